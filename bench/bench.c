@@ -0,0 +1,61 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+void *
+bench_rt_alloc(const void * allocContext, cns_Index size, cns_Error* err)
+{
+    if (size <= 0)
+    {
+        *err = CNS_ERR_BADARG;
+        return 0;
+    }
+    void * rv = malloc(size);
+    *err = rv ? CNS_OK : CNS_ERR_NOMEM;
+    return rv;
+}
+
+void
+bench_rt_free(const void * allocContext, void* ptr, cns_Error* err)
+{
+    free(ptr);
+    *err = CNS_OK;
+}
+
+void *
+bench_rt_realloc(const void * allocContext, void* ptr, cns_Index size, cns_Error* err)
+{
+    if (size <= 0)
+    {
+        *err = CNS_ERR_BADARG;
+        return 0;
+    }
+    void * rv = realloc(ptr, size);
+    *err = rv ? CNS_OK : CNS_ERR_NOMEM;
+    return rv;
+}
+
+cns_Runtime*
+bench_startup(void)
+{
+    return cns_startup(bench_rt_alloc, bench_rt_free, bench_rt_realloc, 0);
+}
+
+double
+bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void
+bench_report(const char * name, double seconds, cns_Index operations, cns_Index bytes)
+{
+    printf("%-48s %12.1f ns/op", name, seconds * 1e9 / (operations ? operations : 1));
+    if (bytes)
+        printf(" %10.1f MB/s", bytes / seconds / (1024.0 * 1024.0));
+    printf("\n");
+}
@@ -0,0 +1,25 @@
+#include <consensual/runtime.h>
+
+void *
+bench_rt_alloc(const void * allocContext, cns_Index size, cns_Error* err);
+
+void
+bench_rt_free(const void * allocContext, void* ptr, cns_Error* err);
+
+void *
+bench_rt_realloc(const void * allocContext, void* ptr, cns_Index size, cns_Error* err);
+
+/** Runtime backed by plain malloc.
+ */
+cns_Runtime*
+bench_startup(void);
+
+/** Monotonic time in seconds.
+ */
+double
+bench_now(void);
+
+/** Prints one result line. `bytes` may be 0 if throughput in bytes makes no sense.
+ */
+void
+bench_report(const char * name, double seconds, cns_Index operations, cns_Index bytes);
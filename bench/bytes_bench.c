@@ -0,0 +1,100 @@
+#include <consensual/bytes.h>
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ITERATIONS 200000
+#define PIECES 64
+
+// a log entry assembled from pieces of various sizes, the way encoders produce it
+static void build_bench(cns_Runtime* cns, cns_Index pieceSize)
+{
+    char* piece = malloc(pieceSize);
+    memset(piece, 'x', pieceSize);
+    char name[64];
+
+    double t = bench_now();
+    for (int i = 0; i < ITERATIONS; ++i)
+    {
+        cns_Index capacity = 64, length = 0;
+        char* buffer = malloc(capacity);
+        for (int j = 0; j < PIECES; ++j)
+        {
+            while (length + pieceSize > capacity)
+                buffer = realloc(buffer, capacity *= 2);
+            memcpy(buffer + length, piece, pieceSize);
+            length += pieceSize;
+        }
+        cns_bytes_free(cns, cns_bytes_new(cns, buffer, length));
+        free(buffer);
+    }
+    t = bench_now() - t;
+    sprintf(name, "own buffer + cns_bytes_new, %ldB pieces", (long) pieceSize);
+    bench_report(name, t, ITERATIONS, (cns_Index) ITERATIONS * PIECES * pieceSize);
+
+    t = bench_now();
+    for (int i = 0; i < ITERATIONS; ++i)
+    {
+        cns_BytesBuilder* builder = cns_bytesbuilder_new(cns, 0);
+        for (int j = 0; j < PIECES; ++j)
+            cns_bytesbuilder_append(cns, builder, piece, pieceSize);
+        cns_bytes_free(cns, cns_bytesbuilder_finish(cns, builder));
+    }
+    t = bench_now() - t;
+    sprintf(name, "cns_BytesBuilder, %ldB pieces", (long) pieceSize);
+    bench_report(name, t, ITERATIONS, (cns_Index) ITERATIONS * PIECES * pieceSize);
+
+    free(piece);
+}
+
+#define BLOB_CHUNKS 64
+#define BLOB_CHUNK (1024 * 1024)
+
+// a blob grown by appending large chunks, as snapshot and batched log payloads are
+static void append_bench(cns_Runtime* cns)
+{
+    char* piece = malloc(BLOB_CHUNK);
+    memset(piece, 'x', BLOB_CHUNK);
+    cns_Bytes* chunk = cns_bytes_new(cns, piece, BLOB_CHUNK);
+
+    double t = bench_now();
+    cns_Bytes* blob = cns_bytes_new(cns, 0, 0);
+    for (int i = 0; i < BLOB_CHUNKS; ++i)
+    {
+        cns_BytesBuilder* builder = cns_bytesbuilder_new(cns, cns_bytes_length(cns, blob) + BLOB_CHUNK);
+        cns_bytesbuilder_append(cns, builder, cns_bytes_ptr(cns, blob), cns_bytes_length(cns, blob));
+        cns_bytesbuilder_append(cns, builder, piece, BLOB_CHUNK);
+        cns_bytes_free(cns, blob);
+        blob = cns_bytesbuilder_finish(cns, builder);
+    }
+    t = bench_now() - t;
+    bench_report("append 1MB by copying", t, BLOB_CHUNKS, (cns_Index) BLOB_CHUNKS * BLOB_CHUNK);
+    cns_bytes_free(cns, blob);
+
+    t = bench_now();
+    blob = cns_bytes_new(cns, 0, 0);
+    for (int i = 0; i < BLOB_CHUNKS; ++i)
+    {
+        cns_Bytes* joined = cns_bytes_concat(cns, blob, chunk);
+        cns_bytes_free(cns, blob);
+        blob = joined;
+    }
+    t = bench_now() - t;
+    bench_report("append 1MB by cns_bytes_concat", t, BLOB_CHUNKS, (cns_Index) BLOB_CHUNKS * BLOB_CHUNK);
+    cns_bytes_free(cns, blob);
+
+    cns_bytes_free(cns, chunk);
+    free(piece);
+}
+
+void bytes_bench(void)
+{
+    cns_Runtime* cns = bench_startup();
+    build_bench(cns, 16);
+    build_bench(cns, 256);
+    append_bench(cns);
+    cns_shutdown(cns);
+}
@@ -0,0 +1,116 @@
+#include <consensual/bytes.h>
+#include <consensual/host.h>
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define PEERS 3
+#define GROUPS 1000
+#define IDLE_TICKS 1000
+#define BUSY_TICKS 200
+
+static double cpuNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static void tickAll(cns_Runtime* cns, cns_Host** hosts, cns_HostNet* net)
+{
+    for (int h = 0; h < PEERS; ++h)
+        cns_host_tick(cns, hosts[h]);
+    cns_hostnet_deliver(cns, net, hosts);
+}
+
+// GROUPS groups on a cluster of PEERS hosts in one process, leaders spread evenly: first idle, then each group taking
+// a one-write batch every tick
+static void cluster_bench(cns_Runtime* cns, int numWorkers)
+{
+    cns_HostNet* net = cns_hostnet_new(cns, PEERS);
+    cns_Host* hosts[PEERS];
+    static cns_Storage* storages[PEERS][GROUPS];
+    for (int h = 0; h < PEERS; ++h)
+    {
+        cns_HostOptions options;
+        cns_hostoptions_default(&options);
+        options.self = h;
+        options.numPeers = PEERS;
+        options.numWorkers = numWorkers;
+        options.send = cns_hostnet_send;
+        options.sendContext = net;
+        hosts[h] = cns_host_new(cns, &options);
+        for (int g = 0; g < GROUPS; ++g)
+        {
+            storages[h][g] = cns_storage_newMemoryStorage(cns, 0);
+            cns_host_addGroup(cns, hosts[h], (uint64_t) g, storages[h][g], g % PEERS);
+        }
+    }
+
+    char name[96];
+    cns_HostStats before, after;
+    for (int t = 0; t < 20; ++t)
+        tickAll(cns, hosts, net);
+    cns_host_stats(cns, hosts[0], &before);
+    double cpu = cpuNow();
+    for (int t = 0; t < IDLE_TICKS; ++t)
+        tickAll(cns, hosts, net);
+    cpu = cpuNow() - cpu;
+    cns_host_stats(cns, hosts[0], &after);
+    snprintf(name, sizeof(name), "idle group tick, CPU, %d workers", numWorkers);
+    bench_report(name, cpu, (cns_Index) PEERS * GROUPS * IDLE_TICKS, 0);
+    printf("    %.2f frames, %.1f messages, %.0f bytes sent per host and tick\n",
+           (double) (after.framesSent - before.framesSent) / IDLE_TICKS,
+           (double) (after.messagesSent - before.messagesSent) / IDLE_TICKS,
+           (double) (after.bytesSent - before.bytesSent) / IDLE_TICKS);
+
+    cns_StorageBatch* batch = cns_storagebatch_new(cns);
+    cns_Bytes* value = cns_bytes_new(cns, "0123456789abcdef0123456789abcdef", 32);
+    uint64_t applied = 0;
+    for (int g = 0; g < GROUPS; ++g)
+        applied += cns_host_appliedIndex(cns, hosts[g % PEERS], (uint64_t) g);
+    double t0 = bench_now();
+    for (int t = 0; t < BUSY_TICKS; ++t)
+    {
+        for (int g = 0; g < GROUPS; ++g)
+        {
+            char key[32];
+            snprintf(key, sizeof(key), "key:%d", t % 64);
+            cns_Bytes* k = cns_bytes_new(cns, key, strlen(key));
+            cns_storagebatch_clear(cns, batch);
+            cns_storagebatch_set(cns, batch, k, value);
+            cns_host_propose(cns, hosts[g % PEERS], (uint64_t) g, batch);
+            cns_bytes_free(cns, k);
+        }
+        tickAll(cns, hosts, net);
+    }
+    double elapsed = bench_now() - t0;
+    uint64_t committed = 0;
+    for (int g = 0; g < GROUPS; ++g)
+        committed += cns_host_appliedIndex(cns, hosts[g % PEERS], (uint64_t) g);
+    committed -= applied;
+    snprintf(name, sizeof(name), "commit, %d groups, %d workers", GROUPS, numWorkers);
+    bench_report(name, elapsed, (cns_Index) committed, 0);
+    printf("    %.0f commits/s over all groups\n", (double) committed / elapsed);
+
+    cns_bytes_free(cns, value);
+    cns_storagebatch_free(cns, batch);
+    for (int h = 0; h < PEERS; ++h)
+    {
+        cns_host_free(cns, hosts[h]);
+        for (int g = 0; g < GROUPS; ++g)
+            cns_storage_free(cns, storages[h][g]);
+    }
+    cns_hostnet_free(cns, net);
+}
+
+void host_bench(void)
+{
+    cns_Runtime* cns = bench_startup();
+    cluster_bench(cns, 1);
+    cluster_bench(cns, 4);
+    cns_shutdown(cns);
+}
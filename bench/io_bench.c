@@ -0,0 +1,102 @@
+#include <consensual/bytes.h>
+#include <consensual/io.h>
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BATCHES 200
+#define ENTRIES 16
+#define ENTRY_SIZE 4096
+
+// stands for applying a batch while the next one is made durable
+static uint64_t work(uint64_t seed)
+{
+    for (int i = 0; i < 200000; ++i)
+        seed = seed * 6364136223846793005u + 1442695040888963407u;
+    return seed;
+}
+
+static int openLog(void)
+{
+    char path[] = "/tmp/cns_iobenchXXXXXX";
+    int fd = mkstemp(path);
+    if (fd >= 0)
+        unlink(path);
+    return fd;
+}
+
+static void bench_blocking(cns_Runtime* cns, cns_Bytes** entries)
+{
+    int fd = openLog();
+    uint64_t seed = 1;
+    double t = bench_now();
+    for (int b = 0; b < BATCHES; ++b)
+    {
+        for (int i = 0; i < ENTRIES; ++i)
+            if (pwrite(fd, cns_bytes_ptr(cns, entries[i]), ENTRY_SIZE, (off_t) (b * ENTRIES + i) * ENTRY_SIZE) != ENTRY_SIZE)
+                abort();
+        fdatasync(fd);
+        seed = work(seed);
+    }
+    t = bench_now() - t;
+    bench_report("write+fdatasync blocking", t, BATCHES, (cns_Index) BATCHES * ENTRIES * ENTRY_SIZE);
+    close(fd);
+    if (seed == 42)
+        printf("%d", (int) seed);
+}
+
+static void bench_queue(cns_Runtime* cns, cns_Bytes** entries, cns_Bool portable)
+{
+    cns_IoOptions options;
+    cns_iooptions_default(&options);
+    options.portable = portable;
+    cns_Io* io = cns_io_new(cns, &options);
+    int fd = openLog();
+    uint64_t seed = 1;
+    cns_IoCompletion completions[ENTRIES + 1];
+
+    double t = bench_now();
+    for (int b = 0; b < BATCHES; ++b)
+    {
+        for (int i = 0; i < ENTRIES; ++i)
+            cns_io_write(cns, io, fd, (int64_t) (b * ENTRIES + i) * ENTRY_SIZE, entries[i], 0, 0);
+        cns_io_fsync(cns, io, fd, CNS_YES, 0, 0);
+        cns_io_submit(cns, io);
+        seed = work(seed);
+        cns_io_poll(cns, io, completions, ENTRIES + 1, ENTRIES + 1);
+    }
+    t = bench_now() - t;
+
+    cns_IoStats stats;
+    cns_io_stats(cns, io, &stats);
+    char name[64];
+    sprintf(name, "write+fdatasync %s", stats.async ? "io_uring" : "fallback");
+    bench_report(name, t, BATCHES, (cns_Index) BATCHES * ENTRIES * ENTRY_SIZE);
+    printf("    %.1f system calls per batch\n", (double) stats.systemCalls / BATCHES);
+    cns_io_free(cns, io);
+    close(fd);
+    if (seed == 42)
+        printf("%d", (int) seed);
+}
+
+void io_bench(void)
+{
+    cns_Runtime* cns = bench_startup();
+    char payload[ENTRY_SIZE];
+    memset(payload, 'w', sizeof(payload));
+    cns_Bytes* entries[ENTRIES];
+    for (int i = 0; i < ENTRIES; ++i)
+        entries[i] = cns_bytes_new(cns, payload, sizeof(payload));
+
+    bench_blocking(cns, entries);
+    bench_queue(cns, entries, CNS_YES);
+    bench_queue(cns, entries, CNS_NO);
+
+    for (int i = 0; i < ENTRIES; ++i)
+        cns_bytes_free(cns, entries[i]);
+    cns_shutdown(cns);
+}
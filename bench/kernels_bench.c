@@ -0,0 +1,83 @@
+#include <consensual/bytes.h>
+#include <consensual/kernels.h>
+#include <consensual/storage.h>
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char * levelNames[] = { "scalar", "sse2", "sse4.2", "avx2" };
+
+void kernels_bench(void)
+{
+    cns_Runtime* cns = bench_startup();
+    cns_Index lengths[] = { 8, 16, 32, 64, 256, 1024, 4096 };
+    char name[64];
+
+    for (int i = 0; i < (int) (sizeof(lengths) / sizeof(lengths[0])); ++i)
+    {
+        cns_Index length = lengths[i];
+        uint8_t* data = malloc(length);
+        for (cns_Index j = 0; j < length; ++j)
+            data[j] = (uint8_t) (j * 31);
+        cns_Bytes* lhs = cns_bytes_new(cns, data, length);
+        cns_Bytes* rhs = cns_bytes_new(cns, data, length);
+        int rounds = (int) (256 * 1024 * 1024 / length);
+        if (rounds > 20000000)
+            rounds = 20000000;
+
+        volatile uint32_t sink = 0;
+        double t = bench_now();
+        for (int r = 0; r < rounds; ++r)
+            sink += cns_storage_jenkinsBytesHash32(cns, lhs);
+        t = bench_now() - t;
+        sprintf(name, "hash jenkins            length=%d", (int) length);
+        bench_report(name, t, rounds, length * rounds);
+
+        for (cns_KernelLevel level = CNS_KERNEL_SCALAR; level <= CNS_KERNEL_AVX2; ++level)
+        {
+            if (!cns_kernels_supported(level) || level == CNS_KERNEL_SSE2 || level == CNS_KERNEL_AVX2)
+                continue; // no CRC-32C code for these levels
+            t = bench_now();
+            for (int r = 0; r < rounds; ++r)
+                sink += cns_kernels_crc32c(level, 0, data, length);
+            t = bench_now() - t;
+            sprintf(name, "hash crc32c %-11s length=%d", levelNames[level], (int) length);
+            bench_report(name, t, rounds, length * rounds);
+        }
+
+        t = bench_now();
+        for (int r = 0; r < rounds; ++r)
+            sink += cns_storage_defaultBytesHash32(cns, lhs);
+        t = bench_now() - t;
+        sprintf(name, "hash default            length=%d", (int) length);
+        bench_report(name, t, rounds, length * rounds);
+
+        t = bench_now();
+        for (int r = 0; r < rounds; ++r)
+            sink += (0 == memcmp(cns_bytes_ptr(cns, lhs), cns_bytes_ptr(cns, rhs), length));
+        t = bench_now() - t;
+        sprintf(name, "equal memcmp            length=%d", (int) length);
+        bench_report(name, t, rounds, length * rounds);
+
+        for (cns_KernelLevel level = CNS_KERNEL_SCALAR; level <= CNS_KERNEL_AVX2; ++level)
+        {
+            if (!cns_kernels_supported(level) || level == CNS_KERNEL_SSE42)
+                continue; // no equality code for this level
+            t = bench_now();
+            for (int r = 0; r < rounds; ++r)
+                sink += cns_kernels_equal(level, cns_bytes_ptr(cns, lhs), cns_bytes_ptr(cns, rhs), length);
+            t = bench_now() - t;
+            sprintf(name, "equal %-17s length=%d", levelNames[level], (int) length);
+            bench_report(name, t, rounds, length * rounds);
+        }
+
+        cns_bytes_free(cns, lhs);
+        cns_bytes_free(cns, rhs);
+        free(data);
+    }
+
+    cns_shutdown(cns);
+}
@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <string.h>
+
+void bytes_bench(void);
+void host_bench(void);
+void io_bench(void);
+void kernels_bench(void);
+void net_bench(void);
+void runtime_bench(void);
+void storage_bench(void);
+void wire_bench(void);
+
+static const struct
+{
+    const char * name;
+    void (*fn)(void);
+} benches[] = {
+    { "bytes", bytes_bench },
+    { "host", host_bench },
+    { "io", io_bench },
+    { "kernels", kernels_bench },
+    { "net", net_bench },
+    { "runtime", runtime_bench },
+    { "storage", storage_bench },
+    { "wire", wire_bench },
+};
+
+// runs every benchmark, or only those whose names are given on the command line
+int main(int argc, char** argv)
+{
+    for (int i = 0; i < (int) (sizeof(benches) / sizeof(benches[0])); ++i)
+    {
+        int selected = (argc < 2);
+        for (int j = 1; j < argc; ++j)
+            selected |= !strcmp(argv[j], benches[i].name);
+        if (!selected)
+            continue;
+
+        printf("== %s\n", benches[i].name);
+        benches[i].fn();
+    }
+    return 0;
+}
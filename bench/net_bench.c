@@ -0,0 +1,148 @@
+#include <consensual/bytes.h>
+#include <consensual/net.h>
+
+#include "bench.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUND_TRIPS 20000
+#define STREAM_BYTES (256 * 1024 * 1024)
+
+// the server end runs its own net on its own thread, as one reactor per core would
+typedef struct Server
+{
+    cns_Net*        net;
+    int             port;
+    cns_Bool        echo;
+    atomic_int      stop;
+    atomic_llong    received;
+} Server;
+
+static void serverMessage(cns_Runtime* cns, void* context, cns_NetConn* conn, cns_Bytes* message)
+{
+    Server* server = (Server*) context;
+    if (server->echo)
+        cns_netconn_send(cns, conn, message);
+    atomic_fetch_add_explicit(&server->received, 1, memory_order_release);
+    cns_bytes_free(cns, message);
+}
+
+static void* serverRun(void* arg)
+{
+    Server* server = (Server*) arg;
+    cns_Runtime* cns = bench_startup();
+    while (!atomic_load_explicit(&server->stop, memory_order_acquire))
+        cns_net_poll(cns, server->net, 1);
+    cns_shutdown(cns);
+    return 0;
+}
+
+typedef struct Client
+{
+    cns_NetConn*    conn;
+    long long       received;
+    cns_Bool        open;
+} Client;
+
+static void clientMessage(cns_Runtime* cns, void* context, cns_NetConn* conn, cns_Bytes* message)
+{
+    (void) conn;
+    ++((Client*) context)->received;
+    cns_bytes_free(cns, message);
+}
+
+static void clientOpen(cns_Runtime* cns, void* context, cns_NetConn* conn)
+{
+    (void) cns;
+    (void) conn;
+    ((Client*) context)->open = CNS_YES;
+}
+
+static void run(cns_Runtime* cns, cns_Bool echo, cns_Index size)
+{
+    Server server;
+    memset(&server, 0, sizeof(server));
+    server.echo = echo;
+    cns_NetOptions options;
+    cns_netoptions_default(&options);
+    options.onMessage = serverMessage;
+    options.context = &server;
+    server.net = cns_net_new(cns, &options);
+    server.port = cns_net_listen(cns, server.net, "127.0.0.1", 0);
+    pthread_t thread;
+    pthread_create(&thread, 0, serverRun, &server);
+
+    Client client;
+    memset(&client, 0, sizeof(client));
+    options.onMessage = clientMessage;
+    options.onOpen = clientOpen;
+    options.context = &client;
+    cns_Net* net = cns_net_new(cns, &options);
+    client.conn = cns_net_connect(cns, net, "127.0.0.1", server.port);
+    while (!client.open)
+        cns_net_poll(cns, net, 10);
+
+    char* data = malloc((size_t) size);
+    memset(data, 'x', (size_t) size);
+    cns_Bytes* message = cns_bytes_new(cns, data, size);
+    free(data);
+    char name[96];
+    if (echo)
+    {
+        double t0 = bench_now();
+        for (int i = 0; i < ROUND_TRIPS; ++i)
+        {
+            cns_netconn_send(cns, client.conn, message);
+            while (client.received <= i)
+                cns_net_poll(cns, net, -1);
+        }
+        double elapsed = bench_now() - t0;
+        snprintf(name, sizeof(name), "round trip, %ld-byte messages", (long) size);
+        bench_report(name, elapsed, ROUND_TRIPS, 2 * ROUND_TRIPS * size);
+    }
+    else
+    {
+        long long count = STREAM_BYTES / size;
+        double t0 = bench_now();
+        for (long long i = 0; i < count; )
+        {
+            // the poll writes the queue out before it waits, and may then have nothing left to wait for
+            if (cns_netconn_send_r(cns, client.conn, message) == CNS_ERR_BUSY)
+                cns_net_poll(cns, net, 0);
+            else
+                ++i;
+        }
+        while (cns_netconn_queued(cns, client.conn))
+            cns_net_poll(cns, net, 1);
+        while (atomic_load_explicit(&server.received, memory_order_acquire) < count)
+            sched_yield();
+        double elapsed = bench_now() - t0;
+        cns_NetStats stats;
+        cns_net_stats(cns, net, &stats);
+        snprintf(name, sizeof(name), "stream, %ld-byte messages", (long) size);
+        bench_report(name, elapsed, (cns_Index) count, (cns_Index) (count * size));
+        printf("    %.1f messages per sendmsg\n", (double) stats.messagesSent / (double) stats.writeCalls);
+    }
+
+    cns_bytes_free(cns, message);
+    cns_net_free(cns, net);
+    atomic_store_explicit(&server.stop, 1, memory_order_release);
+    pthread_join(thread, 0);
+    cns_net_free(cns, server.net);
+}
+
+void net_bench(void)
+{
+    cns_Runtime* cns = bench_startup();
+    run(cns, CNS_YES, 64);
+    run(cns, CNS_YES, 4096);
+    run(cns, CNS_NO, 64);
+    run(cns, CNS_NO, 1024);
+    run(cns, CNS_NO, 64 * 1024);
+    cns_shutdown(cns);
+}
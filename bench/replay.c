@@ -0,0 +1,380 @@
+#include <consensual/bytes.h>
+#include <consensual/storage.h>
+#include <consensual/lsmstorage.h>
+#include <consensual/trace.h>
+
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Replays a trace written by cns_trace_start against a fresh storage and reports throughput and latencies.
+//
+//   runreplay [-t threads] [-e memory|lsm] [-d directory] trace
+//
+// Records are replayed as fast as they go, not at their recorded pace. With several threads, each takes the records
+// whose key hashes fall to it, in trace order, so that the operations on one key keep their order. Storages take one
+// writer at a time: memory storages let gets run together under a read lock, LSM storages run one operation at a time.
+// Keys and values the trace left out are made up from the key hash and the recorded lengths. Keys first read or deleted
+// as present are set before the clock starts.
+
+#define BUCKETS 64
+#define MAXTHREADS 64
+
+typedef struct Op
+{
+    int         op;
+    cns_Bool    hit;
+    uint64_t    duration;
+    uint64_t    keyHash;
+    cns_Bytes*  key;
+    cns_Bytes*  value;
+} Op;
+
+typedef struct Histogram
+{
+    uint64_t    counts[BUCKETS];
+    uint64_t    total;
+} Histogram;
+
+typedef struct Replay
+{
+    cns_Runtime*        cns;
+    cns_Storage*        storage;
+    cns_Bool            sharedGets;
+    pthread_rwlock_t    lock;
+    Op*                 ops;
+    cns_Index           count;
+    int                 threads;
+} Replay;
+
+typedef struct ReplayThread
+{
+    Replay*     replay;
+    int         index;
+    Histogram   latencies[4];
+    uint64_t    failed;
+} ReplayThread;
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static int bucketOf(uint64_t ns)
+{
+    int bucket = 0;
+    while (ns > 1 && bucket < BUCKETS - 1)
+    {
+        ns >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+static void histogramAdd(Histogram* histogram, uint64_t ns)
+{
+    ++histogram->counts[bucketOf(ns)];
+    ++histogram->total;
+}
+
+// upper bound of the bucket holding the given fraction of the samples
+static uint64_t histogramPercentile(const Histogram* histogram, double fraction)
+{
+    uint64_t rank = (uint64_t) (histogram->total * fraction);
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; ++i)
+    {
+        seen += histogram->counts[i];
+        if (seen > rank)
+            return (uint64_t) 2 << i;
+    }
+    return (uint64_t) 2 << (BUCKETS - 1);
+}
+
+// the key as traced, or failing that one of the traced length made from its hash
+static cns_Bytes* makeKey(cns_Runtime* cns, cns_TraceRecord* record)
+{
+    if (record->key)
+    {
+        cns_Bytes* key = record->key;
+        record->key = 0;
+        return key;
+    }
+    uint8_t buf[256];
+    uint8_t* data = record->keyLength <= (cns_Index) sizeof(buf) ? buf : (uint8_t*) malloc(record->keyLength);
+    for (cns_Index i = 0; i < record->keyLength; ++i)
+        data[i] = (uint8_t) (record->keyHash >> (8 * (i % 8)));
+    cns_Bytes* key = cns_bytes_new(cns, data, record->keyLength);
+    if (data != buf)
+        free(data);
+    return key;
+}
+
+// a slice of `filler`, grown as needed, so that made-up values share one block
+static cns_Bytes* makeValue(cns_Runtime* cns, cns_Bytes** filler, cns_Index length)
+{
+    if (cns_bytes_length(cns, *filler) < length)
+    {
+        void* data = calloc(1, length);
+        cns_bytes_free(cns, *filler);
+        *filler = cns_bytes_new(cns, data, length);
+        free(data);
+    }
+    return cns_bytes_slice(cns, *filler, 0, length);
+}
+
+static void* replayMain(void* arg)
+{
+    ReplayThread* t = (ReplayThread*) arg;
+    Replay* replay = t->replay;
+    cns_Runtime* cns = replay->cns;
+    for (cns_Index i = 0; i < replay->count; ++i)
+    {
+        Op* op = &replay->ops[i];
+        if ((int) (op->keyHash % (uint64_t) replay->threads) != t->index)
+            continue;
+
+        cns_Error err = CNS_OK;
+        uint64_t start = nowNs();
+        if (op->op == CNS_TRACE_GET && replay->sharedGets)
+            pthread_rwlock_rdlock(&replay->lock);
+        else
+            pthread_rwlock_wrlock(&replay->lock);
+        switch (op->op)
+        {
+        case CNS_TRACE_SET:
+            err = cns_storage_set_r(cns, replay->storage, op->key, op->value);
+            break;
+        case CNS_TRACE_GET:
+        {
+            cns_Bytes* value = 0;
+            err = cns_storage_get_r(cns, replay->storage, op->key, &value);
+            if (value)
+                cns_bytes_free(cns, value);
+            break;
+        }
+        case CNS_TRACE_DELETE:
+        {
+            cns_Bool existed = CNS_NO;
+            err = cns_storage_delete_r(cns, replay->storage, op->key, &existed);
+            break;
+        }
+        }
+        pthread_rwlock_unlock(&replay->lock);
+        histogramAdd(&t->latencies[op->op], nowNs() - start);
+        if (err != CNS_OK)
+            ++t->failed;
+    }
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: runreplay [-t threads] [-e memory|lsm] [-d directory] trace\n");
+    exit(2);
+}
+
+static void removeDirectory(const char * path)
+{
+    char command[4096];
+    snprintf(command, sizeof(command), "rm -rf '%s'", path);
+    if (system(command) != 0)
+        fprintf(stderr, "could not remove %s\n", path);
+}
+
+int main(int argc, char** argv)
+{
+    int threads = 1;
+    const char * engine = "memory";
+    const char * directory = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:e:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'e':
+            engine = optarg;
+            break;
+        case 'd':
+            directory = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1 || threads < 1 || threads > MAXTHREADS)
+        usage();
+
+    cns_Runtime* cns = bench_startup();
+    cns_TraceReader* reader = cns_tracereader_open(cns, argv[optind]);
+    if (!reader)
+    {
+        fprintf(stderr, "cannot read %s: error %d\n", argv[optind], cns_lasterr(cns));
+        return 1;
+    }
+
+    Replay replay;
+    memset(&replay, 0, sizeof(replay));
+    replay.cns = cns;
+    replay.threads = threads;
+    pthread_rwlock_init(&replay.lock, 0);
+
+    // load the whole trace up front, so that reading it is not timed
+    cns_Index capacity = 0;
+    Histogram recorded[4];
+    memset(recorded, 0, sizeof(recorded));
+    cns_Bytes* filler = cns_bytes_new(cns, 0, 0);
+    cns_TraceRecord record;
+    while (cns_tracereader_next(cns, reader, &record))
+    {
+        if (record.op < CNS_TRACE_SET || record.op > CNS_TRACE_DELETE)
+        {
+            if (record.key)
+                cns_bytes_free(cns, record.key);
+            if (record.value)
+                cns_bytes_free(cns, record.value);
+            continue;
+        }
+        if (replay.count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 4096;
+            replay.ops = (Op*) realloc(replay.ops, capacity * sizeof(Op));
+        }
+        Op* op = &replay.ops[replay.count++];
+        op->op = record.op;
+        op->hit = record.hit;
+        op->duration = record.duration;
+        op->keyHash = record.keyHash;
+        op->key = makeKey(cns, &record);
+        op->value = 0;
+        if (record.op == CNS_TRACE_SET)
+            op->value = record.value ? record.value : makeValue(cns, &filler, record.valueLength);
+        else if (record.op == CNS_TRACE_GET && record.hit)
+            op->value = makeValue(cns, &filler, record.valueLength);
+        histogramAdd(&recorded[record.op], record.duration);
+    }
+    if (cns_lasterr(cns) != CNS_OK)
+        fprintf(stderr, "trace is damaged; replaying the %lld records before the damage\n", (long long) replay.count);
+    cns_tracereader_close(cns, reader);
+
+    char temporary[] = "/tmp/cns_replayXXXXXX";
+    if (!strcmp(engine, "memory"))
+    {
+        replay.storage = cns_storage_newMemoryStorage(cns, 0);
+        replay.sharedGets = CNS_YES;
+    }
+    else if (!strcmp(engine, "lsm"))
+    {
+        if (!directory)
+            directory = mkdtemp(temporary);
+        replay.storage = directory ? cns_storage_newLsmStorage(cns, directory, 0) : 0;
+    }
+    else
+        usage();
+    if (!replay.storage)
+    {
+        fprintf(stderr, "cannot open the %s storage: error %d\n", engine, cns_lasterr(cns));
+        return 1;
+    }
+
+    // keys which the trace finds before it sets them were there before it started
+    cns_Storage* seen = cns_storage_newMemoryStorage(cns, 0);
+    cns_Index prefilled = 0;
+    for (cns_Index i = 0; i < replay.count; ++i)
+    {
+        Op* op = &replay.ops[i];
+        cns_Bytes* known = cns_storage_get(cns, seen, op->key);
+        if (known)
+        {
+            cns_bytes_free(cns, known);
+            continue;
+        }
+        cns_storage_set(cns, seen, op->key, filler);
+        if (op->hit && op->op != CNS_TRACE_SET)
+        {
+            cns_Bytes* value = op->value ? cns_bytes_copy(cns, op->value) : makeValue(cns, &filler, 16);
+            cns_storage_set(cns, replay.storage, op->key, value);
+            cns_bytes_free(cns, value);
+            ++prefilled;
+        }
+        if (op->op == CNS_TRACE_GET && op->value)
+        {
+            cns_bytes_free(cns, op->value);
+            op->value = 0;
+        }
+    }
+    cns_storage_free(cns, seen);
+
+    ReplayThread* workers = (ReplayThread*) calloc(threads, sizeof(ReplayThread));
+    pthread_t handles[MAXTHREADS];
+    double t = bench_now();
+    for (int i = 0; i < threads; ++i)
+    {
+        workers[i].replay = &replay;
+        workers[i].index = i;
+        if (threads == 1)
+            replayMain(&workers[i]);
+        else
+            pthread_create(&handles[i], 0, replayMain, &workers[i]);
+    }
+    if (threads > 1)
+        for (int i = 0; i < threads; ++i)
+            pthread_join(handles[i], 0);
+    t = bench_now() - t;
+
+    printf("replayed %lld operations on %s storage, %d thread(s), %lld keys prefilled\n",
+           (long long) replay.count, engine, threads, (long long) prefilled);
+    bench_report("replay", t, replay.count, 0);
+    printf("%-8s %10s %10s %10s %10s %12s %12s\n", "op", "count", "p50 ns", "p99 ns", "p99.9 ns", "traced p50", "traced p99");
+    static const char * names[] = { 0, "set", "get", "delete" };
+    uint64_t failed = 0;
+    for (int op = CNS_TRACE_SET; op <= CNS_TRACE_DELETE; ++op)
+    {
+        Histogram merged;
+        memset(&merged, 0, sizeof(merged));
+        for (int i = 0; i < threads; ++i)
+        {
+            for (int b = 0; b < BUCKETS; ++b)
+                merged.counts[b] += workers[i].latencies[op].counts[b];
+            merged.total += workers[i].latencies[op].total;
+        }
+        if (!merged.total)
+            continue;
+        printf("%-8s %10llu %10llu %10llu %10llu %12llu %12llu\n", names[op], (unsigned long long) merged.total,
+               (unsigned long long) histogramPercentile(&merged, 0.5),
+               (unsigned long long) histogramPercentile(&merged, 0.99),
+               (unsigned long long) histogramPercentile(&merged, 0.999),
+               (unsigned long long) histogramPercentile(&recorded[op], 0.5),
+               (unsigned long long) histogramPercentile(&recorded[op], 0.99));
+    }
+    for (int i = 0; i < threads; ++i)
+        failed += workers[i].failed;
+    if (failed)
+        printf("%llu operations failed\n", (unsigned long long) failed);
+
+    for (cns_Index i = 0; i < replay.count; ++i)
+    {
+        cns_bytes_free(cns, replay.ops[i].key);
+        if (replay.ops[i].value)
+            cns_bytes_free(cns, replay.ops[i].value);
+    }
+    free(replay.ops);
+    free(workers);
+    cns_bytes_free(cns, filler);
+    cns_storage_free(cns, replay.storage);
+    if (directory == temporary)
+        removeDirectory(temporary);
+    pthread_rwlock_destroy(&replay.lock);
+    cns_shutdown(cns);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,127 @@
+#include <consensual/bytes.h>
+
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdio.h>
+
+#define ITERATIONS 20000000
+#define MAXTHREADS 8
+
+enum { MODE_SHARED, MODE_LASTERR, MODE_R };
+
+typedef struct BenchThread
+{
+    cns_Runtime*    cns;
+    int             mode;
+    cns_Index       sum;
+} BenchThread;
+
+// what every call used to do: store the error into the runtime, one cache line for all threads
+static volatile cns_Error sharedLastError;
+
+#define ALLOC_ITERATIONS 2000000
+
+// small bytes objects made and dropped, as a storage under churn does; the allocation profile counts each of them
+static void* alloc_main(void* arg)
+{
+    BenchThread* t = (BenchThread*) arg;
+    cns_Index sum = 0;
+    for (int i = 0; i < ALLOC_ITERATIONS; ++i)
+    {
+        cns_Bytes* bytes = cns_bytes_new(t->cns, "0123456789abcdef0123456789abcdef", 1 + i % 32);
+        sum += cns_bytes_length(t->cns, bytes);
+        cns_bytes_free(t->cns, bytes);
+    }
+    t->sum = sum;
+    return 0;
+}
+
+static void* thread_main(void* arg)
+{
+    BenchThread* t = (BenchThread*) arg;
+    cns_Bytes* bytes = cns_bytes_new(t->cns, "0123456789abcdef", 16);
+    cns_Index sum = 0;
+    for (int i = 0; i < ITERATIONS; ++i)
+    {
+        cns_Index length = 0;
+        switch (t->mode)
+        {
+        case MODE_SHARED:
+            cns_bytes_length_r(t->cns, bytes, &length);
+            sharedLastError = CNS_OK;
+            break;
+        case MODE_LASTERR:
+            length = cns_bytes_length(t->cns, bytes);
+            break;
+        case MODE_R:
+            cns_bytes_length_r(t->cns, bytes, &length);
+            break;
+        }
+        sum += length;
+    }
+    cns_bytes_free(t->cns, bytes);
+    t->sum = sum;
+    return 0;
+}
+
+void runtime_bench(void)
+{
+    static const char * modeNames[] = { "shared lastError", "per-thread lastError", "_r" };
+    cns_Runtime* cns = bench_startup();
+
+    for (int numThreads = 1; numThreads <= MAXTHREADS; numThreads *= 2)
+    {
+        for (int mode = MODE_SHARED; mode <= MODE_R; ++mode)
+        {
+            pthread_t threads[MAXTHREADS];
+            BenchThread args[MAXTHREADS];
+
+            double t = bench_now();
+            for (int i = 0; i < numThreads; ++i)
+            {
+                args[i].cns = cns;
+                args[i].mode = mode;
+                pthread_create(&threads[i], 0, thread_main, &args[i]);
+            }
+            for (int i = 0; i < numThreads; ++i)
+                pthread_join(threads[i], 0);
+            t = bench_now() - t;
+
+            char name[64];
+            sprintf(name, "bytes_length %-22s threads=%d", modeNames[mode], numThreads);
+            bench_report(name, t, (cns_Index) ITERATIONS * numThreads, 0);
+        }
+    }
+
+    for (int numThreads = 1; numThreads <= MAXTHREADS; numThreads *= 2)
+    {
+        pthread_t threads[MAXTHREADS];
+        BenchThread args[MAXTHREADS];
+        double t = bench_now();
+        for (int i = 0; i < numThreads; ++i)
+        {
+            args[i].cns = cns;
+            pthread_create(&threads[i], 0, alloc_main, &args[i]);
+        }
+        for (int i = 0; i < numThreads; ++i)
+            pthread_join(threads[i], 0);
+        t = bench_now() - t;
+
+        char name[64];
+        sprintf(name, "bytes_new + bytes_free threads=%d", numThreads);
+        bench_report(name, t, (cns_Index) ALLOC_ITERATIONS * numThreads, 0);
+    }
+
+    cns_AllocProfile profile;
+    cns_runtime_allocProfile(cns, &profile);
+    printf("allocation profile %s\n", profile.instrumented ? "(CNS_ALLOC_PROFILE)" : "not collected, build with CNS_ALLOC_PROFILE");
+    if (profile.instrumented)
+    {
+        char text[4096];
+        cns_allocprofile_format(&profile, text, sizeof(text));
+        printf("%s", text);
+    }
+
+    cns_shutdown(cns);
+}
@@ -0,0 +1,749 @@
+#include <consensual/bytes.h>
+#include <consensual/storage.h>
+#include <consensual/u64storage.h>
+#include <consensual/lsmstorage.h>
+#include <consensual/blockcache.h>
+#include <consensual/snapshotstream.h>
+#include <consensual/watch.h>
+#include <consensual/hotkeys.h>
+
+#include "bench.h"
+
+#include <pthread.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#define KEYS 100000
+#define UPDATES 1000000
+
+static cns_Bytes* makeKey(cns_Runtime* cns, int i)
+{
+    char buf[32];
+    sprintf(buf, "counter:%08d", i);
+    return cns_bytes_new(cns, buf, strlen(buf));
+}
+
+static cns_Bytes* counterValue(cns_Runtime* cns, uint64_t counter)
+{
+    return cns_bytes_new(cns, &counter, sizeof(counter));
+}
+
+static uint64_t counterOf(cns_Runtime* cns, cns_Bytes* value)
+{
+    uint64_t counter = 0;
+    if (value)
+        memcpy(&counter, cns_bytes_ptr(cns, value), sizeof(counter));
+    return counter;
+}
+
+static cns_Bytes* increment(cns_Runtime* cns, cns_Bytes* key, cns_Bytes* current, void* context)
+{
+    return counterValue(cns, counterOf(cns, current) + 1);
+}
+
+static void counters_bench(cns_Runtime* cns)
+{
+    cns_Bytes* keys[KEYS];
+    for (int i = 0; i < KEYS; ++i)
+        keys[i] = makeKey(cns, i);
+
+    cns_Storage* storage = cns_storage_newMemoryStorage(cns, 0);
+    double t = bench_now();
+    for (int i = 0; i < UPDATES; ++i)
+    {
+        cns_Bytes* key = keys[(unsigned) i * 7919u % KEYS];
+        cns_Bytes* current = cns_storage_get(cns, storage, key);
+        cns_Bytes* value = counterValue(cns, counterOf(cns, current) + 1);
+        cns_storage_set(cns, storage, key, value);
+        cns_bytes_free(cns, value);
+        if (current)
+            cns_bytes_free(cns, current);
+    }
+    t = bench_now() - t;
+    bench_report("counter increment get+set", t, UPDATES, 0);
+    cns_storage_free(cns, storage);
+
+    storage = cns_storage_newMemoryStorage(cns, 0);
+    t = bench_now();
+    for (int i = 0; i < UPDATES; ++i)
+        cns_storage_upsert(cns, storage, keys[(unsigned) i * 7919u % KEYS], increment, 0);
+    t = bench_now() - t;
+    bench_report("counter increment upsert", t, UPDATES, 0);
+    cns_storage_free(cns, storage);
+
+    for (int i = 0; i < KEYS; ++i)
+        cns_bytes_free(cns, keys[i]);
+}
+
+#define BULK 1000000
+
+static void bulk_bench(cns_Runtime* cns)
+{
+    cns_Bytes** keys = malloc(BULK * sizeof(cns_Bytes*));
+    for (int i = 0; i < BULK; ++i)
+        keys[i] = makeKey(cns, i);
+
+    cns_Storage* storage = cns_storage_newMemoryStorage(cns, 0);
+    double t = bench_now();
+    for (int i = 0; i < BULK; ++i)
+        cns_storage_set(cns, storage, keys[i], keys[i]);
+    t = bench_now() - t;
+    bench_report("build by set", t, BULK, 0);
+    cns_storage_free(cns, storage);
+
+    storage = cns_storage_newMemoryStorageWithCapacity(cns, 0, BULK);
+    t = bench_now();
+    for (int i = 0; i < BULK; ++i)
+        cns_storage_set(cns, storage, keys[i], keys[i]);
+    t = bench_now() - t;
+    bench_report("build by set, presized", t, BULK, 0);
+    cns_storage_free(cns, storage);
+
+    static const int threads[] = { 1, 2, 4, 8 };
+    for (int i = 0; i < (int) (sizeof(threads) / sizeof(threads[0])); ++i)
+    {
+        char name[64];
+        sprintf(name, "build by bulkSet, %d threads", threads[i]);
+        storage = cns_storage_newMemoryStorage(cns, 0);
+        t = bench_now();
+        cns_storage_bulkSet(cns, storage, keys, keys, BULK, threads[i]);
+        t = bench_now() - t;
+        bench_report(name, t, BULK, 0);
+        cns_storage_free(cns, storage);
+    }
+
+    for (int i = 0; i < BULK; ++i)
+        cns_bytes_free(cns, keys[i]);
+    free(keys);
+}
+
+#define DISTINCT_VALUES 1000
+
+// values decoded from input: a few distinct ones repeated over many keys
+static void interning_bench(cns_Runtime* cns)
+{
+    cns_Bytes** keys = malloc(BULK * sizeof(cns_Bytes*));
+    for (int i = 0; i < BULK; ++i)
+        keys[i] = makeKey(cns, i);
+
+    char value[48];
+    memset(value, 'v', sizeof(value));
+
+    cns_Storage* storage = cns_storage_newMemoryStorageWithCapacity(cns, 0, BULK);
+    double t = bench_now();
+    for (int i = 0; i < BULK; ++i)
+    {
+        sprintf(value, "%08d", i % DISTINCT_VALUES);
+        cns_Bytes* bytes = cns_bytes_new(cns, value, sizeof(value));
+        cns_storage_set(cns, storage, keys[i], bytes);
+        cns_bytes_free(cns, bytes);
+    }
+    t = bench_now() - t;
+    bench_report("set decoded values", t, BULK, 0);
+    cns_storage_free(cns, storage);
+
+    storage = cns_storage_newMemoryStorageWithCapacity(cns, 0, BULK);
+    t = bench_now();
+    for (int i = 0; i < BULK; ++i)
+    {
+        sprintf(value, "%08d", i % DISTINCT_VALUES);
+        cns_Bytes* bytes = cns_storage_intern(cns, storage, value, sizeof(value));
+        cns_storage_set(cns, storage, keys[i], bytes);
+        cns_bytes_free(cns, bytes);
+    }
+    t = bench_now() - t;
+    bench_report("set decoded values, interned", t, BULK, 0);
+    cns_StorageStats stats;
+    cns_storage_stats(cns, storage, &stats);
+    printf("    %ld distinct values, %ld bytes saved\n", (long) stats.internedCount, (long) stats.internSavedBytes);
+    cns_storage_free(cns, storage);
+
+    for (int i = 0; i < BULK; ++i)
+        cns_bytes_free(cns, keys[i]);
+    free(keys);
+}
+
+// 64-bit ids as 8-byte Bytes keys against the unboxed integer table
+static void u64keys_bench(cns_Runtime* cns)
+{
+    cns_Bytes** keys = malloc(BULK * sizeof(cns_Bytes*));
+    for (int i = 0; i < BULK; ++i)
+    {
+        uint64_t id = (uint64_t) i * 0x9e3779b97f4a7c15ULL;
+        keys[i] = cns_bytes_new(cns, &id, sizeof(id));
+    }
+    cns_Bytes* value = counterValue(cns, 1);
+
+    cns_Storage* storage = cns_storage_newMemoryStorage(cns, 0);
+    double t = bench_now();
+    for (int i = 0; i < BULK; ++i)
+        cns_storage_set(cns, storage, keys[i], value);
+    t = bench_now() - t;
+    bench_report("u64 ids as Bytes, set", t, BULK, 0);
+    t = bench_now();
+    for (int i = 0; i < BULK; ++i)
+        cns_bytes_free(cns, cns_storage_get(cns, storage, keys[(unsigned) i * 7919u % BULK]));
+    t = bench_now() - t;
+    bench_report("u64 ids as Bytes, get", t, BULK, 0);
+    cns_storage_free(cns, storage);
+
+    cns_U64Storage* u64storage = cns_u64storage_new(cns, 0);
+    t = bench_now();
+    for (int i = 0; i < BULK; ++i)
+        cns_u64storage_set(cns, u64storage, (uint64_t) i * 0x9e3779b97f4a7c15ULL, value);
+    t = bench_now() - t;
+    bench_report("u64 ids unboxed, set", t, BULK, 0);
+    t = bench_now();
+    for (int i = 0; i < BULK; ++i)
+        cns_bytes_free(cns, cns_u64storage_get(cns, u64storage, (uint64_t) ((unsigned) i * 7919u % BULK) * 0x9e3779b97f4a7c15ULL));
+    t = bench_now() - t;
+    bench_report("u64 ids unboxed, get", t, BULK, 0);
+    cns_u64storage_free(cns, u64storage);
+
+    cns_bytes_free(cns, value);
+    for (int i = 0; i < BULK; ++i)
+        cns_bytes_free(cns, keys[i]);
+    free(keys);
+}
+
+#define DOCUMENTS 10000
+#define DOCUMENT_GETS 200000
+
+// JSON-like documents of 1 to 64 KB, stored as they are and compressed, read with a skew towards a few hot keys
+static void compression_bench(cns_Runtime* cns)
+{
+    cns_Bytes** keys = malloc(DOCUMENTS * sizeof(cns_Bytes*));
+    cns_Bytes** documents = malloc(DOCUMENTS * sizeof(cns_Bytes*));
+    char* buf = malloc(70000);
+    cns_Index totalBytes = 0;
+    for (int i = 0; i < DOCUMENTS; ++i)
+    {
+        keys[i] = makeKey(cns, i);
+        int length = 1024 << (i % 7), n = 0;
+        for (int field = 0; n < length; ++field)
+            n += sprintf(buf + n, "{\"id\":%d,\"seq\":%d,\"owner\":\"user%d\",\"state\":\"%s\"},", i, field,
+                         (i * 131 + field) % 977, field % 3 ? "active" : "archived");
+        documents[i] = cns_bytes_new(cns, buf, length);
+        totalBytes += length;
+    }
+    free(buf);
+
+    static const struct { const char * name; cns_Index threshold; cns_Index cachedValues; } modes[] = {
+        { "documents", 0, 0 },
+        { "documents, compressed", 1024, 0 },
+        { "documents, compressed and cached", 1024, 256 },
+    };
+    for (int mode = 0; mode < (int) (sizeof(modes) / sizeof(modes[0])); ++mode)
+    {
+        cns_Storage* storage = cns_storage_newMemoryStorageWithCapacity(cns, 0, DOCUMENTS);
+        cns_storage_setCompression(cns, storage, modes[mode].threshold, modes[mode].cachedValues);
+        char name[64];
+        double t = bench_now();
+        for (int i = 0; i < DOCUMENTS; ++i)
+            cns_storage_set(cns, storage, keys[i], documents[i]);
+        t = bench_now() - t;
+        sprintf(name, "%s, set", modes[mode].name);
+        bench_report(name, t, DOCUMENTS, totalBytes);
+
+        // nine in ten gets go to a hundred keys
+        t = bench_now();
+        for (int i = 0; i < DOCUMENT_GETS; ++i)
+        {
+            int k = i % 10 ? (int) ((unsigned) i * 2654435761u % 100) : (int) ((unsigned) i * 40503u % DOCUMENTS);
+            cns_bytes_free(cns, cns_storage_get(cns, storage, keys[k]));
+        }
+        t = bench_now() - t;
+        sprintf(name, "%s, get", modes[mode].name);
+        bench_report(name, t, DOCUMENT_GETS, 0);
+
+        cns_StorageStats stats;
+        cns_storage_stats(cns, storage, &stats);
+        if (stats.compressedCount)
+            printf("    %ld of %d compressed, ratio %.2f\n", (long) stats.compressedCount, DOCUMENTS,
+                   (double) stats.uncompressedBytes / (double) stats.compressedBytes);
+        cns_storage_free(cns, storage);
+    }
+
+    for (int i = 0; i < DOCUMENTS; ++i)
+    {
+        cns_bytes_free(cns, documents[i]);
+        cns_bytes_free(cns, keys[i]);
+    }
+    free(documents);
+    free(keys);
+}
+
+#define BATCH_WRITES 1000000
+#define BATCH_SIZE 16
+
+// updates to KEYS keys, one set at a time and in batches, then in batches while a view is pinned for every 1000 of them
+static void batch_bench(cns_Runtime* cns)
+{
+    cns_Bytes** keys = malloc(KEYS * sizeof(cns_Bytes*));
+    for (int i = 0; i < KEYS; ++i)
+        keys[i] = makeKey(cns, i);
+    cns_Bytes* value = cns_bytes_new(cns, "0123456789abcdef0123456789abcdef", 32);
+
+    for (int mode = 0; mode < 3; ++mode)
+    {
+        cns_Storage* storage = cns_storage_newMemoryStorageWithCapacity(cns, 0, KEYS);
+        cns_StorageBatch* batch = cns_storagebatch_new(cns);
+        cns_StorageView* view = 0;
+        cns_StorageStats stats;
+        memset(&stats, 0, sizeof(stats));
+        double t = bench_now();
+        for (int i = 0; i < BATCH_WRITES; i += BATCH_SIZE)
+        {
+            if (mode == 2 && i % 1000 < BATCH_SIZE)
+            {
+                if (view)
+                    cns_storage_unpin(cns, view);
+                view = cns_storage_pin(cns, storage);
+            }
+            for (int j = 0; j < BATCH_SIZE; ++j)
+            {
+                cns_Bytes* key = keys[(unsigned) (i + j) * 2654435761u % KEYS];
+                if (mode == 0)
+                    cns_storage_set(cns, storage, key, value);
+                else
+                    cns_storagebatch_set(cns, batch, key, value);
+            }
+            if (mode != 0)
+            {
+                cns_storage_apply(cns, storage, batch);
+                cns_storagebatch_clear(cns, batch);
+            }
+        }
+        if (view)
+        {
+            cns_storage_stats(cns, storage, &stats);
+            cns_storage_unpin(cns, view);
+        }
+        t = bench_now() - t;
+        static const char * const names[] = { "writes, one at a time", "writes, in batches of 16", "writes, in batches of 16, views pinned" };
+        bench_report(names[mode], t, BATCH_WRITES, 0);
+        if (mode == 2)
+            printf("    %d versions kept at the end\n", (int) stats.retainedVersions);
+        cns_storagebatch_free(cns, batch);
+        cns_storage_free(cns, storage);
+    }
+
+    cns_bytes_free(cns, value);
+    for (int i = 0; i < KEYS; ++i)
+        cns_bytes_free(cns, keys[i]);
+    free(keys);
+}
+
+#define APPLY_WRITES 1000000
+#define APPLY_GROUP 256
+#define APPLY_HOTKEYS 16
+
+// batches of BATCH_SIZE updates to KEYS keys, applied APPLY_GROUP at a time, one by one and then on several threads; a
+// share of the writes goes to a few hot keys, so that more and more of them conflict
+static void apply_bench(cns_Runtime* cns)
+{
+    cns_Bytes** keys = malloc(KEYS * sizeof(cns_Bytes*));
+    for (int i = 0; i < KEYS; ++i)
+        keys[i] = makeKey(cns, i);
+    cns_Bytes* value = cns_bytes_new(cns, "0123456789abcdef0123456789abcdef", 32);
+    cns_StorageBatch* batches[APPLY_GROUP];
+    for (int b = 0; b < APPLY_GROUP; ++b)
+        batches[b] = cns_storagebatch_new(cns);
+
+    static const int hotPercents[] = { 0, 10, 50, 90 };
+    static const int threadCounts[] = { 1, 2, 4, 8 };
+    for (size_t h = 0; h < sizeof(hotPercents) / sizeof(hotPercents[0]); ++h)
+    {
+        for (size_t c = 0; c < sizeof(threadCounts) / sizeof(threadCounts[0]); ++c)
+        {
+            cns_Storage* storage = cns_storage_newMemoryStorageWithCapacity(cns, 0, KEYS);
+            unsigned seed = 1;
+            double elapsed = 0;
+            for (int i = 0; i < APPLY_WRITES; i += APPLY_GROUP * BATCH_SIZE)
+            {
+                for (int b = 0; b < APPLY_GROUP; ++b)
+                {
+                    cns_storagebatch_clear(cns, batches[b]);
+                    for (int j = 0; j < BATCH_SIZE; ++j)
+                    {
+                        seed = seed * 1103515245 + 12345;
+                        unsigned k = seed >> 8;
+                        int hot = (int) (k % 100) < hotPercents[h];
+                        cns_storagebatch_set(cns, batches[b], keys[hot ? k % APPLY_HOTKEYS : k % KEYS], value);
+                    }
+                }
+                double t = bench_now();
+                if (threadCounts[c] == 1)
+                {
+                    for (int b = 0; b < APPLY_GROUP; ++b)
+                        cns_storage_apply(cns, storage, batches[b]);
+                }
+                else
+                    cns_storage_applyBatches(cns, storage, batches, APPLY_GROUP, threadCounts[c]);
+                elapsed += bench_now() - t;
+            }
+            char name[96];
+            if (threadCounts[c] == 1)
+                snprintf(name, sizeof(name), "apply, %d%% hot, serial", hotPercents[h]);
+            else
+                snprintf(name, sizeof(name), "apply, %d%% hot, %d threads", hotPercents[h], threadCounts[c]);
+            bench_report(name, elapsed, APPLY_WRITES, 0);
+            cns_storage_free(cns, storage);
+        }
+    }
+
+    for (int b = 0; b < APPLY_GROUP; ++b)
+        cns_storagebatch_free(cns, batches[b]);
+    cns_bytes_free(cns, value);
+    for (int i = 0; i < KEYS; ++i)
+        cns_bytes_free(cns, keys[i]);
+    free(keys);
+}
+
+#define WATCH_WRITES 1000000
+#define WATCH_POLL 256
+
+// updates to KEYS keys with nothing watched, with a watch on keys never written, and with a watch on every key drained
+// after every WATCH_POLL writes
+static void watch_bench(cns_Runtime* cns)
+{
+    cns_Bytes** keys = malloc(KEYS * sizeof(cns_Bytes*));
+    for (int i = 0; i < KEYS; ++i)
+        keys[i] = makeKey(cns, i);
+    cns_Bytes* value = cns_bytes_new(cns, "0123456789abcdef0123456789abcdef", 32);
+    cns_Bytes* other = cns_bytes_new(cns, "other:", 6);
+    cns_Bytes* counters = cns_bytes_new(cns, "counter:", 8);
+    cns_WatchEvent events[WATCH_POLL];
+
+    for (int mode = 0; mode < 3; ++mode)
+    {
+        cns_Storage* storage = cns_storage_newMemoryStorageWithCapacity(cns, 0, KEYS);
+        cns_Watch* watch = mode ? cns_watch_new(cns, storage, mode == 1 ? other : counters, CNS_YES, WATCH_POLL) : 0;
+        uint64_t delivered = 0;
+        double t = bench_now();
+        for (int i = 0; i < WATCH_WRITES; ++i)
+        {
+            cns_storage_set(cns, storage, keys[(unsigned) i * 2654435761u % KEYS], value);
+            if (mode == 2 && (i + 1) % WATCH_POLL == 0)
+            {
+                cns_Index count = cns_watch_poll(cns, watch, events, WATCH_POLL, 0);
+                cns_watch_releaseEvents(cns, events, count);
+                delivered += (uint64_t) count;
+            }
+        }
+        t = bench_now() - t;
+        static const char * const names[] = { "writes, not watched", "writes, other keys watched", "writes, watched and polled" };
+        bench_report(names[mode], t, WATCH_WRITES, 0);
+        if (mode == 2)
+            printf("    %llu events delivered\n", (unsigned long long) delivered);
+        if (watch)
+            cns_watch_free(cns, watch);
+        cns_storage_free(cns, storage);
+    }
+
+    cns_bytes_free(cns, counters);
+    cns_bytes_free(cns, other);
+    cns_bytes_free(cns, value);
+    for (int i = 0; i < KEYS; ++i)
+        cns_bytes_free(cns, keys[i]);
+    free(keys);
+}
+
+#define HOT_GETS 2000000
+#define HOT_THREADS 4
+#define HOT_KEYS 8
+
+typedef struct HotReader
+{
+    cns_Runtime*    cns;
+    cns_Storage*    storage;
+    cns_Bytes**     keys;
+    int             thread;
+    cns_Index       sum;
+} HotReader;
+
+// nine gets in ten go to HOT_KEYS keys, the rest spread over all KEYS
+static void* hotReader(void* arg)
+{
+    HotReader* r = (HotReader*) arg;
+    unsigned seed = 12345u + (unsigned) r->thread;
+    cns_Index sum = 0;
+    for (int i = 0; i < HOT_GETS; ++i)
+    {
+        seed = seed * 1103515245u + 12345u;
+        unsigned k = (seed >> 8) % 10 ? (seed >> 4) % HOT_KEYS : (seed >> 8) % KEYS;
+        cns_Bytes* value = cns_storage_get(r->cns, r->storage, r->keys[k]);
+        sum += cns_bytes_length(r->cns, value);
+        cns_bytes_free(r->cns, value);
+    }
+    r->sum = sum;
+    return 0;
+}
+
+// skewed gets on one and on HOT_THREADS threads, plain, with hot keys counted only, and with per-thread read caches; the
+// caches pay off where threads on several cores would otherwise pass the reference counts of hot values between them
+static void hotkeys_bench(cns_Runtime* cns)
+{
+    cns_Bytes** keys = malloc(KEYS * sizeof(cns_Bytes*));
+    cns_Storage* storage = cns_storage_newMemoryStorageWithCapacity(cns, 0, KEYS);
+    for (int i = 0; i < KEYS; ++i)
+    {
+        keys[i] = makeKey(cns, i);
+        cns_Bytes* value = counterValue(cns, (uint64_t) i);
+        cns_storage_set(cns, storage, keys[i], value);
+        cns_bytes_free(cns, value);
+    }
+
+    for (int mode = 0; mode < 3; ++mode)
+    {
+        cns_HotKeysOptions options;
+        cns_hotkeysoptions_default(&options);
+        options.cacheSlots = mode == 2 ? options.cacheSlots : 0;
+        cns_HotKeys* hotKeys = mode ? cns_hotkeys_start(cns, storage, &options) : 0;
+        for (int threads = 1; threads <= HOT_THREADS; threads *= HOT_THREADS)
+        {
+            pthread_t handles[HOT_THREADS];
+            HotReader readers[HOT_THREADS];
+            double t = bench_now();
+            for (int i = 0; i < threads; ++i)
+            {
+                readers[i] = (HotReader) { .cns = cns, .storage = storage, .keys = keys, .thread = i };
+                pthread_create(&handles[i], 0, hotReader, &readers[i]);
+            }
+            for (int i = 0; i < threads; ++i)
+                pthread_join(handles[i], 0);
+            t = bench_now() - t;
+            static const char * const names[] = { "plain", "hot keys counted", "hot keys cached" };
+            char name[64];
+            snprintf(name, sizeof(name), "skewed gets, %s, %d thread(s)", names[mode], threads);
+            bench_report(name, t, (cns_Index) threads * HOT_GETS, 0);
+        }
+        if (hotKeys)
+        {
+            cns_HotKeysStats stats;
+            cns_hotkeys_stats(cns, hotKeys, &stats);
+            printf("    %llu sampled, %llu cache hits, %llu misses\n", (unsigned long long) stats.sampled,
+                   (unsigned long long) stats.cacheHits, (unsigned long long) stats.cacheMisses);
+            cns_hotkeys_stop(cns, hotKeys);
+        }
+    }
+
+    cns_storage_free(cns, storage);
+    for (int i = 0; i < KEYS; ++i)
+        cns_bytes_free(cns, keys[i]);
+    free(keys);
+}
+
+#define SNAPSHOT_KEYS 1000000
+#define SNAPSHOT_VALUE 200
+
+// a million 200-byte values written to a file and loaded back, on 1 to 8 threads
+static void snapshot_bench(cns_Runtime* cns)
+{
+    cns_Storage* storage = cns_storage_newMemoryStorageWithCapacity(cns, 0, SNAPSHOT_KEYS);
+    char payload[SNAPSHOT_VALUE];
+    memset(payload, 'v', sizeof(payload));
+    for (int i = 0; i < SNAPSHOT_KEYS; ++i)
+    {
+        cns_Bytes* key = makeKey(cns, i);
+        cns_Bytes* value = cns_bytes_new(cns, payload, sizeof(payload));
+        cns_storage_set(cns, storage, key, value);
+        cns_bytes_free(cns, value);
+        cns_bytes_free(cns, key);
+    }
+
+    char path[] = "/tmp/cns_snapshotbenchXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return;
+    unlink(path);
+
+    static const int threads[] = { 1, 2, 4, 8 };
+    for (int i = 0; i < (int) (sizeof(threads) / sizeof(threads[0])); ++i)
+    {
+        char name[64];
+        lseek(fd, 0, SEEK_SET);
+        double t = bench_now();
+        cns_storage_writeSnapshot(cns, storage, fd, threads[i]);
+        t = bench_now() - t;
+        cns_Index size = (cns_Index) lseek(fd, 0, SEEK_CUR);
+        sprintf(name, "snapshot write, %d threads", threads[i]);
+        bench_report(name, t, SNAPSHOT_KEYS, size);
+
+        cns_Storage* restored = cns_storage_newMemoryStorage(cns, 0);
+        lseek(fd, 0, SEEK_SET);
+        t = bench_now();
+        cns_storage_readSnapshot(cns, restored, fd, threads[i]);
+        t = bench_now() - t;
+        sprintf(name, "snapshot read, %d threads", threads[i]);
+        bench_report(name, t, cns_storage_count(cns, restored), size);
+        cns_storage_free(cns, restored);
+    }
+    close(fd);
+
+    // the same content streamed to a follower in memory, a window of 64 KiB chunks at a time
+    cns_SnapshotSender* sender = cns_snapshotsender_new(cns, storage, 64 << 10, 16);
+    cns_SnapshotReceiver* receiver = cns_snapshotreceiver_new(cns, 0);
+    cns_Storage* follower = cns_storage_newMemoryStorage(cns, 0);
+    double t = bench_now();
+    while (!cns_snapshotsender_done(cns, sender))
+    {
+        cns_Bytes* chunk;
+        while ((chunk = cns_snapshotsender_next(cns, sender)))
+        {
+            cns_snapshotreceiver_put(cns, receiver, chunk);
+            cns_bytes_free(cns, chunk);
+        }
+        cns_snapshotsender_ack(cns, sender, cns_snapshotreceiver_offset(cns, receiver));
+    }
+    cns_snapshotreceiver_install(cns, receiver, follower);
+    t = bench_now() - t;
+    bench_report("snapshot stream, 64 KiB chunks", t, cns_storage_count(cns, follower), (cns_Index) cns_snapshotsender_length(cns, sender));
+    cns_snapshotreceiver_free(cns, receiver);
+    cns_snapshotsender_free(cns, sender);
+    cns_storage_free(cns, follower);
+    cns_storage_free(cns, storage);
+}
+
+#define LSM_PHASE 200000
+#define LSM_PHASES 5
+#define LSM_GETS 20000
+#define LSM_CACHE (4 << 20)
+
+static int compareDoubles(const void * lhs, const void * rhs)
+{
+    double l = *(const double*) lhs, r = *(const double*) rhs;
+    return (l > r) - (l < r);
+}
+
+// Write and read amplification and get latency as the data outgrows the memory table and fills more levels
+static void lsm_bench(cns_Runtime* cns)
+{
+    char path[] = "/tmp/cns_lsmbenchXXXXXX";
+    if (!mkdtemp(path))
+        return;
+
+    cns_LsmOptions options;
+    cns_lsmoptions_default(&options);
+    options.memtableBytes = 1 << 20;
+    options.tableBytes = 1 << 20;
+    cns_Storage* storage = cns_storage_newLsmStorage(cns, path, &options);
+
+    char value[100];
+    memset(value, 'v', sizeof(value));
+    double* latencies = malloc(LSM_GETS * sizeof(double));
+    for (int phase = 1; phase <= LSM_PHASES; ++phase)
+    {
+        double t = bench_now();
+        for (int i = (phase - 1) * LSM_PHASE; i < phase * LSM_PHASE; ++i)
+        {
+            cns_Bytes* key = makeKey(cns, (int) ((unsigned) i * 2654435761u % (LSM_PHASE * LSM_PHASES)));
+            cns_Bytes* v = cns_bytes_new(cns, value, sizeof(value));
+            cns_storage_set(cns, storage, key, v);
+            cns_bytes_free(cns, v);
+            cns_bytes_free(cns, key);
+        }
+        cns_storage_lsmFlush(cns, storage, CNS_YES);
+        t = bench_now() - t;
+        char name[64];
+        sprintf(name, "lsm set, %dk keys", phase * LSM_PHASE / 1000);
+        bench_report(name, t, LSM_PHASE, 0);
+
+        cns_LsmStats before, after;
+        cns_storage_lsmStats(cns, storage, &before);
+        t = bench_now();
+        for (int i = 0; i < LSM_GETS; ++i)
+        {
+            cns_Bytes* key = makeKey(cns, (int) ((unsigned) i * 40503u % (phase * LSM_PHASE)));
+            double start = bench_now();
+            cns_Bytes* v = cns_storage_get(cns, storage, key);
+            latencies[i] = bench_now() - start;
+            if (v)
+                cns_bytes_free(cns, v);
+            cns_bytes_free(cns, key);
+        }
+        t = bench_now() - t;
+        cns_storage_lsmStats(cns, storage, &after);
+        qsort(latencies, LSM_GETS, sizeof(double), compareDoubles);
+        sprintf(name, "lsm get, %dk keys", phase * LSM_PHASE / 1000);
+        bench_report(name, t, LSM_GETS, 0);
+
+        double written = (double) (after.logBytesWritten + after.flushBytesWritten + after.compactionBytesWritten);
+        printf("    write amplification %.2f, blocks read per get %.2f, get p99 %.1f us, tables per level",
+               written / after.userBytesWritten, (double) (after.blockReads - before.blockReads) / LSM_GETS,
+               latencies[LSM_GETS * 99 / 100] * 1e6);
+        for (int level = 0; level < CNS_LSM_MAXLEVELS; ++level)
+            printf(" %d", (int) after.tablesPerLevel[level]);
+        printf("\n");
+
+        // the same number of gets with the block cache on: nine in ten go to a tenth of the keys, the rest scan through
+        // all of them, once to warm the cache and once measured
+        cns_blockcache_setCapacity(cns, LSM_CACHE);
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            cns_BlockCacheStats cacheBefore, cacheAfter;
+            cns_blockcache_stats(cns, &cacheBefore);
+            t = bench_now();
+            for (int i = 0; i < LSM_GETS; ++i)
+            {
+                int k = i % 10 ? (int) ((unsigned) i * 40503u % (phase * LSM_PHASE / 10))
+                               : (int) ((unsigned) (pass * LSM_GETS + i) * 97u % (phase * LSM_PHASE));
+                cns_Bytes* key = makeKey(cns, k);
+                double start = bench_now();
+                cns_Bytes* v = cns_storage_get(cns, storage, key);
+                latencies[i] = bench_now() - start;
+                if (v)
+                    cns_bytes_free(cns, v);
+                cns_bytes_free(cns, key);
+            }
+            t = bench_now() - t;
+            cns_blockcache_stats(cns, &cacheAfter);
+            if (pass == 0)
+                continue;
+            qsort(latencies, LSM_GETS, sizeof(double), compareDoubles);
+            sprintf(name, "lsm cached get, %dk keys", phase * LSM_PHASE / 1000);
+            bench_report(name, t, LSM_GETS, 0);
+            uint64_t hits = cacheAfter.hits - cacheBefore.hits, misses = cacheAfter.misses - cacheBefore.misses;
+            printf("    block cache hit rate %.3f, get p99 %.1f us, %d blocks, %d%% hot\n",
+                   hits + misses ? (double) hits / (double) (hits + misses) : 0.0, latencies[LSM_GETS * 99 / 100] * 1e6,
+                   (int) cacheAfter.blocks, (int) (100 * cacheAfter.hotUsage / (cacheAfter.usage ? cacheAfter.usage : 1)));
+        }
+        cns_blockcache_setCapacity(cns, 0);
+    }
+    free(latencies);
+    cns_storage_free(cns, storage);
+
+    DIR* dir = opendir(path);
+    struct dirent* entry;
+    while (dir && (entry = readdir(dir)) != 0)
+    {
+        char file[PATH_MAX];
+        int length = snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        if (entry->d_name[0] != '.' && length > 0 && length < (int) sizeof(file))
+            unlink(file);
+    }
+    if (dir)
+        closedir(dir);
+    rmdir(path);
+}
+
+void storage_bench(void)
+{
+    cns_Runtime* cns = bench_startup();
+    counters_bench(cns);
+    bulk_bench(cns);
+    interning_bench(cns);
+    u64keys_bench(cns);
+    compression_bench(cns);
+    batch_bench(cns);
+    apply_bench(cns);
+    watch_bench(cns);
+    hotkeys_bench(cns);
+    snapshot_bench(cns);
+    lsm_bench(cns);
+    cns_shutdown(cns);
+}
@@ -0,0 +1,115 @@
+#include <consensual/bytes.h>
+#include <consensual/wire.h>
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FIELDS 64
+
+// the straightforward alternative: size everything up, then memcpy all fields into one buffer
+static cns_Index naive_encode(cns_Runtime* cns, cns_Bytes** fields, int count, uint8_t* out)
+{
+    uint8_t* p = out;
+    for (int i = 0; i < count; ++i)
+    {
+        cns_Index size = cns_bytes_length(cns, fields[i]);
+        p += cns_wire_encodeVarint((uint64_t) size, p);
+        memcpy(p, cns_bytes_ptr(cns, fields[i]), size);
+        p += size;
+    }
+    return p - out;
+}
+
+static void bench_size(cns_Runtime* cns, cns_Index valueSize)
+{
+    cns_Bytes* fields[FIELDS];
+    uint8_t* payload = malloc(valueSize);
+    memset(payload, 'x', valueSize);
+    for (int i = 0; i < FIELDS; ++i)
+        fields[i] = (i & 1) ? cns_bytes_new(cns, payload, valueSize) : cns_bytes_new(cns, "0123456789abcdef", 16);
+    free(payload);
+
+    cns_Index messageSize = 0;
+    for (int i = 0; i < FIELDS; ++i)
+        messageSize += cns_bytes_length(cns, fields[i]) + CNS_WIRE_MAXVARINT;
+    uint8_t* buffer = malloc(messageSize);
+
+    int rounds = (int) (64 * 1024 * 1024 / messageSize) + 1;
+    char name[64];
+
+    double t = bench_now();
+    cns_Index encoded = 0;
+    for (int r = 0; r < rounds; ++r)
+        encoded += naive_encode(cns, fields, FIELDS, buffer);
+    t = bench_now() - t;
+    sprintf(name, "encode memcpy      value=%d", (int) valueSize);
+    bench_report(name, t, rounds, encoded);
+
+    cns_WireWriter* writer = cns_wirewriter_new(cns);
+    t = bench_now();
+    encoded = 0;
+    for (int r = 0; r < rounds; ++r)
+    {
+        cns_wirewriter_reset(cns, writer);
+        for (int i = 0; i < FIELDS; ++i)
+            cns_wirewriter_putBytes(cns, writer, fields[i]);
+        int count = 0;
+        cns_wirewriter_iov(cns, writer, &count);
+        encoded += cns_wirewriter_length(cns, writer);
+    }
+    t = bench_now() - t;
+    sprintf(name, "encode iovec       value=%d", (int) valueSize);
+    bench_report(name, t, rounds, encoded);
+
+    cns_Bytes* message = cns_wirewriter_toBytes(cns, writer);
+    cns_wirewriter_free(cns, writer);
+    cns_Index length = cns_bytes_length(cns, message);
+
+    t = bench_now();
+    for (int r = 0; r < rounds; ++r)
+    {
+        const uint8_t* p = cns_bytes_ptr(cns, message);
+        const uint8_t* end = p + length;
+        while (p < end)
+        {
+            uint64_t size = 0;
+            p += cns_wire_decodeVarint(p, end - p, &size);
+            cns_Bytes* field = cns_bytes_new(cns, p, (cns_Index) size);
+            cns_bytes_free(cns, field);
+            p += size;
+        }
+    }
+    t = bench_now() - t;
+    sprintf(name, "decode copy        value=%d", (int) valueSize);
+    bench_report(name, t, rounds, length * rounds);
+
+    t = bench_now();
+    for (int r = 0; r < rounds; ++r)
+    {
+        cns_WireReader* reader = cns_wirereader_new(cns, message);
+        cns_Bytes* field;
+        while ((field = cns_wirereader_getBytes(cns, reader)))
+            cns_bytes_free(cns, field);
+        cns_wirereader_free(cns, reader);
+    }
+    t = bench_now() - t;
+    sprintf(name, "decode slice       value=%d", (int) valueSize);
+    bench_report(name, t, rounds, length * rounds);
+
+    cns_bytes_free(cns, message);
+    for (int i = 0; i < FIELDS; ++i)
+        cns_bytes_free(cns, fields[i]);
+    free(buffer);
+}
+
+void wire_bench(void)
+{
+    cns_Runtime* cns = bench_startup();
+    cns_Index sizes[] = { 16, 256, 4096, 65536 };
+    for (int i = 0; i < (int) (sizeof(sizes) / sizeof(sizes[0])); ++i)
+        bench_size(cns, sizes[i]);
+    cns_shutdown(cns);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "runtime.h"
+#include "bytes.h"
+
+/** Cache of blocks read from files, shared by everything using one runtime.
+ *
+ * Storages which read their data from files keep recently used blocks here, so that reading them again costs neither a
+ * system call nor decoding. Blocks are Bytes objects: a lookup hands out a reference to the cached block, and values
+ * sliced out of it keep it alive after it is evicted.
+ *
+ * The cache is bounded by the total length of the blocks. It is split into shards, each with its own lock, and evicts
+ * with CLOCK-Pro: a block has to be used again during a test period to become hot, and blocks evicted before being
+ * used again adapt the share of cold blocks, so a scan over many blocks does not push out the ones in regular use.
+ *
+ * Blocks are identified by an owner, which is any value unique among live users of the cache (the address of the
+ * storage, say), a file and an offset. The cache is off until it is given a capacity.
+ */
+
+/** Sets the total length of the blocks the cache may hold, evicting blocks if needed. 0 empties the cache and turns it
+ * off.
+ */
+void
+cns_blockcache_setCapacity(cns_Runtime* cns, cns_Index capacity);
+
+/**
+ */
+cns_Error
+cns_blockcache_setCapacity_r(cns_Runtime* cns, cns_Index capacity);
+
+/** Returns the cached block, which you own and must free, or NULL if it is not in the cache.
+ */
+cns_Bytes*
+cns_blockcache_lookup(cns_Runtime* cns, uint64_t owner, uint64_t file, uint64_t offset);
+
+/** Stores NULL into `out_block` if the block is not in the cache.
+ */
+cns_Error
+cns_blockcache_lookup_r(cns_Runtime* cns, uint64_t owner, uint64_t file, uint64_t offset, cns_Bytes** out_block);
+
+/** Adds a block, replacing the one cached for the same position. The cache takes a reference to `block`.
+ * Does nothing while the cache is off, or if the block is longer than a shard may hold.
+ */
+void
+cns_blockcache_insert(cns_Runtime* cns, uint64_t owner, uint64_t file, uint64_t offset, cns_Bytes* block);
+
+/**
+ */
+cns_Error
+cns_blockcache_insert_r(cns_Runtime* cns, uint64_t owner, uint64_t file, uint64_t offset, cns_Bytes* block);
+
+/** Drops every block of `owner`; call it before the owner value may be reused. Walks the whole cache.
+ */
+void
+cns_blockcache_eraseOwner(cns_Runtime* cns, uint64_t owner);
+
+/**
+ */
+cns_Error
+cns_blockcache_eraseOwner_r(cns_Runtime* cns, uint64_t owner);
+
+typedef struct cns_BlockCacheStats
+{
+    cns_Index   capacity;
+    /** Total length of cached blocks, and how much of it is hot. */
+    cns_Index   usage;
+    cns_Index   hotUsage;
+    /** Share of the capacity CLOCK-Pro currently gives to cold blocks. */
+    cns_Index   coldTarget;
+    cns_Index   blocks;
+    /** Evicted blocks which are remembered, so that using them again soon makes the cold share grow. */
+    cns_Index   remembered;
+
+    uint64_t    hits;
+    uint64_t    misses;
+    uint64_t    inserts;
+    uint64_t    evictions;
+    /** Cold blocks which became hot. */
+    uint64_t    promotions;
+} cns_BlockCacheStats;
+
+/** Fills `out_stats`. The hit rate is `hits / (hits + misses)`.
+ */
+void
+cns_blockcache_stats(cns_Runtime* cns, cns_BlockCacheStats* out_stats);
@@ -10,6 +10,11 @@ typedef struct cns_Bytes cns_Bytes;
 cns_Bytes*
 cns_bytes_new(cns_Runtime* cns, const void * ptr, cns_Index size);
 
+/**
+ */
+cns_Error
+cns_bytes_new_r(cns_Runtime* cns, const void * ptr, cns_Index size, cns_Bytes** out_bytes);
+
 /**
  * You own the object returned and must free it. The copy is cheap, referring same memory block using reference counting.
  *
@@ -18,26 +23,172 @@ cns_bytes_new(cns_Runtime* cns, const void * ptr, cns_Index size);
 cns_Bytes*
 cns_bytes_copy(cns_Runtime* cns, cns_Bytes* another);
 
+/**
+ */
+cns_Error
+cns_bytes_copy_r(cns_Runtime* cns, cns_Bytes* another, cns_Bytes** out_bytes);
+
 /**
  */
 cns_Index
 cns_bytes_length(cns_Runtime* cns, cns_Bytes* bytes);
 
+/**
+ */
+cns_Error
+cns_bytes_length_r(cns_Runtime* cns, cns_Bytes* bytes, cns_Index* out_length);
+
 /**
  * You must not modify this memory, as it may be shared with other Bytes objects.
+ *
+ * A concatenation is copied into one contiguous block the first time this is called for it; the block is kept until the
+ * object is freed. Use `cns_bytes_chunksBegin` to read the content without that copy.
  */
 const void *
 cns_bytes_ptr(cns_Runtime* cns, cns_Bytes* bytes);
 
 /**
- * memcmp
+ */
+cns_Error
+cns_bytes_ptr_r(cns_Runtime* cns, cns_Bytes* bytes, const void ** out_ptr);
+
+/** Creates a view of `length` bytes starting at `offset` without copying them.
+ * The slice keeps the memory it points into alive; you own it and must free it like any other Bytes object.
+ */
+cns_Bytes*
+cns_bytes_slice(cns_Runtime* cns, cns_Bytes* bytes, cns_Index offset, cns_Index length);
+
+/**
+ */
+cns_Error
+cns_bytes_slice_r(cns_Runtime* cns, cns_Bytes* bytes, cns_Index offset, cns_Index length, cns_Bytes** out_bytes);
+
+/** Joins two Bytes objects without copying their content: the result refers to both of them.
+ * Short results are copied into a single block instead, as that is cheaper than keeping the pieces. Meant for large
+ * values; build up a value from many small pieces with `cns_BytesBuilder`. You own the result and must free it.
+ */
+cns_Bytes*
+cns_bytes_concat(cns_Runtime* cns, cns_Bytes* lhs, cns_Bytes* rhs);
+
+/**
+ */
+cns_Error
+cns_bytes_concat_r(cns_Runtime* cns, cns_Bytes* lhs, cns_Bytes* rhs, cns_Bytes** out_bytes);
+
+#define _CNS_BYTES_MAXDEPTH 64
+
+/** Iterator over the contiguous pieces of a Bytes object, for scatter/gather I/O and the like.
+ * Refers to the object without owning it. Members are private.
+ */
+typedef struct cns_BytesChunks
+{
+    const void *    _stack[_CNS_BYTES_MAXDEPTH];
+    int             _depth;
+} cns_BytesChunks;
+
+/**
+ */
+void
+cns_bytes_chunksBegin(cns_Runtime* cns, cns_Bytes* bytes, cns_BytesChunks* out_chunks);
+
+/** Stores the next non-empty piece. Returns `CNS_NO` when there are no more pieces.
+ */
+cns_Bool
+cns_bytes_chunksNext(cns_Runtime* cns, cns_BytesChunks* chunks, const void ** out_ptr, cns_Index* out_length);
+
+/** Number of pieces `cns_bytes_chunksNext` would produce.
+ */
+cns_Index
+cns_bytes_chunkCount(cns_Runtime* cns, cns_Bytes* bytes);
+
+/**
+ * memcmp; compares concatenations piece by piece without joining them.
  */
 cns_Bool
 cns_bytes_equal(cns_Runtime* cns, cns_Bytes* lhs, cns_Bytes* rhs);
 
+/** Whether `bytes` starts with `prefix`.
+ */
+cns_Bool
+cns_bytes_hasPrefix(cns_Runtime* cns, cns_Bytes* bytes, cns_Bytes* prefix);
+
 /**
  * You must call `cns_bytes_free` for each previous `cns_bytes_new`/`cns_bytes_copy`.
+ *
+ * Reference counting is atomic, so copies of one Bytes object may be used and freed on different threads.
  */
 void
 cns_bytes_free(cns_Runtime* cns, cns_Bytes* bytes);
 
+/**
+ */
+cns_Error
+cns_bytes_free_r(cns_Runtime* cns, cns_Bytes* bytes);
+
+
+typedef struct cns_BytesBuilder cns_BytesBuilder;
+
+/** Creates a builder which assembles a Bytes object piece by piece.
+ *
+ * The content is written straight into the memory of the future Bytes object, growing it geometrically with the
+ * runtime's realloc function, so `cns_bytesbuilder_finish` does not copy it again.
+ * @param capacity  Number of bytes to make room for up front; may be 0.
+ */
+cns_BytesBuilder*
+cns_bytesbuilder_new(cns_Runtime* cns, cns_Index capacity);
+
+/**
+ */
+cns_Error
+cns_bytesbuilder_new_r(cns_Runtime* cns, cns_Index capacity, cns_BytesBuilder** out_builder);
+
+/** Makes room for `size` more bytes, so that appending them does not reallocate.
+ */
+void
+cns_bytesbuilder_reserve(cns_Runtime* cns, cns_BytesBuilder* builder, cns_Index size);
+
+/**
+ */
+cns_Error
+cns_bytesbuilder_reserve_r(cns_Runtime* cns, cns_BytesBuilder* builder, cns_Index size);
+
+/** Appends `size` bytes from `ptr`. On failure the builder keeps its previous content.
+ */
+void
+cns_bytesbuilder_append(cns_Runtime* cns, cns_BytesBuilder* builder, const void * ptr, cns_Index size);
+
+/**
+ */
+cns_Error
+cns_bytesbuilder_append_r(cns_Runtime* cns, cns_BytesBuilder* builder, const void * ptr, cns_Index size);
+
+/** Number of bytes appended so far.
+ */
+cns_Index
+cns_bytesbuilder_length(cns_Runtime* cns, cns_BytesBuilder* builder);
+
+/** Content appended so far. Valid until the next call that may grow the builder.
+ */
+void *
+cns_bytesbuilder_ptr(cns_Runtime* cns, cns_BytesBuilder* builder);
+
+/** Turns the content into a Bytes object and frees the builder, which must not be used afterwards.
+ * Spare capacity is given back to the allocator; the content itself is not copied.
+ */
+cns_Bytes*
+cns_bytesbuilder_finish(cns_Runtime* cns, cns_BytesBuilder* builder);
+
+/**
+ */
+cns_Error
+cns_bytesbuilder_finish_r(cns_Runtime* cns, cns_BytesBuilder* builder, cns_Bytes** out_bytes);
+
+/** Frees the builder and its content without making a Bytes object.
+ */
+void
+cns_bytesbuilder_free(cns_Runtime* cns, cns_BytesBuilder* builder);
+
+/**
+ */
+cns_Error
+cns_bytesbuilder_free_r(cns_Runtime* cns, cns_BytesBuilder* builder);
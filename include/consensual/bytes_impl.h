@@ -0,0 +1,96 @@
+#pragma once
+
+/** Layout of Bytes objects and unchecked inline accessors for them.
+ *
+ * Opt-in: include this only where the function call, null checks and error reporting of `cns_bytes_length` and friends
+ * are measurable, and only pass objects you know to be valid. Nothing here reports errors.
+ */
+
+#include "bytes.h"
+
+#include <stdatomic.h>
+#include <string.h> // memcmp
+
+typedef struct _cns_BytesImpl
+{
+    atomic_int              referenceCount;
+    cns_Index               length;
+    const uint8_t*          data; // null for concatenations, whose content is in pieces
+    struct _cns_BytesImpl*  parent; // slices keep the block they point into alive
+} _cns_BytesImpl;
+
+/** A block with room for `size` bytes of content, which the caller fills in through `data` before handing it out.
+ */
+cns_Error
+_cns_bytes_alloc(cns_Runtime* cns, cns_Index size, _cns_BytesImpl** out_impl);
+
+/** Joins the pieces of a concatenation into one block, once; null if that fails for lack of memory.
+ */
+const void *
+_cns_bytes_flatten(cns_Bytes* bytes);
+
+/** Compares the first `length` bytes of two objects piece by piece.
+ */
+cns_Bool
+_cns_bytes_equalChunks(cns_Bytes* lhs, cns_Bytes* rhs, cns_Index length);
+
+/** `cns_bytes_chunksBegin` without checks; `bytes` must not be null.
+ */
+static inline void
+cns_bytes_chunksBeginUnchecked(cns_Bytes* bytes, cns_BytesChunks* out_chunks)
+{
+    out_chunks->_depth = 0;
+    out_chunks->_stack[out_chunks->_depth++] = bytes;
+}
+
+/** `cns_bytes_chunksNext` without checks.
+ */
+cns_Bool
+cns_bytes_chunksNextUnchecked(cns_BytesChunks* chunks, const void ** out_ptr, cns_Index* out_length);
+
+/** `cns_bytes_chunkCount` without checks; `bytes` must not be null.
+ */
+cns_Index
+cns_bytes_chunkCountUnchecked(cns_Bytes* bytes);
+
+/** Whether the content is one contiguous block already.
+ */
+static inline cns_Bool
+cns_bytes_isFlatUnchecked(cns_Bytes* bytes)
+{
+    return ((const _cns_BytesImpl*) bytes)->data != 0;
+}
+
+/** `cns_bytes_length` without checks; `bytes` must not be null.
+ */
+static inline cns_Index
+cns_bytes_lengthUnchecked(cns_Bytes* bytes)
+{
+    return ((const _cns_BytesImpl*) bytes)->length;
+}
+
+/** `cns_bytes_ptr` without checks; `bytes` must not be null.
+ */
+static inline const void *
+cns_bytes_ptrUnchecked(cns_Bytes* bytes)
+{
+    const uint8_t* data = ((const _cns_BytesImpl*) bytes)->data;
+    return data ? data : _cns_bytes_flatten(bytes);
+}
+
+/** `cns_bytes_equal` for non-null objects.
+ */
+static inline cns_Bool
+cns_bytes_equalUnchecked(cns_Bytes* lhs, cns_Bytes* rhs)
+{
+    if (lhs == rhs)
+        return CNS_YES;
+
+    cns_Index length = cns_bytes_lengthUnchecked(lhs);
+    if (length != cns_bytes_lengthUnchecked(rhs))
+        return CNS_NO;
+
+    if (!cns_bytes_isFlatUnchecked(lhs) || !cns_bytes_isFlatUnchecked(rhs))
+        return _cns_bytes_equalChunks(lhs, rhs, length);
+    return (0 == memcmp(cns_bytes_ptrUnchecked(lhs), cns_bytes_ptrUnchecked(rhs), length));
+}
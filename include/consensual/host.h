@@ -0,0 +1,142 @@
+#pragma once
+
+#include "storage.h"
+
+/** Many small replicated groups run together on a fixed set of threads.
+ *
+ * The hosts of a cluster of `numPeers` each run their share of every group: a log of batches, whose committed entries
+ * are applied in order to a memory storage the group was given. The leader of a group, fixed when the group is added,
+ * takes proposals, sends the log on to the other peers and counts an entry as committed once a majority holds it. There
+ * are no elections: a group waits while its leader or a majority of peers is away, and goes on once they are back.
+ *
+ * A host works in ticks. A tick hands the frames received since the last one to their groups, lets every group act, and
+ * then sends each peer at most one frame with everything its groups had to say to it: entries, commit indexes,
+ * heartbeats and acknowledgements of any number of groups travel together. A group with nothing new sends a small
+ * heartbeat every few ticks and otherwise costs a few comparisons per tick. Groups are spread over a fixed set of
+ * workers, the calling thread being one of them, which run the tick at once; with more than one worker, the runtime's
+ * allocation functions must be safe to call from several threads. Call the host itself from one thread at a time.
+ */
+typedef struct cns_Host cns_Host;
+
+/** Takes a frame for `peer`, and the reference to it. Frames may be lost; groups send again what was not acknowledged.
+ */
+typedef void (* cns_HostSendFn)(cns_Runtime* cns, void* context, int peer, cns_Bytes* frame);
+
+typedef struct cns_HostOptions
+{
+    /** Place of this host in the cluster, from 0 to `numPeers` - 1. */
+    int             self;
+    int             numPeers;
+    /** Threads running the groups, the calling one included. */
+    int             numWorkers;
+    /** Ticks between heartbeats of a group with nothing else to send, and before unacknowledged entries are sent again. */
+    int             heartbeatTicks;
+    /** Most entries a group sends one peer in one tick. */
+    int             maxEntriesPerTick;
+    cns_HostSendFn  send;
+    void*           sendContext;
+} cns_HostOptions;
+
+/** Fills `out_options` for a cluster of one, on one worker, with heartbeats every 10 ticks and up to 64 entries a tick.
+ */
+void
+cns_hostoptions_default(cns_HostOptions* out_options);
+
+/** Creates a host and starts its workers.
+ */
+cns_Host*
+cns_host_new(cns_Runtime* cns, const cns_HostOptions* options);
+
+/** Stops the workers and frees the host; the storages of its groups are left to you.
+ */
+void
+cns_host_free(cns_Runtime* cns, cns_Host* host);
+
+/** Adds the group `groupId`, led by peer `leader`, which applies its log to `storage`. Every peer must add the group,
+ * with the same leader and an empty storage of its own. Memory storages only.
+ */
+void
+cns_host_addGroup(cns_Runtime* cns, cns_Host* host, uint64_t groupId, cns_Storage* storage, int leader);
+
+/**
+ */
+cns_Error
+cns_host_addGroup_r(cns_Runtime* cns, cns_Host* host, uint64_t groupId, cns_Storage* storage, int leader);
+
+/** Appends the writes of `batch` to the log of a group this host leads and returns the index of the new entry; once it is
+ * applied, `cns_host_appliedIndex` reaches that index. The batch may be changed right away. Groups led by another peer
+ * fail with CNS_ERR_BADARG.
+ */
+uint64_t
+cns_host_propose(cns_Runtime* cns, cns_Host* host, uint64_t groupId, cns_StorageBatch* batch);
+
+/**
+ */
+cns_Error
+cns_host_propose_r(cns_Runtime* cns, cns_Host* host, uint64_t groupId, cns_StorageBatch* batch, uint64_t* out_index);
+
+/** Queues a frame from another peer for the next tick. The host holds a reference, so you may free `frame` right away.
+ */
+void
+cns_host_receive(cns_Runtime* cns, cns_Host* host, cns_Bytes* frame);
+
+/**
+ */
+cns_Error
+cns_host_receive_r(cns_Runtime* cns, cns_Host* host, cns_Bytes* frame);
+
+/** Runs one tick. The tick goes on past failures, which leave some messages unsent; the first one is returned.
+ */
+void
+cns_host_tick(cns_Runtime* cns, cns_Host* host);
+
+/**
+ */
+cns_Error
+cns_host_tick_r(cns_Runtime* cns, cns_Host* host);
+
+/** Index of the last entry of the group applied to its storage on this host; 0 before any.
+ */
+uint64_t
+cns_host_appliedIndex(cns_Runtime* cns, cns_Host* host, uint64_t groupId);
+
+typedef struct cns_HostStats
+{
+    uint64_t    ticks;
+    uint64_t    framesSent;
+    uint64_t    messagesSent;
+    uint64_t    bytesSent;
+    uint64_t    framesReceived;
+    /** Frames which did not decode; the part of them past the damage was dropped. */
+    uint64_t    malformedFrames;
+} cns_HostStats;
+
+/**
+ */
+void
+cns_host_stats(cns_Runtime* cns, cns_Host* host, cns_HostStats* out_stats);
+
+
+/** In-process transport between hosts of one process: frames sent wait in the net until delivered.
+ */
+typedef struct cns_HostNet cns_HostNet;
+
+/**
+ */
+cns_HostNet*
+cns_hostnet_new(cns_Runtime* cns, int numPeers);
+
+/** Frees the net and the frames still waiting in it.
+ */
+void
+cns_hostnet_free(cns_Runtime* cns, cns_HostNet* net);
+
+/** A `cns_HostSendFn`; give the net as its context.
+ */
+void
+cns_hostnet_send(cns_Runtime* cns, void* net, int peer, cns_Bytes* frame);
+
+/** Hands every waiting frame to `hosts[peer]`, in the order they were sent, and returns how many there were.
+ */
+cns_Index
+cns_hostnet_deliver(cns_Runtime* cns, cns_HostNet* net, cns_Host** hosts);
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "storage.h"
+
+/** Hot key tracking and per-thread read caches of a memory storage.
+ *
+ * Gets are counted in a count-min sketch: four rows of counters, each key adding to one counter per row, and the smallest
+ * of its four counters estimating how often it was read. Estimates never fall short of the true count, and only overshoot
+ * by what other keys sharing all four counters add. To keep readers from fighting over the counters, each thread counts
+ * one get in every `sampleRate` of its own, with the weight of all of them. Every 16 sampled gets per counter of a row the
+ * counts are halved, so that keys which cool down leave the top. The hottest `topKeys` keys seen are kept, with copies of
+ * their keys, for `cns_hotkeys_top` to report.
+ *
+ * With `cacheSlots` set, each thread also keeps a small cache of the hottest keys with copies of their values private to
+ * it, so that repeated gets of a hot key neither walk the table nor touch the reference count of the stored value, which
+ * all threads reading it would otherwise pass between their cores. Each write bumps a version stamp of the stripe of keys
+ * it falls into, and a cached value is only served while the stamp it was cached with is current; replacing the whole
+ * content of the storage bumps every stamp. Values served from a cache are copies, equal in content to the stored ones
+ * and decompressed if the storage compresses them.
+ *
+ * Gets then allocate and free on the threads making them, so the runtime's allocation functions must be safe to call from
+ * several threads. Writes only check a pointer while nothing is tracked. Start and stop tracking while no other thread
+ * uses the storage, and stop it before freeing the storage. Memory storages only.
+ */
+typedef struct cns_HotKeys cns_HotKeys;
+
+typedef struct cns_HotKeysOptions
+{
+    /** How many of the hottest keys to keep, up to 256. */
+    cns_Index   topKeys;
+    /** Counters in each row of the sketch, rounded up to a power of two. */
+    cns_Index   sketchWidth;
+    /** One get in this many of each thread is counted, rounded up to a power of two. */
+    cns_Index   sampleRate;
+    /** Slots of the read cache of each thread, rounded up to a power of two; 0 for no caches. */
+    cns_Index   cacheSlots;
+} cns_HotKeysOptions;
+
+/** Fills `out_options` with the defaults: 16 keys, 4096 counters per row, one get in 8 counted, 64 cache slots.
+ */
+void
+cns_hotkeysoptions_default(cns_HotKeysOptions* out_options);
+
+/** Starts tracking the gets of `storage`. A storage has one tracker at most.
+ * @param options   Pass `NULL` for the defaults.
+ */
+cns_HotKeys*
+cns_hotkeys_start(cns_Runtime* cns, cns_Storage* storage, const cns_HotKeysOptions* options);
+
+/** Stops tracking and frees the tracker and the caches of every thread.
+ */
+void
+cns_hotkeys_stop(cns_Runtime* cns, cns_HotKeys* hotKeys);
+
+typedef struct cns_HotKey
+{
+    cns_Bytes*  key;
+    /** Estimated gets, scaled up from the sampled ones and halved as counts age. */
+    uint64_t    count;
+} cns_HotKey;
+
+/** Moves up to `max` of the hottest keys into `out`, hottest first, and returns how many. Their keys are yours to free,
+ * for instance with `cns_hotkeys_releaseTop`. May be called while other threads make gets.
+ */
+cns_Index
+cns_hotkeys_top(cns_Runtime* cns, cns_HotKeys* hotKeys, cns_HotKey* out, cns_Index max);
+
+/**
+ */
+cns_Error
+cns_hotkeys_top_r(cns_Runtime* cns, cns_HotKeys* hotKeys, cns_HotKey* out, cns_Index max, cns_Index* out_count);
+
+/** Frees the keys of `count` entries.
+ */
+void
+cns_hotkeys_releaseTop(cns_Runtime* cns, cns_HotKey* keys, cns_Index count);
+
+typedef struct cns_HotKeysStats
+{
+    /** Gets counted in the sketch. */
+    uint64_t    sampled;
+    /** Gets served from the cache of their thread. */
+    uint64_t    cacheHits;
+    /** Gets which went to the table while the thread had a cache. */
+    uint64_t    cacheMisses;
+    /** Values copied into caches. */
+    uint64_t    cacheFills;
+} cns_HotKeysStats;
+
+/** Sums the counts of all threads; may be called while other threads make gets.
+ */
+void
+cns_hotkeys_stats(cns_Runtime* cns, cns_HotKeys* hotKeys, cns_HotKeysStats* out_stats);
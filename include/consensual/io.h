@@ -0,0 +1,155 @@
+#pragma once
+
+#include "runtime.h"
+#include "bytes.h"
+
+/** Asynchronous file I/O for logs and snapshots.
+ *
+ * Operations are queued, handed to the kernel together by `cns_io_submit`, and their completions collected by
+ * `cns_io_poll`, so that the calling thread goes on working while they are in flight. On Linux this runs on io_uring,
+ * through the system calls directly. Where io_uring is missing or not allowed, a portable fallback runs each operation
+ * with a blocking system call at submit time, and reports it complete at the next poll.
+ *
+ * Writes take their data straight from the memory of a Bytes object and hold a reference until they complete, so you may
+ * free it right after queuing. Concatenations are written piece by piece. Writes out of buffers registered with
+ * `cns_io_registerBuffers` spare the kernel mapping their pages for every operation.
+ *
+ * An I/O queue is not thread safe; use it from one thread at a time.
+ */
+typedef struct cns_Io cns_Io;
+
+/** Kinds of operations. */
+enum
+{
+    CNS_IO_WRITE    = 1,
+    CNS_IO_READ     = 2,
+    CNS_IO_FSYNC    = 3,
+};
+
+typedef struct cns_IoCompletion
+{
+    /** Value given when queuing the operation. */
+    void*       context;
+    int         op;
+    /** Bytes transferred, or a negative errno. Reads come up short at the end of the file; writes may, as with write(2). */
+    cns_Index   result;
+    /** The data of a successful read, which you own and must free; NULL otherwise. */
+    cns_Bytes*  data;
+} cns_IoCompletion;
+
+/** Called by `cns_io_poll` when an operation queued with it completes. It may queue more operations, but not poll.
+ */
+typedef void (* cns_IoCallback)(cns_Runtime* cns, cns_Io* io, const cns_IoCompletion* completion);
+
+typedef struct cns_IoOptions
+{
+    /** Operations handed to the kernel at once; more wait in the queue. */
+    int         entries;
+    /** Use the blocking fallback even where io_uring works. */
+    cns_Bool    portable;
+} cns_IoOptions;
+
+/** Fills `out_options` with 64 entries, on io_uring where available.
+ */
+void
+cns_iooptions_default(cns_IoOptions* out_options);
+
+/** Creates an I/O queue. Pass `NULL` options for the defaults.
+ */
+cns_Io*
+cns_io_new(cns_Runtime* cns, const cns_IoOptions* options);
+
+/** Waits for the operations in flight and frees the queue. Their completions, and those not polled yet, are dropped
+ * without calling callbacks; operations which were not submitted are not run.
+ */
+void
+cns_io_free(cns_Runtime* cns, cns_Io* io);
+
+/** Queues writing `data` at `offset` of `fd`; -1 writes at the file position and moves it, as write(2) does.
+ * @param callback  Called with the completion by `cns_io_poll`; if NULL, the poll returns the completion instead.
+ */
+void
+cns_io_write(cns_Runtime* cns, cns_Io* io, int fd, int64_t offset, cns_Bytes* data, cns_IoCallback callback, void* context);
+
+/**
+ */
+cns_Error
+cns_io_write_r(cns_Runtime* cns, cns_Io* io, int fd, int64_t offset, cns_Bytes* data, cns_IoCallback callback, void* context);
+
+/** Queues reading up to `length` bytes at `offset` of `fd` into a new Bytes object, which the completion hands over.
+ */
+void
+cns_io_read(cns_Runtime* cns, cns_Io* io, int fd, int64_t offset, cns_Index length, cns_IoCallback callback, void* context);
+
+/**
+ */
+cns_Error
+cns_io_read_r(cns_Runtime* cns, cns_Io* io, int fd, int64_t offset, cns_Index length, cns_IoCallback callback, void* context);
+
+/** Queues flushing `fd` to the device, only its data and size if `dataOnly`. It starts once every operation submitted
+ * before it has completed, so it covers the writes queued ahead of it.
+ */
+void
+cns_io_fsync(cns_Runtime* cns, cns_Io* io, int fd, cns_Bool dataOnly, cns_IoCallback callback, void* context);
+
+/**
+ */
+cns_Error
+cns_io_fsync_r(cns_Runtime* cns, cns_Io* io, int fd, cns_Bool dataOnly, cns_IoCallback callback, void* context);
+
+/** Hands the queued operations to the kernel, as many as there are free entries. Returns how many it handed over.
+ */
+cns_Index
+cns_io_submit(cns_Runtime* cns, cns_Io* io);
+
+/**
+ */
+cns_Error
+cns_io_submit_r(cns_Runtime* cns, cns_Io* io, cns_Index* out_submitted);
+
+/** Collects completed operations, waiting until at least `waitFor` have completed; 0 only takes what is there.
+ *
+ * Operations queued with a callback have it called. The completions of the others are stored into `out`, in the order
+ * they completed; once `max` are stored, the rest stay for the next poll. Queued operations are submitted as entries
+ * free up. Returns the number of completions stored.
+ */
+cns_Index
+cns_io_poll(cns_Runtime* cns, cns_Io* io, cns_IoCompletion* out, cns_Index max, cns_Index waitFor);
+
+/**
+ */
+cns_Error
+cns_io_poll_r(cns_Runtime* cns, cns_Io* io, cns_IoCompletion* out, cns_Index max, cns_Index waitFor, cns_Index* out_stored);
+
+/** Registers long-lived buffers with the kernel, replacing those registered before; pass 0 buffers to drop them.
+ *
+ * Writes of data lying within one of them, such as slices of a log segment, then use the pinned pages. The queue holds
+ * a reference to each buffer until they are replaced. Nothing may be queued or in flight. Fails with CNS_ERR_IO if the
+ * kernel refuses, typically for lack of locked memory allowance; with the fallback it only holds the references.
+ */
+void
+cns_io_registerBuffers(cns_Runtime* cns, cns_Io* io, cns_Bytes** buffers, cns_Index count);
+
+/**
+ */
+cns_Error
+cns_io_registerBuffers_r(cns_Runtime* cns, cns_Io* io, cns_Bytes** buffers, cns_Index count);
+
+typedef struct cns_IoStats
+{
+    /** Whether io_uring runs the operations rather than the blocking fallback. */
+    cns_Bool    async;
+    cns_Index   queued;
+    cns_Index   inFlight;
+    uint64_t    submitted;
+    uint64_t    completed;
+    /** System calls made to submit and wait; with io_uring, one covers many operations. */
+    uint64_t    systemCalls;
+    /** Writes served from registered buffers. */
+    uint64_t    fixedWrites;
+} cns_IoStats;
+
+/**
+ */
+void
+cns_io_stats(cns_Runtime* cns, cns_Io* io, cns_IoStats* out_stats);
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "runtime.h"
+
+/** Byte-crunching kernels behind hashing and comparison of Bytes objects.
+ *
+ * Every kernel exists in several implementations, one per instruction set level. All of them produce identical results;
+ * the best one supported by the CPU is picked at runtime. Passing an explicit level is meant for tests and benchmarks.
+ */
+typedef uint8_t cns_KernelLevel;
+
+#define CNS_KERNEL_SCALAR 0
+#define CNS_KERNEL_SSE2 1
+#define CNS_KERNEL_SSE42 2
+#define CNS_KERNEL_AVX2 3
+#define CNS_KERNEL_AUTO 255
+
+/** Best level supported by this CPU, detected with CPUID.
+ */
+cns_KernelLevel
+cns_kernels_bestLevel(void);
+
+/** Whether `level` can run on this CPU; always for CNS_KERNEL_AUTO.
+ */
+cns_Bool
+cns_kernels_supported(cns_KernelLevel level);
+
+/** CRC-32C (Castagnoli) of `length` bytes at `ptr`, continuing from `crc`.
+ * Pass 0 as `crc` to start; feeding consecutive pieces gives the same result as feeding them at once.
+ * Levels below CNS_KERNEL_SSE42 use the table-driven version. Unsupported levels fall back to the best supported one.
+ */
+uint32_t
+cns_kernels_crc32c(cns_KernelLevel level, uint32_t crc, const void * ptr, cns_Index length);
+
+/** Whether `length` bytes at `lhs` and `rhs` are equal.
+ * Unsupported levels fall back to the best supported one.
+ */
+cns_Bool
+cns_kernels_equal(cns_KernelLevel level, const void * lhs, const void * rhs, cns_Index length);
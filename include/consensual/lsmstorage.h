@@ -0,0 +1,90 @@
+#pragma once
+
+#include "storage.h"
+
+/** Persistent storage for data which does not fit in memory: a log-structured merge tree behind the `cns_Storage` API.
+ *
+ * Writes go to a write-ahead log and an in-memory table. Full memory tables are written out as immutable sorted files
+ * (SSTables) with a block index and a bloom filter, which a background thread merges level by level: each level is a
+ * sorted run about `levelRatio` times larger than the one above it.
+ *
+ * get, set and delete work as for the memory storage; so do count, upsert and bulkSet. Entries and interning are not
+ * available and fail with CNS_ERR_UNSUPPORTED. As with the memory storage, calls for one storage must not overlap.
+ * I/O failures are reported as CNS_ERR_IO; a failure of the background thread is reported by every following write.
+ *
+ * The background thread allocates what it builds and the files it opens through the runtime, while the storage is in
+ * use, so the runtime's allocation functions must be safe to call from several threads.
+ *
+ * Gets keep the blocks they read in the runtime's block cache, when it is on, and return values as slices of them.
+ * @see cns_blockcache_setCapacity
+ */
+
+typedef struct cns_LsmOptions
+{
+    /** Size of keys and values the memory table collects before it is written out. */
+    cns_Index   memtableBytes;
+    /** Size at which files produced by merging are split. */
+    cns_Index   tableBytes;
+    /** Size of the blocks files are read in. */
+    cns_Index   blockBytes;
+    /** Bloom filter size; 0 disables the filters. */
+    int         bloomBitsPerKey;
+    /** Number of files written from memory tables that triggers merging them into the first level. */
+    int         level0Tables;
+    /** Size ratio between a level and the one above it. */
+    int         levelRatio;
+    /** Whether each write waits until the log is on disk. */
+    cns_Bool    syncWrites;
+} cns_LsmOptions;
+
+/** Fills `out_options` with the defaults: 4 MiB memory tables, 2 MiB files, 4 KiB blocks, 10 filter bits per key,
+ * merging after 4 files, levels 10 times apart, no syncing.
+ */
+void
+cns_lsmoptions_default(cns_LsmOptions* out_options);
+
+/** Opens the storage kept in `directory`, creating the directory and an empty storage if needed.
+ * Data written before a crash is recovered from the log, up to the last write that reached the disk.
+ * @param options   Pass `NULL` for the defaults.
+ */
+cns_Storage*
+cns_storage_newLsmStorage(cns_Runtime* cns, const char * directory, const cns_LsmOptions* options);
+
+#define CNS_LSM_MAXLEVELS 7
+
+typedef struct cns_LsmStats
+{
+    /** Keys and values passed to set and delete. */
+    uint64_t    userBytesWritten;
+    uint64_t    logBytesWritten;
+    uint64_t    flushBytesWritten;
+    uint64_t    compactionBytesRead;
+    uint64_t    compactionBytesWritten;
+    uint64_t    flushes;
+    uint64_t    compactions;
+
+    /** Gets that had to look past the memory tables. */
+    uint64_t    diskGets;
+    /** Files whose key range covered such a get, and how many of those the bloom filter ruled out. */
+    uint64_t    tablesProbed;
+    uint64_t    bloomNegatives;
+    /** Data blocks gets read from disk, and found in the runtime's block cache. */
+    uint64_t    blockReads;
+    uint64_t    blockCacheHits;
+
+    cns_Index   memtableBytes;
+    cns_Index   tablesPerLevel[CNS_LSM_MAXLEVELS];
+    cns_Index   bytesPerLevel[CNS_LSM_MAXLEVELS];
+} cns_LsmStats;
+
+/** Fills `out_stats` for a storage made by `cns_storage_newLsmStorage`.
+ * Write amplification is the sum of the bytes written divided by `userBytesWritten`; read amplification is
+ * `blockReads` plus `blockCacheHits` per get.
+ */
+void
+cns_storage_lsmStats(cns_Runtime* cns, cns_Storage* storage, cns_LsmStats* out_stats);
+
+/** Writes the memory table out and, if `waitForCompactions`, waits until no level needs merging.
+ */
+void
+cns_storage_lsmFlush(cns_Runtime* cns, cns_Storage* storage, cns_Bool waitForCompactions);
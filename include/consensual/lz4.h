@@ -0,0 +1,33 @@
+#pragma once
+
+#include "runtime.h"
+
+/** Fast compression in the LZ4 block format.
+ *
+ * Output is a raw LZ4 block without a frame, readable by any LZ4 implementation, and any LZ4 block decodes here. Neither
+ * the compressed nor the original length is stored, so keep them next to the block. Compression is greedy with a small
+ * hash table on the stack; decompression checks every length and offset, so malformed input cannot make it read or
+ * write out of bounds.
+ */
+
+/** Longest input `cns_lz4_compress` accepts.
+ */
+#define CNS_LZ4_MAXINPUT 0x7E000000
+
+/** Room the compressed form of `size` bytes may need when nothing in it repeats.
+ */
+#define CNS_LZ4_BOUND(size) ((size) + (size) / 255 + 16)
+
+/** Compresses `size` bytes at `src` into `dst`, which has room for `capacity` bytes.
+ * Returns the compressed length, or 0 if it does not fit or the input is longer than `CNS_LZ4_MAXINPUT`. With a
+ * capacity of `CNS_LZ4_BOUND(size)` it always fits; pass less to give up on data which does not shrink enough.
+ */
+cns_Index
+cns_lz4_compress(const void * src, cns_Index size, void* dst, cns_Index capacity);
+
+/** Decompresses the `size` bytes block at `src` into `dst`, which has room for `capacity` bytes.
+ * Returns the decompressed length, or -1 if the block is malformed or decompresses to more than `capacity` bytes.
+ * Copies run in 16-byte steps, so the room past the decompressed length may be overwritten too.
+ */
+cns_Index
+cns_lz4_decompress(const void * src, cns_Index size, void* dst, cns_Index capacity);
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "runtime.h"
+#include "bytes.h"
+
+/** Message transport over TCP, for replication between hosts.
+ *
+ * A net is one epoll reactor: connections, listening sockets and their callbacks all run in `cns_net_poll`, on the
+ * thread calling it. Run one net per core, each with its own connections; with nets on several threads, the runtime's
+ * allocation functions must be safe to call from several threads.
+ *
+ * A message goes on the wire as its length, 4 bytes little endian, then its content. Sending queues a reference to the
+ * message and writes it with `sendmsg` straight from its memory, concatenations piece by piece, so nothing is copied on
+ * the way out. A peer hanging up closes the connection; it never raises SIGPIPE. Received data lands in blocks taken from a pool, and each message is handed out as a slice of its block;
+ * a block goes back to the pool once every message sliced out of it is freed. Messages longer than a block get a block
+ * of their own.
+ *
+ * Each connection bounds the bytes it queues for sending: past the bound, sending fails with CNS_ERR_BUSY until the queue
+ * drains, which the writable callback tells. A receiver falling behind may pause reading from a connection, so that TCP
+ * pushes back on the sender in turn.
+ */
+typedef struct cns_Net cns_Net;
+typedef struct cns_NetConn cns_NetConn;
+
+/** Called for each message received; the message is yours to free, and may be kept as long as needed.
+ */
+typedef void (* cns_NetMessageFn)(cns_Runtime* cns, void* context, cns_NetConn* conn, cns_Bytes* message);
+
+/** Called when a connection is established, when its send queue has drained after CNS_ERR_BUSY, and when it closes. */
+typedef void (* cns_NetConnFn)(cns_Runtime* cns, void* context, cns_NetConn* conn);
+
+typedef struct cns_NetOptions
+{
+    /** Length of pooled receive blocks. */
+    cns_Index           blockSize;
+    /** Blocks the pool keeps at most. */
+    int                 poolBlocks;
+    /** Longest message accepted; a longer one closes the connection. */
+    cns_Index           maxMessage;
+    /** Bytes a connection queues for sending before sends fail with CNS_ERR_BUSY. */
+    cns_Index           maxQueued;
+    cns_NetMessageFn    onMessage;
+    /** Each may be NULL. */
+    cns_NetConnFn       onOpen;
+    cns_NetConnFn       onWritable;
+    cns_NetConnFn       onClose;
+    void*               context;
+} cns_NetOptions;
+
+/** Fills `out_options` with 64 KiB blocks, a pool of 256 of them, messages of up to 64 MiB and 4 MiB of queue per
+ * connection, and no callbacks.
+ */
+void
+cns_netoptions_default(cns_NetOptions* out_options);
+
+/** Creates a net. `options->onMessage` is required.
+ */
+cns_Net*
+cns_net_new(cns_Runtime* cns, const cns_NetOptions* options);
+
+/** Closes every connection and listening socket, without calling back, and frees the net. Blocks of messages handed
+ * out stay valid until those messages are freed.
+ */
+void
+cns_net_free(cns_Runtime* cns, cns_Net* net);
+
+/** Accepts connections on `address` and `port`, an IPv4 address such as "127.0.0.1" and a port, 0 for any free one.
+ * Returns the port listened on, or 0 on failure.
+ */
+int
+cns_net_listen(cns_Runtime* cns, cns_Net* net, const char * address, int port);
+
+/**
+ */
+cns_Error
+cns_net_listen_r(cns_Runtime* cns, cns_Net* net, const char * address, int port, int* out_port);
+
+/** Starts connecting to `address` and `port`; the open callback tells when it is done. Messages may be sent right away;
+ * they wait in the queue.
+ */
+cns_NetConn*
+cns_net_connect(cns_Runtime* cns, cns_Net* net, const char * address, int port);
+
+/**
+ */
+cns_Error
+cns_net_connect_r(cns_Runtime* cns, cns_Net* net, const char * address, int port, cns_NetConn** out_conn);
+
+/** Waits up to `timeoutMs` milliseconds, -1 for ever, for something to happen, handles everything that did, calling
+ * back as it goes, and returns the number of events handled.
+ */
+int
+cns_net_poll(cns_Runtime* cns, cns_Net* net, int timeoutMs);
+
+/**
+ */
+cns_Error
+cns_net_poll_r(cns_Runtime* cns, cns_Net* net, int timeoutMs, int* out_count);
+
+/** Queues `message` for sending; the connection holds a reference, so you may free it right away. Fails with
+ * CNS_ERR_BUSY, queuing nothing, while the queue holds `maxQueued` bytes or more.
+ */
+void
+cns_netconn_send(cns_Runtime* cns, cns_NetConn* conn, cns_Bytes* message);
+
+/**
+ */
+cns_Error
+cns_netconn_send_r(cns_Runtime* cns, cns_NetConn* conn, cns_Bytes* message);
+
+/** Stops or resumes reading from the connection.
+ */
+void
+cns_netconn_pause(cns_Runtime* cns, cns_NetConn* conn, cns_Bool paused);
+
+/** Closes the connection, dropping what it has not sent; the close callback is called. The connection is freed by the
+ * next poll, and must not be used once closed.
+ */
+void
+cns_netconn_close(cns_Runtime* cns, cns_NetConn* conn);
+
+/** Bytes queued for sending.
+ */
+cns_Index
+cns_netconn_queued(cns_Runtime* cns, cns_NetConn* conn);
+
+/** A value of yours kept with the connection; NULL at first.
+ */
+void*
+cns_netconn_context(cns_NetConn* conn);
+
+/**
+ */
+void
+cns_netconn_setContext(cns_NetConn* conn, void* context);
+
+typedef struct cns_NetStats
+{
+    uint64_t    messagesSent;
+    uint64_t    bytesSent;
+    uint64_t    messagesReceived;
+    uint64_t    bytesReceived;
+    /** `sendmsg` and `read` calls. */
+    uint64_t    writeCalls;
+    uint64_t    readCalls;
+    /** Receive blocks taken from the pool again, and blocks allocated. */
+    uint64_t    blocksReused;
+    uint64_t    blocksAllocated;
+    /** Sends which failed with CNS_ERR_BUSY. */
+    uint64_t    busy;
+} cns_NetStats;
+
+/**
+ */
+void
+cns_net_stats(cns_Runtime* cns, cns_Net* net, cns_NetStats* out_stats);
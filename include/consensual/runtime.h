@@ -4,6 +4,8 @@
 
 
 /**
+ * Functions report errors through `cns_lasterr`. Those with the `_r` suffix return the error code instead and never touch
+ * the last error, which makes them the cheaper choice in hot loops.
  * @see cns_lasterr
  */
 typedef uint8_t cns_Error;
@@ -11,6 +13,10 @@ typedef uint8_t cns_Error;
 #define CNS_OK 0
 #define CNS_ERR_BADARG 1
 #define CNS_ERR_NOMEM 2
+#define CNS_ERR_MALFORMED 3
+#define CNS_ERR_IO 4
+#define CNS_ERR_UNSUPPORTED 5
+#define CNS_ERR_BUSY 6
 
 
 /**
@@ -80,21 +86,108 @@ cns_shutdown(cns_Runtime* cns);
 void *
 cns_runtime_alloc(cns_Runtime*, cns_Index size);
 
+/**
+ */
+cns_Error
+cns_runtime_alloc_r(cns_Runtime*, cns_Index size, void** out_ptr);
+
 /**
  * If `ptr` is null, succeeds without doing anything.
  */
 void
 cns_runtime_free(cns_Runtime*, void* ptr);
 
+/**
+ */
+cns_Error
+cns_runtime_free_r(cns_Runtime*, void* ptr);
+
 /**
  */
 void *
 cns_runtime_realloc(cns_Runtime*, void* ptr, cns_Index size);
 
-
 /**
  */
 cns_Error
+cns_runtime_realloc_r(cns_Runtime*, void* ptr, cns_Index size, void** out_ptr);
+
+
+/** What memory is for, as the allocation profile tells it apart. Memory allocated through `cns_runtime_alloc` and
+ * friends is counted as CNS_ALLOC_OTHER.
+ */
+#define CNS_ALLOC_OTHER 0
+/** Bytes objects with their content. */
+#define CNS_ALLOC_BYTES 1
+/** Items and kept versions of memory storages. */
+#define CNS_ALLOC_STORAGE_ITEM 2
+/** Bucket arrays of memory storages and their intern and version tables. */
+#define CNS_ALLOC_STORAGE_TABLE 3
+/** Everything else of storages: batches, views, watches, caches, snapshot buffers. */
+#define CNS_ALLOC_STORAGE 4
+/** LSM storages, with their opened tables and what their background threads build; their memory tables count as
+ * memory storages.
+ */
+#define CNS_ALLOC_LSM 5
+/** The block cache, with the blocks in it. */
+#define CNS_ALLOC_BLOCKCACHE 6
+/** File IO and snapshot streams. */
+#define CNS_ALLOC_IO 7
+/** Hosts and nets. */
+#define CNS_ALLOC_REPLICATION 8
+#define CNS_ALLOC_CATEGORIES 9
+
+#define CNS_ALLOC_SIZE_BUCKETS 32
+
+typedef struct cns_AllocCategoryProfile
+{
+    /** Allocations and frees; a reallocation counts as one of each. */
+    uint64_t    allocs;
+    uint64_t    frees;
+    /** Allocated and not freed yet. */
+    int64_t     liveBytes;
+    int64_t     liveCount;
+    /** `sizes[i]` is the number of allocations of [2^i, 2^(i+1)) bytes; the last one counts all larger ones. */
+    uint64_t    sizes[CNS_ALLOC_SIZE_BUCKETS];
+} cns_AllocCategoryProfile;
+
+/** Where the memory of a runtime goes.
+ *
+ * Only collected when the library is built with the CNS_ALLOC_PROFILE option, otherwise everything is zero and
+ * `instrumented` is `CNS_NO`. Profiling puts a 16-byte header in front of each allocation, which records its category and
+ * size for the free, and counts in shards picked by thread, so that threads allocating at once do not share counters.
+ * The header keeps memory 16-byte aligned, as malloc does, but an allocator which aligns further only gets 16-byte
+ * alignment through to the library.
+ */
+typedef struct cns_AllocProfile
+{
+    cns_Bool                    instrumented;
+    cns_AllocCategoryProfile    categories[CNS_ALLOC_CATEGORIES];
+} cns_AllocProfile;
+
+/** Fills `out_profile` with the counters so far. Allocations made while this runs may be counted or not.
+ */
+void
+cns_runtime_allocProfile(cns_Runtime* cns, cns_AllocProfile* out_profile);
+
+/** Name of a category, such as "storage item"; NULL for numbers which are none.
+ */
+const char *
+cns_alloccategory_name(int category);
+
+/** Writes a table of `profile`, one line per category which has seen any allocation, to `out`, and terminates it with
+ * a zero unless `size` is 0. Returns the length of the whole table, which is `size` or more if it was cut short, as
+ * `snprintf` does.
+ */
+cns_Index
+cns_allocprofile_format(const cns_AllocProfile* profile, char* out, cns_Index size);
+
+
+/** Result of the last call made on the calling thread.
+ *
+ * The error is kept per thread, like `errno`, so one runtime may be used by several threads at once.
+ */
+cns_Error
 cns_lasterr(cns_Runtime* cns);
 
 /**
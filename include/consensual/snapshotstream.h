@@ -0,0 +1,109 @@
+#pragma once
+
+#include "storage.h"
+
+/** Shipping the whole content of a memory storage to a follower that fell too far behind, a chunk at a time.
+ *
+ * The sender captures the keys and values when it is created, holding a reference to each rather than copying them, so
+ * the storage may go on changing while the transfer runs. It then cuts the stream of records into chunks of a fixed
+ * size, each carrying its offset in the stream, the stream length and a CRC-32C, and keeps at most `window` chunks in
+ * flight until the receiver acknowledges them.
+ *
+ * The receiver takes chunks in stream order and fills a storage of its own, so memory never holds more than that storage
+ * and a record being assembled. Its offset is what to acknowledge, and where to resume after a chunk is lost, damaged or
+ * delayed: chunks at other offsets are ignored, and the sender rewinds to the offset. When complete, the received
+ * content is swapped into the follower's storage in one step.
+ *
+ * Values stored compressed travel and land compressed. Only memory storages can be sent and received into.
+ */
+typedef struct cns_SnapshotSender cns_SnapshotSender;
+typedef struct cns_SnapshotReceiver cns_SnapshotReceiver;
+
+/** Bytes a chunk takes beyond its payload. */
+#define CNS_SNAPSHOT_CHUNKHEADER 24
+
+/** Captures the content of `storage` for sending in chunks of up to `chunkSize` payload bytes, at most `window` of them
+ * unacknowledged at a time.
+ */
+cns_SnapshotSender*
+cns_snapshotsender_new(cns_Runtime* cns, cns_Storage* storage, cns_Index chunkSize, int window);
+
+/**
+ */
+void
+cns_snapshotsender_free(cns_Runtime* cns, cns_SnapshotSender* sender);
+
+/** Next chunk to send, which you own and must free; NULL with CNS_OK once the window is full or everything was sent.
+ */
+cns_Bytes*
+cns_snapshotsender_next(cns_Runtime* cns, cns_SnapshotSender* sender);
+
+/**
+ */
+cns_Error
+cns_snapshotsender_next_r(cns_Runtime* cns, cns_SnapshotSender* sender, cns_Bytes** out_chunk);
+
+/** Records that the receiver has the stream up to `offset`, freeing room in the window. Older offsets are ignored.
+ */
+void
+cns_snapshotsender_ack(cns_Runtime* cns, cns_SnapshotSender* sender, uint64_t offset);
+
+/** Makes the following chunks start again at `offset`, the receiver's offset after a chunk went missing. It must be an
+ * offset acknowledged last or a chunk boundary after it.
+ */
+void
+cns_snapshotsender_rewind(cns_Runtime* cns, cns_SnapshotSender* sender, uint64_t offset);
+
+/** Whether the receiver acknowledged the whole stream.
+ */
+cns_Bool
+cns_snapshotsender_done(cns_Runtime* cns, cns_SnapshotSender* sender);
+
+/** Stream length; the payloads of all chunks add up to it.
+ */
+uint64_t
+cns_snapshotsender_length(cns_Runtime* cns, cns_SnapshotSender* sender);
+
+/** Starts receiving into a new storage hashing keys with `byteshashfn`, which must be that of the storage to install into.
+ * Pass `NULL` for the default one.
+ */
+cns_SnapshotReceiver*
+cns_snapshotreceiver_new(cns_Runtime* cns, cns_Storage_BytesHash32Fn byteshashfn);
+
+/** Frees the receiver with what it has received and not installed.
+ */
+void
+cns_snapshotreceiver_free(cns_Runtime* cns, cns_SnapshotReceiver* receiver);
+
+/** Takes a chunk. A chunk at another offset than the receiver's is ignored; a damaged one fails with CNS_ERR_MALFORMED
+ * and is ignored too. A stream which does not decode fails with CNS_ERR_MALFORMED for good.
+ */
+void
+cns_snapshotreceiver_put(cns_Runtime* cns, cns_SnapshotReceiver* receiver, cns_Bytes* chunk);
+
+/**
+ */
+cns_Error
+cns_snapshotreceiver_put_r(cns_Runtime* cns, cns_SnapshotReceiver* receiver, cns_Bytes* chunk);
+
+/** Length of the stream received so far: what to acknowledge, and where the sender resumes.
+ */
+uint64_t
+cns_snapshotreceiver_offset(cns_Runtime* cns, cns_SnapshotReceiver* receiver);
+
+/** Whether the whole stream was received.
+ */
+cns_Bool
+cns_snapshotreceiver_complete(cns_Runtime* cns, cns_SnapshotReceiver* receiver);
+
+/** Replaces the keys and values of `storage` by those received, at once; its previous content is freed. The stream must
+ * be complete, and `storage` a memory storage hashing keys the way the receiver does, with no pinned views. Then only
+ * freeing the receiver is left to do.
+ */
+void
+cns_snapshotreceiver_install(cns_Runtime* cns, cns_SnapshotReceiver* receiver, cns_Storage* storage);
+
+/**
+ */
+cns_Error
+cns_snapshotreceiver_install_r(cns_Runtime* cns, cns_SnapshotReceiver* receiver, cns_Storage* storage);
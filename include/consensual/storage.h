@@ -9,42 +9,423 @@ typedef struct cns_Storage cns_Storage;
  */
 typedef uint32_t (* cns_Storage_BytesHash32Fn)(cns_Runtime* cns, cns_Bytes* bytes);
 
-/** The default 32-bit hash function.
+/** The default 32-bit hash function, based on CRC-32C.
  */
 uint32_t
 cns_storage_defaultBytesHash32(cns_Runtime* cns, cns_Bytes* bytes);
 
+/** Bob Jenkins' one-at-a-time hash, the default before CRC-32C; slow on long keys.
+ */
+uint32_t
+cns_storage_jenkinsBytesHash32(cns_Runtime* cns, cns_Bytes* bytes);
+
 /** Creates simplest storage which holds everything in memory.
  * @param byteshashfn   Hash function. Pass `NULL` to use the default one.
  */
 cns_Storage*
 cns_storage_newMemoryStorage(cns_Runtime* cns, cns_Storage_BytesHash32Fn byteshashfn);
 
+/** Creates a memory storage with room for `capacity` values, so that filling it up to that point never resizes.
+ */
+cns_Storage*
+cns_storage_newMemoryStorageWithCapacity(cns_Runtime* cns, cns_Storage_BytesHash32Fn byteshashfn, cns_Index capacity);
+
 /**
  */
 void
 cns_storage_free(cns_Runtime* cns, cns_Storage* storage);
 
+/**
+ */
+cns_Error
+cns_storage_free_r(cns_Runtime* cns, cns_Storage* storage);
+
+/** Grows the storage to hold `capacity` values without further resizing. Never shrinks it.
+ */
+void
+cns_storage_reserve(cns_Runtime* cns, cns_Storage* storage, cns_Index capacity);
+
+/**
+ */
+cns_Error
+cns_storage_reserve_r(cns_Runtime* cns, cns_Storage* storage, cns_Index capacity);
+
+/** Sets `count` values at once, same as calling `cns_storage_set` for each pair in order.
+ *
+ * The storage is resized once up front. With `numThreads` above 1 and enough pairs, keys are hashed on that many
+ * threads, so the hash function must be safe to call concurrently (the default one is). Placing the items happens on the
+ * calling thread, as does joining concatenated keys for hash functions other than the default one, so allocation
+ * functions are never called concurrently. Feed a stream through repeated calls.
+ */
+void
+cns_storage_bulkSet(cns_Runtime* cns, cns_Storage* storage, cns_Bytes** keys, cns_Bytes** values, cns_Index count, int numThreads);
+
+/**
+ */
+cns_Error
+cns_storage_bulkSet_r(cns_Runtime* cns, cns_Storage* storage, cns_Bytes** keys, cns_Bytes** values, cns_Index count, int numThreads);
+
+/** Writes every key and value of a memory storage to `fd`, starting at its file position and leaving it at the end.
+ *
+ * The table is split into ranges of buckets which up to `numThreads` threads encode and write at once, each into its own
+ * segment of the file, so a fast device is kept busy. Compressed values are written as they are. Every segment and the
+ * header carry a CRC-32C. The file is not synced. The storage must not change while this runs; the hash function is not
+ * called, and allocation functions are only called from the calling thread.
+ */
+void
+cns_storage_writeSnapshot(cns_Runtime* cns, cns_Storage* storage, int fd, int numThreads);
+
+/**
+ */
+cns_Error
+cns_storage_writeSnapshot_r(cns_Runtime* cns, cns_Storage* storage, int fd, int numThreads);
+
+/** Loads a snapshot written by `cns_storage_writeSnapshot` from `fd` into an empty memory storage with no pinned views,
+ * starting at the file position and leaving it past the snapshot.
+ *
+ * The table takes the size it had when written, and up to `numThreads` threads read, check and place the segments, each
+ * into its own range of buckets; the hash function must be safe to call concurrently, as for `cns_storage_bulkSet`.
+ * Allocation happens on the calling thread only. A damaged snapshot fails with CNS_ERR_MALFORMED and leaves the storage
+ * empty. Restored keys and values are not interned.
+ */
+void
+cns_storage_readSnapshot(cns_Runtime* cns, cns_Storage* storage, int fd, int numThreads);
+
+/**
+ */
+cns_Error
+cns_storage_readSnapshot_r(cns_Runtime* cns, cns_Storage* storage, int fd, int numThreads);
+
+/** What `cns_storage_setInterning` deduplicates. */
+enum
+{
+    CNS_STORAGE_INTERN_KEYS     = 1,
+    CNS_STORAGE_INTERN_VALUES   = 2,
+};
+
+/** Makes the storage keep a single copy of equal keys and/or values it is given from now on.
+ *
+ * Keys and values with the same content then share one block, at the cost of hashing and comparing them on insertion.
+ * Copies which are only held by the interning table are dropped when it grows or when the storage shrinks. Passing 0
+ * turns interning off and releases the table; values already stored stay shared.
+ */
+void
+cns_storage_setInterning(cns_Runtime* cns, cns_Storage* storage, unsigned flags);
+
+/**
+ */
+cns_Error
+cns_storage_setInterning_r(cns_Runtime* cns, cns_Storage* storage, unsigned flags);
+
+/** Returns the interned Bytes with the given content, allocating only if the storage has not seen it yet.
+ * Meant for decoders, to skip allocating keys and values that are already present. Works whether interning is on or not.
+ * The result must be freed by the caller.
+ */
+cns_Bytes*
+cns_storage_intern(cns_Runtime* cns, cns_Storage* storage, const void * ptr, cns_Index size);
+
+/**
+ */
+cns_Error
+cns_storage_intern_r(cns_Runtime* cns, cns_Storage* storage, const void * ptr, cns_Index size, cns_Bytes** out_bytes);
+
+/** Makes the storage compress the values of at least `threshold` bytes it is given from now on, in the LZ4 format.
+ *
+ * Values which do not shrink by at least an eighth are stored as they are. Every `cns_storage_get` of a compressed value
+ * decompresses it into a new block, unless it is in a cache of `cachedValues` recently decompressed values, which may be
+ * 0. Passing 0 as `threshold` stops compressing; values compressed already stay so.
+ *
+ * Entries hand out the stored value itself, so values written through them are never compressed, and
+ * `cns_storage_entryValue` fails with CNS_ERR_UNSUPPORTED for a value compressed by another write.
+ */
+void
+cns_storage_setCompression(cns_Runtime* cns, cns_Storage* storage, cns_Index threshold, cns_Index cachedValues);
+
+/**
+ */
+cns_Error
+cns_storage_setCompression_r(cns_Runtime* cns, cns_Storage* storage, cns_Index threshold, cns_Index cachedValues);
+
 /** Set value for key.
  * Both key and value are copied. If there was a previous value for this key, it is replaced.
  */
 void
 cns_storage_set(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bytes* value);
 
+/**
+ */
+cns_Error
+cns_storage_set_r(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bytes* value);
+
 /** Get value for key.
  * The returned value is a copy, you own it and must free it. If there is no value for this key, NULL is returned, and the error is set to CNS_ERR_NOTFOUND.
  */
 cns_Bytes*
 cns_storage_get(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key);
 
+/** Stores NULL into `out_value` and returns CNS_OK if there is no value for this key.
+ */
+cns_Error
+cns_storage_get_r(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bytes** out_value);
+
 /** Deletes value for key.
  * Returns `CNS_YES` if value existed for this key, `CNS_NO` if it didn't.
  */
 cns_Bool
 cns_storage_delete(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key);
 
+/**
+ * @param out_existed   Receives `CNS_YES` if value existed for this key; may be null.
+ */
+cns_Error
+cns_storage_delete_r(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bool* out_existed);
+
+/** Callback for `cns_storage_upsert`.
+ * @param current   Value stored for the key, or NULL if there is none. Borrowed, do not free it.
+ * @param context   Value passed to `cns_storage_upsert`.
+ * Returns the new value, whose ownership passes to the storage, or NULL to leave the storage as it is.
+ * The callback must not use the storage it was called for.
+ */
+typedef cns_Bytes* (* cns_Storage_UpsertFn)(cns_Runtime* cns, cns_Bytes* key, cns_Bytes* current, void* context);
+
+/** Replaces the value for key with the one computed by `fn` from the current value, looking the key up only once.
+ * Inserts the key if there was no value for it and `fn` returns one.
+ */
+void
+cns_storage_upsert(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Storage_UpsertFn fn, void* context);
+
+/**
+ */
+cns_Error
+cns_storage_upsert_r(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Storage_UpsertFn fn, void* context);
+
+/** Handle to a key and its value inside a storage.
+ * It stays valid until the key is deleted or the storage is freed; resizing the storage does not affect it.
+ */
+typedef struct cns_StorageEntry cns_StorageEntry;
+
+/** Finds the entry for key, inserting one holding a copy of `value` if there is none.
+ * @param out_inserted  Receives `CNS_YES` if the entry was created by this call; may be null.
+ */
+cns_StorageEntry*
+cns_storage_getOrInsert(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bytes* value, cns_Bool* out_inserted);
+
+/**
+ */
+cns_Error
+cns_storage_getOrInsert_r(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bytes* value, cns_StorageEntry** out_entry, cns_Bool* out_inserted);
+
+/** Key of the entry. Borrowed, do not free it.
+ */
+cns_Bytes*
+cns_storage_entryKey(cns_Runtime* cns, cns_StorageEntry* entry);
+
+/** Current value of the entry. Borrowed and valid until the value is replaced; copy it to keep it longer.
+ */
+cns_Bytes*
+cns_storage_entryValue(cns_Runtime* cns, cns_StorageEntry* entry);
+
+/** Replaces the value of the entry; `value` is copied.
+ */
+void
+cns_storage_entrySetValue(cns_Runtime* cns, cns_Storage* storage, cns_StorageEntry* entry, cns_Bytes* value);
+
+/** Sets and deletes to apply to a storage all at once.
+ *
+ * Each write to a memory storage, or each batch of them, is a commit numbered by the storage's sequence. Either all the
+ * writes of a batch are applied, or none when it fails; a view pinned before sees none of them, one pinned after sees
+ * them all. Later writes to the same key in a batch win over earlier ones.
+ */
+typedef struct cns_StorageBatch cns_StorageBatch;
+
+/**
+ */
+cns_StorageBatch*
+cns_storagebatch_new(cns_Runtime* cns);
+
+/**
+ */
+cns_Error
+cns_storagebatch_new_r(cns_Runtime* cns, cns_StorageBatch** out_batch);
+
+/**
+ */
+void
+cns_storagebatch_free(cns_Runtime* cns, cns_StorageBatch* batch);
+
+/**
+ */
+cns_Error
+cns_storagebatch_free_r(cns_Runtime* cns, cns_StorageBatch* batch);
+
+/** Adds the setting of `key` to `value`; both are copied.
+ */
+void
+cns_storagebatch_set(cns_Runtime* cns, cns_StorageBatch* batch, cns_Bytes* key, cns_Bytes* value);
+
+/**
+ */
+cns_Error
+cns_storagebatch_set_r(cns_Runtime* cns, cns_StorageBatch* batch, cns_Bytes* key, cns_Bytes* value);
+
+/** Adds the deletion of `key`, which is copied.
+ */
+void
+cns_storagebatch_delete(cns_Runtime* cns, cns_StorageBatch* batch, cns_Bytes* key);
+
+/**
+ */
+cns_Error
+cns_storagebatch_delete_r(cns_Runtime* cns, cns_StorageBatch* batch, cns_Bytes* key);
+
+/** Number of writes in the batch.
+ */
+cns_Index
+cns_storagebatch_count(cns_Runtime* cns, cns_StorageBatch* batch);
+
+/**
+ */
+cns_Error
+cns_storagebatch_count_r(cns_Runtime* cns, cns_StorageBatch* batch, cns_Index* out_count);
+
+/** Empties the batch so that it can be filled again, keeping its memory.
+ */
+void
+cns_storagebatch_clear(cns_Runtime* cns, cns_StorageBatch* batch);
+
+/**
+ */
+cns_Error
+cns_storagebatch_clear_r(cns_Runtime* cns, cns_StorageBatch* batch);
+
+/** Applies the writes of the batch in order, as one commit. Memory storages only.
+ */
+void
+cns_storage_apply(cns_Runtime* cns, cns_Storage* storage, cns_StorageBatch* batch);
+
+/**
+ */
+cns_Error
+cns_storage_apply_r(cns_Runtime* cns, cns_Storage* storage, cns_StorageBatch* batch);
+
+/** Applies `count` batches in order, as `count` commits, with the same outcome as applying each with `cns_storage_apply`.
+ *
+ * With `numThreads` above 1 and enough writes, keys are hashed on that many threads, and each thread then makes the
+ * writes whose keys fall into its own range of buckets, in log order. Writes to one key are thus never reordered, while
+ * writes to unrelated keys go on at once; the hash function must be safe to call concurrently, as for
+ * `cns_storage_bulkSet`. Allocation happens on the calling thread only, joining concatenated keys for hash functions
+ * other than the default one included. Storages with watches, pinned views, compression, interning or tracked hot keys
+ * apply the batches one by one on the calling thread. On failure the storage holds the outcome of some leading batches,
+ * possibly none. Memory storages only.
+ */
+void
+cns_storage_applyBatches(cns_Runtime* cns, cns_Storage* storage, cns_StorageBatch** batches, cns_Index count, int numThreads);
+
+/**
+ */
+cns_Error
+cns_storage_applyBatches_r(cns_Runtime* cns, cns_Storage* storage, cns_StorageBatch** batches, cns_Index count, int numThreads);
+
+/** Sequence number of the last commit; 0 for a new storage. Memory storages only.
+ */
+uint64_t
+cns_storage_sequence(cns_Runtime* cns, cns_Storage* storage);
+
+/** The content of a storage as of a commit, for as long as the view is pinned.
+ *
+ * Writers do not wait for views: a write that replaces or deletes a value some pinned view still sees keeps the old value
+ * aside, and the values kept for a view are released when the last view needing them is unpinned. Like gets, reads
+ * through views may run on several threads at once, but not while the storage is written to. Unpin every view before
+ * freeing the storage.
+ */
+typedef struct cns_StorageView cns_StorageView;
+
+/** Pins a view of the storage as of its last commit. Memory storages only.
+ */
+cns_StorageView*
+cns_storage_pin(cns_Runtime* cns, cns_Storage* storage);
+
+/**
+ */
+void
+cns_storage_unpin(cns_Runtime* cns, cns_StorageView* view);
+
+/** Sequence number of the commit the view shows.
+ */
+uint64_t
+cns_storage_viewSequence(cns_Runtime* cns, cns_StorageView* view);
+
+/** Value for key as of the view's commit, or NULL. You must free it.
+ */
+cns_Bytes*
+cns_storage_viewGet(cns_Runtime* cns, cns_StorageView* view, cns_Bytes* key);
+
+/**
+ */
+cns_Error
+cns_storage_viewGet_r(cns_Runtime* cns, cns_StorageView* view, cns_Bytes* key, cns_Bytes** out_value);
+
 /** Number of values currently in storage.
  */
 cns_Index
 cns_storage_count(cns_Runtime* cns, cns_Storage* storage);
 
+
+
+#define CNS_STATS_CHAIN_BUCKETS 16
+#define CNS_STATS_PROBE_BUCKETS 16
+#define CNS_STATS_LATENCY_BUCKETS 32
+
+/** Statistics of a storage.
+ *
+ * The shape of the table is always reported. Operation counters and latencies are only collected when the library is
+ * built with the CNS_STATS option, otherwise they are zero and `instrumented` is `CNS_NO`.
+ */
+typedef struct cns_StorageStats
+{
+    cns_Index   count;
+    cns_Index   numBuckets;
+    double      loadFactor;
+    /** `chainLengths[i]` is the number of buckets holding `i` items; the last one counts all longer chains. */
+    cns_Index   chainLengths[CNS_STATS_CHAIN_BUCKETS];
+    cns_Index   longestChain;
+
+    cns_Bool    instrumented;
+    uint64_t    gets;
+    uint64_t    sets;
+    uint64_t    deletes;
+    /** `getLatency[i]` is the number of gets which took [2^i, 2^(i+1)) nanoseconds; same for sets and deletes. */
+    uint64_t    getLatency[CNS_STATS_LATENCY_BUCKETS];
+    uint64_t    setLatency[CNS_STATS_LATENCY_BUCKETS];
+    uint64_t    deleteLatency[CNS_STATS_LATENCY_BUCKETS];
+    /** `probes[i]` is the number of lookups that skipped `i` chain items before finding the key or giving up. */
+    uint64_t    probes[CNS_STATS_PROBE_BUCKETS];
+    uint64_t    resizes;
+    uint64_t    resizeNanoseconds;
+    uint64_t    allocFailures;
+
+    /** Distinct byte strings in the interning table, and the memory they take. */
+    cns_Index   internedCount;
+    cns_Index   internedBytes;
+    /** Estimated memory saved by sharing, from the number of references to each interned block. */
+    cns_Index   internSavedBytes;
+
+    /** Values stored compressed, their length as stored and before compression; the ratio is the latter over the former. */
+    cns_Index   compressedCount;
+    cns_Index   compressedBytes;
+    cns_Index   uncompressedBytes;
+    /** Gets of compressed values, how many of them the cache of decompressed values served, and the time the others
+     * spent decompressing. */
+    uint64_t    compressedGets;
+    uint64_t    decompressCacheHits;
+    uint64_t    decompressNanoseconds;
+
+    /** Pinned views, and the superseded values kept for them. */
+    cns_Index   pinnedViews;
+    cns_Index   retainedVersions;
+} cns_StorageStats;
+
+/** Fills `out_stats`. Walks the whole table, so it is not meant to be called often.
+ */
+void
+cns_storage_stats(cns_Runtime* cns, cns_Storage* storage, cns_StorageStats* out_stats);
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "storage.h"
+
+/** Traces of storage operations, recorded from a live storage and replayed offline.
+ *
+ * A trace follows `cns_storage_set`, `cns_storage_get` and `cns_storage_delete` on one storage of any engine, and writes a
+ * record of each to a file: the operation, its start time and duration, the thread which made it, a 64-bit hash and the
+ * length of the key, the length of the value set or found, and whether a get found a value or a delete removed one.
+ * Keys and the values of sets are left out unless asked for, so that traces of private data can leave the machine; the
+ * hash still tells keys apart. A record takes about 15 bytes without them. Batches, bulk sets and upserts are not traced.
+ *
+ * Records collect in a buffer that is written out when it fills up, under a lock which is only taken while tracing, so
+ * gets made on several threads at once are all recorded. Storages which are not traced only check a pointer. Start and
+ * stop traces while no other thread uses the storage.
+ *
+ * The `runreplay` program replays a trace against a storage of any engine and reports throughput and latencies.
+ *
+ * File format: "CNSTRACE", varints for the version (1) and the options (1 for keys, 2 for values), then the wall clock
+ * time the trace started in nanoseconds, 8 bytes little endian. Then records: a byte holding the operation and its flags,
+ * varints for the start time as a zigzag difference from the start of the record before, for the duration in nanoseconds
+ * and for the thread, the key hash in 8 bytes little endian, varints for the key length and for the value length of sets
+ * and of gets which found a value, then the key and the value of a set if the trace has them.
+ */
+typedef struct cns_Trace cns_Trace;
+
+#define CNS_TRACE_SET 1
+#define CNS_TRACE_GET 2
+#define CNS_TRACE_DELETE 3
+
+typedef struct cns_TraceOptions
+{
+    /** Whether to record keys, and the values of sets. */
+    cns_Bool    keys;
+    cns_Bool    values;
+    /** Size of the buffer collecting records. */
+    cns_Index   bufferSize;
+} cns_TraceOptions;
+
+/** Fills `out_options` with the defaults: no keys, no values, a 1 MiB buffer.
+ */
+void
+cns_traceoptions_default(cns_TraceOptions* out_options);
+
+/** Creates the file at `path`, replacing any, and starts tracing `storage` into it. A storage has one trace at most.
+ * @param options   Pass `NULL` for the defaults.
+ */
+cns_Trace*
+cns_trace_start(cns_Runtime* cns, cns_Storage* storage, const char * path, const cns_TraceOptions* options);
+
+/** Stops tracing, writes out what is buffered, closes the file and frees the trace. Reports CNS_ERR_IO if any write to
+ * the file failed, in which case the records from then on were dropped.
+ */
+void
+cns_trace_stop(cns_Runtime* cns, cns_Trace* trace);
+
+/**
+ */
+cns_Error
+cns_trace_stop_r(cns_Runtime* cns, cns_Trace* trace);
+
+typedef struct cns_TraceStats
+{
+    uint64_t    records;
+    /** Written to the file or still buffered, header included. */
+    uint64_t    bytes;
+    /** Lost to a failed write. */
+    uint64_t    dropped;
+} cns_TraceStats;
+
+/**
+ */
+void
+cns_trace_stats(cns_Runtime* cns, cns_Trace* trace, cns_TraceStats* out_stats);
+
+/** 64-bit hash of a key, as traces record it.
+ */
+uint64_t
+cns_trace_hashKey(cns_Runtime* cns, cns_Bytes* key);
+
+
+typedef struct cns_TraceReader cns_TraceReader;
+
+typedef struct cns_TraceRecord
+{
+    /** One of the CNS_TRACE_ operations. */
+    int         op;
+    /** Whether a get found a value or a delete removed one. */
+    cns_Bool    hit;
+    /** Whether the operation failed. */
+    cns_Bool    failed;
+    /** Start, in nanoseconds since the trace started. */
+    uint64_t    time;
+    uint64_t    duration;
+    /** Small number telling the threads of the traced process apart. */
+    uint32_t    thread;
+    uint64_t    keyHash;
+    cns_Index   keyLength;
+    /** Of the value set or found; 0 for misses and deletes. */
+    cns_Index   valueLength;
+    /** NULL unless the trace has them; yours to free. */
+    cns_Bytes*  key;
+    cns_Bytes*  value;
+} cns_TraceRecord;
+
+/** Opens the trace written at `path`.
+ */
+cns_TraceReader*
+cns_tracereader_open(cns_Runtime* cns, const char * path);
+
+/**
+ */
+void
+cns_tracereader_close(cns_Runtime* cns, cns_TraceReader* reader);
+
+/** Fills `out_options` with what the trace was recorded with; the buffer size is 0.
+ */
+void
+cns_tracereader_options(cns_TraceReader* reader, cns_TraceOptions* out_options);
+
+/** Reads the next record into `out_record`. Returns `CNS_NO` at the end of the trace, with the last error CNS_OK, or if
+ * the file is damaged or cut short, with CNS_ERR_MALFORMED.
+ */
+cns_Bool
+cns_tracereader_next(cns_Runtime* cns, cns_TraceReader* reader, cns_TraceRecord* out_record);
+
+/**
+ */
+cns_Error
+cns_tracereader_next_r(cns_Runtime* cns, cns_TraceReader* reader, cns_TraceRecord* out_record, cns_Bool* out_more);
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "runtime.h"
+#include "bytes.h"
+
+/** In-memory storage keyed by 64-bit integers.
+ *
+ * Keys are kept unboxed in an open-addressing table together with the value pointers, so lookups hash with an integer
+ * mixer and compare keys as integers instead of going through `cns_Bytes`. Values are `cns_Bytes`, copied the same way
+ * as by `cns_Storage`.
+ */
+typedef struct cns_U64Storage cns_U64Storage;
+
+/** Creates an empty storage with room for `capacity` values before it has to grow; 0 picks a small default.
+ */
+cns_U64Storage*
+cns_u64storage_new(cns_Runtime* cns, cns_Index capacity);
+
+/**
+ */
+void
+cns_u64storage_free(cns_Runtime* cns, cns_U64Storage* storage);
+
+/** Set value for key. The value is copied. If there was a previous value for this key, it is replaced.
+ */
+void
+cns_u64storage_set(cns_Runtime* cns, cns_U64Storage* storage, uint64_t key, cns_Bytes* value);
+
+/**
+ */
+cns_Error
+cns_u64storage_set_r(cns_Runtime* cns, cns_U64Storage* storage, uint64_t key, cns_Bytes* value);
+
+/** Get value for key. The returned value is a copy which the caller must free; NULL if there is no value for the key.
+ */
+cns_Bytes*
+cns_u64storage_get(cns_Runtime* cns, cns_U64Storage* storage, uint64_t key);
+
+/** Stores NULL into `out_value` and returns CNS_OK if there is no value for this key.
+ */
+cns_Error
+cns_u64storage_get_r(cns_Runtime* cns, cns_U64Storage* storage, uint64_t key, cns_Bytes** out_value);
+
+/** Deletes value for key. Returns `CNS_YES` if value existed for this key, `CNS_NO` if it didn't.
+ */
+cns_Bool
+cns_u64storage_delete(cns_Runtime* cns, cns_U64Storage* storage, uint64_t key);
+
+/**
+ * @param out_existed   Receives `CNS_YES` if value existed for this key; may be null.
+ */
+cns_Error
+cns_u64storage_delete_r(cns_Runtime* cns, cns_U64Storage* storage, uint64_t key, cns_Bool* out_existed);
+
+/** Number of values currently in storage.
+ */
+cns_Index
+cns_u64storage_count(cns_Runtime* cns, cns_U64Storage* storage);
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "storage.h"
+
+/** Change feeds of a memory storage.
+ *
+ * A watch follows the writes to one key, or to every key starting with a prefix. Each write it matches becomes an event
+ * holding references to the key and to the values before and after, tagged with the sequence number of its commit; the
+ * events of a commit reach the consumer together, once the commit is over. They pass through a ring of fixed capacity
+ * which the writing thread fills and one consumer drains, possibly on another thread, without locks. When the ring is
+ * full the writer drops the event and counts it as missed rather than wait; the consumer learns how many it missed and can
+ * read the storage again to catch up. Replacing the whole content of the storage, as when installing a snapshot, counts
+ * as one missed event for every watch.
+ *
+ * Writes only check a pointer while nothing is watched. Values stored compressed are decompressed for matched writes only.
+ * Create and free watches on the thread writing to the storage, and free them before the storage. Freeing event
+ * references on another thread frees memory there, as with any Bytes object shared between threads.
+ */
+typedef struct cns_Watch cns_Watch;
+
+typedef struct cns_WatchEvent
+{
+    /** Commit which made the change; one commit, such as a batch, may make several. */
+    uint64_t    sequence;
+    cns_Bytes*  key;
+    /** NULL if the key had no value. */
+    cns_Bytes*  oldValue;
+    /** NULL if the key was deleted. */
+    cns_Bytes*  newValue;
+} cns_WatchEvent;
+
+/** Starts watching `key`, or every key starting with it if `prefix`; `key` is copied. The ring holds `capacity` events,
+ * rounded up to a power of two. Memory storages only.
+ */
+cns_Watch*
+cns_watch_new(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bool prefix, cns_Index capacity);
+
+/** Stops watching and drops the events not polled yet.
+ */
+void
+cns_watch_free(cns_Runtime* cns, cns_Watch* watch);
+
+/** Moves up to `max` events into `out`, oldest first, and returns how many. Their references are yours to free, for
+ * instance with `cns_watch_releaseEvents`. Only one thread may poll a watch at a time.
+ * @param out_missed    Receives the number of events dropped since the last poll; may be null.
+ */
+cns_Index
+cns_watch_poll(cns_Runtime* cns, cns_Watch* watch, cns_WatchEvent* out, cns_Index max, uint64_t* out_missed);
+
+/**
+ */
+cns_Error
+cns_watch_poll_r(cns_Runtime* cns, cns_Watch* watch, cns_WatchEvent* out, cns_Index max, cns_Index* out_count, uint64_t* out_missed);
+
+/** Frees the references held by `count` events.
+ */
+void
+cns_watch_releaseEvents(cns_Runtime* cns, cns_WatchEvent* events, cns_Index count);
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "runtime.h"
+#include "bytes.h"
+
+#include <sys/uio.h> // struct iovec
+
+/** Compact binary encoding for messages made of unsigned varints and length-prefixed byte strings.
+ *
+ * Integers are LEB128 varints (7 bits per byte, least significant group first). A byte string is its length as a varint
+ * followed by the bytes themselves. There are no tags or framing; the reader must know the order of fields.
+ */
+
+/** Maximum number of bytes a 64-bit varint occupies.
+ */
+#define CNS_WIRE_MAXVARINT 10
+
+/** Writes `value` into `out`, which must have room for `CNS_WIRE_MAXVARINT` bytes.
+ * Returns the number of bytes written.
+ */
+cns_Index
+cns_wire_encodeVarint(uint64_t value, uint8_t* out);
+
+/** Reads a varint from the first `size` bytes at `ptr`.
+ * Returns the number of bytes consumed, or 0 if the input is truncated or the varint is overlong.
+ */
+cns_Index
+cns_wire_decodeVarint(const uint8_t* ptr, cns_Index size, uint64_t* out_value);
+
+
+typedef struct cns_WireWriter cns_WireWriter;
+
+/** Creates an encoder producing scatter/gather output.
+ *
+ * Varints and short byte strings are packed into an internal buffer; longer `cns_Bytes` payloads are not copied, the writer
+ * keeps a reference and points an iovec entry straight at their memory.
+ */
+cns_WireWriter*
+cns_wirewriter_new(cns_Runtime* cns);
+
+/**
+ */
+void
+cns_wirewriter_free(cns_Runtime* cns, cns_WireWriter* writer);
+
+/** Forgets everything written so far and releases referenced payloads; allocated buffers are kept for reuse.
+ */
+void
+cns_wirewriter_reset(cns_Runtime* cns, cns_WireWriter* writer);
+
+/**
+ */
+void
+cns_wirewriter_putVarint(cns_Runtime* cns, cns_WireWriter* writer, uint64_t value);
+
+/** Writes length-prefixed `bytes`. The writer holds a reference, so you may free `bytes` right away.
+ */
+void
+cns_wirewriter_putBytes(cns_Runtime* cns, cns_WireWriter* writer, cns_Bytes* bytes);
+
+/** Writes length-prefixed `size` bytes copied from `ptr`.
+ */
+void
+cns_wirewriter_putRaw(cns_Runtime* cns, cns_WireWriter* writer, const void * ptr, cns_Index size);
+
+/** Total number of encoded bytes.
+ */
+cns_Index
+cns_wirewriter_length(cns_Runtime* cns, cns_WireWriter* writer);
+
+/** Encoded message as an array of iovec entries, suitable for `writev`.
+ * The array is owned by the writer and stays valid until the next call to any writer function.
+ */
+const struct iovec *
+cns_wirewriter_iov(cns_Runtime* cns, cns_WireWriter* writer, int* out_count);
+
+/** Encoded message as a single contiguous Bytes object; payloads are copied once, straight into it.
+ */
+cns_Bytes*
+cns_wirewriter_toBytes(cns_Runtime* cns, cns_WireWriter* writer);
+
+
+typedef struct cns_WireReader cns_WireReader;
+
+/** Creates a decoder over `message`. The reader holds a reference to it.
+ */
+cns_WireReader*
+cns_wirereader_new(cns_Runtime* cns, cns_Bytes* message);
+
+/**
+ */
+void
+cns_wirereader_free(cns_Runtime* cns, cns_WireReader* reader);
+
+/** Reads a varint.
+ * Returns `CNS_NO` at the end of the message (error is CNS_OK) or on malformed input (error is CNS_ERR_MALFORMED).
+ */
+cns_Bool
+cns_wirereader_getVarint(cns_Runtime* cns, cns_WireReader* reader, uint64_t* out_value);
+
+/** Reads a byte string.
+ * The result is a slice of the message, no payload is copied; you own it and must free it.
+ * Returns NULL at the end of the message (error is CNS_OK) or on malformed input (error is CNS_ERR_MALFORMED).
+ */
+cns_Bytes*
+cns_wirereader_getBytes(cns_Runtime* cns, cns_WireReader* reader);
+
+/** Number of bytes not consumed yet.
+ */
+cns_Index
+cns_wirereader_remaining(cns_Runtime* cns, cns_WireReader* reader);
@@ -0,0 +1,582 @@
+#include <consensual/blockcache.h>
+#include <consensual/bytes_impl.h>
+#include "runtime_impl.h"
+
+#include <string.h> // memset
+#include <pthread.h>
+
+// CLOCK-Pro (Jiang, Chen, Zhang, 2005) with sizes in bytes rather than pages.
+//
+// Each shard keeps its entries on one circular list, newest just behind the hot hand, which three hands sweep:
+//   cold hand  evicts cold blocks which were not used since it last passed; a used one is promoted to hot if it is in
+//              its test period, otherwise it starts a new one
+//   hot hand   demotes hot blocks which were not used since it last passed, and ends the test periods it passes
+//   test hand  forgets the oldest evicted blocks, so that they take at most the capacity
+// Evicted blocks stay on the list without their content until their test period ends. Inserting one of them again means
+// it was evicted too early: the cold share grows, and the block comes back hot. Test periods that end unused shrink it.
+
+#define _CNS_BLOCKCACHE_LOG2SHARDS 4
+#define _CNS_BLOCKCACHE_SHARDS (1 << _CNS_BLOCKCACHE_LOG2SHARDS)
+
+typedef struct _cns_BlockCacheEntry
+{
+    uint64_t                        owner;
+    uint64_t                        file;
+    uint64_t                        offset;
+    uint64_t                        hash;
+    cns_Bytes*                      block; // null once evicted
+    cns_Index                       size;
+    cns_Bool                        hot;
+    cns_Bool                        referenced;
+    cns_Bool                        test;
+    struct _cns_BlockCacheEntry*    prev;
+    struct _cns_BlockCacheEntry*    next;
+    struct _cns_BlockCacheEntry*    chain; // next in the hash bucket
+} _cns_BlockCacheEntry;
+
+typedef struct _cns_BlockCacheShard
+{
+    pthread_mutex_t         mutex;
+    _cns_BlockCacheEntry**  buckets;
+    int                     log2numbuckets;
+    cns_Index               numEntries;
+    _cns_BlockCacheEntry*   handHot; // null when the list is empty
+    _cns_BlockCacheEntry*   handCold;
+    _cns_BlockCacheEntry*   handTest;
+    cns_Index               capacity;
+    cns_Index               hotBytes;
+    cns_Index               coldBytes;
+    cns_Index               testBytes; // evicted blocks still on the list
+    cns_Index               coldTarget;
+    cns_Index               numResident;
+    cns_Index               numRemembered;
+    uint64_t                hits;
+    uint64_t                misses;
+    uint64_t                inserts;
+    uint64_t                evictions;
+    uint64_t                promotions;
+} _cns_BlockCacheShard;
+
+struct _cns_BlockCache
+{
+    _cns_BlockCacheShard    shards[_CNS_BLOCKCACHE_SHARDS];
+};
+
+static uint64_t _cns_blockcache_hash(uint64_t owner, uint64_t file, uint64_t offset)
+{
+    // MurmurHash3 fmix64 over a mix of the three parts
+    uint64_t key = owner * 0x9e3779b97f4a7c15ULL ^ file * 0xc2b2ae3d27d4eb4fULL ^ offset;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static _cns_BlockCacheShard* _cns_blockcache_shard(_cns_BlockCache* cache, uint64_t hash)
+{
+    return &cache->shards[hash >> (64 - _CNS_BLOCKCACHE_LOG2SHARDS)];
+}
+
+static _cns_BlockCacheEntry** _cns_blockcache_bucket(_cns_BlockCacheShard* shard, uint64_t hash)
+{
+    return &shard->buckets[hash & (((uint64_t) 1 << shard->log2numbuckets) - 1)];
+}
+
+static _cns_BlockCacheEntry* _cns_blockcache_find(_cns_BlockCacheShard* shard, uint64_t hash, uint64_t owner, uint64_t file, uint64_t offset)
+{
+    if (!shard->buckets)
+        return 0;
+
+    _cns_BlockCacheEntry* entry = *_cns_blockcache_bucket(shard, hash);
+    while (entry && !(entry->hash == hash && entry->owner == owner && entry->file == file && entry->offset == offset))
+        entry = entry->chain;
+    return entry;
+}
+
+// Links the entry in as the newest, which the hot hand reaches last
+static void _cns_blockcache_link(_cns_BlockCacheShard* shard, _cns_BlockCacheEntry* entry)
+{
+    if (!shard->handHot)
+    {
+        entry->prev = entry->next = entry;
+        shard->handHot = shard->handCold = shard->handTest = entry;
+        return;
+    }
+    entry->next = shard->handHot;
+    entry->prev = shard->handHot->prev;
+    entry->prev->next = entry;
+    entry->next->prev = entry;
+}
+
+static void _cns_blockcache_unlink(_cns_BlockCacheShard* shard, _cns_BlockCacheEntry* entry)
+{
+    if (entry->next == entry)
+    {
+        shard->handHot = shard->handCold = shard->handTest = 0;
+        return;
+    }
+    if (shard->handHot == entry)
+        shard->handHot = entry->next;
+    if (shard->handCold == entry)
+        shard->handCold = entry->next;
+    if (shard->handTest == entry)
+        shard->handTest = entry->next;
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+}
+
+// Drops the content of an entry; the entry itself stays
+static void _cns_blockcache_evict(cns_Runtime* cns, _cns_BlockCacheShard* shard, _cns_BlockCacheEntry* entry)
+{
+    if (entry->hot)
+        shard->hotBytes -= entry->size;
+    else
+        shard->coldBytes -= entry->size;
+    cns_bytes_free_r(cns, entry->block);
+    entry->block = 0;
+    --shard->numResident;
+}
+
+static void _cns_blockcache_remove(cns_Runtime* cns, _cns_BlockCacheShard* shard, _cns_BlockCacheEntry* entry)
+{
+    if (entry->block)
+        _cns_blockcache_evict(cns, shard, entry);
+    else
+    {
+        shard->testBytes -= entry->size;
+        --shard->numRemembered;
+    }
+    _cns_blockcache_unlink(shard, entry);
+
+    _cns_BlockCacheEntry** link = _cns_blockcache_bucket(shard, entry->hash);
+    while (*link != entry)
+        link = &(*link)->chain;
+    *link = entry->chain;
+    --shard->numEntries;
+    cns_runtime_free_r(cns, entry);
+}
+
+static void _cns_blockcache_shrinkColdTarget(_cns_BlockCacheShard* shard, cns_Index size)
+{
+    shard->coldTarget = shard->coldTarget > size ? shard->coldTarget - size : 0;
+}
+
+// Ends the test period of an entry the hot or test hand passes; forgets it if it was evicted
+static void _cns_blockcache_endTest(cns_Runtime* cns, _cns_BlockCacheShard* shard, _cns_BlockCacheEntry* entry)
+{
+    entry->test = CNS_NO;
+    _cns_blockcache_shrinkColdTarget(shard, entry->size);
+    if (!entry->block)
+        _cns_blockcache_remove(cns, shard, entry);
+}
+
+// Moves the hot hand until it demotes one block; returns CNS_NO if there is no hot block
+static cns_Bool _cns_blockcache_runHandHot(cns_Runtime* cns, _cns_BlockCacheShard* shard)
+{
+    // two rounds clear every reference bit, so a demotion happens within them
+    for (cns_Index steps = 2 * shard->numEntries; shard->hotBytes && steps >= 0; --steps)
+    {
+        _cns_BlockCacheEntry* entry = shard->handHot;
+        shard->handHot = entry->next;
+        if (entry->hot)
+        {
+            if (entry->referenced)
+                entry->referenced = CNS_NO;
+            else
+            {
+                entry->hot = CNS_NO;
+                shard->hotBytes -= entry->size;
+                shard->coldBytes += entry->size;
+                return CNS_YES;
+            }
+        }
+        else if (entry->test)
+            _cns_blockcache_endTest(cns, shard, entry);
+    }
+    return CNS_NO;
+}
+
+// Forgets the oldest evicted block
+static void _cns_blockcache_runHandTest(cns_Runtime* cns, _cns_BlockCacheShard* shard)
+{
+    for (cns_Index steps = shard->numEntries; shard->numRemembered && steps >= 0; --steps)
+    {
+        _cns_BlockCacheEntry* entry = shard->handTest;
+        shard->handTest = entry->next;
+        if (!entry->hot && entry->test)
+        {
+            cns_Bool remembered = !entry->block;
+            _cns_blockcache_endTest(cns, shard, entry);
+            if (remembered)
+                return;
+        }
+    }
+}
+
+static void _cns_blockcache_demoteHot(cns_Runtime* cns, _cns_BlockCacheShard* shard)
+{
+    while (shard->hotBytes > shard->capacity - shard->coldTarget && _cns_blockcache_runHandHot(cns, shard))
+    {
+    }
+}
+
+// Moves the cold hand until it evicts one block
+static void _cns_blockcache_runHandCold(cns_Runtime* cns, _cns_BlockCacheShard* shard)
+{
+    if (!shard->coldBytes)
+        _cns_blockcache_runHandHot(cns, shard);
+
+    // promotions and new test periods clear reference bits, so an eviction happens within a few rounds; past those,
+    // the block under the hand goes whatever its state
+    for (cns_Index steps = 4 * shard->numEntries; shard->handCold; --steps)
+    {
+        _cns_BlockCacheEntry* entry = shard->handCold;
+        shard->handCold = entry->next;
+        if (!entry->block || (entry->hot && steps > 0))
+            continue;
+
+        if (entry->referenced && steps > 0)
+        {
+            entry->referenced = CNS_NO;
+            if (entry->test)
+            {
+                entry->hot = CNS_YES;
+                entry->test = CNS_NO;
+                shard->coldBytes -= entry->size;
+                shard->hotBytes += entry->size;
+                ++shard->promotions;
+                _cns_blockcache_demoteHot(cns, shard);
+                if (!shard->coldBytes)
+                    _cns_blockcache_runHandHot(cns, shard);
+            }
+            else
+            {
+                // a new test period, starting from the newest position
+                entry->test = CNS_YES;
+                _cns_blockcache_unlink(shard, entry);
+                _cns_blockcache_link(shard, entry);
+            }
+            continue;
+        }
+
+        ++shard->evictions;
+        if (entry->test && !entry->hot)
+        {
+            _cns_blockcache_evict(cns, shard, entry);
+            shard->testBytes += entry->size;
+            ++shard->numRemembered;
+            while (shard->testBytes > shard->capacity && shard->numRemembered)
+                _cns_blockcache_runHandTest(cns, shard);
+        }
+        else
+            _cns_blockcache_remove(cns, shard, entry);
+        return;
+    }
+}
+
+static void _cns_blockcache_fit(cns_Runtime* cns, _cns_BlockCacheShard* shard)
+{
+    while (shard->hotBytes + shard->coldBytes > shard->capacity && shard->numResident)
+        _cns_blockcache_runHandCold(cns, shard);
+    while (shard->testBytes > shard->capacity && shard->numRemembered)
+        _cns_blockcache_runHandTest(cns, shard);
+}
+
+static cns_Error _cns_blockcache_grow(cns_Runtime* cns, _cns_BlockCacheShard* shard)
+{
+    int base = shard->buckets ? shard->log2numbuckets + 1 : 6;
+    _cns_BlockCacheEntry** buckets = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_BLOCKCACHE, ((cns_Index) 1 << base) * (cns_Index) sizeof(_cns_BlockCacheEntry*), (void**) &buckets);
+    if (!buckets)
+        return err;
+    memset(buckets, 0, ((size_t) 1 << base) * sizeof(_cns_BlockCacheEntry*));
+
+    for (int i = 0; shard->buckets && i < (1 << shard->log2numbuckets); ++i)
+    {
+        _cns_BlockCacheEntry* entry = shard->buckets[i];
+        while (entry)
+        {
+            _cns_BlockCacheEntry* next = entry->chain;
+            _cns_BlockCacheEntry** bucket = &buckets[entry->hash & (((uint64_t) 1 << base) - 1)];
+            entry->chain = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    cns_runtime_free_r(cns, shard->buckets);
+    shard->buckets = buckets;
+    shard->log2numbuckets = base;
+    return CNS_OK;
+}
+
+static void _cns_blockcache_clear(cns_Runtime* cns, _cns_BlockCacheShard* shard, cns_Bool (* match)(_cns_BlockCacheEntry* entry, uint64_t owner), uint64_t owner)
+{
+    for (int i = 0; shard->buckets && i < (1 << shard->log2numbuckets); ++i)
+    {
+        _cns_BlockCacheEntry* entry = shard->buckets[i];
+        while (entry)
+        {
+            _cns_BlockCacheEntry* next = entry->chain;
+            if (match(entry, owner))
+                _cns_blockcache_remove(cns, shard, entry);
+            entry = next;
+        }
+    }
+
+    // an empty shard gives its table back, so that a cache nobody uses takes next to no memory
+    if (!shard->numEntries)
+    {
+        cns_runtime_free_r(cns, shard->buckets);
+        shard->buckets = 0;
+        shard->log2numbuckets = 0;
+    }
+}
+
+static cns_Bool _cns_blockcache_matchAll(_cns_BlockCacheEntry* entry, uint64_t owner)
+{
+    (void) entry;
+    (void) owner;
+    return CNS_YES;
+}
+
+static cns_Bool _cns_blockcache_matchOwner(_cns_BlockCacheEntry* entry, uint64_t owner)
+{
+    return entry->owner == owner;
+}
+
+void
+_cns_blockcache_destroy(cns_Runtime* cns, _cns_BlockCache* cache)
+{
+    for (int i = 0; i < _CNS_BLOCKCACHE_SHARDS; ++i)
+    {
+        _cns_BlockCacheShard* shard = &cache->shards[i];
+        _cns_blockcache_clear(cns, shard, _cns_blockcache_matchAll, 0);
+        pthread_mutex_destroy(&shard->mutex);
+    }
+    cns_runtime_free_r(cns, cache);
+}
+
+cns_Error
+cns_blockcache_setCapacity_r(cns_Runtime* cns, cns_Index capacity)
+{
+    if (!cns || capacity < 0)
+        return CNS_ERR_BADARG;
+
+    _cns_BlockCache* cache = _cns_runtime_blockCache(cns);
+    if (!cache && !capacity)
+        return CNS_OK;
+    if (!cache)
+    {
+        cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_BLOCKCACHE, sizeof(_cns_BlockCache), (void**) &cache);
+        if (!cache)
+            return err;
+        memset(cache, 0, sizeof(_cns_BlockCache));
+        for (int i = 0; i < _CNS_BLOCKCACHE_SHARDS; ++i)
+            pthread_mutex_init(&cache->shards[i].mutex, 0);
+
+        _cns_BlockCache* installed = _cns_runtime_installBlockCache(cns, cache);
+        if (installed != cache)
+        {
+            _cns_blockcache_destroy(cns, cache);
+            cache = installed;
+        }
+    }
+
+    for (int i = 0; i < _CNS_BLOCKCACHE_SHARDS; ++i)
+    {
+        _cns_BlockCacheShard* shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        shard->capacity = capacity / _CNS_BLOCKCACHE_SHARDS;
+        if (shard->coldTarget > shard->capacity)
+            shard->coldTarget = shard->capacity;
+        if (capacity)
+            _cns_blockcache_fit(cns, shard);
+        else
+            _cns_blockcache_clear(cns, shard, _cns_blockcache_matchAll, 0);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    return CNS_OK;
+}
+
+void
+cns_blockcache_setCapacity(cns_Runtime* cns, cns_Index capacity)
+{
+    cns_setlasterr(cns, cns_blockcache_setCapacity_r(cns, capacity));
+}
+
+cns_Error
+cns_blockcache_lookup_r(cns_Runtime* cns, uint64_t owner, uint64_t file, uint64_t offset, cns_Bytes** out_block)
+{
+    if (!cns || !out_block)
+        return CNS_ERR_BADARG;
+
+    *out_block = 0;
+    _cns_BlockCache* cache = _cns_runtime_blockCache(cns);
+    if (!cache)
+        return CNS_OK;
+
+    uint64_t hash = _cns_blockcache_hash(owner, file, offset);
+    _cns_BlockCacheShard* shard = _cns_blockcache_shard(cache, hash);
+    pthread_mutex_lock(&shard->mutex);
+    _cns_BlockCacheEntry* entry = _cns_blockcache_find(shard, hash, owner, file, offset);
+    if (entry && entry->block)
+    {
+        entry->referenced = CNS_YES;
+        ++shard->hits;
+        cns_bytes_copy_r(cns, entry->block, out_block);
+    }
+    else
+        ++shard->misses;
+    pthread_mutex_unlock(&shard->mutex);
+    return CNS_OK;
+}
+
+cns_Bytes*
+cns_blockcache_lookup(cns_Runtime* cns, uint64_t owner, uint64_t file, uint64_t offset)
+{
+    cns_Bytes* rv = 0;
+    cns_setlasterr(cns, cns_blockcache_lookup_r(cns, owner, file, offset, &rv));
+    return rv;
+}
+
+cns_Error
+cns_blockcache_insert_r(cns_Runtime* cns, uint64_t owner, uint64_t file, uint64_t offset, cns_Bytes* block)
+{
+    if (!cns || !block)
+        return CNS_ERR_BADARG;
+
+    _cns_BlockCache* cache = _cns_runtime_blockCache(cns);
+    if (!cache)
+        return CNS_OK;
+
+    uint64_t hash = _cns_blockcache_hash(owner, file, offset);
+    _cns_BlockCacheShard* shard = _cns_blockcache_shard(cache, hash);
+    cns_Index size = cns_bytes_lengthUnchecked(block);
+    cns_Bytes* replaced = 0;
+    cns_Error err = CNS_OK;
+    pthread_mutex_lock(&shard->mutex);
+
+    _cns_BlockCacheEntry* entry = _cns_blockcache_find(shard, hash, owner, file, offset);
+    cns_Bool hot = CNS_NO;
+    if (entry && entry->block)
+    {
+        // same position, new content: keep the entry's state
+        replaced = entry->block;
+        cns_bytes_copy_r(cns, block, &entry->block);
+        if (entry->hot)
+            shard->hotBytes += size - entry->size;
+        else
+            shard->coldBytes += size - entry->size;
+        entry->size = size;
+        entry->referenced = CNS_YES;
+        _cns_blockcache_fit(cns, shard);
+        pthread_mutex_unlock(&shard->mutex);
+        cns_bytes_free_r(cns, replaced);
+        return CNS_OK;
+    }
+    if (entry)
+    {
+        // evicted during its test period, so cold blocks deserve more room
+        cns_Index grown = shard->coldTarget + entry->size;
+        shard->coldTarget = grown < shard->capacity ? grown : shard->capacity;
+        _cns_blockcache_remove(cns, shard, entry);
+        hot = CNS_YES;
+    }
+
+    if (size <= shard->capacity && (!shard->buckets || shard->numEntries >= ((cns_Index) 1 << shard->log2numbuckets)))
+        err = _cns_blockcache_grow(cns, shard);
+    entry = 0;
+    if (!err && size <= shard->capacity)
+        err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_BLOCKCACHE, sizeof(_cns_BlockCacheEntry), (void**) &entry);
+    if (entry)
+    {
+        memset(entry, 0, sizeof(_cns_BlockCacheEntry));
+        entry->owner = owner;
+        entry->file = file;
+        entry->offset = offset;
+        entry->hash = hash;
+        entry->size = size;
+        entry->hot = hot;
+        entry->test = !hot;
+        cns_bytes_copy_r(cns, block, &entry->block);
+
+        _cns_BlockCacheEntry** bucket = _cns_blockcache_bucket(shard, hash);
+        entry->chain = *bucket;
+        *bucket = entry;
+        ++shard->numEntries;
+        ++shard->numResident;
+        _cns_blockcache_link(shard, entry);
+        if (hot)
+            shard->hotBytes += size;
+        else
+            shard->coldBytes += size;
+        ++shard->inserts;
+
+        _cns_blockcache_demoteHot(cns, shard);
+        _cns_blockcache_fit(cns, shard);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return err;
+}
+
+void
+cns_blockcache_insert(cns_Runtime* cns, uint64_t owner, uint64_t file, uint64_t offset, cns_Bytes* block)
+{
+    cns_setlasterr(cns, cns_blockcache_insert_r(cns, owner, file, offset, block));
+}
+
+cns_Error
+cns_blockcache_eraseOwner_r(cns_Runtime* cns, uint64_t owner)
+{
+    if (!cns)
+        return CNS_ERR_BADARG;
+
+    _cns_BlockCache* cache = _cns_runtime_blockCache(cns);
+    for (int i = 0; cache && i < _CNS_BLOCKCACHE_SHARDS; ++i)
+    {
+        _cns_BlockCacheShard* shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        _cns_blockcache_clear(cns, shard, _cns_blockcache_matchOwner, owner);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    return CNS_OK;
+}
+
+void
+cns_blockcache_eraseOwner(cns_Runtime* cns, uint64_t owner)
+{
+    cns_setlasterr(cns, cns_blockcache_eraseOwner_r(cns, owner));
+}
+
+void
+cns_blockcache_stats(cns_Runtime* cns, cns_BlockCacheStats* out_stats)
+{
+    if (!cns || !out_stats)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    memset(out_stats, 0, sizeof(cns_BlockCacheStats));
+    _cns_BlockCache* cache = _cns_runtime_blockCache(cns);
+    for (int i = 0; cache && i < _CNS_BLOCKCACHE_SHARDS; ++i)
+    {
+        _cns_BlockCacheShard* shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        out_stats->capacity += shard->capacity;
+        out_stats->usage += shard->hotBytes + shard->coldBytes;
+        out_stats->hotUsage += shard->hotBytes;
+        out_stats->coldTarget += shard->coldTarget;
+        out_stats->blocks += shard->numResident;
+        out_stats->remembered += shard->numRemembered;
+        out_stats->hits += shard->hits;
+        out_stats->misses += shard->misses;
+        out_stats->inserts += shard->inserts;
+        out_stats->evictions += shard->evictions;
+        out_stats->promotions += shard->promotions;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    cns_setlasterr(cns, CNS_OK);
+}
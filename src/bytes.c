@@ -1,79 +1,491 @@
 #include <consensual/bytes.h>
+#include <consensual/bytes_impl.h>
+#include <consensual/kernels.h>
+#include "runtime_impl.h"
 
 #include <string.h> // memcpy
 
-typedef struct _cns_BytesImpl
+// a concatenation: `data` is null and the content is that of `left` followed by that of `right`
+typedef struct _cns_BytesRope
 {
-    int         referenceCount;
-    cns_Index   length;
-} _cns_BytesImpl;
+    _cns_BytesImpl                  header;
+    cns_Runtime*                    cns; // to allocate the flat copy from `cns_bytes_ptrUnchecked`, which has no runtime
+    _cns_BytesImpl*                 left;
+    _cns_BytesImpl*                 right;
+    _Atomic(_cns_BytesImpl*)        flat; // contiguous copy, made on demand and published once
+    int                             depth;
+} _cns_BytesRope;
 
+// results up to this long are copied rather than joined
+#define _CNS_BYTES_FLATCONCAT 512
 
-cns_Bytes*
-cns_bytes_new(cns_Runtime* cns, const void * ptr, cns_Index size)
+// joins are rebalanced past this depth, leaving chunk iterators room to spare
+#define _CNS_BYTES_REBALANCEDEPTH (_CNS_BYTES_MAXDEPTH - 16)
+
+cns_Error
+_cns_bytes_alloc(cns_Runtime* cns, cns_Index size, _cns_BytesImpl** out_impl)
 {
-    if (!cns || size < 0)
+    _cns_BytesImpl* impl = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_BYTES, sizeof(_cns_BytesImpl) + size, (void**) &impl);
+    if (impl)
     {
-        cns_setlasterr(cns, CNS_ERR_BADARG);
-        return 0;
+        atomic_init(&impl->referenceCount, 1);
+        impl->length = size;
+        impl->data = (const uint8_t*) (impl + 1);
+        impl->parent = 0;
     }
+    *out_impl = impl;
+    return err;
+}
+
+cns_Error
+cns_bytes_new_r(cns_Runtime* cns, const void * ptr, cns_Index size, cns_Bytes** out_bytes)
+{
+    if (!cns || size < 0 || !out_bytes)
+        return CNS_ERR_BADARG;
 
     if (!ptr)
         size = 0;
 
-    _cns_BytesImpl* impl = cns_runtime_alloc(cns, sizeof(_cns_BytesImpl) + size);
-    if (impl)
-    {
-        impl->referenceCount = 1;
-        impl->length = size;
+    _cns_BytesImpl* impl = 0;
+    cns_Error err = _cns_bytes_alloc(cns, size, &impl);
+    if (impl && size)
         memcpy(impl + 1, ptr, size);
-    }
-    return (cns_Bytes*) impl;
+    *out_bytes = (cns_Bytes*) impl;
+    return err;
+}
+
+cns_Bytes*
+cns_bytes_new(cns_Runtime* cns, const void * ptr, cns_Index size)
+{
+    cns_Bytes* rv = 0;
+    cns_setlasterr(cns, cns_bytes_new_r(cns, ptr, size, &rv));
+    return rv;
 }
 
 
+cns_Error
+cns_bytes_copy_r(cns_Runtime* cns, cns_Bytes* another, cns_Bytes** out_bytes)
+{
+    if (!cns || !another || !out_bytes)
+        return CNS_ERR_BADARG;
+
+    _cns_BytesImpl* impl = (_cns_BytesImpl*) another;
+    atomic_fetch_add_explicit(&impl->referenceCount, 1, memory_order_relaxed);
+    *out_bytes = another;
+    return CNS_OK;
+}
+
 cns_Bytes*
 cns_bytes_copy(cns_Runtime* cns, cns_Bytes* another)
 {
-    if (!cns || !another)
+    cns_Bytes* rv = 0;
+    cns_setlasterr(cns, cns_bytes_copy_r(cns, another, &rv));
+    return rv;
+}
+
+
+cns_Error
+cns_bytes_length_r(cns_Runtime* cns, cns_Bytes* bytes, cns_Index* out_length)
+{
+    if (!cns || !bytes || !out_length)
+        return CNS_ERR_BADARG;
+
+    *out_length = ((_cns_BytesImpl*) bytes)->length;
+    return CNS_OK;
+}
+
+cns_Index
+cns_bytes_length(cns_Runtime* cns, cns_Bytes* bytes)
+{
+    cns_Index rv = 0;
+    cns_setlasterr(cns, cns_bytes_length_r(cns, bytes, &rv));
+    return rv;
+}
+
+
+cns_Error
+cns_bytes_ptr_r(cns_Runtime* cns, cns_Bytes* bytes, const void ** out_ptr)
+{
+    if (!cns || !bytes || !out_ptr)
+        return CNS_ERR_BADARG;
+
+    *out_ptr = cns_bytes_ptrUnchecked(bytes);
+    return *out_ptr ? CNS_OK : CNS_ERR_NOMEM;
+}
+
+const void *
+cns_bytes_ptr(cns_Runtime* cns, cns_Bytes* bytes)
+{
+    const void * rv = 0;
+    cns_setlasterr(cns, cns_bytes_ptr_r(cns, bytes, &rv));
+    return rv;
+}
+
+
+cns_Error
+cns_bytes_slice_r(cns_Runtime* cns, cns_Bytes* bytes, cns_Index offset, cns_Index length, cns_Bytes** out_bytes)
+{
+    if (!cns || !bytes || offset < 0 || length < 0 || !out_bytes)
+        return CNS_ERR_BADARG;
+
+    _cns_BytesImpl* impl = (_cns_BytesImpl*) bytes;
+    if (offset > impl->length || length > impl->length - offset)
+        return CNS_ERR_BADARG;
+
+    if (offset == 0 && length == impl->length)
+        return cns_bytes_copy_r(cns, bytes, out_bytes);
+
+    if (!impl->data)
     {
-        cns_setlasterr(cns, CNS_ERR_BADARG);
-        return 0;
+        // slice the flat copy if there is one, otherwise the pieces the range covers
+        _cns_BytesRope* rope = (_cns_BytesRope*) impl;
+        _cns_BytesImpl* flat = atomic_load_explicit(&rope->flat, memory_order_acquire);
+        if (flat)
+            return cns_bytes_slice_r(cns, (cns_Bytes*) flat, offset, length, out_bytes);
+
+        cns_Index leftLength = rope->left->length;
+        if (offset + length <= leftLength)
+            return cns_bytes_slice_r(cns, (cns_Bytes*) rope->left, offset, length, out_bytes);
+        if (offset >= leftLength)
+            return cns_bytes_slice_r(cns, (cns_Bytes*) rope->right, offset - leftLength, length, out_bytes);
+
+        cns_Bytes* head = 0;
+        cns_Bytes* tail = 0;
+        cns_Error err = cns_bytes_slice_r(cns, (cns_Bytes*) rope->left, offset, leftLength - offset, &head);
+        if (!err)
+            err = cns_bytes_slice_r(cns, (cns_Bytes*) rope->right, 0, length - (leftLength - offset), &tail);
+        *out_bytes = 0;
+        if (!err)
+            err = cns_bytes_concat_r(cns, head, tail, out_bytes);
+        if (head)
+            cns_bytes_free_r(cns, head);
+        if (tail)
+            cns_bytes_free_r(cns, tail);
+        return err;
     }
-    _cns_BytesImpl* impl = (_cns_BytesImpl*) another;
-    impl->referenceCount++;
-    cns_setlasterr(cns, CNS_OK);
-    return another;
+
+    // never build chains of slices, point straight into the block holding the data
+    _cns_BytesImpl* block = impl->parent ? impl->parent : impl;
+
+    _cns_BytesImpl* rv = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_BYTES, sizeof(_cns_BytesImpl), (void**) &rv);
+    if (rv)
+    {
+        atomic_init(&rv->referenceCount, 1);
+        rv->length = length;
+        rv->data = impl->data + offset;
+        rv->parent = block;
+        atomic_fetch_add_explicit(&block->referenceCount, 1, memory_order_relaxed);
+    }
+    *out_bytes = (cns_Bytes*) rv;
+    return err;
+}
+
+cns_Bytes*
+cns_bytes_slice(cns_Runtime* cns, cns_Bytes* bytes, cns_Index offset, cns_Index length)
+{
+    cns_Bytes* rv = 0;
+    cns_setlasterr(cns, cns_bytes_slice_r(cns, bytes, offset, length, &rv));
+    return rv;
+}
+
+
+static void _cns_bytes_cursorBegin(cns_BytesChunks* chunks, _cns_BytesImpl* impl)
+{
+    cns_bytes_chunksBeginUnchecked((cns_Bytes*) impl, chunks);
+}
+
+// next non-empty contiguous object, or null at the end
+static _cns_BytesImpl* _cns_bytes_cursorNext(cns_BytesChunks* chunks)
+{
+    while (chunks->_depth)
+    {
+        _cns_BytesImpl* node = (_cns_BytesImpl*) chunks->_stack[--chunks->_depth];
+        while (!node->data)
+        {
+            _cns_BytesRope* rope = (_cns_BytesRope*) node;
+            _cns_BytesImpl* flat = atomic_load_explicit(&rope->flat, memory_order_acquire);
+            if (flat)
+            {
+                node = flat;
+                break;
+            }
+            chunks->_stack[chunks->_depth++] = rope->right;
+            node = rope->left;
+        }
+        if (node->length)
+            return node;
+    }
+    return 0;
 }
 
+cns_Bool
+cns_bytes_chunksNextUnchecked(cns_BytesChunks* chunks, const void ** out_ptr, cns_Index* out_length)
+{
+    _cns_BytesImpl* chunk = _cns_bytes_cursorNext(chunks);
+    if (!chunk)
+        return CNS_NO;
+    *out_ptr = chunk->data;
+    *out_length = chunk->length;
+    return CNS_YES;
+}
 
 cns_Index
-cns_bytes_length(cns_Runtime* cns, cns_Bytes* bytes)
+cns_bytes_chunkCountUnchecked(cns_Bytes* bytes)
 {
-    if (!cns || !bytes)
+    cns_BytesChunks chunks;
+    _cns_bytes_cursorBegin(&chunks, (_cns_BytesImpl*) bytes);
+    cns_Index count = 0;
+    while (_cns_bytes_cursorNext(&chunks))
+        ++count;
+    return count;
+}
+
+void
+cns_bytes_chunksBegin(cns_Runtime* cns, cns_Bytes* bytes, cns_BytesChunks* out_chunks)
+{
+    if (!cns || !bytes || !out_chunks)
     {
         cns_setlasterr(cns, CNS_ERR_BADARG);
-        return 0;
+        return;
     }
-    _cns_BytesImpl* impl = (_cns_BytesImpl*) bytes;
+    cns_bytes_chunksBeginUnchecked(bytes, out_chunks);
     cns_setlasterr(cns, CNS_OK);
-    return impl->length;
 }
 
+cns_Bool
+cns_bytes_chunksNext(cns_Runtime* cns, cns_BytesChunks* chunks, const void ** out_ptr, cns_Index* out_length)
+{
+    if (!cns || !chunks || !out_ptr || !out_length)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return CNS_NO;
+    }
+
+    cns_setlasterr(cns, CNS_OK);
+    return cns_bytes_chunksNextUnchecked(chunks, out_ptr, out_length);
+}
 
-const void *
-cns_bytes_ptr(cns_Runtime* cns, cns_Bytes* bytes)
+cns_Index
+cns_bytes_chunkCount(cns_Runtime* cns, cns_Bytes* bytes)
 {
     if (!cns || !bytes)
     {
         cns_setlasterr(cns, CNS_ERR_BADARG);
         return 0;
     }
-    _cns_BytesImpl* impl = (_cns_BytesImpl*) bytes;
+
     cns_setlasterr(cns, CNS_OK);
-    return impl + 1;
+    return cns_bytes_chunkCountUnchecked(bytes);
+}
+
+const void *
+_cns_bytes_flatten(cns_Bytes* bytes)
+{
+    _cns_BytesRope* rope = (_cns_BytesRope*) bytes;
+    _cns_BytesImpl* flat = atomic_load_explicit(&rope->flat, memory_order_acquire);
+    if (flat)
+        return flat->data;
+
+    if (_cns_bytes_alloc(rope->cns, rope->header.length, &flat))
+        return 0;
+    cns_BytesChunks chunks;
+    _cns_bytes_cursorBegin(&chunks, &rope->header);
+    uint8_t* p = (uint8_t*) (flat + 1);
+    for (_cns_BytesImpl* chunk; (chunk = _cns_bytes_cursorNext(&chunks)); p += chunk->length)
+        memcpy(p, chunk->data, chunk->length);
+
+    // several threads may flatten at once; the first to publish wins and the others drop their copies
+    _cns_BytesImpl* expected = 0;
+    if (!atomic_compare_exchange_strong_explicit(&rope->flat, &expected, flat, memory_order_acq_rel, memory_order_acquire))
+    {
+        cns_runtime_free_r(rope->cns, flat);
+        flat = expected;
+    }
+    return flat->data;
 }
 
+cns_Bool
+_cns_bytes_equalChunks(cns_Bytes* lhs, cns_Bytes* rhs, cns_Index length)
+{
+    cns_BytesChunks lhsChunks, rhsChunks;
+    _cns_bytes_cursorBegin(&lhsChunks, (_cns_BytesImpl*) lhs);
+    _cns_bytes_cursorBegin(&rhsChunks, (_cns_BytesImpl*) rhs);
+    const uint8_t* lp = 0;
+    const uint8_t* rp = 0;
+    cns_Index ln = 0, rn = 0;
+    while (length > 0)
+    {
+        if (!ln)
+        {
+            _cns_BytesImpl* chunk = _cns_bytes_cursorNext(&lhsChunks);
+            lp = chunk->data;
+            ln = chunk->length;
+        }
+        if (!rn)
+        {
+            _cns_BytesImpl* chunk = _cns_bytes_cursorNext(&rhsChunks);
+            rp = chunk->data;
+            rn = chunk->length;
+        }
+        cns_Index n = ln < rn ? ln : rn;
+        if (n > length)
+            n = length;
+        if (memcmp(lp, rp, n))
+            return CNS_NO;
+        lp += n;
+        rp += n;
+        ln -= n;
+        rn -= n;
+        length -= n;
+    }
+    return CNS_YES;
+}
+
+static int _cns_bytes_depth(_cns_BytesImpl* impl)
+{
+    return impl->data ? 0 : ((_cns_BytesRope*) impl)->depth;
+}
+
+// takes references to both halves
+static cns_Error _cns_bytes_newRope(cns_Runtime* cns, _cns_BytesImpl* left, _cns_BytesImpl* right, _cns_BytesImpl** out_impl)
+{
+    _cns_BytesRope* rope = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_BYTES, sizeof(_cns_BytesRope), (void**) &rope);
+    *out_impl = (_cns_BytesImpl*) rope;
+    if (!rope)
+        return err;
+
+    atomic_init(&rope->header.referenceCount, 1);
+    rope->header.length = left->length + right->length;
+    rope->header.data = 0;
+    rope->header.parent = 0;
+    rope->cns = cns;
+    rope->left = left;
+    rope->right = right;
+    atomic_init(&rope->flat, (_cns_BytesImpl*) 0);
+    int leftDepth = _cns_bytes_depth(left), rightDepth = _cns_bytes_depth(right);
+    rope->depth = 1 + (leftDepth > rightDepth ? leftDepth : rightDepth);
+    atomic_fetch_add_explicit(&left->referenceCount, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&right->referenceCount, 1, memory_order_relaxed);
+    return CNS_OK;
+}
+
+static cns_Error _cns_bytes_buildBalanced(cns_Runtime* cns, _cns_BytesImpl** pieces, cns_Index count, _cns_BytesImpl** out_impl)
+{
+    if (count == 1)
+    {
+        atomic_fetch_add_explicit(&pieces[0]->referenceCount, 1, memory_order_relaxed);
+        *out_impl = pieces[0];
+        return CNS_OK;
+    }
+
+    _cns_BytesImpl* left = 0;
+    _cns_BytesImpl* right = 0;
+    cns_Error err = _cns_bytes_buildBalanced(cns, pieces, count / 2, &left);
+    if (!err)
+        err = _cns_bytes_buildBalanced(cns, pieces + count / 2, count - count / 2, &right);
+    *out_impl = 0;
+    if (!err)
+        err = _cns_bytes_newRope(cns, left, right, out_impl);
+    if (left)
+        cns_bytes_free_r(cns, (cns_Bytes*) left);
+    if (right)
+        cns_bytes_free_r(cns, (cns_Bytes*) right);
+    return err;
+}
+
+// rebuilds a join that got too deep from its pieces, as a balanced tree
+static cns_Error _cns_bytes_rebalance(cns_Runtime* cns, _cns_BytesImpl* impl, _cns_BytesImpl** out_impl)
+{
+    cns_BytesChunks chunks;
+    _cns_bytes_cursorBegin(&chunks, impl);
+    cns_Index count = 0;
+    while (_cns_bytes_cursorNext(&chunks))
+        ++count;
+
+    _cns_BytesImpl** pieces = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_BYTES, count * sizeof(_cns_BytesImpl*), (void**) &pieces);
+    if (!pieces)
+        return err;
+    _cns_bytes_cursorBegin(&chunks, impl);
+    for (cns_Index i = 0; i < count; ++i)
+        pieces[i] = _cns_bytes_cursorNext(&chunks);
+
+    err = _cns_bytes_buildBalanced(cns, pieces, count, out_impl);
+    cns_runtime_free_r(cns, pieces);
+    return err;
+}
+
+cns_Error
+cns_bytes_concat_r(cns_Runtime* cns, cns_Bytes* lhs, cns_Bytes* rhs, cns_Bytes** out_bytes)
+{
+    if (!cns || !lhs || !rhs || !out_bytes)
+        return CNS_ERR_BADARG;
+
+    _cns_BytesImpl* left = (_cns_BytesImpl*) lhs;
+    _cns_BytesImpl* right = (_cns_BytesImpl*) rhs;
+    if (!right->length)
+        return cns_bytes_copy_r(cns, lhs, out_bytes);
+    if (!left->length)
+        return cns_bytes_copy_r(cns, rhs, out_bytes);
+
+    _cns_BytesImpl* impl = 0;
+    cns_Error err = CNS_OK;
+    if (left->length + right->length <= _CNS_BYTES_FLATCONCAT)
+    {
+        err = _cns_bytes_alloc(cns, left->length + right->length, &impl);
+        if (impl)
+        {
+            cns_BytesChunks chunks;
+            uint8_t* p = (uint8_t*) (impl + 1);
+            _cns_bytes_cursorBegin(&chunks, left);
+            for (_cns_BytesImpl* chunk; (chunk = _cns_bytes_cursorNext(&chunks)); p += chunk->length)
+                memcpy(p, chunk->data, chunk->length);
+            _cns_bytes_cursorBegin(&chunks, right);
+            for (_cns_BytesImpl* chunk; (chunk = _cns_bytes_cursorNext(&chunks)); p += chunk->length)
+                memcpy(p, chunk->data, chunk->length);
+        }
+        *out_bytes = (cns_Bytes*) impl;
+        return err;
+    }
+
+    _cns_BytesRope* leftRope = left->data ? 0 : (_cns_BytesRope*) left;
+    if (leftRope && leftRope->right->length + right->length <= _CNS_BYTES_FLATCONCAT)
+    {
+        // appending small pieces one by one grows the last piece instead of the depth
+        _cns_BytesImpl* tail = 0;
+        err = cns_bytes_concat_r(cns, (cns_Bytes*) leftRope->right, rhs, (cns_Bytes**) &tail);
+        if (!err)
+        {
+            err = _cns_bytes_newRope(cns, leftRope->left, tail, &impl);
+            cns_bytes_free_r(cns, (cns_Bytes*) tail);
+        }
+    }
+    else
+        err = _cns_bytes_newRope(cns, left, right, &impl);
+
+    if (impl && ((_cns_BytesRope*) impl)->depth > _CNS_BYTES_REBALANCEDEPTH)
+    {
+        _cns_BytesImpl* balanced = 0;
+        err = _cns_bytes_rebalance(cns, impl, &balanced);
+        cns_bytes_free_r(cns, (cns_Bytes*) impl);
+        impl = balanced;
+    }
+    *out_bytes = (cns_Bytes*) impl;
+    return err;
+}
+
+cns_Bytes*
+cns_bytes_concat(cns_Runtime* cns, cns_Bytes* lhs, cns_Bytes* rhs)
+{
+    cns_Bytes* rv = 0;
+    cns_setlasterr(cns, cns_bytes_concat_r(cns, lhs, rhs, &rv));
+    return rv;
+}
+
+
 cns_Bool
 cns_bytes_equal(cns_Runtime* cns, cns_Bytes* lhs, cns_Bytes* rhs)
 {
@@ -83,33 +495,232 @@ cns_bytes_equal(cns_Runtime* cns, cns_Bytes* lhs, cns_Bytes* rhs)
     if (!lhs ^ !rhs)
         return CNS_NO;
 
-    cns_Index length = cns_bytes_length(cns, lhs);
-    if (length != cns_bytes_length(cns, rhs))
+    return cns_bytes_equalUnchecked(lhs, rhs);
+}
+
+cns_Bool
+cns_bytes_hasPrefix(cns_Runtime* cns, cns_Bytes* bytes, cns_Bytes* prefix)
+{
+    if (!cns || !bytes || !prefix)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
         return CNS_NO;
+    }
+
+    cns_setlasterr(cns, CNS_OK);
+    cns_Index length = cns_bytes_lengthUnchecked(prefix);
+    if (length > cns_bytes_lengthUnchecked(bytes))
+        return CNS_NO;
+    if (!cns_bytes_isFlatUnchecked(bytes) || !cns_bytes_isFlatUnchecked(prefix))
+        return _cns_bytes_equalChunks(bytes, prefix, length);
+    return cns_kernels_equal(CNS_KERNEL_AUTO, cns_bytes_ptrUnchecked(bytes), cns_bytes_ptrUnchecked(prefix), length);
+}
+
 
-    return (0 == memcmp(cns_bytes_ptr(cns, lhs), cns_bytes_ptr(cns, rhs), length));
+cns_Error
+cns_bytes_free_r(cns_Runtime* cns, cns_Bytes* bytes)
+{
+    if (!cns || !bytes)
+        return CNS_ERR_BADARG;
+
+    _cns_BytesImpl* impl = (_cns_BytesImpl*) bytes;
+
+    int previous = atomic_fetch_sub_explicit(&impl->referenceCount, 1, memory_order_acq_rel);
+    if (previous <= 0)
+    {
+        atomic_fetch_add_explicit(&impl->referenceCount, 1, memory_order_relaxed);
+        return CNS_ERR_BADARG;
+    }
+
+    if (previous == 1 && !impl->data)
+    {
+        _cns_BytesRope* rope = (_cns_BytesRope*) impl;
+        _cns_BytesImpl* flat = atomic_load_explicit(&rope->flat, memory_order_acquire);
+        cns_bytes_free_r(cns, (cns_Bytes*) rope->left);
+        cns_bytes_free_r(cns, (cns_Bytes*) rope->right);
+        if (flat)
+            cns_bytes_free_r(cns, (cns_Bytes*) flat);
+        return cns_runtime_free_r(cns, rope);
+    }
+
+    if (previous == 1)
+    {
+        _cns_BytesImpl* parent = impl->parent;
+        cns_Error err = cns_runtime_free_r(cns, impl);
+        if (parent)
+            cns_bytes_free_r(cns, (cns_Bytes*) parent);
+        return err;
+    }
+    return CNS_OK;
 }
 
 void
 cns_bytes_free(cns_Runtime* cns, cns_Bytes* bytes)
 {
-    if (!cns || !bytes)
+    cns_setlasterr(cns, cns_bytes_free_r(cns, bytes));
+}
+
+
+// the buffer is laid out as the Bytes object it will become: header first, content right after it
+struct cns_BytesBuilder
+{
+    _cns_BytesImpl* block;
+    cns_Index capacity;
+};
+
+// smallest content capacity a builder grows to
+#define _CNS_BYTESBUILDER_MINCAPACITY 64
+
+cns_Error
+cns_bytesbuilder_new_r(cns_Runtime* cns, cns_Index capacity, cns_BytesBuilder** out_builder)
+{
+    if (!cns || capacity < 0 || !out_builder)
+        return CNS_ERR_BADARG;
+
+    *out_builder = 0;
+    cns_BytesBuilder* rv = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_BYTES, sizeof(cns_BytesBuilder), (void**) &rv);
+    if (!rv)
+        return err;
+    err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_BYTES, sizeof(_cns_BytesImpl) + capacity, (void**) &rv->block);
+    if (!rv->block)
     {
-        cns_setlasterr(cns, CNS_ERR_BADARG);
-        return;
+        cns_runtime_free_r(cns, rv);
+        return err;
     }
+    rv->block->length = 0;
+    rv->capacity = capacity;
+    *out_builder = rv;
+    return CNS_OK;
+}
 
-    _cns_BytesImpl* impl = (_cns_BytesImpl*) bytes;
+cns_BytesBuilder*
+cns_bytesbuilder_new(cns_Runtime* cns, cns_Index capacity)
+{
+    cns_BytesBuilder* rv = 0;
+    cns_setlasterr(cns, cns_bytesbuilder_new_r(cns, capacity, &rv));
+    return rv;
+}
+
+cns_Error
+cns_bytesbuilder_reserve_r(cns_Runtime* cns, cns_BytesBuilder* builder, cns_Index size)
+{
+    if (!cns || !builder || size < 0)
+        return CNS_ERR_BADARG;
 
-    if (impl->referenceCount <= 0)
+    cns_Index needed = builder->block->length + size;
+    if (needed <= builder->capacity)
+        return CNS_OK;
+
+    cns_Index capacity = builder->capacity < _CNS_BYTESBUILDER_MINCAPACITY ? _CNS_BYTESBUILDER_MINCAPACITY : builder->capacity;
+    while (capacity < needed)
+        capacity *= 2;
+
+    void* block = 0;
+    cns_Error err = _cns_runtime_reallocIn_r(cns, CNS_ALLOC_BYTES, builder->block, sizeof(_cns_BytesImpl) + capacity, &block);
+    if (!block)
+        return err;
+    builder->block = (_cns_BytesImpl*) block;
+    builder->capacity = capacity;
+    return CNS_OK;
+}
+
+void
+cns_bytesbuilder_reserve(cns_Runtime* cns, cns_BytesBuilder* builder, cns_Index size)
+{
+    cns_setlasterr(cns, cns_bytesbuilder_reserve_r(cns, builder, size));
+}
+
+cns_Error
+cns_bytesbuilder_append_r(cns_Runtime* cns, cns_BytesBuilder* builder, const void * ptr, cns_Index size)
+{
+    if (!cns || !builder || size < 0 || (size && !ptr))
+        return CNS_ERR_BADARG;
+
+    cns_Error err = cns_bytesbuilder_reserve_r(cns, builder, size);
+    if (err)
+        return err;
+    if (size)
+        memcpy((uint8_t*) (builder->block + 1) + builder->block->length, ptr, size);
+    builder->block->length += size;
+    return CNS_OK;
+}
+
+void
+cns_bytesbuilder_append(cns_Runtime* cns, cns_BytesBuilder* builder, const void * ptr, cns_Index size)
+{
+    cns_setlasterr(cns, cns_bytesbuilder_append_r(cns, builder, ptr, size));
+}
+
+cns_Index
+cns_bytesbuilder_length(cns_Runtime* cns, cns_BytesBuilder* builder)
+{
+    if (!cns || !builder)
     {
         cns_setlasterr(cns, CNS_ERR_BADARG);
-        return;
+        return 0;
     }
+    cns_setlasterr(cns, CNS_OK);
+    return builder->block->length;
+}
 
+void *
+cns_bytesbuilder_ptr(cns_Runtime* cns, cns_BytesBuilder* builder)
+{
+    if (!cns || !builder)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
     cns_setlasterr(cns, CNS_OK);
-    if (!--impl->referenceCount)
-        cns_runtime_free(cns, impl);
+    return builder->block + 1;
 }
 
+cns_Error
+cns_bytesbuilder_finish_r(cns_Runtime* cns, cns_BytesBuilder* builder, cns_Bytes** out_bytes)
+{
+    if (!cns || !builder || !out_bytes)
+        return CNS_ERR_BADARG;
 
+    _cns_BytesImpl* impl = builder->block;
+    if (impl->length < builder->capacity)
+    {
+        // shrinking normally happens in place; if it fails, the block is merely larger than needed
+        void* block = 0;
+        _cns_runtime_reallocIn_r(cns, CNS_ALLOC_BYTES, impl, sizeof(_cns_BytesImpl) + impl->length, &block);
+        if (block)
+            impl = (_cns_BytesImpl*) block;
+    }
+    cns_runtime_free_r(cns, builder);
+
+    atomic_init(&impl->referenceCount, 1);
+    impl->data = (const uint8_t*) (impl + 1);
+    impl->parent = 0;
+    *out_bytes = (cns_Bytes*) impl;
+    return CNS_OK;
+}
+
+cns_Bytes*
+cns_bytesbuilder_finish(cns_Runtime* cns, cns_BytesBuilder* builder)
+{
+    cns_Bytes* rv = 0;
+    cns_setlasterr(cns, cns_bytesbuilder_finish_r(cns, builder, &rv));
+    return rv;
+}
+
+cns_Error
+cns_bytesbuilder_free_r(cns_Runtime* cns, cns_BytesBuilder* builder)
+{
+    if (!cns || !builder)
+        return CNS_ERR_BADARG;
+
+    cns_runtime_free_r(cns, builder->block);
+    cns_runtime_free_r(cns, builder);
+    return CNS_OK;
+}
+
+void
+cns_bytesbuilder_free(cns_Runtime* cns, cns_BytesBuilder* builder)
+{
+    cns_setlasterr(cns, cns_bytesbuilder_free_r(cns, builder));
+}
@@ -0,0 +1,1023 @@
+#include <consensual/host.h>
+#include <consensual/bytes_impl.h>
+#include <consensual/wire.h>
+#include "storage_engine.h"
+#include "runtime_impl.h"
+
+#include <pthread.h>
+#include <string.h> // memcpy, memmove, memset
+
+// A frame is a version and the sending peer, then messages up to its end, all varints:
+//   append     type 1, group, index of the entry before the first one sent, leader's commit index, number of entries,
+//              then each entry as a byte string
+//   ack        type 2, group, index of the last entry held, whether an append did not fit the log (0 or 1)
+// An entry is its number of writes, then for each a flag telling a set (1) from a delete (0), the key and, for a set,
+// the value, as byte strings.
+//
+// Log indexes start at 1. A leader sends a follower its entries from `next` on and moves `next` past them right away;
+// when the follower's acknowledgements stay behind for `heartbeatTicks`, it starts over from what was acknowledged.
+
+#define _CNS_HOST_VERSION 1
+#define _CNS_HOST_APPEND 1
+#define _CNS_HOST_ACK 2
+#define _CNS_HOST_MAXWORKERS 64
+
+// what a group's leader knows of one peer
+typedef struct _cns_HostPeer
+{
+    uint64_t    next; // index of the next entry to send
+    uint64_t    match; // index of the last entry the peer acknowledged
+    uint64_t    sentCommit; // commit index last sent
+    int         idleTicks; // since the last message to the peer
+} _cns_HostPeer;
+
+typedef struct _cns_HostGroup
+{
+    uint64_t            id;
+    cns_Storage*        storage;
+    cns_StorageBatch*   batch; // reused to apply entries
+    int                 leader;
+    int                 worker;
+    cns_Bytes**         entries; // [begin, end) hold the log from `firstIndex` on
+    cns_Index           begin;
+    cns_Index           end;
+    cns_Index           capacity;
+    uint64_t            firstIndex;
+    uint64_t            commitIndex;
+    uint64_t            appliedIndex;
+    _cns_HostPeer       peers[]; // `numPeers` of them, used by the leader
+} _cns_HostGroup;
+
+// a message received for a group, between `ptr`, past the group id, and `end`; it was checked to decode
+typedef struct _cns_HostMessage
+{
+    _cns_HostGroup* group;
+    const uint8_t*  ptr;
+    const uint8_t*  end;
+    int             type;
+    int             from;
+} _cns_HostMessage;
+
+// messages a worker has for one peer in this tick
+typedef struct _cns_HostOut
+{
+    uint8_t*    data;
+    cns_Index   length;
+    cns_Index   capacity;
+    uint64_t    count;
+} _cns_HostOut;
+
+typedef struct _cns_HostWorker
+{
+    cns_Host*           host;
+    int                 index;
+    cns_Bool            started; // runs on a thread of its own; otherwise the calling thread does its share
+    pthread_t           thread;
+    uint64_t            generation; // of the last tick run
+    _cns_HostMessage*   inbox;
+    cns_Index           inboxCount;
+    cns_Index           inboxCapacity;
+    _cns_HostOut*       out; // one per peer
+    cns_Error           failure; // the first of this tick
+    char                _pad[64];
+} _cns_HostWorker;
+
+struct cns_Host
+{
+    cns_Runtime*        cns;
+    cns_HostOptions     options;
+    _cns_HostGroup**    groups; // in the order added; group `i` runs on worker `i % numWorkers`
+    cns_Index           numGroups;
+    cns_Index           groupsCapacity;
+    _cns_HostGroup**    slots; // by id, open addressing with linear probing
+    int                 log2numslots;
+    cns_Bytes**         received; // frames for the next tick
+    cns_Index           numReceived;
+    cns_Index           receivedCapacity;
+    _cns_HostWorker*    workers;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      start;
+    pthread_cond_t      done;
+    uint64_t            generation;
+    int                 running; // workers on threads still busy with the tick
+    cns_Bool            stopping;
+    cns_HostStats       stats;
+};
+
+static cns_Error _cns_host_grow(cns_Runtime* cns, void** array, cns_Index* capacity, cns_Index need, cns_Index itemsize)
+{
+    if (need <= *capacity)
+        return CNS_OK;
+    cns_Index newCapacity = *capacity ? *capacity : 16;
+    while (newCapacity < need)
+        newCapacity *= 2;
+    void* grown = 0;
+    cns_Error err = _cns_runtime_reallocIn_r(cns, CNS_ALLOC_REPLICATION, *array, newCapacity * itemsize, &grown);
+    if (!grown)
+        return err;
+    *array = grown;
+    *capacity = newCapacity;
+    return CNS_OK;
+}
+
+static uint32_t _cns_host_slot(uint64_t groupId, int log2numslots)
+{
+    return (uint32_t) ((groupId * 0x9e3779b97f4a7c15ull) >> (64 - log2numslots));
+}
+
+static _cns_HostGroup* _cns_host_group(cns_Host* host, uint64_t groupId)
+{
+    if (!host->slots)
+        return 0;
+    uint32_t mask = (1u << host->log2numslots) - 1;
+    for (uint32_t i = _cns_host_slot(groupId, host->log2numslots); host->slots[i]; i = (i + 1) & mask)
+    {
+        if (host->slots[i]->id == groupId)
+            return host->slots[i];
+    }
+    return 0;
+}
+
+static uint64_t _cns_host_lastIndex(_cns_HostGroup* group)
+{
+    return group->firstIndex + (uint64_t) (group->end - group->begin) - 1;
+}
+
+static cns_Bytes* _cns_host_entry(_cns_HostGroup* group, uint64_t index)
+{
+    return group->entries[group->begin + (cns_Index) (index - group->firstIndex)];
+}
+
+// takes ownership of `entry` even on failure
+static cns_Error _cns_host_append(cns_Runtime* cns, _cns_HostGroup* group, cns_Bytes* entry)
+{
+    if (group->end == group->capacity && group->begin)
+    {
+        memmove(group->entries, group->entries + group->begin, (size_t) (group->end - group->begin) * sizeof(cns_Bytes*));
+        group->end -= group->begin;
+        group->begin = 0;
+    }
+    cns_Error err = _cns_host_grow(cns, (void**) &group->entries, &group->capacity, group->end + 1, sizeof(cns_Bytes*));
+    if (err)
+    {
+        cns_bytes_free_r(cns, entry);
+        return err;
+    }
+    group->entries[group->end++] = entry;
+    return CNS_OK;
+}
+
+// drops the entries up to `index`, which nobody needs any more
+static void _cns_host_trim(cns_Runtime* cns, _cns_HostGroup* group, uint64_t index)
+{
+    while (group->begin < group->end && group->firstIndex <= index)
+    {
+        cns_bytes_free_r(cns, group->entries[group->begin++]);
+        ++group->firstIndex;
+    }
+}
+
+static cns_Bool _cns_host_varint(const uint8_t** ptr, const uint8_t* end, uint64_t* out_value)
+{
+    cns_Index n = cns_wire_decodeVarint(*ptr, end - *ptr, out_value);
+    *ptr += n;
+    return n != 0;
+}
+
+static cns_Bool _cns_host_string(const uint8_t** ptr, const uint8_t* end, const uint8_t** out_string, uint64_t* out_length)
+{
+    if (!_cns_host_varint(ptr, end, out_length) || *out_length > (uint64_t) (end - *ptr))
+        return CNS_NO;
+    *out_string = *ptr;
+    *ptr += *out_length;
+    return CNS_YES;
+}
+
+// whether an entry received decodes, so that applying it needs no checks
+static cns_Bool _cns_host_checkEntry(const uint8_t* ptr, const uint8_t* end)
+{
+    uint64_t count = 0;
+    if (!_cns_host_varint(&ptr, end, &count) || count > (uint64_t) (end - ptr))
+        return CNS_NO;
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        uint64_t isSet = 0, length = 0;
+        const uint8_t* string = 0;
+        if (!_cns_host_varint(&ptr, end, &isSet) || isSet > 1 || !_cns_host_string(&ptr, end, &string, &length)
+            || (isSet && !_cns_host_string(&ptr, end, &string, &length)))
+            return CNS_NO;
+    }
+    return ptr == end;
+}
+
+// applies the committed entries not applied yet, stopping at the first one which fails
+static cns_Error _cns_host_apply(cns_Runtime* cns, _cns_HostGroup* group)
+{
+    while (group->appliedIndex < group->commitIndex)
+    {
+        cns_Bytes* entry = _cns_host_entry(group, group->appliedIndex + 1);
+        const uint8_t* ptr = (const uint8_t*) cns_bytes_ptrUnchecked(entry);
+        const uint8_t* end = ptr + cns_bytes_lengthUnchecked(entry);
+        uint64_t count = 0;
+        _cns_host_varint(&ptr, end, &count); // entries were checked when proposed or received
+        cns_storagebatch_clear_r(cns, group->batch);
+        cns_Error err = CNS_OK;
+        for (uint64_t i = 0; i < count && !err; ++i)
+        {
+            uint64_t isSet = 0;
+            const uint8_t* string = 0;
+            uint64_t length = 0;
+            _cns_host_varint(&ptr, end, &isSet);
+            _cns_host_string(&ptr, end, &string, &length);
+            cns_Bytes* key = 0;
+            cns_Bytes* value = 0;
+            err = cns_bytes_new_r(cns, string, (cns_Index) length, &key);
+            if (!err && isSet)
+            {
+                _cns_host_string(&ptr, end, &string, &length);
+                err = cns_bytes_new_r(cns, string, (cns_Index) length, &value);
+            }
+            if (!err)
+                err = value ? cns_storagebatch_set_r(cns, group->batch, key, value) : cns_storagebatch_delete_r(cns, group->batch, key);
+            if (value)
+                cns_bytes_free_r(cns, value);
+            if (key)
+                cns_bytes_free_r(cns, key);
+        }
+        if (!err)
+            err = cns_storage_apply_r(cns, group->storage, group->batch);
+        if (err)
+            return err;
+        ++group->appliedIndex;
+    }
+    return CNS_OK;
+}
+
+static cns_Error _cns_host_reserveOut(cns_Runtime* cns, _cns_HostOut* out, cns_Index size)
+{
+    return _cns_host_grow(cns, (void**) &out->data, &out->capacity, out->length + size, 1);
+}
+
+static void _cns_host_putVarint(_cns_HostOut* out, uint64_t value)
+{
+    out->length += cns_wire_encodeVarint(value, out->data + out->length);
+}
+
+static void _cns_host_ack(_cns_HostWorker* worker, _cns_HostGroup* group, int to, cns_Bool rejected)
+{
+    _cns_HostOut* out = &worker->out[to];
+    cns_Error err = _cns_host_reserveOut(worker->host->cns, out, 4 * CNS_WIRE_MAXVARINT);
+    if (err)
+    {
+        worker->failure = worker->failure ? worker->failure : err;
+        return;
+    }
+    _cns_host_putVarint(out, _CNS_HOST_ACK);
+    _cns_host_putVarint(out, group->id);
+    _cns_host_putVarint(out, _cns_host_lastIndex(group));
+    _cns_host_putVarint(out, rejected);
+    ++out->count;
+}
+
+// sends `peer` the entries from its `next` on, or none as a heartbeat
+static void _cns_host_sendAppend(_cns_HostWorker* worker, _cns_HostGroup* group, int peer)
+{
+    cns_Runtime* cns = worker->host->cns;
+    _cns_HostPeer* state = &group->peers[peer];
+    _cns_HostOut* out = &worker->out[peer];
+    uint64_t last = _cns_host_lastIndex(group);
+    uint64_t count = state->next <= last ? last - state->next + 1 : 0;
+    if (count > (uint64_t) worker->host->options.maxEntriesPerTick)
+        count = (uint64_t) worker->host->options.maxEntriesPerTick;
+    cns_Index size = 6 * CNS_WIRE_MAXVARINT;
+    for (uint64_t i = 0; i < count; ++i)
+        size += CNS_WIRE_MAXVARINT + cns_bytes_lengthUnchecked(_cns_host_entry(group, state->next + i));
+    cns_Error err = _cns_host_reserveOut(cns, out, size);
+    if (err)
+    {
+        worker->failure = worker->failure ? worker->failure : err;
+        return;
+    }
+
+    _cns_host_putVarint(out, _CNS_HOST_APPEND);
+    _cns_host_putVarint(out, group->id);
+    _cns_host_putVarint(out, state->next - 1);
+    _cns_host_putVarint(out, group->commitIndex);
+    _cns_host_putVarint(out, count);
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        cns_Bytes* entry = _cns_host_entry(group, state->next + i);
+        cns_Index length = cns_bytes_lengthUnchecked(entry);
+        _cns_host_putVarint(out, (uint64_t) length);
+        memcpy(out->data + out->length, cns_bytes_ptrUnchecked(entry), (size_t) length);
+        out->length += length;
+    }
+    ++out->count;
+    state->next += count;
+    state->sentCommit = group->commitIndex;
+    state->idleTicks = 0;
+}
+
+static void _cns_host_onAppend(_cns_HostWorker* worker, _cns_HostMessage* message)
+{
+    cns_Runtime* cns = worker->host->cns;
+    _cns_HostGroup* group = message->group;
+    if (group->leader != message->from)
+        return;
+    const uint8_t* ptr = message->ptr;
+    uint64_t prev = 0, commit = 0, count = 0;
+    _cns_host_varint(&ptr, message->end, &prev);
+    _cns_host_varint(&ptr, message->end, &commit);
+    _cns_host_varint(&ptr, message->end, &count);
+    uint64_t last = _cns_host_lastIndex(group);
+    if (prev > last)
+    {
+        _cns_host_ack(worker, group, message->from, CNS_YES);
+        return;
+    }
+
+    // entries up to `last` are here already, as there is only ever one leader
+    cns_Error err = CNS_OK;
+    for (uint64_t i = 0; i < count && !err; ++i)
+    {
+        const uint8_t* entry = 0;
+        uint64_t length = 0;
+        _cns_host_string(&ptr, message->end, &entry, &length);
+        if (prev + i + 1 <= last)
+            continue;
+        cns_Bytes* copy = 0;
+        err = cns_bytes_new_r(cns, entry, (cns_Index) length, &copy);
+        if (!err)
+            err = _cns_host_append(cns, group, copy);
+    }
+    if (err)
+        worker->failure = worker->failure ? worker->failure : err;
+
+    last = _cns_host_lastIndex(group);
+    if (commit > last)
+        commit = last;
+    if (commit > group->commitIndex)
+        group->commitIndex = commit;
+    err = _cns_host_apply(cns, group);
+    if (err)
+        worker->failure = worker->failure ? worker->failure : err;
+    // followers never send entries on, so they keep only what is not applied yet
+    _cns_host_trim(cns, group, group->appliedIndex);
+    // a heartbeat needs no answer unless the leader is behind on what this peer holds; entries that did not all fit are
+    // asked for again
+    if (count || prev < last)
+        _cns_host_ack(worker, group, message->from, prev + count > last);
+}
+
+static void _cns_host_onAck(_cns_HostWorker* worker, _cns_HostMessage* message)
+{
+    _cns_HostGroup* group = message->group;
+    if (group->leader != worker->host->options.self)
+        return;
+    const uint8_t* ptr = message->ptr;
+    uint64_t match = 0, rejected = 0;
+    _cns_host_varint(&ptr, message->end, &match);
+    _cns_host_varint(&ptr, message->end, &rejected);
+    _cns_HostPeer* peer = &group->peers[message->from];
+    uint64_t last = _cns_host_lastIndex(group);
+    if (match > last)
+        match = last;
+    if (match > peer->match)
+        peer->match = match;
+    if (rejected && peer->next > match + 1)
+        peer->next = match + 1;
+}
+
+// the leader's part of a tick: commit what a majority holds, apply it, and send each peer what it lacks
+static void _cns_host_lead(_cns_HostWorker* worker, _cns_HostGroup* group)
+{
+    cns_Host* host = worker->host;
+    int numPeers = host->options.numPeers;
+    int self = host->options.self;
+    uint64_t last = _cns_host_lastIndex(group);
+
+    // the highest index held by a majority: the smallest of the `numPeers / 2 + 1` highest matches
+    uint64_t matches[64];
+    int count = 0;
+    uint64_t oldest = last;
+    for (int p = 0; p < numPeers; ++p)
+    {
+        uint64_t match = p == self ? last : group->peers[p].match;
+        if (match < oldest)
+            oldest = match;
+        int i = count++;
+        for (; i > 0 && matches[i - 1] < match; --i)
+            matches[i] = matches[i - 1];
+        matches[i] = match;
+    }
+    uint64_t committed = matches[numPeers / 2];
+    if (committed > group->commitIndex)
+        group->commitIndex = committed;
+    cns_Error err = _cns_host_apply(host->cns, group);
+    if (err)
+        worker->failure = worker->failure ? worker->failure : err;
+    _cns_host_trim(host->cns, group, oldest < group->appliedIndex ? oldest : group->appliedIndex);
+
+    for (int p = 0; p < numPeers; ++p)
+    {
+        if (p == self)
+            continue;
+        _cns_HostPeer* peer = &group->peers[p];
+        if (peer->next <= last || peer->sentCommit < group->commitIndex)
+            _cns_host_sendAppend(worker, group, p);
+        else if (++peer->idleTicks >= host->options.heartbeatTicks)
+        {
+            // what was sent and not acknowledged is sent again
+            peer->next = peer->match + 1;
+            _cns_host_sendAppend(worker, group, p);
+        }
+    }
+}
+
+static void _cns_host_work(_cns_HostWorker* worker)
+{
+    cns_Host* host = worker->host;
+    worker->failure = CNS_OK;
+    for (cns_Index i = 0; i < worker->inboxCount; ++i)
+    {
+        _cns_HostMessage* message = &worker->inbox[i];
+        if (message->type == _CNS_HOST_APPEND)
+            _cns_host_onAppend(worker, message);
+        else
+            _cns_host_onAck(worker, message);
+    }
+    worker->inboxCount = 0;
+
+    int numWorkers = host->options.numWorkers;
+    for (cns_Index g = worker->index; g < host->numGroups; g += numWorkers)
+    {
+        if (host->groups[g]->leader == host->options.self)
+            _cns_host_lead(worker, host->groups[g]);
+    }
+}
+
+static void* _cns_host_workerMain(void* arg)
+{
+    _cns_HostWorker* worker = (_cns_HostWorker*) arg;
+    cns_Host* host = worker->host;
+    for (;;)
+    {
+        pthread_mutex_lock(&host->mutex);
+        while (!host->stopping && host->generation == worker->generation)
+            pthread_cond_wait(&host->start, &host->mutex);
+        if (host->stopping)
+        {
+            pthread_mutex_unlock(&host->mutex);
+            return 0;
+        }
+        worker->generation = host->generation;
+        pthread_mutex_unlock(&host->mutex);
+
+        _cns_host_work(worker);
+
+        pthread_mutex_lock(&host->mutex);
+        if (--host->running == 0)
+            pthread_cond_signal(&host->done);
+        pthread_mutex_unlock(&host->mutex);
+    }
+}
+
+void
+cns_hostoptions_default(cns_HostOptions* out_options)
+{
+    if (!out_options)
+        return;
+    memset(out_options, 0, sizeof(cns_HostOptions));
+    out_options->self = 0;
+    out_options->numPeers = 1;
+    out_options->numWorkers = 1;
+    out_options->heartbeatTicks = 10;
+    out_options->maxEntriesPerTick = 64;
+}
+
+cns_Host*
+cns_host_new(cns_Runtime* cns, const cns_HostOptions* options)
+{
+    cns_HostOptions defaults;
+    cns_hostoptions_default(&defaults);
+    if (!options)
+        options = &defaults;
+    if (!cns || options->numPeers < 1 || options->numPeers > 64 || options->self < 0 || options->self >= options->numPeers
+        || options->numWorkers < 1 || options->numWorkers > _CNS_HOST_MAXWORKERS || options->heartbeatTicks < 1
+        || options->maxEntriesPerTick < 1 || (options->numPeers > 1 && !options->send))
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+
+    cns_Host* host = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_REPLICATION, sizeof(cns_Host), (void**) &host);
+    if (!host)
+    {
+        cns_setlasterr(cns, err);
+        return 0;
+    }
+    memset(host, 0, sizeof(cns_Host));
+    host->cns = cns;
+    host->options = *options;
+    err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_REPLICATION, options->numWorkers * (cns_Index) sizeof(_cns_HostWorker), (void**) &host->workers);
+    if (host->workers)
+        memset(host->workers, 0, options->numWorkers * sizeof(_cns_HostWorker));
+    for (int w = 0; w < options->numWorkers && !err; ++w)
+    {
+        host->workers[w].host = host;
+        host->workers[w].index = w;
+        err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_REPLICATION, options->numPeers * (cns_Index) sizeof(_cns_HostOut), (void**) &host->workers[w].out);
+        if (host->workers[w].out)
+            memset(host->workers[w].out, 0, options->numPeers * sizeof(_cns_HostOut));
+    }
+    if (err)
+    {
+        for (int w = 0; host->workers && w < options->numWorkers; ++w)
+            cns_runtime_free_r(cns, host->workers[w].out);
+        cns_runtime_free_r(cns, host->workers);
+        cns_runtime_free_r(cns, host);
+        cns_setlasterr(cns, err);
+        return 0;
+    }
+
+    pthread_mutex_init(&host->mutex, 0);
+    pthread_cond_init(&host->start, 0);
+    pthread_cond_init(&host->done, 0);
+    // a worker whose thread cannot start has its share done by the calling thread
+    for (int w = 1; w < options->numWorkers; ++w)
+        host->workers[w].started = !pthread_create(&host->workers[w].thread, 0, _cns_host_workerMain, &host->workers[w]);
+    cns_setlasterr(cns, CNS_OK);
+    return host;
+}
+
+void
+cns_host_free(cns_Runtime* cns, cns_Host* host)
+{
+    if (!cns || !host)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    pthread_mutex_lock(&host->mutex);
+    host->stopping = CNS_YES;
+    pthread_cond_broadcast(&host->start);
+    pthread_mutex_unlock(&host->mutex);
+    for (int w = 1; w < host->options.numWorkers; ++w)
+    {
+        if (host->workers[w].started)
+            pthread_join(host->workers[w].thread, 0);
+    }
+    pthread_cond_destroy(&host->done);
+    pthread_cond_destroy(&host->start);
+    pthread_mutex_destroy(&host->mutex);
+
+    for (cns_Index g = 0; g < host->numGroups; ++g)
+    {
+        _cns_HostGroup* group = host->groups[g];
+        _cns_host_trim(cns, group, UINT64_MAX);
+        cns_runtime_free_r(cns, group->entries);
+        cns_storagebatch_free_r(cns, group->batch);
+        cns_runtime_free_r(cns, group);
+    }
+    for (cns_Index i = 0; i < host->numReceived; ++i)
+        cns_bytes_free_r(cns, host->received[i]);
+    for (int w = 0; w < host->options.numWorkers; ++w)
+    {
+        for (int p = 0; p < host->options.numPeers; ++p)
+            cns_runtime_free_r(cns, host->workers[w].out[p].data);
+        cns_runtime_free_r(cns, host->workers[w].out);
+        cns_runtime_free_r(cns, host->workers[w].inbox);
+    }
+    cns_runtime_free_r(cns, host->workers);
+    cns_runtime_free_r(cns, host->received);
+    cns_runtime_free_r(cns, host->slots);
+    cns_runtime_free_r(cns, host->groups);
+    cns_runtime_free_r(cns, host);
+    cns_setlasterr(cns, CNS_OK);
+}
+
+cns_Error
+cns_host_addGroup_r(cns_Runtime* cns, cns_Host* host, uint64_t groupId, cns_Storage* storage, int leader)
+{
+    if (!cns || !host || !storage || leader < 0 || leader >= host->options.numPeers || _cns_host_group(host, groupId))
+        return CNS_ERR_BADARG;
+    if (_cns_storage_engine(storage))
+        return CNS_ERR_UNSUPPORTED;
+
+    // the id table stays at most half full
+    cns_Error err = _cns_host_grow(cns, (void**) &host->groups, &host->groupsCapacity, host->numGroups + 1, sizeof(_cns_HostGroup*));
+    if (!err && 2 * (host->numGroups + 1) > ((cns_Index) 1 << host->log2numslots))
+    {
+        int base = host->log2numslots ? host->log2numslots + 1 : 6;
+        _cns_HostGroup** slots = 0;
+        err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_REPLICATION, ((cns_Index) 1 << base) * (cns_Index) sizeof(_cns_HostGroup*), (void**) &slots);
+        if (slots)
+        {
+            memset(slots, 0, ((size_t) 1 << base) * sizeof(_cns_HostGroup*));
+            uint32_t mask = (1u << base) - 1;
+            for (cns_Index g = 0; g < host->numGroups; ++g)
+            {
+                uint32_t i = _cns_host_slot(host->groups[g]->id, base);
+                while (slots[i])
+                    i = (i + 1) & mask;
+                slots[i] = host->groups[g];
+            }
+            cns_runtime_free_r(cns, host->slots);
+            host->slots = slots;
+            host->log2numslots = base;
+        }
+    }
+    _cns_HostGroup* group = 0;
+    if (!err)
+        err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_REPLICATION, (cns_Index) (sizeof(_cns_HostGroup) + host->options.numPeers * sizeof(_cns_HostPeer)), (void**) &group);
+    if (err)
+        return err;
+    memset(group, 0, sizeof(_cns_HostGroup) + host->options.numPeers * sizeof(_cns_HostPeer));
+    err = cns_storagebatch_new_r(cns, &group->batch);
+    if (!group->batch)
+    {
+        cns_runtime_free_r(cns, group);
+        return err;
+    }
+    group->id = groupId;
+    group->storage = storage;
+    group->leader = leader;
+    group->worker = (int) (host->numGroups % host->options.numWorkers);
+    group->firstIndex = 1;
+    for (int p = 0; p < host->options.numPeers; ++p)
+    {
+        group->peers[p].next = 1;
+        // heartbeats of groups added together go out over several ticks rather than in one burst
+        group->peers[p].idleTicks = (int) (host->numGroups % host->options.heartbeatTicks);
+    }
+
+    uint32_t mask = (1u << host->log2numslots) - 1;
+    uint32_t i = _cns_host_slot(groupId, host->log2numslots);
+    while (host->slots[i])
+        i = (i + 1) & mask;
+    host->slots[i] = group;
+    host->groups[host->numGroups++] = group;
+    return CNS_OK;
+}
+
+void
+cns_host_addGroup(cns_Runtime* cns, cns_Host* host, uint64_t groupId, cns_Storage* storage, int leader)
+{
+    cns_setlasterr(cns, cns_host_addGroup_r(cns, host, groupId, storage, leader));
+}
+
+static cns_Error _cns_host_putString(cns_Runtime* cns, cns_BytesBuilder* builder, cns_Bytes* bytes)
+{
+    uint8_t varint[CNS_WIRE_MAXVARINT];
+    cns_Error err = cns_bytesbuilder_append_r(cns, builder, varint, cns_wire_encodeVarint((uint64_t) cns_bytes_lengthUnchecked(bytes), varint));
+    cns_BytesChunks chunks;
+    cns_bytes_chunksBeginUnchecked(bytes, &chunks);
+    const void * ptr = 0;
+    cns_Index length = 0;
+    while (!err && cns_bytes_chunksNextUnchecked(&chunks, &ptr, &length))
+        err = cns_bytesbuilder_append_r(cns, builder, ptr, length);
+    return err;
+}
+
+cns_Error
+cns_host_propose_r(cns_Runtime* cns, cns_Host* host, uint64_t groupId, cns_StorageBatch* batch, uint64_t* out_index)
+{
+    if (!cns || !host || !batch || !out_index)
+        return CNS_ERR_BADARG;
+    _cns_HostGroup* group = _cns_host_group(host, groupId);
+    if (!group || group->leader != host->options.self)
+        return CNS_ERR_BADARG;
+
+    cns_Index count = 0;
+    cns_storagebatch_count_r(cns, batch, &count);
+    cns_Index size = CNS_WIRE_MAXVARINT;
+    for (cns_Index i = 0; i < count; ++i)
+    {
+        cns_Bytes* key = 0;
+        cns_Bytes* value = 0;
+        _cns_storagebatch_write(batch, i, &key, &value);
+        size += 1 + CNS_WIRE_MAXVARINT + cns_bytes_lengthUnchecked(key);
+        if (value)
+            size += CNS_WIRE_MAXVARINT + cns_bytes_lengthUnchecked(value);
+    }
+    cns_BytesBuilder* builder = 0;
+    cns_Error err = cns_bytesbuilder_new_r(cns, size, &builder);
+    if (err)
+        return err;
+    uint8_t varint[CNS_WIRE_MAXVARINT];
+    err = cns_bytesbuilder_append_r(cns, builder, varint, cns_wire_encodeVarint((uint64_t) count, varint));
+    for (cns_Index i = 0; i < count && !err; ++i)
+    {
+        cns_Bytes* key = 0;
+        cns_Bytes* value = 0;
+        _cns_storagebatch_write(batch, i, &key, &value);
+        uint8_t isSet = value ? 1 : 0;
+        err = cns_bytesbuilder_append_r(cns, builder, &isSet, 1);
+        if (!err)
+            err = _cns_host_putString(cns, builder, key);
+        if (!err && value)
+            err = _cns_host_putString(cns, builder, value);
+    }
+    if (err)
+    {
+        cns_bytesbuilder_free_r(cns, builder);
+        return err;
+    }
+    cns_Bytes* entry = 0;
+    err = cns_bytesbuilder_finish_r(cns, builder, &entry);
+    if (err)
+        return err;
+    err = _cns_host_append(cns, group, entry);
+    if (!err)
+        *out_index = _cns_host_lastIndex(group);
+    return err;
+}
+
+uint64_t
+cns_host_propose(cns_Runtime* cns, cns_Host* host, uint64_t groupId, cns_StorageBatch* batch)
+{
+    uint64_t rv = 0;
+    cns_setlasterr(cns, cns_host_propose_r(cns, host, groupId, batch, &rv));
+    return rv;
+}
+
+cns_Error
+cns_host_receive_r(cns_Runtime* cns, cns_Host* host, cns_Bytes* frame)
+{
+    if (!cns || !host || !frame)
+        return CNS_ERR_BADARG;
+    cns_Error err = _cns_host_grow(cns, (void**) &host->received, &host->receivedCapacity, host->numReceived + 1, sizeof(cns_Bytes*));
+    if (!err)
+        err = cns_bytes_copy_r(cns, frame, &host->received[host->numReceived]);
+    if (!err)
+        ++host->numReceived;
+    return err;
+}
+
+void
+cns_host_receive(cns_Runtime* cns, cns_Host* host, cns_Bytes* frame)
+{
+    cns_setlasterr(cns, cns_host_receive_r(cns, host, frame));
+}
+
+// checks a frame to the end and hands each message to the worker of its group; messages for unknown groups are dropped
+static cns_Error _cns_host_route(cns_Runtime* cns, cns_Host* host, cns_Bytes* frame)
+{
+    const void * start = 0;
+    cns_Error err = cns_bytes_ptr_r(cns, frame, &start);
+    if (err)
+        return err;
+    const uint8_t* ptr = (const uint8_t*) start;
+    const uint8_t* end = ptr + cns_bytes_lengthUnchecked(frame);
+    uint64_t version = 0, from = 0;
+    if (!_cns_host_varint(&ptr, end, &version) || version != _CNS_HOST_VERSION || !_cns_host_varint(&ptr, end, &from)
+        || from >= (uint64_t) host->options.numPeers || (int) from == host->options.self)
+        return CNS_ERR_MALFORMED;
+
+    while (ptr < end)
+    {
+        uint64_t type = 0, groupId = 0;
+        if (!_cns_host_varint(&ptr, end, &type) || !_cns_host_varint(&ptr, end, &groupId))
+            return CNS_ERR_MALFORMED;
+        const uint8_t* body = ptr;
+        uint64_t a = 0, b = 0, count = 0;
+        if (!_cns_host_varint(&ptr, end, &a) || !_cns_host_varint(&ptr, end, &b))
+            return CNS_ERR_MALFORMED;
+        if (type == _CNS_HOST_APPEND)
+        {
+            if (!_cns_host_varint(&ptr, end, &count))
+                return CNS_ERR_MALFORMED;
+            for (uint64_t i = 0; i < count; ++i)
+            {
+                const uint8_t* entry = 0;
+                uint64_t length = 0;
+                if (!_cns_host_string(&ptr, end, &entry, &length) || !_cns_host_checkEntry(entry, entry + length))
+                    return CNS_ERR_MALFORMED;
+            }
+        }
+        else if (type != _CNS_HOST_ACK || b > 1)
+            return CNS_ERR_MALFORMED;
+
+        _cns_HostGroup* group = _cns_host_group(host, groupId);
+        if (!group)
+            continue;
+        _cns_HostWorker* worker = &host->workers[group->worker];
+        err = _cns_host_grow(cns, (void**) &worker->inbox, &worker->inboxCapacity, worker->inboxCount + 1, sizeof(_cns_HostMessage));
+        if (err)
+            return err;
+        _cns_HostMessage* message = &worker->inbox[worker->inboxCount++];
+        message->group = group;
+        message->ptr = body;
+        message->end = ptr;
+        message->type = (int) type;
+        message->from = (int) from;
+    }
+    return CNS_OK;
+}
+
+cns_Error
+cns_host_tick_r(cns_Runtime* cns, cns_Host* host)
+{
+    if (!cns || !host)
+        return CNS_ERR_BADARG;
+
+    cns_Error failure = CNS_OK;
+    for (cns_Index i = 0; i < host->numReceived; ++i)
+    {
+        cns_Error err = _cns_host_route(cns, host, host->received[i]);
+        if (err == CNS_ERR_MALFORMED)
+            ++host->stats.malformedFrames;
+        else if (err && !failure)
+            failure = err;
+    }
+    host->stats.framesReceived += (uint64_t) host->numReceived;
+
+    int numWorkers = host->options.numWorkers;
+    pthread_mutex_lock(&host->mutex);
+    ++host->generation;
+    host->running = 0;
+    for (int w = 1; w < numWorkers; ++w)
+        host->running += host->workers[w].started;
+    pthread_cond_broadcast(&host->start);
+    pthread_mutex_unlock(&host->mutex);
+    for (int w = 0; w < numWorkers; ++w)
+    {
+        if (!host->workers[w].started)
+            _cns_host_work(&host->workers[w]);
+    }
+    pthread_mutex_lock(&host->mutex);
+    while (host->running)
+        pthread_cond_wait(&host->done, &host->mutex);
+    pthread_mutex_unlock(&host->mutex);
+
+    // messages were read in place
+    for (cns_Index i = 0; i < host->numReceived; ++i)
+        cns_bytes_free_r(cns, host->received[i]);
+    host->numReceived = 0;
+
+    // one frame per peer, out of what every worker had for it
+    for (int p = 0; p < host->options.numPeers; ++p)
+    {
+        cns_Index length = 0;
+        uint64_t count = 0;
+        for (int w = 0; w < numWorkers; ++w)
+        {
+            length += host->workers[w].out[p].length;
+            count += host->workers[w].out[p].count;
+        }
+        if (!count)
+            continue;
+        cns_BytesBuilder* builder = 0;
+        cns_Error err = cns_bytesbuilder_new_r(cns, 2 * CNS_WIRE_MAXVARINT + length, &builder);
+        if (builder)
+        {
+            uint8_t header[2 * CNS_WIRE_MAXVARINT];
+            cns_Index n = cns_wire_encodeVarint(_CNS_HOST_VERSION, header);
+            n += cns_wire_encodeVarint((uint64_t) host->options.self, header + n);
+            cns_bytesbuilder_append_r(cns, builder, header, n); // room was made up front
+            for (int w = 0; w < numWorkers; ++w)
+            {
+                if (host->workers[w].out[p].length)
+                    cns_bytesbuilder_append_r(cns, builder, host->workers[w].out[p].data, host->workers[w].out[p].length);
+            }
+            cns_Bytes* frame = 0;
+            err = cns_bytesbuilder_finish_r(cns, builder, &frame);
+            if (frame)
+            {
+                length = cns_bytes_lengthUnchecked(frame);
+                host->options.send(cns, host->options.sendContext, p, frame);
+                ++host->stats.framesSent;
+                host->stats.messagesSent += count;
+                host->stats.bytesSent += (uint64_t) length;
+            }
+        }
+        if (err && !failure)
+            failure = err;
+        for (int w = 0; w < numWorkers; ++w)
+        {
+            host->workers[w].out[p].length = 0;
+            host->workers[w].out[p].count = 0;
+        }
+    }
+
+    for (int w = 0; w < numWorkers; ++w)
+    {
+        if (host->workers[w].failure && !failure)
+            failure = host->workers[w].failure;
+    }
+    ++host->stats.ticks;
+    return failure;
+}
+
+void
+cns_host_tick(cns_Runtime* cns, cns_Host* host)
+{
+    cns_setlasterr(cns, cns_host_tick_r(cns, host));
+}
+
+uint64_t
+cns_host_appliedIndex(cns_Runtime* cns, cns_Host* host, uint64_t groupId)
+{
+    _cns_HostGroup* group = cns && host ? _cns_host_group(host, groupId) : 0;
+    if (!group)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+    cns_setlasterr(cns, CNS_OK);
+    return group->appliedIndex;
+}
+
+void
+cns_host_stats(cns_Runtime* cns, cns_Host* host, cns_HostStats* out_stats)
+{
+    if (!cns || !host || !out_stats)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+    *out_stats = host->stats;
+    cns_setlasterr(cns, CNS_OK);
+}
+
+struct cns_HostNet
+{
+    int         numPeers;
+    int*        peers; // destination of each waiting frame
+    cns_Bytes** frames;
+    cns_Index   count;
+    cns_Index   capacity;
+    cns_Index   peersCapacity;
+};
+
+cns_HostNet*
+cns_hostnet_new(cns_Runtime* cns, int numPeers)
+{
+    if (!cns || numPeers < 1)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+    cns_HostNet* net = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_REPLICATION, sizeof(cns_HostNet), (void**) &net);
+    if (net)
+    {
+        memset(net, 0, sizeof(cns_HostNet));
+        net->numPeers = numPeers;
+    }
+    cns_setlasterr(cns, err);
+    return net;
+}
+
+void
+cns_hostnet_free(cns_Runtime* cns, cns_HostNet* net)
+{
+    if (!cns || !net)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+    for (cns_Index i = 0; i < net->count; ++i)
+        cns_bytes_free_r(cns, net->frames[i]);
+    cns_runtime_free_r(cns, net->frames);
+    cns_runtime_free_r(cns, net->peers);
+    cns_runtime_free_r(cns, net);
+    cns_setlasterr(cns, CNS_OK);
+}
+
+void
+cns_hostnet_send(cns_Runtime* cns, void* context, int peer, cns_Bytes* frame)
+{
+    cns_HostNet* net = (cns_HostNet*) context;
+    cns_Error err = _cns_host_grow(cns, (void**) &net->frames, &net->capacity, net->count + 1, sizeof(cns_Bytes*));
+    if (!err)
+        err = _cns_host_grow(cns, (void**) &net->peers, &net->peersCapacity, net->count + 1, sizeof(int));
+    if (err || peer < 0 || peer >= net->numPeers)
+    {
+        cns_bytes_free_r(cns, frame); // lost, as on a real network
+        return;
+    }
+    net->peers[net->count] = peer;
+    net->frames[net->count++] = frame;
+}
+
+cns_Index
+cns_hostnet_deliver(cns_Runtime* cns, cns_HostNet* net, cns_Host** hosts)
+{
+    if (!cns || !net || !hosts)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+    cns_Index count = net->count;
+    for (cns_Index i = 0; i < count; ++i)
+    {
+        cns_host_receive_r(cns, hosts[net->peers[i]], net->frames[i]);
+        cns_bytes_free_r(cns, net->frames[i]);
+    }
+    net->count = 0;
+    cns_setlasterr(cns, CNS_OK);
+    return count;
+}
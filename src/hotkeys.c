@@ -0,0 +1,535 @@
+#include <consensual/hotkeys.h>
+#include <consensual/bytes_impl.h>
+#include "storage_engine.h"
+#include "runtime_impl.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h> // memset, memcpy
+
+#define _CNS_HOTKEYS_ROWS 4
+#define _CNS_HOTKEYS_MAXTOP 256
+#define _CNS_HOTKEYS_MINWIDTH 64
+#define _CNS_HOTKEYS_MAXWIDTH (1 << 24)
+#define _CNS_HOTKEYS_MAXSAMPLERATE (1 << 20)
+#define _CNS_HOTKEYS_MAXSLOTS (1 << 16)
+#define _CNS_HOTKEYS_AGING 16 // sampled gets per counter of a row between halvings
+#define _CNS_HOTKEYS_AGINGTICK 1024 // sampled gets a thread counts on its own before adding them to the shared total
+#define _CNS_HOTKEYS_STRIPES 1024 // of keys sharing a version stamp
+#define _CNS_HOTKEYS_FILTERBITS 1024
+#define _CNS_HOTKEYS_THREADS 64 // threads beyond this many share the state of others, and skip it while it is in use
+
+typedef struct _cns_HotKeys_Slot
+{
+    cns_Bytes* key; // NULL for an empty slot; a flat copy, like the value
+    cns_Bytes* value;
+    uint64_t stamp; // of the stripe of the key when the value was copied
+    uint32_t hash;
+} _cns_HotKeys_Slot;
+
+// what one thread counts and caches; allocated on a cache line of its own the first time the thread gets a value
+typedef struct _cns_HotKeys_Thread
+{
+    atomic_flag busy;
+    void* memory; // the allocation this is the aligned part of
+    _Atomic uint64_t sampled;
+    _Atomic uint64_t hits;
+    _Atomic uint64_t misses;
+    _Atomic uint64_t fills;
+    _cns_HotKeys_Slot slots[];
+} _cns_HotKeys_Thread;
+
+struct cns_HotKeys
+{
+    cns_Storage* storage;
+    uint32_t sampleMask;
+    uint32_t widthMask;
+    uint32_t slotMask; // of the caches, 0 if there are none
+    cns_Index numSlots;
+    cns_Index maxTop;
+    uint64_t agingInterval; // sampled gets between halvings
+    _Atomic uint32_t* sketch; // the rows one after another
+    _Atomic uint64_t agingTicks;
+    _Atomic uint64_t floor; // estimate a key must beat to enter the top once it is full
+    _Atomic uint64_t filter[_CNS_HOTKEYS_FILTERBITS / 64]; // bits of the hashes of the top keys, for caches to go by
+    pthread_mutex_t mutex; // over the top keys
+    cns_Bytes** topKeys; // flat copies
+    _Atomic uint32_t* topHashes; // also read without the mutex
+    _Atomic int topCount;
+    uint64_t stamps[_CNS_HOTKEYS_STRIPES]; // bumped by writes, which never run with gets
+    _Atomic(_cns_HotKeys_Thread*) threads[_CNS_HOTKEYS_THREADS];
+};
+
+static atomic_int _cns_hotkeys_nextThread;
+static _Thread_local int _cns_hotkeys_threadIndex = -1;
+static _Thread_local uint32_t _cns_hotkeys_tick; // gets of this thread, to sample from
+
+static const uint32_t _cns_hotkeys_seeds[_CNS_HOTKEYS_ROWS] = { 0x9e3779b9u, 0x7f4a7c15u, 0x85ebca6bu, 0xc2b2ae35u };
+
+// the finalizer of MurmurHash3, so that each row spreads the key hash its own way
+static uint32_t _cns_hotkeys_mix(uint32_t hash)
+{
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static _Atomic uint32_t* _cns_hotkeys_counter(cns_HotKeys* hotKeys, int row, uint32_t keyhash)
+{
+    uint32_t index = _cns_hotkeys_mix(keyhash ^ _cns_hotkeys_seeds[row]) & hotKeys->widthMask;
+    return &hotKeys->sketch[(size_t) row * (hotKeys->widthMask + 1) + index];
+}
+
+static uint64_t _cns_hotkeys_estimate(cns_HotKeys* hotKeys, uint32_t keyhash)
+{
+    uint64_t estimate = UINT32_MAX;
+    for (int row = 0; row < _CNS_HOTKEYS_ROWS; ++row)
+    {
+        uint32_t count = atomic_load_explicit(_cns_hotkeys_counter(hotKeys, row, keyhash), memory_order_relaxed);
+        if (count < estimate)
+            estimate = count;
+    }
+    return estimate;
+}
+
+static unsigned _cns_hotkeys_filterBit(uint32_t keyhash)
+{
+    return keyhash >> 22;
+}
+
+static cns_Bool _cns_hotkeys_filtered(cns_HotKeys* hotKeys, uint32_t keyhash)
+{
+    unsigned bit = _cns_hotkeys_filterBit(keyhash);
+    return (atomic_load_explicit(&hotKeys->filter[bit / 64], memory_order_relaxed) >> (bit % 64)) & 1;
+}
+
+// a flat copy of `bytes` in a block of its own
+static cns_Error _cns_hotkeys_copy(cns_Runtime* cns, cns_Bytes* bytes, cns_Bytes** out_copy)
+{
+    _cns_BytesImpl* impl = 0;
+    cns_Error err = _cns_bytes_alloc(cns, cns_bytes_lengthUnchecked(bytes), &impl);
+    *out_copy = (cns_Bytes*) impl;
+    if (!impl)
+        return err;
+    uint8_t* data = (uint8_t*) (impl + 1);
+    cns_BytesChunks chunks;
+    cns_bytes_chunksBeginUnchecked(bytes, &chunks);
+    const void * ptr = 0;
+    cns_Index length = 0;
+    while (cns_bytes_chunksNextUnchecked(&chunks, &ptr, &length))
+    {
+        memcpy(data, ptr, (size_t) length);
+        data += length;
+    }
+    return CNS_OK;
+}
+
+// for counters of a thread state, which only the thread holding it bumps
+static void _cns_hotkeys_bump(_Atomic uint64_t* counter)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+static _cns_HotKeys_Thread* _cns_hotkeys_thread(cns_Runtime* cns, cns_HotKeys* hotKeys)
+{
+    if (_cns_hotkeys_threadIndex < 0)
+        _cns_hotkeys_threadIndex = atomic_fetch_add_explicit(&_cns_hotkeys_nextThread, 1, memory_order_relaxed) % _CNS_HOTKEYS_THREADS;
+    _Atomic(_cns_HotKeys_Thread*)* link = &hotKeys->threads[_cns_hotkeys_threadIndex];
+    _cns_HotKeys_Thread* thread = atomic_load_explicit(link, memory_order_acquire);
+    if (thread)
+        return thread;
+
+    cns_Index size = (cns_Index) sizeof(_cns_HotKeys_Thread) + hotKeys->numSlots * (cns_Index) sizeof(_cns_HotKeys_Slot);
+    void* memory = 0;
+    _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, size + 64, &memory);
+    if (!memory)
+        return 0;
+    thread = (_cns_HotKeys_Thread*) (((uintptr_t) memory + 63) & ~(uintptr_t) 63);
+    memset(thread, 0, (size_t) size);
+    atomic_flag_clear(&thread->busy);
+    thread->memory = memory;
+    // another thread sharing the index may have got there first
+    _cns_HotKeys_Thread* expected = 0;
+    if (!atomic_compare_exchange_strong_explicit(link, &expected, thread, memory_order_acq_rel, memory_order_acquire))
+    {
+        cns_runtime_free_r(cns, memory);
+        thread = expected;
+    }
+    return thread;
+}
+
+static void _cns_hotkeys_rebuildFilter(cns_HotKeys* hotKeys)
+{
+    uint64_t filter[_CNS_HOTKEYS_FILTERBITS / 64] = { 0 };
+    int count = atomic_load_explicit(&hotKeys->topCount, memory_order_relaxed);
+    for (int i = 0; i < count; ++i)
+    {
+        unsigned bit = _cns_hotkeys_filterBit(atomic_load_explicit(&hotKeys->topHashes[i], memory_order_relaxed));
+        filter[bit / 64] |= (uint64_t) 1 << (bit % 64);
+    }
+    for (int i = 0; i < _CNS_HOTKEYS_FILTERBITS / 64; ++i)
+        atomic_store_explicit(&hotKeys->filter[i], filter[i], memory_order_relaxed);
+}
+
+// the coldest of the top keys
+static int _cns_hotkeys_coldest(cns_HotKeys* hotKeys, int count, uint64_t* out_estimate)
+{
+    int coldest = -1;
+    *out_estimate = UINT64_MAX;
+    for (int i = 0; i < count; ++i)
+    {
+        uint64_t estimate = _cns_hotkeys_estimate(hotKeys, atomic_load_explicit(&hotKeys->topHashes[i], memory_order_relaxed));
+        if (estimate < *out_estimate)
+        {
+            coldest = i;
+            *out_estimate = estimate;
+        }
+    }
+    return coldest;
+}
+
+// puts `key` into the top if it is not there and is hotter than the coldest key there; a sample another thread is
+// offering at the same time wins, since the next samples will offer the key again if it is hot
+static void _cns_hotkeys_offer(cns_Runtime* cns, cns_HotKeys* hotKeys, cns_Bytes* key, uint32_t keyhash, uint64_t estimate)
+{
+    if (pthread_mutex_trylock(&hotKeys->mutex))
+        return;
+    int count = atomic_load_explicit(&hotKeys->topCount, memory_order_relaxed);
+    for (int i = 0; i < count; ++i)
+    {
+        if (atomic_load_explicit(&hotKeys->topHashes[i], memory_order_relaxed) == keyhash
+            && cns_bytes_equalUnchecked(hotKeys->topKeys[i], key))
+        {
+            pthread_mutex_unlock(&hotKeys->mutex);
+            return;
+        }
+    }
+    uint64_t coldestEstimate = 0;
+    int coldest = _cns_hotkeys_coldest(hotKeys, count, &coldestEstimate);
+    int index = count < hotKeys->maxTop ? count : coldest;
+    cns_Bytes* copy = 0;
+    if ((index == count || estimate > coldestEstimate) && !_cns_hotkeys_copy(cns, key, &copy))
+    {
+        if (index < count)
+            cns_bytes_free_r(cns, hotKeys->topKeys[index]);
+        else
+            atomic_store_explicit(&hotKeys->topCount, ++count, memory_order_relaxed);
+        hotKeys->topKeys[index] = copy;
+        atomic_store_explicit(&hotKeys->topHashes[index], keyhash, memory_order_relaxed);
+        _cns_hotkeys_rebuildFilter(hotKeys);
+        _cns_hotkeys_coldest(hotKeys, count, &coldestEstimate);
+    }
+    // keys no hotter than the coldest need not take the mutex until they are
+    if (count == hotKeys->maxTop)
+        atomic_store_explicit(&hotKeys->floor, coldestEstimate, memory_order_relaxed);
+    pthread_mutex_unlock(&hotKeys->mutex);
+}
+
+static void _cns_hotkeys_age(cns_HotKeys* hotKeys)
+{
+    size_t numCounters = (size_t) _CNS_HOTKEYS_ROWS * (hotKeys->widthMask + 1);
+    for (size_t i = 0; i < numCounters; ++i)
+        atomic_store_explicit(&hotKeys->sketch[i], atomic_load_explicit(&hotKeys->sketch[i], memory_order_relaxed) >> 1, memory_order_relaxed);
+    atomic_store_explicit(&hotKeys->floor, atomic_load_explicit(&hotKeys->floor, memory_order_relaxed) >> 1, memory_order_relaxed);
+}
+
+static void _cns_hotkeys_count(cns_Runtime* cns, cns_HotKeys* hotKeys, _cns_HotKeys_Thread* thread, cns_Bytes* key, uint32_t keyhash)
+{
+    // racing increments may both see the old count; a sketch can live with the odd lost or doubled sample
+    uint32_t weight = hotKeys->sampleMask + 1;
+    uint64_t estimate = UINT32_MAX;
+    for (int row = 0; row < _CNS_HOTKEYS_ROWS; ++row)
+    {
+        uint32_t count = atomic_fetch_add_explicit(_cns_hotkeys_counter(hotKeys, row, keyhash), weight, memory_order_relaxed) + weight;
+        if (count < estimate)
+            estimate = count;
+    }
+
+    // threads sharing the state count here at once; the others are only bumped by the thread holding it
+    uint64_t sampled = atomic_fetch_add_explicit(&thread->sampled, 1, memory_order_relaxed) + 1;
+    if (sampled % _CNS_HOTKEYS_AGINGTICK == 0)
+    {
+        uint64_t ticks = atomic_fetch_add_explicit(&hotKeys->agingTicks, _CNS_HOTKEYS_AGINGTICK, memory_order_relaxed) + _CNS_HOTKEYS_AGINGTICK;
+        if (ticks % hotKeys->agingInterval == 0)
+            _cns_hotkeys_age(hotKeys);
+    }
+
+    if (estimate <= atomic_load_explicit(&hotKeys->floor, memory_order_relaxed))
+        return;
+    int count = atomic_load_explicit(&hotKeys->topCount, memory_order_relaxed);
+    for (int i = 0; i < count; ++i)
+    {
+        if (atomic_load_explicit(&hotKeys->topHashes[i], memory_order_relaxed) == keyhash)
+            return;
+    }
+    _cns_hotkeys_offer(cns, hotKeys, key, keyhash, estimate);
+}
+
+cns_Bool
+_cns_hotkeys_get(cns_Runtime* cns, cns_HotKeys* hotKeys, cns_Bytes* key, uint32_t keyhash, cns_Bytes** out_value)
+{
+    cns_Bool sample = !(++_cns_hotkeys_tick & hotKeys->sampleMask);
+    if (!sample && !hotKeys->numSlots)
+        return CNS_NO;
+    _cns_HotKeys_Thread* thread = _cns_hotkeys_thread(cns, hotKeys);
+    if (!thread)
+        return CNS_NO;
+    if (sample)
+        _cns_hotkeys_count(cns, hotKeys, thread, key, keyhash);
+    if (!hotKeys->numSlots || atomic_flag_test_and_set_explicit(&thread->busy, memory_order_acquire))
+        return CNS_NO;
+
+    _cns_HotKeys_Slot* slot = &thread->slots[keyhash & hotKeys->slotMask];
+    cns_Bool hit = slot->key && slot->hash == keyhash && slot->stamp == hotKeys->stamps[keyhash % _CNS_HOTKEYS_STRIPES]
+        && cns_bytes_equalUnchecked(slot->key, key);
+    if (hit)
+        cns_bytes_copy_r(cns, slot->value, out_value);
+    _cns_hotkeys_bump(hit ? &thread->hits : &thread->misses);
+    atomic_flag_clear_explicit(&thread->busy, memory_order_release);
+    return hit;
+}
+
+void
+_cns_hotkeys_fill(cns_Runtime* cns, cns_HotKeys* hotKeys, cns_Bytes* key, uint32_t keyhash, cns_Bytes* value)
+{
+    if (!hotKeys->numSlots || !_cns_hotkeys_filtered(hotKeys, keyhash))
+        return;
+    _cns_HotKeys_Thread* thread = _cns_hotkeys_thread(cns, hotKeys);
+    if (!thread || atomic_flag_test_and_set_explicit(&thread->busy, memory_order_acquire))
+        return;
+
+    _cns_HotKeys_Slot* slot = &thread->slots[keyhash & hotKeys->slotMask];
+    if (slot->key && (slot->hash != keyhash || !cns_bytes_equalUnchecked(slot->key, key)))
+    {
+        cns_bytes_free_r(cns, slot->key);
+        slot->key = 0;
+    }
+    if (slot->value)
+    {
+        cns_bytes_free_r(cns, slot->value);
+        slot->value = 0;
+    }
+    cns_Error err = slot->key ? CNS_OK : _cns_hotkeys_copy(cns, key, &slot->key);
+    if (!err)
+        err = _cns_hotkeys_copy(cns, value, &slot->value);
+    if (err && slot->key)
+    {
+        cns_bytes_free_r(cns, slot->key);
+        slot->key = 0;
+    }
+    if (!err)
+    {
+        slot->hash = keyhash;
+        slot->stamp = hotKeys->stamps[keyhash % _CNS_HOTKEYS_STRIPES];
+        _cns_hotkeys_bump(&thread->fills);
+    }
+    atomic_flag_clear_explicit(&thread->busy, memory_order_release);
+}
+
+void
+_cns_hotkeys_written(cns_HotKeys* hotKeys, uint32_t keyhash)
+{
+    ++hotKeys->stamps[keyhash % _CNS_HOTKEYS_STRIPES];
+}
+
+void
+_cns_hotkeys_writtenAll(cns_HotKeys* hotKeys)
+{
+    for (int i = 0; i < _CNS_HOTKEYS_STRIPES; ++i)
+        ++hotKeys->stamps[i];
+}
+
+static cns_Index _cns_hotkeys_roundUp(cns_Index value)
+{
+    cns_Index rounded = 1;
+    while (rounded < value)
+        rounded *= 2;
+    return rounded;
+}
+
+void
+cns_hotkeysoptions_default(cns_HotKeysOptions* out_options)
+{
+    if (!out_options)
+        return;
+    out_options->topKeys = 16;
+    out_options->sketchWidth = 4096;
+    out_options->sampleRate = 8;
+    out_options->cacheSlots = 64;
+}
+
+cns_HotKeys*
+cns_hotkeys_start(cns_Runtime* cns, cns_Storage* storage, const cns_HotKeysOptions* options)
+{
+    cns_HotKeysOptions defaults;
+    cns_hotkeysoptions_default(&defaults);
+    if (!options)
+        options = &defaults;
+    if (!cns || !storage || *_cns_storage_hotKeys(storage)
+        || options->topKeys < 1 || options->topKeys > _CNS_HOTKEYS_MAXTOP
+        || options->sketchWidth < 1 || options->sketchWidth > _CNS_HOTKEYS_MAXWIDTH
+        || options->sampleRate < 1 || options->sampleRate > _CNS_HOTKEYS_MAXSAMPLERATE
+        || options->cacheSlots < 0 || options->cacheSlots > _CNS_HOTKEYS_MAXSLOTS)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+    if (_cns_storage_engine(storage))
+    {
+        cns_setlasterr(cns, CNS_ERR_UNSUPPORTED);
+        return 0;
+    }
+
+    cns_Index width = _cns_hotkeys_roundUp(options->sketchWidth);
+    if (width < _CNS_HOTKEYS_MINWIDTH)
+        width = _CNS_HOTKEYS_MINWIDTH;
+    cns_HotKeys* hotKeys = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, sizeof(cns_HotKeys), (void**) &hotKeys);
+    if (!hotKeys)
+    {
+        cns_setlasterr(cns, err);
+        return 0;
+    }
+    memset(hotKeys, 0, sizeof(cns_HotKeys));
+    cns_Index sketchSize = _CNS_HOTKEYS_ROWS * width * (cns_Index) sizeof(uint32_t);
+    err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, sketchSize, (void**) &hotKeys->sketch);
+    if (!err)
+        err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, options->topKeys * (cns_Index) sizeof(cns_Bytes*), (void**) &hotKeys->topKeys);
+    if (!err)
+        err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, options->topKeys * (cns_Index) sizeof(uint32_t), (void**) &hotKeys->topHashes);
+    if (err)
+    {
+        cns_runtime_free_r(cns, hotKeys->topKeys);
+        cns_runtime_free_r(cns, hotKeys->sketch);
+        cns_runtime_free_r(cns, hotKeys);
+        cns_setlasterr(cns, err);
+        return 0;
+    }
+    memset((void*) hotKeys->sketch, 0, (size_t) sketchSize);
+    hotKeys->storage = storage;
+    hotKeys->sampleMask = (uint32_t) _cns_hotkeys_roundUp(options->sampleRate) - 1;
+    hotKeys->widthMask = (uint32_t) width - 1;
+    hotKeys->numSlots = options->cacheSlots ? _cns_hotkeys_roundUp(options->cacheSlots) : 0;
+    hotKeys->slotMask = hotKeys->numSlots ? (uint32_t) hotKeys->numSlots - 1 : 0;
+    hotKeys->maxTop = options->topKeys;
+    hotKeys->agingInterval = (uint64_t) width * _CNS_HOTKEYS_AGING;
+    pthread_mutex_init(&hotKeys->mutex, 0);
+    *_cns_storage_hotKeys(storage) = hotKeys;
+    cns_setlasterr(cns, CNS_OK);
+    return hotKeys;
+}
+
+void
+cns_hotkeys_stop(cns_Runtime* cns, cns_HotKeys* hotKeys)
+{
+    if (!cns || !hotKeys)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    *_cns_storage_hotKeys(hotKeys->storage) = 0;
+    for (int t = 0; t < _CNS_HOTKEYS_THREADS; ++t)
+    {
+        _cns_HotKeys_Thread* thread = atomic_load_explicit(&hotKeys->threads[t], memory_order_acquire);
+        if (!thread)
+            continue;
+        for (cns_Index i = 0; i < hotKeys->numSlots; ++i)
+        {
+            if (thread->slots[i].key)
+                cns_bytes_free_r(cns, thread->slots[i].key);
+            if (thread->slots[i].value)
+                cns_bytes_free_r(cns, thread->slots[i].value);
+        }
+        cns_runtime_free_r(cns, thread->memory);
+    }
+    int count = atomic_load_explicit(&hotKeys->topCount, memory_order_relaxed);
+    for (int i = 0; i < count; ++i)
+        cns_bytes_free_r(cns, hotKeys->topKeys[i]);
+    pthread_mutex_destroy(&hotKeys->mutex);
+    cns_runtime_free_r(cns, (void*) hotKeys->topHashes);
+    cns_runtime_free_r(cns, hotKeys->topKeys);
+    cns_runtime_free_r(cns, (void*) hotKeys->sketch);
+    cns_runtime_free_r(cns, hotKeys);
+    cns_setlasterr(cns, CNS_OK);
+}
+
+cns_Error
+cns_hotkeys_top_r(cns_Runtime* cns, cns_HotKeys* hotKeys, cns_HotKey* out, cns_Index max, cns_Index* out_count)
+{
+    if (!cns || !hotKeys || max < 0 || (max && !out) || !out_count)
+        return CNS_ERR_BADARG;
+
+    cns_HotKey sorted[_CNS_HOTKEYS_MAXTOP];
+    pthread_mutex_lock(&hotKeys->mutex);
+    int count = atomic_load_explicit(&hotKeys->topCount, memory_order_relaxed);
+    // few enough for an insertion sort, hottest first
+    for (int i = 0; i < count; ++i)
+    {
+        cns_HotKey entry = { hotKeys->topKeys[i], _cns_hotkeys_estimate(hotKeys, atomic_load_explicit(&hotKeys->topHashes[i], memory_order_relaxed)) };
+        int j = i;
+        for (; j > 0 && sorted[j - 1].count < entry.count; --j)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = entry;
+    }
+    cns_Index n = count < max ? count : max;
+    for (cns_Index i = 0; i < n; ++i)
+    {
+        out[i] = sorted[i];
+        cns_bytes_copy_r(cns, sorted[i].key, &out[i].key);
+    }
+    pthread_mutex_unlock(&hotKeys->mutex);
+    *out_count = n;
+    return CNS_OK;
+}
+
+cns_Index
+cns_hotkeys_top(cns_Runtime* cns, cns_HotKeys* hotKeys, cns_HotKey* out, cns_Index max)
+{
+    cns_Index rv = 0;
+    cns_setlasterr(cns, cns_hotkeys_top_r(cns, hotKeys, out, max, &rv));
+    return rv;
+}
+
+void
+cns_hotkeys_releaseTop(cns_Runtime* cns, cns_HotKey* keys, cns_Index count)
+{
+    if (!cns || count < 0 || (count && !keys))
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+    for (cns_Index i = 0; i < count; ++i)
+    {
+        if (keys[i].key)
+            cns_bytes_free_r(cns, keys[i].key);
+        keys[i].key = 0;
+    }
+    cns_setlasterr(cns, CNS_OK);
+}
+
+void
+cns_hotkeys_stats(cns_Runtime* cns, cns_HotKeys* hotKeys, cns_HotKeysStats* out_stats)
+{
+    if (!cns || !hotKeys || !out_stats)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+    memset(out_stats, 0, sizeof(cns_HotKeysStats));
+    for (int t = 0; t < _CNS_HOTKEYS_THREADS; ++t)
+    {
+        _cns_HotKeys_Thread* thread = atomic_load_explicit(&hotKeys->threads[t], memory_order_acquire);
+        if (!thread)
+            continue;
+        out_stats->sampled += atomic_load_explicit(&thread->sampled, memory_order_relaxed);
+        out_stats->cacheHits += atomic_load_explicit(&thread->hits, memory_order_relaxed);
+        out_stats->cacheMisses += atomic_load_explicit(&thread->misses, memory_order_relaxed);
+        out_stats->cacheFills += atomic_load_explicit(&thread->fills, memory_order_relaxed);
+    }
+    cns_setlasterr(cns, CNS_OK);
+}
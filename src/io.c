@@ -0,0 +1,801 @@
+#include <consensual/io.h>
+#include <consensual/bytes_impl.h>
+#include "runtime_impl.h"
+
+#include <errno.h>
+#include <limits.h> // IOV_MAX
+#include <string.h> // memset
+#include <unistd.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define _CNS_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+typedef struct _cns_IoOp
+{
+    int                 op;
+    int                 fd;
+    int64_t             offset;
+    cns_Bool            dataOnly;
+    cns_Bytes*          data; // being written, or read into
+    struct iovec*       iov; // `&inlineIov` unless the data is in several pieces
+    int                 iovcnt;
+    int                 bufIndex; // registered buffer holding the data of a write, -1 if none
+    struct iovec        inlineIov;
+    cns_IoCallback      callback;
+    void*               context;
+    cns_Index           result;
+    struct _cns_IoOp*   next; // in the queue, the done list or the free list
+} _cns_IoOp;
+
+struct cns_Io
+{
+    _cns_IoOp*          queueHead; // waiting to be submitted
+    _cns_IoOp*          queueTail;
+    _cns_IoOp*          doneHead; // run by the fallback, waiting to be polled
+    _cns_IoOp*          doneTail;
+    _cns_IoOp*          freeOps;
+    cns_Bytes**         buffers;
+    cns_Index           numBuffers;
+    cns_IoStats         stats;
+#ifdef _CNS_IO_URING
+    int                 ringFd; // -1 for the fallback
+    unsigned            unsubmitted; // entries filled in but not passed to io_uring_enter yet
+    void*               sqMap;
+    size_t              sqMapSize;
+    void*               cqMap; // same as `sqMap` with IORING_FEAT_SINGLE_MMAP
+    size_t              cqMapSize;
+    struct io_uring_sqe* sqes;
+    size_t              sqesSize;
+    unsigned*           sqHead; // shared with the kernel, hence the atomic accesses
+    unsigned*           sqTail;
+    unsigned            sqMask;
+    unsigned            sqEntries;
+    unsigned*           sqArray;
+    unsigned*           cqHead;
+    unsigned*           cqTail;
+    unsigned            cqMask;
+    unsigned            cqEntries;
+    struct io_uring_cqe* cqes;
+#endif
+};
+
+void
+cns_iooptions_default(cns_IoOptions* out_options)
+{
+    if (!out_options)
+        return;
+    out_options->entries = 64;
+    out_options->portable = CNS_NO;
+}
+
+#ifdef _CNS_IO_URING
+
+static cns_Bool _cns_io_setupRing(cns_Io* io, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return CNS_NO;
+
+    io->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    cns_Bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && io->cqMapSize > io->sqMapSize)
+        io->sqMapSize = io->cqMapSize;
+    io->sqMap = mmap(0, io->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    io->cqMap = single ? io->sqMap : mmap(0, io->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    io->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = (struct io_uring_sqe*) mmap(0, io->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (io->sqMap == MAP_FAILED || io->cqMap == MAP_FAILED || io->sqes == MAP_FAILED)
+    {
+        if (io->sqes != MAP_FAILED)
+            munmap(io->sqes, io->sqesSize);
+        if (io->cqMap != MAP_FAILED && io->cqMap != io->sqMap)
+            munmap(io->cqMap, io->cqMapSize);
+        if (io->sqMap != MAP_FAILED)
+            munmap(io->sqMap, io->sqMapSize);
+        close(fd);
+        return CNS_NO;
+    }
+
+    uint8_t* sq = (uint8_t*) io->sqMap;
+    uint8_t* cq = (uint8_t*) io->cqMap;
+    io->sqHead = (unsigned*) (sq + params.sq_off.head);
+    io->sqTail = (unsigned*) (sq + params.sq_off.tail);
+    io->sqMask = *(unsigned*) (sq + params.sq_off.ring_mask);
+    io->sqEntries = params.sq_entries;
+    io->sqArray = (unsigned*) (sq + params.sq_off.array);
+    io->cqHead = (unsigned*) (cq + params.cq_off.head);
+    io->cqTail = (unsigned*) (cq + params.cq_off.tail);
+    io->cqMask = *(unsigned*) (cq + params.cq_off.ring_mask);
+    io->cqEntries = params.cq_entries;
+    io->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    io->ringFd = fd;
+    return CNS_YES;
+}
+
+static void _cns_io_closeRing(cns_Io* io)
+{
+    munmap(io->sqes, io->sqesSize);
+    if (io->cqMap != io->sqMap)
+        munmap(io->cqMap, io->cqMapSize);
+    munmap(io->sqMap, io->sqMapSize);
+    close(io->ringFd);
+    io->ringFd = -1;
+}
+
+static int _cns_io_enter(cns_Io* io, unsigned toSubmit, unsigned minComplete)
+{
+    ++io->stats.systemCalls;
+    return (int) syscall(__NR_io_uring_enter, io->ringFd, toSubmit, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+}
+
+static void _cns_io_prepare(struct io_uring_sqe* sqe, _cns_IoOp* op)
+{
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = op->fd;
+    sqe->user_data = (uint64_t) (uintptr_t) op;
+    sqe->off = (uint64_t) op->offset; // -1 stands for the file position
+    if (op->op == CNS_IO_FSYNC)
+    {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = op->dataOnly ? IORING_FSYNC_DATASYNC : 0;
+        sqe->flags = IOSQE_IO_DRAIN;
+        sqe->off = 0;
+    }
+    else if (op->bufIndex >= 0)
+    {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->addr = (uint64_t) (uintptr_t) op->inlineIov.iov_base;
+        sqe->len = (uint32_t) op->inlineIov.iov_len;
+        sqe->buf_index = (uint16_t) op->bufIndex;
+    }
+    else
+    {
+        sqe->opcode = op->op == CNS_IO_WRITE ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (uint64_t) (uintptr_t) op->iov;
+        sqe->len = (uint32_t) op->iovcnt;
+    }
+}
+
+// Moves queued operations into free submission entries, leaving room in the completion ring for all in flight
+static void _cns_io_fillRing(cns_Io* io)
+{
+    unsigned tail = *io->sqTail;
+    unsigned head = __atomic_load_n(io->sqHead, __ATOMIC_ACQUIRE);
+    while (io->queueHead && tail - head < io->sqEntries && (unsigned) io->stats.inFlight < io->cqEntries)
+    {
+        _cns_IoOp* op = io->queueHead;
+        io->queueHead = op->next;
+        if (!io->queueHead)
+            io->queueTail = 0;
+        --io->stats.queued;
+
+        unsigned index = tail & io->sqMask;
+        _cns_io_prepare(&io->sqes[index], op);
+        io->sqArray[index] = index;
+        ++tail;
+        ++io->unsubmitted;
+        ++io->stats.inFlight;
+        if (op->bufIndex >= 0)
+            ++io->stats.fixedWrites;
+    }
+    __atomic_store_n(io->sqTail, tail, __ATOMIC_RELEASE);
+}
+
+#endif // _CNS_IO_URING
+
+static cns_Bool _cns_io_async(cns_Io* io)
+{
+#ifdef _CNS_IO_URING
+    return io->ringFd >= 0;
+#else
+    (void) io;
+    return CNS_NO;
+#endif
+}
+
+static cns_Index _cns_io_writeAll(_cns_IoOp* op)
+{
+    struct iovec* iov = op->iov;
+    int iovcnt = op->iovcnt;
+    cns_Index total = 0;
+    while (iovcnt > 0)
+    {
+        ssize_t n = op->offset < 0 ? writev(op->fd, iov, iovcnt) : pwritev(op->fd, iov, iovcnt, op->offset + total);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return total ? total : -errno;
+        if (n == 0)
+            break;
+        total += n;
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len)
+        {
+            n -= (ssize_t) iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (uint8_t*) iov->iov_base + n;
+            iov->iov_len -= (size_t) n;
+        }
+    }
+    return total;
+}
+
+static cns_Index _cns_io_readAll(_cns_IoOp* op)
+{
+    uint8_t* ptr = (uint8_t*) op->inlineIov.iov_base;
+    size_t length = op->inlineIov.iov_len;
+    cns_Index total = 0;
+    while ((size_t) total < length)
+    {
+        ssize_t n = op->offset < 0 ? read(op->fd, ptr + total, length - (size_t) total)
+                                   : pread(op->fd, ptr + total, length - (size_t) total, op->offset + total);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return total ? total : -errno;
+        if (n == 0)
+            break;
+        total += n;
+    }
+    return total;
+}
+
+// The fallback: runs the operation to the end, blocking
+static void _cns_io_runBlocking(cns_Io* io, _cns_IoOp* op)
+{
+    ++io->stats.systemCalls;
+    if (op->op == CNS_IO_WRITE)
+        op->result = _cns_io_writeAll(op);
+    else if (op->op == CNS_IO_READ)
+        op->result = _cns_io_readAll(op);
+    else
+    {
+        int rv;
+        do
+            rv = op->dataOnly ? fdatasync(op->fd) : fsync(op->fd);
+        while (rv < 0 && errno == EINTR);
+        op->result = rv < 0 ? -errno : 0;
+    }
+}
+
+static cns_Error _cns_io_allocOp(cns_Runtime* cns, cns_Io* io, _cns_IoOp** out_op)
+{
+    _cns_IoOp* op = io->freeOps;
+    if (op)
+        io->freeOps = op->next;
+    else
+    {
+        cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_IO, sizeof(_cns_IoOp), (void**) &op);
+        if (!op)
+            return err;
+    }
+    memset(op, 0, sizeof(_cns_IoOp));
+    op->iov = &op->inlineIov;
+    op->iovcnt = 1;
+    op->bufIndex = -1;
+    *out_op = op;
+    return CNS_OK;
+}
+
+static void _cns_io_releaseOp(cns_Runtime* cns, cns_Io* io, _cns_IoOp* op)
+{
+    if (op->data)
+        cns_bytes_free_r(cns, op->data);
+    if (op->iov != &op->inlineIov)
+        cns_runtime_free_r(cns, op->iov);
+    op->next = io->freeOps;
+    io->freeOps = op;
+}
+
+static void _cns_io_enqueue(cns_Io* io, _cns_IoOp* op)
+{
+    op->next = 0;
+    if (io->queueTail)
+        io->queueTail->next = op;
+    else
+        io->queueHead = op;
+    io->queueTail = op;
+    ++io->stats.queued;
+}
+
+cns_Io*
+cns_io_new(cns_Runtime* cns, const cns_IoOptions* options)
+{
+    cns_IoOptions defaults;
+    cns_iooptions_default(&defaults);
+    if (!options)
+        options = &defaults;
+    if (!cns || options->entries <= 0 || options->entries > 4096)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+
+    cns_Io* io = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_IO, sizeof(cns_Io), (void**) &io);
+    if (io)
+    {
+        memset(io, 0, sizeof(cns_Io));
+#ifdef _CNS_IO_URING
+        io->ringFd = -1;
+        if (!options->portable)
+            _cns_io_setupRing(io, (unsigned) options->entries);
+#endif
+        io->stats.async = _cns_io_async(io);
+    }
+    cns_setlasterr(cns, err);
+    return io;
+}
+
+// Hands over completions in order: to the callback, or into `out` while it has room. Returns CNS_NO, leaving the
+// operation where it is, if it would go to `out` and that is full.
+static cns_Bool _cns_io_deliver(cns_Runtime* cns, cns_Io* io, _cns_IoOp* op, cns_IoCompletion* out, cns_Index max, cns_Index* stored)
+{
+    if (!op->callback && *stored >= max)
+        return CNS_NO;
+
+    cns_IoCompletion completion = { .context = op->context, .op = op->op, .result = op->result, .data = 0 };
+    if (op->op == CNS_IO_READ && op->result >= 0)
+    {
+        // the block was sized for the whole request
+        ((_cns_BytesImpl*) op->data)->length = op->result;
+        completion.data = op->data;
+        op->data = 0;
+    }
+    ++io->stats.completed;
+    cns_IoCallback callback = op->callback;
+    _cns_io_releaseOp(cns, io, op);
+    if (callback)
+        callback(cns, io, &completion);
+    else
+        out[(*stored)++] = completion;
+    return CNS_YES;
+}
+
+// Takes whatever completed, without waiting. Returns the number of completions handed over.
+static cns_Index _cns_io_reap(cns_Runtime* cns, cns_Io* io, cns_IoCompletion* out, cns_Index max, cns_Index* stored)
+{
+    cns_Index handled = 0;
+    while (io->doneHead)
+    {
+        _cns_IoOp* op = io->doneHead;
+        _cns_IoOp* next = op->next;
+        if (!_cns_io_deliver(cns, io, op, out, max, stored))
+            return handled;
+        io->doneHead = next;
+        if (!next)
+            io->doneTail = 0;
+        ++handled;
+    }
+
+#ifdef _CNS_IO_URING
+    if (io->ringFd < 0)
+        return handled;
+    unsigned head = *io->cqHead;
+    unsigned tail = __atomic_load_n(io->cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        struct io_uring_cqe* cqe = &io->cqes[head & io->cqMask];
+        _cns_IoOp* op = (_cns_IoOp*) (uintptr_t) cqe->user_data;
+        if (!op->callback && *stored >= max)
+            break;
+        op->result = cqe->res;
+        // the entry is free as soon as the head moves, and callbacks may submit more
+        __atomic_store_n(io->cqHead, ++head, __ATOMIC_RELEASE);
+        --io->stats.inFlight;
+        _cns_io_deliver(cns, io, op, out, max, stored);
+        ++handled;
+        tail = __atomic_load_n(io->cqTail, __ATOMIC_ACQUIRE);
+    }
+#endif
+    return handled;
+}
+
+static cns_Error _cns_io_submit(cns_Io* io, unsigned minComplete, cns_Index* out_submitted)
+{
+    *out_submitted = 0;
+    if (!_cns_io_async(io))
+    {
+        while (io->queueHead)
+        {
+            _cns_IoOp* op = io->queueHead;
+            io->queueHead = op->next;
+            if (!io->queueHead)
+                io->queueTail = 0;
+            --io->stats.queued;
+
+            _cns_io_runBlocking(io, op);
+            op->next = 0;
+            if (io->doneTail)
+                io->doneTail->next = op;
+            else
+                io->doneHead = op;
+            io->doneTail = op;
+            ++*out_submitted;
+            ++io->stats.submitted;
+        }
+        return CNS_OK;
+    }
+
+#ifdef _CNS_IO_URING
+    _cns_io_fillRing(io);
+    while (io->unsubmitted || minComplete)
+    {
+        int rv = _cns_io_enter(io, io->unsubmitted, minComplete);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        // EAGAIN and EBUSY mean the kernel wants completions reaped first; what is left goes with the next call
+        if (rv < 0)
+            return (errno == EAGAIN || errno == EBUSY) ? CNS_OK : CNS_ERR_IO;
+        io->unsubmitted -= (unsigned) rv;
+        *out_submitted += rv;
+        io->stats.submitted += (uint64_t) rv;
+        minComplete = 0;
+    }
+#endif
+    return CNS_OK;
+}
+
+void
+cns_io_free(cns_Runtime* cns, cns_Io* io)
+{
+    if (!cns || !io)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    while (io->queueHead)
+    {
+        _cns_IoOp* op = io->queueHead;
+        io->queueHead = op->next;
+        _cns_io_releaseOp(cns, io, op);
+    }
+    io->queueTail = 0;
+    io->stats.queued = 0;
+
+#ifdef _CNS_IO_URING
+    if (io->ringFd >= 0)
+    {
+        // the kernel may still be using the memory of what is in flight
+        cns_Index submitted = 0;
+        _cns_io_submit(io, 0, &submitted);
+        while (io->stats.inFlight)
+        {
+            unsigned head = *io->cqHead;
+            unsigned tail = __atomic_load_n(io->cqTail, __ATOMIC_ACQUIRE);
+            if (head == tail)
+            {
+                int rv = _cns_io_enter(io, io->unsubmitted, 1);
+                if (rv < 0 && errno != EINTR)
+                    break;
+                if (rv > 0)
+                    io->unsubmitted -= (unsigned) rv;
+                continue;
+            }
+            _cns_IoOp* op = (_cns_IoOp*) (uintptr_t) io->cqes[head & io->cqMask].user_data;
+            __atomic_store_n(io->cqHead, head + 1, __ATOMIC_RELEASE);
+            --io->stats.inFlight;
+            _cns_io_releaseOp(cns, io, op);
+        }
+        _cns_io_closeRing(io);
+    }
+#endif
+
+    while (io->doneHead)
+    {
+        _cns_IoOp* op = io->doneHead;
+        io->doneHead = op->next;
+        _cns_io_releaseOp(cns, io, op);
+    }
+    while (io->freeOps)
+    {
+        _cns_IoOp* op = io->freeOps;
+        io->freeOps = op->next;
+        cns_runtime_free_r(cns, op);
+    }
+    for (cns_Index i = 0; i < io->numBuffers; ++i)
+        cns_bytes_free_r(cns, io->buffers[i]);
+    cns_runtime_free_r(cns, io->buffers);
+    cns_runtime_free_r(cns, io);
+    cns_setlasterr(cns, CNS_OK);
+}
+
+cns_Error
+cns_io_write_r(cns_Runtime* cns, cns_Io* io, int fd, int64_t offset, cns_Bytes* data, cns_IoCallback callback, void* context)
+{
+    if (!cns || !io || fd < 0 || offset < -1 || !data)
+        return CNS_ERR_BADARG;
+
+    _cns_IoOp* op = 0;
+    cns_Error err = _cns_io_allocOp(cns, io, &op);
+    if (!op)
+        return err;
+    op->op = CNS_IO_WRITE;
+    op->fd = fd;
+    op->offset = offset;
+    op->callback = callback;
+    op->context = context;
+    cns_bytes_copy_r(cns, data, &op->data);
+
+    cns_Index numChunks = cns_bytes_isFlatUnchecked(data) ? 1 : cns_bytes_chunkCountUnchecked(data);
+    if (numChunks > 1 && numChunks <= IOV_MAX)
+    {
+        err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_IO, numChunks * (cns_Index) sizeof(struct iovec), (void**) &op->iov);
+        if (!op->iov)
+        {
+            op->iov = &op->inlineIov;
+            _cns_io_releaseOp(cns, io, op);
+            return err;
+        }
+        cns_BytesChunks chunks;
+        cns_bytes_chunksBeginUnchecked(data, &chunks);
+        const void * ptr;
+        cns_Index length;
+        op->iovcnt = 0;
+        while (cns_bytes_chunksNextUnchecked(&chunks, &ptr, &length))
+        {
+            op->iov[op->iovcnt].iov_base = (void*) ptr;
+            op->iov[op->iovcnt].iov_len = (size_t) length;
+            ++op->iovcnt;
+        }
+    }
+    else
+    {
+        // flat already, or in more pieces than one system call takes
+        const void * ptr = cns_bytes_ptrUnchecked(data);
+        if (!ptr)
+        {
+            _cns_io_releaseOp(cns, io, op);
+            return CNS_ERR_NOMEM;
+        }
+        op->inlineIov.iov_base = (void*) ptr;
+        op->inlineIov.iov_len = (size_t) cns_bytes_lengthUnchecked(data);
+        for (cns_Index i = 0; i < io->numBuffers && op->bufIndex < 0; ++i)
+        {
+            const uint8_t* begin = (const uint8_t*) cns_bytes_ptrUnchecked(io->buffers[i]);
+            const uint8_t* end = begin + cns_bytes_lengthUnchecked(io->buffers[i]);
+            if ((const uint8_t*) ptr >= begin && (const uint8_t*) ptr + op->inlineIov.iov_len <= end)
+                op->bufIndex = (int) i;
+        }
+    }
+    _cns_io_enqueue(io, op);
+    return CNS_OK;
+}
+
+void
+cns_io_write(cns_Runtime* cns, cns_Io* io, int fd, int64_t offset, cns_Bytes* data, cns_IoCallback callback, void* context)
+{
+    cns_setlasterr(cns, cns_io_write_r(cns, io, fd, offset, data, callback, context));
+}
+
+cns_Error
+cns_io_read_r(cns_Runtime* cns, cns_Io* io, int fd, int64_t offset, cns_Index length, cns_IoCallback callback, void* context)
+{
+    if (!cns || !io || fd < 0 || offset < -1 || length < 0)
+        return CNS_ERR_BADARG;
+
+    _cns_IoOp* op = 0;
+    cns_Error err = _cns_io_allocOp(cns, io, &op);
+    if (!op)
+        return err;
+    _cns_BytesImpl* block = 0;
+    err = _cns_bytes_alloc(cns, length, &block);
+    if (!block)
+    {
+        _cns_io_releaseOp(cns, io, op);
+        return err;
+    }
+    op->op = CNS_IO_READ;
+    op->fd = fd;
+    op->offset = offset;
+    op->callback = callback;
+    op->context = context;
+    op->data = (cns_Bytes*) block;
+    op->inlineIov.iov_base = (void*) block->data;
+    op->inlineIov.iov_len = (size_t) length;
+    _cns_io_enqueue(io, op);
+    return CNS_OK;
+}
+
+void
+cns_io_read(cns_Runtime* cns, cns_Io* io, int fd, int64_t offset, cns_Index length, cns_IoCallback callback, void* context)
+{
+    cns_setlasterr(cns, cns_io_read_r(cns, io, fd, offset, length, callback, context));
+}
+
+cns_Error
+cns_io_fsync_r(cns_Runtime* cns, cns_Io* io, int fd, cns_Bool dataOnly, cns_IoCallback callback, void* context)
+{
+    if (!cns || !io || fd < 0)
+        return CNS_ERR_BADARG;
+
+    _cns_IoOp* op = 0;
+    cns_Error err = _cns_io_allocOp(cns, io, &op);
+    if (!op)
+        return err;
+    op->op = CNS_IO_FSYNC;
+    op->fd = fd;
+    op->dataOnly = dataOnly;
+    op->callback = callback;
+    op->context = context;
+    _cns_io_enqueue(io, op);
+    return CNS_OK;
+}
+
+void
+cns_io_fsync(cns_Runtime* cns, cns_Io* io, int fd, cns_Bool dataOnly, cns_IoCallback callback, void* context)
+{
+    cns_setlasterr(cns, cns_io_fsync_r(cns, io, fd, dataOnly, callback, context));
+}
+
+cns_Error
+cns_io_submit_r(cns_Runtime* cns, cns_Io* io, cns_Index* out_submitted)
+{
+    if (!cns || !io || !out_submitted)
+        return CNS_ERR_BADARG;
+    return _cns_io_submit(io, 0, out_submitted);
+}
+
+cns_Index
+cns_io_submit(cns_Runtime* cns, cns_Io* io)
+{
+    cns_Index rv = 0;
+    cns_setlasterr(cns, cns_io_submit_r(cns, io, &rv));
+    return rv;
+}
+
+cns_Error
+cns_io_poll_r(cns_Runtime* cns, cns_Io* io, cns_IoCompletion* out, cns_Index max, cns_Index waitFor, cns_Index* out_stored)
+{
+    if (!cns || !io || max < 0 || (max && !out) || waitFor < 0 || !out_stored)
+        return CNS_ERR_BADARG;
+
+    *out_stored = 0;
+    cns_Index handled = 0;
+    for (;;)
+    {
+        cns_Index submitted = 0;
+        cns_Error err = _cns_io_submit(io, 0, &submitted);
+        if (err)
+            return err;
+        handled += _cns_io_reap(cns, io, out, max, out_stored);
+
+        // nothing more to wait for once `out` is full or nothing is left
+        cns_Index outstanding = io->stats.inFlight + io->stats.queued;
+        if (handled >= waitFor || !outstanding || (io->doneHead && *out_stored >= max))
+            return CNS_OK;
+        if (!_cns_io_async(io))
+            continue;
+
+#ifdef _CNS_IO_URING
+        if (__atomic_load_n(io->cqTail, __ATOMIC_ACQUIRE) == *io->cqHead)
+        {
+            err = _cns_io_submit(io, 1, &submitted);
+            if (err)
+                return err;
+        }
+        else if (*out_stored >= max)
+        {
+            // the next completion goes to `out`, which is full
+            _cns_IoOp* op = (_cns_IoOp*) (uintptr_t) io->cqes[*io->cqHead & io->cqMask].user_data;
+            if (!op->callback)
+                return CNS_OK;
+        }
+#endif
+    }
+}
+
+cns_Index
+cns_io_poll(cns_Runtime* cns, cns_Io* io, cns_IoCompletion* out, cns_Index max, cns_Index waitFor)
+{
+    cns_Index rv = 0;
+    cns_setlasterr(cns, cns_io_poll_r(cns, io, out, max, waitFor, &rv));
+    return rv;
+}
+
+cns_Error
+cns_io_registerBuffers_r(cns_Runtime* cns, cns_Io* io, cns_Bytes** buffers, cns_Index count)
+{
+    if (!cns || !io || count < 0 || count > 1024 || (count && !buffers))
+        return CNS_ERR_BADARG;
+    if (io->stats.queued || io->stats.inFlight)
+        return CNS_ERR_BADARG;
+
+    struct iovec* iovs = 0;
+    cns_Bytes** held = 0;
+    cns_Error err = CNS_OK;
+    if (count)
+    {
+        err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_IO, count * (cns_Index) sizeof(struct iovec), (void**) &iovs);
+        if (!err)
+            err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_IO, count * (cns_Index) sizeof(cns_Bytes*), (void**) &held);
+        for (cns_Index i = 0; !err && i < count; ++i)
+        {
+            if (!buffers[i] || !cns_bytes_lengthUnchecked(buffers[i]))
+                err = CNS_ERR_BADARG;
+            else if (!(iovs[i].iov_base = (void*) cns_bytes_ptrUnchecked(buffers[i])))
+                err = CNS_ERR_NOMEM;
+            else
+                iovs[i].iov_len = (size_t) cns_bytes_lengthUnchecked(buffers[i]);
+        }
+    }
+
+    if (err)
+    {
+        cns_runtime_free_r(cns, held);
+        cns_runtime_free_r(cns, iovs);
+        return err;
+    }
+
+#ifdef _CNS_IO_URING
+    if (io->ringFd >= 0)
+    {
+        if (io->numBuffers)
+        {
+            syscall(__NR_io_uring_register, io->ringFd, IORING_UNREGISTER_BUFFERS, 0, 0);
+            ++io->stats.systemCalls;
+        }
+        if (count)
+        {
+            ++io->stats.systemCalls;
+            if (syscall(__NR_io_uring_register, io->ringFd, IORING_REGISTER_BUFFERS, iovs, (unsigned) count) < 0)
+            {
+                // the previous buffers are gone from the kernel already, so they are dropped here too
+                err = CNS_ERR_IO;
+                count = 0;
+            }
+        }
+    }
+#endif
+    cns_runtime_free_r(cns, iovs);
+
+    for (cns_Index i = 0; i < io->numBuffers; ++i)
+        cns_bytes_free_r(cns, io->buffers[i]);
+    cns_runtime_free_r(cns, io->buffers);
+    if (!count)
+    {
+        cns_runtime_free_r(cns, held);
+        held = 0;
+    }
+    for (cns_Index i = 0; i < count; ++i)
+        cns_bytes_copy_r(cns, buffers[i], &held[i]);
+    io->buffers = held;
+    io->numBuffers = count;
+    return err;
+}
+
+void
+cns_io_registerBuffers(cns_Runtime* cns, cns_Io* io, cns_Bytes** buffers, cns_Index count)
+{
+    cns_setlasterr(cns, cns_io_registerBuffers_r(cns, io, buffers, count));
+}
+
+void
+cns_io_stats(cns_Runtime* cns, cns_Io* io, cns_IoStats* out_stats)
+{
+    if (!cns || !io || !out_stats)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+    *out_stats = io->stats;
+    cns_setlasterr(cns, CNS_OK);
+}
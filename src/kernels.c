@@ -0,0 +1,238 @@
+#include <consensual/kernels.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h> // memcmp, memcpy
+
+#if defined(__x86_64__) || defined(__i386__)
+#define _CNS_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+typedef uint32_t (* _cns_Crc32cFn)(uint32_t crc, const uint8_t* p, cns_Index length);
+typedef cns_Bool (* _cns_EqualFn)(const uint8_t* lhs, const uint8_t* rhs, cns_Index length);
+
+static pthread_once_t _cns_kernels_once = PTHREAD_ONCE_INIT;
+static atomic_int _cns_kernels_ready;
+static cns_KernelLevel _cns_kernels_best;
+static uint32_t _cns_crc32c_table[8][256];
+
+
+// slicing-by-8, reflected polynomial 0x82F63B78
+static uint32_t _cns_crc32c_scalar(uint32_t crc, const uint8_t* p, cns_Index length)
+{
+    while (length && ((uintptr_t) p & 7))
+    {
+        crc = _cns_crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        --length;
+    }
+    while (length >= 8)
+    {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= crc;
+        crc = _cns_crc32c_table[7][lo & 0xff] ^ _cns_crc32c_table[6][(lo >> 8) & 0xff]
+            ^ _cns_crc32c_table[5][(lo >> 16) & 0xff] ^ _cns_crc32c_table[4][lo >> 24]
+            ^ _cns_crc32c_table[3][hi & 0xff] ^ _cns_crc32c_table[2][(hi >> 8) & 0xff]
+            ^ _cns_crc32c_table[1][(hi >> 16) & 0xff] ^ _cns_crc32c_table[0][hi >> 24];
+        p += 8;
+        length -= 8;
+    }
+    while (length--)
+        crc = _cns_crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+static cns_Bool _cns_equal_scalar(const uint8_t* lhs, const uint8_t* rhs, cns_Index length)
+{
+    return (0 == memcmp(lhs, rhs, length));
+}
+
+#ifdef _CNS_KERNELS_X86
+
+__attribute__((target("sse4.2")))
+static uint32_t _cns_crc32c_sse42(uint32_t crc, const uint8_t* p, cns_Index length)
+{
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        length -= 8;
+    }
+    crc = (uint32_t) crc64;
+#endif
+    while (length >= 4)
+    {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        crc = _mm_crc32_u32(crc, word);
+        p += 4;
+        length -= 4;
+    }
+    while (length--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+__attribute__((target("sse2")))
+static cns_Bool _cns_equal_sse2(const uint8_t* lhs, const uint8_t* rhs, cns_Index length)
+{
+    if (length < 16)
+        return _cns_equal_scalar(lhs, rhs, length);
+
+    // accumulate differences and test once per 64 bytes
+    cns_Index i = 0;
+    for (; i + 64 <= length; i += 64)
+    {
+        __m128i d0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (lhs + i)), _mm_loadu_si128((const __m128i*) (rhs + i)));
+        __m128i d1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (lhs + i + 16)), _mm_loadu_si128((const __m128i*) (rhs + i + 16)));
+        __m128i d2 = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (lhs + i + 32)), _mm_loadu_si128((const __m128i*) (rhs + i + 32)));
+        __m128i d3 = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (lhs + i + 48)), _mm_loadu_si128((const __m128i*) (rhs + i + 48)));
+        __m128i d = _mm_or_si128(_mm_or_si128(d0, d1), _mm_or_si128(d2, d3));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(d, _mm_setzero_si128())) != 0xffff)
+            return CNS_NO;
+    }
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*) (lhs + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (rhs + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xffff)
+            return CNS_NO;
+    }
+    if (i == length)
+        return CNS_YES;
+
+    // the tail overlaps bytes already compared, which is harmless
+    __m128i a = _mm_loadu_si128((const __m128i*) (lhs + length - 16));
+    __m128i b = _mm_loadu_si128((const __m128i*) (rhs + length - 16));
+    return (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) == 0xffff);
+}
+
+__attribute__((target("avx2")))
+static cns_Bool _cns_equal_avx2(const uint8_t* lhs, const uint8_t* rhs, cns_Index length)
+{
+    if (length < 32)
+        return _cns_equal_sse2(lhs, rhs, length);
+
+    cns_Index i = 0;
+    for (; i + 128 <= length; i += 128)
+    {
+        __m256i d0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (lhs + i)), _mm256_loadu_si256((const __m256i*) (rhs + i)));
+        __m256i d1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (lhs + i + 32)), _mm256_loadu_si256((const __m256i*) (rhs + i + 32)));
+        __m256i d2 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (lhs + i + 64)), _mm256_loadu_si256((const __m256i*) (rhs + i + 64)));
+        __m256i d3 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (lhs + i + 96)), _mm256_loadu_si256((const __m256i*) (rhs + i + 96)));
+        __m256i d = _mm256_or_si256(_mm256_or_si256(d0, d1), _mm256_or_si256(d2, d3));
+        if (!_mm256_testz_si256(d, d))
+            return CNS_NO;
+    }
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i d = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (lhs + i)), _mm256_loadu_si256((const __m256i*) (rhs + i)));
+        if (!_mm256_testz_si256(d, d))
+            return CNS_NO;
+    }
+    if (i == length)
+        return CNS_YES;
+
+    __m256i d = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (lhs + length - 32)), _mm256_loadu_si256((const __m256i*) (rhs + length - 32)));
+    return _mm256_testz_si256(d, d);
+}
+
+#endif // _CNS_KERNELS_X86
+
+static _cns_Crc32cFn _cns_crc32c_best = _cns_crc32c_scalar;
+static _cns_EqualFn _cns_equal_best = _cns_equal_scalar;
+
+static void _cns_kernels_init(void)
+{
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; ++k)
+            crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+        _cns_crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; ++i)
+        for (int t = 1; t < 8; ++t)
+            _cns_crc32c_table[t][i] = (_cns_crc32c_table[t - 1][i] >> 8) ^ _cns_crc32c_table[0][_cns_crc32c_table[t - 1][i] & 0xff];
+
+    _cns_kernels_best = CNS_KERNEL_SCALAR;
+#ifdef _CNS_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+    {
+        _cns_kernels_best = CNS_KERNEL_SSE2;
+        _cns_equal_best = _cns_equal_sse2;
+    }
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        _cns_kernels_best = CNS_KERNEL_SSE42;
+        _cns_crc32c_best = _cns_crc32c_sse42;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        _cns_kernels_best = CNS_KERNEL_AVX2;
+        _cns_equal_best = _cns_equal_avx2;
+    }
+#endif
+    atomic_store_explicit(&_cns_kernels_ready, 1, memory_order_release);
+}
+
+// cheaper than going through pthread_once on every call
+static inline void _cns_kernels_ensureInit(void)
+{
+    if (!atomic_load_explicit(&_cns_kernels_ready, memory_order_acquire))
+        pthread_once(&_cns_kernels_once, _cns_kernels_init);
+}
+
+cns_KernelLevel
+cns_kernels_bestLevel(void)
+{
+    _cns_kernels_ensureInit();
+    return _cns_kernels_best;
+}
+
+cns_Bool
+cns_kernels_supported(cns_KernelLevel level)
+{
+    return (level == CNS_KERNEL_AUTO || level <= cns_kernels_bestLevel());
+}
+
+uint32_t
+cns_kernels_crc32c(cns_KernelLevel level, uint32_t crc, const void * ptr, cns_Index length)
+{
+    _cns_kernels_ensureInit();
+
+    _cns_Crc32cFn fn = _cns_crc32c_best;
+#ifdef _CNS_KERNELS_X86
+    if (level < CNS_KERNEL_SSE42)
+        fn = _cns_crc32c_scalar;
+#else
+    fn = _cns_crc32c_scalar;
+#endif
+    return ~fn(~crc, (const uint8_t*) ptr, length);
+}
+
+cns_Bool
+cns_kernels_equal(cns_KernelLevel level, const void * lhs, const void * rhs, cns_Index length)
+{
+    _cns_kernels_ensureInit();
+
+    _cns_EqualFn fn = _cns_equal_best;
+#ifdef _CNS_KERNELS_X86
+    if (level == CNS_KERNEL_SCALAR)
+        fn = _cns_equal_scalar;
+    else if (level < CNS_KERNEL_AVX2 && _cns_kernels_best >= CNS_KERNEL_SSE2)
+        fn = _cns_equal_sse2;
+#endif
+    return fn((const uint8_t*) lhs, (const uint8_t*) rhs, length);
+}
@@ -0,0 +1,1949 @@
+#include <consensual/lsmstorage.h>
+#include <consensual/blockcache.h>
+#include <consensual/bytes_impl.h>
+#include <consensual/kernels.h>
+#include <consensual/wire.h>
+#include "storage_engine.h"
+#include "runtime_impl.h"
+
+#include <stdlib.h> // qsort
+#include <string.h> // memcpy, memcmp, strlen
+#include <stdio.h> // snprintf
+#include <stdatomic.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/file.h> // flock
+#include <sys/stat.h>
+
+// Files in the directory, all numbered from one counter:
+//   <n>.wal    log of the writes to one memory table; record = varint payload size, payload, CRC-32C of the payload;
+//              payload = 1 (set) or 0 (delete), varint key size, key, value
+//   <n>.sst    sorted table: data blocks, each followed by its CRC-32C; the index (varint size + smallest key, then
+//              varint size + last key, varint offset, varint size of each block) and the bloom filter, each followed
+//              by its CRC-32C; then the footer
+//   MANIFEST   which tables make up each level: magic, next file number, last flushed log, count, number of tables,
+//              then level and number of each table, all varints, and a CRC-32C of it all
+//   LOCK       held with flock while the storage is open
+//
+// Entries in data blocks are varint key size, key, varint tag, value, where the tag is 0 for deletions and the value
+// size plus one otherwise.
+
+#define _CNS_LSM_TABLEMAGIC 0x3130454c42415453ull // "STABLE01"
+#define _CNS_LSM_MANIFESTMAGIC 0x31305453464e414dull // "MANFST01"
+#define _CNS_LSM_FOOTERSIZE 48
+#define _CNS_LSM_PATHMAX 4096
+
+static const _cns_StorageEngine _cns_lsm_engine;
+
+
+// Helpers
+
+static void _cns_lsm_put32(uint8_t* out, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        out[i] = (uint8_t) (value >> (8 * i));
+}
+
+static uint32_t _cns_lsm_get32(const uint8_t* ptr)
+{
+    return (uint32_t) ptr[0] | (uint32_t) ptr[1] << 8 | (uint32_t) ptr[2] << 16 | (uint32_t) ptr[3] << 24;
+}
+
+static void _cns_lsm_put64(uint8_t* out, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i)
+        out[i] = (uint8_t) (value >> (8 * i));
+}
+
+static uint64_t _cns_lsm_get64(const uint8_t* ptr)
+{
+    return (uint64_t) _cns_lsm_get32(ptr) | (uint64_t) _cns_lsm_get32(ptr + 4) << 32;
+}
+
+static uint32_t _cns_lsm_crc(const void * ptr, size_t size)
+{
+    return cns_kernels_crc32c(CNS_KERNEL_AUTO, 0, ptr, (cns_Index) size);
+}
+
+static int _cns_lsm_compare(const uint8_t* lhs, size_t lhsSize, const uint8_t* rhs, size_t rhsSize)
+{
+    int rv = memcmp(lhs, rhs, lhsSize < rhsSize ? lhsSize : rhsSize);
+    return rv ? rv : (lhsSize > rhsSize) - (lhsSize < rhsSize);
+}
+
+static int _cns_lsm_writeAll(int fd, const void * ptr, size_t size)
+{
+    while (size)
+    {
+        ssize_t n = write(fd, ptr, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        ptr = (const uint8_t*) ptr + n;
+        size -= (size_t) n;
+    }
+    return 0;
+}
+
+static int _cns_lsm_readAt(int fd, void* ptr, size_t size, uint64_t offset)
+{
+    while (size)
+    {
+        ssize_t n = pread(fd, ptr, size, (off_t) offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        ptr = (uint8_t*) ptr + n;
+        size -= (size_t) n;
+        offset += (uint64_t) n;
+    }
+    return 0;
+}
+
+static int _cns_lsm_syncDirectory(const char * directory)
+{
+    int fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    int rv = fsync(fd);
+    close(fd);
+    return rv;
+}
+
+// Memory of the tables and of what the background thread builds, counted as CNS_ALLOC_LSM; NULL if out of memory
+static void* _cns_lsm_alloc(cns_Runtime* cns, size_t size)
+{
+    void* rv = 0;
+    return _cns_runtime_allocIn_r(cns, CNS_ALLOC_LSM, (cns_Index) size, &rv) ? 0 : rv;
+}
+
+static void* _cns_lsm_allocZeroed(cns_Runtime* cns, size_t size)
+{
+    void* rv = _cns_lsm_alloc(cns, size);
+    if (rv)
+        memset(rv, 0, size);
+    return rv;
+}
+
+// Growing buffer, for what the background thread builds
+typedef struct _cns_LsmBuffer
+{
+    cns_Runtime*    cns;
+    uint8_t*        data;
+    size_t          size;
+    size_t          capacity;
+} _cns_LsmBuffer;
+
+static int _cns_lsm_bufferReserve(_cns_LsmBuffer* buffer, size_t more)
+{
+    if (buffer->size + more <= buffer->capacity)
+        return 0;
+
+    size_t capacity = buffer->capacity ? buffer->capacity : 256;
+    while (capacity < buffer->size + more)
+        capacity *= 2;
+    void* data = 0;
+    if (_cns_runtime_reallocIn_r(buffer->cns, CNS_ALLOC_LSM, buffer->data, (cns_Index) capacity, &data) || !data)
+        return -1;
+    buffer->data = (uint8_t*) data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+static int _cns_lsm_bufferAppend(_cns_LsmBuffer* buffer, const void * ptr, size_t size)
+{
+    if (_cns_lsm_bufferReserve(buffer, size))
+        return -1;
+    if (size)
+        memcpy(buffer->data + buffer->size, ptr, size);
+    buffer->size += size;
+    return 0;
+}
+
+static int _cns_lsm_bufferVarint(_cns_LsmBuffer* buffer, uint64_t value)
+{
+    if (_cns_lsm_bufferReserve(buffer, CNS_WIRE_MAXVARINT))
+        return -1;
+    buffer->size += (size_t) cns_wire_encodeVarint(value, buffer->data + buffer->size);
+    return 0;
+}
+
+static int _cns_lsm_bufferCrc(_cns_LsmBuffer* buffer, size_t from)
+{
+    uint8_t crc[4];
+    _cns_lsm_put32(crc, _cns_lsm_crc(buffer->data + from, buffer->size - from));
+    return _cns_lsm_bufferAppend(buffer, crc, 4);
+}
+
+// Reads a varint and that many bytes after it; 0 if the input is too short
+static size_t _cns_lsm_decodeSlice(const uint8_t* ptr, size_t size, const uint8_t** out_ptr, size_t* out_size)
+{
+    uint64_t length = 0;
+    size_t n = (size_t) cns_wire_decodeVarint(ptr, (cns_Index) size, &length);
+    if (!n || length > size - n)
+        return 0;
+    *out_ptr = ptr + n;
+    *out_size = (size_t) length;
+    return n + (size_t) length;
+}
+
+
+// Bloom filters, with double hashing as in LevelDB; the last byte holds the number of probes
+
+static void _cns_lsm_bloomAdd(uint8_t* bits, size_t numBits, int numProbes, uint32_t hash)
+{
+    uint32_t delta = (hash >> 17) | (hash << 15);
+    for (int i = 0; i < numProbes; ++i)
+    {
+        size_t bit = hash % numBits;
+        bits[bit / 8] |= (uint8_t) (1 << (bit % 8));
+        hash += delta;
+    }
+}
+
+static cns_Bool _cns_lsm_bloomMayContain(const uint8_t* filter, size_t size, uint32_t hash)
+{
+    if (size < 2 || filter[size - 1] > 30)
+        return CNS_YES;
+
+    size_t numBits = (size - 1) * 8;
+    uint32_t delta = (hash >> 17) | (hash << 15);
+    for (int i = 0; i < filter[size - 1]; ++i)
+    {
+        size_t bit = hash % numBits;
+        if (!(filter[bit / 8] & (1 << (bit % 8))))
+            return CNS_NO;
+        hash += delta;
+    }
+    return CNS_YES;
+}
+
+
+// Tables
+
+typedef struct _cns_LsmBlockHandle
+{
+    const uint8_t*  lastKey;
+    size_t          lastKeySize;
+    uint64_t        offset;
+    size_t          size; // without the CRC
+} _cns_LsmBlockHandle;
+
+// Opened tables are shared between versions and freed by whichever thread drops the last reference.
+typedef struct _cns_LsmTable
+{
+    atomic_int              references;
+    atomic_int              obsolete; // deleted with the last reference
+    uint64_t                number;
+    int                     fd;
+    uint64_t                fileSize;
+    uint64_t                entries;
+    uint8_t*                meta; // index and filter as read from the file
+    _cns_LsmBlockHandle*    blocks;
+    int                     numBlocks;
+    const uint8_t*          smallest;
+    size_t                  smallestSize;
+    const uint8_t*          filter;
+    size_t                  filterSize;
+} _cns_LsmTable;
+
+static const uint8_t* _cns_lsm_tableLargest(const _cns_LsmTable* table, size_t* out_size)
+{
+    *out_size = table->blocks[table->numBlocks - 1].lastKeySize;
+    return table->blocks[table->numBlocks - 1].lastKey;
+}
+
+typedef struct _cns_LsmVersion
+{
+    atomic_int      references;
+    int             numTables[CNS_LSM_MAXLEVELS];
+    // newest first in level 0, ordered by key in the others
+    _cns_LsmTable** tables[CNS_LSM_MAXLEVELS];
+} _cns_LsmVersion;
+
+typedef struct _cns_Lsm
+{
+    cns_Runtime*    cns;
+    cns_LsmOptions  options;
+    char*           directory;
+    int             lockFd;
+
+    // used by the calling thread only
+    cns_Storage*    memtable;
+    cns_Bytes*      tombstone; // told apart from values by identity
+    int             logFd;
+    uint64_t        logNumber;
+    cns_Index       memtableBytes;
+    cns_Index       count;
+    uint8_t*        scratch; // log records and blocks read by gets
+    cns_Index       scratchCapacity;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  workCondition;
+    pthread_cond_t  doneCondition;
+    pthread_t       worker;
+    cns_Bool        workerStarted;
+
+    // guarded by the mutex; the memory table being flushed is only replaced by the calling thread
+    cns_Storage*    immutable;
+    uint64_t        immutableLogNumber;
+    cns_Index       immutableCount; // count once it is flushed
+    cns_Index       flushedCount; // count as of the last flushed log, kept in the manifest
+    atomic_int      immutableFlushed;
+    _cns_LsmVersion* current;
+    uint64_t        nextFileNumber;
+    uint64_t        flushedLogNumber;
+    int             nextCompaction[CNS_LSM_MAXLEVELS];
+    cns_Bool        stop;
+    cns_Bool        idle;
+    _Atomic cns_Error backgroundError;
+
+    // the background thread updates its counters under the mutex
+    cns_LsmStats    stats;
+} _cns_Lsm;
+
+static void _cns_lsm_path(const _cns_Lsm* lsm, char* out, uint64_t number, const char * suffix)
+{
+    snprintf(out, _CNS_LSM_PATHMAX, "%s/%06llu.%s", lsm->directory, (unsigned long long) number, suffix);
+}
+
+static void _cns_lsm_tableUnref(const _cns_Lsm* lsm, _cns_LsmTable* table)
+{
+    if (atomic_fetch_sub(&table->references, 1) != 1)
+        return;
+
+    close(table->fd);
+    if (atomic_load(&table->obsolete))
+    {
+        char path[_CNS_LSM_PATHMAX];
+        _cns_lsm_path(lsm, path, table->number, "sst");
+        unlink(path);
+    }
+    cns_runtime_free_r(lsm->cns, table->blocks);
+    cns_runtime_free_r(lsm->cns, table->meta);
+    cns_runtime_free_r(lsm->cns, table);
+}
+
+static cns_Error _cns_lsm_tableOpen(const _cns_Lsm* lsm, uint64_t number, _cns_LsmTable** out_table)
+{
+    *out_table = 0;
+    char path[_CNS_LSM_PATHMAX];
+    _cns_lsm_path(lsm, path, number, "sst");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return CNS_ERR_IO;
+
+    cns_Error err = CNS_ERR_MALFORMED;
+    _cns_LsmTable* table = (_cns_LsmTable*) _cns_lsm_allocZeroed(lsm->cns, sizeof(_cns_LsmTable));
+    struct stat st;
+    uint8_t footer[_CNS_LSM_FOOTERSIZE];
+    if (!table)
+        err = CNS_ERR_NOMEM;
+    else if (fstat(fd, &st) || st.st_size < _CNS_LSM_FOOTERSIZE
+             || _cns_lsm_readAt(fd, footer, _CNS_LSM_FOOTERSIZE, (uint64_t) st.st_size - _CNS_LSM_FOOTERSIZE))
+        err = CNS_ERR_IO;
+    else if (_cns_lsm_get64(footer + 40) == _CNS_LSM_TABLEMAGIC)
+    {
+        uint64_t indexOffset = _cns_lsm_get64(footer), indexSize = _cns_lsm_get64(footer + 8);
+        uint64_t filterOffset = _cns_lsm_get64(footer + 16), filterSize = _cns_lsm_get64(footer + 24);
+        uint64_t metaEnd = (uint64_t) st.st_size - _CNS_LSM_FOOTERSIZE;
+        if (indexSize >= 4 && filterSize >= 4 && filterOffset == indexOffset + indexSize
+            && indexOffset < metaEnd && filterOffset + filterSize == metaEnd)
+        {
+            table->meta = (uint8_t*) _cns_lsm_alloc(lsm->cns, indexSize + filterSize);
+            if (!table->meta)
+                err = CNS_ERR_NOMEM;
+            else if (_cns_lsm_readAt(fd, table->meta, indexSize + filterSize, indexOffset))
+                err = CNS_ERR_IO;
+            else
+            {
+                table->fd = fd;
+                table->number = number;
+                table->fileSize = (uint64_t) st.st_size;
+                table->entries = _cns_lsm_get64(footer + 32);
+                const uint8_t* index = table->meta;
+                size_t indexData = indexSize - 4;
+                table->filter = index + indexSize;
+                table->filterSize = filterSize - 4;
+                if (_cns_lsm_get32(index + indexData) == _cns_lsm_crc(index, indexData)
+                    && _cns_lsm_get32(table->filter + table->filterSize) == _cns_lsm_crc(table->filter, table->filterSize))
+                {
+                    // the smallest key, then one handle per block; count them first
+                    size_t pos = _cns_lsm_decodeSlice(index, indexData, &table->smallest, &table->smallestSize);
+                    int numBlocks = 0;
+                    for (size_t p = pos; pos && p < indexData; ++numBlocks)
+                    {
+                        const uint8_t* key;
+                        size_t keySize;
+                        uint64_t value = 0;
+                        size_t n = _cns_lsm_decodeSlice(index + p, indexData - p, &key, &keySize);
+                        for (int i = 0; n && i < 2; ++i)
+                        {
+                            size_t m = (size_t) cns_wire_decodeVarint(index + p + n, (cns_Index) (indexData - p - n), &value);
+                            n = m ? n + m : 0;
+                        }
+                        if (!n)
+                        {
+                            numBlocks = 0;
+                            break;
+                        }
+                        p += n;
+                    }
+                    table->blocks = numBlocks ? (_cns_LsmBlockHandle*) _cns_lsm_alloc(lsm->cns, numBlocks * sizeof(_cns_LsmBlockHandle)) : 0;
+                    if (numBlocks && !table->blocks)
+                        err = CNS_ERR_NOMEM;
+                    for (int i = 0; table->blocks && i < numBlocks; ++i)
+                    {
+                        _cns_LsmBlockHandle* block = &table->blocks[i];
+                        uint64_t offset = 0, size = 0;
+                        pos += _cns_lsm_decodeSlice(index + pos, indexData - pos, &block->lastKey, &block->lastKeySize);
+                        pos += (size_t) cns_wire_decodeVarint(index + pos, (cns_Index) (indexData - pos), &offset);
+                        pos += (size_t) cns_wire_decodeVarint(index + pos, (cns_Index) (indexData - pos), &size);
+                        block->offset = offset;
+                        block->size = (size_t) size;
+                        if (offset + size + 4 > indexOffset)
+                            break;
+                        table->numBlocks = i + 1;
+                    }
+                    if (table->numBlocks && table->numBlocks == numBlocks)
+                    {
+                        atomic_init(&table->references, 1);
+                        atomic_init(&table->obsolete, 0);
+                        *out_table = table;
+                        return CNS_OK;
+                    }
+                }
+            }
+        }
+    }
+
+    close(fd);
+    if (table)
+    {
+        cns_runtime_free_r(lsm->cns, table->blocks);
+        cns_runtime_free_r(lsm->cns, table->meta);
+        cns_runtime_free_r(lsm->cns, table);
+    }
+    return err;
+}
+
+// Finds the first entry with `key` in a block. Returns 1 if there is one, 0 if not, -1 if the block is malformed.
+static int _cns_lsm_blockFind(const uint8_t* block, size_t size, const uint8_t* key, size_t keySize,
+                              const uint8_t** out_value, size_t* out_valueSize, cns_Bool* out_deleted)
+{
+    size_t pos = 0;
+    while (pos < size)
+    {
+        const uint8_t* entryKey;
+        size_t entryKeySize;
+        uint64_t tag = 0;
+        size_t n = _cns_lsm_decodeSlice(block + pos, size - pos, &entryKey, &entryKeySize);
+        size_t m = n ? (size_t) cns_wire_decodeVarint(block + pos + n, (cns_Index) (size - pos - n), &tag) : 0;
+        if (!m || (tag && tag - 1 > size - pos - n - m))
+            return -1;
+
+        int c = _cns_lsm_compare(entryKey, entryKeySize, key, keySize);
+        if (c > 0)
+            return 0;
+        if (!c)
+        {
+            *out_deleted = (tag == 0);
+            *out_value = block + pos + n + m;
+            *out_valueSize = tag ? (size_t) (tag - 1) : 0;
+            return 1;
+        }
+        pos += n + m + (tag ? (size_t) (tag - 1) : 0);
+    }
+    return 0;
+}
+
+// Gets look blocks up on the calling thread, reading them into the scratch buffer
+static cns_Error _cns_lsm_reserveScratch(cns_Runtime* cns, _cns_Lsm* lsm, cns_Index size)
+{
+    if (size <= lsm->scratchCapacity)
+        return CNS_OK;
+
+    cns_Index capacity = lsm->scratchCapacity ? lsm->scratchCapacity : 4096;
+    while (capacity < size)
+        capacity *= 2;
+    void* scratch = 0;
+    cns_Error err = _cns_runtime_reallocIn_r(cns, CNS_ALLOC_LSM, lsm->scratch, capacity, &scratch);
+    if (scratch)
+    {
+        lsm->scratch = (uint8_t*) scratch;
+        lsm->scratchCapacity = capacity;
+    }
+    return err;
+}
+
+// Looks the key up in one table whose range covers it. Returns 1 if the table has an entry for the key, 0 if not. The
+// block is taken from the runtime's block cache, or read into a new Bytes object and cached; it goes to `out_block`,
+// which the caller frees, and the value is at `out_valueOffset` in it.
+static int _cns_lsm_tableGet(cns_Runtime* cns, _cns_Lsm* lsm, _cns_LsmTable* table, const uint8_t* key, size_t keySize,
+                             uint32_t hash, cns_Bytes** out_block, size_t* out_valueOffset, size_t* out_valueSize,
+                             cns_Bool* out_deleted, cns_Error* out_err)
+{
+    ++lsm->stats.tablesProbed;
+    if (!_cns_lsm_bloomMayContain(table->filter, table->filterSize, hash))
+    {
+        ++lsm->stats.bloomNegatives;
+        return 0;
+    }
+
+    // first block whose last key is not below the key
+    int lo = 0, hi = table->numBlocks - 1;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (_cns_lsm_compare(table->blocks[mid].lastKey, table->blocks[mid].lastKeySize, key, keySize) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    const _cns_LsmBlockHandle* block = &table->blocks[lo];
+    cns_Bytes* blockBytes = 0;
+    *out_err = cns_blockcache_lookup_r(cns, (uintptr_t) lsm, table->number, block->offset, &blockBytes);
+    if (*out_err)
+        return 0;
+    if (blockBytes)
+        ++lsm->stats.blockCacheHits;
+    else
+    {
+        *out_err = _cns_lsm_reserveScratch(cns, lsm, (cns_Index) block->size + 4);
+        if (*out_err)
+            return 0;
+        ++lsm->stats.blockReads;
+        if (_cns_lsm_readAt(table->fd, lsm->scratch, block->size + 4, block->offset))
+        {
+            *out_err = CNS_ERR_IO;
+            return 0;
+        }
+        if (_cns_lsm_get32(lsm->scratch + block->size) != _cns_lsm_crc(lsm->scratch, block->size))
+        {
+            *out_err = CNS_ERR_MALFORMED;
+            return 0;
+        }
+        *out_err = cns_bytes_new_r(cns, lsm->scratch, (cns_Index) block->size, &blockBytes);
+        if (*out_err)
+            return 0;
+        // not caching it only costs a read next time
+        cns_blockcache_insert_r(cns, (uintptr_t) lsm, table->number, block->offset, blockBytes);
+    }
+
+    const uint8_t* blockPtr = (const uint8_t*) cns_bytes_ptrUnchecked(blockBytes);
+    const uint8_t* value = 0;
+    int found = _cns_lsm_blockFind(blockPtr, block->size, key, keySize, &value, out_valueSize, out_deleted);
+    if (found < 0)
+        *out_err = CNS_ERR_MALFORMED;
+    if (found > 0)
+    {
+        *out_block = blockBytes;
+        *out_valueOffset = (size_t) (value - blockPtr);
+    }
+    else
+        cns_bytes_free_r(cns, blockBytes);
+    return found > 0;
+}
+
+
+// Writing tables, on the background thread or while opening the storage
+
+typedef struct _cns_LsmTableWriter
+{
+    const _cns_Lsm* lsm;
+    int             fd;
+    uint64_t        number;
+    uint64_t        offset;
+    uint64_t        entries;
+    _cns_LsmBuffer  block;
+    _cns_LsmBuffer  index;
+    _cns_LsmBuffer  lastKey;
+    _cns_LsmBuffer  hashes;
+} _cns_LsmTableWriter;
+
+static int _cns_lsm_writerOpen(_cns_LsmTableWriter* writer, const _cns_Lsm* lsm, uint64_t number)
+{
+    memset(writer, 0, sizeof(_cns_LsmTableWriter));
+    writer->lsm = lsm;
+    writer->number = number;
+    writer->block.cns = writer->index.cns = writer->lastKey.cns = writer->hashes.cns = lsm->cns;
+    char path[_CNS_LSM_PATHMAX];
+    _cns_lsm_path(lsm, path, number, "sst");
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    return writer->fd < 0 ? -1 : 0;
+}
+
+static int _cns_lsm_writerFinishBlock(_cns_LsmTableWriter* writer)
+{
+    if (!writer->block.size)
+        return 0;
+
+    size_t size = writer->block.size;
+    if (_cns_lsm_bufferCrc(&writer->block, 0)
+        || _cns_lsm_writeAll(writer->fd, writer->block.data, writer->block.size)
+        || _cns_lsm_bufferVarint(&writer->index, writer->lastKey.size)
+        || _cns_lsm_bufferAppend(&writer->index, writer->lastKey.data, writer->lastKey.size)
+        || _cns_lsm_bufferVarint(&writer->index, writer->offset)
+        || _cns_lsm_bufferVarint(&writer->index, size))
+        return -1;
+    writer->offset += writer->block.size;
+    writer->block.size = 0;
+    return 0;
+}
+
+static int _cns_lsm_writerAdd(_cns_LsmTableWriter* writer, const uint8_t* key, size_t keySize,
+                              const uint8_t* value, size_t valueSize, cns_Bool deleted)
+{
+    if (!writer->entries && (_cns_lsm_bufferVarint(&writer->index, keySize)
+                             || _cns_lsm_bufferAppend(&writer->index, key, keySize)))
+        return -1;
+
+    uint32_t hash = _cns_lsm_crc(key, keySize);
+    writer->lastKey.size = 0;
+    if (_cns_lsm_bufferVarint(&writer->block, keySize)
+        || _cns_lsm_bufferAppend(&writer->block, key, keySize)
+        || _cns_lsm_bufferVarint(&writer->block, deleted ? 0 : valueSize + 1)
+        || _cns_lsm_bufferAppend(&writer->block, value, deleted ? 0 : valueSize)
+        || _cns_lsm_bufferAppend(&writer->lastKey, key, keySize)
+        || _cns_lsm_bufferAppend(&writer->hashes, &hash, sizeof(hash)))
+        return -1;
+    ++writer->entries;
+
+    if (writer->block.size >= (size_t) writer->lsm->options.blockBytes)
+        return _cns_lsm_writerFinishBlock(writer);
+    return 0;
+}
+
+// Bytes written so far, including the block being filled
+static uint64_t _cns_lsm_writerSize(const _cns_LsmTableWriter* writer)
+{
+    return writer->offset + writer->block.size;
+}
+
+static void _cns_lsm_writerRelease(_cns_LsmTableWriter* writer)
+{
+    if (writer->fd >= 0)
+        close(writer->fd);
+    writer->fd = -1;
+    cns_runtime_free_r(writer->lsm->cns, writer->block.data);
+    cns_runtime_free_r(writer->lsm->cns, writer->index.data);
+    cns_runtime_free_r(writer->lsm->cns, writer->lastKey.data);
+    cns_runtime_free_r(writer->lsm->cns, writer->hashes.data);
+    writer->block.data = writer->index.data = writer->lastKey.data = writer->hashes.data = 0;
+    writer->block.size = writer->index.size = writer->lastKey.size = writer->hashes.size = 0;
+    writer->block.capacity = writer->index.capacity = writer->lastKey.capacity = writer->hashes.capacity = 0;
+}
+
+static void _cns_lsm_writerAbandon(_cns_LsmTableWriter* writer)
+{
+    _cns_lsm_writerRelease(writer);
+    char path[_CNS_LSM_PATHMAX];
+    _cns_lsm_path(writer->lsm, path, writer->number, "sst");
+    unlink(path);
+}
+
+// Writes the index, filter and footer, syncs the file and opens it as a table
+static cns_Error _cns_lsm_writerFinish(_cns_LsmTableWriter* writer, _cns_LsmTable** out_table)
+{
+    cns_Error err = CNS_ERR_IO;
+    size_t numKeys = writer->hashes.size / sizeof(uint32_t);
+    int bitsPerKey = writer->lsm->options.bloomBitsPerKey;
+    size_t numBits = numKeys * (size_t) bitsPerKey < 64 ? 64 : numKeys * (size_t) bitsPerKey;
+    size_t filterSize = bitsPerKey ? (numBits + 7) / 8 : 0;
+    int numProbes = bitsPerKey * 69 / 100; // ln 2 times bits per key
+    numProbes = numProbes < 1 ? 1 : (numProbes > 30 ? 30 : numProbes);
+
+    _cns_LsmBuffer filter = { .cns = writer->lsm->cns };
+    uint8_t footer[_CNS_LSM_FOOTERSIZE];
+    if (!_cns_lsm_writerFinishBlock(writer)
+        && !_cns_lsm_bufferCrc(&writer->index, 0)
+        && !_cns_lsm_bufferReserve(&filter, filterSize + 1 + 4))
+    {
+        memset(filter.data, 0, filterSize);
+        for (size_t i = 0; filterSize && i < numKeys; ++i)
+            _cns_lsm_bloomAdd(filter.data, filterSize * 8, numProbes, ((const uint32_t*) writer->hashes.data)[i]);
+        filter.data[filterSize] = (uint8_t) (filterSize ? numProbes : 0xff); // no filter: every key may be there
+        filter.size = filterSize + 1;
+        _cns_lsm_bufferCrc(&filter, 0);
+
+        _cns_lsm_put64(footer, writer->offset);
+        _cns_lsm_put64(footer + 8, writer->index.size);
+        _cns_lsm_put64(footer + 16, writer->offset + writer->index.size);
+        _cns_lsm_put64(footer + 24, filter.size);
+        _cns_lsm_put64(footer + 32, writer->entries);
+        _cns_lsm_put64(footer + 40, _CNS_LSM_TABLEMAGIC);
+        if (!_cns_lsm_writeAll(writer->fd, writer->index.data, writer->index.size)
+            && !_cns_lsm_writeAll(writer->fd, filter.data, filter.size)
+            && !_cns_lsm_writeAll(writer->fd, footer, _CNS_LSM_FOOTERSIZE)
+            && !fdatasync(writer->fd))
+            err = CNS_OK;
+    }
+    cns_runtime_free_r(writer->lsm->cns, filter.data);
+
+    if (!err)
+    {
+        _cns_lsm_writerRelease(writer);
+        err = _cns_lsm_tableOpen(writer->lsm, writer->number, out_table);
+    }
+    if (err)
+        _cns_lsm_writerAbandon(writer);
+    return err;
+}
+
+typedef struct _cns_LsmEntry
+{
+    const uint8_t*  key;
+    size_t          keySize;
+    const uint8_t*  value;
+    size_t          valueSize;
+    cns_Bool        deleted;
+} _cns_LsmEntry;
+
+typedef struct _cns_LsmCollector
+{
+    const _cns_Lsm* lsm;
+    _cns_LsmBuffer  entries;
+    cns_Bool        failed;
+} _cns_LsmCollector;
+
+static void _cns_lsm_collect(void* context, cns_Bytes* key, cns_Bytes* value)
+{
+    _cns_LsmCollector* collector = (_cns_LsmCollector*) context;
+    // both were made contiguous when they were set
+    _cns_LsmEntry entry = {
+        .key = (const uint8_t*) cns_bytes_ptrUnchecked(key),
+        .keySize = (size_t) cns_bytes_lengthUnchecked(key),
+        .value = (const uint8_t*) cns_bytes_ptrUnchecked(value),
+        .valueSize = (size_t) cns_bytes_lengthUnchecked(value),
+        .deleted = (value == collector->lsm->tombstone),
+    };
+    collector->failed |= (cns_Bool) (_cns_lsm_bufferAppend(&collector->entries, &entry, sizeof(entry)) != 0);
+}
+
+static int _cns_lsm_entryCompare(const void * lhs, const void * rhs)
+{
+    const _cns_LsmEntry* l = (const _cns_LsmEntry*) lhs;
+    const _cns_LsmEntry* r = (const _cns_LsmEntry*) rhs;
+    return _cns_lsm_compare(l->key, l->keySize, r->key, r->keySize);
+}
+
+// Writes a memory table out as table `number`; only reads the memory table
+static cns_Error _cns_lsm_writeMemtable(const _cns_Lsm* lsm, cns_Storage* memtable, uint64_t number, _cns_LsmTable** out_table)
+{
+    _cns_LsmCollector collector = { .lsm = lsm, .entries = { .cns = lsm->cns } };
+    _cns_storage_forEach(memtable, _cns_lsm_collect, &collector);
+    cns_Error err = collector.failed ? CNS_ERR_NOMEM : CNS_OK;
+    size_t numEntries = collector.entries.size / sizeof(_cns_LsmEntry);
+    _cns_LsmEntry* entries = (_cns_LsmEntry*) collector.entries.data;
+    if (!err)
+        qsort(entries, numEntries, sizeof(_cns_LsmEntry), _cns_lsm_entryCompare);
+
+    _cns_LsmTableWriter writer;
+    if (!err && _cns_lsm_writerOpen(&writer, lsm, number))
+        err = CNS_ERR_IO;
+    else if (!err)
+    {
+        for (size_t i = 0; !err && i < numEntries; ++i)
+        {
+            if (_cns_lsm_writerAdd(&writer, entries[i].key, entries[i].keySize, entries[i].value, entries[i].valueSize, entries[i].deleted))
+                err = CNS_ERR_IO;
+        }
+        if (err)
+            _cns_lsm_writerAbandon(&writer);
+        else
+            err = _cns_lsm_writerFinish(&writer, out_table);
+    }
+    cns_runtime_free_r(lsm->cns, collector.entries.data);
+    return err;
+}
+
+
+// Versions
+
+static void _cns_lsm_versionUnref(const _cns_Lsm* lsm, _cns_LsmVersion* version)
+{
+    if (!version || atomic_fetch_sub(&version->references, 1) != 1)
+        return;
+
+    for (int level = 0; level < CNS_LSM_MAXLEVELS; ++level)
+    {
+        for (int i = 0; i < version->numTables[level]; ++i)
+            _cns_lsm_tableUnref(lsm, version->tables[level][i]);
+        cns_runtime_free_r(lsm->cns, version->tables[level]);
+    }
+    cns_runtime_free_r(lsm->cns, version);
+}
+
+static int _cns_lsm_tableCompare(const void * lhs, const void * rhs)
+{
+    const _cns_LsmTable* l = *(const _cns_LsmTable* const *) lhs;
+    const _cns_LsmTable* r = *(const _cns_LsmTable* const *) rhs;
+    return _cns_lsm_compare(l->smallest, l->smallestSize, r->smallest, r->smallestSize);
+}
+
+// Copy of `base` without the tables in `removed` and with `added` placed in `level`; NULL if out of memory.
+// Takes its own references to the tables, the caller keeps those it has to `added`.
+static _cns_LsmVersion* _cns_lsm_versionApply(const _cns_Lsm* lsm, const _cns_LsmVersion* base, _cns_LsmTable** removed,
+                                              int numRemoved, int level, _cns_LsmTable** added, int numAdded)
+{
+    _cns_LsmVersion* rv = (_cns_LsmVersion*) _cns_lsm_allocZeroed(lsm->cns, sizeof(_cns_LsmVersion));
+    if (!rv)
+        return 0;
+    atomic_init(&rv->references, 1);
+
+    for (int l = 0; l < CNS_LSM_MAXLEVELS; ++l)
+    {
+        int extra = (l == level ? numAdded : 0);
+        int capacity = (base ? base->numTables[l] : 0) + extra;
+        if (!capacity)
+            continue;
+        rv->tables[l] = (_cns_LsmTable**) _cns_lsm_alloc(lsm->cns, capacity * sizeof(_cns_LsmTable*));
+        if (!rv->tables[l])
+        {
+            for (int k = 0; k < l; ++k)
+            {
+                for (int i = 0; i < rv->numTables[k]; ++i)
+                    atomic_fetch_sub(&rv->tables[k][i]->references, 1); // the base or the caller still holds them
+                cns_runtime_free_r(lsm->cns, rv->tables[k]);
+            }
+            cns_runtime_free_r(lsm->cns, rv);
+            return 0;
+        }
+
+        // level 0 is newest first, so added tables go in front
+        for (int i = 0; l == 0 && i < extra; ++i)
+        {
+            atomic_fetch_add(&added[i]->references, 1);
+            rv->tables[l][rv->numTables[l]++] = added[i];
+        }
+        for (int i = 0; base && i < base->numTables[l]; ++i)
+        {
+            _cns_LsmTable* table = base->tables[l][i];
+            cns_Bool isRemoved = CNS_NO;
+            for (int j = 0; j < numRemoved && !isRemoved; ++j)
+                isRemoved = (removed[j] == table);
+            if (isRemoved)
+                continue;
+            atomic_fetch_add(&table->references, 1);
+            rv->tables[l][rv->numTables[l]++] = table;
+        }
+        for (int i = 0; l != 0 && i < extra; ++i)
+        {
+            atomic_fetch_add(&added[i]->references, 1);
+            rv->tables[l][rv->numTables[l]++] = added[i];
+        }
+        if (l != 0 && extra)
+            qsort(rv->tables[l], rv->numTables[l], sizeof(_cns_LsmTable*), _cns_lsm_tableCompare);
+    }
+    return rv;
+}
+
+static uint64_t _cns_lsm_levelBytes(const _cns_LsmVersion* version, int level)
+{
+    uint64_t rv = 0;
+    for (int i = 0; i < version->numTables[level]; ++i)
+        rv += version->tables[level][i]->fileSize;
+    return rv;
+}
+
+static uint64_t _cns_lsm_levelLimit(const _cns_Lsm* lsm, int level)
+{
+    uint64_t rv = (uint64_t) lsm->options.tableBytes;
+    for (int i = 0; i < level; ++i)
+        rv *= (uint64_t) lsm->options.levelRatio;
+    return rv;
+}
+
+// Persists `version`; call with the mutex held, or before the background thread is started
+static cns_Error _cns_lsm_writeManifest(const _cns_Lsm* lsm, const _cns_LsmVersion* version)
+{
+    _cns_LsmBuffer buffer = { .cns = lsm->cns };
+    uint8_t header[8];
+    _cns_lsm_put64(header, _CNS_LSM_MANIFESTMAGIC);
+    int numTables = 0;
+    for (int level = 0; level < CNS_LSM_MAXLEVELS; ++level)
+        numTables += version->numTables[level];
+
+    int failed = _cns_lsm_bufferAppend(&buffer, header, 8)
+        || _cns_lsm_bufferVarint(&buffer, lsm->nextFileNumber)
+        || _cns_lsm_bufferVarint(&buffer, lsm->flushedLogNumber)
+        || _cns_lsm_bufferVarint(&buffer, (uint64_t) lsm->flushedCount)
+        || _cns_lsm_bufferVarint(&buffer, (uint64_t) numTables);
+    for (int level = 0; level < CNS_LSM_MAXLEVELS && !failed; ++level)
+    {
+        for (int i = 0; i < version->numTables[level] && !failed; ++i)
+            failed = _cns_lsm_bufferVarint(&buffer, (uint64_t) level)
+                || _cns_lsm_bufferVarint(&buffer, version->tables[level][i]->number);
+    }
+    failed = failed || _cns_lsm_bufferCrc(&buffer, 0);
+    if (failed)
+    {
+        cns_runtime_free_r(lsm->cns, buffer.data);
+        return CNS_ERR_NOMEM;
+    }
+
+    char path[_CNS_LSM_PATHMAX], tmpPath[_CNS_LSM_PATHMAX];
+    snprintf(path, sizeof(path), "%s/MANIFEST", lsm->directory);
+    snprintf(tmpPath, sizeof(tmpPath), "%s/MANIFEST.tmp", lsm->directory);
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    failed = (fd < 0);
+    failed = failed || _cns_lsm_writeAll(fd, buffer.data, buffer.size) || fdatasync(fd);
+    if (fd >= 0)
+        failed |= close(fd);
+    failed = failed || rename(tmpPath, path) || _cns_lsm_syncDirectory(lsm->directory);
+    cns_runtime_free_r(lsm->cns, buffer.data);
+    return failed ? CNS_ERR_IO : CNS_OK;
+}
+
+static cns_Error _cns_lsm_readManifest(_cns_Lsm* lsm)
+{
+    char path[_CNS_LSM_PATHMAX];
+    snprintf(path, sizeof(path), "%s/MANIFEST", lsm->directory);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? CNS_OK : CNS_ERR_IO;
+
+    struct stat st;
+    uint8_t* data = 0;
+    cns_Error err = CNS_ERR_IO;
+    if (!fstat(fd, &st) && st.st_size >= 12 && (data = (uint8_t*) _cns_lsm_alloc(lsm->cns, (size_t) st.st_size)) != 0
+        && !_cns_lsm_readAt(fd, data, (size_t) st.st_size, 0))
+    {
+        size_t size = (size_t) st.st_size - 4;
+        err = CNS_ERR_MALFORMED;
+        uint64_t fields[4] = { 0 };
+        size_t pos = 8;
+        for (int i = 0; i < 4 && pos; ++i)
+        {
+            size_t n = (size_t) cns_wire_decodeVarint(data + pos, (cns_Index) (size - pos), &fields[i]);
+            pos = n ? pos + n : 0;
+        }
+        if (pos && _cns_lsm_get64(data) == _CNS_LSM_MANIFESTMAGIC && _cns_lsm_get32(data + size) == _cns_lsm_crc(data, size))
+        {
+            lsm->nextFileNumber = fields[0];
+            lsm->flushedLogNumber = fields[1];
+            lsm->flushedCount = (cns_Index) fields[2];
+            _cns_LsmVersion* version = _cns_lsm_versionApply(lsm, 0, 0, 0, 0, 0, 0);
+            err = version ? CNS_OK : CNS_ERR_NOMEM;
+            for (uint64_t i = 0; i < fields[3] && !err; ++i)
+            {
+                uint64_t level = 0, number = 0;
+                size_t n = (size_t) cns_wire_decodeVarint(data + pos, (cns_Index) (size - pos), &level);
+                size_t m = n ? (size_t) cns_wire_decodeVarint(data + pos + n, (cns_Index) (size - pos - n), &number) : 0;
+                pos += n + m;
+                _cns_LsmTable* table = 0;
+                err = (!m || level >= CNS_LSM_MAXLEVELS) ? CNS_ERR_MALFORMED : _cns_lsm_tableOpen(lsm, number, &table);
+                // tables are listed in level order, so appending keeps each level ordered
+                _cns_LsmVersion* next = err ? 0 : _cns_lsm_versionApply(lsm, version, 0, 0, (int) level, &table, 1);
+                if (table)
+                    _cns_lsm_tableUnref(lsm, table);
+                if (!err && !next)
+                    err = CNS_ERR_NOMEM;
+                if (next)
+                {
+                    _cns_lsm_versionUnref(lsm, version);
+                    version = next;
+                }
+            }
+            if (err)
+                _cns_lsm_versionUnref(lsm, version);
+            else
+            {
+                _cns_lsm_versionUnref(lsm, lsm->current);
+                lsm->current = version;
+            }
+        }
+    }
+    cns_runtime_free_r(lsm->cns, data);
+    close(fd);
+    return err;
+}
+
+
+// Merging tables, on the background thread
+
+typedef struct _cns_LsmTableIterator
+{
+    const _cns_LsmTable*    table;
+    int                     block;
+    _cns_LsmBuffer          buffer;
+    size_t                  pos;
+    cns_Bool                valid;
+    const uint8_t*          key;
+    size_t                  keySize;
+    const uint8_t*          value;
+    size_t                  valueSize;
+    cns_Bool                deleted;
+} _cns_LsmTableIterator;
+
+// Moves to the next entry; returns -1 on errors
+static int _cns_lsm_iteratorNext(_cns_LsmTableIterator* it)
+{
+    while (it->pos >= it->buffer.size)
+    {
+        if (++it->block >= it->table->numBlocks)
+        {
+            it->valid = CNS_NO;
+            return 0;
+        }
+        const _cns_LsmBlockHandle* block = &it->table->blocks[it->block];
+        it->buffer.size = 0;
+        if (_cns_lsm_bufferReserve(&it->buffer, block->size + 4)
+            || _cns_lsm_readAt(it->table->fd, it->buffer.data, block->size + 4, block->offset)
+            || _cns_lsm_get32(it->buffer.data + block->size) != _cns_lsm_crc(it->buffer.data, block->size))
+            return -1;
+        it->buffer.size = block->size;
+        it->pos = 0;
+    }
+
+    const uint8_t* ptr = it->buffer.data + it->pos;
+    size_t size = it->buffer.size - it->pos;
+    uint64_t tag = 0;
+    size_t n = _cns_lsm_decodeSlice(ptr, size, &it->key, &it->keySize);
+    size_t m = n ? (size_t) cns_wire_decodeVarint(ptr + n, (cns_Index) (size - n), &tag) : 0;
+    if (!m || (tag && tag - 1 > size - n - m))
+        return -1;
+    it->deleted = (tag == 0);
+    it->value = ptr + n + m;
+    it->valueSize = tag ? (size_t) (tag - 1) : 0;
+    it->pos += n + m + it->valueSize;
+    it->valid = CNS_YES;
+    return 0;
+}
+
+static cns_Bool _cns_lsm_overlaps(const _cns_LsmTable* table, const uint8_t* lo, size_t loSize, const uint8_t* hi, size_t hiSize)
+{
+    size_t largestSize;
+    const uint8_t* largest = _cns_lsm_tableLargest(table, &largestSize);
+    return _cns_lsm_compare(largest, largestSize, lo, loSize) >= 0
+        && _cns_lsm_compare(table->smallest, table->smallestSize, hi, hiSize) <= 0;
+}
+
+// Level to merge into the next one, or -1; call with the mutex held
+static int _cns_lsm_pickCompaction(const _cns_Lsm* lsm)
+{
+    if (lsm->current->numTables[0] >= lsm->options.level0Tables)
+        return 0;
+    for (int level = 1; level < CNS_LSM_MAXLEVELS - 1; ++level)
+    {
+        if (_cns_lsm_levelBytes(lsm->current, level) > _cns_lsm_levelLimit(lsm, level))
+            return level;
+    }
+    return -1;
+}
+
+// Merges tables of `level` into the next level: all of level 0, or one table of the others, taken in turn, together with
+// the tables of the next level whose range overlaps them. Called and returns with the mutex held.
+static cns_Error _cns_lsm_compact(_cns_Lsm* lsm, int level)
+{
+    _cns_LsmVersion* version = lsm->current;
+    atomic_fetch_add(&version->references, 1);
+
+    int numSources = level == 0 ? version->numTables[0] : 1;
+    int first = level == 0 ? 0 : lsm->nextCompaction[level] % version->numTables[level];
+    lsm->nextCompaction[level] = first + 1;
+    _cns_LsmTable** sources = &version->tables[level][first];
+    cns_Bool dropDeletions = CNS_YES; // nothing older below to hide
+    for (int l = level + 2; l < CNS_LSM_MAXLEVELS; ++l)
+        dropDeletions &= (cns_Bool) (version->numTables[l] == 0);
+    pthread_mutex_unlock(&lsm->mutex);
+
+    const uint8_t* lo = sources[0]->smallest;
+    size_t loSize = sources[0]->smallestSize, hiSize;
+    const uint8_t* hi = _cns_lsm_tableLargest(sources[0], &hiSize);
+    for (int i = 1; i < numSources; ++i)
+    {
+        size_t largestSize;
+        const uint8_t* largest = _cns_lsm_tableLargest(sources[i], &largestSize);
+        if (_cns_lsm_compare(sources[i]->smallest, sources[i]->smallestSize, lo, loSize) < 0)
+        {
+            lo = sources[i]->smallest;
+            loSize = sources[i]->smallestSize;
+        }
+        if (_cns_lsm_compare(largest, largestSize, hi, hiSize) > 0)
+        {
+            hi = largest;
+            hiSize = largestSize;
+        }
+    }
+
+    // inputs in order of precedence: newer data first
+    int maxInputs = numSources + version->numTables[level + 1];
+    _cns_LsmTable** inputs = (_cns_LsmTable**) _cns_lsm_alloc(lsm->cns, maxInputs * sizeof(_cns_LsmTable*));
+    _cns_LsmTableIterator* its = (_cns_LsmTableIterator*) _cns_lsm_allocZeroed(lsm->cns, maxInputs * sizeof(_cns_LsmTableIterator));
+    _cns_LsmBuffer outputs = { .cns = lsm->cns };
+    int numInputs = 0;
+    uint64_t bytesRead = 0, bytesWritten = 0;
+    cns_Error err = (inputs && its) ? CNS_OK : CNS_ERR_NOMEM;
+    for (int i = 0; !err && i < maxInputs; ++i)
+    {
+        _cns_LsmTable* table = i < numSources ? sources[i] : version->tables[level + 1][i - numSources];
+        if (i >= numSources && !_cns_lsm_overlaps(table, lo, loSize, hi, hiSize))
+            continue;
+        inputs[numInputs] = table;
+        its[numInputs].table = table;
+        its[numInputs].block = -1;
+        its[numInputs].buffer.cns = lsm->cns;
+        bytesRead += table->fileSize;
+        if (_cns_lsm_iteratorNext(&its[numInputs++]))
+            err = CNS_ERR_IO;
+    }
+
+    _cns_LsmTableWriter writer;
+    cns_Bool writing = CNS_NO;
+    while (!err)
+    {
+        int best = -1;
+        for (int i = 0; i < numInputs; ++i)
+        {
+            if (its[i].valid && (best < 0 || _cns_lsm_compare(its[i].key, its[i].keySize, its[best].key, its[best].keySize) < 0))
+                best = i;
+        }
+        if (best < 0)
+            break;
+
+        if (!writing && !(its[best].deleted && dropDeletions))
+        {
+            pthread_mutex_lock(&lsm->mutex);
+            uint64_t number = lsm->nextFileNumber++;
+            cns_Bool stop = lsm->stop;
+            pthread_mutex_unlock(&lsm->mutex);
+            if (stop)
+            {
+                err = CNS_ERR_IO; // abandoned, the inputs stay as they are
+                break;
+            }
+            if (_cns_lsm_writerOpen(&writer, lsm, number))
+            {
+                err = CNS_ERR_IO;
+                break;
+            }
+            writing = CNS_YES;
+        }
+        if (!(its[best].deleted && dropDeletions)
+            && _cns_lsm_writerAdd(&writer, its[best].key, its[best].keySize, its[best].value, its[best].valueSize, its[best].deleted))
+            err = CNS_ERR_IO;
+
+        // skip older entries for the same key, then the entry itself; its key lives in the iterator's buffer
+        for (int i = 0; !err && i < numInputs; ++i)
+        {
+            if (i != best && its[i].valid && !_cns_lsm_compare(its[i].key, its[i].keySize, its[best].key, its[best].keySize)
+                && _cns_lsm_iteratorNext(&its[i]))
+                err = CNS_ERR_IO;
+        }
+        if (!err && _cns_lsm_iteratorNext(&its[best]))
+            err = CNS_ERR_IO;
+
+        if (!err && writing && _cns_lsm_writerSize(&writer) >= (uint64_t) lsm->options.tableBytes)
+        {
+            _cns_LsmTable* table = 0;
+            writing = CNS_NO;
+            err = _cns_lsm_writerFinish(&writer, &table);
+            if (!err && _cns_lsm_bufferAppend(&outputs, &table, sizeof(table)))
+            {
+                _cns_lsm_tableUnref(lsm, table);
+                err = CNS_ERR_NOMEM;
+            }
+        }
+    }
+    if (!err && writing)
+    {
+        _cns_LsmTable* table = 0;
+        writing = CNS_NO;
+        err = _cns_lsm_writerFinish(&writer, &table);
+        if (!err && _cns_lsm_bufferAppend(&outputs, &table, sizeof(table)))
+        {
+            _cns_lsm_tableUnref(lsm, table);
+            err = CNS_ERR_NOMEM;
+        }
+    }
+    if (writing)
+        _cns_lsm_writerAbandon(&writer);
+    for (int i = 0; its && i < maxInputs; ++i)
+        cns_runtime_free_r(lsm->cns, its[i].buffer.data);
+    cns_runtime_free_r(lsm->cns, its);
+
+    _cns_LsmTable** added = (_cns_LsmTable**) outputs.data;
+    int numAdded = (int) (outputs.size / sizeof(_cns_LsmTable*));
+    for (int i = 0; i < numAdded; ++i)
+        bytesWritten += added[i]->fileSize;
+
+    pthread_mutex_lock(&lsm->mutex);
+    _cns_LsmVersion* next = err ? 0 : _cns_lsm_versionApply(lsm, version, inputs, numInputs, level + 1, added, numAdded);
+    if (!err && !next)
+        err = CNS_ERR_NOMEM;
+    if (!err)
+        err = _cns_lsm_writeManifest(lsm, next);
+    if (!err)
+    {
+        for (int i = 0; i < numInputs; ++i)
+            atomic_store(&inputs[i]->obsolete, 1);
+        _cns_lsm_versionUnref(lsm, lsm->current);
+        lsm->current = next;
+        ++lsm->stats.compactions;
+        lsm->stats.compactionBytesRead += bytesRead;
+        lsm->stats.compactionBytesWritten += bytesWritten;
+    }
+    else
+        _cns_lsm_versionUnref(lsm, next);
+    for (int i = 0; i < numAdded; ++i)
+    {
+        if (err)
+            atomic_store(&added[i]->obsolete, 1);
+        _cns_lsm_tableUnref(lsm, added[i]);
+    }
+    cns_runtime_free_r(lsm->cns, outputs.data);
+    cns_runtime_free_r(lsm->cns, inputs);
+    _cns_lsm_versionUnref(lsm, version);
+    return err;
+}
+
+
+// The background thread
+
+// Writes the immutable memory table out to level 0. Called and returns with the mutex held.
+static cns_Error _cns_lsm_flushImmutable(_cns_Lsm* lsm)
+{
+    cns_Storage* memtable = lsm->immutable;
+    uint64_t logNumber = lsm->immutableLogNumber;
+    uint64_t number = lsm->nextFileNumber++;
+    pthread_mutex_unlock(&lsm->mutex);
+
+    _cns_LsmTable* table = 0;
+    cns_Error err = _cns_lsm_writeMemtable(lsm, memtable, number, &table);
+
+    pthread_mutex_lock(&lsm->mutex);
+    _cns_LsmVersion* next = err ? 0 : _cns_lsm_versionApply(lsm, lsm->current, 0, 0, 0, &table, 1);
+    if (!err && !next)
+        err = CNS_ERR_NOMEM;
+    if (!err)
+    {
+        uint64_t flushedLogNumber = lsm->flushedLogNumber;
+        cns_Index flushedCount = lsm->flushedCount;
+        lsm->flushedLogNumber = logNumber;
+        lsm->flushedCount = lsm->immutableCount;
+        err = _cns_lsm_writeManifest(lsm, next);
+        if (err)
+        {
+            lsm->flushedLogNumber = flushedLogNumber;
+            lsm->flushedCount = flushedCount;
+        }
+    }
+    if (!err)
+    {
+        _cns_lsm_versionUnref(lsm, lsm->current);
+        lsm->current = next;
+        atomic_store(&lsm->immutableFlushed, 1);
+        ++lsm->stats.flushes;
+        lsm->stats.flushBytesWritten += table->fileSize;
+
+        char path[_CNS_LSM_PATHMAX];
+        _cns_lsm_path(lsm, path, logNumber, "wal");
+        unlink(path);
+    }
+    else
+        _cns_lsm_versionUnref(lsm, next);
+    if (table)
+    {
+        if (err)
+            atomic_store(&table->obsolete, 1);
+        _cns_lsm_tableUnref(lsm, table);
+    }
+    return err;
+}
+
+static void* _cns_lsm_work(void* arg)
+{
+    _cns_Lsm* lsm = (_cns_Lsm*) arg;
+    pthread_mutex_lock(&lsm->mutex);
+    while (!lsm->stop)
+    {
+        cns_Error err = CNS_OK;
+        cns_Bool failed = (atomic_load(&lsm->backgroundError) != CNS_OK);
+        int level = -1;
+        if (!failed && lsm->immutable && !atomic_load(&lsm->immutableFlushed))
+            err = _cns_lsm_flushImmutable(lsm);
+        else if (!failed && (level = _cns_lsm_pickCompaction(lsm)) >= 0)
+            err = _cns_lsm_compact(lsm, level);
+        else
+        {
+            lsm->idle = CNS_YES;
+            pthread_cond_broadcast(&lsm->doneCondition);
+            pthread_cond_wait(&lsm->workCondition, &lsm->mutex);
+            continue;
+        }
+
+        if (err && !lsm->stop)
+            atomic_store(&lsm->backgroundError, err); // nothing changed on disk; writes fail from now on
+        pthread_cond_broadcast(&lsm->doneCondition);
+    }
+    lsm->idle = CNS_YES;
+    pthread_cond_broadcast(&lsm->doneCondition);
+    pthread_mutex_unlock(&lsm->mutex);
+    return 0;
+}
+
+
+// Reads and writes, on the calling thread
+
+// Memory storages report through the last error, which `_r` functions must leave alone
+static cns_Error _cns_lsm_newMemtable(cns_Runtime* cns, cns_Storage** out_memtable)
+{
+    cns_Error saved = cns_lasterr(cns);
+    *out_memtable = cns_storage_newMemoryStorage(cns, 0);
+    cns_Error err = *out_memtable ? CNS_OK : cns_lasterr(cns);
+    cns_setlasterr(cns, saved);
+    return err;
+}
+
+static void _cns_lsm_freeMemtable(cns_Runtime* cns, cns_Storage* memtable)
+{
+    cns_Error saved = cns_lasterr(cns);
+    cns_storage_free(cns, memtable);
+    cns_setlasterr(cns, saved);
+}
+
+// Frees the immutable memory table once it is on disk
+static void _cns_lsm_dropFlushed(cns_Runtime* cns, _cns_Lsm* lsm)
+{
+    if (!lsm->immutable || !atomic_load(&lsm->immutableFlushed))
+        return;
+
+    pthread_mutex_lock(&lsm->mutex);
+    cns_Storage* memtable = lsm->immutable;
+    lsm->immutable = 0;
+    pthread_mutex_unlock(&lsm->mutex);
+    _cns_lsm_freeMemtable(cns, memtable);
+}
+
+// Finds the newest entry for the key: in the memory tables, then in the tables from the newest on.
+// `out_value` may be NULL if only existence matters.
+static cns_Error _cns_lsm_lookup(cns_Runtime* cns, _cns_Lsm* lsm, cns_Bytes* key, cns_Bytes** out_value, cns_Bool* out_found)
+{
+    *out_found = CNS_NO;
+    cns_Storage* memtables[2] = { lsm->memtable, lsm->immutable };
+    for (int i = 0; i < 2; ++i)
+    {
+        cns_Bytes* value = 0;
+        cns_Error err = memtables[i] ? cns_storage_get_r(cns, memtables[i], key, &value) : CNS_OK;
+        if (err)
+            return err;
+        if (!value)
+            continue;
+
+        *out_found = (value != lsm->tombstone);
+        if (*out_found && out_value)
+            *out_value = value;
+        else
+            cns_bytes_free_r(cns, value);
+        return CNS_OK;
+    }
+
+    const uint8_t* keyPtr = (const uint8_t*) cns_bytes_ptrUnchecked(key);
+    if (!keyPtr)
+        return CNS_ERR_NOMEM;
+    size_t keySize = (size_t) cns_bytes_lengthUnchecked(key);
+    uint32_t hash = _cns_lsm_crc(keyPtr, keySize);
+    ++lsm->stats.diskGets;
+
+    pthread_mutex_lock(&lsm->mutex);
+    _cns_LsmVersion* version = lsm->current;
+    atomic_fetch_add(&version->references, 1);
+    pthread_mutex_unlock(&lsm->mutex);
+
+    cns_Error err = CNS_OK;
+    int found = 0;
+    cns_Bytes* block = 0;
+    size_t valueOffset = 0, valueSize = 0;
+    cns_Bool deleted = CNS_NO;
+    for (int level = 0; level < CNS_LSM_MAXLEVELS && !found && !err; ++level)
+    {
+        _cns_LsmTable** tables = version->tables[level];
+        int i = 0, end = version->numTables[level];
+        if (level > 0)
+        {
+            // the one table whose range may cover the key: the first one not ending below it
+            int hi = end;
+            while (i < hi)
+            {
+                int mid = i + (hi - i) / 2;
+                size_t largestSize;
+                const uint8_t* largest = _cns_lsm_tableLargest(tables[mid], &largestSize);
+                if (_cns_lsm_compare(largest, largestSize, keyPtr, keySize) < 0)
+                    i = mid + 1;
+                else
+                    hi = mid;
+            }
+            end = i < end ? i + 1 : end;
+        }
+        for (; i < end && !found && !err; ++i)
+        {
+            if (_cns_lsm_overlaps(tables[i], keyPtr, keySize, keyPtr, keySize))
+                found = _cns_lsm_tableGet(cns, lsm, tables[i], keyPtr, keySize, hash, &block, &valueOffset, &valueSize, &deleted, &err);
+        }
+    }
+
+    if (found && !deleted)
+    {
+        *out_found = CNS_YES;
+        // a view into the block, without copying
+        if (out_value)
+            err = cns_bytes_slice_r(cns, block, (cns_Index) valueOffset, (cns_Index) valueSize, out_value);
+    }
+    if (block)
+        cns_bytes_free_r(cns, block);
+    _cns_lsm_versionUnref(lsm, version);
+    return err;
+}
+
+static cns_Error _cns_lsm_logAppend(cns_Runtime* cns, _cns_Lsm* lsm, const uint8_t* key, size_t keySize,
+                                    const uint8_t* value, size_t valueSize, cns_Bool deleted)
+{
+    uint8_t keyHeader[CNS_WIRE_MAXVARINT];
+    size_t keyHeaderSize = (size_t) cns_wire_encodeVarint(keySize, keyHeader);
+    size_t payloadSize = 1 + keyHeaderSize + keySize + (deleted ? 0 : valueSize);
+    cns_Error err = _cns_lsm_reserveScratch(cns, lsm, (cns_Index) (CNS_WIRE_MAXVARINT + payloadSize + 4));
+    if (err)
+        return err;
+
+    uint8_t* record = lsm->scratch;
+    size_t n = (size_t) cns_wire_encodeVarint(payloadSize, record);
+    uint8_t* payload = record + n;
+    payload[0] = deleted ? 0 : 1;
+    memcpy(payload + 1, keyHeader, keyHeaderSize);
+    memcpy(payload + 1 + keyHeaderSize, key, keySize);
+    if (!deleted)
+        memcpy(payload + 1 + keyHeaderSize + keySize, value, valueSize);
+    _cns_lsm_put32(payload + payloadSize, _cns_lsm_crc(payload, payloadSize));
+
+    size_t recordSize = n + payloadSize + 4;
+    if (_cns_lsm_writeAll(lsm->logFd, record, recordSize) || (lsm->options.syncWrites && fdatasync(lsm->logFd)))
+        return CNS_ERR_IO;
+    lsm->stats.logBytesWritten += recordSize;
+    return CNS_OK;
+}
+
+// Writes `value`, or the tombstone for deletes, to the memory table, logging it first if `log` is set.
+// Deleting a key which has no value does nothing.
+static cns_Error _cns_lsm_put(cns_Runtime* cns, _cns_Lsm* lsm, cns_Bytes* key, cns_Bytes* value, cns_Bool log, cns_Bool* out_existed)
+{
+    // contiguous from now on, so that the background thread can read them without allocating
+    const uint8_t* keyPtr = (const uint8_t*) cns_bytes_ptrUnchecked(key);
+    const uint8_t* valuePtr = (const uint8_t*) cns_bytes_ptrUnchecked(value);
+    if (!keyPtr || !valuePtr)
+        return CNS_ERR_NOMEM;
+    size_t keySize = (size_t) cns_bytes_lengthUnchecked(key);
+    size_t valueSize = (size_t) cns_bytes_lengthUnchecked(value);
+    cns_Bool deleted = (value == lsm->tombstone);
+
+    cns_Bool existed = CNS_NO;
+    cns_Error err = _cns_lsm_lookup(cns, lsm, key, 0, &existed);
+    if (out_existed)
+        *out_existed = existed;
+    if (err || (deleted && !existed))
+        return err;
+
+    if (log)
+    {
+        err = _cns_lsm_logAppend(cns, lsm, keyPtr, keySize, valuePtr, valueSize, deleted);
+        if (err)
+            return err;
+        lsm->stats.userBytesWritten += keySize + (deleted ? 0 : valueSize);
+    }
+    err = cns_storage_set_r(cns, lsm->memtable, key, value);
+    if (err)
+        return err;
+
+    if (deleted)
+        --lsm->count;
+    else if (!existed)
+        ++lsm->count;
+    lsm->memtableBytes += (cns_Index) (keySize + valueSize);
+    return CNS_OK;
+}
+
+// Hands the memory table over to the background thread and starts a new one with its own log
+static cns_Error _cns_lsm_rotate(cns_Runtime* cns, _cns_Lsm* lsm)
+{
+    // one memory table is written out at a time
+    pthread_mutex_lock(&lsm->mutex);
+    while (lsm->immutable && !atomic_load(&lsm->immutableFlushed) && !atomic_load(&lsm->backgroundError))
+        pthread_cond_wait(&lsm->doneCondition, &lsm->mutex);
+    uint64_t number = lsm->nextFileNumber++;
+    pthread_mutex_unlock(&lsm->mutex);
+    _cns_lsm_dropFlushed(cns, lsm);
+
+    cns_Error err = atomic_load(&lsm->backgroundError);
+    cns_Storage* memtable = 0;
+    if (!err)
+        err = _cns_lsm_newMemtable(cns, &memtable);
+    if (err)
+        return err;
+
+    char path[_CNS_LSM_PATHMAX];
+    _cns_lsm_path(lsm, path, number, "wal");
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        _cns_lsm_freeMemtable(cns, memtable);
+        return CNS_ERR_IO;
+    }
+    close(lsm->logFd);
+
+    pthread_mutex_lock(&lsm->mutex);
+    lsm->immutable = lsm->memtable;
+    lsm->immutableLogNumber = lsm->logNumber;
+    lsm->immutableCount = lsm->count;
+    atomic_store(&lsm->immutableFlushed, 0);
+    lsm->idle = CNS_NO;
+    pthread_cond_signal(&lsm->workCondition);
+    pthread_mutex_unlock(&lsm->mutex);
+
+    lsm->memtable = memtable;
+    lsm->logFd = fd;
+    lsm->logNumber = number;
+    lsm->memtableBytes = 0;
+    return CNS_OK;
+}
+
+static cns_Error _cns_lsm_beginWrite(cns_Runtime* cns, _cns_Lsm* lsm)
+{
+    cns_Error err = atomic_load(&lsm->backgroundError);
+    if (err)
+        return err;
+
+    _cns_lsm_dropFlushed(cns, lsm);
+    if (lsm->memtableBytes >= lsm->options.memtableBytes)
+        err = _cns_lsm_rotate(cns, lsm);
+    return err;
+}
+
+static cns_Error _cns_lsm_set(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bytes* value)
+{
+    _cns_Lsm* lsm = (_cns_Lsm*) _cns_storage_engineState(storage);
+    cns_Error err = _cns_lsm_beginWrite(cns, lsm);
+    return err ? err : _cns_lsm_put(cns, lsm, key, value, CNS_YES, 0);
+}
+
+static cns_Error _cns_lsm_get(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bytes** out_value)
+{
+    _cns_Lsm* lsm = (_cns_Lsm*) _cns_storage_engineState(storage);
+    cns_Bool found = CNS_NO;
+    _cns_lsm_dropFlushed(cns, lsm);
+    return _cns_lsm_lookup(cns, lsm, key, out_value, &found);
+}
+
+static cns_Error _cns_lsm_remove(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bool* out_existed)
+{
+    _cns_Lsm* lsm = (_cns_Lsm*) _cns_storage_engineState(storage);
+    cns_Bool existed = CNS_NO;
+    cns_Error err = _cns_lsm_beginWrite(cns, lsm);
+    if (!err)
+        err = _cns_lsm_put(cns, lsm, key, lsm->tombstone, CNS_YES, &existed);
+    if (out_existed)
+        *out_existed = (cns_Bool) (!err && existed);
+    return err;
+}
+
+static cns_Index _cns_lsm_count(cns_Storage* storage)
+{
+    return ((_cns_Lsm*) _cns_storage_engineState(storage))->count;
+}
+
+static void _cns_lsm_stats(cns_Runtime* cns, cns_Storage* storage, cns_StorageStats* out_stats)
+{
+    out_stats->count = ((_cns_Lsm*) _cns_storage_engineState(storage))->count;
+}
+
+
+// Opening and closing
+
+// Parses "<number>.<suffix>"
+static cns_Bool _cns_lsm_parseFileName(const char * name, const char * suffix, uint64_t* out_number)
+{
+    uint64_t number = 0;
+    const char * p = name;
+    for (; *p >= '0' && *p <= '9'; ++p)
+        number = number * 10 + (uint64_t) (*p - '0');
+    if (p == name || *p != '.' || strcmp(p + 1, suffix))
+        return CNS_NO;
+    *out_number = number;
+    return CNS_YES;
+}
+
+static int _cns_lsm_numberCompare(const void * lhs, const void * rhs)
+{
+    uint64_t l = *(const uint64_t*) lhs, r = *(const uint64_t*) rhs;
+    return (l > r) - (l < r);
+}
+
+// Applies the records of a log to the memory table, up to the first one which was not written completely
+static cns_Error _cns_lsm_replayLog(cns_Runtime* cns, _cns_Lsm* lsm, uint64_t number)
+{
+    char path[_CNS_LSM_PATHMAX];
+    _cns_lsm_path(lsm, path, number, "wal");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st))
+    {
+        if (fd >= 0)
+            close(fd);
+        return CNS_ERR_IO;
+    }
+
+    size_t size = (size_t) st.st_size;
+    uint8_t* data = 0;
+    cns_Error err = size ? _cns_runtime_allocIn_r(cns, CNS_ALLOC_LSM, (cns_Index) size, (void**) &data) : CNS_OK;
+    if (!err && size && _cns_lsm_readAt(fd, data, size, 0))
+        err = CNS_ERR_IO;
+    close(fd);
+
+    size_t pos = 0;
+    while (!err && pos < size)
+    {
+        uint64_t payloadSize = 0;
+        size_t n = (size_t) cns_wire_decodeVarint(data + pos, (cns_Index) (size - pos), &payloadSize);
+        if (!n || payloadSize < 2 || payloadSize + 4 > size - pos - n)
+            break;
+        const uint8_t* payload = data + pos + n;
+        if (_cns_lsm_get32(payload + payloadSize) != _cns_lsm_crc(payload, (size_t) payloadSize) || payload[0] > 1)
+            break;
+        const uint8_t* key;
+        size_t keySize;
+        size_t m = _cns_lsm_decodeSlice(payload + 1, (size_t) payloadSize - 1, &key, &keySize);
+        if (!m)
+            break;
+
+        cns_Bytes* keyBytes = 0;
+        cns_Bytes* value = lsm->tombstone;
+        err = cns_bytes_new_r(cns, key, (cns_Index) keySize, &keyBytes);
+        if (!err && payload[0])
+            err = cns_bytes_new_r(cns, payload + 1 + m, (cns_Index) (payloadSize - 1 - m), &value);
+        if (!err)
+            err = _cns_lsm_put(cns, lsm, keyBytes, value, CNS_NO, 0);
+        if (keyBytes)
+            cns_bytes_free_r(cns, keyBytes);
+        if (value && value != lsm->tombstone)
+            cns_bytes_free_r(cns, value);
+        pos += n + (size_t) payloadSize + 4;
+    }
+    cns_runtime_free_r(cns, data);
+    return err;
+}
+
+// Lists the files in the directory: logs newer than the last flush go to `out_logs`, orphans left by a crash are
+// deleted, and the next file number is moved past every number in use
+static cns_Error _cns_lsm_scanDirectory(cns_Runtime* cns, _cns_Lsm* lsm, uint64_t** out_logs, cns_Index* out_numLogs)
+{
+    DIR* dir = opendir(lsm->directory);
+    if (!dir)
+        return CNS_ERR_IO;
+
+    cns_Error err = CNS_OK;
+    cns_Index capacity = 0;
+    struct dirent* entry;
+    while (!err && (entry = readdir(dir)) != 0)
+    {
+        char path[_CNS_LSM_PATHMAX];
+        uint64_t number = 0;
+        if (_cns_lsm_parseFileName(entry->d_name, "wal", &number))
+        {
+            if (number <= lsm->flushedLogNumber)
+            {
+                _cns_lsm_path(lsm, path, number, "wal");
+                unlink(path);
+            }
+            else
+            {
+                if (*out_numLogs == capacity)
+                {
+                    capacity = capacity ? capacity * 2 : 8;
+                    err = _cns_runtime_reallocIn_r(cns, CNS_ALLOC_LSM, *out_logs, capacity * (cns_Index) sizeof(uint64_t), (void**) out_logs);
+                }
+                if (!err)
+                    (*out_logs)[(*out_numLogs)++] = number;
+            }
+        }
+        else if (_cns_lsm_parseFileName(entry->d_name, "sst", &number))
+        {
+            cns_Bool live = CNS_NO;
+            for (int level = 0; level < CNS_LSM_MAXLEVELS && !live; ++level)
+            {
+                for (int i = 0; i < lsm->current->numTables[level] && !live; ++i)
+                    live = (lsm->current->tables[level][i]->number == number);
+            }
+            if (!live)
+            {
+                _cns_lsm_path(lsm, path, number, "sst");
+                unlink(path);
+            }
+        }
+        else if (!strcmp(entry->d_name, "MANIFEST.tmp"))
+        {
+            snprintf(path, sizeof(path), "%s/MANIFEST.tmp", lsm->directory);
+            unlink(path);
+        }
+        if (number >= lsm->nextFileNumber)
+            lsm->nextFileNumber = number + 1;
+    }
+    closedir(dir);
+    return err;
+}
+
+static cns_Error _cns_lsm_open(cns_Runtime* cns, _cns_Lsm* lsm)
+{
+    char path[_CNS_LSM_PATHMAX];
+    if (mkdir(lsm->directory, 0755) && errno != EEXIST)
+        return CNS_ERR_IO;
+    snprintf(path, sizeof(path), "%s/LOCK", lsm->directory);
+    lsm->lockFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lsm->lockFd < 0 || flock(lsm->lockFd, LOCK_EX | LOCK_NB))
+        return CNS_ERR_IO;
+
+    cns_Error err = _cns_lsm_readManifest(lsm);
+    if (!err && !lsm->current)
+    {
+        lsm->current = _cns_lsm_versionApply(lsm, 0, 0, 0, 0, 0, 0);
+        err = lsm->current ? CNS_OK : CNS_ERR_NOMEM;
+    }
+    lsm->count = lsm->flushedCount;
+    if (!err)
+        err = cns_bytes_new_r(cns, 0, 0, &lsm->tombstone);
+    if (!err)
+        err = _cns_lsm_newMemtable(cns, &lsm->memtable);
+
+    // logs newer than the last flush hold writes which are not in any table yet
+    uint64_t* logs = 0;
+    cns_Index numLogs = 0;
+    if (!err)
+        err = _cns_lsm_scanDirectory(cns, lsm, &logs, &numLogs);
+    if (numLogs)
+        qsort(logs, (size_t) numLogs, sizeof(uint64_t), _cns_lsm_numberCompare);
+    for (cns_Index i = 0; i < numLogs && !err; ++i)
+        err = _cns_lsm_replayLog(cns, lsm, logs[i]);
+
+    if (!err && numLogs)
+    {
+        cns_Storage* memtable = lsm->memtable;
+        _cns_LsmTable* table = 0;
+        if (cns_storage_count(cns, memtable))
+            err = _cns_lsm_writeMemtable(lsm, memtable, lsm->nextFileNumber++, &table);
+        _cns_LsmVersion* next = (err || !table) ? 0 : _cns_lsm_versionApply(lsm, lsm->current, 0, 0, 0, &table, 1);
+        if (table && !next)
+            err = CNS_ERR_NOMEM;
+        lsm->flushedLogNumber = logs[numLogs - 1];
+        lsm->flushedCount = lsm->count;
+        if (!err)
+            err = _cns_lsm_writeManifest(lsm, next ? next : lsm->current);
+        if (next && !err)
+        {
+            _cns_lsm_versionUnref(lsm, lsm->current);
+            lsm->current = next;
+        }
+        else
+            _cns_lsm_versionUnref(lsm, next);
+        if (table)
+            _cns_lsm_tableUnref(lsm, table);
+
+        // the logs are replaced by the table; the next scan deletes them should this not finish
+        for (cns_Index i = 0; i < numLogs && !err; ++i)
+        {
+            _cns_lsm_path(lsm, path, logs[i], "wal");
+            unlink(path);
+        }
+        if (!err)
+        {
+            _cns_lsm_freeMemtable(cns, memtable);
+            lsm->memtable = 0;
+            lsm->memtableBytes = 0;
+            err = _cns_lsm_newMemtable(cns, &lsm->memtable);
+        }
+    }
+    cns_runtime_free_r(cns, logs);
+
+    if (!err)
+    {
+        lsm->logNumber = lsm->nextFileNumber++;
+        _cns_lsm_path(lsm, path, lsm->logNumber, "wal");
+        lsm->logFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (lsm->logFd < 0)
+            err = CNS_ERR_IO;
+    }
+    if (!err)
+    {
+        lsm->idle = CNS_NO; // until the first look at what needs merging
+        if (pthread_create(&lsm->worker, 0, _cns_lsm_work, lsm))
+            err = CNS_ERR_NOMEM;
+        else
+            lsm->workerStarted = CNS_YES;
+    }
+    return err;
+}
+
+static void _cns_lsm_destroy(cns_Runtime* cns, _cns_Lsm* lsm)
+{
+    if (lsm->workerStarted)
+    {
+        pthread_mutex_lock(&lsm->mutex);
+        lsm->stop = CNS_YES;
+        pthread_cond_signal(&lsm->workCondition);
+        pthread_mutex_unlock(&lsm->mutex);
+        pthread_join(lsm->worker, 0);
+    }
+
+    // memory tables which did not make it to disk are in the logs, and replayed by the next open
+    if (lsm->immutable)
+        _cns_lsm_freeMemtable(cns, lsm->immutable);
+    if (lsm->memtable)
+        _cns_lsm_freeMemtable(cns, lsm->memtable);
+    if (lsm->logFd >= 0)
+        close(lsm->logFd);
+    _cns_lsm_versionUnref(lsm, lsm->current);
+    if (lsm->tombstone)
+        cns_bytes_free_r(cns, lsm->tombstone);
+    cns_blockcache_eraseOwner_r(cns, (uintptr_t) lsm);
+    cns_runtime_free_r(cns, lsm->scratch);
+    if (lsm->lockFd >= 0)
+        close(lsm->lockFd);
+    cns_runtime_free_r(cns, lsm->directory);
+    pthread_cond_destroy(&lsm->doneCondition);
+    pthread_cond_destroy(&lsm->workCondition);
+    pthread_mutex_destroy(&lsm->mutex);
+    cns_runtime_free_r(cns, lsm);
+}
+
+static void _cns_lsm_free(cns_Runtime* cns, cns_Storage* storage)
+{
+    _cns_lsm_destroy(cns, (_cns_Lsm*) _cns_storage_engineState(storage));
+}
+
+static const _cns_StorageEngine _cns_lsm_engine = {
+    .set = _cns_lsm_set,
+    .get = _cns_lsm_get,
+    .remove = _cns_lsm_remove,
+    .count = _cns_lsm_count,
+    .stats = _cns_lsm_stats,
+    .free = _cns_lsm_free,
+};
+
+
+void
+cns_lsmoptions_default(cns_LsmOptions* out_options)
+{
+    if (!out_options)
+        return;
+
+    out_options->memtableBytes = 4 << 20;
+    out_options->tableBytes = 2 << 20;
+    out_options->blockBytes = 4 << 10;
+    out_options->bloomBitsPerKey = 10;
+    out_options->level0Tables = 4;
+    out_options->levelRatio = 10;
+    out_options->syncWrites = CNS_NO;
+}
+
+cns_Storage*
+cns_storage_newLsmStorage(cns_Runtime* cns, const char * directory, const cns_LsmOptions* options)
+{
+    cns_LsmOptions defaults;
+    cns_lsmoptions_default(&defaults);
+    if (!options)
+        options = &defaults;
+    if (!cns || !directory || !*directory || strlen(directory) + 32 > _CNS_LSM_PATHMAX
+        || options->memtableBytes <= 0 || options->tableBytes <= 0 || options->blockBytes <= 0
+        || options->bloomBitsPerKey < 0 || options->level0Tables < 1 || options->levelRatio < 2 || options->syncWrites > 1)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+
+    _cns_Lsm* lsm = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_LSM, sizeof(_cns_Lsm), (void**) &lsm);
+    if (!lsm)
+    {
+        cns_setlasterr(cns, err);
+        return 0;
+    }
+    memset(lsm, 0, sizeof(_cns_Lsm));
+    lsm->cns = cns;
+    lsm->options = *options;
+    lsm->lockFd = -1;
+    lsm->logFd = -1;
+    lsm->nextFileNumber = 1;
+    atomic_init(&lsm->immutableFlushed, 0);
+    atomic_init(&lsm->backgroundError, CNS_OK);
+    pthread_mutex_init(&lsm->mutex, 0);
+    pthread_cond_init(&lsm->workCondition, 0);
+    pthread_cond_init(&lsm->doneCondition, 0);
+
+    err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_LSM, (cns_Index) strlen(directory) + 1, (void**) &lsm->directory);
+    if (lsm->directory)
+    {
+        memcpy(lsm->directory, directory, strlen(directory) + 1);
+        err = _cns_lsm_open(cns, lsm);
+    }
+
+    cns_Storage* rv = 0;
+    if (!err)
+    {
+        rv = _cns_storage_newWithEngine(cns, &_cns_lsm_engine, lsm);
+        err = cns_lasterr(cns);
+    }
+    if (!rv)
+        _cns_lsm_destroy(cns, lsm);
+    cns_setlasterr(cns, err);
+    return rv;
+}
+
+void
+cns_storage_lsmStats(cns_Runtime* cns, cns_Storage* storage, cns_LsmStats* out_stats)
+{
+    if (!cns || !storage || !out_stats || _cns_storage_engine(storage) != &_cns_lsm_engine)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    _cns_Lsm* lsm = (_cns_Lsm*) _cns_storage_engineState(storage);
+    pthread_mutex_lock(&lsm->mutex);
+    *out_stats = lsm->stats;
+    out_stats->memtableBytes = lsm->memtableBytes;
+    for (int level = 0; level < CNS_LSM_MAXLEVELS; ++level)
+    {
+        out_stats->tablesPerLevel[level] = lsm->current->numTables[level];
+        out_stats->bytesPerLevel[level] = (cns_Index) _cns_lsm_levelBytes(lsm->current, level);
+    }
+    pthread_mutex_unlock(&lsm->mutex);
+    cns_setlasterr(cns, CNS_OK);
+}
+
+void
+cns_storage_lsmFlush(cns_Runtime* cns, cns_Storage* storage, cns_Bool waitForCompactions)
+{
+    if (!cns || !storage || waitForCompactions > 1 || _cns_storage_engine(storage) != &_cns_lsm_engine)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    _cns_Lsm* lsm = (_cns_Lsm*) _cns_storage_engineState(storage);
+    cns_Error err = atomic_load(&lsm->backgroundError);
+    _cns_lsm_dropFlushed(cns, lsm);
+    if (!err && cns_storage_count(cns, lsm->memtable))
+        err = _cns_lsm_rotate(cns, lsm);
+
+    pthread_mutex_lock(&lsm->mutex);
+    while (!err && !atomic_load(&lsm->backgroundError)
+           && ((lsm->immutable && !atomic_load(&lsm->immutableFlushed)) || (waitForCompactions && !lsm->idle)))
+        pthread_cond_wait(&lsm->doneCondition, &lsm->mutex);
+    pthread_mutex_unlock(&lsm->mutex);
+    _cns_lsm_dropFlushed(cns, lsm);
+
+    cns_setlasterr(cns, err ? err : atomic_load(&lsm->backgroundError));
+}
@@ -0,0 +1,224 @@
+#include <consensual/lz4.h>
+
+#include <string.h> // memcpy, memset
+
+// LZ4 block format: a sequence of
+//   token           literal length in the high nibble, match length - 4 in the low one; 15 means more bytes follow
+//   [length bytes]  255 each until the last one, which is below 255
+//   literals
+//   offset          2 bytes little endian, back from the current output position
+//   [length bytes]  continuing the match length
+// The last sequence has literals only. Decoders rely on the last 5 bytes being literals and on the last match starting
+// at least 12 bytes before the end.
+
+#define _CNS_LZ4_MINMATCH 4
+#define _CNS_LZ4_LASTLITERALS 5
+#define _CNS_LZ4_MFLIMIT 12
+#define _CNS_LZ4_MAXOFFSET 65535
+#define _CNS_LZ4_HASHLOG 12
+// after this many misses in a row the search steps over more bytes, so incompressible data goes fast
+#define _CNS_LZ4_SKIPTRIGGER 6
+
+static uint32_t _cns_lz4_read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t _cns_lz4_hash(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - _CNS_LZ4_HASHLOG);
+}
+
+// Writes the rest of a length which did not fit in its nibble; null if there is no room
+static uint8_t* _cns_lz4_putLength(uint8_t* op, const uint8_t* oend, size_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        if (op >= oend)
+            return 0;
+        *op++ = 255;
+    }
+    if (op >= oend)
+        return 0;
+    *op++ = (uint8_t) length;
+    return op;
+}
+
+// Appends a sequence: the literals from `anchor` to `ip`, then a match of `matchLength` bytes `offset` back unless
+// `matchLength` is 0; null if there is no room
+static uint8_t* _cns_lz4_putSequence(uint8_t* op, const uint8_t* oend, const uint8_t* anchor, const uint8_t* ip, size_t offset, size_t matchLength)
+{
+    size_t literals = (size_t) (ip - anchor);
+    if (op >= oend)
+        return 0;
+    uint8_t* token = op++;
+    *token = (uint8_t) ((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15 && !(op = _cns_lz4_putLength(op, oend, literals - 15)))
+        return 0;
+    if ((size_t) (oend - op) < literals)
+        return 0;
+    memcpy(op, anchor, literals);
+    op += literals;
+    if (!matchLength)
+        return op;
+
+    if (oend - op < 2)
+        return 0;
+    *op++ = (uint8_t) offset;
+    *op++ = (uint8_t) (offset >> 8);
+    size_t code = matchLength - _CNS_LZ4_MINMATCH;
+    *token |= (uint8_t) (code < 15 ? code : 15);
+    if (code >= 15 && !(op = _cns_lz4_putLength(op, oend, code - 15)))
+        return 0;
+    return op;
+}
+
+cns_Index
+cns_lz4_compress(const void * src, cns_Index size, void* dst, cns_Index capacity)
+{
+    if (size < 0 || size > CNS_LZ4_MAXINPUT || capacity <= 0 || (size && !src) || !dst)
+        return 0;
+
+    const uint8_t* in = (const uint8_t*) src;
+    const uint8_t* end = in + size;
+    const uint8_t* anchor = in;
+    uint8_t* op = (uint8_t*) dst;
+    const uint8_t* oend = op + capacity;
+
+    if (size > _CNS_LZ4_MFLIMIT)
+    {
+        // positions of the last 4-byte sequence seen with each hash; stale ones are weeded out by comparing
+        uint32_t table[1 << _CNS_LZ4_HASHLOG];
+        memset(table, 0, sizeof(table));
+        const uint8_t* matchLimit = end - _CNS_LZ4_LASTLITERALS;
+        const uint8_t* ipLimit = end - _CNS_LZ4_MFLIMIT;
+        const uint8_t* ip = in + 1;
+        unsigned misses = 0;
+
+        while (ip <= ipLimit)
+        {
+            uint32_t sequence = _cns_lz4_read32(ip);
+            uint32_t h = _cns_lz4_hash(sequence);
+            const uint8_t* ref = in + table[h];
+            table[h] = (uint32_t) (ip - in);
+            if (ip - ref > _CNS_LZ4_MAXOFFSET || ref == ip || _cns_lz4_read32(ref) != sequence)
+            {
+                ip += 1 + (misses++ >> _CNS_LZ4_SKIPTRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            while (ip > anchor && ref > in && ip[-1] == ref[-1])
+            {
+                --ip;
+                --ref;
+            }
+            const uint8_t* matchEnd = ip + _CNS_LZ4_MINMATCH;
+            const uint8_t* refEnd = ref + _CNS_LZ4_MINMATCH;
+            while (matchEnd < matchLimit && *matchEnd == *refEnd)
+            {
+                ++matchEnd;
+                ++refEnd;
+            }
+
+            op = _cns_lz4_putSequence(op, oend, anchor, ip, (size_t) (ip - ref), (size_t) (matchEnd - ip));
+            if (!op)
+                return 0;
+            ip = anchor = matchEnd;
+            if (ip <= ipLimit)
+                table[_cns_lz4_hash(_cns_lz4_read32(ip - 2))] = (uint32_t) (ip - 2 - in);
+        }
+    }
+
+    op = _cns_lz4_putSequence(op, oend, anchor, end, 0, 0);
+    return op ? (cns_Index) (op - (uint8_t*) dst) : 0;
+}
+
+// Reads the rest of a length whose nibble was 15; false if the input ends first
+static cns_Bool _cns_lz4_getLength(const uint8_t** ip, const uint8_t* iend, size_t* length)
+{
+    unsigned b;
+    do
+    {
+        if (*ip >= iend)
+            return CNS_NO;
+        b = *(*ip)++;
+        *length += b;
+    }
+    while (b == 255);
+    return CNS_YES;
+}
+
+cns_Index
+cns_lz4_decompress(const void * src, cns_Index size, void* dst, cns_Index capacity)
+{
+    if (size <= 0 || capacity < 0 || !src || (capacity && !dst))
+        return -1;
+
+    const uint8_t* ip = (const uint8_t*) src;
+    const uint8_t* iend = ip + size;
+    uint8_t* op = (uint8_t*) dst;
+    uint8_t* const ostart = op;
+    const uint8_t* oend = op + capacity;
+
+    for (;;)
+    {
+        unsigned token = *ip++;
+        size_t length = token >> 4;
+        if (length == 15 && !_cns_lz4_getLength(&ip, iend, &length))
+            return -1;
+        if ((size_t) (iend - ip) < length || (size_t) (oend - op) < length)
+            return -1;
+        if (length <= 16 && iend - ip >= 16 && oend - op >= 16)
+            memcpy(op, ip, 16); // short literals are the common case; the bytes past them are overwritten later
+        else if (length)
+            memcpy(op, ip, length);
+        op += length;
+        ip += length;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = (size_t) ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+        if (!offset || offset > (size_t) (op - ostart))
+            return -1;
+        length = token & 15;
+        if (length == 15 && !_cns_lz4_getLength(&ip, iend, &length))
+            return -1;
+        length += _CNS_LZ4_MINMATCH;
+        if ((size_t) (oend - op) < length)
+            return -1;
+
+        const uint8_t* match = op - offset;
+        if (offset >= 16 && (size_t) (oend - op) >= length + 16)
+        {
+            // 16 bytes at a time, running past the end into room the output has anyway; each step only reads what
+            // was written before it
+            for (size_t i = 0; i < length; i += 16)
+                memcpy(op + i, match + i, 16);
+        }
+        else if (offset >= length)
+            memcpy(op, match, length);
+        else if (offset >= 8)
+        {
+            size_t i = 0;
+            for (; i + 8 <= length; i += 8)
+                memcpy(op + i, match + i, 8);
+            for (; i < length; ++i)
+                op[i] = match[i];
+        }
+        else
+        {
+            for (size_t i = 0; i < length; ++i)
+                op[i] = match[i];
+        }
+        op += length;
+        if (ip >= iend)
+            return -1; // the last sequence must be literals
+    }
+    return (cns_Index) (op - ostart);
+}
@@ -0,0 +1,753 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // accept4
+#endif
+
+#include <consensual/net.h>
+#include <consensual/bytes_impl.h>
+#include "runtime_impl.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h> // memcpy, memset
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define _CNS_NET_HEADER 4
+#define _CNS_NET_MAXIOV 64
+#define _CNS_NET_MAXEVENTS 64
+#define _CNS_NET_READSPEREVENT 16 // so that one busy connection does not starve the others
+
+enum { _CNS_NET_LISTENER = 1, _CNS_NET_CONN = 2 };
+enum { _CNS_NET_CONNECTING = 1, _CNS_NET_OPEN = 2, _CNS_NET_CLOSED = 3 };
+
+// what epoll events point to; the kind tells listeners from connections
+typedef struct _cns_NetListener
+{
+    int kind;
+    int fd;
+    struct _cns_NetListener* next;
+} _cns_NetListener;
+
+typedef struct _cns_NetSend
+{
+    cns_Bytes*  message;
+    uint8_t     header[_CNS_NET_HEADER];
+} _cns_NetSend;
+
+struct cns_NetConn
+{
+    int                 kind;
+    int                 fd;
+    int                 state;
+    cns_Net*            net;
+    void*               context;
+    _cns_NetSend*       queue; // a ring, `queueCount` messages from `queueHead` on
+    cns_Index           queueHead;
+    cns_Index           queueCount;
+    cns_Index           queueCapacity;
+    cns_Index           sentOfFirst; // bytes of the first queued message written, its header included
+    cns_Index           queued; // bytes not written yet, headers included
+    cns_Bool            busy; // a send failed since the queue last drained
+    cns_Bool            paused;
+    cns_Bool            registered; // with epoll
+    uint32_t            events; // registered for
+    cns_Bool            dirty; // has messages to write before the next wait
+    _cns_BytesImpl*     block; // receive block, with a reference of the connection
+    cns_Index           blockUsed;
+    cns_Index           messageStart; // of the message being received
+    cns_NetConn*        prev; // in the list of live connections
+    cns_NetConn*        next;
+    cns_NetConn*        nextDirty;
+    cns_NetConn*        nextClosed;
+};
+
+struct cns_Net
+{
+    cns_Runtime*        cns;
+    cns_NetOptions      options;
+    int                 epfd;
+    _cns_NetListener*   listeners;
+    cns_NetConn*        conns;
+    cns_NetConn*        dirty;
+    cns_NetConn*        closed; // freed by the next poll
+    _cns_BytesImpl**    pool; // blocks with a reference of the pool; free for reuse when that is the only one
+    int                 poolCount;
+    int                 poolNext; // where the search for a free block starts
+    cns_NetStats        stats;
+};
+
+static void _cns_net_put32(uint8_t* out, uint32_t value)
+{
+    out[0] = (uint8_t) value;
+    out[1] = (uint8_t) (value >> 8);
+    out[2] = (uint8_t) (value >> 16);
+    out[3] = (uint8_t) (value >> 24);
+}
+
+static uint32_t _cns_net_get32(const uint8_t* ptr)
+{
+    return (uint32_t) ptr[0] | ((uint32_t) ptr[1] << 8) | ((uint32_t) ptr[2] << 16) | ((uint32_t) ptr[3] << 24);
+}
+
+static void _cns_net_register(cns_Net* net, cns_NetConn* conn, uint32_t events)
+{
+    if (conn->registered && conn->events == events)
+        return;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = conn;
+    epoll_ctl(net->epfd, conn->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn->fd, &event);
+    conn->registered = CNS_YES;
+    conn->events = events;
+}
+
+// what the connection waits for: data unless paused, and room to write while connecting or while messages wait
+static void _cns_net_updateEvents(cns_Net* net, cns_NetConn* conn)
+{
+    uint32_t events = conn->paused ? 0 : EPOLLIN;
+    if (conn->state == _CNS_NET_CONNECTING || (conn->queueCount && !conn->dirty))
+        events |= EPOLLOUT;
+    _cns_net_register(net, conn, events);
+}
+
+// a block of `size` bytes at least: a free one from the pool if it is of the usual size, otherwise a new one
+static cns_Error _cns_net_takeBlock(cns_Runtime* cns, cns_Net* net, cns_Index size, _cns_BytesImpl** out_block)
+{
+    if (size <= net->options.blockSize)
+    {
+        for (int i = 0; i < net->poolCount; ++i)
+        {
+            int slot = (net->poolNext + i) % net->poolCount;
+            _cns_BytesImpl* block = net->pool[slot];
+            if (atomic_load_explicit(&block->referenceCount, memory_order_acquire) == 1)
+            {
+                // no message of the block is alive, and none can be made but by this thread
+                atomic_fetch_add_explicit(&block->referenceCount, 1, memory_order_relaxed);
+                net->poolNext = (slot + 1) % net->poolCount;
+                ++net->stats.blocksReused;
+                *out_block = block;
+                return CNS_OK;
+            }
+        }
+        size = net->options.blockSize;
+    }
+
+    _cns_BytesImpl* block = 0;
+    cns_Error err = _cns_bytes_alloc(cns, size, &block);
+    if (!block)
+        return err;
+    ++net->stats.blocksAllocated;
+    if (size == net->options.blockSize && net->poolCount < net->options.poolBlocks)
+    {
+        atomic_fetch_add_explicit(&block->referenceCount, 1, memory_order_relaxed);
+        net->pool[net->poolCount++] = block;
+    }
+    *out_block = block;
+    return CNS_OK;
+}
+
+static void _cns_net_dropQueue(cns_Runtime* cns, cns_NetConn* conn)
+{
+    for (cns_Index i = 0; i < conn->queueCount; ++i)
+        cns_bytes_free_r(cns, conn->queue[(conn->queueHead + i) % conn->queueCapacity].message);
+    conn->queueCount = 0;
+    conn->queued = 0;
+}
+
+static void _cns_net_close(cns_Runtime* cns, cns_NetConn* conn, cns_Bool callback)
+{
+    if (conn->state == _CNS_NET_CLOSED)
+        return;
+    cns_Net* net = conn->net;
+    conn->state = _CNS_NET_CLOSED;
+    if (conn->dirty)
+    {
+        for (cns_NetConn** link = &net->dirty; *link; link = &(*link)->nextDirty)
+        {
+            if (*link == conn)
+            {
+                *link = conn->nextDirty;
+                break;
+            }
+        }
+    }
+    epoll_ctl(net->epfd, EPOLL_CTL_DEL, conn->fd, 0);
+    close(conn->fd);
+    _cns_net_dropQueue(cns, conn);
+    if (conn->block)
+        cns_bytes_free_r(cns, (cns_Bytes*) conn->block);
+    conn->block = 0;
+
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        net->conns = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    conn->nextClosed = net->closed;
+    net->closed = conn;
+    if (callback && net->options.onClose)
+        net->options.onClose(cns, net->options.context, conn);
+}
+
+static void _cns_net_freeClosed(cns_Runtime* cns, cns_Net* net)
+{
+    while (net->closed)
+    {
+        cns_NetConn* conn = net->closed;
+        net->closed = conn->nextClosed;
+        cns_runtime_free_r(cns, conn->queue);
+        cns_runtime_free_r(cns, conn);
+    }
+}
+
+static cns_Error _cns_net_newConn(cns_Runtime* cns, cns_Net* net, int fd, int state, cns_NetConn** out_conn)
+{
+    cns_NetConn* conn = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_REPLICATION, sizeof(cns_NetConn), (void**) &conn);
+    if (!conn)
+    {
+        close(fd);
+        return err;
+    }
+    memset(conn, 0, sizeof(cns_NetConn));
+    conn->kind = _CNS_NET_CONN;
+    conn->fd = fd;
+    conn->state = state;
+    conn->net = net;
+    conn->next = net->conns;
+    if (net->conns)
+        net->conns->prev = conn;
+    net->conns = conn;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    _cns_net_updateEvents(net, conn);
+    *out_conn = conn;
+    return CNS_OK;
+}
+
+// writes what the queue holds until it is empty or the socket is full
+static void _cns_net_flush(cns_Runtime* cns, cns_Net* net, cns_NetConn* conn)
+{
+    while (conn->queueCount && conn->state == _CNS_NET_OPEN)
+    {
+        struct iovec iov[_CNS_NET_MAXIOV];
+        int iovcnt = 0;
+        cns_Index skip = conn->sentOfFirst;
+        for (cns_Index i = 0; i < conn->queueCount && iovcnt < _CNS_NET_MAXIOV; ++i)
+        {
+            _cns_NetSend* send = &conn->queue[(conn->queueHead + i) % conn->queueCapacity];
+            if (skip < _CNS_NET_HEADER)
+            {
+                iov[iovcnt].iov_base = send->header + skip;
+                iov[iovcnt++].iov_len = (size_t) (_CNS_NET_HEADER - skip);
+                skip = 0;
+            }
+            else
+                skip -= _CNS_NET_HEADER;
+            cns_BytesChunks chunks;
+            cns_bytes_chunksBeginUnchecked(send->message, &chunks);
+            const void * ptr = 0;
+            cns_Index length = 0;
+            while (iovcnt < _CNS_NET_MAXIOV && cns_bytes_chunksNextUnchecked(&chunks, &ptr, &length))
+            {
+                if (skip >= length)
+                {
+                    skip -= length;
+                    continue;
+                }
+                iov[iovcnt].iov_base = (void*) ((const uint8_t*) ptr + skip);
+                iov[iovcnt++].iov_len = (size_t) (length - skip);
+                skip = 0;
+            }
+        }
+
+        // a peer which hung up fails the write with EPIPE rather than killing the process with SIGPIPE
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t) iovcnt;
+        ssize_t written = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        ++net->stats.writeCalls;
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                _cns_net_close(cns, conn, CNS_YES);
+            break;
+        }
+
+        net->stats.bytesSent += (uint64_t) written;
+        conn->queued -= written;
+        cns_Index left = written + conn->sentOfFirst;
+        while (conn->queueCount)
+        {
+            _cns_NetSend* send = &conn->queue[conn->queueHead];
+            cns_Index length = _CNS_NET_HEADER + cns_bytes_lengthUnchecked(send->message);
+            if (left < length)
+                break;
+            left -= length;
+            cns_bytes_free_r(cns, send->message);
+            conn->queueHead = (conn->queueHead + 1) % conn->queueCapacity;
+            --conn->queueCount;
+            ++net->stats.messagesSent;
+        }
+        conn->sentOfFirst = left;
+    }
+    if (conn->state == _CNS_NET_CLOSED)
+        return;
+    _cns_net_updateEvents(net, conn);
+    if (conn->busy && conn->queued <= net->options.maxQueued / 2)
+    {
+        conn->busy = CNS_NO;
+        if (net->options.onWritable)
+            net->options.onWritable(cns, net->options.context, conn);
+    }
+}
+
+// moves the part of a message received so far into a block with room for all of it
+static cns_Error _cns_net_relocate(cns_Runtime* cns, cns_Net* net, cns_NetConn* conn)
+{
+    cns_Index partial = conn->blockUsed - conn->messageStart;
+    cns_Index need = net->options.blockSize;
+    if (partial >= _CNS_NET_HEADER)
+    {
+        cns_Index length = (cns_Index) _cns_net_get32(conn->block->data + conn->messageStart);
+        if (length > net->options.maxMessage)
+            return CNS_ERR_MALFORMED;
+        if (_CNS_NET_HEADER + length > need)
+            need = _CNS_NET_HEADER + length;
+    }
+    _cns_BytesImpl* block = 0;
+    cns_Error err = _cns_net_takeBlock(cns, net, need, &block);
+    if (err)
+        return err;
+    if (conn->block)
+    {
+        memcpy((uint8_t*) block->data, conn->block->data + conn->messageStart, (size_t) partial);
+        cns_bytes_free_r(cns, (cns_Bytes*) conn->block);
+    }
+    conn->block = block;
+    conn->blockUsed = partial;
+    conn->messageStart = 0;
+    return CNS_OK;
+}
+
+static void _cns_net_read(cns_Runtime* cns, cns_Net* net, cns_NetConn* conn)
+{
+    for (int reads = 0; reads < _CNS_NET_READSPEREVENT && conn->state == _CNS_NET_OPEN && !conn->paused; ++reads)
+    {
+        cns_Index partial = conn->block ? conn->blockUsed - conn->messageStart : 0;
+        cns_Bool fits = conn->block && conn->blockUsed < conn->block->length;
+        if (fits && partial >= _CNS_NET_HEADER)
+        {
+            cns_Index length = _CNS_NET_HEADER + (cns_Index) _cns_net_get32(conn->block->data + conn->messageStart);
+            fits = conn->messageStart + length <= conn->block->length;
+        }
+        if (!fits && _cns_net_relocate(cns, net, conn))
+        {
+            _cns_net_close(cns, conn, CNS_YES);
+            return;
+        }
+
+        ssize_t n = read(conn->fd, (uint8_t*) conn->block->data + conn->blockUsed, (size_t) (conn->block->length - conn->blockUsed));
+        ++net->stats.readCalls;
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            _cns_net_close(cns, conn, CNS_YES); // the peer hung up, or the connection failed
+            return;
+        }
+        net->stats.bytesReceived += (uint64_t) n;
+        conn->blockUsed += n;
+
+        while (conn->state == _CNS_NET_OPEN && conn->blockUsed - conn->messageStart >= _CNS_NET_HEADER)
+        {
+            cns_Index length = (cns_Index) _cns_net_get32(conn->block->data + conn->messageStart);
+            if (length > net->options.maxMessage)
+            {
+                _cns_net_close(cns, conn, CNS_YES);
+                return;
+            }
+            if (conn->blockUsed - conn->messageStart < _CNS_NET_HEADER + length)
+                break;
+            cns_Bytes* message = 0;
+            cns_Error err = cns_bytes_slice_r(cns, (cns_Bytes*) conn->block, conn->messageStart + _CNS_NET_HEADER, length, &message);
+            if (err)
+            {
+                _cns_net_close(cns, conn, CNS_YES);
+                return;
+            }
+            conn->messageStart += _CNS_NET_HEADER + length;
+            ++net->stats.messagesReceived;
+            net->options.onMessage(cns, net->options.context, conn, message);
+        }
+    }
+}
+
+static void _cns_net_accept(cns_Runtime* cns, cns_Net* net, _cns_NetListener* listener)
+{
+    for (;;)
+    {
+        int fd = accept4(listener->fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        cns_NetConn* conn = 0;
+        if (_cns_net_newConn(cns, net, fd, _CNS_NET_OPEN, &conn))
+            continue;
+        if (net->options.onOpen)
+            net->options.onOpen(cns, net->options.context, conn);
+    }
+}
+
+static void _cns_net_connected(cns_Runtime* cns, cns_Net* net, cns_NetConn* conn)
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error)
+    {
+        _cns_net_close(cns, conn, CNS_YES);
+        return;
+    }
+    conn->state = _CNS_NET_OPEN;
+    if (net->options.onOpen)
+        net->options.onOpen(cns, net->options.context, conn);
+    if (conn->state == _CNS_NET_OPEN)
+        _cns_net_flush(cns, net, conn);
+}
+
+void
+cns_netoptions_default(cns_NetOptions* out_options)
+{
+    if (!out_options)
+        return;
+    memset(out_options, 0, sizeof(cns_NetOptions));
+    out_options->blockSize = 64 * 1024;
+    out_options->poolBlocks = 256;
+    out_options->maxMessage = 64 * 1024 * 1024;
+    out_options->maxQueued = 4 * 1024 * 1024;
+}
+
+cns_Net*
+cns_net_new(cns_Runtime* cns, const cns_NetOptions* options)
+{
+    if (!cns || !options || !options->onMessage || options->blockSize < 64 || options->poolBlocks < 0
+        || options->maxMessage < 0 || options->maxMessage > UINT32_MAX || options->maxQueued < 1)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+
+    cns_Net* net = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_REPLICATION, sizeof(cns_Net), (void**) &net);
+    if (!net)
+    {
+        cns_setlasterr(cns, err);
+        return 0;
+    }
+    memset(net, 0, sizeof(cns_Net));
+    net->cns = cns;
+    net->options = *options;
+    if (options->poolBlocks)
+        err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_REPLICATION, options->poolBlocks * (cns_Index) sizeof(_cns_BytesImpl*), (void**) &net->pool);
+    net->epfd = err ? -1 : epoll_create1(EPOLL_CLOEXEC);
+    if (!err && net->epfd < 0)
+        err = CNS_ERR_IO;
+    if (err)
+    {
+        cns_runtime_free_r(cns, net->pool);
+        cns_runtime_free_r(cns, net);
+        cns_setlasterr(cns, err);
+        return 0;
+    }
+    cns_setlasterr(cns, CNS_OK);
+    return net;
+}
+
+void
+cns_net_free(cns_Runtime* cns, cns_Net* net)
+{
+    if (!cns || !net)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    while (net->conns)
+        _cns_net_close(cns, net->conns, CNS_NO);
+    _cns_net_freeClosed(cns, net);
+    while (net->listeners)
+    {
+        _cns_NetListener* listener = net->listeners;
+        net->listeners = listener->next;
+        close(listener->fd);
+        cns_runtime_free_r(cns, listener);
+    }
+    for (int i = 0; i < net->poolCount; ++i)
+        cns_bytes_free_r(cns, (cns_Bytes*) net->pool[i]);
+    cns_runtime_free_r(cns, net->pool);
+    close(net->epfd);
+    cns_runtime_free_r(cns, net);
+    cns_setlasterr(cns, CNS_OK);
+}
+
+static cns_Error _cns_net_address(const char * address, int port, struct sockaddr_in* out_address)
+{
+    memset(out_address, 0, sizeof(struct sockaddr_in));
+    out_address->sin_family = AF_INET;
+    out_address->sin_port = htons((uint16_t) port);
+    if (!address || port < 0 || port > 65535 || inet_pton(AF_INET, address, &out_address->sin_addr) != 1)
+        return CNS_ERR_BADARG;
+    return CNS_OK;
+}
+
+cns_Error
+cns_net_listen_r(cns_Runtime* cns, cns_Net* net, const char * address, int port, int* out_port)
+{
+    struct sockaddr_in sin;
+    if (!cns || !net || !out_port || _cns_net_address(address, port, &sin))
+        return CNS_ERR_BADARG;
+
+    _cns_NetListener* listener = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_REPLICATION, sizeof(_cns_NetListener), (void**) &listener);
+    if (!listener)
+        return err;
+    listener->kind = _CNS_NET_LISTENER;
+    listener->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    socklen_t length = sizeof(sin);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = listener;
+    if (listener->fd < 0 || setsockopt(listener->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0
+        || bind(listener->fd, (struct sockaddr*) &sin, sizeof(sin)) < 0 || listen(listener->fd, SOMAXCONN) < 0
+        || getsockname(listener->fd, (struct sockaddr*) &sin, &length) < 0
+        || epoll_ctl(net->epfd, EPOLL_CTL_ADD, listener->fd, &event) < 0)
+    {
+        if (listener->fd >= 0)
+            close(listener->fd);
+        cns_runtime_free_r(cns, listener);
+        return CNS_ERR_IO;
+    }
+    listener->next = net->listeners;
+    net->listeners = listener;
+    *out_port = ntohs(sin.sin_port);
+    return CNS_OK;
+}
+
+int
+cns_net_listen(cns_Runtime* cns, cns_Net* net, const char * address, int port)
+{
+    int rv = 0;
+    cns_setlasterr(cns, cns_net_listen_r(cns, net, address, port, &rv));
+    return rv;
+}
+
+cns_Error
+cns_net_connect_r(cns_Runtime* cns, cns_Net* net, const char * address, int port, cns_NetConn** out_conn)
+{
+    struct sockaddr_in sin;
+    if (!cns || !net || !out_conn || _cns_net_address(address, port, &sin) || !port)
+        return CNS_ERR_BADARG;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return CNS_ERR_IO;
+    if (connect(fd, (struct sockaddr*) &sin, sizeof(sin)) < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return CNS_ERR_IO;
+    }
+    // even a connection made at once is reported open by the poll, as the open callback must not run from here
+    return _cns_net_newConn(cns, net, fd, _CNS_NET_CONNECTING, out_conn);
+}
+
+cns_NetConn*
+cns_net_connect(cns_Runtime* cns, cns_Net* net, const char * address, int port)
+{
+    cns_NetConn* rv = 0;
+    cns_setlasterr(cns, cns_net_connect_r(cns, net, address, port, &rv));
+    return rv;
+}
+
+cns_Error
+cns_net_poll_r(cns_Runtime* cns, cns_Net* net, int timeoutMs, int* out_count)
+{
+    if (!cns || !net || !out_count)
+        return CNS_ERR_BADARG;
+
+    _cns_net_freeClosed(cns, net);
+    // messages sent since the last poll leave together, one sendmsg per connection
+    while (net->dirty)
+    {
+        cns_NetConn* conn = net->dirty;
+        net->dirty = conn->nextDirty;
+        conn->dirty = CNS_NO;
+        _cns_net_flush(cns, net, conn);
+    }
+
+    struct epoll_event events[_CNS_NET_MAXEVENTS];
+    int count = epoll_wait(net->epfd, events, _CNS_NET_MAXEVENTS, timeoutMs);
+    if (count < 0)
+    {
+        *out_count = 0;
+        return errno == EINTR ? CNS_OK : CNS_ERR_IO;
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        if (*(int*) events[i].data.ptr == _CNS_NET_LISTENER)
+        {
+            _cns_net_accept(cns, net, (_cns_NetListener*) events[i].data.ptr);
+            continue;
+        }
+        cns_NetConn* conn = (cns_NetConn*) events[i].data.ptr;
+        if (conn->state == _CNS_NET_CONNECTING)
+            _cns_net_connected(cns, net, conn);
+        else if (conn->state == _CNS_NET_OPEN && (events[i].events & EPOLLOUT))
+            _cns_net_flush(cns, net, conn);
+        if (conn->state == _CNS_NET_OPEN && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        {
+            // a paused connection only hears of errors, which reading would not find
+            if (conn->paused && (events[i].events & (EPOLLERR | EPOLLHUP)))
+                _cns_net_close(cns, conn, CNS_YES);
+            else if (!conn->paused)
+                _cns_net_read(cns, net, conn);
+        }
+    }
+    *out_count = count;
+    return CNS_OK;
+}
+
+int
+cns_net_poll(cns_Runtime* cns, cns_Net* net, int timeoutMs)
+{
+    int rv = 0;
+    cns_setlasterr(cns, cns_net_poll_r(cns, net, timeoutMs, &rv));
+    return rv;
+}
+
+cns_Error
+cns_netconn_send_r(cns_Runtime* cns, cns_NetConn* conn, cns_Bytes* message)
+{
+    if (!cns || !conn || !message || conn->state == _CNS_NET_CLOSED)
+        return CNS_ERR_BADARG;
+    cns_Net* net = conn->net;
+    cns_Index length = cns_bytes_lengthUnchecked(message);
+    if (length > net->options.maxMessage)
+        return CNS_ERR_BADARG;
+    if (conn->queued >= net->options.maxQueued)
+    {
+        conn->busy = CNS_YES;
+        ++net->stats.busy;
+        return CNS_ERR_BUSY;
+    }
+
+    if (conn->queueCount == conn->queueCapacity)
+    {
+        cns_Index capacity = conn->queueCapacity ? 2 * conn->queueCapacity : 16;
+        _cns_NetSend* queue = 0;
+        cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_REPLICATION, capacity * (cns_Index) sizeof(_cns_NetSend), (void**) &queue);
+        if (!queue)
+            return err;
+        for (cns_Index i = 0; i < conn->queueCount; ++i)
+            queue[i] = conn->queue[(conn->queueHead + i) % conn->queueCapacity];
+        cns_runtime_free_r(cns, conn->queue);
+        conn->queue = queue;
+        conn->queueHead = 0;
+        conn->queueCapacity = capacity;
+    }
+    _cns_NetSend* send = &conn->queue[(conn->queueHead + conn->queueCount) % conn->queueCapacity];
+    cns_bytes_copy_r(cns, message, &send->message);
+    _cns_net_put32(send->header, (uint32_t) length);
+    ++conn->queueCount;
+    conn->queued += _CNS_NET_HEADER + length;
+    if (!conn->dirty && conn->state == _CNS_NET_OPEN)
+    {
+        conn->dirty = CNS_YES;
+        conn->nextDirty = net->dirty;
+        net->dirty = conn;
+    }
+    return CNS_OK;
+}
+
+void
+cns_netconn_send(cns_Runtime* cns, cns_NetConn* conn, cns_Bytes* message)
+{
+    cns_setlasterr(cns, cns_netconn_send_r(cns, conn, message));
+}
+
+void
+cns_netconn_pause(cns_Runtime* cns, cns_NetConn* conn, cns_Bool paused)
+{
+    if (!cns || !conn || conn->state == _CNS_NET_CLOSED)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+    conn->paused = paused ? CNS_YES : CNS_NO;
+    _cns_net_updateEvents(conn->net, conn);
+    cns_setlasterr(cns, CNS_OK);
+}
+
+void
+cns_netconn_close(cns_Runtime* cns, cns_NetConn* conn)
+{
+    if (!cns || !conn || conn->state == _CNS_NET_CLOSED)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+    _cns_net_close(cns, conn, CNS_YES);
+    cns_setlasterr(cns, CNS_OK);
+}
+
+cns_Index
+cns_netconn_queued(cns_Runtime* cns, cns_NetConn* conn)
+{
+    if (!cns || !conn)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+    cns_setlasterr(cns, CNS_OK);
+    return conn->queued;
+}
+
+void*
+cns_netconn_context(cns_NetConn* conn)
+{
+    return conn ? conn->context : 0;
+}
+
+void
+cns_netconn_setContext(cns_NetConn* conn, void* context)
+{
+    if (conn)
+        conn->context = context;
+}
+
+void
+cns_net_stats(cns_Runtime* cns, cns_Net* net, cns_NetStats* out_stats)
+{
+    if (!cns || !net || !out_stats)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+    *out_stats = net->stats;
+    cns_setlasterr(cns, CNS_OK);
+}
@@ -1,4 +1,44 @@
 #include <consensual/runtime.h>
+#include "runtime_impl.h"
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h> // snprintf
+#include <string.h> // memset
+
+#ifdef CNS_ENABLE_ALLOC_PROFILE
+
+// counters are spread over shards picked by thread, as storage statistics are
+#define _CNS_ALLOC_SHARDS 8
+
+// two additions per allocation or free: the rest of the profile is worked out from these
+typedef struct _cns_AllocCounters
+{
+    _Atomic uint64_t    sizes[CNS_ALLOC_SIZE_BUCKETS]; // allocations by size, which add up to their number
+    _Atomic uint64_t    allocBytes;
+    _Atomic uint64_t    frees;
+    _Atomic uint64_t    freeBytes;
+} _cns_AllocCounters;
+
+// rounded up to whole cache lines
+typedef union _cns_AllocShard
+{
+    _cns_AllocCounters  categories[CNS_ALLOC_CATEGORIES];
+    uint8_t             padding[(sizeof(_cns_AllocCounters) * CNS_ALLOC_CATEGORIES + 63) / 64 * 64];
+} _cns_AllocShard;
+
+// in front of each allocation; 16 bytes keep what follows 16-byte aligned, but no more, should the allocator align further
+typedef struct _cns_AllocHeader
+{
+    int64_t     size;
+    int32_t     category;
+    int32_t     unused;
+} _cns_AllocHeader;
+
+static atomic_int _cns_alloc_nextThreadSlot;
+static _Thread_local int _cns_alloc_threadSlot = -1;
+
+#endif // CNS_ENABLE_ALLOC_PROFILE
 
 struct _cns_Runtime
 {
@@ -6,9 +46,15 @@ struct _cns_Runtime
     cns_Runtime_FreeFn      freefn;
     cns_Runtime_ReallocFn   reallocfn;
     const void *            allocContext;
-    cns_Error               lastError;
+    _Atomic(_cns_BlockCache*) blockCache;
+#ifdef CNS_ENABLE_ALLOC_PROFILE
+    _cns_AllocShard         allocShards[_CNS_ALLOC_SHARDS];
+#endif
 };
 
+// kept per thread like errno, so that a runtime can be shared by threads without them writing to one cache line
+static _Thread_local cns_Error _cns_lastError;
+
 cns_Runtime *
 cns_startup(cns_Runtime_AllocFn allocfn, cns_Runtime_FreeFn freefn, cns_Runtime_ReallocFn reallocfn, const void * allocContext)
 {
@@ -23,8 +69,12 @@ cns_startup(cns_Runtime_AllocFn allocfn, cns_Runtime_FreeFn freefn, cns_Runtime_
         rv->freefn          = freefn;
         rv->reallocfn       = reallocfn;
         rv->allocContext    = allocContext;
-        rv->lastError       = err;
+        atomic_init(&rv->blockCache, 0);
+#ifdef CNS_ENABLE_ALLOC_PROFILE
+        memset(rv->allocShards, 0, sizeof(rv->allocShards));
+#endif
     }
+    _cns_lastError = err;
     return rv;
 }
 
@@ -33,33 +83,163 @@ cns_shutdown(cns_Runtime* cns)
 {
     if (cns)
     {
+        _cns_BlockCache* cache = atomic_load(&cns->blockCache);
+        if (cache)
+            _cns_blockcache_destroy(cns, cache);
         cns_Error err = CNS_OK;
         cns->freefn(cns->allocContext, cns, &err);
     }
 }
 
+_cns_BlockCache*
+_cns_runtime_blockCache(cns_Runtime* cns)
+{
+    return atomic_load_explicit(&cns->blockCache, memory_order_acquire);
+}
+
+_cns_BlockCache*
+_cns_runtime_installBlockCache(cns_Runtime* cns, _cns_BlockCache* cache)
+{
+    _cns_BlockCache* expected = 0;
+    if (atomic_compare_exchange_strong(&cns->blockCache, &expected, cache))
+        return cache;
+    return expected;
+}
+
+#ifdef CNS_ENABLE_ALLOC_PROFILE
+
+static void _cns_alloc_count(cns_Runtime* cns, int category, int64_t size, int delta)
+{
+    if (_cns_alloc_threadSlot < 0)
+        _cns_alloc_threadSlot = atomic_fetch_add_explicit(&_cns_alloc_nextThreadSlot, 1, memory_order_relaxed) % _CNS_ALLOC_SHARDS;
+    _cns_AllocCounters* counters = &cns->allocShards[_cns_alloc_threadSlot].categories[category];
+    if (delta < 0)
+    {
+        atomic_fetch_add_explicit(&counters->frees, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&counters->freeBytes, (uint64_t) size, memory_order_relaxed);
+        return;
+    }
+    int bucket = size ? 63 - __builtin_clzll((uint64_t) size) : 0;
+    if (bucket >= CNS_ALLOC_SIZE_BUCKETS)
+        bucket = CNS_ALLOC_SIZE_BUCKETS - 1;
+    atomic_fetch_add_explicit(&counters->sizes[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->allocBytes, (uint64_t) size, memory_order_relaxed);
+}
+
+#endif // CNS_ENABLE_ALLOC_PROFILE
+
+cns_Error
+_cns_runtime_allocIn_r(cns_Runtime* cns, int category, cns_Index size, void** out_ptr)
+{
+    if (!cns || !out_ptr)
+        return CNS_ERR_BADARG;
+
+    cns_Error err = CNS_OK;
+#ifdef CNS_ENABLE_ALLOC_PROFILE
+    if (size <= 0)
+    {
+        *out_ptr = 0;
+        return CNS_ERR_BADARG; // the allocator would fail it, after the header made it look fine
+    }
+    if (category < 0 || category >= CNS_ALLOC_CATEGORIES)
+        category = CNS_ALLOC_OTHER;
+    _cns_AllocHeader* header = cns->allocfn(cns->allocContext, size + (cns_Index) sizeof(_cns_AllocHeader), &err);
+    *out_ptr = header ? header + 1 : 0;
+    if (header)
+    {
+        header->size = size;
+        header->category = category;
+        _cns_alloc_count(cns, category, size, 1);
+    }
+#else
+    (void) category;
+    *out_ptr = cns->allocfn(cns->allocContext, size, &err);
+#endif
+    return err;
+}
+
+cns_Error
+cns_runtime_alloc_r(cns_Runtime* cns, cns_Index size, void** out_ptr)
+{
+    return _cns_runtime_allocIn_r(cns, CNS_ALLOC_OTHER, size, out_ptr);
+}
+
 void *
 cns_runtime_alloc(cns_Runtime* cns, cns_Index size)
 {
     if (!cns)
         return 0;
-    void * rv = cns->allocfn(cns->allocContext, size, &cns->lastError);
+    void * rv = 0;
+    _cns_lastError = cns_runtime_alloc_r(cns, size, &rv);
     return rv;
 }
 
+cns_Error
+cns_runtime_free_r(cns_Runtime* cns, void* ptr)
+{
+    if (!cns || ptr == cns)
+        return CNS_ERR_BADARG;
+
+    cns_Error err = CNS_OK;
+#ifdef CNS_ENABLE_ALLOC_PROFILE
+    if (ptr)
+    {
+        _cns_AllocHeader* header = (_cns_AllocHeader*) ptr - 1;
+        _cns_alloc_count(cns, header->category, header->size, -1);
+        ptr = header;
+    }
+#endif
+    cns->freefn(cns->allocContext, ptr, &err);
+    return err;
+}
+
 void
 cns_runtime_free(cns_Runtime* cns, void* ptr)
 {
     if (!cns)
         return;
+    _cns_lastError = cns_runtime_free_r(cns, ptr);
+}
 
-    if (ptr == cns)
+cns_Error
+_cns_runtime_reallocIn_r(cns_Runtime* cns, int category, void* ptr, cns_Index size, void** out_ptr)
+{
+    if (!cns || !out_ptr)
+        return CNS_ERR_BADARG;
+
+    cns_Error err = CNS_OK;
+#ifdef CNS_ENABLE_ALLOC_PROFILE
+    if (size <= 0)
     {
-        cns->lastError = CNS_ERR_BADARG;
-        return;
+        *out_ptr = 0;
+        return CNS_ERR_BADARG;
+    }
+    if (category < 0 || category >= CNS_ALLOC_CATEGORIES)
+        category = CNS_ALLOC_OTHER;
+    _cns_AllocHeader* old = ptr ? (_cns_AllocHeader*) ptr - 1 : 0;
+    int64_t oldSize = old ? old->size : 0;
+    int oldCategory = old ? old->category : 0;
+    _cns_AllocHeader* header = cns->reallocfn(cns->allocContext, old, size + (cns_Index) sizeof(_cns_AllocHeader), &err);
+    *out_ptr = header ? header + 1 : 0;
+    if (header)
+    {
+        if (old)
+            _cns_alloc_count(cns, oldCategory, oldSize, -1);
+        header->size = size;
+        header->category = category;
+        _cns_alloc_count(cns, category, size, 1);
     }
+#else
+    (void) category;
+    *out_ptr = cns->reallocfn(cns->allocContext, ptr, size, &err);
+#endif
+    return err;
+}
 
-    cns->freefn(cns->allocContext, ptr, &cns->lastError);
+cns_Error
+cns_runtime_realloc_r(cns_Runtime* cns, void* ptr, cns_Index size, void** out_ptr)
+{
+    return _cns_runtime_reallocIn_r(cns, CNS_ALLOC_OTHER, ptr, size, out_ptr);
 }
 
 void *
@@ -67,20 +247,102 @@ cns_runtime_realloc(cns_Runtime* cns, void* ptr, cns_Index size)
 {
     if (!cns)
         return 0;
-
-    void * rv = cns->reallocfn(cns->allocContext, ptr, size, &cns->lastError);
+    void * rv = 0;
+    _cns_lastError = cns_runtime_realloc_r(cns, ptr, size, &rv);
     return rv;
 }
 
+void
+cns_runtime_allocProfile(cns_Runtime* cns, cns_AllocProfile* out_profile)
+{
+    if (!cns || !out_profile)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    memset(out_profile, 0, sizeof(cns_AllocProfile));
+#ifdef CNS_ENABLE_ALLOC_PROFILE
+    out_profile->instrumented = CNS_YES;
+    for (int shard = 0; shard < _CNS_ALLOC_SHARDS; ++shard)
+    {
+        for (int c = 0; c < CNS_ALLOC_CATEGORIES; ++c)
+        {
+            _cns_AllocCounters* counters = &cns->allocShards[shard].categories[c];
+            cns_AllocCategoryProfile* out = &out_profile->categories[c];
+            for (int i = 0; i < CNS_ALLOC_SIZE_BUCKETS; ++i)
+            {
+                uint64_t count = atomic_load_explicit(&counters->sizes[i], memory_order_relaxed);
+                out->sizes[i] += count;
+                out->allocs += count;
+            }
+            out->frees += atomic_load_explicit(&counters->frees, memory_order_relaxed);
+            out->liveBytes += (int64_t) atomic_load_explicit(&counters->allocBytes, memory_order_relaxed);
+            out->liveBytes -= (int64_t) atomic_load_explicit(&counters->freeBytes, memory_order_relaxed);
+        }
+    }
+    for (int c = 0; c < CNS_ALLOC_CATEGORIES; ++c)
+        out_profile->categories[c].liveCount = (int64_t) (out_profile->categories[c].allocs - out_profile->categories[c].frees);
+#endif
+    cns_setlasterr(cns, CNS_OK);
+}
+
+const char *
+cns_alloccategory_name(int category)
+{
+    static const char * const names[CNS_ALLOC_CATEGORIES] = {
+        "other", "bytes", "storage item", "storage table", "storage", "lsm", "block cache", "io", "replication",
+    };
+    return category >= 0 && category < CNS_ALLOC_CATEGORIES ? names[category] : 0;
+}
+
+// appends like snprintf, keeping count of the length the whole text needs
+static void _cns_allocprofile_append(char* out, cns_Index size, cns_Index* length, const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    cns_Index room = *length < size ? size - *length : 0;
+    int n = vsnprintf(room ? out + *length : 0, (size_t) room, format, args);
+    va_end(args);
+    if (n > 0)
+        *length += n;
+}
+
+cns_Index
+cns_allocprofile_format(const cns_AllocProfile* profile, char* out, cns_Index size)
+{
+    if (!profile || size < 0 || (size && !out))
+        return 0;
+
+    cns_Index length = 0;
+    _cns_allocprofile_append(out, size, &length, "%-14s %12s %12s %14s %12s  %s\n",
+                             "category", "allocs", "frees", "live bytes", "live count", "sizes (log2 bytes: allocs)");
+    for (int c = 0; c < CNS_ALLOC_CATEGORIES; ++c)
+    {
+        const cns_AllocCategoryProfile* category = &profile->categories[c];
+        if (!category->allocs && !category->frees)
+            continue;
+        _cns_allocprofile_append(out, size, &length, "%-14s %12llu %12llu %14lld %12lld ", cns_alloccategory_name(c),
+                                 (unsigned long long) category->allocs, (unsigned long long) category->frees,
+                                 (long long) category->liveBytes, (long long) category->liveCount);
+        for (int i = 0; i < CNS_ALLOC_SIZE_BUCKETS; ++i)
+        {
+            if (category->sizes[i])
+                _cns_allocprofile_append(out, size, &length, " %d:%llu", i, (unsigned long long) category->sizes[i]);
+        }
+        _cns_allocprofile_append(out, size, &length, "\n");
+    }
+    return length;
+}
+
 cns_Error
 cns_lasterr(cns_Runtime* cns)
 {
-    return cns->lastError;
+    return _cns_lastError;
 }
 
 void
 cns_setlasterr(cns_Runtime* cns, cns_Error errcode)
 {
-    cns->lastError = errcode;
+    _cns_lastError = errcode;
 }
-
@@ -0,0 +1,32 @@
+#pragma once
+
+// Private parts of the runtime which other modules hang off it.
+
+#include <consensual/runtime.h>
+
+/** `cns_runtime_alloc_r` counting the memory under `category`, one of the CNS_ALLOC_ values.
+ */
+cns_Error
+_cns_runtime_allocIn_r(cns_Runtime* cns, int category, cns_Index size, void** out_ptr);
+
+/** `cns_runtime_realloc_r` counting the memory under `category`.
+ */
+cns_Error
+_cns_runtime_reallocIn_r(cns_Runtime* cns, int category, void* ptr, cns_Index size, void** out_ptr);
+
+typedef struct _cns_BlockCache _cns_BlockCache;
+
+/** The runtime's block cache; NULL until it is first given a capacity.
+ */
+_cns_BlockCache*
+_cns_runtime_blockCache(cns_Runtime* cns);
+
+/** Installs `cache` unless another thread installed one first. Returns the cache in use.
+ */
+_cns_BlockCache*
+_cns_runtime_installBlockCache(cns_Runtime* cns, _cns_BlockCache* cache);
+
+/** Frees the cache and the blocks in it; called by `cns_shutdown`.
+ */
+void
+_cns_blockcache_destroy(cns_Runtime* cns, _cns_BlockCache* cache);
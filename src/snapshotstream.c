@@ -0,0 +1,614 @@
+#include <consensual/snapshotstream.h>
+#include <consensual/bytes_impl.h>
+#include <consensual/kernels.h>
+#include <consensual/lz4.h>
+#include <consensual/wire.h>
+#include "storage_engine.h"
+#include "runtime_impl.h"
+
+#include <string.h> // memcpy, memmove
+
+// The stream is a prelude, then one record per key:
+//   prelude    magic, version, reserved, number of records; 8, 4, 4 and 8 bytes little endian
+//   record     varint key size, key, varint value size, varint uncompressed size (0 unless the value is LZ4
+//              compressed), value; the same records as in snapshot files
+// Chunks are offset, stream length, payload size, CRC-32C of all that and the payload; 8, 8, 4 and 4 bytes little
+// endian, then the payload.
+
+#define _CNS_STREAM_MAGIC 0x314d525453534e43ull // "CNSSTRM1"
+#define _CNS_STREAM_VERSION 1
+#define _CNS_STREAM_PRELUDESIZE 24
+#define _CNS_STREAM_MAXCHUNK (1 << 30)
+#define _CNS_STREAM_MAXWINDOW 65536
+
+// a position in the stream: the prelude while `record` is -1
+typedef struct _cns_SnapshotCursor
+{
+    uint64_t    offset;
+    cns_Index   record;
+    cns_Index   within;
+} _cns_SnapshotCursor;
+
+struct cns_SnapshotSender
+{
+    cns_Index               count;
+    cns_Bytes**             keys;
+    cns_Bytes**             values;
+    uint32_t*               rawLengths;
+    uint8_t                 prelude[_CNS_STREAM_PRELUDESIZE];
+    uint64_t                length;
+    cns_Index               chunkSize;
+    int                     window;
+    _cns_SnapshotCursor     cursor; // next byte to send
+    _cns_SnapshotCursor*    inFlight; // where each unacknowledged chunk starts, oldest first, `window` of them
+    int                     numInFlight;
+    uint64_t                acked;
+};
+
+struct cns_SnapshotReceiver
+{
+    cns_Storage*            storage; // NULL once installed
+    uint64_t                offset;
+    uint64_t                length; // 0 until the first chunk
+    uint8_t*                pending; // the start of a record whose end has not arrived
+    cns_Index               pendingLength;
+    cns_Index               pendingCapacity;
+    cns_Index               remaining; // records still to come, -1 before the prelude
+    cns_Error               failure; // once the stream does not decode, it never will
+};
+
+static void _cns_stream_put32(uint8_t* out, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        out[i] = (uint8_t) (value >> (8 * i));
+}
+
+static uint32_t _cns_stream_get32(const uint8_t* ptr)
+{
+    return (uint32_t) ptr[0] | (uint32_t) ptr[1] << 8 | (uint32_t) ptr[2] << 16 | (uint32_t) ptr[3] << 24;
+}
+
+static void _cns_stream_put64(uint8_t* out, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i)
+        out[i] = (uint8_t) (value >> (8 * i));
+}
+
+static uint64_t _cns_stream_get64(const uint8_t* ptr)
+{
+    return (uint64_t) _cns_stream_get32(ptr) | (uint64_t) _cns_stream_get32(ptr + 4) << 32;
+}
+
+// the varints in front of a record
+static cns_Index _cns_stream_recordHead(cns_SnapshotSender* sender, cns_Index record, uint8_t* out)
+{
+    cns_Index n = cns_wire_encodeVarint((uint64_t) cns_bytes_lengthUnchecked(sender->keys[record]), out);
+    n += cns_wire_encodeVarint((uint64_t) cns_bytes_lengthUnchecked(sender->values[record]), out + n);
+    n += cns_wire_encodeVarint(sender->rawLengths[record], out + n);
+    return n;
+}
+
+// copies `length` bytes at `from` of a Bytes object, going through the pieces of a concatenation
+static void _cns_stream_copyRange(cns_Runtime* cns, cns_Bytes* bytes, cns_Index from, uint8_t* out, cns_Index length)
+{
+    if (cns_bytes_isFlatUnchecked(bytes))
+    {
+        memcpy(out, (const uint8_t*) cns_bytes_ptrUnchecked(bytes) + from, (size_t) length);
+        return;
+    }
+    cns_BytesChunks chunks;
+    cns_bytes_chunksBeginUnchecked(bytes, &chunks);
+    const void * ptr = 0;
+    cns_Index size = 0;
+    while (length && cns_bytes_chunksNextUnchecked(&chunks, &ptr, &size))
+    {
+        if (from >= size)
+        {
+            from -= size;
+            continue;
+        }
+        cns_Index n = size - from < length ? size - from : length;
+        memcpy(out, (const uint8_t*) ptr + from, (size_t) n);
+        out += n;
+        length -= n;
+        from = 0;
+    }
+}
+
+// writes the stream from `cursor` into `out` until it has `capacity` bytes or the stream ends
+static void _cns_stream_fill(cns_Runtime* cns, cns_SnapshotSender* sender, _cns_SnapshotCursor* cursor, uint8_t* out, cns_Index capacity)
+{
+    while (capacity && cursor->offset < sender->length)
+    {
+        uint8_t head[3 * CNS_WIRE_MAXVARINT];
+        const uint8_t* piece = sender->prelude;
+        cns_Index pieceLength = _CNS_STREAM_PRELUDESIZE;
+        cns_Index pieceStart = 0;
+        cns_Bytes* bytes = 0;
+        cns_Index recordLength = _CNS_STREAM_PRELUDESIZE;
+        if (cursor->record >= 0)
+        {
+            // the record is its head, its key and its value; find the one the cursor is in
+            cns_Index headLength = _cns_stream_recordHead(sender, cursor->record, head);
+            cns_Index keyLength = cns_bytes_lengthUnchecked(sender->keys[cursor->record]);
+            recordLength = headLength + keyLength + cns_bytes_lengthUnchecked(sender->values[cursor->record]);
+            piece = head;
+            pieceLength = headLength;
+            if (cursor->within >= headLength + keyLength)
+            {
+                bytes = sender->values[cursor->record];
+                pieceStart = headLength + keyLength;
+                pieceLength = recordLength - pieceStart;
+            }
+            else if (cursor->within >= headLength)
+            {
+                bytes = sender->keys[cursor->record];
+                pieceStart = headLength;
+                pieceLength = keyLength;
+            }
+        }
+
+        cns_Index from = cursor->within - pieceStart;
+        cns_Index n = pieceLength - from < capacity ? pieceLength - from : capacity;
+        if (bytes)
+            _cns_stream_copyRange(cns, bytes, from, out, n);
+        else
+            memcpy(out, piece + from, (size_t) n);
+        out += n;
+        capacity -= n;
+        cursor->offset += (uint64_t) n;
+        cursor->within += n;
+        if (cursor->within == recordLength)
+        {
+            ++cursor->record;
+            cursor->within = 0;
+        }
+    }
+}
+
+static cns_Index _cns_stream_payloadLength(cns_SnapshotSender* sender, uint64_t offset)
+{
+    uint64_t left = sender->length - offset;
+    return left < (uint64_t) sender->chunkSize ? (cns_Index) left : sender->chunkSize;
+}
+
+typedef struct _cns_StreamCapture
+{
+    cns_Runtime*            cns;
+    cns_SnapshotSender*     sender;
+} _cns_StreamCapture;
+
+static void _cns_stream_capture(void* context, cns_Bytes* key, cns_Bytes* value, uint32_t rawLength)
+{
+    _cns_StreamCapture* capture = (_cns_StreamCapture*) context;
+    cns_SnapshotSender* sender = capture->sender;
+    cns_Index i = sender->count++;
+    cns_bytes_copy_r(capture->cns, key, &sender->keys[i]);
+    cns_bytes_copy_r(capture->cns, value, &sender->values[i]);
+    sender->rawLengths[i] = rawLength;
+
+    uint8_t head[3 * CNS_WIRE_MAXVARINT];
+    sender->length += (uint64_t) (_cns_stream_recordHead(sender, i, head) + cns_bytes_lengthUnchecked(key) + cns_bytes_lengthUnchecked(value));
+}
+
+cns_SnapshotSender*
+cns_snapshotsender_new(cns_Runtime* cns, cns_Storage* storage, cns_Index chunkSize, int window)
+{
+    if (!cns || !storage || chunkSize <= 0 || chunkSize > _CNS_STREAM_MAXCHUNK || window <= 0 || window > _CNS_STREAM_MAXWINDOW)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+    if (_cns_storage_engine(storage))
+    {
+        cns_setlasterr(cns, CNS_ERR_UNSUPPORTED);
+        return 0;
+    }
+
+    cns_Index count = cns_storage_count(cns, storage);
+    cns_SnapshotSender* sender = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_IO, sizeof(cns_SnapshotSender), (void**) &sender);
+    if (sender)
+    {
+        memset(sender, 0, sizeof(cns_SnapshotSender));
+        err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_IO, window * (cns_Index) sizeof(_cns_SnapshotCursor), (void**) &sender->inFlight);
+        // one more, so that an empty storage allocates something too
+        if (!err)
+            err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_IO, (count + 1) * (cns_Index) sizeof(cns_Bytes*), (void**) &sender->keys);
+        if (!err)
+            err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_IO, (count + 1) * (cns_Index) sizeof(cns_Bytes*), (void**) &sender->values);
+        if (!err)
+            err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_IO, (count + 1) * (cns_Index) sizeof(uint32_t), (void**) &sender->rawLengths);
+        if (err)
+        {
+            cns_snapshotsender_free(cns, sender);
+            cns_setlasterr(cns, err);
+            return 0;
+        }
+
+        sender->length = _CNS_STREAM_PRELUDESIZE;
+        _cns_StreamCapture capture = { cns, sender };
+        _cns_storage_forEachStored(storage, _cns_stream_capture, &capture);
+        _cns_stream_put64(sender->prelude, _CNS_STREAM_MAGIC);
+        _cns_stream_put32(sender->prelude + 8, _CNS_STREAM_VERSION);
+        _cns_stream_put32(sender->prelude + 12, 0);
+        _cns_stream_put64(sender->prelude + 16, (uint64_t) sender->count);
+        sender->chunkSize = chunkSize;
+        sender->window = window;
+        sender->cursor.record = -1;
+    }
+    cns_setlasterr(cns, err);
+    return sender;
+}
+
+void
+cns_snapshotsender_free(cns_Runtime* cns, cns_SnapshotSender* sender)
+{
+    if (!cns || !sender)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    for (cns_Index i = 0; i < sender->count; ++i)
+    {
+        cns_bytes_free_r(cns, sender->keys[i]);
+        cns_bytes_free_r(cns, sender->values[i]);
+    }
+    cns_runtime_free_r(cns, sender->keys);
+    cns_runtime_free_r(cns, sender->values);
+    cns_runtime_free_r(cns, sender->rawLengths);
+    cns_runtime_free_r(cns, sender->inFlight);
+    cns_runtime_free_r(cns, sender);
+    cns_setlasterr(cns, CNS_OK);
+}
+
+cns_Error
+cns_snapshotsender_next_r(cns_Runtime* cns, cns_SnapshotSender* sender, cns_Bytes** out_chunk)
+{
+    if (!cns || !sender || !out_chunk)
+        return CNS_ERR_BADARG;
+
+    *out_chunk = 0;
+    if (sender->numInFlight == sender->window || sender->cursor.offset == sender->length)
+        return CNS_OK;
+
+    cns_Index payloadLength = _cns_stream_payloadLength(sender, sender->cursor.offset);
+    _cns_BytesImpl* chunk = 0;
+    cns_Error err = _cns_bytes_alloc(cns, CNS_SNAPSHOT_CHUNKHEADER + payloadLength, &chunk);
+    if (!chunk)
+        return err;
+
+    uint8_t* data = (uint8_t*) chunk->data;
+    _cns_stream_put64(data, sender->cursor.offset);
+    _cns_stream_put64(data + 8, sender->length);
+    _cns_stream_put32(data + 16, (uint32_t) payloadLength);
+    sender->inFlight[sender->numInFlight++] = sender->cursor;
+    _cns_stream_fill(cns, sender, &sender->cursor, data + CNS_SNAPSHOT_CHUNKHEADER, payloadLength);
+    uint32_t crc = cns_kernels_crc32c(CNS_KERNEL_AUTO, 0, data, 20);
+    _cns_stream_put32(data + 20, cns_kernels_crc32c(CNS_KERNEL_AUTO, crc, data + CNS_SNAPSHOT_CHUNKHEADER, payloadLength));
+    *out_chunk = (cns_Bytes*) chunk;
+    return CNS_OK;
+}
+
+cns_Bytes*
+cns_snapshotsender_next(cns_Runtime* cns, cns_SnapshotSender* sender)
+{
+    cns_Bytes* rv = 0;
+    cns_setlasterr(cns, cns_snapshotsender_next_r(cns, sender, &rv));
+    return rv;
+}
+
+void
+cns_snapshotsender_ack(cns_Runtime* cns, cns_SnapshotSender* sender, uint64_t offset)
+{
+    if (!cns || !sender || offset > sender->cursor.offset)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+    if (offset <= sender->acked)
+    {
+        cns_setlasterr(cns, CNS_OK);
+        return;
+    }
+
+    sender->acked = offset;
+    int acked = 0;
+    while (acked < sender->numInFlight
+           && sender->inFlight[acked].offset + (uint64_t) _cns_stream_payloadLength(sender, sender->inFlight[acked].offset) <= offset)
+        ++acked;
+    sender->numInFlight -= acked;
+    memmove(sender->inFlight, sender->inFlight + acked, (size_t) sender->numInFlight * sizeof(_cns_SnapshotCursor));
+    cns_setlasterr(cns, CNS_OK);
+}
+
+void
+cns_snapshotsender_rewind(cns_Runtime* cns, cns_SnapshotSender* sender, uint64_t offset)
+{
+    if (!cns || !sender)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+    if (offset == sender->cursor.offset)
+    {
+        cns_setlasterr(cns, CNS_OK);
+        return;
+    }
+    for (int i = 0; i < sender->numInFlight; ++i)
+    {
+        if (sender->inFlight[i].offset == offset)
+        {
+            // the chunks from there on count as never sent
+            sender->cursor = sender->inFlight[i];
+            sender->numInFlight = i;
+            cns_setlasterr(cns, CNS_OK);
+            return;
+        }
+    }
+    cns_setlasterr(cns, CNS_ERR_BADARG);
+}
+
+cns_Bool
+cns_snapshotsender_done(cns_Runtime* cns, cns_SnapshotSender* sender)
+{
+    if (!cns || !sender)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return CNS_NO;
+    }
+    cns_setlasterr(cns, CNS_OK);
+    return sender->acked == sender->length;
+}
+
+uint64_t
+cns_snapshotsender_length(cns_Runtime* cns, cns_SnapshotSender* sender)
+{
+    if (!cns || !sender)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+    cns_setlasterr(cns, CNS_OK);
+    return sender->length;
+}
+
+cns_SnapshotReceiver*
+cns_snapshotreceiver_new(cns_Runtime* cns, cns_Storage_BytesHash32Fn byteshashfn)
+{
+    if (!cns)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+
+    cns_SnapshotReceiver* receiver = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_IO, sizeof(cns_SnapshotReceiver), (void**) &receiver);
+    if (receiver)
+    {
+        memset(receiver, 0, sizeof(cns_SnapshotReceiver));
+        receiver->remaining = -1;
+        receiver->storage = cns_storage_newMemoryStorage(cns, byteshashfn);
+        if (!receiver->storage)
+        {
+            err = cns_lasterr(cns);
+            cns_runtime_free_r(cns, receiver);
+            receiver = 0;
+        }
+    }
+    cns_setlasterr(cns, err);
+    return receiver;
+}
+
+void
+cns_snapshotreceiver_free(cns_Runtime* cns, cns_SnapshotReceiver* receiver)
+{
+    if (!cns || !receiver)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+    if (receiver->storage)
+        cns_storage_free(cns, receiver->storage);
+    cns_runtime_free_r(cns, receiver->pending);
+    cns_runtime_free_r(cns, receiver);
+    cns_setlasterr(cns, CNS_OK);
+}
+
+static cns_Bool _cns_stream_varint(const uint8_t** ptr, const uint8_t* end, uint64_t* out_value)
+{
+    cns_Index n = cns_wire_decodeVarint(*ptr, end - *ptr, out_value);
+    *ptr += n;
+    return n != 0;
+}
+
+// Stores the records which lie whole in [`ptr`, `end`); returns how many bytes they took. A record cut short waits for the
+// next chunk, unless the bytes it has already cannot be a record.
+static cns_Error _cns_stream_parse(cns_Runtime* cns, cns_SnapshotReceiver* receiver, const uint8_t* ptr, const uint8_t* end, cns_Index* out_consumed)
+{
+    const uint8_t* start = ptr;
+    *out_consumed = 0;
+    if (receiver->remaining < 0)
+    {
+        if (end - ptr < _CNS_STREAM_PRELUDESIZE)
+            return CNS_OK;
+        uint64_t count = _cns_stream_get64(ptr + 16);
+        if (_cns_stream_get64(ptr) != _CNS_STREAM_MAGIC || _cns_stream_get32(ptr + 8) != _CNS_STREAM_VERSION
+            || count > (uint64_t) receiver->length / 3)
+            return CNS_ERR_MALFORMED;
+        receiver->remaining = (cns_Index) count;
+        cns_storage_reserve_r(cns, receiver->storage, receiver->remaining); // only a hint
+        ptr += _CNS_STREAM_PRELUDESIZE;
+        *out_consumed = ptr - start;
+    }
+
+    while (receiver->remaining > 0 && ptr < end)
+    {
+        const uint8_t* p = ptr;
+        uint64_t keyLength = 0, valueLength = 0, rawLength = 0;
+        if (!_cns_stream_varint(&p, end, &keyLength) || !_cns_stream_varint(&p, end, &valueLength)
+            || !_cns_stream_varint(&p, end, &rawLength))
+        {
+            // a head takes three varints at most
+            return end - ptr >= 3 * CNS_WIRE_MAXVARINT ? CNS_ERR_MALFORMED : CNS_OK;
+        }
+        if (keyLength > receiver->length || valueLength > receiver->length || rawLength > CNS_LZ4_MAXINPUT)
+            return CNS_ERR_MALFORMED;
+        if ((uint64_t) (end - p) < keyLength + valueLength)
+            return CNS_OK;
+
+        cns_Bytes* key = 0;
+        cns_Bytes* value = 0;
+        cns_Error err = cns_bytes_new_r(cns, p, (cns_Index) keyLength, &key);
+        if (!err)
+            err = cns_bytes_new_r(cns, p + keyLength, (cns_Index) valueLength, &value);
+        if (!err)
+            err = _cns_storage_setStored(cns, receiver->storage, key, value, (uint32_t) rawLength);
+        if (key)
+            cns_bytes_free_r(cns, key);
+        if (value)
+            cns_bytes_free_r(cns, value);
+        if (err)
+            return err;
+
+        ptr = p + keyLength + valueLength;
+        *out_consumed = ptr - start;
+        --receiver->remaining;
+    }
+    return receiver->remaining || ptr == end ? CNS_OK : CNS_ERR_MALFORMED;
+}
+
+static cns_Error _cns_stream_keep(cns_Runtime* cns, cns_SnapshotReceiver* receiver, const uint8_t* ptr, cns_Index length)
+{
+    if (!length)
+        return CNS_OK;
+    if (receiver->pendingLength + length > receiver->pendingCapacity)
+    {
+        cns_Index capacity = receiver->pendingCapacity ? receiver->pendingCapacity : 4096;
+        while (capacity < receiver->pendingLength + length)
+            capacity *= 2;
+        void* pending = 0;
+        cns_Error err = _cns_runtime_reallocIn_r(cns, CNS_ALLOC_IO, receiver->pending, capacity, &pending);
+        if (!pending)
+            return err;
+        receiver->pending = (uint8_t*) pending;
+        receiver->pendingCapacity = capacity;
+    }
+    memcpy(receiver->pending + receiver->pendingLength, ptr, (size_t) length);
+    receiver->pendingLength += length;
+    return CNS_OK;
+}
+
+cns_Error
+cns_snapshotreceiver_put_r(cns_Runtime* cns, cns_SnapshotReceiver* receiver, cns_Bytes* chunk)
+{
+    if (!cns || !receiver || !chunk || !receiver->storage)
+        return CNS_ERR_BADARG;
+    if (receiver->failure)
+        return receiver->failure;
+
+    cns_Index chunkLength = cns_bytes_lengthUnchecked(chunk);
+    const uint8_t* data = (const uint8_t*) cns_bytes_ptrUnchecked(chunk);
+    if (!data)
+        return CNS_ERR_NOMEM;
+    if (chunkLength < CNS_SNAPSHOT_CHUNKHEADER)
+        return CNS_ERR_MALFORMED;
+    uint64_t offset = _cns_stream_get64(data);
+    uint64_t length = _cns_stream_get64(data + 8);
+    cns_Index payloadLength = (cns_Index) _cns_stream_get32(data + 16);
+    const uint8_t* payload = data + CNS_SNAPSHOT_CHUNKHEADER;
+    if (payloadLength != chunkLength - CNS_SNAPSHOT_CHUNKHEADER
+        || _cns_stream_get32(data + 20) != cns_kernels_crc32c(CNS_KERNEL_AUTO, cns_kernels_crc32c(CNS_KERNEL_AUTO, 0, data, 20), payload, payloadLength))
+        return CNS_ERR_MALFORMED;
+
+    // intact but not the one expected: a duplicate, or one after a gap the sender will go back to fill
+    if (offset != receiver->offset)
+        return CNS_OK;
+    if ((receiver->length && length != receiver->length) || length < _CNS_STREAM_PRELUDESIZE || length - offset < (uint64_t) payloadLength)
+        return receiver->failure = CNS_ERR_MALFORMED;
+    receiver->length = length;
+
+    // records are taken straight from the chunk; only a record cut at its end is kept, until the rest arrives
+    cns_Index consumed = 0;
+    cns_Error err = CNS_OK;
+    if (receiver->pendingLength)
+    {
+        err = _cns_stream_keep(cns, receiver, payload, payloadLength);
+        if (!err)
+            err = _cns_stream_parse(cns, receiver, receiver->pending, receiver->pending + receiver->pendingLength, &consumed);
+        if (!err)
+        {
+            receiver->pendingLength -= consumed;
+            memmove(receiver->pending, receiver->pending + consumed, (size_t) receiver->pendingLength);
+        }
+    }
+    else
+    {
+        err = _cns_stream_parse(cns, receiver, payload, payload + payloadLength, &consumed);
+        if (!err)
+            err = _cns_stream_keep(cns, receiver, payload + consumed, payloadLength - consumed);
+    }
+    if (!err)
+    {
+        receiver->offset += (uint64_t) payloadLength;
+        if (receiver->offset == receiver->length && (receiver->remaining || receiver->pendingLength))
+            err = CNS_ERR_MALFORMED;
+    }
+    // records may have been stored already, so the chunk cannot be taken again
+    if (err)
+        receiver->failure = err;
+    return err;
+}
+
+void
+cns_snapshotreceiver_put(cns_Runtime* cns, cns_SnapshotReceiver* receiver, cns_Bytes* chunk)
+{
+    cns_setlasterr(cns, cns_snapshotreceiver_put_r(cns, receiver, chunk));
+}
+
+uint64_t
+cns_snapshotreceiver_offset(cns_Runtime* cns, cns_SnapshotReceiver* receiver)
+{
+    if (!cns || !receiver)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+    cns_setlasterr(cns, CNS_OK);
+    return receiver->offset;
+}
+
+cns_Bool
+cns_snapshotreceiver_complete(cns_Runtime* cns, cns_SnapshotReceiver* receiver)
+{
+    if (!cns || !receiver)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return CNS_NO;
+    }
+    cns_setlasterr(cns, CNS_OK);
+    return receiver->length && receiver->offset == receiver->length && !receiver->failure;
+}
+
+cns_Error
+cns_snapshotreceiver_install_r(cns_Runtime* cns, cns_SnapshotReceiver* receiver, cns_Storage* storage)
+{
+    if (!cns || !receiver || !storage || !receiver->storage)
+        return CNS_ERR_BADARG;
+    if (!receiver->length || receiver->offset != receiver->length || receiver->failure)
+        return CNS_ERR_BADARG;
+
+    cns_Error err = _cns_storage_swapItems(storage, receiver->storage);
+    if (err)
+        return err;
+    cns_storage_free_r(cns, receiver->storage);
+    receiver->storage = 0;
+    return CNS_OK;
+}
+
+void
+cns_snapshotreceiver_install(cns_Runtime* cns, cns_SnapshotReceiver* receiver, cns_Storage* storage)
+{
+    cns_setlasterr(cns, cns_snapshotreceiver_install_r(cns, receiver, storage));
+}
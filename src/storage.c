@@ -1,7 +1,25 @@
 #include <consensual/storage.h>
+#include <consensual/bytes_impl.h>
+#include <consensual/kernels.h>
+#include <consensual/lz4.h>
+#include <consensual/wire.h>
+#include "storage_engine.h"
+#include "runtime_impl.h"
 
-#include <string.h> // memset
+#include <string.h> // memset, memcmp
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef CNS_ENABLE_STATS
+#include <stdatomic.h>
+#include <time.h>
+#define _CNS_STATS(...) __VA_ARGS__
+#else
+#define _CNS_STATS(...)
+#endif
 
 // http://www.burtleburtle.net/bob/hash/doobs.html
 // Public Domain
@@ -21,9 +39,8 @@ uint32_t jenkins_one_at_a_time_hash(const uint8_t* key, size_t len)
     return hash;
 }
 
-// I have no idea what quality it has, just needed something working so here it is
 uint32_t
-cns_storage_defaultBytesHash32(cns_Runtime* cns, cns_Bytes* bytes)
+cns_storage_jenkinsBytesHash32(cns_Runtime* cns, cns_Bytes* bytes)
 {
     if (!cns || !bytes)
     {
@@ -31,13 +48,52 @@ cns_storage_defaultBytesHash32(cns_Runtime* cns, cns_Bytes* bytes)
         return 0;
     }
 
-    const uint8_t* p = cns_bytes_ptr(cns, bytes);
+    const uint8_t* p = cns_bytes_ptrUnchecked(bytes);
     assert(p != 0);
     if (!p)
         return 0;
 
-    cns_Index length = cns_bytes_length(cns, bytes);
-    return jenkins_one_at_a_time_hash(p, length);
+    return jenkins_one_at_a_time_hash(p, cns_bytes_lengthUnchecked(bytes));
+}
+
+// CRC-32C runs at several bytes per cycle with the SSE4.2 instruction; being linear, it is
+// followed by the MurmurHash3 finalizer so that every bit of the result depends on every input bit
+static uint32_t _cns_storage_finalizeHash(uint32_t hash)
+{
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static uint32_t _cns_storage_hashMemory(const void * ptr, cns_Index length)
+{
+    return _cns_storage_finalizeHash(cns_kernels_crc32c(CNS_KERNEL_AUTO, 0, ptr, length));
+}
+
+uint32_t
+cns_storage_defaultBytesHash32(cns_Runtime* cns, cns_Bytes* bytes)
+{
+    if (!cns || !bytes)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+
+    if (cns_bytes_isFlatUnchecked(bytes))
+        return _cns_storage_hashMemory(cns_bytes_ptrUnchecked(bytes), cns_bytes_lengthUnchecked(bytes));
+
+    // CRC-32C chains over pieces, so a concatenation hashes like its flat copy without being joined
+    uint32_t crc = 0;
+    cns_BytesChunks chunks;
+    cns_bytes_chunksBeginUnchecked(bytes, &chunks);
+    const void * ptr = 0;
+    cns_Index length = 0;
+    while (cns_bytes_chunksNextUnchecked(&chunks, &ptr, &length))
+        crc = cns_kernels_crc32c(CNS_KERNEL_AUTO, crc, ptr, length);
+    return _cns_storage_finalizeHash(crc);
 }
 
 typedef struct _cns_Storage_BucketItem
@@ -45,266 +101,2883 @@ typedef struct _cns_Storage_BucketItem
     cns_Bytes* key;
     cns_Bytes* value;
     struct _cns_Storage_BucketItem* next;
+    uint32_t hash; // full hash of the key, so resizing never hashes keys again
+    uint32_t rawLength; // nonzero if `value` is the LZ4 compression of this many bytes
 } _cns_Storage_BucketItem;
 
+// a value superseded while a view was pinned, kept until no pinned view sees it
+typedef struct _cns_Storage_Version
+{
+    cns_Bytes* key;
+    cns_Bytes* value; // NULL if the key had no value
+    struct _cns_Storage_Version* older; // of the same key
+    struct _cns_Storage_Version* newer;
+    struct _cns_Storage_Version* next; // in the bucket, which only links the newest version of each key
+    struct _cns_Storage_Version* nextSuperseded; // in the order they were superseded
+    uint64_t sequence; // the commit which superseded the value
+    uint32_t hash;
+    uint32_t rawLength;
+} _cns_Storage_Version;
+
+struct cns_StorageView
+{
+    cns_Storage* storage;
+    uint64_t sequence;
+    cns_StorageView* older;
+    cns_StorageView* newer;
+};
+
+typedef struct _cns_StorageBatchWrite
+{
+    cns_Bytes* key;
+    cns_Bytes* value; // NULL to delete the key
+} _cns_StorageBatchWrite;
+
+struct cns_StorageBatch
+{
+    _cns_StorageBatchWrite* writes;
+    cns_Index count;
+    cns_Index capacity;
+};
+
+// a slot of the interning table, which holds one reference to each distinct byte string
+typedef struct _cns_Storage_InternSlot
+{
+    cns_Bytes* bytes; // NULL for an empty slot
+    uint32_t hash; // `_cns_storage_hashMemory` of the content
+} _cns_Storage_InternSlot;
+
+// a slot of the decompressed value cache; it is keyed by the stored block, whose address cannot be reused for other
+// content while the slot holds a reference to it
+typedef struct _cns_Storage_DecompressSlot
+{
+    cns_Bytes* compressed; // NULL for an empty slot
+    cns_Bytes* value;
+} _cns_Storage_DecompressSlot;
+
+typedef struct _cns_Storage_DecompressCache
+{
+    pthread_mutex_t mutex; // gets may run on several threads at once
+    int log2numslots;
+    _cns_Storage_DecompressSlot slots[];
+} _cns_Storage_DecompressCache;
+
+#ifdef CNS_ENABLE_STATS
+
+// counters are spread over shards picked by thread, so that threads reading one storage do not fight over a cache line
+#define _CNS_STATS_SHARDS 8
+
+typedef struct _cns_StorageCounters
+{
+    _Atomic uint64_t    operations[3];
+    _Atomic uint64_t    latency[3][CNS_STATS_LATENCY_BUCKETS];
+    _Atomic uint64_t    probes[CNS_STATS_PROBE_BUCKETS];
+    _Atomic uint64_t    resizes;
+    _Atomic uint64_t    resizeNanoseconds;
+    _Atomic uint64_t    allocFailures;
+    _Atomic uint64_t    compressedGets;
+    _Atomic uint64_t    decompressCacheHits;
+    _Atomic uint64_t    decompressNanoseconds;
+} _cns_StorageCounters;
+
+// rounded up to whole cache lines
+typedef union _cns_StorageCountersShard
+{
+    _cns_StorageCounters    counters;
+    uint8_t                 padding[(sizeof(_cns_StorageCounters) + 63) / 64 * 64];
+} _cns_StorageCountersShard;
+
+enum { _CNS_OP_GET, _CNS_OP_SET, _CNS_OP_DELETE };
+
+static atomic_int _cns_stats_nextThreadSlot;
+static _Thread_local int _cns_stats_threadSlot = -1;
+
+#endif // CNS_ENABLE_STATS
+
 struct cns_Storage
 {
+    const _cns_StorageEngine* engine; // NULL for the memory storage, which everything below describes
+    void* engineState;
     cns_Storage_BytesHash32Fn byteshashfn;
     int log2numbuckets;
     int count;
     _cns_Storage_BucketItem** buckets;
+    unsigned internFlags;
+    int log2numinternslots;
+    cns_Index interncount;
+    _cns_Storage_InternSlot* internslots; // open addressing with linear probing, allocated on first use
+    cns_Index compressThreshold; // 0 when new values are stored as given
+    _cns_Storage_DecompressCache* decompressCache; // direct mapped, NULL unless asked for
+    uint64_t sequence; // commits so far
+    cns_StorageView* oldestView; // pinned views, in the order of their sequence
+    cns_StorageView* newestView;
+    int log2numversionbuckets;
+    cns_Index versionCount;
+    _cns_Storage_Version** versionBuckets; // allocated while versions are kept
+    _cns_Storage_Version* oldestVersion;
+    _cns_Storage_Version* newestVersion;
+    _cns_Storage_BucketItem* spareItems; // set aside by a batch, so that applying it cannot fail halfway
+    _cns_Storage_Version* spareVersions;
+    cns_Watch* watches;
+    cns_Trace* trace; // of any engine
+    cns_HotKeys* hotKeys;
+#ifdef CNS_ENABLE_STATS
+    void* countersMemory;
+    _cns_StorageCountersShard* counters; // `countersMemory` aligned to a cache line
+#endif
 };
 
-static _cns_Storage_BucketItem* _cns_storage_itemForKey(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, _cns_Storage_BucketItem*** bucket, _cns_Storage_BucketItem** previousitem)
+#ifdef CNS_ENABLE_STATS
+
+static _cns_StorageCounters* _cns_stats_counters(cns_Storage* storage)
 {
-    uint32_t keyhash = storage->byteshashfn(cns, key);
-    keyhash &= (1 << storage->log2numbuckets) - 1;
+    if (_cns_stats_threadSlot < 0)
+        _cns_stats_threadSlot = atomic_fetch_add_explicit(&_cns_stats_nextThreadSlot, 1, memory_order_relaxed) % _CNS_STATS_SHARDS;
+    return &storage->counters[_cns_stats_threadSlot].counters;
+}
+
+static void _cns_stats_add(_Atomic uint64_t* counter, uint64_t value)
+{
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+static uint64_t _cns_stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+// index of the power-of-two bucket holding `value`
+static int _cns_stats_log2Bucket(uint64_t value, int numBuckets)
+{
+    int bucket = value ? 63 - __builtin_clzll(value) : 0;
+    return bucket < numBuckets ? bucket : numBuckets - 1;
+}
+
+static void _cns_stats_operation(cns_Storage* storage, int op, uint64_t startTime)
+{
+    _cns_StorageCounters* counters = _cns_stats_counters(storage);
+    _cns_stats_add(&counters->operations[op], 1);
+    _cns_stats_add(&counters->latency[op][_cns_stats_log2Bucket(_cns_stats_now() - startTime, CNS_STATS_LATENCY_BUCKETS)], 1);
+}
+
+#endif // CNS_ENABLE_STATS
+
+static _cns_Storage_BucketItem* _cns_storage_itemForKey(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, uint32_t keyhash, _cns_Storage_BucketItem*** bucket, _cns_Storage_BucketItem** previousitem)
+{
+    uint32_t index = keyhash & ((1 << storage->log2numbuckets) - 1);
     if (bucket)
-        *bucket = &storage->buckets[keyhash];
+        *bucket = &storage->buckets[index];
 
-    _cns_Storage_BucketItem* first = storage->buckets[keyhash];
-    _cns_Storage_BucketItem* item = first;
+    _cns_Storage_BucketItem* item = storage->buckets[index];
     if (previousitem)
         *previousitem = 0;
-    while (item && !cns_bytes_equal(cns, item->key, key))
+    _CNS_STATS(int probes = 0;)
+    // keys in the table and the key passed in are validated by the public entry points
+    while (item && !(item->hash == keyhash && cns_bytes_equalUnchecked(item->key, key)))
     {
         if (previousitem)
             *previousitem = item;
         item = item->next;
+        _CNS_STATS(++probes;)
     }
+    _CNS_STATS(_cns_stats_add(&_cns_stats_counters(storage)->probes[probes < CNS_STATS_PROBE_BUCKETS ? probes : CNS_STATS_PROBE_BUCKETS - 1], 1);)
     return item;
 }
 
 static void _cns_item_free(cns_Runtime* cns, _cns_Storage_BucketItem* item)
 {
-    cns_bytes_free(cns, item->key);
-    cns_bytes_free(cns, item->value);
-    cns_runtime_free(cns, item);
+    cns_bytes_free_r(cns, item->key);
+    cns_bytes_free_r(cns, item->value);
+    cns_runtime_free_r(cns, item);
 }
 
+// items are relinked rather than copied, so pointers to them stay valid
 static cns_Bool _cns_storage_changeCapacityBase(cns_Runtime* cns, cns_Storage* storage, int newCapacityBase)
 {
     _cns_Storage_BucketItem** old_buckets = storage->buckets;
-    int old_count = storage->count;
     int old_base = storage->log2numbuckets;
+    _CNS_STATS(uint64_t startTime = _cns_stats_now();)
 
-    storage->log2numbuckets = newCapacityBase;
     cns_Index bucketmemsize = (1 << newCapacityBase) * sizeof(_cns_Storage_BucketItem*);
-    storage->buckets = (_cns_Storage_BucketItem**) cns_runtime_alloc(cns, bucketmemsize);
-    if (storage->buckets)
+    _cns_Storage_BucketItem** new_buckets = 0;
+    _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE_TABLE, bucketmemsize, (void**) &new_buckets);
+    if (!new_buckets)
     {
-        storage->count = 0;
-        memset(storage->buckets, 0, bucketmemsize);
+        // failing to allocate more memory is not fatal here, we can proceed with the old buckets
+        _CNS_STATS(_cns_stats_add(&_cns_stats_counters(storage)->allocFailures, 1);)
+        return CNS_NO;
+    }
 
-        // copy items to the new location
-        for (int i = 0; i < (1 << old_base); ++i)
+    memset(new_buckets, 0, bucketmemsize);
+    uint32_t mask = (1 << newCapacityBase) - 1;
+    for (int i = 0; i < (1 << old_base); ++i)
+    {
+        _cns_Storage_BucketItem* item = old_buckets[i];
+        while (item)
         {
-            _cns_Storage_BucketItem* item = old_buckets[i];
-            while (item)
-            {
-                _cns_Storage_BucketItem* next = item->next;
-                cns_storage_set(cns, storage, item->key, item->value);
-                item = next;
-            }
+            _cns_Storage_BucketItem* next = item->next;
+            item->next = new_buckets[item->hash & mask];
+            new_buckets[item->hash & mask] = item;
+            item = next;
         }
+    }
+    storage->buckets = new_buckets;
+    storage->log2numbuckets = newCapacityBase;
+    cns_runtime_free_r(cns, old_buckets);
+
+    _CNS_STATS(_cns_StorageCounters* counters = _cns_stats_counters(storage);)
+    _CNS_STATS(_cns_stats_add(&counters->resizes, 1);)
+    _CNS_STATS(_cns_stats_add(&counters->resizeNanoseconds, _cns_stats_now() - startTime);)
+    return CNS_YES;
+}
+
+// Interning. Each distinct content is kept once in the table; the storage swaps what it is given for the table's copy.
+// The table owns a reference to each copy and drops those nobody else holds when it is about to grow or the storage
+// shrinks, so the storage does not have to find table entries whenever it releases a key or a value.
+
+static cns_Bytes* _cns_storage_internFind(cns_Storage* storage, const void * ptr, cns_Index length, uint32_t hash)
+{
+    if (!storage->internslots)
+        return 0;
+
+    uint32_t mask = (1u << storage->log2numinternslots) - 1;
+    for (uint32_t i = hash & mask; storage->internslots[i].bytes; i = (i + 1) & mask)
+    {
+        cns_Bytes* bytes = storage->internslots[i].bytes;
+        if (storage->internslots[i].hash == hash && cns_bytes_lengthUnchecked(bytes) == length
+            && !memcmp(cns_bytes_ptrUnchecked(bytes), ptr, length))
+            return bytes;
+    }
+    return 0;
+}
 
-        assert(storage->count == old_count);
+static void _cns_storage_internPlace(_cns_Storage_InternSlot* slots, int log2numslots, cns_Bytes* bytes, uint32_t hash)
+{
+    uint32_t mask = (1u << log2numslots) - 1;
+    uint32_t i = hash & mask;
+    while (slots[i].bytes)
+        i = (i + 1) & mask;
+    slots[i].bytes = bytes;
+    slots[i].hash = hash;
+}
 
-        // free old items
-        for (int i = 0; i < (1 << old_base); ++i)
+// backward shift deletion, no tombstones are left behind
+static void _cns_storage_internRemoveAt(cns_Storage* storage, uint32_t hole)
+{
+    _cns_Storage_InternSlot* slots = storage->internslots;
+    uint32_t mask = (1u << storage->log2numinternslots) - 1;
+    for (uint32_t i = (hole + 1) & mask; slots[i].bytes; i = (i + 1) & mask)
+    {
+        // an entry can fill the hole unless its home slot lies between the hole and itself
+        uint32_t home = slots[i].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask))
         {
-            _cns_Storage_BucketItem* item = old_buckets[i];
-            while (item)
-            {
-                _cns_Storage_BucketItem* next = item->next;
-                _cns_item_free(cns, item);
-                item = next;
-            }
+            slots[hole] = slots[i];
+            hole = i;
         }
-        cns_runtime_free(cns, old_buckets);
     }
-    else
+    slots[hole].bytes = 0;
+    --storage->interncount;
+}
+
+// drops entries referenced by nobody but the table
+static void _cns_storage_internSweep(cns_Runtime* cns, cns_Storage* storage)
+{
+    if (!storage->internslots)
+        return;
+
+    uint32_t numslots = 1u << storage->log2numinternslots;
+    for (uint32_t i = 0; i < numslots; )
     {
-        // failing to allocate more memory is not fatal here, we can proceed with the old buckets
-        storage->buckets = old_buckets;
-        storage->log2numbuckets = old_base;
-        return CNS_NO;
+        _cns_BytesImpl* impl = (_cns_BytesImpl*) storage->internslots[i].bytes;
+        if (impl && atomic_load_explicit(&impl->referenceCount, memory_order_acquire) == 1)
+        {
+            // removing shifts a later entry into this slot, so look at it again
+            _cns_storage_internRemoveAt(storage, i);
+            cns_bytes_free_r(cns, (cns_Bytes*) impl);
+        }
+        else
+            ++i;
     }
-    return CNS_YES;
 }
 
-cns_Storage*
-cns_storage_newMemoryStorage(cns_Runtime* cns, cns_Storage_BytesHash32Fn byteshashfn)
+static void _cns_storage_internClear(cns_Runtime* cns, cns_Storage* storage)
 {
-    if (!cns)
+    if (!storage->internslots)
+        return;
+
+    for (uint32_t i = 0; i < (1u << storage->log2numinternslots); ++i)
     {
-        cns_setlasterr(cns, CNS_ERR_BADARG);
-        return 0;
+        if (storage->internslots[i].bytes)
+            cns_bytes_free_r(cns, storage->internslots[i].bytes);
     }
+    cns_runtime_free_r(cns, storage->internslots);
+    storage->internslots = 0;
+    storage->log2numinternslots = 0;
+    storage->interncount = 0;
+}
 
-    cns_Storage* rv = (cns_Storage*) cns_runtime_alloc(cns, sizeof(cns_Storage));
-    if (rv)
+// takes ownership of the table's reference to `bytes`, which must not be in the table yet
+static cns_Bool _cns_storage_internAdd(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* bytes, uint32_t hash)
+{
+    cns_Index numslots = storage->internslots ? (cns_Index) 1 << storage->log2numinternslots : 0;
+    if (4 * (storage->interncount + 1) > 3 * numslots)
     {
-        rv->byteshashfn = (byteshashfn ? byteshashfn : cns_storage_defaultBytesHash32);
-        rv->log2numbuckets = 4; // start with 16 buckets
-        cns_Index bucketmemsize = (1 << rv->log2numbuckets) * sizeof(_cns_Storage_BucketItem*);
-        rv->buckets = (_cns_Storage_BucketItem**) cns_runtime_alloc(cns, bucketmemsize);
-        if (!rv->buckets)
+        _cns_storage_internSweep(cns, storage);
+
+        // grow unless sweeping freed enough room to postpone the next sweep for a while
+        if (2 * (storage->interncount + 1) > numslots)
         {
-            cns_Error err = cns_lasterr(cns);
-            cns_runtime_free(cns, rv);
-            cns_setlasterr(cns, err);
-            return 0;
+            int base = numslots ? storage->log2numinternslots + 1 : 6;
+            _cns_Storage_InternSlot* slots = 0;
+            _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE_TABLE, ((cns_Index) 1 << base) * sizeof(_cns_Storage_InternSlot), (void**) &slots);
+            if (!slots)
+            {
+                _CNS_STATS(_cns_stats_add(&_cns_stats_counters(storage)->allocFailures, 1);)
+                if (4 * (storage->interncount + 1) > 3 * numslots)
+                    return CNS_NO;
+            }
+            else
+            {
+                memset(slots, 0, ((cns_Index) 1 << base) * sizeof(_cns_Storage_InternSlot));
+                for (cns_Index i = 0; i < numslots; ++i)
+                {
+                    if (storage->internslots[i].bytes)
+                        _cns_storage_internPlace(slots, base, storage->internslots[i].bytes, storage->internslots[i].hash);
+                }
+                if (storage->internslots)
+                    cns_runtime_free_r(cns, storage->internslots);
+                storage->internslots = slots;
+                storage->log2numinternslots = base;
+            }
         }
-        rv->count = 0;
-        memset(rv->buckets, 0, bucketmemsize);
-        cns_setlasterr(cns, CNS_OK);
     }
-    return rv;
+
+    _cns_storage_internPlace(storage->internslots, storage->log2numinternslots, bytes, hash);
+    ++storage->interncount;
+    return CNS_YES;
 }
 
-void
-cns_storage_free(cns_Runtime* cns, cns_Storage* storage)
+// trades the reference passed in for one to the interned copy of the same content; on failure it is returned as is
+static cns_Bytes* _cns_storage_intern(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* bytes, const uint32_t* knownhash)
 {
-    if (!cns || !storage)
+    const void * ptr = cns_bytes_ptrUnchecked(bytes);
+    cns_Index length = cns_bytes_lengthUnchecked(bytes);
+    uint32_t hash = knownhash ? *knownhash : _cns_storage_hashMemory(ptr, length);
+
+    cns_Bytes* interned = _cns_storage_internFind(storage, ptr, length, hash);
+    if (interned)
     {
-        cns_setlasterr(cns, CNS_ERR_BADARG);
-        return;
+        cns_bytes_copy_r(cns, interned, &interned);
+        cns_bytes_free_r(cns, bytes);
+        return interned;
     }
 
-    for (int i = 0; i < (1 << storage->log2numbuckets); ++i)
+    // a slice would pin the whole block it points into, so the table keeps a compact copy instead; same for the pieces
+    // of a concatenation
+    if (((_cns_BytesImpl*) bytes)->parent || !cns_bytes_isFlatUnchecked(bytes))
     {
-        _cns_Storage_BucketItem* item = storage->buckets[i];
-        while (item)
-        {
-            _cns_Storage_BucketItem* next = item->next;
-            _cns_item_free(cns, item);
-            item = next;
-        }
+        if (cns_bytes_new_r(cns, ptr, length, &interned))
+            return bytes;
     }
-    cns_runtime_free(cns, storage->buckets);
-    cns_runtime_free(cns, storage);
-    cns_setlasterr(cns, CNS_OK);
+    else
+        cns_bytes_copy_r(cns, bytes, &interned);
+
+    if (!_cns_storage_internAdd(cns, storage, interned, hash))
+    {
+        cns_bytes_free_r(cns, interned);
+        return bytes;
+    }
+    if (interned != bytes)
+    {
+        cns_bytes_copy_r(cns, interned, &interned);
+        cns_bytes_free_r(cns, bytes);
+    }
+    return interned;
 }
 
-void
-cns_storage_set(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bytes* value)
+// Replaces `*value` by its compression if the storage compresses values that long and it saves at least an eighth.
+// Returns the original length if it did, 0 otherwise. Compressing only saves memory, so running out of it keeps the value
+// as it is.
+static uint32_t _cns_storage_compress(cns_Runtime* cns, cns_Storage* storage, cns_Bytes** value)
 {
-    if (!cns || !storage || !key || !value)
+    cns_Index length = cns_bytes_lengthUnchecked(*value);
+    if (!storage->compressThreshold || length < storage->compressThreshold || length > CNS_LZ4_MAXINPUT)
+        return 0;
+    const void * ptr = cns_bytes_ptrUnchecked(*value);
+    void* buffer = 0;
+    cns_Index capacity = length - length / 8;
+    if (ptr && capacity)
+        _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, capacity, &buffer);
+    if (!buffer)
+        return 0;
+
+    cns_Index compressedLength = cns_lz4_compress(ptr, length, buffer, capacity);
+    cns_Bytes* compressed = 0;
+    if (compressedLength)
+        cns_bytes_new_r(cns, buffer, compressedLength, &compressed);
+    cns_runtime_free_r(cns, buffer);
+    if (!compressed)
+        return 0;
+    cns_bytes_free_r(cns, *value);
+    *value = compressed;
+    return (uint32_t) length;
+}
+
+static cns_Error _cns_storage_decompress(cns_Runtime* cns, cns_Bytes* value, uint32_t rawLength, cns_Bytes** out_value)
+{
+    _cns_BytesImpl* impl = 0;
+    cns_Error err = _cns_bytes_alloc(cns, rawLength, &impl);
+    if (!impl)
+        return err;
+    cns_Index length = cns_lz4_decompress(cns_bytes_ptrUnchecked(value), cns_bytes_lengthUnchecked(value), (void*) impl->data, rawLength);
+    if (length != (cns_Index) rawLength)
     {
-        cns_setlasterr(cns, CNS_ERR_BADARG);
-        return;
+        cns_bytes_free_r(cns, (cns_Bytes*) impl);
+        return CNS_ERR_MALFORMED;
     }
+    *out_value = (cns_Bytes*) impl;
+    return CNS_OK;
+}
 
-    _cns_Storage_BucketItem** bucket = 0;
-    _cns_Storage_BucketItem* item = _cns_storage_itemForKey(cns, storage, key, &bucket, 0);
-    _cns_Storage_BucketItem* first = *bucket;
+static _cns_Storage_DecompressSlot* _cns_storage_decompressSlot(_cns_Storage_DecompressCache* cache, cns_Bytes* compressed)
+{
+    uint64_t h = ((uint64_t) (uintptr_t) compressed >> 4) * 0x9e3779b97f4a7c15ULL;
+    return &cache->slots[(h >> 32) & (((uint64_t) 1 << cache->log2numslots) - 1)];
+}
 
-    if (item)
+// the value of a compressed item as a new reference, from the decompressed value cache if it has it
+static cns_Error _cns_storage_getCompressed(cns_Runtime* cns, cns_Storage* storage, _cns_Storage_BucketItem* item, cns_Bytes** out_value)
+{
+    _CNS_STATS(_cns_StorageCounters* counters = _cns_stats_counters(storage);)
+    _CNS_STATS(_cns_stats_add(&counters->compressedGets, 1);)
+    _cns_Storage_DecompressCache* cache = storage->decompressCache;
+    _cns_Storage_DecompressSlot* slot = 0;
+    if (cache)
     {
-        cns_Bytes* discardedValue = item->value;
-        item->value = cns_bytes_copy(cns, value);
-        if (!item->value)
+        slot = _cns_storage_decompressSlot(cache, item->value);
+        pthread_mutex_lock(&cache->mutex);
+        cns_Bool hit = (slot->compressed == item->value);
+        if (hit)
+            cns_bytes_copy_r(cns, slot->value, out_value);
+        pthread_mutex_unlock(&cache->mutex);
+        if (hit)
         {
-            // out of memory?
-            item->value = discardedValue;
-            return;
+            _CNS_STATS(_cns_stats_add(&counters->decompressCacheHits, 1);)
+            return CNS_OK;
         }
-        cns_bytes_free(cns, discardedValue);
     }
-    else
+
+    _CNS_STATS(uint64_t startTime = _cns_stats_now();)
+    cns_Error err = _cns_storage_decompress(cns, item->value, item->rawLength, out_value);
+    _CNS_STATS(_cns_stats_add(&counters->decompressNanoseconds, _cns_stats_now() - startTime);)
+    if (err || !cache)
+        return err;
+
+    pthread_mutex_lock(&cache->mutex);
+    cns_Bytes* evictedCompressed = slot->compressed;
+    cns_Bytes* evictedValue = slot->value;
+    cns_bytes_copy_r(cns, item->value, &slot->compressed);
+    cns_bytes_copy_r(cns, *out_value, &slot->value);
+    pthread_mutex_unlock(&cache->mutex);
+    if (evictedCompressed)
     {
-        // FIXME: when to rehash?
-        if (storage->count > 2 * (1 << storage->log2numbuckets))
-        {
-            _cns_storage_changeCapacityBase(cns, storage, storage->log2numbuckets + 1);
-            _cns_storage_itemForKey(cns, storage, key, &bucket, 0);
-            first = *bucket;
-        }
+        cns_bytes_free_r(cns, evictedCompressed);
+        cns_bytes_free_r(cns, evictedValue);
+    }
+    return CNS_OK;
+}
 
-        item = cns_runtime_alloc(cns, sizeof(_cns_Storage_BucketItem));
-        if (!item)
-            return;
-        item->key = cns_bytes_copy(cns, key);
-        if (!item->key)
-        {
-            cns_runtime_free(cns, item);
-            return;
-        }
-        item->value = cns_bytes_copy(cns, value);
-        if (!item->value)
+static void _cns_storage_decompressCacheFree(cns_Runtime* cns, _cns_Storage_DecompressCache* cache)
+{
+    if (!cache)
+        return;
+    for (cns_Index i = 0; i < ((cns_Index) 1 << cache->log2numslots); ++i)
+    {
+        if (cache->slots[i].compressed)
         {
-            cns_bytes_free(cns, item->key);
-            cns_runtime_free(cns, item);
-            return;
+            cns_bytes_free_r(cns, cache->slots[i].compressed);
+            cns_bytes_free_r(cns, cache->slots[i].value);
         }
-        item->next = first;
-        *bucket = item;
-        ++storage->count;
     }
-    cns_setlasterr(cns, CNS_OK);
+    pthread_mutex_destroy(&cache->mutex);
+    cns_runtime_free_r(cns, cache);
 }
 
-cns_Bytes*
-cns_storage_get(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key)
+// Versions. A write keeps the value it supersedes only while a view is pinned. A view of commit S sees, for a key, the
+// value kept by the oldest version superseded after S if there is one, and the current value otherwise. Versions are
+// released in the order they were superseded, once the oldest pinned view is past them.
+
+static _cns_Storage_Version* _cns_storage_newestVersion(cns_Storage* storage, cns_Bytes* key, uint32_t keyhash, _cns_Storage_Version*** out_link)
 {
-    if (!cns || !storage || !key)
-    {
-        cns_setlasterr(cns, CNS_ERR_BADARG);
+    if (!storage->versionBuckets)
         return 0;
-    }
+    _cns_Storage_Version** link = &storage->versionBuckets[keyhash & ((1u << storage->log2numversionbuckets) - 1)];
+    while (*link && !((*link)->hash == keyhash && cns_bytes_equalUnchecked((*link)->key, key)))
+        link = &(*link)->next;
+    if (out_link)
+        *out_link = link;
+    return *link;
+}
 
-    _cns_Storage_BucketItem* item = _cns_storage_itemForKey(cns, storage, key, 0, 0);
-    cns_setlasterr(cns, CNS_OK);
-    return item ? cns_bytes_copy(cns, item->value) : 0;
+static cns_Error _cns_storage_versionTable(cns_Runtime* cns, cns_Storage* storage)
+{
+    if (storage->versionBuckets)
+        return CNS_OK;
+    cns_Index bucketmemsize = 16 * sizeof(_cns_Storage_Version*);
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE_TABLE, bucketmemsize, (void**) &storage->versionBuckets);
+    if (!storage->versionBuckets)
+        return err;
+    memset(storage->versionBuckets, 0, bucketmemsize);
+    storage->log2numversionbuckets = 4;
+    return CNS_OK;
 }
 
-cns_Bool
-cns_storage_delete(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key)
+// growing is not needed for correctness, so failing to is ignored
+static void _cns_storage_growVersionTable(cns_Runtime* cns, cns_Storage* storage)
 {
-    if (!cns || !storage || !key)
+    int base = storage->log2numversionbuckets + 1;
+    _cns_Storage_Version** buckets = 0;
+    _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE_TABLE, ((cns_Index) 1 << base) * sizeof(_cns_Storage_Version*), (void**) &buckets);
+    if (!buckets)
+        return;
+    memset(buckets, 0, ((cns_Index) 1 << base) * sizeof(_cns_Storage_Version*));
+    for (int i = 0; i < (1 << storage->log2numversionbuckets); ++i)
     {
-        cns_setlasterr(cns, CNS_ERR_BADARG);
-        return CNS_NO;
+        _cns_Storage_Version* version = storage->versionBuckets[i];
+        while (version)
+        {
+            _cns_Storage_Version* next = version->next;
+            version->next = buckets[version->hash & ((1u << base) - 1)];
+            buckets[version->hash & ((1u << base) - 1)] = version;
+            version = next;
+        }
     }
+    cns_runtime_free_r(cns, storage->versionBuckets);
+    storage->versionBuckets = buckets;
+    storage->log2numversionbuckets = base;
+}
 
-    _cns_Storage_BucketItem** bucket = 0;
-    _cns_Storage_BucketItem* previousitem = 0;
-    _cns_Storage_BucketItem* item = _cns_storage_itemForKey(cns, storage, key, &bucket, &previousitem);
+// gets what keeping a superseded value takes if a view is pinned, so that nothing can fail once the write starts
+static cns_Error _cns_storage_prepareVersion(cns_Runtime* cns, cns_Storage* storage, _cns_Storage_Version** out_version)
+{
+    *out_version = 0;
+    if (!storage->oldestView)
+        return CNS_OK;
+    cns_Error err = _cns_storage_versionTable(cns, storage);
+    if (err)
+        return err;
+    if (storage->spareVersions)
+    {
+        *out_version = storage->spareVersions;
+        storage->spareVersions = storage->spareVersions->nextSuperseded;
+        return CNS_OK;
+    }
+    return _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE_ITEM, sizeof(_cns_Storage_Version), (void**) out_version);
+}
 
-    if (!item)
+// Keeps `value`, which the commit in progress supersedes for `key`, in `version` from `_cns_storage_prepareVersion`. Takes
+// ownership of `value`, freeing it if there is no version to keep it in or the commit already superseded another value
+// for the key.
+static void _cns_storage_keepVersion(cns_Runtime* cns, cns_Storage* storage, _cns_Storage_Version* version, cns_Bytes* key, uint32_t keyhash, cns_Bytes* value, uint32_t rawLength)
+{
+    _cns_Storage_Version** link = 0;
+    _cns_Storage_Version* older = version ? _cns_storage_newestVersion(storage, key, keyhash, &link) : 0;
+    if (!version || (older && older->sequence == storage->sequence + 1))
     {
-        cns_setlasterr(cns, CNS_OK);
-        return CNS_NO;
+        if (value)
+            cns_bytes_free_r(cns, value);
+        if (version)
+        {
+            version->nextSuperseded = storage->spareVersions;
+            storage->spareVersions = version;
+        }
+        return;
     }
 
-    if (previousitem)
-        previousitem->next = item->next;
+    cns_bytes_copy_r(cns, key, &version->key);
+    version->value = value;
+    version->rawLength = rawLength;
+    version->hash = keyhash;
+    version->sequence = storage->sequence + 1;
+    version->older = older;
+    version->newer = 0;
+    version->nextSuperseded = 0;
+    // the newest version takes the place of the older one in the bucket
+    version->next = older ? older->next : 0;
+    *link = version;
+    if (older)
+        older->newer = version;
+
+    if (storage->newestVersion)
+        storage->newestVersion->nextSuperseded = version;
     else
-        *bucket = item->next;
-    cns_bytes_free(cns, item->key);
-    cns_bytes_free(cns, item->value);
-    cns_runtime_free(cns, item);
-    --storage->count;
+        storage->oldestVersion = version;
+    storage->newestVersion = version;
+    if (++storage->versionCount > 2 * ((cns_Index) 1 << storage->log2numversionbuckets))
+        _cns_storage_growVersionTable(cns, storage);
+}
 
-    // FIXME: when to rehash?
-    if (storage->count < 4 * (1 << storage->log2numbuckets))
+// releases the versions no pinned view sees any more, or all of them
+static void _cns_storage_releaseVersions(cns_Runtime* cns, cns_Storage* storage, cns_Bool all)
+{
+    while (storage->oldestVersion && (all || !storage->oldestView || storage->oldestVersion->sequence <= storage->oldestView->sequence))
+    {
+        _cns_Storage_Version* version = storage->oldestVersion;
+        storage->oldestVersion = version->nextSuperseded;
+        // the oldest version of all is the oldest of its key
+        if (version->newer)
+            version->newer->older = 0;
+        else
+        {
+            _cns_Storage_Version** link = 0;
+            _cns_storage_newestVersion(storage, version->key, version->hash, &link);
+            *link = version->next;
+        }
+        cns_bytes_free_r(cns, version->key);
+        if (version->value)
+            cns_bytes_free_r(cns, version->value);
+        cns_runtime_free_r(cns, version);
+        --storage->versionCount;
+    }
+    if (!storage->oldestVersion)
     {
-        _cns_storage_changeCapacityBase(cns, storage, storage->log2numbuckets - 2);
+        storage->newestVersion = 0;
+        if (storage->versionBuckets)
+            cns_runtime_free_r(cns, storage->versionBuckets);
+        storage->versionBuckets = 0;
     }
+}
 
-    cns_setlasterr(cns, CNS_OK);
-    return CNS_YES;
+static void _cns_storage_releaseSpares(cns_Runtime* cns, cns_Storage* storage)
+{
+    while (storage->spareItems)
+    {
+        _cns_Storage_BucketItem* item = storage->spareItems;
+        storage->spareItems = item->next;
+        cns_runtime_free_r(cns, item);
+    }
+    while (storage->spareVersions)
+    {
+        _cns_Storage_Version* version = storage->spareVersions;
+        storage->spareVersions = version->nextSuperseded;
+        cns_runtime_free_r(cns, version);
+    }
 }
 
-cns_Index
-cns_storage_count(cns_Runtime* cns, cns_Storage* storage)
+// ends the commit in progress, handing its changes to the watches
+static void _cns_storage_commit(cns_Storage* storage)
 {
-    if (!cns || !storage)
+    ++storage->sequence;
+    if (storage->watches)
+        _cns_watch_publish(storage->watches);
+}
+
+// tells the watches following `key` about a change of the commit in progress; `oldValue` is as stored
+static void _cns_storage_notify(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bytes* oldValue, uint32_t oldRawLength, cns_Bytes* newValue)
+{
+    if (!_cns_watch_matches(storage->watches, key))
+        return;
+    cns_Bytes* decompressed = 0;
+    if (oldValue && oldRawLength && _cns_storage_decompress(cns, oldValue, oldRawLength, &decompressed))
     {
-        cns_setlasterr(cns, CNS_ERR_BADARG);
-        return 0;
+        _cns_watch_miss(storage->watches, key);
+        return;
     }
-    return storage->count;
+    _cns_watch_notify(cns, storage->watches, storage->sequence + 1, key, decompressed ? decompressed : oldValue, newValue);
+    if (decompressed)
+        cns_bytes_free_r(cns, decompressed);
 }
 
+// adds an item for `key`, which must not be in the storage yet; takes ownership of `value` even on failure
+// values set through entries are never compressed, since entries hand out the stored value itself
+static cns_Error _cns_storage_insert(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, uint32_t keyhash, cns_Bytes* value, cns_Bool compress, _cns_Storage_BucketItem** out_item)
+{
+    // FIXME: when to rehash?
+    if (storage->count > 2 * (1 << storage->log2numbuckets))
+        _cns_storage_changeCapacityBase(cns, storage, storage->log2numbuckets + 1);
+
+    _cns_Storage_BucketItem* item = storage->spareItems;
+    _cns_Storage_Version* version = 0;
+    cns_Error err = CNS_OK;
+    if (item)
+        storage->spareItems = item->next;
+    else
+        err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE_ITEM, sizeof(_cns_Storage_BucketItem), (void**) &item);
+    if (item)
+    {
+        err = _cns_storage_prepareVersion(cns, storage, &version);
+        if (err)
+        {
+            cns_runtime_free_r(cns, item);
+            item = 0;
+        }
+    }
+    if (!item)
+    {
+        _CNS_STATS(_cns_stats_add(&_cns_stats_counters(storage)->allocFailures, 1);)
+        cns_bytes_free_r(cns, value);
+        return err;
+    }
+    err = cns_bytes_copy_r(cns, key, &item->key);
+    if (err)
+    {
+        if (version)
+            cns_runtime_free_r(cns, version);
+        cns_runtime_free_r(cns, item);
+        cns_bytes_free_r(cns, value);
+        return err;
+    }
+    if (storage->internFlags & CNS_STORAGE_INTERN_KEYS)
+    {
+        // the key hash only doubles as the content hash when the storage hashes keys the default way
+        uint32_t contenthash = keyhash;
+        cns_Bool reusable = (storage->byteshashfn == cns_storage_defaultBytesHash32);
+        item->key = _cns_storage_intern(cns, storage, item->key, reusable ? &contenthash : 0);
+    }
+    // watches get the value as given, not its compression
+    cns_Bytes* given = 0;
+    if (storage->watches)
+        cns_bytes_copy_r(cns, value, &given);
+    item->rawLength = compress ? _cns_storage_compress(cns, storage, &value) : 0;
+    if (storage->internFlags & CNS_STORAGE_INTERN_VALUES)
+        value = _cns_storage_intern(cns, storage, value, 0);
+    item->value = value;
+    item->hash = keyhash;
+
+    _cns_Storage_BucketItem** bucket = &storage->buckets[keyhash & ((1 << storage->log2numbuckets) - 1)];
+    item->next = *bucket;
+    *bucket = item;
+    ++storage->count;
+    if (storage->hotKeys)
+        _cns_hotkeys_written(storage->hotKeys, keyhash);
+    _cns_storage_keepVersion(cns, storage, version, item->key, keyhash, 0, 0);
+    if (given)
+    {
+        _cns_storage_notify(cns, storage, item->key, 0, 0, given);
+        cns_bytes_free_r(cns, given);
+    }
+
+    if (out_item)
+        *out_item = item;
+    return CNS_OK;
+}
+
+// takes ownership of `value` even on failure
+static cns_Error _cns_storage_replaceValue(cns_Runtime* cns, cns_Storage* storage, _cns_Storage_BucketItem* item, cns_Bytes* value, cns_Bool compress)
+{
+    _cns_Storage_Version* version = 0;
+    cns_Error err = _cns_storage_prepareVersion(cns, storage, &version);
+    if (err)
+    {
+        cns_bytes_free_r(cns, value);
+        return err;
+    }
+    cns_Bytes* given = 0;
+    if (storage->watches)
+        cns_bytes_copy_r(cns, value, &given);
+    uint32_t discardedRawLength = item->rawLength;
+    item->rawLength = compress ? _cns_storage_compress(cns, storage, &value) : 0;
+    if (storage->internFlags & CNS_STORAGE_INTERN_VALUES)
+        value = _cns_storage_intern(cns, storage, value, 0);
+    cns_Bytes* discardedValue = item->value;
+    item->value = value;
+    if (storage->hotKeys)
+        _cns_hotkeys_written(storage->hotKeys, item->hash);
+    if (given)
+    {
+        _cns_storage_notify(cns, storage, item->key, discardedValue, discardedRawLength, given);
+        cns_bytes_free_r(cns, given);
+    }
+    _cns_storage_keepVersion(cns, storage, version, item->key, item->hash, discardedValue, discardedRawLength);
+    return CNS_OK;
+}
+
+// the parts every storage has, whatever engine it runs on
+static cns_Error _cns_storage_alloc(cns_Runtime* cns, cns_Storage** out_storage)
+{
+    cns_Storage* rv = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, sizeof(cns_Storage), (void**) &rv);
+    *out_storage = rv;
+    if (!rv)
+        return err;
+
+    memset(rv, 0, sizeof(cns_Storage));
+#ifdef CNS_ENABLE_STATS
+    cns_Index countersmemsize = _CNS_STATS_SHARDS * sizeof(_cns_StorageCountersShard) + 64;
+    err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, countersmemsize, &rv->countersMemory);
+    if (!rv->countersMemory)
+    {
+        cns_runtime_free_r(cns, rv);
+        *out_storage = 0;
+        return err;
+    }
+    memset(rv->countersMemory, 0, countersmemsize);
+    rv->counters = (_cns_StorageCountersShard*) (((uintptr_t) rv->countersMemory + 63) & ~(uintptr_t) 63);
+#endif
+    return CNS_OK;
+}
+
+static void _cns_storage_release(cns_Runtime* cns, cns_Storage* storage)
+{
+    _CNS_STATS(cns_runtime_free_r(cns, storage->countersMemory);)
+    cns_runtime_free_r(cns, storage);
+}
+
+cns_Storage*
+cns_storage_newMemoryStorage(cns_Runtime* cns, cns_Storage_BytesHash32Fn byteshashfn)
+{
+    if (!cns)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+
+    cns_Storage* rv = 0;
+    cns_Error err = _cns_storage_alloc(cns, &rv);
+    if (rv)
+    {
+        rv->byteshashfn = (byteshashfn ? byteshashfn : cns_storage_defaultBytesHash32);
+        rv->log2numbuckets = 4; // start with 16 buckets
+        cns_Index bucketmemsize = (1 << rv->log2numbuckets) * sizeof(_cns_Storage_BucketItem*);
+        err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE_TABLE, bucketmemsize, (void**) &rv->buckets);
+        if (!rv->buckets)
+        {
+            _cns_storage_release(cns, rv);
+            rv = 0;
+        }
+        else
+            memset(rv->buckets, 0, bucketmemsize);
+    }
+    cns_setlasterr(cns, err);
+    return rv;
+}
+
+cns_Storage*
+_cns_storage_newWithEngine(cns_Runtime* cns, const _cns_StorageEngine* engine, void* engineState)
+{
+    cns_Storage* rv = 0;
+    cns_Error err = _cns_storage_alloc(cns, &rv);
+    if (rv)
+    {
+        rv->engine = engine;
+        rv->engineState = engineState;
+    }
+    cns_setlasterr(cns, err);
+    return rv;
+}
+
+const _cns_StorageEngine*
+_cns_storage_engine(cns_Storage* storage)
+{
+    return storage->engine;
+}
+
+void*
+_cns_storage_engineState(cns_Storage* storage)
+{
+    return storage->engineState;
+}
+
+cns_Watch**
+_cns_storage_watches(cns_Storage* storage)
+{
+    return &storage->watches;
+}
+
+cns_Trace**
+_cns_storage_trace(cns_Storage* storage)
+{
+    return &storage->trace;
+}
+
+cns_HotKeys**
+_cns_storage_hotKeys(cns_Storage* storage)
+{
+    return &storage->hotKeys;
+}
+
+void
+_cns_storage_forEach(cns_Storage* storage, void (* fn)(void* context, cns_Bytes* key, cns_Bytes* value), void* context)
+{
+    for (int i = 0; !storage->engine && i < (1 << storage->log2numbuckets); ++i)
+    {
+        for (_cns_Storage_BucketItem* item = storage->buckets[i]; item; item = item->next)
+            fn(context, item->key, item->value);
+    }
+}
+
+void
+_cns_storage_forEachStored(cns_Storage* storage, void (* fn)(void* context, cns_Bytes* key, cns_Bytes* value, uint32_t rawLength), void* context)
+{
+    for (int i = 0; !storage->engine && i < (1 << storage->log2numbuckets); ++i)
+    {
+        for (_cns_Storage_BucketItem* item = storage->buckets[i]; item; item = item->next)
+            fn(context, item->key, item->value, item->rawLength);
+    }
+}
+
+cns_Error
+_cns_storage_setStored(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bytes* value, uint32_t rawLength)
+{
+    uint32_t keyhash = storage->byteshashfn(cns, key);
+    _cns_Storage_BucketItem* item = _cns_storage_itemForKey(cns, storage, key, keyhash, 0, 0);
+
+    cns_Bytes* valueCopy = 0;
+    cns_Error err = cns_bytes_copy_r(cns, value, &valueCopy);
+    if (err)
+        return err;
+    if (item)
+        err = _cns_storage_replaceValue(cns, storage, item, valueCopy, CNS_NO);
+    else
+        err = _cns_storage_insert(cns, storage, key, keyhash, valueCopy, CNS_NO, &item);
+    if (!err)
+    {
+        item->rawLength = rawLength;
+        _cns_storage_commit(storage);
+    }
+    return err;
+}
+
+cns_Error
+_cns_storage_swapItems(cns_Storage* storage, cns_Storage* other)
+{
+    if (storage->engine || other->engine || storage->byteshashfn != other->byteshashfn || storage->oldestView || other->oldestView)
+        return CNS_ERR_BADARG;
+
+    _cns_Storage_BucketItem** buckets = storage->buckets;
+    int log2numbuckets = storage->log2numbuckets;
+    int count = storage->count;
+    storage->buckets = other->buckets;
+    storage->log2numbuckets = other->log2numbuckets;
+    storage->count = other->count;
+    other->buckets = buckets;
+    other->log2numbuckets = log2numbuckets;
+    other->count = count;
+    // too many changes at once to report one by one
+    if (storage->watches)
+        _cns_watch_miss(storage->watches, 0);
+    if (storage->hotKeys)
+        _cns_hotkeys_writtenAll(storage->hotKeys);
+    if (other->hotKeys)
+        _cns_hotkeys_writtenAll(other->hotKeys);
+    _cns_storage_commit(storage);
+    return CNS_OK;
+}
+
+cns_Storage*
+cns_storage_newMemoryStorageWithCapacity(cns_Runtime* cns, cns_Storage_BytesHash32Fn byteshashfn, cns_Index capacity)
+{
+    cns_Storage* rv = cns_storage_newMemoryStorage(cns, byteshashfn);
+    if (rv && capacity > 0)
+    {
+        cns_Error err = cns_storage_reserve_r(cns, rv, capacity);
+        if (err)
+        {
+            cns_storage_free(cns, rv);
+            cns_setlasterr(cns, err);
+            return 0;
+        }
+    }
+    return rv;
+}
+
+cns_Error
+cns_storage_free_r(cns_Runtime* cns, cns_Storage* storage)
+{
+    if (!cns || !storage)
+        return CNS_ERR_BADARG;
+
+    if (storage->engine)
+    {
+        storage->engine->free(cns, storage);
+        _cns_storage_release(cns, storage);
+        return CNS_OK;
+    }
+
+    for (int i = 0; i < (1 << storage->log2numbuckets); ++i)
+    {
+        _cns_Storage_BucketItem* item = storage->buckets[i];
+        while (item)
+        {
+            _cns_Storage_BucketItem* next = item->next;
+            _cns_item_free(cns, item);
+            item = next;
+        }
+    }
+    _cns_storage_releaseVersions(cns, storage, CNS_YES);
+    _cns_storage_releaseSpares(cns, storage);
+    _cns_storage_internClear(cns, storage);
+    _cns_storage_decompressCacheFree(cns, storage->decompressCache);
+    cns_runtime_free_r(cns, storage->buckets);
+    _cns_storage_release(cns, storage);
+    return CNS_OK;
+}
+
+void
+cns_storage_free(cns_Runtime* cns, cns_Storage* storage)
+{
+    cns_setlasterr(cns, cns_storage_free_r(cns, storage));
+}
+
+static cns_Error _cns_storage_set(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bytes* value)
+{
+    uint32_t keyhash = storage->byteshashfn(cns, key);
+    _cns_Storage_BucketItem* item = _cns_storage_itemForKey(cns, storage, key, keyhash, 0, 0);
+
+    cns_Bytes* valueCopy = 0;
+    cns_Error err = cns_bytes_copy_r(cns, value, &valueCopy);
+    if (err)
+        return err;
+
+    if (item)
+        err = _cns_storage_replaceValue(cns, storage, item, valueCopy, CNS_YES);
+    else
+        err = _cns_storage_insert(cns, storage, key, keyhash, valueCopy, CNS_YES, 0);
+    if (!err)
+        _cns_storage_commit(storage);
+    return err;
+}
+
+cns_Error
+cns_storage_set_r(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bytes* value)
+{
+    if (!cns || !storage || !key || !value)
+        return CNS_ERR_BADARG;
+
+    _CNS_STATS(uint64_t startTime = _cns_stats_now();)
+    cns_Trace* trace = storage->trace;
+    uint64_t traceStart = trace ? _cns_trace_now() : 0;
+    cns_Error err = storage->engine ? storage->engine->set(cns, storage, key, value) : _cns_storage_set(cns, storage, key, value);
+    _CNS_STATS(_cns_stats_operation(storage, _CNS_OP_SET, startTime);)
+    if (trace)
+        _cns_trace_record(cns, trace, CNS_TRACE_SET, traceStart, key, value, CNS_NO, err);
+    return err;
+}
+
+void
+cns_storage_set(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bytes* value)
+{
+    cns_setlasterr(cns, cns_storage_set_r(cns, storage, key, value));
+}
+
+cns_Error
+cns_storage_get_r(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bytes** out_value)
+{
+    if (!cns || !storage || !key || !out_value)
+        return CNS_ERR_BADARG;
+
+    _CNS_STATS(uint64_t startTime = _cns_stats_now();)
+    cns_Trace* trace = storage->trace;
+    uint64_t traceStart = trace ? _cns_trace_now() : 0;
+    *out_value = 0;
+    cns_Error err = CNS_OK;
+    if (storage->engine)
+        err = storage->engine->get(cns, storage, key, out_value);
+    else
+    {
+        uint32_t keyhash = storage->byteshashfn(cns, key);
+        cns_HotKeys* hotKeys = storage->hotKeys;
+        if (!hotKeys || !_cns_hotkeys_get(cns, hotKeys, key, keyhash, out_value))
+        {
+            _cns_Storage_BucketItem* item = _cns_storage_itemForKey(cns, storage, key, keyhash, 0, 0);
+            if (item && item->rawLength)
+                err = _cns_storage_getCompressed(cns, storage, item, out_value);
+            else if (item)
+                err = cns_bytes_copy_r(cns, item->value, out_value);
+            if (hotKeys && *out_value)
+                _cns_hotkeys_fill(cns, hotKeys, key, keyhash, *out_value);
+        }
+    }
+    _CNS_STATS(_cns_stats_operation(storage, _CNS_OP_GET, startTime);)
+    if (trace)
+        _cns_trace_record(cns, trace, CNS_TRACE_GET, traceStart, key, *out_value, *out_value != 0, err);
+    return err;
+}
+
+cns_Bytes*
+cns_storage_get(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key)
+{
+    cns_Bytes* rv = 0;
+    cns_setlasterr(cns, cns_storage_get_r(cns, storage, key, &rv));
+    return rv;
+}
+
+// part of a commit, whose sequence the caller bumps
+static cns_Error _cns_storage_delete(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, uint32_t keyhash, cns_Bool* out_existed)
+{
+    _cns_Storage_BucketItem** bucket = 0;
+    _cns_Storage_BucketItem* previousitem = 0;
+    _cns_Storage_BucketItem* item = _cns_storage_itemForKey(cns, storage, key, keyhash, &bucket, &previousitem);
+
+    if (out_existed)
+        *out_existed = CNS_NO;
+    _cns_Storage_Version* version = 0;
+    cns_Error err = item ? _cns_storage_prepareVersion(cns, storage, &version) : CNS_OK;
+    if (!item || err)
+        return err;
+    if (out_existed)
+        *out_existed = CNS_YES;
+
+    if (previousitem)
+        previousitem->next = item->next;
+    else
+        *bucket = item->next;
+    if (storage->hotKeys)
+        _cns_hotkeys_written(storage->hotKeys, keyhash);
+    if (storage->watches)
+        _cns_storage_notify(cns, storage, item->key, item->value, item->rawLength, 0);
+    _cns_storage_keepVersion(cns, storage, version, item->key, item->hash, item->value, item->rawLength);
+    cns_bytes_free_r(cns, item->key);
+    cns_runtime_free_r(cns, item);
+    --storage->count;
+
+    // shrink once the table is a quarter full, but never below the initial 16 buckets
+    if (storage->log2numbuckets > 4 && 4 * storage->count < (1 << storage->log2numbuckets))
+    {
+        _cns_storage_changeCapacityBase(cns, storage, storage->log2numbuckets - 2 > 4 ? storage->log2numbuckets - 2 : 4);
+        _cns_storage_internSweep(cns, storage);
+    }
+    return CNS_OK;
+}
+
+cns_Error
+cns_storage_delete_r(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bool* out_existed)
+{
+    if (!cns || !storage || !key)
+        return CNS_ERR_BADARG;
+
+    _CNS_STATS(uint64_t startTime = _cns_stats_now();)
+    cns_Trace* trace = storage->trace;
+    uint64_t traceStart = trace ? _cns_trace_now() : 0;
+    cns_Bool existed = CNS_NO;
+    if (!out_existed && trace)
+        out_existed = &existed;
+    cns_Error err = CNS_OK;
+    if (storage->engine)
+        err = storage->engine->remove(cns, storage, key, out_existed);
+    else
+    {
+        err = _cns_storage_delete(cns, storage, key, storage->byteshashfn(cns, key), out_existed);
+        if (!err)
+            _cns_storage_commit(storage);
+    }
+    _CNS_STATS(_cns_stats_operation(storage, _CNS_OP_DELETE, startTime);)
+    if (trace)
+        _cns_trace_record(cns, trace, CNS_TRACE_DELETE, traceStart, key, 0, !err && *out_existed, err);
+    return err;
+}
+
+cns_Bool
+cns_storage_delete(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key)
+{
+    cns_Bool rv = CNS_NO;
+    cns_setlasterr(cns, cns_storage_delete_r(cns, storage, key, &rv));
+    return rv;
+}
+
+cns_Error
+cns_storage_setInterning_r(cns_Runtime* cns, cns_Storage* storage, unsigned flags)
+{
+    if (!cns || !storage || (flags & ~(unsigned) (CNS_STORAGE_INTERN_KEYS | CNS_STORAGE_INTERN_VALUES)))
+        return CNS_ERR_BADARG;
+    if (storage->engine)
+        return CNS_ERR_UNSUPPORTED;
+
+    storage->internFlags = flags;
+    if (!flags)
+        _cns_storage_internClear(cns, storage);
+    return CNS_OK;
+}
+
+void
+cns_storage_setInterning(cns_Runtime* cns, cns_Storage* storage, unsigned flags)
+{
+    cns_setlasterr(cns, cns_storage_setInterning_r(cns, storage, flags));
+}
+
+cns_Error
+cns_storage_intern_r(cns_Runtime* cns, cns_Storage* storage, const void * ptr, cns_Index size, cns_Bytes** out_bytes)
+{
+    if (!cns || !storage || size < 0 || (size && !ptr) || !out_bytes)
+        return CNS_ERR_BADARG;
+    if (storage->engine)
+        return CNS_ERR_UNSUPPORTED;
+
+    uint32_t hash = _cns_storage_hashMemory(ptr, size);
+    cns_Bytes* interned = _cns_storage_internFind(storage, ptr, size, hash);
+    if (interned)
+        return cns_bytes_copy_r(cns, interned, out_bytes);
+
+    cns_Error err = cns_bytes_new_r(cns, ptr, size, &interned);
+    if (err)
+    {
+        *out_bytes = 0;
+        return err;
+    }
+    // if the table cannot take it, the caller still gets a plain copy
+    if (_cns_storage_internAdd(cns, storage, interned, hash))
+        cns_bytes_copy_r(cns, interned, &interned);
+    *out_bytes = interned;
+    return CNS_OK;
+}
+
+cns_Bytes*
+cns_storage_intern(cns_Runtime* cns, cns_Storage* storage, const void * ptr, cns_Index size)
+{
+    cns_Bytes* rv = 0;
+    cns_setlasterr(cns, cns_storage_intern_r(cns, storage, ptr, size, &rv));
+    return rv;
+}
+
+cns_Error
+cns_storage_setCompression_r(cns_Runtime* cns, cns_Storage* storage, cns_Index threshold, cns_Index cachedValues)
+{
+    if (!cns || !storage || threshold < 0 || cachedValues < 0 || cachedValues > (1 << 24))
+        return CNS_ERR_BADARG;
+    if (storage->engine)
+        return CNS_ERR_UNSUPPORTED;
+
+    _cns_Storage_DecompressCache* cache = 0;
+    if (cachedValues)
+    {
+        int log2numslots = 0;
+        while (((cns_Index) 1 << log2numslots) < cachedValues)
+            ++log2numslots;
+        cns_Index size = sizeof(_cns_Storage_DecompressCache) + ((cns_Index) 1 << log2numslots) * sizeof(_cns_Storage_DecompressSlot);
+        cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, size, (void**) &cache);
+        if (!cache)
+            return err;
+        memset(cache, 0, size);
+        pthread_mutex_init(&cache->mutex, 0);
+        cache->log2numslots = log2numslots;
+    }
+    _cns_storage_decompressCacheFree(cns, storage->decompressCache);
+    storage->decompressCache = cache;
+    storage->compressThreshold = threshold;
+    return CNS_OK;
+}
+
+void
+cns_storage_setCompression(cns_Runtime* cns, cns_Storage* storage, cns_Index threshold, cns_Index cachedValues)
+{
+    cns_setlasterr(cns, cns_storage_setCompression_r(cns, storage, threshold, cachedValues));
+}
+
+cns_Error
+cns_storage_reserve_r(cns_Runtime* cns, cns_Storage* storage, cns_Index capacity)
+{
+    if (!cns || !storage || capacity < 0)
+        return CNS_ERR_BADARG;
+    if (storage->engine)
+        return CNS_OK; // only a hint, which other engines have no use for
+
+    // one item per bucket on average; inserts only grow the table past two
+    int base = storage->log2numbuckets;
+    while (base < 30 && ((cns_Index) 1 << base) < capacity)
+        ++base;
+    if (base == storage->log2numbuckets)
+        return CNS_OK;
+    return _cns_storage_changeCapacityBase(cns, storage, base) ? CNS_OK : CNS_ERR_NOMEM;
+}
+
+void
+cns_storage_reserve(cns_Runtime* cns, cns_Storage* storage, cns_Index capacity)
+{
+    cns_setlasterr(cns, cns_storage_reserve_r(cns, storage, capacity));
+}
+
+// bulk loads hash keys on several threads when each gets at least this many
+#define _CNS_STORAGE_MINKEYSPERTHREAD 4096
+
+typedef struct _cns_Storage_HashJob
+{
+    cns_Runtime*                cns;
+    cns_Storage_BytesHash32Fn   byteshashfn;
+    cns_Bytes**                 keys;
+    uint32_t*                   hashes;
+    cns_Index                   begin;
+    cns_Index                   end;
+} _cns_Storage_HashJob;
+
+static void* _cns_storage_hashRange(void* arg)
+{
+    _cns_Storage_HashJob* job = (_cns_Storage_HashJob*) arg;
+    for (cns_Index i = job->begin; i < job->end; ++i)
+        job->hashes[i] = job->byteshashfn(job->cns, job->keys[i]);
+    return 0;
+}
+
+// Hash functions other than the default may join a concatenated key to read it, which allocates; writes which hash on
+// worker threads join their keys on the calling thread first.
+static cns_Error _cns_storage_flattenForHash(cns_Storage* storage, cns_Bytes* key)
+{
+    if (storage->byteshashfn == cns_storage_defaultBytesHash32 || cns_bytes_isFlatUnchecked(key))
+        return CNS_OK;
+    return _cns_bytes_flatten(key) ? CNS_OK : CNS_ERR_NOMEM;
+}
+
+static cns_Error _cns_storage_hashKeys(cns_Runtime* cns, cns_Storage* storage, cns_Bytes** keys, uint32_t* hashes, cns_Index count, int numThreads)
+{
+    if (numThreads > count / _CNS_STORAGE_MINKEYSPERTHREAD)
+        numThreads = (int) (count / _CNS_STORAGE_MINKEYSPERTHREAD);
+    if (numThreads > 64)
+        numThreads = 64;
+
+    for (cns_Index i = 0; numThreads > 1 && i < count; ++i)
+    {
+        cns_Error err = _cns_storage_flattenForHash(storage, keys[i]);
+        if (err)
+            return err;
+    }
+
+    _cns_Storage_HashJob jobs[64];
+    pthread_t threads[64];
+    int numStarted = 0;
+    for (int t = 1; t < numThreads; ++t)
+    {
+        _cns_Storage_HashJob* job = &jobs[t];
+        job->cns = cns;
+        job->byteshashfn = storage->byteshashfn;
+        job->keys = keys;
+        job->hashes = hashes;
+        job->begin = count * t / numThreads;
+        job->end = count * (t + 1) / numThreads;
+        if (pthread_create(&threads[numStarted], 0, _cns_storage_hashRange, job))
+            _cns_storage_hashRange(job); // could not start a thread, do its share here
+        else
+            ++numStarted;
+    }
+
+    // the calling thread takes the first share
+    jobs[0].cns = cns;
+    jobs[0].byteshashfn = storage->byteshashfn;
+    jobs[0].keys = keys;
+    jobs[0].hashes = hashes;
+    jobs[0].begin = 0;
+    jobs[0].end = numThreads > 1 ? count / numThreads : count;
+    _cns_storage_hashRange(&jobs[0]);
+
+    for (int t = 0; t < numStarted; ++t)
+        pthread_join(threads[t], 0);
+    return CNS_OK;
+}
+
+cns_Error
+cns_storage_bulkSet_r(cns_Runtime* cns, cns_Storage* storage, cns_Bytes** keys, cns_Bytes** values, cns_Index count, int numThreads)
+{
+    if (!cns || !storage || count < 0 || (count && (!keys || !values)))
+        return CNS_ERR_BADARG;
+    for (cns_Index i = 0; i < count; ++i)
+    {
+        if (!keys[i] || !values[i])
+            return CNS_ERR_BADARG;
+    }
+    if (!count)
+        return CNS_OK;
+
+    if (storage->engine)
+    {
+        cns_Error err = CNS_OK;
+        for (cns_Index i = 0; i < count && !err; ++i)
+            err = cns_storage_set_r(cns, storage, keys[i], values[i]);
+        return err;
+    }
+
+    cns_Error err = cns_storage_reserve_r(cns, storage, storage->count + count);
+    if (err)
+        return err;
+
+    uint32_t* hashes = 0;
+    err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, count * sizeof(uint32_t), (void**) &hashes);
+    if (!hashes)
+        return err;
+    err = _cns_storage_hashKeys(cns, storage, keys, hashes, count, numThreads);
+
+    // the table is big enough already, so placing is a chain walk and a link per pair
+    for (cns_Index i = 0; i < count && !err; ++i)
+    {
+        _CNS_STATS(uint64_t startTime = _cns_stats_now();)
+        _cns_Storage_BucketItem* item = _cns_storage_itemForKey(cns, storage, keys[i], hashes[i], 0, 0);
+        cns_Bytes* valueCopy = 0;
+        err = cns_bytes_copy_r(cns, values[i], &valueCopy);
+        if (!err)
+        {
+            if (item)
+                err = _cns_storage_replaceValue(cns, storage, item, valueCopy, CNS_YES);
+            else
+                err = _cns_storage_insert(cns, storage, keys[i], hashes[i], valueCopy, CNS_YES, 0);
+        }
+        _CNS_STATS(_cns_stats_operation(storage, _CNS_OP_SET, startTime);)
+    }
+    _cns_storage_commit(storage);
+
+    cns_runtime_free_r(cns, hashes);
+    return err;
+}
+
+void
+cns_storage_bulkSet(cns_Runtime* cns, cns_Storage* storage, cns_Bytes** keys, cns_Bytes** values, cns_Index count, int numThreads)
+{
+    cns_setlasterr(cns, cns_storage_bulkSet_r(cns, storage, keys, values, count, numThreads));
+}
+
+// Snapshots of the memory storage
+//
+//   header     magic, version, log2 of the number of buckets, number of segments, count, then for each segment its
+//              length, count and CRC-32C; then a CRC-32C of the header, padded to 8 bytes. All fixed size, little endian.
+//   segments   one after the other; each holds the items of a contiguous range of buckets, as records of varint key size,
+//              key, varint value size, varint uncompressed size (0 unless the value is LZ4 compressed), value
+//
+// Segment `i` of `n` covers buckets [i * numBuckets / n, (i + 1) * numBuckets / n). Threads take segments in turn,
+// several per thread so that uneven ones even out. Restoring into a table of the same size puts every item of a segment
+// into the segment's own buckets, so threads link items without locking; only items which hash elsewhere, with another
+// hash function, are left for the calling thread. The runtime's allocation functions are only called from the calling
+// thread: workers encode into buffers and parse into records it allocated, then fill in the blocks it allocated.
+
+#define _CNS_SNAPSHOT_MAGIC 0x3150414e53534e43ull // "CNSSNAP1"
+#define _CNS_SNAPSHOT_VERSION 1
+#define _CNS_SNAPSHOT_FIXEDSIZE 32
+#define _CNS_SNAPSHOT_SEGMENTINFOSIZE 24
+#define _CNS_SNAPSHOT_SEGMENTSPERTHREAD 4
+#define _CNS_SNAPSHOT_MAXTHREADS 64
+#define _CNS_SNAPSHOT_BUFFERSIZE (1 << 20)
+
+enum { _CNS_SNAPSHOT_SIZE, _CNS_SNAPSHOT_WRITE, _CNS_SNAPSHOT_READ, _CNS_SNAPSHOT_BUILD };
+
+// a key and value parsed from a segment, and the blocks the calling thread allocated for them
+typedef struct _cns_Storage_SnapshotRecord
+{
+    const uint8_t*              key;
+    const uint8_t*              value;
+    cns_Index                   keyLength;
+    cns_Index                   valueLength;
+    uint32_t                    rawLength;
+    _cns_BytesImpl*             keyBlock;
+    _cns_BytesImpl*             valueBlock;
+    _cns_Storage_BucketItem*    item;
+} _cns_Storage_SnapshotRecord;
+
+typedef struct _cns_Storage_SnapshotSegment
+{
+    uint32_t                        firstBucket;
+    uint32_t                        endBucket;
+    uint64_t                        offset; // from the start of the snapshot
+    uint64_t                        length;
+    uint64_t                        count;
+    uint32_t                        crc;
+    cns_Error                       err;
+    uint8_t*                        data; // read from the file
+    _cns_Storage_SnapshotRecord*    records;
+    _cns_Storage_BucketItem*        strays; // items whose bucket lies outside the segment's range
+} _cns_Storage_SnapshotSegment;
+
+typedef struct _cns_Storage_SnapshotWork
+{
+    cns_Runtime*                    cns;
+    cns_Storage*                    storage;
+    int                             fd;
+    int64_t                         base; // file offset of the snapshot
+    int                             phase;
+    _cns_Storage_SnapshotSegment*   segments;
+    int                             numSegments;
+    atomic_int                      nextSegment;
+} _cns_Storage_SnapshotWork;
+
+typedef struct _cns_Storage_SnapshotWorker
+{
+    _cns_Storage_SnapshotWork*  work;
+    uint8_t*                    buffer; // for writing
+    cns_Index                   used;
+    int64_t                     position; // file offset the buffer goes to
+    uint32_t                    crc;
+} _cns_Storage_SnapshotWorker;
+
+static void _cns_storage_put32(uint8_t* out, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        out[i] = (uint8_t) (value >> (8 * i));
+}
+
+static uint32_t _cns_storage_get32(const uint8_t* ptr)
+{
+    return (uint32_t) ptr[0] | (uint32_t) ptr[1] << 8 | (uint32_t) ptr[2] << 16 | (uint32_t) ptr[3] << 24;
+}
+
+static void _cns_storage_put64(uint8_t* out, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i)
+        out[i] = (uint8_t) (value >> (8 * i));
+}
+
+static uint64_t _cns_storage_get64(const uint8_t* ptr)
+{
+    return (uint64_t) _cns_storage_get32(ptr) | (uint64_t) _cns_storage_get32(ptr + 4) << 32;
+}
+
+static cns_Index _cns_storage_varintSize(uint64_t value)
+{
+    cns_Index size = 1;
+    for (; value >= 0x80; value >>= 7)
+        ++size;
+    return size;
+}
+
+static cns_Index _cns_storage_snapshotHeaderSize(int numSegments)
+{
+    return _CNS_SNAPSHOT_FIXEDSIZE + (cns_Index) numSegments * _CNS_SNAPSHOT_SEGMENTINFOSIZE + 8;
+}
+
+static cns_Error _cns_storage_writeAt(int fd, const void * ptr, size_t size, int64_t offset)
+{
+    while (size)
+    {
+        ssize_t n = pwrite(fd, ptr, size, (off_t) offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return CNS_ERR_IO;
+        ptr = (const uint8_t*) ptr + n;
+        size -= (size_t) n;
+        offset += n;
+    }
+    return CNS_OK;
+}
+
+// a file ending early makes a malformed snapshot rather than an I/O error
+static cns_Error _cns_storage_readAt(int fd, void* ptr, size_t size, int64_t offset)
+{
+    while (size)
+    {
+        ssize_t n = pread(fd, ptr, size, (off_t) offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return CNS_ERR_IO;
+        if (n == 0)
+            return CNS_ERR_MALFORMED;
+        ptr = (uint8_t*) ptr + n;
+        size -= (size_t) n;
+        offset += n;
+    }
+    return CNS_OK;
+}
+
+static void _cns_storage_snapshotFlush(_cns_Storage_SnapshotWorker* worker, _cns_Storage_SnapshotSegment* segment)
+{
+    if (!worker->used || segment->err)
+        return;
+    worker->crc = cns_kernels_crc32c(CNS_KERNEL_AUTO, worker->crc, worker->buffer, worker->used);
+    segment->err = _cns_storage_writeAt(worker->work->fd, worker->buffer, (size_t) worker->used, worker->position);
+    worker->position += worker->used;
+    worker->used = 0;
+}
+
+static void _cns_storage_snapshotAppend(_cns_Storage_SnapshotWorker* worker, _cns_Storage_SnapshotSegment* segment, const void * ptr, cns_Index length)
+{
+    while (length)
+    {
+        cns_Index n = _CNS_SNAPSHOT_BUFFERSIZE - worker->used;
+        if (n > length)
+            n = length;
+        memcpy(worker->buffer + worker->used, ptr, (size_t) n);
+        worker->used += n;
+        ptr = (const uint8_t*) ptr + n;
+        length -= n;
+        if (worker->used == _CNS_SNAPSHOT_BUFFERSIZE)
+            _cns_storage_snapshotFlush(worker, segment);
+    }
+}
+
+static void _cns_storage_snapshotAppendVarint(_cns_Storage_SnapshotWorker* worker, _cns_Storage_SnapshotSegment* segment, uint64_t value)
+{
+    uint8_t encoded[CNS_WIRE_MAXVARINT];
+    _cns_storage_snapshotAppend(worker, segment, encoded, cns_wire_encodeVarint(value, encoded));
+}
+
+// concatenations are written piece by piece, since joining them would allocate
+static void _cns_storage_snapshotAppendBytes(_cns_Storage_SnapshotWorker* worker, _cns_Storage_SnapshotSegment* segment, cns_Bytes* bytes)
+{
+    if (cns_bytes_isFlatUnchecked(bytes))
+    {
+        _cns_storage_snapshotAppend(worker, segment, cns_bytes_ptrUnchecked(bytes), cns_bytes_lengthUnchecked(bytes));
+        return;
+    }
+    cns_BytesChunks chunks;
+    cns_bytes_chunksBeginUnchecked(bytes, &chunks);
+    const void * ptr = 0;
+    cns_Index length = 0;
+    while (cns_bytes_chunksNextUnchecked(&chunks, &ptr, &length))
+        _cns_storage_snapshotAppend(worker, segment, ptr, length);
+}
+
+static void _cns_storage_snapshotSize(_cns_Storage_SnapshotWork* work, _cns_Storage_SnapshotSegment* segment)
+{
+    for (uint32_t i = segment->firstBucket; i < segment->endBucket; ++i)
+    {
+        for (_cns_Storage_BucketItem* item = work->storage->buckets[i]; item; item = item->next)
+        {
+            cns_Index keyLength = cns_bytes_lengthUnchecked(item->key);
+            cns_Index valueLength = cns_bytes_lengthUnchecked(item->value);
+            segment->length += (uint64_t) (_cns_storage_varintSize((uint64_t) keyLength) + keyLength
+                + _cns_storage_varintSize((uint64_t) valueLength) + _cns_storage_varintSize(item->rawLength) + valueLength);
+            ++segment->count;
+        }
+    }
+}
+
+static void _cns_storage_snapshotWrite(_cns_Storage_SnapshotWorker* worker, _cns_Storage_SnapshotSegment* segment)
+{
+    worker->used = 0;
+    worker->position = worker->work->base + (int64_t) segment->offset;
+    worker->crc = 0;
+    for (uint32_t i = segment->firstBucket; i < segment->endBucket && !segment->err; ++i)
+    {
+        for (_cns_Storage_BucketItem* item = worker->work->storage->buckets[i]; item; item = item->next)
+        {
+            _cns_storage_snapshotAppendVarint(worker, segment, (uint64_t) cns_bytes_lengthUnchecked(item->key));
+            _cns_storage_snapshotAppendBytes(worker, segment, item->key);
+            _cns_storage_snapshotAppendVarint(worker, segment, (uint64_t) cns_bytes_lengthUnchecked(item->value));
+            _cns_storage_snapshotAppendVarint(worker, segment, item->rawLength);
+            _cns_storage_snapshotAppendBytes(worker, segment, item->value);
+        }
+    }
+    _cns_storage_snapshotFlush(worker, segment);
+    segment->crc = worker->crc;
+}
+
+static cns_Bool _cns_storage_snapshotVarint(const uint8_t** ptr, const uint8_t* end, cns_Index* out_value)
+{
+    uint64_t value = 0;
+    cns_Index n = cns_wire_decodeVarint(*ptr, end - *ptr, &value);
+    if (!n || value > PTRDIFF_MAX)
+        return CNS_NO;
+    *ptr += n;
+    *out_value = (cns_Index) value;
+    return CNS_YES;
+}
+
+static void _cns_storage_snapshotRead(_cns_Storage_SnapshotWork* work, _cns_Storage_SnapshotSegment* segment)
+{
+    segment->err = _cns_storage_readAt(work->fd, segment->data, (size_t) segment->length, work->base + (int64_t) segment->offset);
+    if (segment->err)
+        return;
+    if (cns_kernels_crc32c(CNS_KERNEL_AUTO, 0, segment->data, (cns_Index) segment->length) != segment->crc)
+    {
+        segment->err = CNS_ERR_MALFORMED;
+        return;
+    }
+
+    const uint8_t* ptr = segment->data;
+    const uint8_t* end = ptr + segment->length;
+    for (uint64_t i = 0; i < segment->count; ++i)
+    {
+        _cns_Storage_SnapshotRecord* record = &segment->records[i];
+        cns_Index rawLength = 0;
+        if (!_cns_storage_snapshotVarint(&ptr, end, &record->keyLength) || record->keyLength > end - ptr)
+            break;
+        record->key = ptr;
+        ptr += record->keyLength;
+        if (!_cns_storage_snapshotVarint(&ptr, end, &record->valueLength) || !_cns_storage_snapshotVarint(&ptr, end, &rawLength)
+            || record->valueLength > end - ptr || rawLength > CNS_LZ4_MAXINPUT)
+            break;
+        record->rawLength = (uint32_t) rawLength;
+        record->value = ptr;
+        ptr += record->valueLength;
+        if (i + 1 == segment->count && ptr == end)
+            return;
+    }
+    if (segment->count || ptr != end)
+        segment->err = CNS_ERR_MALFORMED;
+}
+
+static void _cns_storage_snapshotBuild(_cns_Storage_SnapshotWork* work, _cns_Storage_SnapshotSegment* segment)
+{
+    cns_Storage* storage = work->storage;
+    uint32_t mask = (1u << storage->log2numbuckets) - 1;
+    for (uint64_t i = 0; i < segment->count; ++i)
+    {
+        _cns_Storage_SnapshotRecord* record = &segment->records[i];
+        memcpy((void*) record->keyBlock->data, record->key, (size_t) record->keyLength);
+        memcpy((void*) record->valueBlock->data, record->value, (size_t) record->valueLength);
+        _cns_Storage_BucketItem* item = record->item;
+        item->key = (cns_Bytes*) record->keyBlock;
+        item->value = (cns_Bytes*) record->valueBlock;
+        item->rawLength = record->rawLength;
+        item->hash = storage->byteshashfn(work->cns, item->key);
+
+        uint32_t index = item->hash & mask;
+        _cns_Storage_BucketItem** list = index >= segment->firstBucket && index < segment->endBucket ? &storage->buckets[index] : &segment->strays;
+        item->next = *list;
+        *list = item;
+    }
+}
+
+static void* _cns_storage_snapshotWorker(void* arg)
+{
+    _cns_Storage_SnapshotWorker* worker = (_cns_Storage_SnapshotWorker*) arg;
+    _cns_Storage_SnapshotWork* work = worker->work;
+    for (;;)
+    {
+        int i = atomic_fetch_add_explicit(&work->nextSegment, 1, memory_order_relaxed);
+        if (i >= work->numSegments)
+            return 0;
+        _cns_Storage_SnapshotSegment* segment = &work->segments[i];
+        if (work->phase == _CNS_SNAPSHOT_SIZE)
+            _cns_storage_snapshotSize(work, segment);
+        else if (work->phase == _CNS_SNAPSHOT_WRITE)
+            _cns_storage_snapshotWrite(worker, segment);
+        else if (work->phase == _CNS_SNAPSHOT_READ)
+            _cns_storage_snapshotRead(work, segment);
+        else
+            _cns_storage_snapshotBuild(work, segment);
+    }
+}
+
+// runs one phase over `numSegments` segments on up to `numThreads` threads, the calling one included; returns the first
+// error of a segment
+static cns_Error _cns_storage_snapshotRun(_cns_Storage_SnapshotWork* work, int phase, _cns_Storage_SnapshotSegment* segments, int numSegments, _cns_Storage_SnapshotWorker* workers, int numThreads)
+{
+    work->phase = phase;
+    work->segments = segments;
+    work->numSegments = numSegments;
+    atomic_store_explicit(&work->nextSegment, 0, memory_order_relaxed);
+
+    pthread_t threads[_CNS_SNAPSHOT_MAXTHREADS];
+    int numStarted = 0;
+    for (int t = 1; t < numThreads && t < numSegments; ++t)
+    {
+        // a thread that cannot start leaves its segments to the others
+        if (!pthread_create(&threads[numStarted], 0, _cns_storage_snapshotWorker, &workers[t]))
+            ++numStarted;
+    }
+    _cns_storage_snapshotWorker(&workers[0]);
+    for (int t = 0; t < numStarted; ++t)
+        pthread_join(threads[t], 0);
+
+    for (int i = 0; i < numSegments; ++i)
+    {
+        if (segments[i].err)
+            return segments[i].err;
+    }
+    return CNS_OK;
+}
+
+static int _cns_storage_snapshotThreads(cns_Index count, int numThreads)
+{
+    if (numThreads > count / _CNS_STORAGE_MINKEYSPERTHREAD)
+        numThreads = (int) (count / _CNS_STORAGE_MINKEYSPERTHREAD);
+    if (numThreads > _CNS_SNAPSHOT_MAXTHREADS)
+        numThreads = _CNS_SNAPSHOT_MAXTHREADS;
+    return numThreads > 1 ? numThreads : 1;
+}
+
+cns_Error
+cns_storage_writeSnapshot_r(cns_Runtime* cns, cns_Storage* storage, int fd, int numThreads)
+{
+    if (!cns || !storage || fd < 0 || numThreads < 1)
+        return CNS_ERR_BADARG;
+    if (storage->engine)
+        return CNS_ERR_UNSUPPORTED;
+
+    off_t base = lseek(fd, 0, SEEK_CUR);
+    if (base < 0)
+        return CNS_ERR_IO;
+
+    numThreads = _cns_storage_snapshotThreads(storage->count, numThreads);
+    int numBuckets = 1 << storage->log2numbuckets;
+    int numSegments = numThreads * _CNS_SNAPSHOT_SEGMENTSPERTHREAD;
+    if (numThreads == 1 || numSegments > numBuckets)
+        numSegments = numThreads == 1 ? 1 : numBuckets;
+    cns_Index headerSize = _cns_storage_snapshotHeaderSize(numSegments);
+
+    _cns_Storage_SnapshotSegment* segments = 0;
+    _cns_Storage_SnapshotWorker* workers = 0;
+    uint8_t* header = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, numSegments * (cns_Index) sizeof(_cns_Storage_SnapshotSegment), (void**) &segments);
+    if (!err)
+        err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, numThreads * (cns_Index) sizeof(_cns_Storage_SnapshotWorker), (void**) &workers);
+    if (!err)
+        err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, headerSize, (void**) &header);
+    if (!err)
+    {
+        memset(segments, 0, numSegments * sizeof(_cns_Storage_SnapshotSegment));
+        memset(workers, 0, numThreads * sizeof(_cns_Storage_SnapshotWorker));
+    }
+    for (int t = 0; t < numThreads && !err; ++t)
+        err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, _CNS_SNAPSHOT_BUFFERSIZE, (void**) &workers[t].buffer);
+
+    _cns_Storage_SnapshotWork work = { .cns = cns, .storage = storage, .fd = fd, .base = (int64_t) base };
+    if (!err)
+    {
+        for (int i = 0; i < numSegments; ++i)
+        {
+            segments[i].firstBucket = (uint32_t) ((int64_t) numBuckets * i / numSegments);
+            segments[i].endBucket = (uint32_t) ((int64_t) numBuckets * (i + 1) / numSegments);
+        }
+        for (int t = 0; t < numThreads; ++t)
+            workers[t].work = &work;
+        _cns_storage_snapshotRun(&work, _CNS_SNAPSHOT_SIZE, segments, numSegments, workers, numThreads);
+
+        uint64_t offset = (uint64_t) headerSize;
+        for (int i = 0; i < numSegments; ++i)
+        {
+            segments[i].offset = offset;
+            offset += segments[i].length;
+        }
+        err = _cns_storage_snapshotRun(&work, _CNS_SNAPSHOT_WRITE, segments, numSegments, workers, numThreads);
+
+        if (!err)
+        {
+            _cns_storage_put64(header, _CNS_SNAPSHOT_MAGIC);
+            _cns_storage_put32(header + 8, _CNS_SNAPSHOT_VERSION);
+            _cns_storage_put32(header + 12, (uint32_t) storage->log2numbuckets);
+            _cns_storage_put32(header + 16, (uint32_t) numSegments);
+            _cns_storage_put32(header + 20, 0);
+            _cns_storage_put64(header + 24, (uint64_t) storage->count);
+            for (int i = 0; i < numSegments; ++i)
+            {
+                uint8_t* info = header + _CNS_SNAPSHOT_FIXEDSIZE + i * _CNS_SNAPSHOT_SEGMENTINFOSIZE;
+                _cns_storage_put64(info, segments[i].length);
+                _cns_storage_put64(info + 8, segments[i].count);
+                _cns_storage_put32(info + 16, segments[i].crc);
+                _cns_storage_put32(info + 20, 0);
+            }
+            _cns_storage_put32(header + headerSize - 8, cns_kernels_crc32c(CNS_KERNEL_AUTO, 0, header, headerSize - 8));
+            _cns_storage_put32(header + headerSize - 4, 0);
+            err = _cns_storage_writeAt(fd, header, (size_t) headerSize, (int64_t) base);
+        }
+        if (!err && lseek(fd, base + (off_t) offset, SEEK_SET) < 0)
+            err = CNS_ERR_IO;
+    }
+
+    for (int t = 0; workers && t < numThreads; ++t)
+        cns_runtime_free_r(cns, workers[t].buffer);
+    cns_runtime_free_r(cns, workers);
+    cns_runtime_free_r(cns, segments);
+    cns_runtime_free_r(cns, header);
+    return err;
+}
+
+void
+cns_storage_writeSnapshot(cns_Runtime* cns, cns_Storage* storage, int fd, int numThreads)
+{
+    cns_setlasterr(cns, cns_storage_writeSnapshot_r(cns, storage, fd, numThreads));
+}
+
+// frees what was allocated for the records of a segment and not linked into the table
+static void _cns_storage_snapshotReleaseSegment(cns_Runtime* cns, _cns_Storage_SnapshotSegment* segment, cns_Bool linked)
+{
+    for (uint64_t i = 0; segment->records && !linked && i < segment->count; ++i)
+    {
+        _cns_Storage_SnapshotRecord* record = &segment->records[i];
+        if (record->keyBlock)
+            cns_bytes_free_r(cns, (cns_Bytes*) record->keyBlock);
+        if (record->valueBlock)
+            cns_bytes_free_r(cns, (cns_Bytes*) record->valueBlock);
+        cns_runtime_free_r(cns, record->item);
+    }
+    cns_runtime_free_r(cns, segment->records);
+    cns_runtime_free_r(cns, segment->data);
+    segment->records = 0;
+    segment->data = 0;
+}
+
+static void _cns_storage_clear(cns_Runtime* cns, cns_Storage* storage)
+{
+    for (int i = 0; i < (1 << storage->log2numbuckets); ++i)
+    {
+        _cns_Storage_BucketItem* item = storage->buckets[i];
+        while (item)
+        {
+            _cns_Storage_BucketItem* next = item->next;
+            _cns_item_free(cns, item);
+            item = next;
+        }
+        storage->buckets[i] = 0;
+    }
+    storage->count = 0;
+}
+
+// reads and checks the header into newly allocated segments
+static cns_Error _cns_storage_snapshotReadHeader(cns_Runtime* cns, int fd, int64_t base, int* out_log2numbuckets, int* out_numSegments, _cns_Storage_SnapshotSegment** out_segments, uint64_t* out_end)
+{
+    uint8_t fixed[_CNS_SNAPSHOT_FIXEDSIZE];
+    cns_Error err = _cns_storage_readAt(fd, fixed, sizeof(fixed), base);
+    if (err)
+        return err;
+    uint32_t log2numbuckets = _cns_storage_get32(fixed + 12);
+    uint32_t numSegments = _cns_storage_get32(fixed + 16);
+    uint64_t count = _cns_storage_get64(fixed + 24);
+    if (_cns_storage_get64(fixed) != _CNS_SNAPSHOT_MAGIC || _cns_storage_get32(fixed + 8) != _CNS_SNAPSHOT_VERSION
+        || log2numbuckets < 4 || log2numbuckets > 30 || !numSegments || numSegments > (1u << log2numbuckets) || count > INT_MAX)
+        return CNS_ERR_MALFORMED;
+
+    cns_Index headerSize = _cns_storage_snapshotHeaderSize((int) numSegments);
+    uint8_t* header = 0;
+    _cns_Storage_SnapshotSegment* segments = 0;
+    err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, headerSize, (void**) &header);
+    if (!err)
+        err = _cns_storage_readAt(fd, header, (size_t) headerSize, base);
+    if (!err && _cns_storage_get32(header + headerSize - 8) != cns_kernels_crc32c(CNS_KERNEL_AUTO, 0, header, headerSize - 8))
+        err = CNS_ERR_MALFORMED;
+    if (!err)
+        err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, (cns_Index) numSegments * (cns_Index) sizeof(_cns_Storage_SnapshotSegment), (void**) &segments);
+    if (!err)
+    {
+        memset(segments, 0, numSegments * sizeof(_cns_Storage_SnapshotSegment));
+        uint64_t offset = (uint64_t) headerSize;
+        uint64_t total = 0;
+        for (uint32_t i = 0; i < numSegments && !err; ++i)
+        {
+            const uint8_t* info = header + _CNS_SNAPSHOT_FIXEDSIZE + i * _CNS_SNAPSHOT_SEGMENTINFOSIZE;
+            _cns_Storage_SnapshotSegment* segment = &segments[i];
+            segment->firstBucket = (uint32_t) (((uint64_t) 1 << log2numbuckets) * i / numSegments);
+            segment->endBucket = (uint32_t) (((uint64_t) 1 << log2numbuckets) * (i + 1) / numSegments);
+            segment->offset = offset;
+            segment->length = _cns_storage_get64(info);
+            segment->count = _cns_storage_get64(info + 8);
+            segment->crc = _cns_storage_get32(info + 16);
+            // each record takes at least 3 bytes
+            if (segment->length > ((uint64_t) 1 << 46) || segment->count > segment->length / 3 || segment->length > PTRDIFF_MAX)
+                err = CNS_ERR_MALFORMED;
+            offset += segment->length;
+            total += segment->count;
+        }
+        if (!err && total != count)
+            err = CNS_ERR_MALFORMED;
+        *out_end = offset;
+    }
+    cns_runtime_free_r(cns, header);
+    if (err)
+    {
+        cns_runtime_free_r(cns, segments);
+        return err;
+    }
+    *out_log2numbuckets = (int) log2numbuckets;
+    *out_numSegments = (int) numSegments;
+    *out_segments = segments;
+    return CNS_OK;
+}
+
+// allocates the blocks and items the records of a parsed segment become
+static cns_Error _cns_storage_snapshotAllocRecords(cns_Runtime* cns, _cns_Storage_SnapshotSegment* segment)
+{
+    for (uint64_t i = 0; i < segment->count; ++i)
+    {
+        _cns_Storage_SnapshotRecord* record = &segment->records[i];
+        cns_Error err = _cns_bytes_alloc(cns, record->keyLength, &record->keyBlock);
+        if (!err)
+            err = _cns_bytes_alloc(cns, record->valueLength, &record->valueBlock);
+        if (!err)
+            err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE_ITEM, sizeof(_cns_Storage_BucketItem), (void**) &record->item);
+        if (err)
+            return err;
+    }
+    return CNS_OK;
+}
+
+cns_Error
+cns_storage_readSnapshot_r(cns_Runtime* cns, cns_Storage* storage, int fd, int numThreads)
+{
+    if (!cns || !storage || fd < 0 || numThreads < 1)
+        return CNS_ERR_BADARG;
+    if (storage->engine)
+        return CNS_ERR_UNSUPPORTED;
+    if (storage->count || storage->oldestView)
+        return CNS_ERR_BADARG;
+
+    off_t base = lseek(fd, 0, SEEK_CUR);
+    if (base < 0)
+        return CNS_ERR_IO;
+
+    int log2numbuckets = 0;
+    int numSegments = 0;
+    _cns_Storage_SnapshotSegment* segments = 0;
+    uint64_t end = 0;
+    cns_Error err = _cns_storage_snapshotReadHeader(cns, fd, (int64_t) base, &log2numbuckets, &numSegments, &segments, &end);
+    if (err)
+        return err;
+
+    // the table takes the size it had, so that segments fill disjoint ranges of buckets
+    if (log2numbuckets != storage->log2numbuckets && !_cns_storage_changeCapacityBase(cns, storage, log2numbuckets))
+        err = CNS_ERR_NOMEM;
+
+    numThreads = numThreads > _CNS_SNAPSHOT_MAXTHREADS ? _CNS_SNAPSHOT_MAXTHREADS : numThreads;
+    _cns_Storage_SnapshotWorker workers[_CNS_SNAPSHOT_MAXTHREADS];
+    _cns_Storage_SnapshotWork work = { .cns = cns, .storage = storage, .fd = fd, .base = (int64_t) base };
+    for (int t = 0; t < numThreads; ++t)
+        workers[t] = (_cns_Storage_SnapshotWorker) { .work = &work };
+
+    // a round of segments at a time, so that the file is never in memory all at once
+    for (int first = 0; first < numSegments && !err; first += numThreads)
+    {
+        int roundSize = numSegments - first < numThreads ? numSegments - first : numThreads;
+        _cns_Storage_SnapshotSegment* round = &segments[first];
+        for (int i = 0; i < roundSize && !err; ++i)
+        {
+            if (!round[i].length)
+                continue;
+            err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, (cns_Index) round[i].length, (void**) &round[i].data);
+            if (!err && round[i].count)
+            {
+                cns_Index size = (cns_Index) round[i].count * (cns_Index) sizeof(_cns_Storage_SnapshotRecord);
+                err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, size, (void**) &round[i].records);
+                if (!err)
+                    memset(round[i].records, 0, (size_t) size);
+            }
+        }
+        if (!err)
+            err = _cns_storage_snapshotRun(&work, _CNS_SNAPSHOT_READ, round, roundSize, workers, numThreads);
+        for (int i = 0; i < roundSize && !err; ++i)
+            err = _cns_storage_snapshotAllocRecords(cns, &round[i]);
+        if (!err)
+        {
+            _cns_storage_snapshotRun(&work, _CNS_SNAPSHOT_BUILD, round, roundSize, workers, numThreads);
+            uint32_t mask = (1u << storage->log2numbuckets) - 1;
+            for (int i = 0; i < roundSize; ++i)
+            {
+                while (round[i].strays)
+                {
+                    _cns_Storage_BucketItem* item = round[i].strays;
+                    round[i].strays = item->next;
+                    item->next = storage->buckets[item->hash & mask];
+                    storage->buckets[item->hash & mask] = item;
+                }
+                storage->count += (int) round[i].count;
+            }
+        }
+        for (int i = 0; i < roundSize; ++i)
+            _cns_storage_snapshotReleaseSegment(cns, &round[i], !err);
+    }
+    cns_runtime_free_r(cns, segments);
+
+    if (!err && lseek(fd, base + (off_t) end, SEEK_SET) < 0)
+        err = CNS_ERR_IO;
+    if (storage->hotKeys)
+        _cns_hotkeys_writtenAll(storage->hotKeys);
+    if (err)
+        _cns_storage_clear(cns, storage);
+    else
+    {
+        if (storage->watches)
+            _cns_watch_miss(storage->watches, 0);
+        _cns_storage_commit(storage);
+    }
+    return err;
+}
+
+void
+cns_storage_readSnapshot(cns_Runtime* cns, cns_Storage* storage, int fd, int numThreads)
+{
+    cns_setlasterr(cns, cns_storage_readSnapshot_r(cns, storage, fd, numThreads));
+}
+
+cns_Error
+cns_storage_upsert_r(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Storage_UpsertFn fn, void* context)
+{
+    if (!cns || !storage || !key || !fn)
+        return CNS_ERR_BADARG;
+
+    if (storage->engine)
+    {
+        // no single lookup to share with other engines; read, compute and write back
+        cns_Bytes* current = 0;
+        cns_Error err = cns_storage_get_r(cns, storage, key, &current);
+        if (err)
+            return err;
+        cns_Bytes* value = fn(cns, key, current, context);
+        if (value)
+        {
+            err = cns_storage_set_r(cns, storage, key, value);
+            cns_bytes_free_r(cns, value);
+        }
+        if (current)
+            cns_bytes_free_r(cns, current);
+        return err;
+    }
+
+    _CNS_STATS(uint64_t startTime = _cns_stats_now();)
+    uint32_t keyhash = storage->byteshashfn(cns, key);
+    _cns_Storage_BucketItem* item = _cns_storage_itemForKey(cns, storage, key, keyhash, 0, 0);
+
+    // the callback sees compressed values decompressed
+    cns_Bytes* current = 0;
+    cns_Error err = item && item->rawLength ? _cns_storage_getCompressed(cns, storage, item, &current) : CNS_OK;
+    if (err)
+        return err;
+    cns_Bytes* value = fn(cns, key, item ? (current ? current : item->value) : 0, context);
+    if (current)
+        cns_bytes_free_r(cns, current);
+    if (value)
+    {
+        if (item)
+            err = _cns_storage_replaceValue(cns, storage, item, value, CNS_YES);
+        else
+            err = _cns_storage_insert(cns, storage, key, keyhash, value, CNS_YES, 0);
+        if (!err)
+            _cns_storage_commit(storage);
+    }
+    _CNS_STATS(_cns_stats_operation(storage, _CNS_OP_SET, startTime);)
+    return err;
+}
+
+void
+cns_storage_upsert(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Storage_UpsertFn fn, void* context)
+{
+    cns_setlasterr(cns, cns_storage_upsert_r(cns, storage, key, fn, context));
+}
+
+cns_Error
+cns_storage_getOrInsert_r(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bytes* value, cns_StorageEntry** out_entry, cns_Bool* out_inserted)
+{
+    if (!cns || !storage || !key || !value || !out_entry)
+        return CNS_ERR_BADARG;
+    if (storage->engine)
+        return CNS_ERR_UNSUPPORTED; // entries point into the memory storage's table
+
+    _CNS_STATS(uint64_t startTime = _cns_stats_now();)
+    uint32_t keyhash = storage->byteshashfn(cns, key);
+    _cns_Storage_BucketItem* item = _cns_storage_itemForKey(cns, storage, key, keyhash, 0, 0);
+
+    cns_Error err = CNS_OK;
+    cns_Bool inserted = CNS_NO;
+    if (!item)
+    {
+        cns_Bytes* valueCopy = 0;
+        err = cns_bytes_copy_r(cns, value, &valueCopy);
+        if (!err)
+            err = _cns_storage_insert(cns, storage, key, keyhash, valueCopy, CNS_NO, &item);
+        if (!err)
+        {
+            _cns_storage_commit(storage);
+            inserted = CNS_YES;
+        }
+    }
+    if (out_inserted)
+        *out_inserted = inserted;
+    *out_entry = (cns_StorageEntry*) item;
+    _CNS_STATS(_cns_stats_operation(storage, inserted ? _CNS_OP_SET : _CNS_OP_GET, startTime);)
+    return err;
+}
+
+cns_StorageEntry*
+cns_storage_getOrInsert(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bytes* value, cns_Bool* out_inserted)
+{
+    cns_StorageEntry* rv = 0;
+    cns_setlasterr(cns, cns_storage_getOrInsert_r(cns, storage, key, value, &rv, out_inserted));
+    return rv;
+}
+
+cns_Bytes*
+cns_storage_entryKey(cns_Runtime* cns, cns_StorageEntry* entry)
+{
+    if (!cns || !entry)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+    cns_setlasterr(cns, CNS_OK);
+    return ((_cns_Storage_BucketItem*) entry)->key;
+}
+
+cns_Bytes*
+cns_storage_entryValue(cns_Runtime* cns, cns_StorageEntry* entry)
+{
+    if (!cns || !entry)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+    _cns_Storage_BucketItem* item = (_cns_Storage_BucketItem*) entry;
+    if (item->rawLength)
+    {
+        // compressed by a write other than through the entry; there is no uncompressed value to lend
+        cns_setlasterr(cns, CNS_ERR_UNSUPPORTED);
+        return 0;
+    }
+    cns_setlasterr(cns, CNS_OK);
+    return item->value;
+}
+
+void
+cns_storage_entrySetValue(cns_Runtime* cns, cns_Storage* storage, cns_StorageEntry* entry, cns_Bytes* value)
+{
+    if (!cns || !storage || !entry || !value)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    if (storage->engine)
+    {
+        cns_setlasterr(cns, CNS_ERR_UNSUPPORTED);
+        return;
+    }
+
+    cns_Bytes* valueCopy = 0;
+    cns_Error err = cns_bytes_copy_r(cns, value, &valueCopy);
+    if (!err)
+        err = _cns_storage_replaceValue(cns, storage, (_cns_Storage_BucketItem*) entry, valueCopy, CNS_NO);
+    if (!err)
+        _cns_storage_commit(storage);
+    cns_setlasterr(cns, err);
+}
+
+cns_Error
+cns_storagebatch_new_r(cns_Runtime* cns, cns_StorageBatch** out_batch)
+{
+    if (!cns || !out_batch)
+        return CNS_ERR_BADARG;
+
+    cns_StorageBatch* batch = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, sizeof(cns_StorageBatch), (void**) &batch);
+    if (batch)
+        memset(batch, 0, sizeof(cns_StorageBatch));
+    *out_batch = batch;
+    return err;
+}
+
+cns_StorageBatch*
+cns_storagebatch_new(cns_Runtime* cns)
+{
+    cns_StorageBatch* batch = 0;
+    cns_setlasterr(cns, cns_storagebatch_new_r(cns, &batch));
+    return batch;
+}
+
+cns_Error
+cns_storagebatch_clear_r(cns_Runtime* cns, cns_StorageBatch* batch)
+{
+    if (!cns || !batch)
+        return CNS_ERR_BADARG;
+
+    for (cns_Index i = 0; i < batch->count; ++i)
+    {
+        cns_bytes_free_r(cns, batch->writes[i].key);
+        if (batch->writes[i].value)
+            cns_bytes_free_r(cns, batch->writes[i].value);
+    }
+    batch->count = 0;
+    return CNS_OK;
+}
+
+void
+cns_storagebatch_clear(cns_Runtime* cns, cns_StorageBatch* batch)
+{
+    cns_setlasterr(cns, cns_storagebatch_clear_r(cns, batch));
+}
+
+cns_Error
+cns_storagebatch_free_r(cns_Runtime* cns, cns_StorageBatch* batch)
+{
+    if (!cns || !batch)
+        return CNS_ERR_BADARG;
+
+    cns_storagebatch_clear_r(cns, batch);
+    if (batch->writes)
+        cns_runtime_free_r(cns, batch->writes);
+    cns_runtime_free_r(cns, batch);
+    return CNS_OK;
+}
+
+void
+cns_storagebatch_free(cns_Runtime* cns, cns_StorageBatch* batch)
+{
+    cns_setlasterr(cns, cns_storagebatch_free_r(cns, batch));
+}
+
+static cns_Error _cns_storagebatch_add(cns_Runtime* cns, cns_StorageBatch* batch, cns_Bytes* key, cns_Bytes* value)
+{
+    if (batch->count == batch->capacity)
+    {
+        cns_Index capacity = batch->capacity ? 2 * batch->capacity : 16;
+        void* writes = 0;
+        cns_Error err = _cns_runtime_reallocIn_r(cns, CNS_ALLOC_STORAGE, batch->writes, capacity * sizeof(_cns_StorageBatchWrite), &writes);
+        if (!writes)
+            return err;
+        batch->writes = (_cns_StorageBatchWrite*) writes;
+        batch->capacity = capacity;
+    }
+    _cns_StorageBatchWrite* write = &batch->writes[batch->count++];
+    cns_bytes_copy_r(cns, key, &write->key);
+    write->value = 0;
+    if (value)
+        cns_bytes_copy_r(cns, value, &write->value);
+    return CNS_OK;
+}
+
+void
+_cns_storagebatch_write(cns_StorageBatch* batch, cns_Index index, cns_Bytes** out_key, cns_Bytes** out_value)
+{
+    *out_key = batch->writes[index].key;
+    *out_value = batch->writes[index].value;
+}
+
+cns_Error
+cns_storagebatch_set_r(cns_Runtime* cns, cns_StorageBatch* batch, cns_Bytes* key, cns_Bytes* value)
+{
+    if (!cns || !batch || !key || !value)
+        return CNS_ERR_BADARG;
+    return _cns_storagebatch_add(cns, batch, key, value);
+}
+
+void
+cns_storagebatch_set(cns_Runtime* cns, cns_StorageBatch* batch, cns_Bytes* key, cns_Bytes* value)
+{
+    cns_setlasterr(cns, cns_storagebatch_set_r(cns, batch, key, value));
+}
+
+cns_Error
+cns_storagebatch_delete_r(cns_Runtime* cns, cns_StorageBatch* batch, cns_Bytes* key)
+{
+    if (!cns || !batch || !key)
+        return CNS_ERR_BADARG;
+    return _cns_storagebatch_add(cns, batch, key, 0);
+}
+
+void
+cns_storagebatch_delete(cns_Runtime* cns, cns_StorageBatch* batch, cns_Bytes* key)
+{
+    cns_setlasterr(cns, cns_storagebatch_delete_r(cns, batch, key));
+}
+
+cns_Error
+cns_storagebatch_count_r(cns_Runtime* cns, cns_StorageBatch* batch, cns_Index* out_count)
+{
+    if (!cns || !batch || !out_count)
+        return CNS_ERR_BADARG;
+    *out_count = batch->count;
+    return CNS_OK;
+}
+
+cns_Index
+cns_storagebatch_count(cns_Runtime* cns, cns_StorageBatch* batch)
+{
+    cns_Index count = 0;
+    cns_setlasterr(cns, cns_storagebatch_count_r(cns, batch, &count));
+    return count;
+}
+
+cns_Error
+cns_storage_apply_r(cns_Runtime* cns, cns_Storage* storage, cns_StorageBatch* batch)
+{
+    if (!cns || !storage || !batch)
+        return CNS_ERR_BADARG;
+    if (storage->engine)
+        return CNS_ERR_UNSUPPORTED;
+    if (!batch->count)
+        return CNS_OK;
+
+    // whatever may fail is done before the first write: room in the table, and the items and versions the writes may take
+    uint32_t* hashes = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, batch->count * sizeof(uint32_t), (void**) &hashes);
+    if (!hashes)
+        return err;
+    cns_Index sets = 0;
+    for (cns_Index i = 0; i < batch->count; ++i)
+    {
+        hashes[i] = storage->byteshashfn(cns, batch->writes[i].key);
+        sets += (batch->writes[i].value != 0);
+    }
+    err = cns_storage_reserve_r(cns, storage, storage->count + sets);
+    for (cns_Index i = 0; i < sets && !err; ++i)
+    {
+        _cns_Storage_BucketItem* item = 0;
+        err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE_ITEM, sizeof(_cns_Storage_BucketItem), (void**) &item);
+        if (item)
+        {
+            item->next = storage->spareItems;
+            storage->spareItems = item;
+        }
+    }
+    if (!err && storage->oldestView)
+        err = _cns_storage_versionTable(cns, storage);
+    for (cns_Index i = 0; storage->oldestView && i < batch->count && !err; ++i)
+    {
+        _cns_Storage_Version* version = 0;
+        err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE_ITEM, sizeof(_cns_Storage_Version), (void**) &version);
+        if (version)
+        {
+            version->nextSuperseded = storage->spareVersions;
+            storage->spareVersions = version;
+        }
+    }
+
+    for (cns_Index i = 0; i < batch->count && !err; ++i)
+    {
+        _cns_StorageBatchWrite* write = &batch->writes[i];
+        if (!write->value)
+        {
+            _cns_storage_delete(cns, storage, write->key, hashes[i], 0);
+            continue;
+        }
+        _cns_Storage_BucketItem* item = _cns_storage_itemForKey(cns, storage, write->key, hashes[i], 0, 0);
+        cns_Bytes* valueCopy = 0;
+        cns_bytes_copy_r(cns, write->value, &valueCopy);
+        if (item)
+            _cns_storage_replaceValue(cns, storage, item, valueCopy, CNS_YES);
+        else
+            _cns_storage_insert(cns, storage, write->key, hashes[i], valueCopy, CNS_YES, 0);
+    }
+    if (!err)
+        _cns_storage_commit(storage);
+
+    _cns_storage_releaseSpares(cns, storage);
+    cns_runtime_free_r(cns, hashes);
+    return err;
+}
+
+void
+cns_storage_apply(cns_Runtime* cns, cns_Storage* storage, cns_StorageBatch* batch)
+{
+    cns_setlasterr(cns, cns_storage_apply_r(cns, storage, batch));
+}
+
+// batches applied together spread their writes over threads when each gets at least this many
+#define _CNS_STORAGE_MINWRITESPERTHREAD 1024
+
+// a write of one of several batches applied together; `item` starts as the spare item a set may take and ends as the item
+// a delete unlinked, and `discarded` as the value a set replaced, for the calling thread to free
+typedef struct _cns_Storage_ApplyWrite
+{
+    cns_Bytes* key;
+    cns_Bytes* value; // NULL to delete the key
+    _cns_Storage_BucketItem* item;
+    cns_Bytes* discarded;
+    uint32_t hash;
+    int owner; // the thread whose buckets the key falls into
+} _cns_Storage_ApplyWrite;
+
+typedef struct _cns_Storage_ApplyJob
+{
+    cns_Runtime* cns;
+    cns_Storage* storage;
+    _cns_Storage_ApplyWrite* writes;
+    cns_Index begin;
+    cns_Index end;
+    cns_Index countChange;
+} _cns_Storage_ApplyJob;
+
+static void* _cns_storage_applyHashRange(void* arg)
+{
+    _cns_Storage_ApplyJob* job = (_cns_Storage_ApplyJob*) arg;
+    for (cns_Index i = job->begin; i < job->end; ++i)
+        job->writes[i].hash = job->storage->byteshashfn(job->cns, job->writes[i].key);
+    return 0;
+}
+
+// makes the writes of one thread, in log order; they all fall into its own range of buckets, and it neither allocates
+// nor frees
+static void* _cns_storage_applyRange(void* arg)
+{
+    _cns_Storage_ApplyJob* job = (_cns_Storage_ApplyJob*) arg;
+    cns_Storage* storage = job->storage;
+    for (cns_Index i = job->begin; i < job->end; ++i)
+    {
+        _cns_Storage_ApplyWrite* write = &job->writes[i];
+        _cns_Storage_BucketItem** bucket = 0;
+        _cns_Storage_BucketItem* previousitem = 0;
+        _cns_Storage_BucketItem* item = _cns_storage_itemForKey(job->cns, storage, write->key, write->hash, &bucket, &previousitem);
+        if (!write->value)
+        {
+            if (item)
+            {
+                if (previousitem)
+                    previousitem->next = item->next;
+                else
+                    *bucket = item->next;
+                --job->countChange;
+            }
+            write->item = item;
+            continue;
+        }
+        if (item)
+        {
+            write->discarded = item->value;
+            cns_bytes_copy_r(job->cns, write->value, &item->value);
+            item->rawLength = 0;
+            continue;
+        }
+        item = write->item;
+        write->item = 0;
+        cns_bytes_copy_r(job->cns, write->key, &item->key);
+        cns_bytes_copy_r(job->cns, write->value, &item->value);
+        item->hash = write->hash;
+        item->rawLength = 0;
+        item->next = *bucket;
+        *bucket = item;
+        ++job->countChange;
+    }
+    return 0;
+}
+
+// runs `fn` over `numJobs` jobs, the first on the calling thread
+static void _cns_storage_runApplyJobs(void* (*fn)(void*), _cns_Storage_ApplyJob* jobs, int numJobs)
+{
+    pthread_t threads[64];
+    int numStarted = 0;
+    for (int t = 1; t < numJobs; ++t)
+    {
+        if (pthread_create(&threads[numStarted], 0, fn, &jobs[t]))
+            fn(&jobs[t]); // could not start a thread, do its share here
+        else
+            ++numStarted;
+    }
+    fn(&jobs[0]);
+    for (int t = 0; t < numStarted; ++t)
+        pthread_join(threads[t], 0);
+}
+
+cns_Error
+cns_storage_applyBatches_r(cns_Runtime* cns, cns_Storage* storage, cns_StorageBatch** batches, cns_Index count, int numThreads)
+{
+    if (!cns || !storage || count < 0 || (count && !batches))
+        return CNS_ERR_BADARG;
+    cns_Index numWrites = 0;
+    cns_Index numCommits = 0;
+    for (cns_Index b = 0; b < count; ++b)
+    {
+        if (!batches[b])
+            return CNS_ERR_BADARG;
+        numWrites += batches[b]->count;
+        numCommits += (batches[b]->count != 0);
+    }
+    if (storage->engine)
+        return CNS_ERR_UNSUPPORTED;
+
+    if (numThreads > numWrites / _CNS_STORAGE_MINWRITESPERTHREAD)
+        numThreads = (int) (numWrites / _CNS_STORAGE_MINWRITESPERTHREAD);
+    if (numThreads > 64)
+        numThreads = 64;
+    // what watches, views, compression, interning and hot key caches do on a write either allocates or has to follow the
+    // log order
+    if (numThreads < 2 || storage->watches || storage->oldestView || storage->compressThreshold || storage->internFlags
+        || storage->hotKeys)
+    {
+        cns_Error err = CNS_OK;
+        for (cns_Index b = 0; b < count && !err; ++b)
+            err = cns_storage_apply_r(cns, storage, batches[b]);
+        return err;
+    }
+
+    // whatever may fail is done before the first write: room in the table, keys the workers can hash, and an item for every
+    // set
+    _cns_Storage_ApplyWrite* log = 0;
+    _cns_Storage_ApplyWrite* writes = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, 2 * numWrites * (cns_Index) sizeof(_cns_Storage_ApplyWrite), (void**) &log);
+    if (!log)
+        return err;
+    writes = log + numWrites;
+    cns_Index sets = 0;
+    cns_Index w = 0;
+    for (cns_Index b = 0; b < count; ++b)
+    {
+        for (cns_Index i = 0; i < batches[b]->count; ++i, ++w)
+        {
+            log[w].key = batches[b]->writes[i].key;
+            log[w].value = batches[b]->writes[i].value;
+            log[w].item = 0;
+            log[w].discarded = 0;
+            sets += (log[w].value != 0);
+        }
+    }
+    err = cns_storage_reserve_r(cns, storage, storage->count + sets);
+    for (cns_Index i = 0; i < numWrites && !err; ++i)
+    {
+        err = _cns_storage_flattenForHash(storage, log[i].key);
+        if (!err && log[i].value)
+            err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE_ITEM, sizeof(_cns_Storage_BucketItem), (void**) &log[i].item);
+    }
+    if (err)
+    {
+        for (cns_Index i = 0; i < numWrites; ++i)
+        {
+            if (log[i].item)
+                cns_runtime_free_r(cns, log[i].item);
+        }
+        cns_runtime_free_r(cns, log);
+        return err;
+    }
+
+    _cns_Storage_ApplyJob jobs[64];
+    for (int t = 0; t < numThreads; ++t)
+    {
+        jobs[t].cns = cns;
+        jobs[t].storage = storage;
+        jobs[t].writes = log;
+        jobs[t].begin = numWrites * t / numThreads;
+        jobs[t].end = numWrites * (t + 1) / numThreads;
+        jobs[t].countChange = 0;
+    }
+    _cns_storage_runApplyJobs(_cns_storage_applyHashRange, jobs, numThreads);
+
+    // thread `t` owns buckets [t * numBuckets / numThreads, (t + 1) * numBuckets / numThreads); every write to a key goes
+    // to the one owner of its bucket, and a stable counting sort keeps them in log order there
+    cns_Index numBuckets = (cns_Index) 1 << storage->log2numbuckets;
+    cns_Index starts[65] = { 0 };
+    for (cns_Index i = 0; i < numWrites; ++i)
+    {
+        cns_Index bucket = log[i].hash & (numBuckets - 1);
+        log[i].owner = (int) (bucket * numThreads / numBuckets);
+        ++starts[log[i].owner + 1];
+    }
+    for (int t = 0; t < numThreads; ++t)
+    {
+        starts[t + 1] += starts[t];
+        jobs[t].writes = writes;
+        jobs[t].begin = starts[t];
+        jobs[t].end = starts[t + 1];
+    }
+    for (cns_Index i = 0; i < numWrites; ++i)
+        writes[starts[log[i].owner]++] = log[i];
+    _cns_storage_runApplyJobs(_cns_storage_applyRange, jobs, numThreads);
+
+    for (int t = 0; t < numThreads; ++t)
+        storage->count += (int) jobs[t].countChange;
+    storage->sequence += (uint64_t) numCommits;
+    for (cns_Index i = 0; i < numWrites; ++i)
+    {
+        // spare items of sets which found their key, and items of deleted keys
+        if (writes[i].item && writes[i].value)
+            cns_runtime_free_r(cns, writes[i].item);
+        else if (writes[i].item)
+            _cns_item_free(cns, writes[i].item);
+        if (writes[i].discarded)
+            cns_bytes_free_r(cns, writes[i].discarded);
+    }
+    cns_runtime_free_r(cns, log);
+
+    // shrink the way deletes one at a time would
+    if (storage->log2numbuckets > 4 && 4 * storage->count < (1 << storage->log2numbuckets))
+    {
+        int base = storage->log2numbuckets;
+        while (base > 4 && 4 * storage->count < (1 << base))
+            base = base - 2 > 4 ? base - 2 : 4;
+        _cns_storage_changeCapacityBase(cns, storage, base);
+    }
+    return CNS_OK;
+}
+
+void
+cns_storage_applyBatches(cns_Runtime* cns, cns_Storage* storage, cns_StorageBatch** batches, cns_Index count, int numThreads)
+{
+    cns_setlasterr(cns, cns_storage_applyBatches_r(cns, storage, batches, count, numThreads));
+}
+
+uint64_t
+cns_storage_sequence(cns_Runtime* cns, cns_Storage* storage)
+{
+    if (!cns || !storage)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+    if (storage->engine)
+    {
+        cns_setlasterr(cns, CNS_ERR_UNSUPPORTED);
+        return 0;
+    }
+    cns_setlasterr(cns, CNS_OK);
+    return storage->sequence;
+}
+
+cns_StorageView*
+cns_storage_pin(cns_Runtime* cns, cns_Storage* storage)
+{
+    if (!cns || !storage)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+    if (storage->engine)
+    {
+        cns_setlasterr(cns, CNS_ERR_UNSUPPORTED);
+        return 0;
+    }
+
+    cns_StorageView* view = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, sizeof(cns_StorageView), (void**) &view);
+    if (view)
+    {
+        // sequences only grow, so the newest view goes last
+        view->storage = storage;
+        view->sequence = storage->sequence;
+        view->older = storage->newestView;
+        view->newer = 0;
+        if (storage->newestView)
+            storage->newestView->newer = view;
+        else
+            storage->oldestView = view;
+        storage->newestView = view;
+    }
+    cns_setlasterr(cns, err);
+    return view;
+}
+
+void
+cns_storage_unpin(cns_Runtime* cns, cns_StorageView* view)
+{
+    if (!cns || !view)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    cns_Storage* storage = view->storage;
+    if (view->older)
+        view->older->newer = view->newer;
+    else
+        storage->oldestView = view->newer;
+    if (view->newer)
+        view->newer->older = view->older;
+    else
+        storage->newestView = view->older;
+    cns_runtime_free_r(cns, view);
+    _cns_storage_releaseVersions(cns, storage, CNS_NO);
+    cns_setlasterr(cns, CNS_OK);
+}
+
+uint64_t
+cns_storage_viewSequence(cns_Runtime* cns, cns_StorageView* view)
+{
+    if (!cns || !view)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+    cns_setlasterr(cns, CNS_OK);
+    return view->sequence;
+}
+
+cns_Error
+cns_storage_viewGet_r(cns_Runtime* cns, cns_StorageView* view, cns_Bytes* key, cns_Bytes** out_value)
+{
+    if (!cns || !view || !key || !out_value)
+        return CNS_ERR_BADARG;
+
+    *out_value = 0;
+    cns_Storage* storage = view->storage;
+    uint32_t keyhash = storage->byteshashfn(cns, key);
+    _cns_Storage_Version* kept = 0;
+    for (_cns_Storage_Version* version = _cns_storage_newestVersion(storage, key, keyhash, 0); version && version->sequence > view->sequence; version = version->older)
+        kept = version;
+    if (kept)
+    {
+        if (kept->value && kept->rawLength)
+            return _cns_storage_decompress(cns, kept->value, kept->rawLength, out_value);
+        return kept->value ? cns_bytes_copy_r(cns, kept->value, out_value) : CNS_OK;
+    }
+
+    // not written since the view was pinned
+    _cns_Storage_BucketItem* item = _cns_storage_itemForKey(cns, storage, key, keyhash, 0, 0);
+    if (item && item->rawLength)
+        return _cns_storage_getCompressed(cns, storage, item, out_value);
+    return item ? cns_bytes_copy_r(cns, item->value, out_value) : CNS_OK;
+}
+
+cns_Bytes*
+cns_storage_viewGet(cns_Runtime* cns, cns_StorageView* view, cns_Bytes* key)
+{
+    cns_Bytes* rv = 0;
+    cns_setlasterr(cns, cns_storage_viewGet_r(cns, view, key, &rv));
+    return rv;
+}
+
+cns_Index
+cns_storage_count(cns_Runtime* cns, cns_Storage* storage)
+{
+    if (!cns || !storage)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+    return storage->engine ? storage->engine->count(storage) : storage->count;
+}
+
+
+static void _cns_storage_shapeStats(cns_Storage* storage, cns_StorageStats* out_stats)
+{
+    out_stats->count = storage->count;
+    for (cns_StorageView* view = storage->oldestView; view; view = view->newer)
+        ++out_stats->pinnedViews;
+    out_stats->retainedVersions = storage->versionCount;
+    out_stats->numBuckets = (cns_Index) 1 << storage->log2numbuckets;
+    out_stats->loadFactor = (double) storage->count / out_stats->numBuckets;
+
+    for (cns_Index i = 0; i < out_stats->numBuckets; ++i)
+    {
+        cns_Index length = 0;
+        for (_cns_Storage_BucketItem* item = storage->buckets[i]; item; item = item->next)
+            ++length;
+        if (length > out_stats->longestChain)
+            out_stats->longestChain = length;
+        for (_cns_Storage_BucketItem* item = storage->buckets[i]; item; item = item->next)
+        {
+            if (!item->rawLength)
+                continue;
+            out_stats->compressedCount += 1;
+            out_stats->compressedBytes += cns_bytes_lengthUnchecked(item->value);
+            out_stats->uncompressedBytes += item->rawLength;
+        }
+        out_stats->chainLengths[length < CNS_STATS_CHAIN_BUCKETS ? length : CNS_STATS_CHAIN_BUCKETS - 1] += 1;
+    }
+
+    for (cns_Index i = 0; storage->internslots && i < ((cns_Index) 1 << storage->log2numinternslots); ++i)
+    {
+        _cns_BytesImpl* impl = (_cns_BytesImpl*) storage->internslots[i].bytes;
+        if (!impl)
+            continue;
+        cns_Index size = sizeof(_cns_BytesImpl) + impl->length;
+        int references = atomic_load_explicit(&impl->referenceCount, memory_order_relaxed);
+        out_stats->internedCount += 1;
+        out_stats->internedBytes += size;
+        // without the table, every holder but one would have a block of its own
+        if (references > 2)
+            out_stats->internSavedBytes += (references - 2) * size;
+    }
+}
+
+void
+cns_storage_stats(cns_Runtime* cns, cns_Storage* storage, cns_StorageStats* out_stats)
+{
+    if (!cns || !storage || !out_stats)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    memset(out_stats, 0, sizeof(cns_StorageStats));
+    if (storage->engine)
+        storage->engine->stats(cns, storage, out_stats);
+    else
+        _cns_storage_shapeStats(storage, out_stats);
+
+#ifdef CNS_ENABLE_STATS
+    out_stats->instrumented = CNS_YES;
+    for (int shard = 0; shard < _CNS_STATS_SHARDS; ++shard)
+    {
+        _cns_StorageCounters* counters = &storage->counters[shard].counters;
+        out_stats->gets += atomic_load_explicit(&counters->operations[_CNS_OP_GET], memory_order_relaxed);
+        out_stats->sets += atomic_load_explicit(&counters->operations[_CNS_OP_SET], memory_order_relaxed);
+        out_stats->deletes += atomic_load_explicit(&counters->operations[_CNS_OP_DELETE], memory_order_relaxed);
+        for (int i = 0; i < CNS_STATS_LATENCY_BUCKETS; ++i)
+        {
+            out_stats->getLatency[i] += atomic_load_explicit(&counters->latency[_CNS_OP_GET][i], memory_order_relaxed);
+            out_stats->setLatency[i] += atomic_load_explicit(&counters->latency[_CNS_OP_SET][i], memory_order_relaxed);
+            out_stats->deleteLatency[i] += atomic_load_explicit(&counters->latency[_CNS_OP_DELETE][i], memory_order_relaxed);
+        }
+        for (int i = 0; i < CNS_STATS_PROBE_BUCKETS; ++i)
+            out_stats->probes[i] += atomic_load_explicit(&counters->probes[i], memory_order_relaxed);
+        out_stats->resizes += atomic_load_explicit(&counters->resizes, memory_order_relaxed);
+        out_stats->resizeNanoseconds += atomic_load_explicit(&counters->resizeNanoseconds, memory_order_relaxed);
+        out_stats->allocFailures += atomic_load_explicit(&counters->allocFailures, memory_order_relaxed);
+        out_stats->compressedGets += atomic_load_explicit(&counters->compressedGets, memory_order_relaxed);
+        out_stats->decompressCacheHits += atomic_load_explicit(&counters->decompressCacheHits, memory_order_relaxed);
+        out_stats->decompressNanoseconds += atomic_load_explicit(&counters->decompressNanoseconds, memory_order_relaxed);
+    }
+#endif
+    cns_setlasterr(cns, CNS_OK);
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+// Private interface between `cns_Storage` and the modules built on it: the engines other than the memory one, snapshot
+// streams, watches, traces, hot key trackers and hosts.
+
+#include <consensual/storage.h>
+#include <consensual/hotkeys.h>
+#include <consensual/trace.h>
+#include <consensual/watch.h>
+
+/** Operations of a storage engine. Arguments are validated by the public functions before these are called.
+ */
+typedef struct _cns_StorageEngine
+{
+    cns_Error   (* set)(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bytes* value);
+    /** Leaves `*out_value` NULL if there is no value for the key. */
+    cns_Error   (* get)(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bytes** out_value);
+    cns_Error   (* remove)(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bool* out_existed);
+    cns_Index   (* count)(cns_Storage* storage);
+    /** Fills what describes the data; `out_stats` is zeroed and operation counters are added by the caller. */
+    void        (* stats)(cns_Runtime* cns, cns_Storage* storage, cns_StorageStats* out_stats);
+    /** Releases the engine state; the storage object itself is freed by the caller. */
+    void        (* free)(cns_Runtime* cns, cns_Storage* storage);
+} _cns_StorageEngine;
+
+/** Creates a storage whose operations go to `engine`. Sets the last error.
+ */
+cns_Storage*
+_cns_storage_newWithEngine(cns_Runtime* cns, const _cns_StorageEngine* engine, void* engineState);
+
+/** NULL for memory storages. */
+const _cns_StorageEngine*
+_cns_storage_engine(cns_Storage* storage);
+
+void*
+_cns_storage_engineState(cns_Storage* storage);
+
+/** Calls `fn` for each key and value of a memory storage, in no particular order. Only reads the storage.
+ * Values are passed as stored, so the storage must not compress them.
+ */
+void
+_cns_storage_forEach(cns_Storage* storage, void (* fn)(void* context, cns_Bytes* key, cns_Bytes* value), void* context);
+
+/** Like `_cns_storage_forEach`, also passing the uncompressed length of values stored compressed, 0 for the others.
+ */
+void
+_cns_storage_forEachStored(cns_Storage* storage, void (* fn)(void* context, cns_Bytes* key, cns_Bytes* value, uint32_t rawLength), void* context);
+
+/** Sets a value of a memory storage as it was stored in another one: LZ4 compressed if `rawLength` is not 0, and then
+ * never compressed again.
+ */
+cns_Error
+_cns_storage_setStored(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bytes* value, uint32_t rawLength);
+
+/** Exchanges the keys and values of two memory storages, as a commit of `storage`; settings stay where they are. Fails
+ * with CNS_ERR_BADARG unless both are memory storages with the same hash function and no pinned views.
+ */
+cns_Error
+_cns_storage_swapItems(cns_Storage* storage, cns_Storage* other);
+
+/** Head of the list of watches of a memory storage, which the watch module links them into.
+ */
+cns_Watch**
+_cns_storage_watches(cns_Storage* storage);
+
+/** Where the trace of a storage of any engine hangs, which the trace module sets.
+ */
+cns_Trace**
+_cns_storage_trace(cns_Storage* storage);
+
+/** Where the hot key tracker of a memory storage hangs, which the hot keys module sets.
+ */
+cns_HotKeys**
+_cns_storage_hotKeys(cns_Storage* storage);
+
+/** Write `index` of the batch; `*out_value` is NULL for a delete.
+ */
+void
+_cns_storagebatch_write(cns_StorageBatch* batch, cns_Index index, cns_Bytes** out_key, cns_Bytes** out_value);
+
+// Hooks of the watch module, which the memory storage calls only while it has watches.
+
+/** Whether any of the `watches` follows `key`.
+ */
+cns_Bool
+_cns_watch_matches(cns_Watch* watches, cns_Bytes* key);
+
+/** Queues the change of `key` from `oldValue` to `newValue`, either being NULL for no value, to the watches following the
+ * key; they hand it to their consumers at the next `_cns_watch_publish`.
+ */
+void
+_cns_watch_notify(cns_Runtime* cns, cns_Watch* watches, uint64_t sequence, cns_Bytes* key, cns_Bytes* oldValue, cns_Bytes* newValue);
+
+/** Counts a change the watches following `key`, or all of them if it is NULL, cannot be told about.
+ */
+void
+_cns_watch_miss(cns_Watch* watches, cns_Bytes* key);
+
+/** Hands the changes queued since the last call to the consumers; called when a commit ends.
+ */
+void
+_cns_watch_publish(cns_Watch* watches);
+
+// Hooks of the trace module, which storages call only while traced.
+
+/** Monotonic clock the trace times operations with, in nanoseconds.
+ */
+uint64_t
+_cns_trace_now(void);
+
+/** Records an operation which started at `start`; `value` is the value set or found, NULL for none.
+ */
+void
+_cns_trace_record(cns_Runtime* cns, cns_Trace* trace, int op, uint64_t start, cns_Bytes* key, cns_Bytes* value, cns_Bool hit, cns_Error err);
+
+// Hooks of the hot keys module, which the memory storage calls only while its keys are tracked.
+
+/** Counts a get of `key`, and serves it from the cache of the calling thread if it holds a current value. Returns
+ * whether it did; `*out_value` is only set if so.
+ */
+cns_Bool
+_cns_hotkeys_get(cns_Runtime* cns, cns_HotKeys* hotKeys, cns_Bytes* key, uint32_t keyhash, cns_Bytes** out_value);
+
+/** Offers the value a get found in the table to the cache of the calling thread, which keeps a copy if the key is hot.
+ */
+void
+_cns_hotkeys_fill(cns_Runtime* cns, cns_HotKeys* hotKeys, cns_Bytes* key, uint32_t keyhash, cns_Bytes* value);
+
+/** Outdates what caches hold for the key; called for every write, before the next get.
+ */
+void
+_cns_hotkeys_written(cns_HotKeys* hotKeys, uint32_t keyhash);
+
+/** Outdates everything caches hold, when the whole content changes.
+ */
+void
+_cns_hotkeys_writtenAll(cns_HotKeys* hotKeys);
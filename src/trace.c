@@ -0,0 +1,469 @@
+#include <consensual/trace.h>
+#include <consensual/bytes_impl.h>
+#include <consensual/wire.h>
+#include "storage_engine.h"
+#include "runtime_impl.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h> // memcpy, memmove, memcmp
+#include <time.h>
+#include <unistd.h>
+
+#define _CNS_TRACE_MAGIC "CNSTRACE"
+#define _CNS_TRACE_VERSION 1
+#define _CNS_TRACE_KEYS 1
+#define _CNS_TRACE_VALUES 2
+#define _CNS_TRACE_HIT 0x10
+#define _CNS_TRACE_FAILED 0x20
+#define _CNS_TRACE_MAXHEAD (1 + 5 * CNS_WIRE_MAXVARINT + 8) // a record without its key and value
+
+struct cns_Trace
+{
+    cns_Storage*        storage;
+    int                 fd;
+    cns_TraceOptions    options;
+    uint64_t            startTime; // of `_cns_trace_now`, which record times count from
+    pthread_mutex_t     mutex; // the rest is written under it
+    uint8_t*            buffer;
+    cns_Index           used;
+    uint64_t            lastStart; // of the record before
+    cns_Error           err; // of the first write which failed; nothing is written after it
+    cns_TraceStats      stats;
+};
+
+struct cns_TraceReader
+{
+    int         fd;
+    unsigned    flags;
+    uint8_t*    buffer;
+    cns_Index   capacity;
+    cns_Index   begin; // of what is read and not parsed yet
+    cns_Index   end;
+    cns_Bool    eof;
+    uint64_t    time; // start of the record before
+};
+
+static atomic_uint _cns_trace_nextThread;
+static _Thread_local uint32_t _cns_trace_thread; // 1 more than the number of the thread, 0 until it records
+
+uint64_t
+_cns_trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static int _cns_trace_writeAll(int fd, const void * ptr, size_t size)
+{
+    while (size)
+    {
+        ssize_t n = write(fd, ptr, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        ptr = (const uint8_t*) ptr + n;
+        size -= (size_t) n;
+    }
+    return 0;
+}
+
+static void _cns_trace_flush(cns_Trace* trace)
+{
+    if (trace->used && !trace->err && _cns_trace_writeAll(trace->fd, trace->buffer, (size_t) trace->used))
+        trace->err = CNS_ERR_IO;
+    trace->used = 0;
+}
+
+static void _cns_trace_append(cns_Trace* trace, const void * ptr, cns_Index length)
+{
+    if (trace->used + length > trace->options.bufferSize)
+        _cns_trace_flush(trace);
+    if (length <= trace->options.bufferSize)
+    {
+        memcpy(trace->buffer + trace->used, ptr, (size_t) length);
+        trace->used += length;
+    }
+    else if (!trace->err && _cns_trace_writeAll(trace->fd, ptr, (size_t) length))
+        trace->err = CNS_ERR_IO;
+}
+
+static void _cns_trace_appendBytes(cns_Trace* trace, cns_Bytes* bytes)
+{
+    cns_BytesChunks chunks;
+    cns_bytes_chunksBeginUnchecked(bytes, &chunks);
+    const void * ptr = 0;
+    cns_Index length = 0;
+    while (cns_bytes_chunksNextUnchecked(&chunks, &ptr, &length))
+        _cns_trace_append(trace, ptr, length);
+}
+
+static void _cns_trace_put64(uint8_t* out, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i)
+        out[i] = (uint8_t) (value >> (8 * i));
+}
+
+static uint64_t _cns_trace_get64(const uint8_t* ptr)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i)
+        value |= (uint64_t) ptr[i] << (8 * i);
+    return value;
+}
+
+uint64_t
+cns_trace_hashKey(cns_Runtime* cns, cns_Bytes* key)
+{
+    // FNV-1a, which goes byte by byte and so does not depend on how the key is cut into pieces
+    uint64_t hash = 14695981039346656037ull;
+    if (!cns || !key)
+        return hash;
+    cns_BytesChunks chunks;
+    cns_bytes_chunksBeginUnchecked(key, &chunks);
+    const void * ptr = 0;
+    cns_Index length = 0;
+    while (cns_bytes_chunksNextUnchecked(&chunks, &ptr, &length))
+    {
+        for (cns_Index i = 0; i < length; ++i)
+            hash = (hash ^ ((const uint8_t*) ptr)[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+void
+_cns_trace_record(cns_Runtime* cns, cns_Trace* trace, int op, uint64_t start, cns_Bytes* key, cns_Bytes* value, cns_Bool hit, cns_Error err)
+{
+    uint64_t duration = _cns_trace_now() - start;
+    start -= trace->startTime;
+    if (!_cns_trace_thread)
+        _cns_trace_thread = atomic_fetch_add_explicit(&_cns_trace_nextThread, 1, memory_order_relaxed) + 1;
+    uint64_t keyHash = cns_trace_hashKey(cns, key);
+    cns_Index keyLength = cns_bytes_lengthUnchecked(key);
+
+    uint8_t head[_CNS_TRACE_MAXHEAD];
+    head[0] = (uint8_t) (op | (hit ? _CNS_TRACE_HIT : 0) | (err ? _CNS_TRACE_FAILED : 0));
+    cns_Index length = 1;
+    pthread_mutex_lock(&trace->mutex);
+    if (trace->err)
+    {
+        ++trace->stats.dropped;
+        pthread_mutex_unlock(&trace->mutex);
+        return;
+    }
+    // operations on several threads reach here out of the order they started in, so the difference may be negative
+    int64_t delta = (int64_t) (start - trace->lastStart);
+    trace->lastStart = start;
+    length += cns_wire_encodeVarint(((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63), head + length);
+    length += cns_wire_encodeVarint(duration, head + length);
+    length += cns_wire_encodeVarint(_cns_trace_thread - 1, head + length);
+    _cns_trace_put64(head + length, keyHash);
+    length += 8;
+    length += cns_wire_encodeVarint((uint64_t) keyLength, head + length);
+    if (value)
+        length += cns_wire_encodeVarint((uint64_t) cns_bytes_lengthUnchecked(value), head + length);
+    _cns_trace_append(trace, head, length);
+    if (trace->options.keys)
+    {
+        _cns_trace_appendBytes(trace, key);
+        length += keyLength;
+    }
+    if (trace->options.values && op == CNS_TRACE_SET)
+    {
+        _cns_trace_appendBytes(trace, value);
+        length += cns_bytes_lengthUnchecked(value);
+    }
+    ++trace->stats.records;
+    trace->stats.bytes += (uint64_t) length;
+    pthread_mutex_unlock(&trace->mutex);
+}
+
+void
+cns_traceoptions_default(cns_TraceOptions* out_options)
+{
+    if (!out_options)
+        return;
+    out_options->keys = CNS_NO;
+    out_options->values = CNS_NO;
+    out_options->bufferSize = 1 << 20;
+}
+
+cns_Trace*
+cns_trace_start(cns_Runtime* cns, cns_Storage* storage, const char * path, const cns_TraceOptions* options)
+{
+    cns_TraceOptions defaults;
+    cns_traceoptions_default(&defaults);
+    if (!options)
+        options = &defaults;
+    if (!cns || !storage || !path || options->bufferSize < _CNS_TRACE_MAXHEAD || *_cns_storage_trace(storage))
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+
+    cns_Trace* trace = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_IO, sizeof(cns_Trace), (void**) &trace);
+    if (!trace)
+    {
+        cns_setlasterr(cns, err);
+        return 0;
+    }
+    memset(trace, 0, sizeof(cns_Trace));
+    trace->storage = storage;
+    trace->options = *options;
+    err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_IO, options->bufferSize, (void**) &trace->buffer);
+    trace->fd = err ? -1 : open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (!err && trace->fd < 0)
+        err = CNS_ERR_IO;
+    if (err)
+    {
+        cns_runtime_free_r(cns, trace->buffer);
+        cns_runtime_free_r(cns, trace);
+        cns_setlasterr(cns, err);
+        return 0;
+    }
+    pthread_mutex_init(&trace->mutex, 0);
+
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    uint8_t header[sizeof(_CNS_TRACE_MAGIC) - 1 + 2 * CNS_WIRE_MAXVARINT + 8];
+    cns_Index length = sizeof(_CNS_TRACE_MAGIC) - 1;
+    memcpy(header, _CNS_TRACE_MAGIC, (size_t) length);
+    length += cns_wire_encodeVarint(_CNS_TRACE_VERSION, header + length);
+    length += cns_wire_encodeVarint((options->keys ? _CNS_TRACE_KEYS : 0) | (options->values ? _CNS_TRACE_VALUES : 0), header + length);
+    _cns_trace_put64(header + length, (uint64_t) wall.tv_sec * 1000000000u + (uint64_t) wall.tv_nsec);
+    length += 8;
+    _cns_trace_append(trace, header, length);
+    trace->stats.bytes = (uint64_t) length;
+
+    trace->startTime = _cns_trace_now();
+    *_cns_storage_trace(storage) = trace;
+    cns_setlasterr(cns, CNS_OK);
+    return trace;
+}
+
+cns_Error
+cns_trace_stop_r(cns_Runtime* cns, cns_Trace* trace)
+{
+    if (!cns || !trace)
+        return CNS_ERR_BADARG;
+
+    *_cns_storage_trace(trace->storage) = 0;
+    _cns_trace_flush(trace);
+    cns_Error err = trace->err;
+    if (close(trace->fd) && !err)
+        err = CNS_ERR_IO;
+    pthread_mutex_destroy(&trace->mutex);
+    cns_runtime_free_r(cns, trace->buffer);
+    cns_runtime_free_r(cns, trace);
+    return err;
+}
+
+void
+cns_trace_stop(cns_Runtime* cns, cns_Trace* trace)
+{
+    cns_setlasterr(cns, cns_trace_stop_r(cns, trace));
+}
+
+void
+cns_trace_stats(cns_Runtime* cns, cns_Trace* trace, cns_TraceStats* out_stats)
+{
+    if (!cns || !trace || !out_stats)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+    pthread_mutex_lock(&trace->mutex);
+    *out_stats = trace->stats;
+    pthread_mutex_unlock(&trace->mutex);
+    cns_setlasterr(cns, CNS_OK);
+}
+
+// makes `need` bytes available from `begin` on, unless the file ends first
+static cns_Error _cns_tracereader_fill(cns_Runtime* cns, cns_TraceReader* reader, cns_Index need)
+{
+    if (reader->end - reader->begin >= need || reader->eof)
+        return CNS_OK;
+    memmove(reader->buffer, reader->buffer + reader->begin, (size_t) (reader->end - reader->begin));
+    reader->end -= reader->begin;
+    reader->begin = 0;
+    if (need > reader->capacity)
+    {
+        void* grown = 0;
+        cns_Error err = _cns_runtime_reallocIn_r(cns, CNS_ALLOC_IO, reader->buffer, need, &grown);
+        if (!grown)
+            return err;
+        reader->buffer = grown;
+        reader->capacity = need;
+    }
+    while (reader->end < need)
+    {
+        ssize_t n = read(reader->fd, reader->buffer + reader->end, (size_t) (reader->capacity - reader->end));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return CNS_ERR_IO;
+        if (n == 0)
+        {
+            reader->eof = CNS_YES;
+            break;
+        }
+        reader->end += n;
+    }
+    return CNS_OK;
+}
+
+static cns_Bool _cns_tracereader_varint(cns_TraceReader* reader, uint64_t* out_value)
+{
+    cns_Index n = cns_wire_decodeVarint(reader->buffer + reader->begin, reader->end - reader->begin, out_value);
+    reader->begin += n;
+    return n > 0;
+}
+
+static cns_Error _cns_tracereader_bytes(cns_Runtime* cns, cns_TraceReader* reader, cns_Index length, cns_Bytes** out_bytes)
+{
+    cns_Error err = _cns_tracereader_fill(cns, reader, length);
+    if (err)
+        return err;
+    if (reader->end - reader->begin < length)
+        return CNS_ERR_MALFORMED;
+    err = cns_bytes_new_r(cns, reader->buffer + reader->begin, length, out_bytes);
+    reader->begin += length;
+    return err;
+}
+
+cns_TraceReader*
+cns_tracereader_open(cns_Runtime* cns, const char * path)
+{
+    if (!cns || !path)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+
+    cns_TraceReader* reader = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_IO, sizeof(cns_TraceReader), (void**) &reader);
+    if (!reader)
+    {
+        cns_setlasterr(cns, err);
+        return 0;
+    }
+    memset(reader, 0, sizeof(cns_TraceReader));
+    reader->capacity = 1 << 16;
+    err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_IO, reader->capacity, (void**) &reader->buffer);
+    reader->fd = err ? -1 : open(path, O_RDONLY | O_CLOEXEC);
+    if (!err && reader->fd < 0)
+        err = CNS_ERR_IO;
+
+    const cns_Index magicLength = sizeof(_CNS_TRACE_MAGIC) - 1;
+    uint64_t version = 0, flags = 0;
+    if (!err)
+        err = _cns_tracereader_fill(cns, reader, magicLength + 2 * CNS_WIRE_MAXVARINT + 8);
+    if (!err && (reader->end < magicLength || memcmp(reader->buffer, _CNS_TRACE_MAGIC, (size_t) magicLength)))
+        err = CNS_ERR_MALFORMED;
+    reader->begin = magicLength;
+    if (!err && (!_cns_tracereader_varint(reader, &version) || version != _CNS_TRACE_VERSION
+                 || !_cns_tracereader_varint(reader, &flags) || reader->end - reader->begin < 8))
+        err = CNS_ERR_MALFORMED;
+    if (err)
+    {
+        if (reader->fd >= 0)
+            close(reader->fd);
+        cns_runtime_free_r(cns, reader->buffer);
+        cns_runtime_free_r(cns, reader);
+        cns_setlasterr(cns, err);
+        return 0;
+    }
+    reader->begin += 8; // the wall clock start, which replays have no use for
+    reader->flags = (unsigned) flags;
+    cns_setlasterr(cns, CNS_OK);
+    return reader;
+}
+
+void
+cns_tracereader_close(cns_Runtime* cns, cns_TraceReader* reader)
+{
+    if (!cns || !reader)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+    close(reader->fd);
+    cns_runtime_free_r(cns, reader->buffer);
+    cns_runtime_free_r(cns, reader);
+    cns_setlasterr(cns, CNS_OK);
+}
+
+void
+cns_tracereader_options(cns_TraceReader* reader, cns_TraceOptions* out_options)
+{
+    if (!reader || !out_options)
+        return;
+    out_options->keys = (reader->flags & _CNS_TRACE_KEYS) ? CNS_YES : CNS_NO;
+    out_options->values = (reader->flags & _CNS_TRACE_VALUES) ? CNS_YES : CNS_NO;
+    out_options->bufferSize = 0;
+}
+
+cns_Error
+cns_tracereader_next_r(cns_Runtime* cns, cns_TraceReader* reader, cns_TraceRecord* out_record, cns_Bool* out_more)
+{
+    if (!cns || !reader || !out_record || !out_more)
+        return CNS_ERR_BADARG;
+
+    memset(out_record, 0, sizeof(cns_TraceRecord));
+    *out_more = CNS_NO;
+    cns_Error err = _cns_tracereader_fill(cns, reader, _CNS_TRACE_MAXHEAD);
+    if (err)
+        return err;
+    if (reader->begin == reader->end)
+        return CNS_OK;
+
+    uint8_t head = reader->buffer[reader->begin++];
+    uint64_t delta = 0, duration = 0, thread = 0, keyLength = 0, valueLength = 0;
+    int op = head & 0x0f;
+    out_record->hit = (head & _CNS_TRACE_HIT) ? CNS_YES : CNS_NO;
+    out_record->failed = (head & _CNS_TRACE_FAILED) ? CNS_YES : CNS_NO;
+    cns_Bool hasValue = op == CNS_TRACE_SET || (op == CNS_TRACE_GET && out_record->hit);
+    if (op < CNS_TRACE_SET || op > CNS_TRACE_DELETE
+        || !_cns_tracereader_varint(reader, &delta) || !_cns_tracereader_varint(reader, &duration)
+        || !_cns_tracereader_varint(reader, &thread) || reader->end - reader->begin < 8)
+        return CNS_ERR_MALFORMED;
+    out_record->keyHash = _cns_trace_get64(reader->buffer + reader->begin);
+    reader->begin += 8;
+    if (!_cns_tracereader_varint(reader, &keyLength) || (hasValue && !_cns_tracereader_varint(reader, &valueLength))
+        || keyLength > INTPTR_MAX || valueLength > INTPTR_MAX || thread > UINT32_MAX)
+        return CNS_ERR_MALFORMED;
+
+    reader->time += (delta >> 1) ^ (0 - (delta & 1));
+    out_record->op = op;
+    out_record->time = reader->time;
+    out_record->duration = duration;
+    out_record->thread = (uint32_t) thread;
+    out_record->keyLength = (cns_Index) keyLength;
+    out_record->valueLength = (cns_Index) valueLength;
+    if (reader->flags & _CNS_TRACE_KEYS)
+        err = _cns_tracereader_bytes(cns, reader, out_record->keyLength, &out_record->key);
+    if (!err && (reader->flags & _CNS_TRACE_VALUES) && op == CNS_TRACE_SET)
+        err = _cns_tracereader_bytes(cns, reader, out_record->valueLength, &out_record->value);
+    if (err)
+    {
+        if (out_record->key)
+            cns_bytes_free_r(cns, out_record->key);
+        out_record->key = 0;
+        return err;
+    }
+    *out_more = CNS_YES;
+    return CNS_OK;
+}
+
+cns_Bool
+cns_tracereader_next(cns_Runtime* cns, cns_TraceReader* reader, cns_TraceRecord* out_record)
+{
+    cns_Bool rv = CNS_NO;
+    cns_setlasterr(cns, cns_tracereader_next_r(cns, reader, out_record, &rv));
+    return rv;
+}
@@ -0,0 +1,227 @@
+#include <consensual/u64storage.h>
+#include "runtime_impl.h"
+
+#include <string.h> // memset
+
+// a slot is empty when its value is NULL, so every key value including 0 can be stored
+typedef struct _cns_U64Storage_Slot
+{
+    uint64_t key;
+    cns_Bytes* value;
+} _cns_U64Storage_Slot;
+
+struct cns_U64Storage
+{
+    int log2numslots;
+    cns_Index count;
+    _cns_U64Storage_Slot* slots; // linear probing, at most three quarters full
+};
+
+#define _CNS_U64STORAGE_MINBASE 4
+
+// MurmurHash3 fmix64: every output bit depends on every key bit, so sequential ids spread over the table
+static uint64_t _cns_u64storage_hash(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static uint64_t _cns_u64storage_find(cns_U64Storage* storage, uint64_t key)
+{
+    uint64_t mask = ((uint64_t) 1 << storage->log2numslots) - 1;
+    uint64_t i = _cns_u64storage_hash(key) & mask;
+    while (storage->slots[i].value && storage->slots[i].key != key)
+        i = (i + 1) & mask;
+    return i;
+}
+
+static cns_Error _cns_u64storage_resize(cns_Runtime* cns, cns_U64Storage* storage, int base)
+{
+    cns_Index memsize = ((cns_Index) 1 << base) * sizeof(_cns_U64Storage_Slot);
+    _cns_U64Storage_Slot* slots = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, memsize, (void**) &slots);
+    if (!slots)
+        return err;
+    memset(slots, 0, memsize);
+
+    _cns_U64Storage_Slot* old_slots = storage->slots;
+    cns_Index old_numslots = storage->slots ? (cns_Index) 1 << storage->log2numslots : 0;
+    uint64_t mask = ((uint64_t) 1 << base) - 1;
+    for (cns_Index j = 0; j < old_numslots; ++j)
+    {
+        if (!old_slots[j].value)
+            continue;
+        uint64_t i = _cns_u64storage_hash(old_slots[j].key) & mask;
+        while (slots[i].value)
+            i = (i + 1) & mask;
+        slots[i] = old_slots[j];
+    }
+    storage->slots = slots;
+    storage->log2numslots = base;
+    if (old_slots)
+        cns_runtime_free_r(cns, old_slots);
+    return CNS_OK;
+}
+
+cns_U64Storage*
+cns_u64storage_new(cns_Runtime* cns, cns_Index capacity)
+{
+    if (!cns || capacity < 0)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+
+    cns_U64Storage* rv = 0;
+    cns_setlasterr(cns, _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, sizeof(cns_U64Storage), (void**) &rv));
+    if (rv)
+    {
+        rv->count = 0;
+        rv->slots = 0;
+        int base = _CNS_U64STORAGE_MINBASE;
+        while (base < 40 && 3 * ((cns_Index) 1 << base) < 4 * capacity)
+            ++base;
+        cns_Error err = _cns_u64storage_resize(cns, rv, base);
+        if (err)
+        {
+            cns_runtime_free(cns, rv);
+            cns_setlasterr(cns, err);
+            return 0;
+        }
+        cns_setlasterr(cns, CNS_OK);
+    }
+    return rv;
+}
+
+void
+cns_u64storage_free(cns_Runtime* cns, cns_U64Storage* storage)
+{
+    if (!cns || !storage)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    for (cns_Index i = 0; i < ((cns_Index) 1 << storage->log2numslots); ++i)
+    {
+        if (storage->slots[i].value)
+            cns_bytes_free_r(cns, storage->slots[i].value);
+    }
+    cns_runtime_free(cns, storage->slots);
+    cns_runtime_free(cns, storage);
+    cns_setlasterr(cns, CNS_OK);
+}
+
+cns_Error
+cns_u64storage_set_r(cns_Runtime* cns, cns_U64Storage* storage, uint64_t key, cns_Bytes* value)
+{
+    if (!cns || !storage || !value)
+        return CNS_ERR_BADARG;
+
+    uint64_t i = _cns_u64storage_find(storage, key);
+    _cns_U64Storage_Slot* slot = &storage->slots[i];
+    if (!slot->value && 4 * (storage->count + 1) > 3 * ((cns_Index) 1 << storage->log2numslots))
+    {
+        cns_Error err = _cns_u64storage_resize(cns, storage, storage->log2numslots + 1);
+        if (err)
+            return err;
+        slot = &storage->slots[_cns_u64storage_find(storage, key)];
+    }
+
+    cns_Bytes* valueCopy = 0;
+    cns_Error err = cns_bytes_copy_r(cns, value, &valueCopy);
+    if (err)
+        return err;
+
+    if (slot->value)
+        cns_bytes_free_r(cns, slot->value);
+    else
+        ++storage->count;
+    slot->key = key;
+    slot->value = valueCopy;
+    return CNS_OK;
+}
+
+void
+cns_u64storage_set(cns_Runtime* cns, cns_U64Storage* storage, uint64_t key, cns_Bytes* value)
+{
+    cns_setlasterr(cns, cns_u64storage_set_r(cns, storage, key, value));
+}
+
+cns_Error
+cns_u64storage_get_r(cns_Runtime* cns, cns_U64Storage* storage, uint64_t key, cns_Bytes** out_value)
+{
+    if (!cns || !storage || !out_value)
+        return CNS_ERR_BADARG;
+
+    _cns_U64Storage_Slot* slot = &storage->slots[_cns_u64storage_find(storage, key)];
+    *out_value = 0;
+    return slot->value ? cns_bytes_copy_r(cns, slot->value, out_value) : CNS_OK;
+}
+
+cns_Bytes*
+cns_u64storage_get(cns_Runtime* cns, cns_U64Storage* storage, uint64_t key)
+{
+    cns_Bytes* rv = 0;
+    cns_setlasterr(cns, cns_u64storage_get_r(cns, storage, key, &rv));
+    return rv;
+}
+
+cns_Error
+cns_u64storage_delete_r(cns_Runtime* cns, cns_U64Storage* storage, uint64_t key, cns_Bool* out_existed)
+{
+    if (!cns || !storage)
+        return CNS_ERR_BADARG;
+
+    uint64_t hole = _cns_u64storage_find(storage, key);
+    _cns_U64Storage_Slot* slots = storage->slots;
+    if (out_existed)
+        *out_existed = slots[hole].value ? CNS_YES : CNS_NO;
+    if (!slots[hole].value)
+        return CNS_OK;
+
+    cns_bytes_free_r(cns, slots[hole].value);
+    --storage->count;
+
+    // backward shift deletion, no tombstones are left behind
+    uint64_t mask = ((uint64_t) 1 << storage->log2numslots) - 1;
+    for (uint64_t i = (hole + 1) & mask; slots[i].value; i = (i + 1) & mask)
+    {
+        // a slot can fill the hole unless its home slot lies between the hole and itself
+        uint64_t home = _cns_u64storage_hash(slots[i].key) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            slots[hole] = slots[i];
+            hole = i;
+        }
+    }
+    slots[hole].value = 0;
+
+    // shrink once the table is an eighth full; failing to is harmless
+    if (storage->log2numslots > _CNS_U64STORAGE_MINBASE && 8 * storage->count < ((cns_Index) 1 << storage->log2numslots))
+        _cns_u64storage_resize(cns, storage, storage->log2numslots - 1);
+    return CNS_OK;
+}
+
+cns_Bool
+cns_u64storage_delete(cns_Runtime* cns, cns_U64Storage* storage, uint64_t key)
+{
+    cns_Bool rv = CNS_NO;
+    cns_setlasterr(cns, cns_u64storage_delete_r(cns, storage, key, &rv));
+    return rv;
+}
+
+cns_Index
+cns_u64storage_count(cns_Runtime* cns, cns_U64Storage* storage)
+{
+    if (!cns || !storage)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+    return storage->count;
+}
@@ -0,0 +1,215 @@
+#include <consensual/watch.h>
+#include <consensual/bytes_impl.h>
+#include "storage_engine.h"
+#include "runtime_impl.h"
+
+#include <stdatomic.h>
+#include <string.h> // memcmp, memset
+
+// The ring is single producer, single consumer. The writer fills slots from `queued` on and moves `tail` up to it when a
+// commit ends; the consumer takes slots from `head` to `tail` and moves `head` past them. Each side keeps to its own cache
+// line.
+struct cns_Watch
+{
+    cns_Storage*        storage;
+    cns_Bytes*          key; // flat
+    cns_Bool            prefix;
+    cns_Watch*          next; // in the storage's list
+    cns_WatchEvent*     events;
+    uint64_t            mask;
+    uint64_t            queued; // writer only
+    char                _pad0[64];
+    _Atomic uint64_t    tail;
+    char                _pad1[64 - sizeof(uint64_t)];
+    _Atomic uint64_t    head;
+    _Atomic uint64_t    missed;
+    char                _pad2[64 - 2 * sizeof(uint64_t)];
+};
+
+static cns_Bool _cns_watch_follows(cns_Watch* watch, cns_Bytes* key)
+{
+    cns_Index length = cns_bytes_lengthUnchecked(watch->key);
+    cns_Index keyLength = cns_bytes_lengthUnchecked(key);
+    if (keyLength < length || (!watch->prefix && keyLength != length))
+        return CNS_NO;
+    if (!cns_bytes_isFlatUnchecked(key))
+        return _cns_bytes_equalChunks(key, watch->key, length);
+    return 0 == memcmp(cns_bytes_ptrUnchecked(key), cns_bytes_ptrUnchecked(watch->key), (size_t) length);
+}
+
+cns_Bool
+_cns_watch_matches(cns_Watch* watches, cns_Bytes* key)
+{
+    for (cns_Watch* watch = watches; watch; watch = watch->next)
+    {
+        if (_cns_watch_follows(watch, key))
+            return CNS_YES;
+    }
+    return CNS_NO;
+}
+
+void
+_cns_watch_notify(cns_Runtime* cns, cns_Watch* watches, uint64_t sequence, cns_Bytes* key, cns_Bytes* oldValue, cns_Bytes* newValue)
+{
+    for (cns_Watch* watch = watches; watch; watch = watch->next)
+    {
+        if (!_cns_watch_follows(watch, key))
+            continue;
+        // a full ring drops the event rather than make the writer wait
+        if (watch->queued - atomic_load_explicit(&watch->head, memory_order_acquire) > watch->mask)
+        {
+            atomic_fetch_add_explicit(&watch->missed, 1, memory_order_relaxed);
+            continue;
+        }
+        cns_WatchEvent* event = &watch->events[watch->queued & watch->mask];
+        event->sequence = sequence;
+        cns_bytes_copy_r(cns, key, &event->key);
+        event->oldValue = 0;
+        event->newValue = 0;
+        if (oldValue)
+            cns_bytes_copy_r(cns, oldValue, &event->oldValue);
+        if (newValue)
+            cns_bytes_copy_r(cns, newValue, &event->newValue);
+        ++watch->queued;
+    }
+}
+
+void
+_cns_watch_miss(cns_Watch* watches, cns_Bytes* key)
+{
+    for (cns_Watch* watch = watches; watch; watch = watch->next)
+    {
+        if (!key || _cns_watch_follows(watch, key))
+            atomic_fetch_add_explicit(&watch->missed, 1, memory_order_relaxed);
+    }
+}
+
+void
+_cns_watch_publish(cns_Watch* watches)
+{
+    for (cns_Watch* watch = watches; watch; watch = watch->next)
+    {
+        if (atomic_load_explicit(&watch->tail, memory_order_relaxed) != watch->queued)
+            atomic_store_explicit(&watch->tail, watch->queued, memory_order_release);
+    }
+}
+
+cns_Watch*
+cns_watch_new(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, cns_Bool prefix, cns_Index capacity)
+{
+    if (!cns || !storage || !key || capacity <= 0 || capacity > ((cns_Index) 1 << 30))
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+    if (_cns_storage_engine(storage))
+    {
+        cns_setlasterr(cns, CNS_ERR_UNSUPPORTED);
+        return 0;
+    }
+
+    cns_Index numSlots = 1;
+    while (numSlots < capacity)
+        numSlots *= 2;
+    cns_Watch* watch = 0;
+    cns_Error err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, sizeof(cns_Watch), (void**) &watch);
+    if (watch)
+    {
+        memset(watch, 0, sizeof(cns_Watch));
+        err = _cns_runtime_allocIn_r(cns, CNS_ALLOC_STORAGE, numSlots * (cns_Index) sizeof(cns_WatchEvent), (void**) &watch->events);
+        // a flat copy, so that matching never has to join the pieces of the watched key
+        const void * ptr = cns_bytes_ptrUnchecked(key);
+        if (!err)
+            err = ptr ? cns_bytes_new_r(cns, ptr, cns_bytes_lengthUnchecked(key), &watch->key) : CNS_ERR_NOMEM;
+        if (err)
+        {
+            if (watch->events)
+                cns_runtime_free_r(cns, watch->events);
+            cns_runtime_free_r(cns, watch);
+            cns_setlasterr(cns, err);
+            return 0;
+        }
+
+        watch->storage = storage;
+        watch->prefix = prefix;
+        watch->mask = (uint64_t) numSlots - 1;
+        atomic_init(&watch->tail, 0);
+        atomic_init(&watch->head, 0);
+        atomic_init(&watch->missed, 0);
+        cns_Watch** watches = _cns_storage_watches(storage);
+        watch->next = *watches;
+        *watches = watch;
+    }
+    cns_setlasterr(cns, err);
+    return watch;
+}
+
+void
+cns_watch_free(cns_Runtime* cns, cns_Watch* watch)
+{
+    if (!cns || !watch)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    cns_Watch** link = _cns_storage_watches(watch->storage);
+    while (*link != watch)
+        link = &(*link)->next;
+    *link = watch->next;
+
+    // events queued by a commit still in progress as well
+    for (uint64_t i = atomic_load_explicit(&watch->head, memory_order_acquire); i != watch->queued; ++i)
+        cns_watch_releaseEvents(cns, &watch->events[i & watch->mask], 1);
+    cns_bytes_free_r(cns, watch->key);
+    cns_runtime_free_r(cns, watch->events);
+    cns_runtime_free_r(cns, watch);
+    cns_setlasterr(cns, CNS_OK);
+}
+
+cns_Error
+cns_watch_poll_r(cns_Runtime* cns, cns_Watch* watch, cns_WatchEvent* out, cns_Index max, cns_Index* out_count, uint64_t* out_missed)
+{
+    if (!cns || !watch || max < 0 || (max && !out) || !out_count)
+        return CNS_ERR_BADARG;
+
+    // events dropped while this poll runs are reported by the next one
+    if (out_missed)
+        *out_missed = atomic_exchange_explicit(&watch->missed, 0, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&watch->head, memory_order_relaxed);
+    uint64_t available = atomic_load_explicit(&watch->tail, memory_order_acquire) - head;
+    cns_Index count = available < (uint64_t) max ? (cns_Index) available : max;
+    for (cns_Index i = 0; i < count; ++i)
+        out[i] = watch->events[(head + (uint64_t) i) & watch->mask];
+    atomic_store_explicit(&watch->head, head + (uint64_t) count, memory_order_release);
+    *out_count = count;
+    return CNS_OK;
+}
+
+cns_Index
+cns_watch_poll(cns_Runtime* cns, cns_Watch* watch, cns_WatchEvent* out, cns_Index max, uint64_t* out_missed)
+{
+    cns_Index rv = 0;
+    cns_setlasterr(cns, cns_watch_poll_r(cns, watch, out, max, &rv, out_missed));
+    return rv;
+}
+
+void
+cns_watch_releaseEvents(cns_Runtime* cns, cns_WatchEvent* events, cns_Index count)
+{
+    if (!cns || count < 0 || (count && !events))
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    for (cns_Index i = 0; i < count; ++i)
+    {
+        cns_bytes_free_r(cns, events[i].key);
+        if (events[i].oldValue)
+            cns_bytes_free_r(cns, events[i].oldValue);
+        if (events[i].newValue)
+            cns_bytes_free_r(cns, events[i].newValue);
+    }
+    cns_setlasterr(cns, CNS_OK);
+}
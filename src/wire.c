@@ -0,0 +1,414 @@
+#include <consensual/wire.h>
+
+#include <string.h> // memcpy
+
+// payloads this short are cheaper to copy than to give their own iovec entry
+#define _CNS_WIRE_INLINE 64
+
+cns_Index
+cns_wire_encodeVarint(uint64_t value, uint8_t* out)
+{
+    cns_Index n = 0;
+    while (value >= 0x80)
+    {
+        out[n++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (uint8_t) value;
+    return n;
+}
+
+cns_Index
+cns_wire_decodeVarint(const uint8_t* ptr, cns_Index size, uint64_t* out_value)
+{
+    uint64_t value = 0;
+    for (cns_Index n = 0; n < size && n < CNS_WIRE_MAXVARINT; ++n)
+    {
+        uint64_t group = ptr[n] & 0x7f;
+        if (n == CNS_WIRE_MAXVARINT - 1 && group > 1)
+            return 0; // does not fit 64 bits
+        value |= group << (7 * n);
+        if (!(ptr[n] & 0x80))
+        {
+            *out_value = value;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+
+typedef struct _cns_WireSegment
+{
+    const uint8_t*  ptr;            // null if the segment lives in the scratch buffer
+    cns_Index       scratchOffset;
+    cns_Index       length;
+} _cns_WireSegment;
+
+struct cns_WireWriter
+{
+    uint8_t*            scratch;
+    cns_Index           scratchLength;
+    cns_Index           scratchCapacity;
+    _cns_WireSegment*   segments;
+    int                 numSegments;
+    int                 segmentsCapacity;
+    cns_Bytes**         refs;
+    int                 numRefs;
+    int                 refsCapacity;
+    struct iovec*       iov;
+    int                 iovCapacity;
+    cns_Index           length;
+};
+
+// grows `*array` so it can hold at least `need` items of `itemsize` bytes
+static cns_Bool _cns_wire_reserve(cns_Runtime* cns, void** array, cns_Index* capacity, cns_Index need, cns_Index itemsize)
+{
+    if (need <= *capacity)
+        return CNS_YES;
+
+    cns_Index newCapacity = *capacity ? *capacity : 8;
+    while (newCapacity < need)
+        newCapacity *= 2;
+
+    void* newArray = cns_runtime_realloc(cns, *array, newCapacity * itemsize);
+    if (!newArray)
+        return CNS_NO;
+    *array = newArray;
+    *capacity = newCapacity;
+    return CNS_YES;
+}
+
+static cns_Bool _cns_wirewriter_reserveSegments(cns_Runtime* cns, cns_WireWriter* writer, int more)
+{
+    cns_Index capacity = writer->segmentsCapacity;
+    if (!_cns_wire_reserve(cns, (void**) &writer->segments, &capacity, writer->numSegments + more, sizeof(_cns_WireSegment)))
+        return CNS_NO;
+    writer->segmentsCapacity = (int) capacity;
+    return CNS_YES;
+}
+
+// caller must have reserved scratch space and one segment
+static void _cns_wirewriter_appendScratch(cns_WireWriter* writer, const void * ptr, cns_Index size)
+{
+    _cns_WireSegment* last = writer->numSegments ? &writer->segments[writer->numSegments - 1] : 0;
+    if (!last || last->ptr || last->scratchOffset + last->length != writer->scratchLength)
+    {
+        last = &writer->segments[writer->numSegments++];
+        last->ptr = 0;
+        last->scratchOffset = writer->scratchLength;
+        last->length = 0;
+    }
+    if (size)
+        memcpy(writer->scratch + writer->scratchLength, ptr, size);
+    writer->scratchLength += size;
+    last->length += size;
+    writer->length += size;
+}
+
+cns_WireWriter*
+cns_wirewriter_new(cns_Runtime* cns)
+{
+    if (!cns)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+
+    cns_WireWriter* rv = (cns_WireWriter*) cns_runtime_alloc(cns, sizeof(cns_WireWriter));
+    if (rv)
+    {
+        memset(rv, 0, sizeof(cns_WireWriter));
+        cns_setlasterr(cns, CNS_OK);
+    }
+    return rv;
+}
+
+void
+cns_wirewriter_reset(cns_Runtime* cns, cns_WireWriter* writer)
+{
+    if (!cns || !writer)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    for (int i = 0; i < writer->numRefs; ++i)
+        cns_bytes_free(cns, writer->refs[i]);
+    writer->numRefs = 0;
+    writer->numSegments = 0;
+    writer->scratchLength = 0;
+    writer->length = 0;
+    cns_setlasterr(cns, CNS_OK);
+}
+
+void
+cns_wirewriter_free(cns_Runtime* cns, cns_WireWriter* writer)
+{
+    if (!cns || !writer)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    cns_wirewriter_reset(cns, writer);
+    cns_runtime_free(cns, writer->scratch);
+    cns_runtime_free(cns, writer->segments);
+    cns_runtime_free(cns, writer->refs);
+    cns_runtime_free(cns, writer->iov);
+    cns_runtime_free(cns, writer);
+    cns_setlasterr(cns, CNS_OK);
+}
+
+void
+cns_wirewriter_putVarint(cns_Runtime* cns, cns_WireWriter* writer, uint64_t value)
+{
+    if (!cns || !writer)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    if (!_cns_wire_reserve(cns, (void**) &writer->scratch, &writer->scratchCapacity, writer->scratchLength + CNS_WIRE_MAXVARINT, 1)
+        || !_cns_wirewriter_reserveSegments(cns, writer, 1))
+        return;
+
+    uint8_t buf[CNS_WIRE_MAXVARINT];
+    _cns_wirewriter_appendScratch(writer, buf, cns_wire_encodeVarint(value, buf));
+    cns_setlasterr(cns, CNS_OK);
+}
+
+void
+cns_wirewriter_putRaw(cns_Runtime* cns, cns_WireWriter* writer, const void * ptr, cns_Index size)
+{
+    if (!cns || !writer || size < 0 || (!ptr && size))
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    if (!_cns_wire_reserve(cns, (void**) &writer->scratch, &writer->scratchCapacity, writer->scratchLength + CNS_WIRE_MAXVARINT + size, 1)
+        || !_cns_wirewriter_reserveSegments(cns, writer, 1))
+        return;
+
+    uint8_t buf[CNS_WIRE_MAXVARINT];
+    _cns_wirewriter_appendScratch(writer, buf, cns_wire_encodeVarint((uint64_t) size, buf));
+    _cns_wirewriter_appendScratch(writer, ptr, size);
+    cns_setlasterr(cns, CNS_OK);
+}
+
+void
+cns_wirewriter_putBytes(cns_Runtime* cns, cns_WireWriter* writer, cns_Bytes* bytes)
+{
+    if (!cns || !writer || !bytes)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    cns_Index size = cns_bytes_length(cns, bytes);
+    if (size < _CNS_WIRE_INLINE)
+    {
+        cns_wirewriter_putRaw(cns, writer, cns_bytes_ptr(cns, bytes), size);
+        return;
+    }
+
+    // a concatenation gets an iovec entry per piece rather than being joined
+    cns_Index numChunks = cns_bytes_chunkCount(cns, bytes);
+    cns_Index refsCapacity = writer->refsCapacity;
+    if (!_cns_wire_reserve(cns, (void**) &writer->scratch, &writer->scratchCapacity, writer->scratchLength + CNS_WIRE_MAXVARINT, 1)
+        || !_cns_wirewriter_reserveSegments(cns, writer, 1 + (int) numChunks)
+        || !_cns_wire_reserve(cns, (void**) &writer->refs, &refsCapacity, writer->numRefs + 1, sizeof(cns_Bytes*)))
+        return;
+    writer->refsCapacity = (int) refsCapacity;
+
+    writer->refs[writer->numRefs++] = cns_bytes_copy(cns, bytes);
+
+    uint8_t buf[CNS_WIRE_MAXVARINT];
+    _cns_wirewriter_appendScratch(writer, buf, cns_wire_encodeVarint((uint64_t) size, buf));
+
+    cns_BytesChunks chunks;
+    cns_bytes_chunksBegin(cns, bytes, &chunks);
+    const void * ptr = 0;
+    cns_Index length = 0;
+    while (cns_bytes_chunksNext(cns, &chunks, &ptr, &length))
+    {
+        _cns_WireSegment* segment = &writer->segments[writer->numSegments++];
+        segment->ptr = (const uint8_t*) ptr;
+        segment->scratchOffset = 0;
+        segment->length = length;
+    }
+    writer->length += size;
+    cns_setlasterr(cns, CNS_OK);
+}
+
+cns_Index
+cns_wirewriter_length(cns_Runtime* cns, cns_WireWriter* writer)
+{
+    if (!cns || !writer)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+    cns_setlasterr(cns, CNS_OK);
+    return writer->length;
+}
+
+const struct iovec *
+cns_wirewriter_iov(cns_Runtime* cns, cns_WireWriter* writer, int* out_count)
+{
+    if (!cns || !writer || !out_count)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+
+    // scratch may have moved while growing, so pointers into it are only resolved here
+    cns_Index iovCapacity = writer->iovCapacity;
+    if (!_cns_wire_reserve(cns, (void**) &writer->iov, &iovCapacity, writer->numSegments ? writer->numSegments : 1, sizeof(struct iovec)))
+        return 0;
+    writer->iovCapacity = (int) iovCapacity;
+
+    for (int i = 0; i < writer->numSegments; ++i)
+    {
+        _cns_WireSegment* segment = &writer->segments[i];
+        writer->iov[i].iov_base = (void*) (segment->ptr ? segment->ptr : writer->scratch + segment->scratchOffset);
+        writer->iov[i].iov_len = (size_t) segment->length;
+    }
+    *out_count = writer->numSegments;
+    cns_setlasterr(cns, CNS_OK);
+    return writer->iov;
+}
+
+cns_Bytes*
+cns_wirewriter_toBytes(cns_Runtime* cns, cns_WireWriter* writer)
+{
+    int count = 0;
+    const struct iovec * iov = cns_wirewriter_iov(cns, writer, &count);
+    if (!iov)
+        return 0;
+
+    cns_BytesBuilder* builder = cns_bytesbuilder_new(cns, writer->length);
+    if (!builder)
+        return 0;
+
+    // sized exactly, so none of these appends reallocate
+    for (int i = 0; i < count; ++i)
+        cns_bytesbuilder_append_r(cns, builder, iov[i].iov_base, iov[i].iov_len);
+
+    cns_Bytes* rv = cns_bytesbuilder_finish(cns, builder);
+    return rv;
+}
+
+
+struct cns_WireReader
+{
+    cns_Bytes*      message;
+    const uint8_t*  ptr;
+    cns_Index       length;
+    cns_Index       offset;
+};
+
+cns_WireReader*
+cns_wirereader_new(cns_Runtime* cns, cns_Bytes* message)
+{
+    if (!cns || !message)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+
+    cns_WireReader* rv = (cns_WireReader*) cns_runtime_alloc(cns, sizeof(cns_WireReader));
+    if (rv)
+    {
+        rv->message = cns_bytes_copy(cns, message);
+        rv->ptr = cns_bytes_ptr(cns, message);
+        rv->length = cns_bytes_length(cns, message);
+        rv->offset = 0;
+    }
+    return rv;
+}
+
+void
+cns_wirereader_free(cns_Runtime* cns, cns_WireReader* reader)
+{
+    if (!cns || !reader)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return;
+    }
+
+    cns_bytes_free(cns, reader->message);
+    cns_runtime_free(cns, reader);
+    cns_setlasterr(cns, CNS_OK);
+}
+
+cns_Bool
+cns_wirereader_getVarint(cns_Runtime* cns, cns_WireReader* reader, uint64_t* out_value)
+{
+    if (!cns || !reader || !out_value)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return CNS_NO;
+    }
+
+    if (reader->offset == reader->length)
+    {
+        cns_setlasterr(cns, CNS_OK);
+        return CNS_NO;
+    }
+
+    cns_Index n = cns_wire_decodeVarint(reader->ptr + reader->offset, reader->length - reader->offset, out_value);
+    if (!n)
+    {
+        cns_setlasterr(cns, CNS_ERR_MALFORMED);
+        return CNS_NO;
+    }
+    reader->offset += n;
+    cns_setlasterr(cns, CNS_OK);
+    return CNS_YES;
+}
+
+cns_Bytes*
+cns_wirereader_getBytes(cns_Runtime* cns, cns_WireReader* reader)
+{
+    if (!cns || !reader)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+
+    cns_Index start = reader->offset;
+    uint64_t size = 0;
+    if (!cns_wirereader_getVarint(cns, reader, &size))
+        return 0;
+
+    if (size > (uint64_t) (reader->length - reader->offset))
+    {
+        reader->offset = start;
+        cns_setlasterr(cns, CNS_ERR_MALFORMED);
+        return 0;
+    }
+
+    cns_Bytes* rv = cns_bytes_slice(cns, reader->message, reader->offset, (cns_Index) size);
+    if (!rv)
+    {
+        reader->offset = start;
+        return 0;
+    }
+    reader->offset += (cns_Index) size;
+    cns_setlasterr(cns, CNS_OK);
+    return rv;
+}
+
+cns_Index
+cns_wirereader_remaining(cns_Runtime* cns, cns_WireReader* reader)
+{
+    if (!cns || !reader)
+    {
+        cns_setlasterr(cns, CNS_ERR_BADARG);
+        return 0;
+    }
+    cns_setlasterr(cns, CNS_OK);
+    return reader->length - reader->offset;
+}
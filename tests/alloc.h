@@ -3,7 +3,7 @@
 
 struct TestRTAllocContext
 {
-    int bytesAllocated;
+    _Atomic int bytesAllocated; // the runtime may call its allocation functions from several threads
 };
 
 void *
@@ -0,0 +1,227 @@
+#include <consensual/runtime.h>
+#include <consensual/blockcache.h>
+#include <consensual/bytes.h>
+#include "alloc.h"
+
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define BLOCK 1024
+
+static
+cns_Bytes* makeBlock(cns_Runtime* cns, int id)
+{
+    char buf[BLOCK];
+    memset(buf, id & 0xff, sizeof(buf));
+    return cns_bytes_new(cns, buf, sizeof(buf));
+}
+
+// looks the block up, reading it in on a miss as a storage would; returns whether it was a hit
+static
+cns_Bool touch(cns_Runtime* cns, uint64_t file, int id)
+{
+    cns_Bytes* block = cns_blockcache_lookup(cns, 1, file, (uint64_t) id * BLOCK);
+    cns_Bool hit = (block != 0);
+    if (!block)
+    {
+        block = makeBlock(cns, id);
+        cns_blockcache_insert(cns, 1, file, (uint64_t) id * BLOCK, block);
+    }
+    cns_bytes_free(cns, block);
+    return hit;
+}
+
+START_TEST(test_blockcache)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    // off until it has a capacity
+    cns_Bytes* block = makeBlock(cns, 1);
+    cns_blockcache_insert(cns, 1, 1, 0, block);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    ck_assert_ptr_eq(0, cns_blockcache_lookup(cns, 1, 1, 0));
+    cns_bytes_free(cns, block);
+
+    // the cache itself lives as long as the runtime
+    cns_blockcache_setCapacity(cns, 1);
+    cns_blockcache_setCapacity(cns, 0);
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    block = makeBlock(cns, 1);
+    cns_blockcache_setCapacity(cns, 1024 * BLOCK);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    cns_blockcache_insert(cns, 1, 1, 0, block);
+    cns_Bytes* cached = cns_blockcache_lookup(cns, 1, 1, 0);
+    ck_assert_ptr_eq(block, cached); // the same object, not a copy
+    cns_bytes_free(cns, cached);
+    ck_assert_ptr_eq(0, cns_blockcache_lookup(cns, 2, 1, 0));
+    ck_assert_ptr_eq(0, cns_blockcache_lookup(cns, 1, 2, 0));
+    ck_assert_ptr_eq(0, cns_blockcache_lookup(cns, 1, 1, BLOCK));
+
+    // a block stays valid after it is evicted
+    cns_blockcache_eraseOwner(cns, 1);
+    ck_assert_ptr_eq(0, cns_blockcache_lookup(cns, 1, 1, 0));
+    ck_assert_int_eq(1, *(const char *) cns_bytes_ptr(cns, block));
+    cns_bytes_free(cns, block);
+
+    // many more blocks than fit
+    for (int i = 0; i < 5000; ++i)
+    {
+        touch(cns, 1, i);
+        cns_BlockCacheStats stats;
+        cns_blockcache_stats(cns, &stats);
+        ck_assert(stats.usage <= stats.capacity);
+    }
+    cns_BlockCacheStats stats;
+    cns_blockcache_stats(cns, &stats);
+    ck_assert_int_eq(1024 * BLOCK, stats.capacity);
+    ck_assert_int_eq(5000 + 1, stats.inserts);
+    ck_assert_int_ne(0, stats.evictions);
+    ck_assert(stats.blocks > 512);
+    ck_assert(stats.remembered > 0);
+
+    cns_blockcache_setCapacity(cns, 0);
+    cns_blockcache_stats(cns, &stats);
+    ck_assert_int_eq(0, stats.blocks);
+    ck_assert_int_eq(0, stats.usage);
+    ck_assert_int_eq(0, stats.remembered);
+
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_blockcache_setCapacity_r(cns, -1));
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_blockcache_insert_r(cns, 1, 1, 0, 0));
+
+    ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+START_TEST(test_blockcache_scan)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    cns_blockcache_setCapacity(cns, 1024 * BLOCK);
+    cns_blockcache_setCapacity(cns, 0);
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+    cns_blockcache_setCapacity(cns, 1024 * BLOCK);
+
+    // a working set of a fifth of the capacity, used over and over
+    enum { HOT = 200, SCAN = 20000 };
+    for (int round = 0; round < 3; ++round)
+    {
+        for (int i = 0; i < HOT; ++i)
+            touch(cns, 1, i);
+    }
+
+    // a scan of twenty times the capacity, with one use of the working set for every ten blocks: each working set block
+    // comes back after twice the capacity was scanned, which LRU would have evicted it for
+    int hits = 0, uses = 0;
+    for (int i = 0; i < SCAN; ++i)
+    {
+        ck_assert_int_eq(CNS_NO, touch(cns, 2, i));
+        if (i % 10 == 0)
+        {
+            hits += touch(cns, 1, (i / 10) % HOT);
+            ++uses;
+        }
+    }
+    ck_assert_msg(hits * 10 > uses * 9, "working set hit %d of %d times", hits, uses);
+
+    cns_BlockCacheStats stats;
+    cns_blockcache_stats(cns, &stats);
+    ck_assert_int_ne(0, stats.promotions);
+    ck_assert(stats.hotUsage >= HOT * BLOCK * 9 / 10);
+
+    cns_blockcache_setCapacity(cns, 0);
+    ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+// plain malloc, which unlike the counting test allocator is safe to call from several threads
+static
+void* threadsAlloc(const void* allocContext, cns_Index size, cns_Error* err)
+{
+    (void) allocContext;
+    void* rv = malloc((size_t) size);
+    *err = rv ? CNS_OK : CNS_ERR_NOMEM;
+    return rv;
+}
+
+static
+void threadsFree(const void* allocContext, void* ptr, cns_Error* err)
+{
+    (void) allocContext;
+    free(ptr);
+    *err = CNS_OK;
+}
+
+static
+void* threadsRealloc(const void* allocContext, void* ptr, cns_Index size, cns_Error* err)
+{
+    (void) allocContext;
+    void* rv = realloc(ptr, (size_t) size);
+    *err = rv ? CNS_OK : CNS_ERR_NOMEM;
+    return rv;
+}
+
+struct Hammer
+{
+    cns_Runtime* cns;
+    int thread;
+};
+
+static
+void* hammer(void* arg)
+{
+    struct Hammer* h = (struct Hammer*) arg;
+    for (int i = 0; i < 20000; ++i)
+        touch(h->cns, (uint64_t) h->thread, (i * 7) % 150);
+    return 0;
+}
+
+START_TEST(test_blockcache_threads)
+{
+    cns_Runtime* cns = cns_startup(threadsAlloc, threadsFree, threadsRealloc, 0);
+    cns_blockcache_setCapacity(cns, 512 * BLOCK);
+    pthread_t threads[4];
+    struct Hammer args[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        args[i].cns = cns;
+        args[i].thread = i;
+        pthread_create(&threads[i], 0, hammer, &args[i]);
+    }
+    for (int i = 0; i < 4; ++i)
+        pthread_join(threads[i], 0);
+
+    cns_BlockCacheStats stats;
+    cns_blockcache_stats(cns, &stats);
+    ck_assert_int_eq(4 * 20000, stats.hits + stats.misses);
+    ck_assert_int_ne(0, stats.hits);
+    ck_assert(stats.usage <= stats.capacity);
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+Suite* blockcache_suite(void)
+{
+    Suite* s = suite_create("blockcache");
+
+    TCase* tc = tcase_create("blockcache");
+    tcase_add_test(tc, test_blockcache);
+    tcase_add_test(tc, test_blockcache_scan);
+    tcase_add_test(tc, test_blockcache_threads);
+
+    suite_add_tcase(s, tc);
+    return s;
+}
@@ -1,7 +1,11 @@
 #include <consensual/runtime.h>
 #include <consensual/bytes.h>
+#include <consensual/bytes_impl.h>
 #include <check.h>
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "alloc.h"
 
 START_TEST(test_bytes)
@@ -54,12 +58,230 @@ START_TEST(test_bytes)
     ck_assert_int_eq(CNS_YES, cns_bytes_equal(cns, a, b));
     ck_assert_int_eq(CNS_NO, cns_bytes_equal(cns, a, c));
 
+    // unchecked inline accessors agree with the checked ones
+    ck_assert_int_eq(cns_bytes_length(cns, c), cns_bytes_lengthUnchecked(c));
+    ck_assert_ptr_eq(cns_bytes_ptr(cns, c), cns_bytes_ptrUnchecked(c));
+    ck_assert_int_eq(CNS_YES, cns_bytes_equalUnchecked(a, a));
+    ck_assert_int_eq(CNS_YES, cns_bytes_equalUnchecked(a, b));
+    ck_assert_int_eq(CNS_NO, cns_bytes_equalUnchecked(a, c));
+
     cns_bytes_free(cns, a);
     cns_bytes_free(cns, b);
     cns_bytes_free(cns, c);
 
     ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
 
+    // slices
+    a = cns_bytes_new(cns, "hello, world", 12);
+    b = cns_bytes_slice(cns, a, 7, 5);
+    ck_assert_ptr_ne(0, b);
+    ck_assert_int_eq(5, cns_bytes_length(cns, b));
+    ck_assert_ptr_eq((const char *) cns_bytes_ptr(cns, a) + 7, cns_bytes_ptr(cns, b));
+    c = cns_bytes_slice(cns, b, 1, 3); // slice of a slice
+    ck_assert_int_eq(0, memcmp("orl", cns_bytes_ptr(cns, c), 3));
+    d = cns_bytes_slice(cns, a, 0, 12);
+    ck_assert_ptr_eq(a, d);
+    cns_bytes_free(cns, d);
+    ck_assert_ptr_eq(0, cns_bytes_slice(cns, a, 10, 3));
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_lasterr(cns));
+    ck_assert_ptr_eq(0, cns_bytes_slice(cns, a, -1, 3));
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_lasterr(cns));
+
+    cns_bytes_free(cns, a); // slices keep the data alive
+    cns_bytes_free(cns, b);
+    ck_assert_int_eq(0, memcmp("orl", cns_bytes_ptr(cns, c), 3));
+    cns_bytes_free(cns, c);
+
+    ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+START_TEST(test_bytesbuilder)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    // grows from nothing through several reallocations
+    cns_BytesBuilder* builder = cns_bytesbuilder_new(cns, 0);
+    ck_assert_ptr_ne(0, builder);
+    for (int i = 0; i < 1000; ++i)
+    {
+        char c = (char) ('a' + i % 26);
+        cns_bytesbuilder_append(cns, builder, &c, 1);
+        ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    }
+    cns_bytesbuilder_append(cns, builder, 0, 0);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_bytesbuilder_append_r(cns, builder, 0, 1));
+    ck_assert_int_eq(1000, cns_bytesbuilder_length(cns, builder));
+    ck_assert_int_eq('z', ((char*) cns_bytesbuilder_ptr(cns, builder))[25]);
+
+    cns_Bytes* bytes = cns_bytesbuilder_finish(cns, builder);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    ck_assert_int_eq(1000, cns_bytes_length(cns, bytes));
+    const char * p = (const char *) cns_bytes_ptr(cns, bytes);
+    for (int i = 0; i < 1000; ++i)
+        ck_assert_int_eq('a' + i % 26, p[i]);
+
+    // finished objects behave like any other, including slicing
+    cns_Bytes* slice = cns_bytes_slice(cns, bytes, 26, 3);
+    cns_Bytes* expected = cns_bytes_new(cns, "abc", 3);
+    ck_assert_int_eq(CNS_YES, cns_bytes_equal(cns, expected, slice));
+    cns_bytes_free(cns, expected);
+    cns_bytes_free(cns, bytes);
+    cns_bytes_free(cns, slice);
+
+    // spare capacity is given back and a reserved builder does not move
+    builder = cns_bytesbuilder_new(cns, 4096);
+    cns_bytesbuilder_reserve(cns, builder, 100);
+    void* before = cns_bytesbuilder_ptr(cns, builder);
+    cns_bytesbuilder_append(cns, builder, "hello", 5);
+    ck_assert_ptr_eq(before, cns_bytesbuilder_ptr(cns, builder));
+    bytes = cns_bytesbuilder_finish(cns, builder);
+    ck_assert_int_lt(test_rt_allocContext.bytesAllocated - noleaksNumber, 4096);
+    ck_assert_int_eq(0, memcmp("hello", cns_bytes_ptr(cns, bytes), 5));
+    cns_bytes_free(cns, bytes);
+
+    // empty content and abandoned builders
+    bytes = cns_bytesbuilder_finish(cns, cns_bytesbuilder_new(cns, 0));
+    ck_assert_int_eq(0, cns_bytes_length(cns, bytes));
+    cns_bytes_free(cns, bytes);
+    builder = cns_bytesbuilder_new(cns, 10);
+    cns_bytesbuilder_append(cns, builder, "abandoned", 9);
+    cns_bytesbuilder_free(cns, builder);
+
+    // the _r forms leave the last error alone
+    cns_setlasterr(cns, CNS_ERR_BUSY);
+    ck_assert_int_eq(CNS_OK, cns_bytesbuilder_new_r(cns, 3, &builder));
+    ck_assert_int_eq(CNS_OK, cns_bytesbuilder_append_r(cns, builder, "abc", 3));
+    ck_assert_int_eq(CNS_OK, cns_bytesbuilder_finish_r(cns, builder, &bytes));
+    ck_assert_int_eq(3, cns_bytes_lengthUnchecked(bytes));
+    cns_bytes_free_r(cns, bytes);
+    ck_assert_int_eq(CNS_OK, cns_bytesbuilder_new_r(cns, 3, &builder));
+    ck_assert_int_eq(CNS_OK, cns_bytesbuilder_free_r(cns, builder));
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_bytesbuilder_new_r(cns, -1, &builder));
+    ck_assert_int_eq(CNS_ERR_BUSY, cns_lasterr(cns));
+
+    ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+// `count` pieces of `size` bytes, piece i filled with 'a' + i % 26, joined one by one
+static cns_Bytes* appendPieces(cns_Runtime* cns, char* expected, int count, int size)
+{
+    cns_Bytes* rv = cns_bytes_new(cns, 0, 0);
+    for (int i = 0; i < count; ++i)
+    {
+        memset(expected + i * size, 'a' + i % 26, size);
+        cns_Bytes* piece = cns_bytes_new(cns, expected + i * size, size);
+        cns_Bytes* joined = cns_bytes_concat(cns, rv, piece);
+        ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+        cns_bytes_free(cns, piece);
+        cns_bytes_free(cns, rv);
+        rv = joined;
+    }
+    return rv;
+}
+
+START_TEST(test_bytes_concat)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    // short joins are plain copies
+    cns_Bytes* hello = cns_bytes_new(cns, "hello ", 6);
+    cns_Bytes* world = cns_bytes_new(cns, "world", 5);
+    cns_Bytes* short_ = cns_bytes_concat(cns, hello, world);
+    ck_assert_int_eq(1, cns_bytes_chunkCount(cns, short_));
+    ck_assert_int_eq(CNS_YES, cns_bytes_isFlatUnchecked(short_));
+    ck_assert_int_eq(0, memcmp("hello world", cns_bytes_ptr(cns, short_), 11));
+    cns_bytes_free(cns, short_);
+    cns_bytes_free(cns, hello);
+    cns_bytes_free(cns, world);
+
+    // 300 pieces of 1000 bytes: deep enough to be rebalanced along the way
+    enum { COUNT = 300, SIZE = 1000 };
+    char* expected = malloc(COUNT * SIZE);
+    cns_Bytes* rope = appendPieces(cns, expected, COUNT, SIZE);
+    ck_assert_int_eq(COUNT * SIZE, cns_bytes_length(cns, rope));
+    ck_assert_int_eq(CNS_NO, cns_bytes_isFlatUnchecked(rope));
+    ck_assert_int_eq(COUNT, cns_bytes_chunkCount(cns, rope));
+
+    cns_BytesChunks chunks;
+    cns_bytes_chunksBegin(cns, rope, &chunks);
+    const void * ptr = 0;
+    cns_Index length = 0, offset = 0;
+    while (cns_bytes_chunksNext(cns, &chunks, &ptr, &length))
+    {
+        ck_assert_int_eq(0, memcmp(expected + offset, ptr, length));
+        offset += length;
+    }
+    ck_assert_int_eq(COUNT * SIZE, offset);
+
+    // the unchecked iterator walks the same pieces and leaves the last error alone
+    cns_setlasterr(cns, CNS_ERR_BUSY);
+    ck_assert_int_eq(COUNT, cns_bytes_chunkCountUnchecked(rope));
+    cns_bytes_chunksBeginUnchecked(rope, &chunks);
+    offset = 0;
+    while (cns_bytes_chunksNextUnchecked(&chunks, &ptr, &length))
+    {
+        ck_assert_int_eq(0, memcmp(expected + offset, ptr, length));
+        offset += length;
+    }
+    ck_assert_int_eq(COUNT * SIZE, offset);
+    ck_assert_int_eq(CNS_ERR_BUSY, cns_lasterr(cns));
+
+    // compared piece by piece against a flat copy and against a join with other boundaries
+    cns_Bytes* flat = cns_bytes_new(cns, expected, COUNT * SIZE);
+    ck_assert_int_eq(CNS_YES, cns_bytes_equal(cns, rope, flat));
+    cns_Bytes* head = cns_bytes_slice(cns, flat, 0, 1234);
+    cns_Bytes* tail = cns_bytes_slice(cns, flat, 1234, COUNT * SIZE - 1234);
+    cns_Bytes* other = cns_bytes_concat(cns, head, tail);
+    ck_assert_int_eq(CNS_YES, cns_bytes_equal(cns, rope, other));
+    ck_assert_int_eq(CNS_YES, cns_bytes_hasPrefix(cns, rope, head));
+    ck_assert_int_eq(CNS_NO, cns_bytes_hasPrefix(cns, rope, tail));
+    ck_assert_int_eq(CNS_NO, cns_bytes_isFlatUnchecked(rope));
+
+    // slices across piece boundaries stay pieces
+    cns_Bytes* slice = cns_bytes_slice(cns, rope, 999, 1002);
+    ck_assert_int_eq(1002, cns_bytes_length(cns, slice));
+    ck_assert_int_eq(0, memcmp(expected + 999, cns_bytes_ptr(cns, slice), 1002));
+    cns_bytes_free(cns, slice);
+    slice = cns_bytes_slice(cns, rope, 5 * SIZE + 10, 20 * SIZE);
+    ck_assert_int_eq(CNS_NO, cns_bytes_isFlatUnchecked(slice));
+    cns_Bytes* flatSlice = cns_bytes_slice(cns, flat, 5 * SIZE + 10, 20 * SIZE);
+    ck_assert_int_eq(CNS_YES, cns_bytes_equal(cns, flatSlice, slice));
+    cns_bytes_free(cns, flatSlice);
+    cns_bytes_free(cns, slice);
+
+    // the flat copy is made once and then used for iteration too
+    const void * joined = cns_bytes_ptr(cns, rope);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    ck_assert_int_eq(0, memcmp(expected, joined, COUNT * SIZE));
+    ck_assert_ptr_eq(joined, cns_bytes_ptr(cns, rope));
+    ck_assert_int_eq(1, cns_bytes_chunkCount(cns, rope));
+
+    cns_bytes_free(cns, other);
+    cns_bytes_free(cns, head);
+    cns_bytes_free(cns, tail);
+    cns_bytes_free(cns, flat);
+    cns_bytes_free(cns, rope);
+    free(expected);
+
+    ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
+
     cns_shutdown(cns);
 }
 END_TEST
@@ -70,6 +292,8 @@ Suite* bytes_suite(void)
 
     TCase* tc = tcase_create("bytes");
     tcase_add_test(tc, test_bytes);
+    tcase_add_test(tc, test_bytesbuilder);
+    tcase_add_test(tc, test_bytes_concat);
 
     suite_add_tcase(s, tc);
     return s;
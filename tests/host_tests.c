@@ -0,0 +1,306 @@
+#include <consensual/runtime.h>
+#include <consensual/host.h>
+#include <consensual/bytes.h>
+#include "alloc.h"
+
+#include <check.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+enum { PEERS = 3, GROUPS = 40, PROPOSALS = 30 };
+
+// the test allocator, for workers on several threads
+struct LockedAllocContext
+{
+    struct TestRTAllocContext base;
+    pthread_mutex_t mutex;
+};
+
+static
+void* lockedAlloc(const void * allocContext, cns_Index size, cns_Error* err)
+{
+    struct LockedAllocContext* context = (struct LockedAllocContext*) allocContext;
+    pthread_mutex_lock(&context->mutex);
+    void* rv = test_rt_alloc(&context->base, size, err);
+    pthread_mutex_unlock(&context->mutex);
+    return rv;
+}
+
+static
+void lockedFree(const void * allocContext, void* ptr, cns_Error* err)
+{
+    struct LockedAllocContext* context = (struct LockedAllocContext*) allocContext;
+    pthread_mutex_lock(&context->mutex);
+    test_rt_free(&context->base, ptr, err);
+    pthread_mutex_unlock(&context->mutex);
+}
+
+static
+void* lockedRealloc(const void * allocContext, void* ptr, cns_Index size, cns_Error* err)
+{
+    struct LockedAllocContext* context = (struct LockedAllocContext*) allocContext;
+    pthread_mutex_lock(&context->mutex);
+    void* rv = test_rt_realloc(&context->base, ptr, size, err);
+    pthread_mutex_unlock(&context->mutex);
+    return rv;
+}
+
+// forwards frames to the net, dropping one in `dropEvery`
+typedef struct LossyNet
+{
+    cns_HostNet*    net;
+    int             dropEvery;
+    int             sent;
+} LossyNet;
+
+// runs inside cns_host_tick_r, so it leaves the last error as it found it
+static
+void lossySend(cns_Runtime* cns, void* context, int peer, cns_Bytes* frame)
+{
+    LossyNet* lossy = (LossyNet*) context;
+    cns_Error saved = cns_lasterr(cns);
+    if (lossy->dropEvery && ++lossy->sent % lossy->dropEvery == 0)
+        cns_bytes_free(cns, frame);
+    else
+        cns_hostnet_send(cns, lossy->net, peer, frame);
+    cns_setlasterr(cns, saved);
+}
+
+static
+cns_Bytes* bytesStrFromInt(cns_Runtime* cns, int x)
+{
+    char buf[16];
+    sprintf(buf, "%d", x);
+    return cns_bytes_new(cns, buf, strlen(buf));
+}
+
+static
+void tickAll(cns_Runtime* cns, cns_Host** hosts, cns_HostNet* net)
+{
+    // ticks encode frames and apply entries without touching the last error
+    for (int h = 0; h < PEERS; ++h)
+    {
+        cns_setlasterr(cns, CNS_ERR_BUSY);
+        ck_assert_int_eq(CNS_OK, cns_host_tick_r(cns, hosts[h]));
+        ck_assert_int_eq(CNS_ERR_BUSY, cns_lasterr(cns));
+    }
+    cns_hostnet_deliver(cns, net, hosts);
+}
+
+// runs groups led by every peer through proposals, lost frames and idle ticks, and checks that all peers end up alike
+static
+void runCluster(cns_Runtime* cns, int numWorkers, int dropEvery)
+{
+    cns_HostNet* net = cns_hostnet_new(cns, PEERS);
+    LossyNet lossy = { .net = net, .dropEvery = dropEvery, .sent = 0 };
+    cns_Host* hosts[PEERS];
+    cns_Storage* storages[PEERS][GROUPS];
+    for (int h = 0; h < PEERS; ++h)
+    {
+        cns_HostOptions options;
+        cns_hostoptions_default(&options);
+        options.self = h;
+        options.numPeers = PEERS;
+        options.numWorkers = numWorkers;
+        options.heartbeatTicks = 4;
+        options.maxEntriesPerTick = 8;
+        options.send = lossySend;
+        options.sendContext = &lossy;
+        hosts[h] = cns_host_new(cns, &options);
+        ck_assert_ptr_ne(0, hosts[h]);
+        for (int g = 0; g < GROUPS; ++g)
+        {
+            storages[h][g] = cns_storage_newMemoryStorage(cns, 0);
+            if (g % 2)
+            {
+                cns_setlasterr(cns, CNS_ERR_BUSY);
+                ck_assert_int_eq(CNS_OK, cns_host_addGroup_r(cns, hosts[h], 1000 + g, storages[h][g], g % PEERS));
+                ck_assert_int_eq(CNS_ERR_BUSY, cns_lasterr(cns));
+            }
+            else
+            {
+                cns_host_addGroup(cns, hosts[h], 1000 + g, storages[h][g], g % PEERS);
+                ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+            }
+        }
+    }
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_host_addGroup_r(cns, hosts[0], 1000, storages[0][0], 0));
+
+    // only leaders take proposals
+    cns_StorageBatch* batch = cns_storagebatch_new(cns);
+    uint64_t index = 0;
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_host_propose_r(cns, hosts[1], 1000, batch, &index));
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_host_propose_r(cns, hosts[0], 7, batch, &index));
+
+    // each proposal counts up a key of its group and deletes the one before, several proposals to a tick
+    uint64_t lastIndex[GROUPS] = { 0 };
+    for (int p = 0; p < PROPOSALS; ++p)
+    {
+        for (int g = 0; g < GROUPS; ++g)
+        {
+            cns_storagebatch_clear(cns, batch);
+            cns_Bytes* key = bytesStrFromInt(cns, p);
+            cns_Bytes* value = bytesStrFromInt(cns, g * 1000 + p);
+            cns_storagebatch_set(cns, batch, key, value);
+            cns_bytes_free(cns, value);
+            cns_bytes_free(cns, key);
+            if (p % 2)
+            {
+                key = bytesStrFromInt(cns, p - 1);
+                cns_storagebatch_delete(cns, batch, key);
+                cns_bytes_free(cns, key);
+            }
+            uint64_t proposed = 0;
+            if (g % 2)
+            {
+                cns_setlasterr(cns, CNS_ERR_BUSY);
+                ck_assert_int_eq(CNS_OK, cns_host_propose_r(cns, hosts[g % PEERS], 1000 + g, batch, &proposed));
+                ck_assert_int_eq(CNS_ERR_BUSY, cns_lasterr(cns));
+            }
+            else
+            {
+                proposed = cns_host_propose(cns, hosts[g % PEERS], 1000 + g, batch);
+                ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+            }
+            ck_assert_int_eq(lastIndex[g] + 1, proposed);
+            lastIndex[g] = proposed;
+        }
+        if (p % 3 == 0)
+            tickAll(cns, hosts, net);
+    }
+
+    for (int round = 0; round < 200; ++round)
+    {
+        cns_Bool done = CNS_YES;
+        for (int h = 0; h < PEERS; ++h)
+        {
+            for (int g = 0; g < GROUPS; ++g)
+                done = done && cns_host_appliedIndex(cns, hosts[h], 1000 + g) == PROPOSALS;
+        }
+        if (done)
+            break;
+        tickAll(cns, hosts, net);
+    }
+    for (int h = 0; h < PEERS; ++h)
+    {
+        for (int g = 0; g < GROUPS; ++g)
+        {
+            ck_assert_int_eq(PROPOSALS, cns_host_appliedIndex(cns, hosts[h], 1000 + g));
+            ck_assert_int_eq(PROPOSALS / 2, cns_storage_count(cns, storages[h][g]));
+            for (int p = 1; p < PROPOSALS; p += 2)
+            {
+                cns_Bytes* key = bytesStrFromInt(cns, p);
+                cns_Bytes* value = cns_storage_get(cns, storages[h][g], key);
+                cns_Bytes* expected = bytesStrFromInt(cns, g * 1000 + p);
+                ck_assert(cns_bytes_equal(cns, expected, value));
+                cns_bytes_free(cns, expected);
+                cns_bytes_free(cns, value);
+                cns_bytes_free(cns, key);
+            }
+        }
+    }
+
+    // whatever the number of groups, a tick sends each peer one frame at most, and idle groups only a heartbeat now and
+    // then
+    cns_HostStats before[PEERS];
+    for (int h = 0; h < PEERS; ++h)
+        cns_host_stats(cns, hosts[h], &before[h]);
+    enum { IDLE_TICKS = 40 };
+    for (int t = 0; t < IDLE_TICKS; ++t)
+        tickAll(cns, hosts, net);
+    for (int h = 0; h < PEERS; ++h)
+    {
+        cns_HostStats stats;
+        cns_host_stats(cns, hosts[h], &stats);
+        ck_assert_int_eq(before[h].ticks + IDLE_TICKS, stats.ticks);
+        ck_assert_uint_le(stats.framesSent - before[h].framesSent, IDLE_TICKS * (PEERS - 1));
+        ck_assert_uint_le(stats.messagesSent - before[h].messagesSent, (IDLE_TICKS / 4 + 1) * (PEERS - 1) * (GROUPS / PEERS + 1));
+        ck_assert_uint_ge(stats.messagesSent, 2 * stats.framesSent);
+        ck_assert_int_eq(0, stats.malformedFrames);
+    }
+
+    // damaged frames are counted and dropped
+    uint8_t garbage[] = { 1, 1, 9, 9 };
+    cns_Bytes* frame = cns_bytes_new(cns, garbage, sizeof(garbage));
+    cns_host_receive(cns, hosts[0], frame);
+    cns_bytes_free(cns, frame);
+    cns_host_tick(cns, hosts[0]);
+    cns_HostStats stats;
+    cns_host_stats(cns, hosts[0], &stats);
+    ck_assert_int_eq(1, stats.malformedFrames);
+
+    cns_storagebatch_free(cns, batch);
+    for (int h = 0; h < PEERS; ++h)
+    {
+        cns_host_free(cns, hosts[h]);
+        for (int g = 0; g < GROUPS; ++g)
+            cns_storage_free(cns, storages[h][g]);
+    }
+    cns_hostnet_free(cns, net);
+}
+
+START_TEST(test_host)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    runCluster(cns, 1, 0);
+    runCluster(cns, 1, 5);
+
+    // a cluster of one commits on its own
+    cns_Host* host = cns_host_new(cns, 0);
+    cns_Storage* storage = cns_storage_newMemoryStorage(cns, 0);
+    cns_host_addGroup(cns, host, 1, storage, 0);
+    cns_StorageBatch* batch = cns_storagebatch_new(cns);
+    cns_Bytes* key = bytesStrFromInt(cns, 1);
+    cns_storagebatch_set(cns, batch, key, key);
+    ck_assert_int_eq(1, cns_host_propose(cns, host, 1, batch));
+    ck_assert_int_eq(0, cns_host_appliedIndex(cns, host, 1));
+    cns_host_tick(cns, host);
+    ck_assert_int_eq(1, cns_host_appliedIndex(cns, host, 1));
+    ck_assert_int_eq(1, cns_storage_count(cns, storage));
+    cns_bytes_free(cns, key);
+    cns_storagebatch_free(cns, batch);
+    cns_host_free(cns, host);
+    cns_storage_free(cns, storage);
+
+    ck_assert_int_eq(noleaksNumber, test_rt_allocContext.bytesAllocated);
+    cns_shutdown(cns);
+}
+END_TEST
+
+START_TEST(test_host_workers)
+{
+    struct LockedAllocContext allocContext = {
+        .base = { .bytesAllocated = 0 },
+    };
+    pthread_mutex_init(&allocContext.mutex, 0);
+    cns_Runtime* cns = cns_startup(lockedAlloc, lockedFree, lockedRealloc, &allocContext);
+
+    const int noleaksNumber = allocContext.base.bytesAllocated;
+
+    runCluster(cns, 4, 0);
+    runCluster(cns, 3, 7);
+
+    ck_assert_int_eq(noleaksNumber, allocContext.base.bytesAllocated);
+    cns_shutdown(cns);
+    pthread_mutex_destroy(&allocContext.mutex);
+}
+END_TEST
+
+Suite* host_suite(void)
+{
+    Suite* s = suite_create("host");
+
+    TCase* tc = tcase_create("host");
+    tcase_add_test(tc, test_host);
+    tcase_add_test(tc, test_host_workers);
+
+    suite_add_tcase(s, tc);
+    return s;
+}
@@ -0,0 +1,337 @@
+#include <consensual/runtime.h>
+#include <consensual/hotkeys.h>
+#include <consensual/bytes.h>
+#include "alloc.h"
+
+#include <check.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum { THREADS = 4, KEYS = 1000, GETS_PER_THREAD = 20000 };
+
+static
+cns_Bytes* str(cns_Runtime* cns, const char * s)
+{
+    return cns_bytes_new(cns, s, strlen(s));
+}
+
+static
+cns_Bytes* numbered(cns_Runtime* cns, const char * prefix, int i)
+{
+    char buf[32];
+    sprintf(buf, "%s%d", prefix, i);
+    return str(cns, buf);
+}
+
+static
+void set(cns_Runtime* cns, cns_Storage* storage, const char * key, const char * value)
+{
+    cns_Bytes* k = str(cns, key);
+    cns_Bytes* v = str(cns, value);
+    cns_storage_set(cns, storage, k, v);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    cns_bytes_free(cns, v);
+    cns_bytes_free(cns, k);
+}
+
+// whether a get of `key` finds `value`, or nothing if it is NULL
+static
+cns_Bool getIs(cns_Runtime* cns, cns_Storage* storage, cns_Bytes* key, const char * value)
+{
+    cns_Bytes* found = cns_storage_get(cns, storage, key);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    cns_Bool rv = value ? (found && cns_bytes_length(cns, found) == (cns_Index) strlen(value)
+                           && !memcmp(cns_bytes_ptr(cns, found), value, strlen(value)))
+                        : !found;
+    if (found)
+        cns_bytes_free(cns, found);
+    return rv;
+}
+
+START_TEST(test_hotkeys)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    cns_Storage* storage = cns_storage_newMemoryStorage(cns, 0);
+    cns_HotKeysOptions options;
+    cns_hotkeysoptions_default(&options);
+    options.topKeys = 0;
+    ck_assert_ptr_eq(0, cns_hotkeys_start(cns, storage, &options));
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_lasterr(cns));
+    options.topKeys = 3;
+    options.sampleRate = 1; // count every get, so that the counts below are exact lower bounds
+    options.cacheSlots = 64;
+    cns_HotKeys* hotKeys = cns_hotkeys_start(cns, storage, &options);
+    ck_assert_ptr_ne(0, hotKeys);
+    ck_assert_ptr_eq(0, cns_hotkeys_start(cns, storage, 0));
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_lasterr(cns));
+
+    cns_Bytes* keys[50];
+    for (int i = 0; i < 50; ++i)
+    {
+        keys[i] = numbered(cns, "k", i);
+        cns_Bytes* value = numbered(cns, "v", i);
+        cns_storage_set(cns, storage, keys[i], value);
+        cns_bytes_free(cns, value);
+    }
+
+    // three keys take most of the reads
+    int gets = 0;
+    for (int round = 0; round < 100; ++round)
+    {
+        ck_assert(getIs(cns, storage, keys[0], "v0"));
+        ck_assert(getIs(cns, storage, keys[0], "v0"));
+        ck_assert(getIs(cns, storage, keys[0], "v0"));
+        ck_assert(getIs(cns, storage, keys[1], "v1"));
+        ck_assert(getIs(cns, storage, keys[1], "v1"));
+        ck_assert(getIs(cns, storage, keys[2], "v2"));
+        cns_bytes_free(cns, cns_storage_get(cns, storage, keys[3 + round % 47]));
+        gets += 7;
+    }
+
+    cns_HotKey top[8];
+    ck_assert_int_eq(3, cns_hotkeys_top(cns, hotKeys, top, 8));
+    for (int i = 0; i < 3; ++i)
+        ck_assert(cns_bytes_equal(cns, keys[i], top[i].key));
+    ck_assert_uint_ge(top[0].count, 300);
+    ck_assert_uint_ge(top[1].count, 200);
+    ck_assert_uint_ge(top[2].count, 100);
+    ck_assert_uint_lt(top[2].count, 200);
+    cns_hotkeys_releaseTop(cns, top, 3);
+    ck_assert_ptr_eq(0, top[0].key);
+    ck_assert_int_eq(1, cns_hotkeys_top(cns, hotKeys, top, 1));
+    cns_hotkeys_releaseTop(cns, top, 1);
+
+    cns_HotKeysStats stats;
+    cns_hotkeys_stats(cns, hotKeys, &stats);
+    ck_assert_int_eq(gets, stats.sampled);
+    ck_assert_int_eq(gets, stats.cacheHits + stats.cacheMisses);
+    ck_assert_uint_ge(stats.cacheHits, 250); // more unless the three keys share a slot
+    ck_assert_uint_ge(stats.cacheFills, 3);
+    uint64_t hits = stats.cacheHits;
+
+    // writes outdate what the cache holds, whichever way they reach the key
+    cns_Bytes* rope = cns_bytes_concat(cns, keys[1], keys[0]); // "k1k0"
+    set(cns, storage, "k0", "new");
+    ck_assert(getIs(cns, storage, keys[0], "new"));
+    ck_assert(getIs(cns, storage, keys[0], "new"));
+    ck_assert(cns_storage_delete(cns, storage, keys[0]));
+    ck_assert(getIs(cns, storage, keys[0], 0));
+    set(cns, storage, "k0", "again");
+    ck_assert(getIs(cns, storage, keys[0], "again"));
+    cns_StorageBatch* batch = cns_storagebatch_new(cns);
+    cns_Bytes* batched = str(cns, "batched");
+    cns_storagebatch_set(cns, batch, keys[1], batched);
+    cns_storagebatch_delete(cns, batch, keys[2]);
+    cns_storage_applyBatches(cns, storage, &batch, 1, 4);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    ck_assert(getIs(cns, storage, keys[1], "batched"));
+    ck_assert(getIs(cns, storage, keys[2], 0));
+    cns_Bool inserted = CNS_NO;
+    cns_StorageEntry* entry = cns_storage_getOrInsert(cns, storage, keys[0], batched, &inserted);
+    ck_assert(!inserted);
+    cns_storage_entrySetValue(cns, storage, entry, batched);
+    ck_assert(getIs(cns, storage, keys[0], "batched"));
+    set(cns, storage, "k1k0", "rope");
+    ck_assert(getIs(cns, storage, rope, "rope"));
+
+    // compressed values are cached decompressed
+    char big[1000];
+    memset(big, 'z', sizeof(big) - 1);
+    big[sizeof(big) - 1] = 0;
+    cns_storage_setCompression(cns, storage, 64, 0);
+    set(cns, storage, "k1", big);
+    for (int i = 0; i < 10; ++i)
+        ck_assert(getIs(cns, storage, keys[1], big));
+
+    // filling a slot and serving from it leave the last error of the caller alone
+    set(cns, storage, "k1", big);
+    cns_setlasterr(cns, CNS_ERR_BUSY);
+    for (int i = 0; i < 3; ++i)
+    {
+        cns_Bytes* found = 0;
+        ck_assert_int_eq(CNS_OK, cns_storage_get_r(cns, storage, keys[1], &found));
+        ck_assert_ptr_ne(0, found);
+        cns_bytes_free_r(cns, found);
+    }
+    ck_assert_int_eq(CNS_ERR_BUSY, cns_lasterr(cns));
+
+    cns_hotkeys_stats(cns, hotKeys, &stats);
+    ck_assert_uint_ge(stats.cacheHits, hits + 9);
+    cns_hotkeys_stop(cns, hotKeys);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    ck_assert(getIs(cns, storage, keys[1], big));
+
+    // counts age, so that a key which cools down leaves the top; 64 counters a row halve every 1024 sampled gets
+    options.topKeys = 1;
+    options.sketchWidth = 64;
+    options.cacheSlots = 0;
+    hotKeys = cns_hotkeys_start(cns, storage, &options);
+    for (int i = 0; i < 1000; ++i)
+        ck_assert(getIs(cns, storage, keys[3], "v3"));
+    for (int i = 0; i < 5000; ++i)
+        ck_assert(getIs(cns, storage, keys[4], "v4"));
+    ck_assert_int_eq(1, cns_hotkeys_top(cns, hotKeys, top, 1));
+    ck_assert(cns_bytes_equal(cns, keys[4], top[0].key));
+    ck_assert_uint_lt(top[0].count, 5000);
+    cns_hotkeys_releaseTop(cns, top, 1);
+    cns_hotkeys_stats(cns, hotKeys, &stats);
+    ck_assert_int_eq(6000, stats.sampled);
+    ck_assert_int_eq(0, stats.cacheHits + stats.cacheMisses);
+    cns_hotkeys_stop(cns, hotKeys);
+
+    cns_bytes_free(cns, batched);
+    cns_storagebatch_free(cns, batch);
+    cns_bytes_free(cns, rope);
+    for (int i = 0; i < 50; ++i)
+        cns_bytes_free(cns, keys[i]);
+    cns_storage_free(cns, storage);
+
+    ck_assert_int_eq(noleaksNumber, test_rt_allocContext.bytesAllocated);
+    cns_shutdown(cns);
+}
+END_TEST
+
+// gets with hot key caches allocate on the threads making them
+static
+void* threadsAlloc(const void* allocContext, cns_Index size, cns_Error* err)
+{
+    (void) allocContext;
+    void* rv = malloc((size_t) size);
+    *err = rv ? CNS_OK : CNS_ERR_NOMEM;
+    return rv;
+}
+
+static
+void threadsFree(const void* allocContext, void* ptr, cns_Error* err)
+{
+    (void) allocContext;
+    free(ptr);
+    *err = CNS_OK;
+}
+
+static
+void* threadsRealloc(const void* allocContext, void* ptr, cns_Index size, cns_Error* err)
+{
+    (void) allocContext;
+    void* rv = realloc(ptr, (size_t) size);
+    *err = rv ? CNS_OK : CNS_ERR_NOMEM;
+    return rv;
+}
+
+struct Reader
+{
+    cns_Runtime* cns;
+    cns_Storage* storage;
+    cns_Bytes** keys;
+    int thread;
+    const char * valuePrefix;
+    int wrong;
+};
+
+// nine gets in ten go to four keys
+static
+void* reader(void* arg)
+{
+    struct Reader* r = (struct Reader*) arg;
+    unsigned seed = 12345u + (unsigned) r->thread;
+    for (int i = 0; i < GETS_PER_THREAD; ++i)
+    {
+        seed = seed * 1103515245u + 12345u;
+        int k = (seed >> 8) % 10 ? (int) ((seed >> 4) % 4) : (int) ((seed >> 8) % KEYS);
+        char expected[32];
+        sprintf(expected, "%s%d", k < 4 ? r->valuePrefix : "value", k);
+        cns_Bytes* value = cns_storage_get(r->cns, r->storage, r->keys[k]);
+        if (!value || cns_bytes_length(r->cns, value) != (cns_Index) strlen(expected)
+            || memcmp(cns_bytes_ptr(r->cns, value), expected, strlen(expected)))
+            ++r->wrong;
+        if (value)
+            cns_bytes_free(r->cns, value);
+    }
+    return 0;
+}
+
+static
+void readOnThreads(cns_Runtime* cns, cns_Storage* storage, cns_Bytes** keys, const char * valuePrefix)
+{
+    pthread_t threads[THREADS];
+    struct Reader args[THREADS];
+    for (int i = 0; i < THREADS; ++i)
+    {
+        args[i] = (struct Reader) { .cns = cns, .storage = storage, .keys = keys, .thread = i, .valuePrefix = valuePrefix };
+        pthread_create(&threads[i], 0, reader, &args[i]);
+    }
+    for (int i = 0; i < THREADS; ++i)
+    {
+        pthread_join(threads[i], 0);
+        ck_assert_int_eq(0, args[i].wrong);
+    }
+}
+
+START_TEST(test_hotkeys_threads)
+{
+    cns_Runtime* cns = cns_startup(threadsAlloc, threadsFree, threadsRealloc, 0);
+    cns_Storage* storage = cns_storage_newMemoryStorage(cns, 0);
+    cns_Bytes* keys[KEYS];
+    for (int i = 0; i < KEYS; ++i)
+    {
+        keys[i] = numbered(cns, "key", i);
+        cns_Bytes* value = numbered(cns, "value", i);
+        cns_storage_set(cns, storage, keys[i], value);
+        cns_bytes_free(cns, value);
+    }
+    cns_HotKeys* hotKeys = cns_hotkeys_start(cns, storage, 0);
+    ck_assert_ptr_ne(0, hotKeys);
+
+    readOnThreads(cns, storage, keys, "value");
+    cns_HotKey top[4];
+    ck_assert_int_eq(4, cns_hotkeys_top(cns, hotKeys, top, 4));
+    for (int i = 0; i < 4; ++i)
+    {
+        const char * key = (const char *) cns_bytes_ptr(cns, top[i].key);
+        ck_assert_int_eq(4, cns_bytes_length(cns, top[i].key));
+        ck_assert(!memcmp("key", key, 3) && key[3] >= '0' && key[3] <= '3');
+    }
+    cns_hotkeys_releaseTop(cns, top, 4);
+
+    // caches of every thread see the writes made between the rounds
+    for (int i = 0; i < 4; ++i)
+    {
+        cns_Bytes* value = numbered(cns, "changed", i);
+        cns_storage_set(cns, storage, keys[i], value);
+        cns_bytes_free(cns, value);
+    }
+    readOnThreads(cns, storage, keys, "changed");
+
+    cns_HotKeysStats stats;
+    cns_hotkeys_stats(cns, hotKeys, &stats);
+    ck_assert_uint_le(stats.cacheHits + stats.cacheMisses, 2 * THREADS * GETS_PER_THREAD);
+    ck_assert_uint_gt(stats.cacheHits, THREADS * GETS_PER_THREAD);
+    ck_assert_uint_gt(stats.sampled, 0);
+
+    cns_hotkeys_stop(cns, hotKeys);
+    for (int i = 0; i < KEYS; ++i)
+        cns_bytes_free(cns, keys[i]);
+    cns_storage_free(cns, storage);
+    cns_shutdown(cns);
+}
+END_TEST
+
+Suite* hotkeys_suite(void)
+{
+    Suite* s = suite_create("hotkeys");
+
+    TCase* tc = tcase_create("hotkeys");
+    tcase_add_test(tc, test_hotkeys);
+    tcase_add_test(tc, test_hotkeys_threads);
+
+    suite_add_tcase(s, tc);
+    return s;
+}
@@ -0,0 +1,288 @@
+#include <consensual/runtime.h>
+#include <consensual/io.h>
+#include <consensual/bytes.h>
+#include "alloc.h"
+
+#include <check.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static
+int openTempFile(void)
+{
+    char path[] = "/tmp/cns_ioXXXXXX";
+    int fd = mkstemp(path);
+    ck_assert_int_ge(fd, 0);
+    unlink(path);
+    return fd;
+}
+
+struct CallbackLog
+{
+    int         calls;
+    cns_Index   bytes;
+    int         lastOp;
+};
+
+static
+void logCompletion(cns_Runtime* cns, cns_Io* io, const cns_IoCompletion* completion)
+{
+    (void) io;
+    struct CallbackLog* log = (struct CallbackLog*) completion->context;
+    ++log->calls;
+    log->bytes += completion->result;
+    log->lastOp = completion->op;
+    if (completion->data)
+        cns_bytes_free(cns, completion->data);
+}
+
+static
+void runWritesAndReads(cns_Bool portable)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    cns_IoOptions options;
+    cns_iooptions_default(&options);
+    options.portable = portable;
+    options.entries = 4; // fewer than the operations below, so some wait in the queue
+    cns_Io* io = cns_io_new(cns, &options);
+    ck_assert_ptr_ne(0, io);
+    cns_IoStats stats;
+    cns_io_stats(cns, io, &stats);
+    if (portable)
+        ck_assert(!stats.async);
+
+    int fd = openTempFile();
+
+    // a flat block, a slice and a concatenation, freed as soon as they are queued
+    cns_Bytes* hello = cns_bytes_new(cns, "hello, ", 7);
+    cns_Bytes* world = cns_bytes_new(cns, "xworldx", 7);
+    cns_Bytes* slice = cns_bytes_slice(cns, world, 1, 5);
+    cns_Bytes* rope = cns_bytes_concat(cns, hello, slice);
+    cns_io_write(cns, io, fd, 0, hello, 0, (void*) 1);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    cns_io_write(cns, io, fd, 7, slice, 0, (void*) 2);
+    cns_io_write(cns, io, fd, 12, rope, 0, (void*) 3);
+    cns_bytes_free(cns, rope);
+    cns_bytes_free(cns, slice);
+    cns_bytes_free(cns, world);
+    cns_bytes_free(cns, hello);
+
+    char block[1000];
+    for (int i = 0; i < 10; ++i)
+    {
+        memset(block, 'a' + i, sizeof(block));
+        cns_Bytes* data = cns_bytes_new(cns, block, sizeof(block));
+        if (i < 9)
+            cns_io_write(cns, io, fd, 24 + i * (int) sizeof(block), data, 0, (void*) (intptr_t) (10 + i));
+        else
+        {
+            // long enough to stay in pieces, which are gathered without touching the last error
+            cns_Bytes* head = cns_bytes_slice(cns, data, 0, 600);
+            cns_Bytes* tail = cns_bytes_slice(cns, data, 600, 400);
+            cns_Bytes* pieces = cns_bytes_concat(cns, head, tail);
+            ck_assert_int_eq(2, cns_bytes_chunkCount(cns, pieces));
+            cns_setlasterr(cns, CNS_ERR_BUSY);
+            ck_assert_int_eq(CNS_OK, cns_io_write_r(cns, io, fd, 24 + i * (int) sizeof(block), pieces, 0, (void*) (intptr_t) (10 + i)));
+            ck_assert_int_eq(CNS_ERR_BUSY, cns_lasterr(cns));
+            cns_bytes_free(cns, pieces);
+            cns_bytes_free(cns, tail);
+            cns_bytes_free(cns, head);
+        }
+        cns_bytes_free(cns, data);
+    }
+    struct CallbackLog log = { 0, 0, 0 };
+    cns_io_fsync(cns, io, fd, CNS_YES, logCompletion, &log);
+
+    ck_assert_int_gt(cns_io_submit(cns, io), 0);
+    cns_IoCompletion completions[20];
+    cns_Index n = cns_io_poll(cns, io, completions, 20, 13);
+    ck_assert_int_eq(13, n);
+    cns_Index written = 0;
+    for (cns_Index i = 0; i < n; ++i)
+    {
+        ck_assert_int_eq(CNS_IO_WRITE, completions[i].op);
+        ck_assert_ptr_eq(0, completions[i].data);
+        ck_assert_int_gt(completions[i].result, 0);
+        written += completions[i].result;
+    }
+    ck_assert_int_eq(24 + 10 * (cns_Index) sizeof(block), written);
+
+    // the fsync drains the writes, so it comes last
+    while (!log.calls)
+        cns_io_poll(cns, io, completions, 20, 1);
+    ck_assert_int_eq(1, log.calls);
+    ck_assert_int_eq(0, log.bytes);
+    ck_assert_int_eq(CNS_IO_FSYNC, log.lastOp);
+
+    char check[30];
+    ck_assert_int_eq(30, pread(fd, check, 30, 0));
+    ck_assert(0 == memcmp("hello, worldhello, worldaaaaaa", check, 30));
+
+    // reads hand over what they got, short at the end of the file
+    cns_io_read(cns, io, fd, 7, 5, 0, 0);
+    cns_io_read(cns, io, fd, 24 + 10 * (cns_Index) sizeof(block) - 100, 1000, 0, 0);
+    n = cns_io_poll(cns, io, completions, 20, 2);
+    ck_assert_int_eq(2, n);
+    for (cns_Index i = 0; i < n; ++i)
+    {
+        ck_assert_int_eq(CNS_IO_READ, completions[i].op);
+        ck_assert_int_eq(completions[i].result, cns_bytes_length(cns, completions[i].data));
+        if (completions[i].result == 5)
+            ck_assert(0 == memcmp("world", cns_bytes_ptr(cns, completions[i].data), 5));
+        else
+        {
+            ck_assert_int_eq(100, completions[i].result);
+            ck_assert_int_eq('j', ((const char *) cns_bytes_ptr(cns, completions[i].data))[99]);
+        }
+        cns_bytes_free(cns, completions[i].data);
+    }
+
+    // reads with callbacks, and errors come back as negative results
+    log.calls = 0;
+    log.bytes = 0;
+    cns_io_read(cns, io, fd, 0, 12, logCompletion, &log);
+    int badFd = openTempFile();
+    close(badFd);
+    cns_Bytes* x = cns_bytes_new(cns, "x", 1);
+    cns_io_write(cns, io, badFd, 0, x, 0, 0);
+    cns_bytes_free(cns, x);
+    n = cns_io_poll(cns, io, completions, 20, 2);
+    ck_assert_int_eq(1, n);
+    ck_assert_int_eq(-EBADF, completions[0].result);
+    ck_assert_int_eq(1, log.calls);
+    ck_assert_int_eq(12, log.bytes);
+
+    // a full output leaves the rest for the next poll
+    for (int i = 0; i < 5; ++i)
+        cns_io_fsync(cns, io, fd, CNS_NO, 0, 0);
+    cns_Index total = 0;
+    while (total < 5)
+    {
+        n = cns_io_poll(cns, io, completions, 2, 1);
+        ck_assert_int_le(n, 2);
+        total += n;
+    }
+    ck_assert_int_eq(0, cns_io_poll(cns, io, completions, 2, 0));
+
+    cns_io_stats(cns, io, &stats);
+    ck_assert_int_eq(0, stats.queued);
+    ck_assert_int_eq(0, stats.inFlight);
+    ck_assert_int_eq(stats.submitted, stats.completed);
+    ck_assert_int_eq(23, stats.completed);
+
+    // dropping unpolled and unsubmitted operations
+    cns_Bytes* data = cns_bytes_new(cns, block, sizeof(block));
+    cns_io_write(cns, io, fd, 0, data, 0, 0);
+    cns_io_submit(cns, io);
+    cns_io_write(cns, io, fd, 0, data, 0, 0);
+    cns_io_read(cns, io, fd, 0, 10, 0, 0);
+    cns_bytes_free(cns, data);
+
+    cns_io_free(cns, io);
+    close(fd);
+
+    ck_assert_int_eq(noleaksNumber, test_rt_allocContext.bytesAllocated);
+    cns_shutdown(cns);
+}
+
+START_TEST(test_io_portable)
+{
+    runWritesAndReads(CNS_YES);
+}
+END_TEST
+
+START_TEST(test_io_async)
+{
+    runWritesAndReads(CNS_NO);
+}
+END_TEST
+
+START_TEST(test_io_registeredBuffers)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    cns_Io* io = cns_io_new(cns, 0);
+    ck_assert_ptr_ne(0, io);
+    int fd = openTempFile();
+
+    char segment[4096];
+    for (int i = 0; i < (int) sizeof(segment); ++i)
+        segment[i] = (char) ('0' + i % 10);
+    cns_Bytes* buffer = cns_bytes_new(cns, segment, sizeof(segment));
+    cns_Bytes* empty = cns_bytes_new(cns, "", 0);
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_io_registerBuffers_r(cns, io, &empty, 1));
+    cns_bytes_free(cns, empty);
+
+    cns_Error err = cns_io_registerBuffers_r(cns, io, &buffer, 1);
+    cns_IoStats stats;
+    cns_io_stats(cns, io, &stats);
+    if (err == CNS_ERR_IO)
+    {
+        // no locked memory allowed here; everything still works without
+        ck_assert(stats.async);
+    }
+    else
+        ck_assert_int_eq(CNS_OK, err);
+
+    // slices of the registered buffer go from its pages, at the file position
+    for (int i = 0; i < 4; ++i)
+    {
+        cns_Bytes* slice = cns_bytes_slice(cns, buffer, i * 1000, 1000);
+        cns_io_write(cns, io, fd, -1, slice, 0, 0);
+        cns_bytes_free(cns, slice);
+        cns_IoCompletion completion;
+        ck_assert_int_eq(1, cns_io_poll(cns, io, &completion, 1, 1));
+        ck_assert_int_eq(1000, completion.result);
+    }
+    cns_io_stats(cns, io, &stats);
+    if (stats.async && err == CNS_OK)
+        ck_assert_int_eq(4, stats.fixedWrites);
+    else
+        ck_assert_int_eq(0, stats.fixedWrites);
+
+    char check[4000];
+    ck_assert_int_eq(4000, pread(fd, check, sizeof(check), 0));
+    ck_assert(0 == memcmp(segment, check, sizeof(check)));
+
+    // the queue keeps the buffer alive
+    cns_bytes_free(cns, buffer);
+    cns_Bytes* x = cns_bytes_new(cns, "x", 1);
+    cns_io_write(cns, io, fd, 0, x, 0, 0);
+    cns_bytes_free(cns, x);
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_io_registerBuffers_r(cns, io, 0, 0));
+
+    cns_io_free(cns, io);
+    close(fd);
+
+    ck_assert_int_eq(noleaksNumber, test_rt_allocContext.bytesAllocated);
+    cns_shutdown(cns);
+}
+END_TEST
+
+Suite* io_suite(void)
+{
+    Suite* s = suite_create("io");
+
+    TCase* tc = tcase_create("io");
+    tcase_add_test(tc, test_io_portable);
+    tcase_add_test(tc, test_io_async);
+    tcase_add_test(tc, test_io_registeredBuffers);
+
+    suite_add_tcase(s, tc);
+    return s;
+}
@@ -0,0 +1,123 @@
+#include <consensual/runtime.h>
+#include <consensual/bytes.h>
+#include <consensual/kernels.h>
+#include <check.h>
+
+#include <string.h>
+
+#include "alloc.h"
+
+static const cns_KernelLevel levels[] = { CNS_KERNEL_SCALAR, CNS_KERNEL_SSE2, CNS_KERNEL_SSE42, CNS_KERNEL_AVX2 };
+#define NUMLEVELS ((int) (sizeof(levels) / sizeof(levels[0])))
+
+START_TEST(test_crc32c)
+{
+    ck_assert(cns_kernels_supported(CNS_KERNEL_SCALAR));
+    ck_assert(cns_kernels_supported(CNS_KERNEL_AUTO));
+
+    for (int l = 0; l < NUMLEVELS; ++l)
+    {
+        // the standard check value
+        ck_assert_uint_eq(0xE3069283u, cns_kernels_crc32c(levels[l], 0, "123456789", 9));
+        ck_assert_uint_eq(0, cns_kernels_crc32c(levels[l], 0, "", 0));
+    }
+
+    uint8_t data[512 + 8];
+    uint32_t x = 12345;
+    for (int i = 0; i < (int) sizeof(data); ++i)
+    {
+        x = x * 1103515245u + 12345u;
+        data[i] = (uint8_t) (x >> 16);
+    }
+
+    // every level and alignment agrees with the scalar version
+    for (int offset = 0; offset < 8; ++offset)
+    {
+        for (int length = 0; length <= 512; ++length)
+        {
+            uint32_t expected = cns_kernels_crc32c(CNS_KERNEL_SCALAR, 0, data + offset, length);
+            for (int l = 1; l < NUMLEVELS; ++l)
+                ck_assert_uint_eq(expected, cns_kernels_crc32c(levels[l], 0, data + offset, length));
+            ck_assert_uint_eq(expected, cns_kernels_crc32c(CNS_KERNEL_AUTO, 0, data + offset, length));
+
+            // feeding in two pieces gives the same result
+            int half = length / 3;
+            uint32_t crc = cns_kernels_crc32c(CNS_KERNEL_AUTO, 0, data + offset, half);
+            ck_assert_uint_eq(expected, cns_kernels_crc32c(CNS_KERNEL_SCALAR, crc, data + offset + half, length - half));
+        }
+    }
+}
+END_TEST
+
+START_TEST(test_equal)
+{
+    uint8_t lhs[300 + 1];
+    uint8_t rhs[300 + 1];
+    for (int i = 0; i < (int) sizeof(lhs); ++i)
+        lhs[i] = rhs[i] = (uint8_t) (i * 7);
+
+    for (int length = 0; length <= 300; ++length)
+    {
+        for (int l = 0; l < NUMLEVELS; ++l)
+        {
+            // unaligned on purpose
+            ck_assert_int_eq(CNS_YES, cns_kernels_equal(levels[l], lhs + 1, rhs + 1, length));
+
+            for (int diff = 0; diff < length; ++diff)
+            {
+                rhs[1 + diff] ^= 0x80;
+                ck_assert_int_eq(CNS_NO, cns_kernels_equal(levels[l], lhs + 1, rhs + 1, length));
+                rhs[1 + diff] ^= 0x80;
+            }
+        }
+    }
+}
+END_TEST
+
+START_TEST(test_bytes_prefix)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    const char * text = "user/1234567890/profile/settings/notifications";
+    cns_Bytes* key = cns_bytes_new(cns, text, strlen(text));
+    cns_Bytes* prefix = cns_bytes_new(cns, text, 16);
+    cns_Bytes* other = cns_bytes_new(cns, "user/1234567891/", 16);
+    cns_Bytes* empty = cns_bytes_new(cns, 0, 0);
+
+    ck_assert_int_eq(CNS_YES, cns_bytes_hasPrefix(cns, key, prefix));
+    ck_assert_int_eq(CNS_YES, cns_bytes_hasPrefix(cns, key, key));
+    ck_assert_int_eq(CNS_YES, cns_bytes_hasPrefix(cns, key, empty));
+    ck_assert_int_eq(CNS_NO, cns_bytes_hasPrefix(cns, key, other));
+    ck_assert_int_eq(CNS_NO, cns_bytes_hasPrefix(cns, prefix, key));
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    ck_assert_int_eq(CNS_NO, cns_bytes_hasPrefix(cns, key, 0));
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_lasterr(cns));
+
+    cns_bytes_free(cns, key);
+    cns_bytes_free(cns, prefix);
+    cns_bytes_free(cns, other);
+    cns_bytes_free(cns, empty);
+
+    ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+Suite* kernels_suite(void)
+{
+    Suite* s = suite_create("kernels");
+
+    TCase* tc = tcase_create("kernels");
+    tcase_add_test(tc, test_crc32c);
+    tcase_add_test(tc, test_equal);
+    tcase_add_test(tc, test_bytes_prefix);
+
+    suite_add_tcase(s, tc);
+    return s;
+}
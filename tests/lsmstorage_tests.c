@@ -0,0 +1,295 @@
+#include <consensual/runtime.h>
+#include <consensual/lsmstorage.h>
+#include <consensual/blockcache.h>
+#include <consensual/bytes.h>
+#include "alloc.h"
+
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+
+static
+void makeTempDirectory(char* path)
+{
+    strcpy(path, "/tmp/cns_lsmXXXXXX");
+    ck_assert_ptr_ne(0, mkdtemp(path));
+}
+
+static
+void removeDirectory(const char * path)
+{
+    DIR* dir = opendir(path);
+    struct dirent* entry;
+    while (dir && (entry = readdir(dir)) != 0)
+    {
+        char file[512];
+        snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+            unlink(file);
+    }
+    if (dir)
+        closedir(dir);
+    rmdir(path);
+}
+
+static
+cns_Bytes* keyFromInt(cns_Runtime* cns, int x)
+{
+    char buf[40];
+    sprintf(buf, "key%06d", x);
+    return cns_bytes_new(cns, buf, strlen(buf));
+}
+
+// the value of key `x` after `round` updates, padded so that tables fill up quickly
+static
+cns_Bytes* valueFromInt(cns_Runtime* cns, int x, int round)
+{
+    char buf[64];
+    memset(buf, '.', sizeof(buf));
+    int n = sprintf(buf, "%d/%d", x, round);
+    buf[n] = '.';
+    return cns_bytes_new(cns, buf, 20 + x % 40);
+}
+
+static
+cns_Bool valueIs(cns_Runtime* cns, cns_Bytes* value, int x, int round)
+{
+    cns_Bytes* expected = valueFromInt(cns, x, round);
+    cns_Bool rv = value && cns_bytes_equal(cns, value, expected);
+    cns_bytes_free(cns, expected);
+    return rv;
+}
+
+START_TEST(test_lsmstorage)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    char path[64];
+    makeTempDirectory(path);
+
+    cns_Storage* storage = cns_storage_newLsmStorage(cns, path, 0);
+    ck_assert_ptr_ne(0, storage);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    // one process at a time
+    ck_assert_ptr_eq(0, cns_storage_newLsmStorage(cns, path, 0));
+    ck_assert_int_eq(CNS_ERR_IO, cns_lasterr(cns));
+
+    for (int i = 0; i < 100; ++i)
+    {
+        cns_Bytes* key = keyFromInt(cns, i);
+        cns_Bytes* value = valueFromInt(cns, i, 0);
+        cns_storage_set(cns, storage, key, value);
+        ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+        cns_bytes_free(cns, value);
+        cns_bytes_free(cns, key);
+    }
+    ck_assert_int_eq(100, cns_storage_count(cns, storage));
+
+    cns_Bytes* key = keyFromInt(cns, 7);
+    cns_Bytes* value = cns_storage_get(cns, storage, key);
+    ck_assert(valueIs(cns, value, 7, 0));
+    cns_bytes_free(cns, value);
+    ck_assert_int_eq(CNS_YES, cns_storage_delete(cns, storage, key));
+    ck_assert_int_eq(CNS_NO, cns_storage_delete(cns, storage, key));
+    ck_assert_ptr_eq(0, cns_storage_get(cns, storage, key));
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    ck_assert_int_eq(99, cns_storage_count(cns, storage));
+
+    // entries point into the memory storage's table, which this one does not have
+    ck_assert_ptr_eq(0, cns_storage_getOrInsert(cns, storage, key, key, 0));
+    ck_assert_int_eq(CNS_ERR_UNSUPPORTED, cns_lasterr(cns));
+    cns_bytes_free(cns, key);
+
+    // values written to tables are found there, and deletes hide them
+    cns_storage_lsmFlush(cns, storage, CNS_YES);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    key = keyFromInt(cns, 8);
+    ck_assert_int_eq(CNS_YES, cns_storage_delete(cns, storage, key));
+    ck_assert_ptr_eq(0, cns_storage_get(cns, storage, key));
+    cns_bytes_free(cns, key);
+    key = keyFromInt(cns, 9);
+    value = cns_storage_get(cns, storage, key);
+    ck_assert(valueIs(cns, value, 9, 0));
+    cns_bytes_free(cns, value);
+    cns_bytes_free(cns, key);
+
+    cns_LsmStats stats;
+    cns_storage_lsmStats(cns, storage, &stats);
+    ck_assert_int_eq(1, stats.flushes);
+    ck_assert_int_eq(1, stats.tablesPerLevel[0]);
+    ck_assert_int_ne(0, stats.blockReads);
+
+    // what is only in the log comes back after reopening
+    key = keyFromInt(cns, 1000);
+    value = valueFromInt(cns, 1000, 0);
+    cns_storage_set(cns, storage, key, value);
+    cns_bytes_free(cns, value);
+    cns_storage_free(cns, storage);
+
+    storage = cns_storage_newLsmStorage(cns, path, 0);
+    ck_assert_ptr_ne(0, storage);
+    ck_assert_int_eq(99, cns_storage_count(cns, storage));
+    value = cns_storage_get(cns, storage, key);
+    ck_assert(valueIs(cns, value, 1000, 0));
+    cns_bytes_free(cns, value);
+    cns_bytes_free(cns, key);
+    for (int i = 0; i < 100; ++i)
+    {
+        key = keyFromInt(cns, i);
+        value = cns_storage_get(cns, storage, key);
+        if (i == 7 || i == 8)
+            ck_assert_ptr_eq(0, value);
+        else
+            ck_assert(valueIs(cns, value, i, 0));
+        if (value)
+            cns_bytes_free(cns, value);
+        cns_bytes_free(cns, key);
+    }
+
+    cns_Storage* memoryStorage = cns_storage_newMemoryStorage(cns, 0);
+    cns_storage_lsmFlush(cns, memoryStorage, CNS_NO);
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_lasterr(cns));
+    cns_storage_free(cns, memoryStorage);
+
+    cns_storage_free(cns, storage);
+    removeDirectory(path);
+
+    ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+START_TEST(test_lsmstorage_compaction)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    // the cache stays with the runtime, but its blocks go with the storage
+    cns_blockcache_setCapacity(cns, 64 << 10);
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    char path[64];
+    makeTempDirectory(path);
+
+    // tiny tables, so that a few thousand writes go through several levels
+    cns_LsmOptions options;
+    cns_lsmoptions_default(&options);
+    options.memtableBytes = 8 << 10;
+    options.tableBytes = 4 << 10;
+    options.blockBytes = 512;
+    options.level0Tables = 2;
+    options.levelRatio = 4;
+    cns_Storage* storage = cns_storage_newLsmStorage(cns, path, &options);
+    ck_assert_ptr_ne(0, storage);
+
+    // `rounds[i]` is the last round key i was written in, -1 if it is deleted
+    enum { KEYS = 2000, ROUNDS = 4 };
+    int rounds[KEYS];
+    for (int i = 0; i < KEYS; ++i)
+        rounds[i] = -1;
+    for (int round = 0; round < ROUNDS; ++round)
+    {
+        for (int j = 0; j < KEYS; ++j)
+        {
+            int i = (int) ((unsigned) j * 7919u % KEYS);
+            cns_Bytes* key = keyFromInt(cns, i);
+            if ((i + round) % 5 == 0)
+            {
+                ck_assert_int_eq(rounds[i] >= 0, cns_storage_delete(cns, storage, key));
+                rounds[i] = -1;
+            }
+            else if (i % 3 != round % 3)
+            {
+                cns_Bytes* value = valueFromInt(cns, i, round);
+                cns_storage_set(cns, storage, key, value);
+                ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+                cns_bytes_free(cns, value);
+                rounds[i] = round;
+            }
+            cns_bytes_free(cns, key);
+        }
+    }
+
+    int expectedCount = 0;
+    for (int i = 0; i < KEYS; ++i)
+        expectedCount += (rounds[i] >= 0);
+    ck_assert_int_eq(expectedCount, cns_storage_count(cns, storage));
+
+    cns_storage_lsmFlush(cns, storage, CNS_YES);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    cns_LsmStats stats;
+    cns_storage_lsmStats(cns, storage, &stats);
+    ck_assert_int_ne(0, stats.compactions);
+    ck_assert_int_ne(0, stats.tablesPerLevel[2] + stats.tablesPerLevel[3] + stats.tablesPerLevel[4]);
+    ck_assert(stats.tablesPerLevel[0] < options.level0Tables);
+    ck_assert(stats.flushBytesWritten + stats.compactionBytesWritten > stats.userBytesWritten);
+#ifdef CNS_ENABLE_ALLOC_PROFILE
+    // each opened table holds its own state, index and block handles
+    cns_AllocProfile profile;
+    cns_runtime_allocProfile(cns, &profile);
+    int numTables = 0;
+    for (int level = 0; level < CNS_LSM_MAXLEVELS; ++level)
+        numTables += stats.tablesPerLevel[level];
+    ck_assert_int_ge(profile.categories[CNS_ALLOC_LSM].liveCount, 3 * numTables);
+#endif
+
+    for (int reopen = 0; reopen < 2; ++reopen)
+    {
+        for (int i = 0; i < KEYS; ++i)
+        {
+            cns_Bytes* key = keyFromInt(cns, i);
+            cns_Bytes* value = cns_storage_get(cns, storage, key);
+            ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+            if (rounds[i] < 0)
+                ck_assert_ptr_eq(0, value);
+            else
+                ck_assert(valueIs(cns, value, i, rounds[i]));
+            if (value)
+                cns_bytes_free(cns, value);
+            cns_bytes_free(cns, key);
+        }
+        cns_storage_lsmStats(cns, storage, &stats);
+        // filters spare reading tables which do not have the key, so a lookup reads about one block
+        ck_assert_int_ne(0, stats.bloomNegatives);
+        ck_assert(stats.blockReads + stats.blockCacheHits < stats.diskGets + stats.diskGets / 10);
+        // the cache holds about a third of the data
+        ck_assert_int_ne(0, stats.blockCacheHits);
+
+        cns_storage_free(cns, storage);
+        storage = cns_storage_newLsmStorage(cns, path, &options);
+        ck_assert_ptr_ne(0, storage);
+        ck_assert_int_eq(expectedCount, cns_storage_count(cns, storage));
+    }
+
+    cns_storage_free(cns, storage);
+    removeDirectory(path);
+
+    ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+Suite* lsmstorage_suite(void)
+{
+    Suite* s = suite_create("lsmstorage");
+
+    TCase* tc = tcase_create("lsmstorage");
+    tcase_set_timeout(tc, 30);
+    tcase_add_test(tc, test_lsmstorage);
+    tcase_add_test(tc, test_lsmstorage_compaction);
+
+    suite_add_tcase(s, tc);
+    return s;
+}
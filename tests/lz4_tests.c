@@ -0,0 +1,127 @@
+#include <consensual/runtime.h>
+#include <consensual/lz4.h>
+#include <check.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static
+void roundTrip(const uint8_t* data, cns_Index size, cns_Index expectedMaxCompressed)
+{
+    cns_Index bound = CNS_LZ4_BOUND(size);
+    uint8_t* compressed = malloc(bound);
+    uint8_t* decompressed = malloc(size + 1);
+
+    cns_Index compressedSize = cns_lz4_compress(data, size, compressed, bound);
+    ck_assert_int_gt(compressedSize, 0);
+    ck_assert_int_le(compressedSize, expectedMaxCompressed);
+    ck_assert_int_eq(size, cns_lz4_decompress(compressed, compressedSize, decompressed, size + 1));
+    ck_assert(size == 0 || 0 == memcmp(data, decompressed, size));
+
+    // exact room is enough, one byte less is not
+    ck_assert_int_eq(size, cns_lz4_decompress(compressed, compressedSize, decompressed, size));
+    if (size)
+        ck_assert_int_eq(-1, cns_lz4_decompress(compressed, compressedSize, decompressed, size - 1));
+    // neither is less room for the compressed form
+    ck_assert_int_eq(0, cns_lz4_compress(data, size, compressed, compressedSize - 1));
+    // every truncation is caught
+    for (cns_Index cut = 1; cut < compressedSize; cut += 1 + cut / 16)
+        ck_assert(cns_lz4_decompress(compressed, compressedSize - cut, decompressed, size + 1) != size);
+
+    free(decompressed);
+    free(compressed);
+}
+
+START_TEST(test_lz4)
+{
+    // nothing to find in short inputs
+    roundTrip((const uint8_t*) "", 0, 1);
+    roundTrip((const uint8_t*) "hello", 5, 6);
+    roundTrip((const uint8_t*) "abcabcabcabc", 12, 13);
+
+    enum { SIZE = 100000 };
+    uint8_t* data = malloc(SIZE);
+
+    memset(data, 'x', SIZE);
+    roundTrip(data, SIZE, SIZE / 200);
+
+    // short repeats, which overlap their own copy
+    for (int i = 0; i < SIZE; ++i)
+        data[i] = "abcdefg"[i % 7];
+    roundTrip(data, SIZE, SIZE / 200);
+
+    int n = 0;
+    for (int i = 0; n < SIZE - 100; ++i)
+        n += sprintf((char *) data + n, "{\"id\":%d,\"name\":\"user%d\",\"active\":%s},", i, i * 7, i % 3 ? "true" : "false");
+    roundTrip(data, n, n / 3);
+
+    // random data grows a little, within the bound
+    srand(1);
+    for (int i = 0; i < SIZE; ++i)
+        data[i] = (uint8_t) rand();
+    roundTrip(data, SIZE, CNS_LZ4_BOUND(SIZE));
+
+    // matches further back than an offset can reach
+    for (int i = 0; i < SIZE; ++i)
+        data[i] = (uint8_t) rand();
+    memcpy(data + 70000, data, 1000);
+    roundTrip(data, SIZE, CNS_LZ4_BOUND(SIZE));
+
+    free(data);
+}
+END_TEST
+
+START_TEST(test_lz4_format)
+{
+    // a block made by hand: 3 literals, a 9 byte match 3 back, then the last 5 literals
+    const uint8_t block[] = { 0x35, 'a', 'b', 'c', 0x03, 0x00, 0x50, 'x', 'y', 'z', 'z', 'y' };
+    char out[32];
+    ck_assert_int_eq(17, cns_lz4_decompress(block, sizeof(block), out, sizeof(out)));
+    ck_assert(0 == memcmp("abcabcabcabcxyzzy", out, 17));
+
+    // lengths of 15 and more continue in extra bytes
+    uint8_t longLiterals[1 + 2 + 300];
+    longLiterals[0] = 0xf0;
+    longLiterals[1] = 255;
+    longLiterals[2] = 300 - 15 - 255;
+    memset(longLiterals + 3, 'q', 300);
+    char longOut[300];
+    ck_assert_int_eq(300, cns_lz4_decompress(longLiterals, sizeof(longLiterals), longOut, sizeof(longOut)));
+
+    // malformed blocks
+    const uint8_t zeroOffset[] = { 0x10, 'a', 0x00, 0x00, 0x00 };
+    ck_assert_int_eq(-1, cns_lz4_decompress(zeroOffset, sizeof(zeroOffset), out, sizeof(out)));
+    const uint8_t beforeStart[] = { 0x10, 'a', 0x02, 0x00, 0x00 };
+    ck_assert_int_eq(-1, cns_lz4_decompress(beforeStart, sizeof(beforeStart), out, sizeof(out)));
+    const uint8_t endsWithMatch[] = { 0x10, 'a', 0x01, 0x00 };
+    ck_assert_int_eq(-1, cns_lz4_decompress(endsWithMatch, sizeof(endsWithMatch), out, sizeof(out)));
+    const uint8_t unfinishedLength[] = { 0xf0, 255 };
+    ck_assert_int_eq(-1, cns_lz4_decompress(unfinishedLength, sizeof(unfinishedLength), out, sizeof(out)));
+    ck_assert_int_eq(-1, cns_lz4_decompress(block, 0, out, sizeof(out)));
+
+    // random garbage never decodes out of bounds
+    srand(2);
+    uint8_t garbage[64];
+    for (int round = 0; round < 10000; ++round)
+    {
+        int size = 1 + rand() % (int) sizeof(garbage);
+        for (int i = 0; i < size; ++i)
+            garbage[i] = (uint8_t) rand();
+        cns_Index n = cns_lz4_decompress(garbage, size, out, sizeof(out));
+        ck_assert(n >= -1 && n <= (cns_Index) sizeof(out));
+    }
+}
+END_TEST
+
+Suite* lz4_suite(void)
+{
+    Suite* s = suite_create("lz4");
+
+    TCase* tc = tcase_create("lz4");
+    tcase_add_test(tc, test_lz4);
+    tcase_add_test(tc, test_lz4_format);
+
+    suite_add_tcase(s, tc);
+    return s;
+}
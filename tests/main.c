@@ -30,9 +30,48 @@ int main()
     Suite* bytes_suite(void);
     srunner_add_suite(sr, bytes_suite());
 
+    Suite* kernels_suite(void);
+    srunner_add_suite(sr, kernels_suite());
+
+    Suite* blockcache_suite(void);
+    srunner_add_suite(sr, blockcache_suite());
+
+    Suite* lz4_suite(void);
+    srunner_add_suite(sr, lz4_suite());
+
+    Suite* host_suite(void);
+    srunner_add_suite(sr, host_suite());
+
+    Suite* hotkeys_suite(void);
+    srunner_add_suite(sr, hotkeys_suite());
+
+    Suite* net_suite(void);
+    srunner_add_suite(sr, net_suite());
+
+    Suite* io_suite(void);
+    srunner_add_suite(sr, io_suite());
+
     Suite* storage_suite(void);
     srunner_add_suite(sr, storage_suite());
 
+    Suite* lsmstorage_suite(void);
+    srunner_add_suite(sr, lsmstorage_suite());
+
+    Suite* snapshotstream_suite(void);
+    srunner_add_suite(sr, snapshotstream_suite());
+
+    Suite* trace_suite(void);
+    srunner_add_suite(sr, trace_suite());
+
+    Suite* u64storage_suite(void);
+    srunner_add_suite(sr, u64storage_suite());
+
+    Suite* watch_suite(void);
+    srunner_add_suite(sr, watch_suite());
+
+    Suite* wire_suite(void);
+    srunner_add_suite(sr, wire_suite());
+
     srunner_run_all(sr, CK_NORMAL);
     numFailedTests = srunner_ntests_failed(sr);
     srunner_free(sr);
@@ -0,0 +1,348 @@
+#include <consensual/runtime.h>
+#include <consensual/net.h>
+#include <consensual/bytes.h>
+#include "alloc.h"
+
+#include <check.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+enum { MAX_KEPT = 4096 };
+
+// what the callbacks saw; with `echo`, the server side sends every message back
+typedef struct NetLog
+{
+    cns_NetConn*    client;
+    cns_NetConn*    server;
+    cns_Bool        echo;
+    int             opens;
+    int             closes;
+    int             writables;
+    int             received; // by the client
+    int             echoed; // by the server
+    cns_Bytes*      kept[MAX_KEPT];
+    int             numKept;
+} NetLog;
+
+// runs inside cns_net_poll_r, so it leaves the last error alone
+static
+void onMessage(cns_Runtime* cns, void* context, cns_NetConn* conn, cns_Bytes* message)
+{
+    NetLog* log = (NetLog*) context;
+    if (log->echo && conn == log->server)
+    {
+        ck_assert_int_eq(CNS_OK, cns_netconn_send_r(cns, conn, message));
+        ++log->echoed;
+        cns_bytes_free_r(cns, message);
+        return;
+    }
+    ++log->received;
+    if (log->numKept < MAX_KEPT)
+        log->kept[log->numKept++] = message;
+    else
+        cns_bytes_free(cns, message);
+}
+
+static
+void onOpen(cns_Runtime* cns, void* context, cns_NetConn* conn)
+{
+    (void) cns;
+    NetLog* log = (NetLog*) context;
+    if (conn != log->client)
+        log->server = conn;
+    ++log->opens;
+}
+
+static
+void onWritable(cns_Runtime* cns, void* context, cns_NetConn* conn)
+{
+    (void) cns;
+    (void) conn;
+    ++((NetLog*) context)->writables;
+}
+
+static
+void onClose(cns_Runtime* cns, void* context, cns_NetConn* conn)
+{
+    (void) cns;
+    NetLog* log = (NetLog*) context;
+    if (conn == log->server)
+        log->server = 0;
+    if (conn == log->client)
+        log->client = 0;
+    ++log->closes;
+}
+
+static
+void dropKept(cns_Runtime* cns, NetLog* log)
+{
+    for (int i = 0; i < log->numKept; ++i)
+        cns_bytes_free(cns, log->kept[i]);
+    log->numKept = 0;
+}
+
+// polls until `*counter` reaches `target`, failing the test if it takes too long; writing out queued messages, pieces
+// of concatenations included, leaves the last error alone
+static
+void pollUntil(cns_Runtime* cns, cns_Net* net, const int* counter, int target)
+{
+    for (int i = 0; i < 2000 && *counter < target; ++i)
+    {
+        int count = 0;
+        cns_setlasterr(cns, CNS_ERR_BUSY);
+        ck_assert_int_eq(CNS_OK, cns_net_poll_r(cns, net, 10, &count));
+        ck_assert_int_eq(CNS_ERR_BUSY, cns_lasterr(cns));
+    }
+    ck_assert_int_eq(target, *counter);
+}
+
+static
+cns_Bytes* patterned(cns_Runtime* cns, int seed, cns_Index length)
+{
+    uint8_t buf[4096];
+    ck_assert_int_le(length, sizeof(buf));
+    for (cns_Index i = 0; i < length; ++i)
+        buf[i] = (uint8_t) (seed * 31 + i * 7);
+    return cns_bytes_new(cns, buf, length);
+}
+
+START_TEST(test_net)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    NetLog log;
+    memset(&log, 0, sizeof(log));
+    log.echo = CNS_YES;
+    cns_NetOptions options;
+    cns_netoptions_default(&options);
+    options.blockSize = 1024;
+    options.poolBlocks = 8;
+    options.maxMessage = 1 << 20;
+    options.maxQueued = 4096;
+    options.onMessage = onMessage;
+    options.onOpen = onOpen;
+    options.onWritable = onWritable;
+    options.onClose = onClose;
+    options.context = &log;
+
+    ck_assert_ptr_eq(0, cns_net_new(cns, 0));
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_lasterr(cns));
+    cns_Net* net = cns_net_new(cns, &options);
+    ck_assert_ptr_ne(0, net);
+
+    int port = 0;
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_net_listen_r(cns, net, "not an address", 0, &port));
+    port = cns_net_listen(cns, net, "127.0.0.1", 0);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    ck_assert_int_gt(port, 0);
+    log.client = cns_net_connect(cns, net, "127.0.0.1", port);
+    ck_assert_ptr_ne(0, log.client);
+
+    // sent before the connection is up, it waits in the queue
+    cns_Bytes* hello = cns_bytes_new(cns, "hello", 5);
+    cns_netconn_send(cns, log.client, hello);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    cns_bytes_free(cns, hello);
+    pollUntil(cns, net, &log.received, 1);
+    ck_assert_int_eq(2, log.opens);
+    ck_assert_ptr_ne(0, log.server);
+    ck_assert_int_eq(5, cns_bytes_length(cns, log.kept[0]));
+    ck_assert(!memcmp("hello", cns_bytes_ptr(cns, log.kept[0]), 5));
+    dropKept(cns, &log);
+
+    // many small messages, an empty one among them, come back whole and in order, and the pool serves them
+    int sent = 0;
+    for (int round = 0; round < 20; ++round)
+    {
+        for (int i = 0; i < 100; ++i)
+        {
+            cns_Bytes* message = patterned(cns, sent, (sent * 13) % 30);
+            cns_netconn_send(cns, log.client, message);
+            ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+            cns_bytes_free(cns, message);
+            ++sent;
+        }
+        pollUntil(cns, net, &log.received, 1 + sent);
+        for (int i = 0; i < log.numKept; ++i)
+        {
+            int seed = sent - 100 + i;
+            cns_Bytes* expected = patterned(cns, seed, (seed * 13) % 30);
+            ck_assert(cns_bytes_equal(cns, expected, log.kept[i]));
+            cns_bytes_free(cns, expected);
+        }
+        dropKept(cns, &log);
+    }
+    cns_NetStats stats;
+    cns_net_stats(cns, net, &stats);
+    ck_assert_int_eq(2 * sent + 2, stats.messagesSent);
+    ck_assert_int_eq(2 * sent + 2, stats.messagesReceived);
+    ck_assert_uint_gt(stats.blocksReused, 0);
+    ck_assert_uint_le(stats.blocksAllocated, options.poolBlocks);
+
+    // a message longer than a block, sent as a concatenation, gets a block of its own
+    cns_Bytes* head = patterned(cns, 1, 3000);
+    cns_Bytes* tail = patterned(cns, 2, 500);
+    cns_Bytes* big = cns_bytes_concat(cns, head, tail);
+    cns_netconn_send(cns, log.client, big);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    pollUntil(cns, net, &log.received, 2 + sent);
+    ck_assert(cns_bytes_equal(cns, big, log.kept[0]));
+    dropKept(cns, &log);
+    cns_bytes_free(cns, head);
+    cns_bytes_free(cns, tail);
+
+    // past `maxQueued` sends fail until the queue drains, which the writable callback tells
+    ck_assert_int_eq(CNS_OK, cns_netconn_send_r(cns, log.client, big));
+    ck_assert_int_eq(CNS_OK, cns_netconn_send_r(cns, log.client, big));
+    ck_assert_int_eq(2 * (4 + 3500), cns_netconn_queued(cns, log.client));
+    ck_assert_int_eq(CNS_ERR_BUSY, cns_netconn_send_r(cns, log.client, big));
+    pollUntil(cns, net, &log.writables, 1);
+    ck_assert_int_eq(0, cns_netconn_queued(cns, log.client));
+    pollUntil(cns, net, &log.received, 4 + sent);
+    dropKept(cns, &log);
+    cns_net_stats(cns, net, &stats);
+    ck_assert_int_eq(1, stats.busy);
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_netconn_send_r(cns, log.client, 0));
+    cns_bytes_free(cns, big);
+
+    // nothing is read from a paused connection
+    cns_netconn_pause(cns, log.server, CNS_YES);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    hello = cns_bytes_new(cns, "hello", 5);
+    cns_netconn_send(cns, log.client, hello);
+    for (int i = 0; i < 5; ++i)
+        cns_net_poll(cns, net, 5);
+    ck_assert_int_eq(4 + sent, log.received);
+    cns_netconn_pause(cns, log.server, CNS_NO);
+    pollUntil(cns, net, &log.received, 5 + sent);
+    dropKept(cns, &log);
+
+    // closing one end closes the other
+    cns_netconn_close(cns, log.client);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    ck_assert_int_eq(1, log.closes);
+    pollUntil(cns, net, &log.closes, 2);
+    ck_assert_ptr_eq(0, log.server);
+
+    // a message longer than the receiver takes closes the connection
+    cns_NetOptions strictOptions = options;
+    strictOptions.maxMessage = 4;
+    NetLog strictLog;
+    memset(&strictLog, 0, sizeof(strictLog));
+    strictOptions.context = &strictLog;
+    cns_Net* strict = cns_net_new(cns, &strictOptions);
+    port = cns_net_listen(cns, strict, "127.0.0.1", 0);
+    log.client = cns_net_connect(cns, net, "127.0.0.1", port);
+    cns_netconn_send(cns, log.client, hello);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    for (int i = 0; i < 2000 && log.closes < 3; ++i)
+    {
+        cns_net_poll(cns, net, 1);
+        cns_net_poll(cns, strict, 1);
+    }
+    ck_assert_int_eq(3, log.closes);
+    ck_assert_int_eq(1, strictLog.closes);
+    ck_assert_int_eq(0, strictLog.received);
+    cns_bytes_free(cns, hello);
+
+    // freeing a net with live connections closes them quietly, and messages handed out outlive it
+    log.client = cns_net_connect(cns, net, "127.0.0.1", port);
+    cns_Bytes* small = cns_bytes_new(cns, "abc", 3);
+    cns_netconn_send(cns, log.client, small);
+    strictLog.client = 0;
+    for (int i = 0; i < 2000 && strictLog.received < 1; ++i)
+    {
+        cns_net_poll(cns, net, 1);
+        cns_net_poll(cns, strict, 1);
+    }
+    ck_assert_int_eq(1, strictLog.received);
+    cns_net_free(cns, strict);
+    cns_net_free(cns, net);
+    ck_assert_int_eq(3, log.closes);
+    ck_assert(cns_bytes_equal(cns, small, strictLog.kept[0]));
+    dropKept(cns, &strictLog);
+    cns_bytes_free(cns, small);
+
+    ck_assert_int_eq(noleaksNumber, test_rt_allocContext.bytesAllocated);
+    cns_shutdown(cns);
+}
+END_TEST
+
+// a peer which hangs up while messages are still queued closes the connection; writing to it must not raise SIGPIPE
+START_TEST(test_net_peerClosed)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    // the peer is a plain socket, so that it closes without the net hearing of it first
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    ck_assert_int_ge(listener, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addressLength = sizeof(address);
+    ck_assert_int_eq(0, bind(listener, (struct sockaddr*) &address, sizeof(address)));
+    ck_assert_int_eq(0, listen(listener, 1));
+    ck_assert_int_eq(0, getsockname(listener, (struct sockaddr*) &address, &addressLength));
+
+    NetLog log;
+    memset(&log, 0, sizeof(log));
+    cns_NetOptions options;
+    cns_netoptions_default(&options);
+    options.maxQueued = 1 << 20;
+    options.onMessage = onMessage;
+    options.onOpen = onOpen;
+    options.onClose = onClose;
+    options.context = &log;
+    cns_Net* net = cns_net_new(cns, &options);
+    ck_assert_ptr_ne(0, net);
+    log.client = cns_net_connect(cns, net, "127.0.0.1", ntohs(address.sin_port));
+    ck_assert_ptr_ne(0, log.client);
+    pollUntil(cns, net, &log.opens, 1);
+
+    int peer = accept(listener, 0, 0);
+    ck_assert_int_ge(peer, 0);
+    close(peer);
+    close(listener);
+    usleep(20000); // for the hang-up to arrive
+
+    // the first write draws a reset, the ones after it fail with EPIPE
+    for (int i = 0; i < 200; ++i)
+    {
+        cns_Bytes* message = patterned(cns, i, 1000);
+        ck_assert_int_eq(CNS_OK, cns_netconn_send_r(cns, log.client, message));
+        cns_bytes_free(cns, message);
+    }
+    pollUntil(cns, net, &log.closes, 1);
+    ck_assert_ptr_eq(0, log.client);
+
+    cns_net_free(cns, net);
+    ck_assert_int_eq(noleaksNumber, test_rt_allocContext.bytesAllocated);
+    cns_shutdown(cns);
+}
+END_TEST
+
+Suite* net_suite(void)
+{
+    Suite* s = suite_create("net");
+
+    TCase* tc = tcase_create("net");
+    tcase_add_test(tc, test_net);
+    tcase_add_test(tc, test_net_peerClosed);
+
+    suite_add_tcase(s, tc);
+    return s;
+}
@@ -1,8 +1,19 @@
 #include <consensual/runtime.h>
+#include <consensual/bytes.h>
 #include <check.h>
 
+#include <pthread.h>
+#include <string.h>
+
 #include "alloc.h"
 
+// what the allocation profile puts in front of each allocation
+#ifdef CNS_ENABLE_ALLOC_PROFILE
+enum { PROFILE_HEADER = 16 };
+#else
+enum { PROFILE_HEADER = 0 };
+#endif
+
 START_TEST(test_runtime)
 {
     struct TestRTAllocContext test_rt_allocContext = {
@@ -33,7 +44,7 @@ START_TEST(test_runtime)
 
     void* ptr1 = cns_runtime_alloc(cns, 17);
     ck_assert_int_eq( CNS_OK, cns_lasterr(cns) );
-    ck_assert_int_eq( test_rt_allocContext.bytesAllocated, x + 17 );
+    ck_assert_int_eq( test_rt_allocContext.bytesAllocated, x + 17 + PROFILE_HEADER );
     ck_assert_ptr_ne( 0, ptr1 );
 
     cns_setlasterr(cns, CNS_ERR_NOMEM);
@@ -41,7 +52,7 @@ START_TEST(test_runtime)
 
     void* ptr2 = cns_runtime_alloc(cns, 2);
     ck_assert_int_eq( CNS_OK, cns_lasterr(cns) );
-    ck_assert_int_eq( test_rt_allocContext.bytesAllocated, x + 17 + 2 );
+    ck_assert_int_eq( test_rt_allocContext.bytesAllocated, x + 17 + 2 + 2 * PROFILE_HEADER );
     ck_assert_ptr_ne( 0, ptr2 );
 
     ck_assert_ptr_ne( ptr1, ptr2 );
@@ -51,19 +62,19 @@ START_TEST(test_runtime)
     tmp = cns_runtime_realloc(cns, ptr1, 16);
     ck_assert_int_eq( CNS_OK, cns_lasterr(cns) );
     ck_assert_ptr_ne( 0, tmp );
-    ck_assert_int_eq( test_rt_allocContext.bytesAllocated, x + 16 + 2 );
+    ck_assert_int_eq( test_rt_allocContext.bytesAllocated, x + 16 + 2 + 2 * PROFILE_HEADER );
     ptr1 = tmp;
 
     tmp = cns_runtime_realloc(cns, ptr2, 113);
     ck_assert_int_eq( CNS_OK, cns_lasterr(cns) );
     ck_assert_ptr_ne( 0, tmp );
-    ck_assert_int_eq( test_rt_allocContext.bytesAllocated, x + 16 + 113 );
+    ck_assert_int_eq( test_rt_allocContext.bytesAllocated, x + 16 + 113 + 2 * PROFILE_HEADER );
     ptr2 = tmp;
 
     cns_setlasterr(cns, CNS_ERR_NOMEM);
     cns_runtime_free(cns, ptr1);
     ck_assert_int_eq( CNS_OK, cns_lasterr(cns) );
-    ck_assert_int_eq( test_rt_allocContext.bytesAllocated, x + 113 );
+    ck_assert_int_eq( test_rt_allocContext.bytesAllocated, x + 113 + PROFILE_HEADER );
 
     cns_setlasterr(cns, CNS_ERR_NOMEM);
     cns_runtime_free(cns, ptr2);
@@ -79,12 +90,111 @@ START_TEST(test_runtime)
 }
 END_TEST
 
+static void* setBadArgOnAnotherThread(void* cns)
+{
+    cns_setlasterr((cns_Runtime*) cns, CNS_ERR_BADARG);
+    return (void*) (intptr_t) cns_lasterr((cns_Runtime*) cns);
+}
+
+START_TEST(test_lasterr)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    // errors are per thread
+    cns_setlasterr(cns, CNS_ERR_NOMEM);
+    pthread_t thread;
+    void* threadError = 0;
+    ck_assert_int_eq( 0, pthread_create(&thread, 0, setBadArgOnAnotherThread, cns) );
+    pthread_join(thread, &threadError);
+    ck_assert_int_eq( CNS_ERR_BADARG, (intptr_t) threadError );
+    ck_assert_int_eq( CNS_ERR_NOMEM, cns_lasterr(cns) );
+
+    // _r functions report errors without touching the last error
+    int x = test_rt_allocContext.bytesAllocated;
+    void* ptr = 0;
+    ck_assert_int_eq( CNS_ERR_BADARG, cns_runtime_alloc_r(cns, -1, &ptr) );
+    ck_assert_int_eq( CNS_ERR_NOMEM, cns_lasterr(cns) );
+    ck_assert_int_eq( CNS_OK, cns_runtime_alloc_r(cns, 8, &ptr) );
+    ck_assert_ptr_ne( 0, ptr );
+    ck_assert_int_eq( CNS_OK, cns_runtime_realloc_r(cns, ptr, 16, &ptr) );
+    ck_assert_int_eq( test_rt_allocContext.bytesAllocated, x + 16 + PROFILE_HEADER );
+    ck_assert_int_eq( CNS_OK, cns_runtime_free_r(cns, ptr) );
+    ck_assert_int_eq( CNS_ERR_BADARG, cns_runtime_free_r(cns, cns) );
+    ck_assert_int_eq( CNS_ERR_NOMEM, cns_lasterr(cns) );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+START_TEST(test_allocProfile)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    cns_AllocProfile before, after;
+    cns_runtime_allocProfile(cns, &before);
+    ck_assert_int_eq( CNS_OK, cns_lasterr(cns) );
+    cns_runtime_allocProfile(cns, 0);
+    ck_assert_int_eq( CNS_ERR_BADARG, cns_lasterr(cns) );
+
+    // bytes objects count under their own category, plain runtime allocations under "other"
+    cns_Bytes* bytes = cns_bytes_new(cns, "0123456789", 10);
+    void* ptr = cns_runtime_alloc(cns, 100);
+    ptr = cns_runtime_realloc(cns, ptr, 1000);
+    void* ptr2 = cns_runtime_alloc(cns, 3);
+    cns_runtime_free(cns, ptr2);
+    cns_runtime_allocProfile(cns, &after);
+
+#ifdef CNS_ENABLE_ALLOC_PROFILE
+    ck_assert_int_eq( CNS_YES, after.instrumented );
+    const cns_AllocCategoryProfile* other = &after.categories[CNS_ALLOC_OTHER];
+    ck_assert_int_eq( before.categories[CNS_ALLOC_OTHER].allocs + 3, other->allocs );
+    ck_assert_int_eq( before.categories[CNS_ALLOC_OTHER].frees + 2, other->frees );
+    ck_assert_int_eq( before.categories[CNS_ALLOC_OTHER].liveBytes + 1000, other->liveBytes );
+    ck_assert_int_eq( before.categories[CNS_ALLOC_OTHER].liveCount + 1, other->liveCount );
+    ck_assert_int_eq( before.categories[CNS_ALLOC_OTHER].sizes[1] + 1, other->sizes[1] ); // 3 bytes
+    ck_assert_int_eq( before.categories[CNS_ALLOC_OTHER].sizes[6] + 1, other->sizes[6] ); // 100
+    ck_assert_int_eq( before.categories[CNS_ALLOC_OTHER].sizes[9] + 1, other->sizes[9] ); // 1000
+    ck_assert_int_eq( before.categories[CNS_ALLOC_BYTES].liveCount + 1, after.categories[CNS_ALLOC_BYTES].liveCount );
+    ck_assert_int_ge( after.categories[CNS_ALLOC_BYTES].liveBytes, 10 );
+
+    char text[1024];
+    cns_Index length = cns_allocprofile_format(&after, text, sizeof(text));
+    ck_assert_int_eq( (cns_Index) strlen(text), length );
+    ck_assert_ptr_ne( 0, strstr(text, "bytes ") );
+    ck_assert_ptr_ne( 0, strstr(text, " 9:1") );
+    ck_assert_ptr_eq( 0, strstr(text, "block cache") ); // nothing was allocated for it
+
+    // cut short, the text is still terminated and the full length reported
+    char small[16];
+    ck_assert_int_eq( length, cns_allocprofile_format(&after, small, sizeof(small)) );
+    ck_assert_int_eq( sizeof(small) - 1, strlen(small) );
+#else
+    ck_assert_int_eq( CNS_NO, after.instrumented );
+    ck_assert_int_eq( 0, after.categories[CNS_ALLOC_OTHER].allocs );
+#endif
+    ck_assert_str_eq( "storage item", cns_alloccategory_name(CNS_ALLOC_STORAGE_ITEM) );
+    ck_assert_ptr_eq( 0, cns_alloccategory_name(CNS_ALLOC_CATEGORIES) );
+
+    cns_runtime_free(cns, ptr);
+    cns_bytes_free(cns, bytes);
+    cns_shutdown(cns);
+}
+END_TEST
+
 Suite* runtime_suite(void)
 {
     Suite* s = suite_create("runtime");
 
     TCase* tc = tcase_create("runtime");
     tcase_add_test(tc, test_runtime);
+    tcase_add_test(tc, test_lasterr);
+    tcase_add_test(tc, test_allocProfile);
 
     suite_add_tcase(s, tc);
     return s;
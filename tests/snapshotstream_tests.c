@@ -0,0 +1,339 @@
+#include <consensual/runtime.h>
+#include <consensual/snapshotstream.h>
+#include <consensual/bytes.h>
+#include <consensual/kernels.h>
+#include "alloc.h"
+
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+
+static
+cns_Bytes* bytesStrFromInt(cns_Runtime* cns, int x)
+{
+    char buf[40];
+    sprintf(buf, "%x", x);
+    return cns_bytes_new(cns, buf, strlen(buf) + 1);
+}
+
+static
+cns_Bytes* documentFromInt(cns_Runtime* cns, int x, int size)
+{
+    char buf[4096];
+    for (int i = 0; i < size; ++i)
+        buf[i] = "abcdefgh"[(x + i / 16) % 8];
+    sprintf(buf, "%d:", x);
+    return cns_bytes_new(cns, buf, size);
+}
+
+// most documents are short; those stored as concatenations are long enough to stay in pieces, and a few compress
+static
+int documentSize(int x)
+{
+    return x % 100 ? (x % 7 ? 40 : 700) : 3000;
+}
+
+static
+void checkDocument(cns_Runtime* cns, cns_Storage* storage, int x, int size)
+{
+    cns_Bytes* key = bytesStrFromInt(cns, x);
+    cns_Bytes* value = cns_storage_get(cns, storage, key);
+    ck_assert_ptr_ne(0, value);
+    cns_Bytes* expected = documentFromInt(cns, x, size);
+    ck_assert(cns_bytes_equal(cns, expected, value));
+    cns_bytes_free(cns, expected);
+    cns_bytes_free(cns, value);
+    cns_bytes_free(cns, key);
+}
+
+// An in-process link between the sender and the receiver: chunks sit in a queue until delivered, and the link may lose,
+// damage or hold them back; acknowledgements go back the same way.
+enum { LINK_CAPACITY = 64 };
+
+typedef struct Link
+{
+    cns_Bytes*  chunks[LINK_CAPACITY];
+    int         count;
+} Link;
+
+static
+void link_send(Link* link, cns_Bytes* chunk)
+{
+    ck_assert_int_lt(link->count, LINK_CAPACITY);
+    link->chunks[link->count++] = chunk;
+}
+
+static
+cns_Bytes* link_take(Link* link)
+{
+    cns_Bytes* chunk = link->chunks[0];
+    --link->count;
+    memmove(link->chunks, link->chunks + 1, link->count * sizeof(cns_Bytes*));
+    return chunk;
+}
+
+static
+cns_Bytes* damaged(cns_Runtime* cns, cns_Bytes* chunk, cns_Index at)
+{
+    cns_Index length = cns_bytes_length(cns, chunk);
+    char buf[8192];
+    ck_assert_int_le(length, (cns_Index) sizeof(buf));
+    memcpy(buf, cns_bytes_ptr(cns, chunk), length);
+    buf[at % length] ^= 0x40;
+    return cns_bytes_new(cns, buf, length);
+}
+
+// Runs the transfer; every step, up to a window of chunks goes out, and one chunk arrives unless the link stalls.
+static
+int transfer(cns_Runtime* cns, cns_SnapshotSender* sender, cns_SnapshotReceiver* receiver, cns_Storage* source, unsigned seed)
+{
+    Link link = { .count = 0 };
+    int steps = 0;
+    int maxInFlight = 0;
+    while (!cns_snapshotsender_done(cns, sender))
+    {
+        ck_assert_int_lt(++steps, 100000);
+        // copying out the pieces of concatenated values leaves the last error alone
+        cns_Bytes* chunk = 0;
+        cns_setlasterr(cns, CNS_ERR_BUSY);
+        while (!cns_snapshotsender_next_r(cns, sender, &chunk) && chunk)
+            link_send(&link, chunk);
+        ck_assert_int_eq(CNS_ERR_BUSY, cns_lasterr(cns));
+        if (link.count > maxInFlight)
+            maxInFlight = link.count;
+
+        // the leader keeps changing its storage meanwhile
+        if (source)
+        {
+            cns_Bytes* key = bytesStrFromInt(cns, (int) (seed % 5000));
+            cns_Bytes* value = cns_bytes_new(cns, "changed", 7);
+            cns_storage_set(cns, source, key, value);
+            cns_bytes_free(cns, value);
+            cns_bytes_free(cns, key);
+        }
+
+        seed = seed * 1103515245 + 12345;
+        unsigned fate = (seed >> 16) % 16;
+        if (fate < 3 || !link.count)
+        {
+            // stalled: nothing arrives, and after a while the sender goes back to what the receiver has
+            if (fate == 0)
+            {
+                while (link.count)
+                    cns_bytes_free(cns, link_take(&link));
+                cns_snapshotsender_rewind(cns, sender, cns_snapshotreceiver_offset(cns, receiver));
+                ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+            }
+            continue;
+        }
+
+        chunk = link_take(&link);
+        if (fate == 3)
+        {
+            // lost, so the following chunks come at the wrong offset and are ignored until the sender rewinds
+            cns_bytes_free(cns, chunk);
+            continue;
+        }
+        if (fate == 4)
+        {
+            cns_Bytes* bad = damaged(cns, chunk, seed >> 8);
+            ck_assert_int_eq(CNS_ERR_MALFORMED, cns_snapshotreceiver_put_r(cns, receiver, bad));
+            cns_bytes_free(cns, bad);
+        }
+        else
+        {
+            cns_snapshotreceiver_put(cns, receiver, chunk);
+            ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+        }
+        cns_bytes_free(cns, chunk);
+        cns_snapshotsender_ack(cns, sender, cns_snapshotreceiver_offset(cns, receiver));
+        ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+        if (fate == 5)
+        {
+            cns_snapshotsender_rewind(cns, sender, cns_snapshotreceiver_offset(cns, receiver));
+            ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+            while (link.count)
+                cns_bytes_free(cns, link_take(&link));
+        }
+    }
+    while (link.count)
+        cns_bytes_free(cns, link_take(&link));
+    return maxInFlight;
+}
+
+START_TEST(test_snapshotstream_transfer)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    enum { COUNT = 5000, WINDOW = 8 };
+    cns_Storage* source = cns_storage_newMemoryStorage(cns, 0);
+    cns_storage_setCompression(cns, source, 1024, 0);
+    for (int i = 0; i < COUNT; ++i)
+    {
+        cns_Bytes* key = bytesStrFromInt(cns, i);
+        cns_Bytes* document = documentFromInt(cns, i, documentSize(i));
+        if (i % 7 == 0)
+        {
+            // concatenations are sent piece by piece
+            cns_Bytes* head = cns_bytes_slice(cns, document, 0, 10);
+            cns_Bytes* tail = cns_bytes_slice(cns, document, 10, cns_bytes_length(cns, document) - 10);
+            cns_Bytes* rope = cns_bytes_concat(cns, head, tail);
+            cns_storage_set(cns, source, key, rope);
+            cns_bytes_free(cns, rope);
+            cns_bytes_free(cns, tail);
+            cns_bytes_free(cns, head);
+        }
+        else
+            cns_storage_set(cns, source, key, document);
+        cns_bytes_free(cns, document);
+        cns_bytes_free(cns, key);
+    }
+
+    // the follower has something else, which the snapshot replaces
+    cns_Storage* follower = cns_storage_newMemoryStorage(cns, 0);
+    cns_storage_setCompression(cns, follower, 1024, 0);
+    cns_Bytes* stale = cns_bytes_new(cns, "stale", 5);
+    cns_storage_set(cns, follower, stale, stale);
+
+    // chunks smaller than records, and larger ones
+    cns_Index chunkSizes[] = { 37, 1000, 5000 };
+    for (int round = 0; round < 3; ++round)
+    {
+        cns_SnapshotSender* sender = cns_snapshotsender_new(cns, source, chunkSizes[round], WINDOW);
+        ck_assert_ptr_ne(0, sender);
+        cns_SnapshotReceiver* receiver = cns_snapshotreceiver_new(cns, 0);
+        ck_assert_ptr_ne(0, receiver);
+
+        // flow control never lets more than the window out
+        ck_assert_int_le(transfer(cns, sender, receiver, round == 0 ? source : 0, (unsigned) round + 1), WINDOW);
+        ck_assert(cns_snapshotreceiver_complete(cns, receiver));
+        ck_assert_int_eq(cns_snapshotsender_length(cns, sender), cns_snapshotreceiver_offset(cns, receiver));
+        ck_assert_ptr_eq(0, cns_snapshotsender_next(cns, sender));
+        ck_assert_int_eq(round == 0 ? 1 : COUNT, cns_storage_count(cns, follower));
+
+        cns_setlasterr(cns, CNS_ERR_BUSY);
+        ck_assert_int_eq(CNS_OK, cns_snapshotreceiver_install_r(cns, receiver, follower));
+        ck_assert_int_eq(CNS_ERR_BUSY, cns_lasterr(cns));
+        ck_assert_int_eq(CNS_ERR_BADARG, cns_snapshotreceiver_install_r(cns, receiver, follower));
+        cns_snapshotreceiver_free(cns, receiver);
+        cns_snapshotsender_free(cns, sender);
+
+        // the content as it was when the sender was created
+        ck_assert_int_eq(COUNT, cns_storage_count(cns, follower));
+        ck_assert_ptr_eq(0, cns_storage_get(cns, follower, stale));
+        if (round == 0)
+        {
+            for (int i = 0; i < COUNT; i += 13)
+                checkDocument(cns, follower, i, documentSize(i));
+            cns_StorageStats stats;
+            cns_storage_stats(cns, follower, &stats);
+            ck_assert_int_eq(COUNT / 100, stats.compressedCount);
+        }
+        else
+        {
+            cns_Bytes* key = bytesStrFromInt(cns, 1);
+            cns_Bytes* expected = cns_storage_get(cns, source, key);
+            cns_Bytes* value = cns_storage_get(cns, follower, key);
+            ck_assert(cns_bytes_equal(cns, expected, value));
+            cns_bytes_free(cns, value);
+            cns_bytes_free(cns, expected);
+            cns_bytes_free(cns, key);
+        }
+    }
+
+    cns_bytes_free(cns, stale);
+    cns_storage_free(cns, follower);
+    cns_storage_free(cns, source);
+
+    ck_assert_int_eq(noleaksNumber, test_rt_allocContext.bytesAllocated);
+    cns_shutdown(cns);
+}
+END_TEST
+
+START_TEST(test_snapshotstream_errors)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    cns_Storage* source = cns_storage_newMemoryStorage(cns, 0);
+    ck_assert_ptr_eq(0, cns_snapshotsender_new(cns, source, 0, 4));
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_lasterr(cns));
+    ck_assert_ptr_eq(0, cns_snapshotsender_new(cns, source, 100, 0));
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_lasterr(cns));
+
+    // an empty storage is a stream with no records
+    cns_Storage* follower = cns_storage_newMemoryStorage(cns, 0);
+    cns_SnapshotSender* sender = cns_snapshotsender_new(cns, source, 100, 1);
+    cns_SnapshotReceiver* receiver = cns_snapshotreceiver_new(cns, 0);
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_snapshotreceiver_install_r(cns, receiver, follower));
+    cns_Bytes* chunk = cns_snapshotsender_next(cns, sender);
+    ck_assert_ptr_ne(0, chunk);
+    ck_assert_ptr_eq(0, cns_snapshotsender_next(cns, sender)); // window full, and the end anyway
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    cns_snapshotsender_ack(cns, sender, 1000);
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_lasterr(cns));
+    cns_snapshotsender_rewind(cns, sender, 5);
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_lasterr(cns));
+    ck_assert_int_eq(CNS_OK, cns_snapshotreceiver_put_r(cns, receiver, chunk));
+    ck_assert_int_eq(CNS_OK, cns_snapshotreceiver_put_r(cns, receiver, chunk)); // duplicates are ignored
+    cns_snapshotsender_ack(cns, sender, cns_snapshotreceiver_offset(cns, receiver));
+    ck_assert(cns_snapshotsender_done(cns, sender));
+    ck_assert(cns_snapshotreceiver_complete(cns, receiver));
+    ck_assert_int_eq(CNS_OK, cns_snapshotreceiver_install_r(cns, receiver, follower));
+    ck_assert_int_eq(0, cns_storage_count(cns, follower));
+    cns_snapshotreceiver_free(cns, receiver);
+    cns_snapshotsender_free(cns, sender);
+
+    // damage is caught by the CRC
+    receiver = cns_snapshotreceiver_new(cns, 0);
+    char buf[CNS_SNAPSHOT_CHUNKHEADER + 24];
+    ck_assert_int_eq(sizeof(buf), cns_bytes_length(cns, chunk));
+    memcpy(buf, cns_bytes_ptr(cns, chunk), sizeof(buf));
+    cns_bytes_free(cns, chunk);
+    buf[CNS_SNAPSHOT_CHUNKHEADER] ^= 1;
+    chunk = cns_bytes_new(cns, buf, sizeof(buf));
+    ck_assert_int_eq(CNS_ERR_MALFORMED, cns_snapshotreceiver_put_r(cns, receiver, chunk));
+    cns_bytes_free(cns, chunk);
+    ck_assert_int_eq(0, cns_snapshotreceiver_offset(cns, receiver));
+
+    // a stream which is not a snapshot fails for good, even though its chunks are intact
+    uint32_t crc = cns_kernels_crc32c(CNS_KERNEL_AUTO, 0, buf, 20);
+    crc = cns_kernels_crc32c(CNS_KERNEL_AUTO, crc, buf + CNS_SNAPSHOT_CHUNKHEADER, 24);
+    for (int i = 0; i < 4; ++i)
+        buf[20 + i] = (char) (crc >> (8 * i));
+    chunk = cns_bytes_new(cns, buf, sizeof(buf));
+    ck_assert_int_eq(CNS_ERR_MALFORMED, cns_snapshotreceiver_put_r(cns, receiver, chunk));
+    ck_assert_int_eq(CNS_ERR_MALFORMED, cns_snapshotreceiver_put_r(cns, receiver, chunk));
+    ck_assert(!cns_snapshotreceiver_complete(cns, receiver));
+    cns_bytes_free(cns, chunk);
+    cns_snapshotreceiver_free(cns, receiver);
+
+    cns_storage_free(cns, follower);
+    cns_storage_free(cns, source);
+
+    ck_assert_int_eq(noleaksNumber, test_rt_allocContext.bytesAllocated);
+    cns_shutdown(cns);
+}
+END_TEST
+
+Suite* snapshotstream_suite(void)
+{
+    Suite* s = suite_create("snapshotstream");
+
+    TCase* tc = tcase_create("snapshotstream");
+    tcase_set_timeout(tc, 60);
+    tcase_add_test(tc, test_snapshotstream_transfer);
+    tcase_add_test(tc, test_snapshotstream_errors);
+
+    suite_add_tcase(s, tc);
+    return s;
+}
@@ -7,6 +7,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
 
 static
 cns_Bytes* bytesStrFromInt(cns_Runtime* cns, int x)
@@ -63,6 +66,22 @@ START_TEST(test_defaultBytesHash32)
 
     cns_runtime_free(cns, b);
 
+    // a concatenation hashes like the same content in one block
+    char content[2000];
+    for (int i = 0; i < 2000; ++i)
+        content[i] = (char) (i * 7);
+    cns_Bytes* flat = cns_bytes_new(cns, content, 2000);
+    cns_Bytes* head = cns_bytes_new(cns, content, 777);
+    cns_Bytes* tail = cns_bytes_new(cns, content + 777, 2000 - 777);
+    cns_Bytes* joined = cns_bytes_concat(cns, head, tail);
+    ck_assert_int_eq(2, cns_bytes_chunkCount(cns, joined));
+    ck_assert_int_eq(cns_storage_defaultBytesHash32(cns, flat), cns_storage_defaultBytesHash32(cns, joined));
+    ck_assert_int_eq(2, cns_bytes_chunkCount(cns, joined)); // hashing did not join the pieces
+    cns_bytes_free(cns, joined);
+    cns_bytes_free(cns, head);
+    cns_bytes_free(cns, tail);
+    cns_bytes_free(cns, flat);
+
     ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
 
     cns_shutdown(cns);
@@ -256,6 +275,1159 @@ START_TEST(test_storage)
 }
 END_TEST
 
+START_TEST(test_storage_r)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    cns_Storage* storage = cns_storage_newMemoryStorage(cns, 0);
+    cns_Bytes* key = bytesStrFromInt(cns, 1);
+    cns_Bytes* value = bytesStrFromInt(cns, 2);
+
+    cns_setlasterr(cns, CNS_ERR_NOMEM);
+    ck_assert_int_eq(CNS_OK, cns_storage_set_r(cns, storage, key, value));
+
+    cns_Bytes* got = 0;
+    ck_assert_int_eq(CNS_OK, cns_storage_get_r(cns, storage, key, &got));
+    ck_assert_ptr_eq(value, got);
+    ck_assert_int_eq(CNS_OK, cns_bytes_free_r(cns, got));
+
+    cns_Bool existed = CNS_NO;
+    ck_assert_int_eq(CNS_OK, cns_storage_delete_r(cns, storage, key, &existed));
+    ck_assert_int_eq(CNS_YES, existed);
+    ck_assert_int_eq(CNS_OK, cns_storage_delete_r(cns, storage, key, &existed));
+    ck_assert_int_eq(CNS_NO, existed);
+
+    ck_assert_int_eq(CNS_OK, cns_storage_get_r(cns, storage, key, &got));
+    ck_assert_ptr_eq(0, got);
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_storage_get_r(cns, storage, 0, &got));
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_storage_set_r(cns, storage, key, 0));
+
+    // none of the above touched the last error
+    ck_assert_int_eq(CNS_ERR_NOMEM, cns_lasterr(cns));
+
+    cns_bytes_free(cns, key);
+    cns_bytes_free(cns, value);
+    cns_storage_free(cns, storage);
+
+    ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+START_TEST(test_storage_stats)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    cns_Storage* storage = cns_storage_newMemoryStorage(cns, 0);
+    for (int i = 0; i < 1000; ++i)
+    {
+        cns_Bytes* key = bytesStrFromInt(cns, i);
+        cns_storage_set(cns, storage, key, key);
+        cns_bytes_free(cns, key);
+    }
+    for (int i = 0; i < 500; ++i)
+    {
+        cns_Bytes* key = bytesStrFromInt(cns, i * 3);
+        cns_Bytes* value = cns_storage_get(cns, storage, key);
+        if (value)
+            cns_bytes_free(cns, value);
+        cns_bytes_free(cns, key);
+    }
+    cns_Bytes* key = bytesStrFromInt(cns, 7);
+    ck_assert_int_eq(CNS_YES, cns_storage_delete(cns, storage, key));
+    cns_bytes_free(cns, key);
+
+    cns_StorageStats stats;
+    cns_storage_stats(cns, storage, &stats);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    ck_assert_int_eq(999, stats.count);
+    ck_assert_int_gt(stats.numBuckets, 16);
+    ck_assert_int_eq((int) (1000 * stats.loadFactor), (int) (1000.0 * 999 / stats.numBuckets));
+
+    cns_Index buckets = 0, items = 0;
+    for (int i = 0; i < CNS_STATS_CHAIN_BUCKETS; ++i)
+    {
+        buckets += stats.chainLengths[i];
+        items += i * stats.chainLengths[i];
+    }
+    ck_assert_int_eq(stats.numBuckets, buckets);
+    ck_assert_int_le(stats.longestChain, CNS_STATS_CHAIN_BUCKETS - 1); // the CRC-32C based hash spreads these keys well
+    ck_assert_int_eq(999, items);
+
+#ifdef CNS_ENABLE_STATS
+    ck_assert_int_eq(CNS_YES, stats.instrumented);
+    ck_assert_int_eq(1000, stats.sets);
+    ck_assert_int_eq(500, stats.gets);
+    ck_assert_int_eq(1, stats.deletes);
+    ck_assert_int_gt(stats.resizes, 0);
+    uint64_t gets = 0, probes = 0;
+    for (int i = 0; i < CNS_STATS_LATENCY_BUCKETS; ++i)
+        gets += stats.getLatency[i];
+    for (int i = 0; i < CNS_STATS_PROBE_BUCKETS; ++i)
+        probes += stats.probes[i];
+    ck_assert_int_eq(500, gets);
+    ck_assert_int_ge(probes, 1000 + 500 + 1);
+#else
+    ck_assert_int_eq(CNS_NO, stats.instrumented);
+    ck_assert_int_eq(0, stats.gets);
+#endif
+
+    cns_storage_free(cns, storage);
+
+    ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+// interprets the value as a hex counter and increments it; `context` counts calls
+static cns_Bytes* incrementCounter(cns_Runtime* cns, cns_Bytes* key, cns_Bytes* current, void* context)
+{
+    ++*(int*) context;
+    return bytesStrFromInt(cns, current ? intFromBytesStr(cns, current) + 1 : 1);
+}
+
+static cns_Bytes* keepCurrent(cns_Runtime* cns, cns_Bytes* key, cns_Bytes* current, void* context)
+{
+    return 0;
+}
+
+START_TEST(test_storage_upsert)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    cns_Storage* storage = cns_storage_newMemoryStorage(cns, 0);
+
+    // counters: key i is incremented i % 7 + 1 times
+    int calls = 0;
+    for (int round = 0; round < 7; ++round)
+    {
+        for (int i = 0; i < 300; ++i)
+        {
+            if (round > i % 7)
+                continue;
+            cns_Bytes* key = bytesStrFromInt(cns, i);
+            cns_storage_upsert(cns, storage, key, incrementCounter, &calls);
+            ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+            cns_bytes_free(cns, key);
+        }
+    }
+    ck_assert_int_eq(300, cns_storage_count(cns, storage));
+    for (int i = 0; i < 300; ++i)
+    {
+        cns_Bytes* key = bytesStrFromInt(cns, i);
+        cns_Bytes* value = cns_storage_get(cns, storage, key);
+        ck_assert_int_eq(i % 7 + 1, intFromBytesStr(cns, value));
+        cns_bytes_free(cns, value);
+
+        // returning NULL changes nothing
+        cns_storage_upsert(cns, storage, key, keepCurrent, 0);
+        value = cns_storage_get(cns, storage, key);
+        ck_assert_int_eq(i % 7 + 1, intFromBytesStr(cns, value));
+        cns_bytes_free(cns, value);
+        cns_bytes_free(cns, key);
+    }
+    cns_Bytes* missing = bytesStrFromInt(cns, 100500);
+    cns_storage_upsert(cns, storage, missing, keepCurrent, 0);
+    ck_assert_int_eq(300, cns_storage_count(cns, storage));
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_storage_upsert_r(cns, storage, missing, 0, 0));
+
+    // entries survive the table growing underneath them
+    cns_Bool inserted = CNS_NO;
+    cns_Bytes* zero = bytesStrFromInt(cns, 0);
+    cns_StorageEntry* entry = cns_storage_getOrInsert(cns, storage, missing, zero, &inserted);
+    ck_assert_ptr_ne(0, entry);
+    ck_assert_int_eq(CNS_YES, inserted);
+    ck_assert_int_eq(CNS_YES, cns_bytes_equal(cns, missing, cns_storage_entryKey(cns, entry)));
+    ck_assert_int_eq(0, intFromBytesStr(cns, cns_storage_entryValue(cns, entry)));
+
+    for (int i = 1000; i < 3000; ++i)
+    {
+        cns_Bytes* key = bytesStrFromInt(cns, i);
+        cns_storage_set(cns, storage, key, key);
+        cns_bytes_free(cns, key);
+    }
+
+#ifdef CNS_ENABLE_STATS
+    cns_StorageStats before;
+    cns_storage_stats(cns, storage, &before);
+#endif
+    ck_assert_ptr_eq(entry, cns_storage_getOrInsert(cns, storage, missing, zero, &inserted));
+    ck_assert_int_eq(CNS_NO, inserted);
+#ifdef CNS_ENABLE_STATS
+    // a hit counts as a get, an insertion as a set, whether or not the caller asks which it was
+    cns_StorageStats after;
+    cns_storage_stats(cns, storage, &after);
+    ck_assert_int_eq(before.gets + 1, after.gets);
+    ck_assert_int_eq(before.sets, after.sets);
+    ck_assert_ptr_eq(entry, cns_storage_getOrInsert(cns, storage, missing, zero, 0));
+    cns_Bytes* another = bytesStrFromInt(cns, 100501);
+    ck_assert_ptr_ne(0, cns_storage_getOrInsert(cns, storage, another, zero, 0));
+    cns_bytes_free(cns, another);
+    cns_storage_stats(cns, storage, &before);
+    ck_assert_int_eq(after.gets + 1, before.gets);
+    ck_assert_int_eq(after.sets + 1, before.sets);
+#endif
+    cns_Bytes* fortyTwo = bytesStrFromInt(cns, 42);
+    cns_storage_entrySetValue(cns, storage, entry, fortyTwo);
+    cns_bytes_free(cns, fortyTwo);
+    cns_Bytes* value = cns_storage_get(cns, storage, missing);
+    ck_assert_int_eq(42, intFromBytesStr(cns, value));
+    cns_bytes_free(cns, value);
+
+    cns_bytes_free(cns, zero);
+    cns_bytes_free(cns, missing);
+    cns_storage_free(cns, storage);
+
+    ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+START_TEST(test_storage_bulk)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    // enough pairs to hash them on several threads; the last 1000 repeat earlier keys with new values
+    enum { PAIRS = 21000, UNIQUE = 20000 };
+    cns_Bytes** keys = malloc(PAIRS * sizeof(cns_Bytes*));
+    cns_Bytes** values = malloc(PAIRS * sizeof(cns_Bytes*));
+    for (int i = 0; i < PAIRS; ++i)
+    {
+        keys[i] = bytesStrFromInt(cns, i % UNIQUE);
+        values[i] = bytesStrFromInt(cns, i < UNIQUE ? -i : -i - 7);
+    }
+
+    cns_Storage* storage = cns_storage_newMemoryStorageWithCapacity(cns, 0, UNIQUE);
+    ck_assert_ptr_ne(0, storage);
+    cns_StorageStats before;
+    cns_storage_stats(cns, storage, &before);
+    ck_assert_int_ge(before.numBuckets, UNIQUE);
+
+    cns_storage_bulkSet(cns, storage, keys, values, PAIRS, 4);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    ck_assert_int_eq(UNIQUE, cns_storage_count(cns, storage));
+
+    cns_StorageStats after;
+    cns_storage_stats(cns, storage, &after);
+    ck_assert_int_eq(before.numBuckets, after.numBuckets);
+#ifdef CNS_ENABLE_STATS
+    ck_assert_int_eq(before.resizes, after.resizes);
+    ck_assert_int_eq(PAIRS, after.sets);
+#endif
+
+    for (int i = 0; i < UNIQUE; ++i)
+    {
+        cns_Bytes* value = cns_storage_get(cns, storage, keys[i]);
+        ck_assert_int_eq(i < PAIRS - UNIQUE ? -i - UNIQUE - 7 : -i, intFromBytesStr(cns, value));
+        cns_bytes_free(cns, value);
+    }
+
+    // a second batch lands on a non-empty storage and grows it once
+    cns_storage_bulkSet(cns, storage, keys, keys, PAIRS, 1);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    ck_assert_int_eq(UNIQUE, cns_storage_count(cns, storage));
+    cns_Bytes* value = cns_storage_get(cns, storage, keys[5]);
+    ck_assert_int_eq(5, intFromBytesStr(cns, value));
+    cns_bytes_free(cns, value);
+
+    cns_Bytes* stash = values[3];
+    values[3] = 0;
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_storage_bulkSet_r(cns, storage, keys, values, PAIRS, 1));
+    values[3] = stash;
+    ck_assert_int_eq(CNS_OK, cns_storage_bulkSet_r(cns, storage, keys, values, 0, 4));
+
+    // concatenated keys are joined on this thread before a hash function reading them flat runs on the workers, so the
+    // test allocator is never called concurrently
+    cns_Storage* jenkins = cns_storage_newMemoryStorage(cns, cns_storage_jenkinsBytesHash32);
+    char pad[600];
+    memset(pad, 'k', sizeof(pad));
+    cns_Bytes* prefix = cns_bytes_new(cns, pad, sizeof(pad));
+    cns_Bytes** ropes = malloc(UNIQUE * sizeof(cns_Bytes*));
+    for (int i = 0; i < UNIQUE; ++i)
+        ropes[i] = cns_bytes_concat(cns, prefix, keys[i]);
+    cns_storage_bulkSet(cns, jenkins, ropes, values, UNIQUE, 4);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    ck_assert_int_eq(UNIQUE, cns_storage_count(cns, jenkins));
+    value = cns_storage_get(cns, jenkins, ropes[7]);
+    ck_assert_int_eq(-7, intFromBytesStr(cns, value));
+    cns_bytes_free(cns, value);
+    cns_storage_free(cns, jenkins);
+    for (int i = 0; i < UNIQUE; ++i)
+        cns_bytes_free(cns, ropes[i]);
+    free(ropes);
+    cns_bytes_free(cns, prefix);
+
+    cns_storage_free(cns, storage);
+    for (int i = 0; i < PAIRS; ++i)
+    {
+        cns_bytes_free(cns, keys[i]);
+        cns_bytes_free(cns, values[i]);
+    }
+    free(keys);
+    free(values);
+
+    ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+START_TEST(test_storage_interning)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    cns_Storage* storage = cns_storage_newMemoryStorage(cns, 0);
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_storage_setInterning_r(cns, storage, 4));
+    cns_storage_setInterning(cns, storage, CNS_STORAGE_INTERN_KEYS | CNS_STORAGE_INTERN_VALUES);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+
+    // 1000 keys, each one a slice of a bigger buffer, mapping to 10 distinct values allocated separately
+    cns_Bytes* buffer = cns_bytes_new(cns, "prefix:0123456789", 17);
+    for (int i = 0; i < 1000; ++i)
+    {
+        cns_Bytes* keyStr = bytesStrFromInt(cns, i);
+        cns_Bytes* key = cns_bytes_slice(cns, keyStr, 0, cns_bytes_length(cns, keyStr));
+        cns_Bytes* value = bytesStrFromInt(cns, i % 10);
+        cns_storage_set(cns, storage, key, value);
+        ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+        cns_bytes_free(cns, value);
+        cns_bytes_free(cns, key);
+        cns_bytes_free(cns, keyStr);
+    }
+
+    cns_StorageStats stats;
+    cns_storage_stats(cns, storage, &stats);
+    ck_assert_int_eq(1000, stats.internedCount); // values "0".."9" share the table entries of keys "0".."9"
+    ck_assert_int_gt(stats.internSavedBytes, 0);
+
+    cns_Bytes* key = bytesStrFromInt(cns, 13);
+    cns_Bytes* value = cns_storage_get(cns, storage, key);
+    ck_assert_int_eq(3, intFromBytesStr(cns, value));
+    cns_Bytes* three = cns_storage_intern(cns, storage, "3", 2); // with the terminator, as bytesStrFromInt makes them
+    ck_assert_ptr_eq(value, three);
+    cns_bytes_free(cns, three);
+    cns_bytes_free(cns, value);
+    cns_bytes_free(cns, key);
+
+    // interning works on slices of the buffer without pinning it
+    cns_Bytes* digits = cns_bytes_slice(cns, buffer, 7, 10);
+    cns_Bytes* internedDigits = cns_storage_intern(cns, storage, "0123456789", 10);
+    cns_storage_set(cns, storage, digits, digits);
+    ck_assert_int_eq(CNS_YES, cns_bytes_equal(cns, digits, internedDigits));
+    value = cns_storage_get(cns, storage, internedDigits);
+    ck_assert_ptr_eq(internedDigits, value);
+    cns_bytes_free(cns, value);
+    cns_bytes_free(cns, internedDigits);
+    cns_bytes_free(cns, digits);
+    cns_bytes_free(cns, buffer);
+
+    // entries nobody uses any more go away as the storage shrinks
+    for (int i = 0; i < 1000; ++i)
+    {
+        key = bytesStrFromInt(cns, i);
+        cns_storage_delete(cns, storage, key);
+        cns_bytes_free(cns, key);
+    }
+    cns_storage_stats(cns, storage, &stats);
+    ck_assert_int_lt(stats.internedCount, 1000);
+
+    cns_storage_setInterning(cns, storage, 0);
+    cns_storage_stats(cns, storage, &stats);
+    ck_assert_int_eq(0, stats.internedCount);
+    ck_assert_int_eq(1, cns_storage_count(cns, storage));
+
+    cns_storage_free(cns, storage);
+
+    ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+// a JSON-like document of about `length` bytes, different for each `x`
+static
+cns_Bytes* documentFromInt(cns_Runtime* cns, int x, int length)
+{
+    char* buf = malloc(length + 64);
+    int n = 0;
+    for (int field = 0; n < length; ++field)
+        n += sprintf(buf + n, "{\"id\":%d,\"field\":%d,\"name\":\"item-%d\",\"tags\":[\"a\",\"b\"]},", x, field, x * 31 + field);
+    cns_Bytes* rv = cns_bytes_new(cns, buf, length);
+    free(buf);
+    return rv;
+}
+
+static
+cns_Bytes* appendMark(cns_Runtime* cns, cns_Bytes* key, cns_Bytes* current, void* context)
+{
+    ck_assert_ptr_ne(0, current);
+    cns_Bytes* mark = cns_bytes_new(cns, "!", 1);
+    cns_Bytes* rv = cns_bytes_concat(cns, current, mark);
+    cns_bytes_free(cns, mark);
+    return rv;
+}
+
+START_TEST(test_storage_compression)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    cns_Storage* storage = cns_storage_newMemoryStorage(cns, 0);
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_storage_setCompression_r(cns, storage, -1, 0));
+    cns_storage_setCompression(cns, storage, 1024, 8);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+
+    // short values and values which do not shrink are stored as they are
+    cns_Bytes* key = bytesStrFromInt(cns, 1);
+    cns_Bytes* small = documentFromInt(cns, 1, 100);
+    cns_storage_set(cns, storage, key, small);
+    cns_Bytes* value = cns_storage_get(cns, storage, key);
+    ck_assert_ptr_eq(small, value);
+    cns_bytes_free(cns, value);
+    cns_bytes_free(cns, small);
+    cns_bytes_free(cns, key);
+
+    char noise[4096];
+    srand(7);
+    for (int i = 0; i < (int) sizeof(noise); ++i)
+        noise[i] = (char) rand();
+    key = bytesStrFromInt(cns, 2);
+    cns_Bytes* random = cns_bytes_new(cns, noise, sizeof(noise));
+    cns_storage_set(cns, storage, key, random);
+    value = cns_storage_get(cns, storage, key);
+    ck_assert_ptr_eq(random, value);
+    cns_bytes_free(cns, value);
+    cns_bytes_free(cns, random);
+    cns_bytes_free(cns, key);
+
+    for (int i = 100; i < 200; ++i)
+    {
+        key = bytesStrFromInt(cns, i);
+        cns_Bytes* document = documentFromInt(cns, i, 1024 * (1 + i % 16));
+        cns_storage_set(cns, storage, key, document);
+        ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+        cns_bytes_free(cns, document);
+        cns_bytes_free(cns, key);
+    }
+
+    cns_StorageStats stats;
+    cns_storage_stats(cns, storage, &stats);
+    ck_assert_int_eq(100, stats.compressedCount);
+    ck_assert_int_gt(stats.uncompressedBytes, 4 * stats.compressedBytes);
+
+    for (int round = 0; round < 2; ++round)
+    {
+        for (int i = 100; i < 200; ++i)
+        {
+            key = bytesStrFromInt(cns, i);
+            cns_Bytes* document = documentFromInt(cns, i, 1024 * (1 + i % 16));
+            value = cns_storage_get(cns, storage, key);
+            ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+            ck_assert_int_eq(CNS_YES, cns_bytes_equal(cns, document, value));
+            // the cache holds the last few, so asking again right away gives the same block
+            cns_Bytes* again = cns_storage_get(cns, storage, key);
+            ck_assert_ptr_eq(value, again);
+            cns_bytes_free(cns, again);
+            cns_bytes_free(cns, value);
+            cns_bytes_free(cns, document);
+            cns_bytes_free(cns, key);
+        }
+    }
+    cns_storage_stats(cns, storage, &stats);
+    if (stats.instrumented)
+    {
+        ck_assert_int_eq(400, stats.compressedGets);
+        ck_assert_int_ge(stats.decompressCacheHits, 200);
+    }
+
+    // upserts see the value decompressed, and what they store is compressed again
+    key = bytesStrFromInt(cns, 100);
+    cns_storage_upsert(cns, storage, key, appendMark, 0);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    value = cns_storage_get(cns, storage, key);
+    ck_assert_int_eq(1024 * 5 + 1, cns_bytes_length(cns, value));
+    ck_assert_int_eq('!', ((const char *) cns_bytes_ptr(cns, value))[1024 * 5]);
+    cns_bytes_free(cns, value);
+    cns_storage_stats(cns, storage, &stats);
+    ck_assert_int_eq(100, stats.compressedCount);
+
+    // entries cannot lend a compressed value, and what is written through them stays uncompressed
+    cns_StorageEntry* entry = cns_storage_getOrInsert(cns, storage, key, key, 0);
+    ck_assert_ptr_eq(0, cns_storage_entryValue(cns, entry));
+    ck_assert_int_eq(CNS_ERR_UNSUPPORTED, cns_lasterr(cns));
+    cns_Bytes* document = documentFromInt(cns, 100, 4096);
+    cns_storage_entrySetValue(cns, storage, entry, document);
+    ck_assert_ptr_eq(document, cns_storage_entryValue(cns, entry));
+    cns_bytes_free(cns, document);
+    cns_bytes_free(cns, key);
+
+    // turning it off leaves compressed values readable
+    cns_storage_setCompression(cns, storage, 0, 0);
+    key = bytesStrFromInt(cns, 150);
+    document = documentFromInt(cns, 150, 1024 * (1 + 150 % 16));
+    value = cns_storage_get(cns, storage, key);
+    ck_assert_int_eq(CNS_YES, cns_bytes_equal(cns, document, value));
+    cns_bytes_free(cns, value);
+    cns_storage_set(cns, storage, key, document);
+    cns_storage_stats(cns, storage, &stats);
+    ck_assert_int_eq(98, stats.compressedCount);
+    cns_bytes_free(cns, document);
+    cns_bytes_free(cns, key);
+
+    cns_storage_free(cns, storage);
+
+    ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+// most documents are short; those stored as concatenations are long enough to stay in pieces, and a few compress
+static
+int snapshotDocumentSize(int x)
+{
+    return x % 100 ? (x % 7 ? 64 : 700) : 2048;
+}
+
+static
+void checkRestored(cns_Runtime* cns, cns_Storage* storage, int count)
+{
+    ck_assert_int_eq(count, cns_storage_count(cns, storage));
+    for (int i = 0; i < count; ++i)
+    {
+        cns_Bytes* key = bytesStrFromInt(cns, i);
+        cns_Bytes* document = documentFromInt(cns, i, snapshotDocumentSize(i));
+        cns_Bytes* value = cns_storage_get(cns, storage, key);
+        ck_assert_int_eq(CNS_YES, cns_bytes_equal(cns, document, value));
+        cns_bytes_free(cns, value);
+        cns_bytes_free(cns, document);
+        cns_bytes_free(cns, key);
+    }
+}
+
+START_TEST(test_storage_snapshot)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    enum { COUNT = 30000 };
+    cns_Storage* storage = cns_storage_newMemoryStorage(cns, 0);
+    cns_storage_setCompression(cns, storage, 1024, 0);
+    for (int i = 0; i < COUNT; ++i)
+    {
+        cns_Bytes* key = bytesStrFromInt(cns, i);
+        cns_Bytes* document = documentFromInt(cns, i, snapshotDocumentSize(i));
+        if (i % 7 == 0)
+        {
+            // concatenations are written piece by piece
+            cns_Bytes* head = cns_bytes_slice(cns, document, 0, 10);
+            cns_Bytes* tail = cns_bytes_slice(cns, document, 10, cns_bytes_length(cns, document) - 10);
+            cns_Bytes* rope = cns_bytes_concat(cns, head, tail);
+            cns_storage_set(cns, storage, key, rope);
+            cns_bytes_free(cns, rope);
+            cns_bytes_free(cns, tail);
+            cns_bytes_free(cns, head);
+        }
+        else
+            cns_storage_set(cns, storage, key, document);
+        cns_bytes_free(cns, document);
+        cns_bytes_free(cns, key);
+    }
+
+    char path[] = "/tmp/cns_snapshotXXXXXX";
+    int fd = mkstemp(path);
+    ck_assert_int_ge(fd, 0);
+    unlink(path);
+    ck_assert_int_eq(3, write(fd, "pre", 3));
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_storage_writeSnapshot_r(cns, storage, fd, 0));
+    // the calling thread encodes a share of the pieces itself, without touching the last error
+    cns_setlasterr(cns, CNS_ERR_BUSY);
+    ck_assert_int_eq(CNS_OK, cns_storage_writeSnapshot_r(cns, storage, fd, 4));
+    ck_assert_int_eq(CNS_ERR_BUSY, cns_lasterr(cns));
+    ck_assert_int_eq(4, write(fd, "post", 4));
+    off_t size = lseek(fd, 0, SEEK_CUR);
+
+    // restored on another number of threads, and with another hash function, which puts items into other buckets
+    for (int round = 0; round < 3; ++round)
+    {
+        cns_Storage* restored = cns_storage_newMemoryStorage(cns, round == 2 ? cns_storage_jenkinsBytesHash32 : 0);
+        lseek(fd, 3, SEEK_SET);
+        cns_storage_readSnapshot(cns, restored, fd, round == 0 ? 1 : 3);
+        ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+        char post[4];
+        ck_assert_int_eq(4, read(fd, post, 4));
+        ck_assert(0 == memcmp("post", post, 4));
+        checkRestored(cns, restored, COUNT);
+
+        // compressed values stay so
+        cns_StorageStats stats;
+        cns_storage_stats(cns, restored, &stats);
+        ck_assert_int_eq(COUNT / 100, stats.compressedCount);
+
+        // only into empty storages
+        lseek(fd, 3, SEEK_SET);
+        ck_assert_int_eq(CNS_ERR_BADARG, cns_storage_readSnapshot_r(cns, restored, fd, 2));
+        cns_storage_free(cns, restored);
+    }
+
+    // damage anywhere is caught, and leaves the storage empty
+    off_t damaged[] = { 3, 20, size / 2, size - 10 };
+    for (int i = 0; i < (int) (sizeof(damaged) / sizeof(damaged[0])); ++i)
+    {
+        char byte;
+        ck_assert_int_eq(1, pread(fd, &byte, 1, damaged[i]));
+        byte ^= 0x10;
+        ck_assert_int_eq(1, pwrite(fd, &byte, 1, damaged[i]));
+
+        cns_Storage* restored = cns_storage_newMemoryStorage(cns, 0);
+        lseek(fd, 3, SEEK_SET);
+        ck_assert_int_eq(CNS_ERR_MALFORMED, cns_storage_readSnapshot_r(cns, restored, fd, 3));
+        ck_assert_int_eq(0, cns_storage_count(cns, restored));
+        cns_storage_free(cns, restored);
+
+        byte ^= 0x10;
+        ck_assert_int_eq(1, pwrite(fd, &byte, 1, damaged[i]));
+    }
+    ck_assert_int_eq(0, ftruncate(fd, size / 2));
+    cns_Storage* restored = cns_storage_newMemoryStorage(cns, 0);
+    lseek(fd, 3, SEEK_SET);
+    ck_assert_int_eq(CNS_ERR_MALFORMED, cns_storage_readSnapshot_r(cns, restored, fd, 3));
+    cns_storage_free(cns, restored);
+
+    // an empty storage makes a snapshot too
+    cns_Storage* empty = cns_storage_newMemoryStorage(cns, 0);
+    ck_assert_int_eq(0, ftruncate(fd, 0));
+    lseek(fd, 0, SEEK_SET);
+    ck_assert_int_eq(CNS_OK, cns_storage_writeSnapshot_r(cns, empty, fd, 4));
+    lseek(fd, 0, SEEK_SET);
+    ck_assert_int_eq(CNS_OK, cns_storage_readSnapshot_r(cns, empty, fd, 4));
+    ck_assert_int_eq(0, cns_storage_count(cns, empty));
+    cns_storage_free(cns, empty);
+    close(fd);
+
+    cns_storage_free(cns, storage);
+
+    ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+// fails every allocation once `allocsLeft` runs out; -1 for never
+struct FailingAllocContext
+{
+    struct TestRTAllocContext base;
+    int allocsLeft;
+};
+
+static
+void* failingAlloc(const void * allocContext, cns_Index size, cns_Error* err)
+{
+    struct FailingAllocContext* context = (struct FailingAllocContext*) allocContext;
+    if (!context->allocsLeft)
+    {
+        *err = CNS_ERR_NOMEM;
+        return 0;
+    }
+    if (context->allocsLeft > 0)
+        --context->allocsLeft;
+    return test_rt_alloc(allocContext, size, err);
+}
+
+static
+void* failingRealloc(const void * allocContext, void* ptr, cns_Index size, cns_Error* err)
+{
+    struct FailingAllocContext* context = (struct FailingAllocContext*) allocContext;
+    if (!context->allocsLeft)
+    {
+        *err = CNS_ERR_NOMEM;
+        return 0;
+    }
+    if (context->allocsLeft > 0)
+        --context->allocsLeft;
+    return test_rt_realloc(allocContext, ptr, size, err);
+}
+
+// counts allocator calls made off the thread which started the runtime
+struct ThreadCheckingAllocContext
+{
+    struct TestRTAllocContext base;
+    pthread_t owner;
+    _Atomic int offThread;
+};
+
+static
+void checkThread(const void * allocContext)
+{
+    struct ThreadCheckingAllocContext* context = (struct ThreadCheckingAllocContext*) allocContext;
+    if (!pthread_equal(context->owner, pthread_self()))
+        ++context->offThread;
+}
+
+static
+void* threadCheckingAlloc(const void * allocContext, cns_Index size, cns_Error* err)
+{
+    checkThread(allocContext);
+    return test_rt_alloc(allocContext, size, err);
+}
+
+static
+void threadCheckingFree(const void * allocContext, void* ptr, cns_Error* err)
+{
+    checkThread(allocContext);
+    test_rt_free(allocContext, ptr, err);
+}
+
+static
+void* threadCheckingRealloc(const void * allocContext, void* ptr, cns_Index size, cns_Error* err)
+{
+    checkThread(allocContext);
+    return test_rt_realloc(allocContext, ptr, size, err);
+}
+
+static
+int balance(cns_Runtime* cns, cns_Storage* storage, cns_StorageView* view, int account)
+{
+    cns_Bytes* key = bytesStrFromInt(cns, account);
+    cns_Bytes* value = view ? cns_storage_viewGet(cns, view, key) : cns_storage_get(cns, storage, key);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    int rv = value ? intFromBytesStr(cns, value) : 0;
+    if (value)
+        cns_bytes_free(cns, value);
+    cns_bytes_free(cns, key);
+    return rv;
+}
+
+static
+void setBalance(cns_Runtime* cns, cns_StorageBatch* batch, int account, int amount)
+{
+    cns_Bytes* key = bytesStrFromInt(cns, account);
+    if (amount)
+    {
+        cns_Bytes* value = bytesStrFromInt(cns, amount);
+        cns_storagebatch_set(cns, batch, key, value);
+        cns_bytes_free(cns, value);
+    }
+    else
+        cns_storagebatch_delete(cns, batch, key); // empty accounts are closed
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    cns_bytes_free(cns, key);
+}
+
+START_TEST(test_storage_batch)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    // transfers between accounts never change the total, whichever commit it is read at
+    enum { ACCOUNTS = 200, TRANSFERS = 3000, VIEWS = 4 };
+    cns_Storage* storage = cns_storage_newMemoryStorage(cns, 0);
+    cns_StorageBatch* batch = cns_storagebatch_new(cns);
+    for (int i = 0; i < ACCOUNTS; ++i)
+        setBalance(cns, batch, i, 100);
+    ck_assert_int_eq(ACCOUNTS, cns_storagebatch_count(cns, batch));
+    cns_Index count = 0;
+    cns_setlasterr(cns, CNS_ERR_BUSY);
+    ck_assert_int_eq(CNS_OK, cns_storagebatch_count_r(cns, batch, &count));
+    ck_assert_int_eq(ACCOUNTS, count);
+    ck_assert_int_eq(CNS_ERR_BUSY, cns_lasterr(cns));
+    ck_assert_int_eq(0, cns_storage_sequence(cns, storage));
+    cns_storage_apply(cns, storage, batch);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    ck_assert_int_eq(1, cns_storage_sequence(cns, storage));
+    ck_assert_int_eq(ACCOUNTS, cns_storage_count(cns, storage));
+
+    cns_StorageView* views[VIEWS] = { 0 };
+    int balances[VIEWS][ACCOUNTS];
+    unsigned seed = 7;
+    for (int t = 0; t < TRANSFERS; ++t)
+    {
+        seed = seed * 1103515245 + 12345;
+        int from = (int) ((seed >> 8) % ACCOUNTS);
+        int to = (int) ((seed >> 20) % ACCOUNTS);
+        int fromBalance = balance(cns, storage, 0, from);
+        int amount = fromBalance ? (int) (seed % (unsigned) fromBalance) + 1 : 0;
+        cns_storagebatch_clear(cns, batch);
+        setBalance(cns, batch, from, fromBalance - amount);
+        setBalance(cns, batch, to, balance(cns, storage, 0, to) + (from == to ? 0 : amount));
+        if (from == to)
+            setBalance(cns, batch, from, fromBalance); // the same key twice in a batch
+        uint64_t sequence = cns_storage_sequence(cns, storage);
+        cns_storage_apply(cns, storage, batch);
+        ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+        ck_assert_int_eq(sequence + 1, cns_storage_sequence(cns, storage));
+
+        // views come and go, each pinned for a while
+        int v = (int) ((seed >> 4) % VIEWS);
+        if (t % 97 == 0)
+        {
+            if (views[v])
+            {
+                for (int i = 0; i < ACCOUNTS; ++i)
+                    ck_assert_int_eq(balances[v][i], balance(cns, storage, views[v], i));
+                cns_storage_unpin(cns, views[v]);
+            }
+            views[v] = cns_storage_pin(cns, storage);
+            ck_assert_int_eq(cns_storage_sequence(cns, storage), cns_storage_viewSequence(cns, views[v]));
+            for (int i = 0; i < ACCOUNTS; ++i)
+                balances[v][i] = balance(cns, storage, 0, i);
+        }
+        if (views[v] && t % 13 == 0)
+        {
+            int total = 0;
+            for (int i = 0; i < ACCOUNTS; ++i)
+                total += balance(cns, storage, views[v], i);
+            ck_assert_int_eq(100 * ACCOUNTS, total);
+        }
+    }
+    int total = 0;
+    for (int i = 0; i < ACCOUNTS; ++i)
+        total += balance(cns, storage, 0, i);
+    ck_assert_int_eq(100 * ACCOUNTS, total);
+
+    cns_StorageStats stats;
+    memset(&stats, 0, sizeof(stats));
+    cns_storage_stats(cns, storage, &stats);
+    ck_assert_int_eq(VIEWS, stats.pinnedViews);
+    ck_assert_int_gt(stats.retainedVersions, 0);
+
+    // restoring into a storage with pinned views is refused
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_storage_readSnapshot_r(cns, storage, 0, 1));
+
+    // versions go once no view needs them
+    for (int v = 0; v < VIEWS; ++v)
+    {
+        for (int i = 0; i < ACCOUNTS; ++i)
+            ck_assert_int_eq(balances[v][i], balance(cns, storage, views[v], i));
+        cns_storage_unpin(cns, views[v]);
+    }
+    memset(&stats, 0, sizeof(stats));
+    cns_storage_stats(cns, storage, &stats);
+    ck_assert_int_eq(0, stats.pinnedViews);
+    ck_assert_int_eq(0, stats.retainedVersions);
+
+    // plain writes are commits too, and views see past them
+    cns_StorageView* view = cns_storage_pin(cns, storage);
+    uint64_t sequence = cns_storage_sequence(cns, storage);
+    cns_Bytes* key = bytesStrFromInt(cns, 0);
+    cns_Bytes* value = bytesStrFromInt(cns, 12345);
+    int before = balance(cns, storage, 0, 0);
+    cns_storage_set(cns, storage, key, value);
+    ck_assert(cns_storage_delete(cns, storage, key));
+    cns_storage_set(cns, storage, key, value);
+    ck_assert_int_eq(sequence + 3, cns_storage_sequence(cns, storage));
+    ck_assert_int_eq(before, balance(cns, storage, view, 0));
+    ck_assert_int_eq(12345, balance(cns, storage, 0, 0));
+    cns_storage_unpin(cns, view);
+    cns_bytes_free(cns, value);
+    cns_bytes_free(cns, key);
+
+    cns_storagebatch_free(cns, batch);
+    cns_storage_free(cns, storage);
+
+    ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+START_TEST(test_storage_batch_atomic)
+{
+    struct FailingAllocContext allocContext = {
+        .base = { .bytesAllocated = 0 },
+        .allocsLeft = -1,
+    };
+    cns_Runtime* cns = cns_startup(failingAlloc, test_rt_free, failingRealloc, &allocContext);
+
+    const int noleaksNumber = allocContext.base.bytesAllocated;
+
+    enum { COUNT = 100 };
+    cns_Storage* storage = cns_storage_newMemoryStorage(cns, 0);
+    cns_storage_setCompression(cns, storage, 256, 0);
+    cns_StorageBatch* batch = cns_storagebatch_new(cns);
+    for (int i = 0; i < COUNT; ++i)
+    {
+        cns_Bytes* key = bytesStrFromInt(cns, i);
+        cns_Bytes* document = documentFromInt(cns, i, 1000);
+        cns_storage_set(cns, storage, key, document);
+        cns_bytes_free(cns, document);
+        cns_bytes_free(cns, key);
+    }
+
+    // every existing key rewritten or deleted, and as many new ones
+    for (int i = 0; i < 2 * COUNT; ++i)
+    {
+        cns_Bytes* key = bytesStrFromInt(cns, i);
+        if (i % 3 == 0)
+            cns_storagebatch_delete(cns, batch, key);
+        else
+        {
+            cns_Bytes* document = documentFromInt(cns, -i, 1000);
+            cns_storagebatch_set(cns, batch, key, document);
+            cns_bytes_free(cns, document);
+        }
+        cns_bytes_free(cns, key);
+    }
+
+    // running out of memory anywhere leaves the storage as it was
+    cns_StorageView* view = cns_storage_pin(cns, storage);
+    uint64_t sequence = cns_storage_sequence(cns, storage);
+    cns_Error err = CNS_ERR_NOMEM;
+    for (int allocs = 0; err; ++allocs)
+    {
+        allocContext.allocsLeft = allocs;
+        err = cns_storage_apply_r(cns, storage, batch);
+        allocContext.allocsLeft = -1;
+        if (!err)
+            break;
+        ck_assert_int_eq(CNS_ERR_NOMEM, err);
+        ck_assert_int_eq(sequence, cns_storage_sequence(cns, storage));
+        ck_assert_int_eq(COUNT, cns_storage_count(cns, storage));
+        for (int i = 0; i < 2 * COUNT; i += 7)
+        {
+            cns_Bytes* key = bytesStrFromInt(cns, i);
+            cns_Bytes* value = cns_storage_get(cns, storage, key);
+            if (i < COUNT)
+            {
+                cns_Bytes* document = documentFromInt(cns, i, 1000);
+                ck_assert(cns_bytes_equal(cns, document, value));
+                cns_bytes_free(cns, document);
+                cns_bytes_free(cns, value);
+            }
+            else
+                ck_assert_ptr_eq(0, value);
+            cns_bytes_free(cns, key);
+        }
+    }
+    ck_assert_int_eq(sequence + 1, cns_storage_sequence(cns, storage));
+    ck_assert_int_eq(2 * COUNT - (2 * COUNT + 2) / 3, cns_storage_count(cns, storage));
+
+    // the view still sees the values from before, compressed ones included
+    for (int i = 0; i < 2 * COUNT; ++i)
+    {
+        cns_Bytes* key = bytesStrFromInt(cns, i);
+        cns_Bytes* value = cns_storage_viewGet(cns, view, key);
+        ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+        if (i < COUNT)
+        {
+            cns_Bytes* document = documentFromInt(cns, i, 1000);
+            ck_assert(cns_bytes_equal(cns, document, value));
+            cns_bytes_free(cns, document);
+            cns_bytes_free(cns, value);
+        }
+        else
+            ck_assert_ptr_eq(0, value);
+        cns_bytes_free(cns, key);
+    }
+    cns_storage_unpin(cns, view);
+
+    cns_storagebatch_free(cns, batch);
+    cns_storage_free(cns, storage);
+
+    ck_assert_int_eq( noleaksNumber, allocContext.base.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+// every key of `expected` has the same value in `actual`, and no other key is there
+static void checkSameContent(cns_Runtime* cns, cns_Storage* expected, cns_Storage* actual, int numKeys)
+{
+    ck_assert_int_eq(cns_storage_count(cns, expected), cns_storage_count(cns, actual));
+    ck_assert_int_eq(cns_storage_sequence(cns, expected), cns_storage_sequence(cns, actual));
+    for (int i = 0; i < numKeys; ++i)
+    {
+        cns_Bytes* key = bytesStrFromInt(cns, i);
+        cns_Bytes* expectedValue = cns_storage_get(cns, expected, key);
+        cns_Bytes* actualValue = cns_storage_get(cns, actual, key);
+        ck_assert((expectedValue == 0) == (actualValue == 0));
+        if (expectedValue)
+        {
+            ck_assert(cns_bytes_equal(cns, expectedValue, actualValue));
+            cns_bytes_free(cns, expectedValue);
+            cns_bytes_free(cns, actualValue);
+        }
+        cns_bytes_free(cns, key);
+    }
+}
+
+START_TEST(test_storage_applyBatches)
+{
+    struct FailingAllocContext allocContext = {
+        .base = { .bytesAllocated = 0 },
+        .allocsLeft = -1,
+    };
+    cns_Runtime* cns = cns_startup(failingAlloc, test_rt_free, failingRealloc, &allocContext);
+
+    const int noleaksNumber = allocContext.base.bytesAllocated;
+
+    // writes to few keys conflict often, within and across batches, and deletes make the table shrink again
+    enum { KEYS = 3000, BATCHES = 64, WRITES = 80 };
+    cns_StorageBatch* batches[BATCHES];
+    unsigned seed = 11;
+    for (int b = 0; b < BATCHES; ++b)
+    {
+        batches[b] = cns_storagebatch_new(cns);
+        for (int w = 0; w < WRITES && b % 16 != 5; ++w)
+        {
+            seed = seed * 1103515245 + 12345;
+            int k = (int) ((seed >> 8) % (b < BATCHES / 2 ? KEYS : KEYS / 30));
+            cns_Bytes* key = bytesStrFromInt(cns, k);
+            if (b >= BATCHES / 2 && seed % 3 == 0)
+                cns_storagebatch_delete(cns, batches[b], key);
+            else
+            {
+                cns_Bytes* value = bytesStrFromInt(cns, b * WRITES + w);
+                cns_storagebatch_set(cns, batches[b], key, value);
+                cns_bytes_free(cns, value);
+            }
+            cns_bytes_free(cns, key);
+        }
+    }
+
+    cns_Storage* expected = cns_storage_newMemoryStorage(cns, 0);
+    for (int b = 0; b < BATCHES; ++b)
+        cns_storage_apply(cns, expected, batches[b]);
+    ck_assert_int_eq(BATCHES - BATCHES / 16, cns_storage_sequence(cns, expected));
+
+    cns_Storage* parallel = cns_storage_newMemoryStorage(cns, 0);
+    cns_storage_applyBatches(cns, parallel, batches, BATCHES, 4);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    checkSameContent(cns, expected, parallel, KEYS);
+
+    // storages which compress apply the batches one by one, to the same effect
+    cns_Storage* compressed = cns_storage_newMemoryStorage(cns, 0);
+    cns_storage_setCompression(cns, compressed, 4, 0);
+    cns_storage_applyBatches(cns, compressed, batches, BATCHES, 4);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    checkSameContent(cns, expected, compressed, KEYS);
+
+    // running out of memory leaves the storage as it was
+    for (int b = 0; b < BATCHES; ++b)
+        cns_storage_apply(cns, expected, batches[b]);
+    cns_Error err = CNS_ERR_NOMEM;
+    for (int allocs = 0; err; ++allocs)
+    {
+        allocContext.allocsLeft = allocs;
+        err = cns_storage_applyBatches_r(cns, parallel, batches, BATCHES, 4);
+        allocContext.allocsLeft = -1;
+        if (!err)
+            break;
+        ck_assert_int_eq(CNS_ERR_NOMEM, err);
+        ck_assert_int_eq(BATCHES - BATCHES / 16, cns_storage_sequence(cns, parallel));
+    }
+    checkSameContent(cns, expected, parallel, KEYS);
+
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_storage_applyBatches_r(cns, parallel, 0, 1, 4));
+    ck_assert_int_eq(CNS_OK, cns_storage_applyBatches_r(cns, parallel, batches, 0, 4));
+
+    for (int b = 0; b < BATCHES; ++b)
+        cns_storagebatch_free(cns, batches[b]);
+    cns_storage_free(cns, compressed);
+    cns_storage_free(cns, parallel);
+    cns_storage_free(cns, expected);
+
+    ck_assert_int_eq( noleaksNumber, allocContext.base.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+// concatenated keys are joined on the calling thread before a hash function reading them flat runs on the workers
+START_TEST(test_storage_applyBatches_concatenated)
+{
+    struct ThreadCheckingAllocContext allocContext = {
+        .base = { .bytesAllocated = 0 },
+        .owner = pthread_self(),
+        .offThread = 0,
+    };
+    cns_Runtime* cns = cns_startup(threadCheckingAlloc, threadCheckingFree, threadCheckingRealloc, &allocContext);
+
+    const int noleaksNumber = allocContext.base.bytesAllocated;
+
+    enum { BATCHES = 4, WRITES = 2048 };
+    char pad[600];
+    memset(pad, 'k', sizeof(pad));
+    cns_Bytes* prefix = cns_bytes_new(cns, pad, sizeof(pad));
+    cns_StorageBatch* batches[BATCHES];
+    for (int b = 0; b < BATCHES; ++b)
+    {
+        batches[b] = cns_storagebatch_new(cns);
+        for (int w = 0; w < WRITES; ++w)
+        {
+            cns_Bytes* suffix = bytesStrFromInt(cns, b * WRITES + w);
+            cns_Bytes* key = cns_bytes_concat(cns, prefix, suffix);
+            cns_storagebatch_set(cns, batches[b], key, suffix);
+            cns_bytes_free(cns, key);
+            cns_bytes_free(cns, suffix);
+        }
+    }
+
+    cns_Storage* storage = cns_storage_newMemoryStorage(cns, cns_storage_jenkinsBytesHash32);
+    cns_storage_applyBatches(cns, storage, batches, BATCHES, 4);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    ck_assert_int_eq(0, allocContext.offThread);
+    ck_assert_int_eq(BATCHES * WRITES, cns_storage_count(cns, storage));
+
+    cns_Bytes* suffix = bytesStrFromInt(cns, 5 * WRITES / 2);
+    cns_Bytes* key = cns_bytes_concat(cns, prefix, suffix);
+    cns_Bytes* value = cns_storage_get(cns, storage, key);
+    ck_assert(cns_bytes_equal(cns, suffix, value));
+    cns_bytes_free(cns, value);
+    cns_bytes_free(cns, key);
+    cns_bytes_free(cns, suffix);
+
+    for (int b = 0; b < BATCHES; ++b)
+        cns_storagebatch_free(cns, batches[b]);
+    cns_storage_free(cns, storage);
+    cns_bytes_free(cns, prefix);
+
+    ck_assert_int_eq( noleaksNumber, allocContext.base.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
 Suite* storage_suite(void)
 {
     Suite* s = suite_create("storage");
@@ -263,6 +1435,17 @@ Suite* storage_suite(void)
     TCase* tc = tcase_create("storage");
     tcase_add_test(tc, test_defaultBytesHash32);
     tcase_add_test(tc, test_storage);
+    tcase_add_test(tc, test_storage_r);
+    tcase_add_test(tc, test_storage_stats);
+    tcase_add_test(tc, test_storage_upsert);
+    tcase_add_test(tc, test_storage_bulk);
+    tcase_add_test(tc, test_storage_interning);
+    tcase_add_test(tc, test_storage_compression);
+    tcase_add_test(tc, test_storage_snapshot);
+    tcase_add_test(tc, test_storage_batch);
+    tcase_add_test(tc, test_storage_batch_atomic);
+    tcase_add_test(tc, test_storage_applyBatches);
+    tcase_add_test(tc, test_storage_applyBatches_concatenated);
 
     suite_add_tcase(s, tc);
     return s;
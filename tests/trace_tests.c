@@ -0,0 +1,278 @@
+#include <consensual/runtime.h>
+#include <consensual/trace.h>
+#include <consensual/bytes.h>
+#include "alloc.h"
+
+#include <check.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum { GET_THREADS = 4, GETS_PER_THREAD = 5000 };
+
+static
+void tempPath(char* path)
+{
+    strcpy(path, "/tmp/cns_traceXXXXXX");
+    int fd = mkstemp(path);
+    ck_assert_int_ge(fd, 0);
+    close(fd);
+}
+
+static
+cns_Bytes* bytesStr(cns_Runtime* cns, const char * str)
+{
+    return cns_bytes_new(cns, str, strlen(str));
+}
+
+static
+void freeRecord(cns_Runtime* cns, cns_TraceRecord* record)
+{
+    if (record->key)
+        cns_bytes_free(cns, record->key);
+    if (record->value)
+        cns_bytes_free(cns, record->value);
+}
+
+// runs a few operations of each kind on a traced storage and reads them back
+static
+void runTrace(cns_Runtime* cns, cns_Bool payloads, uint64_t* out_size)
+{
+    char path[32];
+    tempPath(path);
+    cns_Storage* storage = cns_storage_newMemoryStorage(cns, 0);
+    cns_TraceOptions options;
+    cns_traceoptions_default(&options);
+    options.keys = payloads;
+    options.values = payloads;
+    options.bufferSize = 64; // small, so that records are written out as the trace goes
+    cns_Trace* trace = cns_trace_start(cns, storage, path, &options);
+    ck_assert_ptr_ne(0, trace);
+    ck_assert_ptr_eq(0, cns_trace_start(cns, storage, path, &options));
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_lasterr(cns));
+
+    // the key of the get is a concatenation, which hashes as its flat content does
+    cns_Bytes* key = bytesStr(cns, "alpha");
+    cns_Bytes* big = cns_bytes_new(cns, 0, 0);
+    char buf[300];
+    memset(buf, 'v', sizeof(buf));
+    cns_Bytes* value = cns_bytes_new(cns, buf, sizeof(buf));
+    cns_Bytes* head = bytesStr(cns, "al");
+    cns_Bytes* tail = bytesStr(cns, "pha");
+    cns_Bytes* rope = cns_bytes_concat(cns, head, tail);
+    cns_Bytes* missing = bytesStr(cns, "beta");
+    cns_storage_set(cns, storage, key, value);
+    cns_Bytes* got = cns_storage_get(cns, storage, rope);
+    ck_assert_ptr_ne(0, got);
+    cns_bytes_free(cns, got);
+    ck_assert_ptr_eq(0, cns_storage_get(cns, storage, missing));
+    ck_assert(!cns_storage_delete(cns, storage, missing));
+    ck_assert(cns_storage_delete(cns, storage, key));
+    cns_storage_set(cns, storage, missing, big);
+
+    // recording walks the pieces of keys and values without touching the last error of the caller
+    cns_setlasterr(cns, CNS_ERR_BUSY);
+    ck_assert_int_eq(CNS_OK, cns_storage_set_r(cns, storage, rope, value));
+    ck_assert_int_eq(CNS_OK, cns_storage_get_r(cns, storage, rope, &got));
+    cns_bytes_free_r(cns, got);
+    cns_Bool existed = CNS_NO;
+    ck_assert_int_eq(CNS_OK, cns_storage_delete_r(cns, storage, rope, &existed));
+    ck_assert(existed);
+    ck_assert_int_eq(CNS_ERR_BUSY, cns_lasterr(cns));
+
+    cns_TraceStats stats;
+    cns_trace_stats(cns, trace, &stats);
+    ck_assert_int_eq(9, stats.records);
+    ck_assert_int_eq(0, stats.dropped);
+    cns_trace_stop(cns, trace);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+
+    // untraced again
+    cns_storage_set(cns, storage, key, value);
+
+    static const int ops[] = { CNS_TRACE_SET, CNS_TRACE_GET, CNS_TRACE_GET, CNS_TRACE_DELETE, CNS_TRACE_DELETE, CNS_TRACE_SET,
+                               CNS_TRACE_SET, CNS_TRACE_GET, CNS_TRACE_DELETE };
+    static const cns_Bool hits[] = { CNS_NO, CNS_YES, CNS_NO, CNS_NO, CNS_YES, CNS_NO, CNS_NO, CNS_YES, CNS_YES };
+    static const cns_Index valueLengths[] = { 300, 300, 0, 0, 0, 0, 300, 300, 0 };
+    cns_Bytes* keys[] = { key, key, missing, missing, key, missing, key, key, key };
+    cns_TraceReader* reader = cns_tracereader_open(cns, path);
+    ck_assert_ptr_ne(0, reader);
+    cns_TraceOptions recorded;
+    cns_tracereader_options(reader, &recorded);
+    ck_assert_int_eq(payloads, recorded.keys);
+    ck_assert_int_eq(payloads, recorded.values);
+    cns_TraceRecord record;
+    uint64_t time = 0;
+    for (int i = 0; i < 9; ++i)
+    {
+        ck_assert(cns_tracereader_next(cns, reader, &record));
+        ck_assert_int_eq(ops[i], record.op);
+        ck_assert_int_eq(hits[i], record.hit);
+        ck_assert(!record.failed);
+        ck_assert_uint_ge(record.time, time);
+        time = record.time;
+        ck_assert_int_eq(0, record.thread);
+        ck_assert_uint_eq(cns_trace_hashKey(cns, keys[i]), record.keyHash);
+        ck_assert_int_eq(cns_bytes_length(cns, keys[i]), record.keyLength);
+        ck_assert_int_eq(valueLengths[i], record.valueLength);
+        if (payloads)
+        {
+            ck_assert(cns_bytes_equal(cns, keys[i], record.key));
+            if (ops[i] == CNS_TRACE_SET)
+                ck_assert(cns_bytes_equal(cns, i == 5 ? big : value, record.value));
+            else
+                ck_assert_ptr_eq(0, record.value);
+        }
+        else
+        {
+            ck_assert_ptr_eq(0, record.key);
+            ck_assert_ptr_eq(0, record.value);
+        }
+        freeRecord(cns, &record);
+    }
+    ck_assert(!cns_tracereader_next(cns, reader, &record));
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    cns_tracereader_close(cns, reader);
+
+    FILE* file = fopen(path, "rb");
+    fseek(file, 0, SEEK_END);
+    *out_size = (uint64_t) ftell(file);
+    fclose(file);
+    ck_assert_uint_eq(stats.bytes, *out_size);
+
+    // a trace cut short reads up to the damage
+    ck_assert_int_eq(0, truncate(path, (off_t) *out_size - 1));
+    reader = cns_tracereader_open(cns, path);
+    int count = 0;
+    while (cns_tracereader_next(cns, reader, &record))
+    {
+        freeRecord(cns, &record);
+        ++count;
+    }
+    ck_assert_int_eq(CNS_ERR_MALFORMED, cns_lasterr(cns));
+    ck_assert_int_eq(8, count);
+    cns_tracereader_close(cns, reader);
+    unlink(path);
+
+    cns_bytes_free(cns, missing);
+    cns_bytes_free(cns, rope);
+    cns_bytes_free(cns, tail);
+    cns_bytes_free(cns, head);
+    cns_bytes_free(cns, value);
+    cns_bytes_free(cns, big);
+    cns_bytes_free(cns, key);
+    cns_storage_free(cns, storage);
+}
+
+typedef struct GetThread
+{
+    cns_Runtime*    cns;
+    cns_Storage*    storage;
+    cns_Bytes*      key;
+} GetThread;
+
+static
+void* getThreadMain(void* arg)
+{
+    GetThread* t = (GetThread*) arg;
+    for (int i = 0; i < GETS_PER_THREAD; ++i)
+        ck_assert_ptr_eq(0, cns_storage_get(t->cns, t->storage, t->key));
+    return 0;
+}
+
+START_TEST(test_trace)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    uint64_t redactedSize = 0, fullSize = 0;
+    runTrace(cns, CNS_NO, &redactedSize);
+    runTrace(cns, CNS_YES, &fullSize);
+    ck_assert_uint_ge(fullSize, redactedSize + 5 * 5 + 2 * 4 + 2 * 300);
+    ck_assert_uint_le(redactedSize, 8 + 2 + 8 + 9 * 24);
+
+    // not a trace
+    char path[32];
+    tempPath(path);
+    FILE* file = fopen(path, "wb");
+    fputs("not a trace at all", file);
+    fclose(file);
+    ck_assert_ptr_eq(0, cns_tracereader_open(cns, path));
+    ck_assert_int_eq(CNS_ERR_MALFORMED, cns_lasterr(cns));
+    unlink(path);
+    ck_assert_ptr_eq(0, cns_tracereader_open(cns, "/nonexistent/trace"));
+    ck_assert_int_eq(CNS_ERR_IO, cns_lasterr(cns));
+
+    // gets on several threads at once are all recorded, each under its thread; the gets find nothing and so allocate
+    // nothing, and the keys are made on this thread, so the test allocator need not be locked
+    cns_Storage* storage = cns_storage_newMemoryStorage(cns, 0);
+    tempPath(path);
+    cns_Trace* trace = cns_trace_start(cns, storage, path, 0);
+    pthread_t threads[GET_THREADS];
+    GetThread args[GET_THREADS];
+    for (int i = 0; i < GET_THREADS; ++i)
+    {
+        args[i].cns = cns;
+        args[i].storage = storage;
+        char buf[16];
+        sprintf(buf, "key%d", i);
+        args[i].key = bytesStr(cns, buf);
+    }
+    for (int i = 0; i < GET_THREADS; ++i)
+        ck_assert_int_eq(0, pthread_create(&threads[i], 0, getThreadMain, &args[i]));
+    for (int i = 0; i < GET_THREADS; ++i)
+    {
+        pthread_join(threads[i], 0);
+        cns_bytes_free(cns, args[i].key);
+    }
+    cns_trace_stop(cns, trace);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+
+    cns_TraceReader* reader = cns_tracereader_open(cns, path);
+    int perThread[64] = { 0 };
+    int count = 0;
+    cns_TraceRecord record;
+    while (cns_tracereader_next(cns, reader, &record))
+    {
+        ck_assert_int_eq(CNS_TRACE_GET, record.op);
+        ck_assert_uint_lt(record.thread, 64);
+        ++perThread[record.thread];
+        ++count;
+    }
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    ck_assert_int_eq(GET_THREADS * GETS_PER_THREAD, count);
+    int threadsSeen = 0;
+    for (int i = 0; i < 64; ++i)
+    {
+        if (perThread[i])
+        {
+            ck_assert_int_eq(GETS_PER_THREAD, perThread[i]);
+            ++threadsSeen;
+        }
+    }
+    ck_assert_int_eq(GET_THREADS, threadsSeen);
+    cns_tracereader_close(cns, reader);
+    unlink(path);
+    cns_storage_free(cns, storage);
+
+    ck_assert_int_eq(noleaksNumber, test_rt_allocContext.bytesAllocated);
+    cns_shutdown(cns);
+}
+END_TEST
+
+Suite* trace_suite(void)
+{
+    Suite* s = suite_create("trace");
+
+    TCase* tc = tcase_create("trace");
+    tcase_add_test(tc, test_trace);
+
+    suite_add_tcase(s, tc);
+    return s;
+}
@@ -0,0 +1,95 @@
+#include <consensual/runtime.h>
+#include <consensual/u64storage.h>
+#include <consensual/bytes.h>
+#include "alloc.h"
+
+#include <check.h>
+#include <stdint.h>
+
+START_TEST(test_u64storage)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    cns_U64Storage* storage = cns_u64storage_new(cns, 0);
+    ck_assert_ptr_ne(0, storage);
+
+    // 0 and all-ones are ordinary keys
+    const uint64_t special[] = { 0, UINT64_MAX, (uint64_t) 1 << 63 };
+    for (int i = 0; i < 3; ++i)
+    {
+        cns_Bytes* value = cns_bytes_new(cns, &special[i], sizeof(uint64_t));
+        cns_u64storage_set(cns, storage, special[i], value);
+        ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+        cns_bytes_free(cns, value);
+    }
+
+    // sequential ids grow the table several times
+    for (uint64_t key = 1; key <= 5000; ++key)
+    {
+        uint64_t content = key * 3;
+        cns_Bytes* value = cns_bytes_new(cns, &content, sizeof(content));
+        cns_u64storage_set(cns, storage, key, value);
+        cns_bytes_free(cns, value);
+    }
+    ck_assert_int_eq(5003, cns_u64storage_count(cns, storage));
+
+    cns_Bytes* value = cns_u64storage_get(cns, storage, 0);
+    ck_assert_ptr_ne(0, value);
+    ck_assert_int_eq(0, *(const uint64_t*) cns_bytes_ptr(cns, value));
+    cns_bytes_free(cns, value);
+    ck_assert_ptr_eq(0, cns_u64storage_get(cns, storage, 5001));
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+
+    // deleting every other key must keep the rest reachable after the shifts and shrinks it causes
+    for (uint64_t key = 2; key <= 5000; key += 2)
+        ck_assert_int_eq(CNS_YES, cns_u64storage_delete(cns, storage, key));
+    ck_assert_int_eq(CNS_NO, cns_u64storage_delete(cns, storage, 2));
+    for (uint64_t key = 1; key <= 5000; ++key)
+    {
+        value = cns_u64storage_get(cns, storage, key);
+        if (key % 2)
+        {
+            ck_assert_ptr_ne(0, value);
+            ck_assert_int_eq(key * 3, *(const uint64_t*) cns_bytes_ptr(cns, value));
+            cns_bytes_free(cns, value);
+        }
+        else
+            ck_assert_ptr_eq(0, value);
+    }
+    for (uint64_t key = 1; key <= 5000; key += 2)
+        cns_u64storage_delete(cns, storage, key);
+    ck_assert_int_eq(3, cns_u64storage_count(cns, storage));
+
+    value = cns_u64storage_get(cns, storage, UINT64_MAX);
+    ck_assert_int_eq(UINT64_MAX, *(const uint64_t*) cns_bytes_ptr(cns, value));
+    cns_u64storage_set(cns, storage, 0, value);
+    cns_bytes_free(cns, value);
+    value = cns_u64storage_get(cns, storage, 0);
+    ck_assert_int_eq(UINT64_MAX, *(const uint64_t*) cns_bytes_ptr(cns, value));
+    cns_bytes_free(cns, value);
+
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_u64storage_set_r(cns, storage, 1, 0));
+
+    cns_u64storage_free(cns, storage);
+
+    ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+Suite* u64storage_suite(void)
+{
+    Suite* s = suite_create("u64storage");
+
+    TCase* tc = tcase_create("u64storage");
+    tcase_add_test(tc, test_u64storage);
+
+    suite_add_tcase(s, tc);
+    return s;
+}
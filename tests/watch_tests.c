@@ -0,0 +1,260 @@
+#include <consensual/runtime.h>
+#include <consensual/watch.h>
+#include <consensual/bytes.h>
+#include "alloc.h"
+
+#include <check.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static
+cns_Bytes* str(cns_Runtime* cns, const char * s)
+{
+    return cns_bytes_new(cns, s, strlen(s));
+}
+
+static
+void set(cns_Runtime* cns, cns_Storage* storage, const char * key, const char * value)
+{
+    cns_Bytes* k = str(cns, key);
+    cns_Bytes* v = str(cns, value);
+    cns_storage_set(cns, storage, k, v);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    cns_bytes_free(cns, v);
+    cns_bytes_free(cns, k);
+}
+
+static
+void del(cns_Runtime* cns, cns_Storage* storage, const char * key)
+{
+    cns_Bytes* k = str(cns, key);
+    cns_storage_delete(cns, storage, k);
+    cns_bytes_free(cns, k);
+}
+
+static
+cns_Bool bytesIs(cns_Runtime* cns, cns_Bytes* bytes, const char * s)
+{
+    if (!bytes || !s)
+        return !bytes && !s;
+    cns_Bytes* expected = str(cns, s);
+    cns_Bool rv = cns_bytes_equal(cns, expected, bytes);
+    cns_bytes_free(cns, expected);
+    return rv;
+}
+
+static
+void checkEvent(cns_Runtime* cns, cns_WatchEvent* event, uint64_t sequence, const char * key, const char * oldValue, const char * newValue)
+{
+    ck_assert_int_eq(sequence, event->sequence);
+    ck_assert(bytesIs(cns, event->key, key));
+    ck_assert(bytesIs(cns, event->oldValue, oldValue));
+    ck_assert(bytesIs(cns, event->newValue, newValue));
+}
+
+START_TEST(test_watch)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    cns_Storage* storage = cns_storage_newMemoryStorage(cns, 0);
+    set(cns, storage, "user/1", "ann");
+    cns_Bytes* prefix = str(cns, "user/");
+    cns_Bytes* key = str(cns, "user/1");
+    cns_Watch* users = cns_watch_new(cns, storage, prefix, CNS_YES, 8);
+    ck_assert_ptr_ne(0, users);
+    cns_Watch* user1 = cns_watch_new(cns, storage, key, CNS_NO, 8);
+    ck_assert_ptr_ne(0, user1);
+    ck_assert_ptr_eq(0, cns_watch_new(cns, storage, key, CNS_NO, 0));
+    ck_assert_int_eq(CNS_ERR_BADARG, cns_lasterr(cns));
+
+    cns_WatchEvent events[16];
+    uint64_t missed = 1;
+    ck_assert_int_eq(0, cns_watch_poll(cns, users, events, 16, &missed));
+    ck_assert_int_eq(0, missed);
+
+    uint64_t sequence = cns_storage_sequence(cns, storage);
+    set(cns, storage, "user/1", "bob");
+    set(cns, storage, "user/10", "cid");
+    set(cns, storage, "group/1", "admins"); // followed by nobody
+    del(cns, storage, "user/1");
+    del(cns, storage, "user/2"); // had no value, so nothing changed
+    ck_assert_int_eq(3, cns_watch_poll(cns, users, events, 16, &missed));
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    ck_assert_int_eq(0, missed);
+    checkEvent(cns, &events[0], sequence + 1, "user/1", "ann", "bob");
+    checkEvent(cns, &events[1], sequence + 2, "user/10", 0, "cid");
+    checkEvent(cns, &events[2], sequence + 4, "user/1", "bob", 0);
+    cns_watch_releaseEvents(cns, events, 3);
+
+    // the exact key only, and polling a few at a time
+    ck_assert_int_eq(1, cns_watch_poll(cns, user1, events, 1, 0));
+    checkEvent(cns, &events[0], sequence + 1, "user/1", "ann", "bob");
+    cns_watch_releaseEvents(cns, events, 1);
+    ck_assert_int_eq(1, cns_watch_poll(cns, user1, events, 16, 0));
+    checkEvent(cns, &events[0], sequence + 4, "user/1", "bob", 0);
+    cns_watch_releaseEvents(cns, events, 1);
+
+    // the changes of a batch come together, under one sequence number
+    cns_StorageBatch* batch = cns_storagebatch_new(cns);
+    cns_Bytes* k10 = str(cns, "user/10");
+    cns_Bytes* k11 = str(cns, "user/11");
+    cns_Bytes* v = str(cns, "dan");
+    cns_storagebatch_delete(cns, batch, k10);
+    cns_storagebatch_set(cns, batch, k11, v);
+    sequence = cns_storage_sequence(cns, storage);
+    cns_storage_apply(cns, storage, batch);
+    ck_assert_int_eq(2, cns_watch_poll(cns, users, events, 16, 0));
+    checkEvent(cns, &events[0], sequence + 1, "user/10", "cid", 0);
+    checkEvent(cns, &events[1], sequence + 1, "user/11", 0, "dan");
+    cns_watch_releaseEvents(cns, events, 2);
+    cns_bytes_free(cns, v);
+    cns_bytes_free(cns, k11);
+    cns_bytes_free(cns, k10);
+    cns_storagebatch_free(cns, batch);
+
+    // a slow consumer misses what does not fit, and the writer goes on
+    for (int i = 0; i < 20; ++i)
+    {
+        char buf[16];
+        sprintf(buf, "%d", i);
+        set(cns, storage, "user/3", buf);
+    }
+    ck_assert_int_eq(8, cns_watch_poll(cns, users, events, 16, &missed));
+    ck_assert_int_eq(12, missed);
+    checkEvent(cns, &events[7], events[0].sequence + 7, "user/3", "6", "7");
+    cns_watch_releaseEvents(cns, events, 8);
+    ck_assert_int_eq(0, cns_watch_poll(cns, users, events, 16, &missed));
+    ck_assert_int_eq(0, missed);
+
+    // consumers see values as given, even when stored compressed
+    cns_storage_setCompression(cns, storage, 64, 0);
+    char document[1000];
+    memset(document, 'x', sizeof(document) - 1);
+    document[sizeof(document) - 1] = 0;
+    set(cns, storage, "user/4", document);
+    set(cns, storage, "user/4", "short");
+    ck_assert_int_eq(2, cns_watch_poll(cns, users, events, 16, 0));
+    checkEvent(cns, &events[0], events[0].sequence, "user/4", 0, document);
+    checkEvent(cns, &events[1], events[0].sequence + 1, "user/4", document, "short");
+    cns_watch_releaseEvents(cns, events, 2);
+
+    // events not polled go with the watch
+    set(cns, storage, "user/5", "eve");
+    cns_watch_free(cns, user1);
+    cns_watch_free(cns, users);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    set(cns, storage, "user/6", "fay");
+
+    cns_bytes_free(cns, key);
+    cns_bytes_free(cns, prefix);
+    cns_storage_free(cns, storage);
+
+    ck_assert_int_eq(noleaksNumber, test_rt_allocContext.bytesAllocated);
+    cns_shutdown(cns);
+}
+END_TEST
+
+enum { THREAD_WRITES = 20000, THREAD_CAPACITY = 64 };
+
+typedef struct Consumer
+{
+    cns_Runtime*    cns;
+    cns_Watch*      watch;
+    cns_WatchEvent* events; // kept, since the test allocator may only be used by the writing thread
+    cns_Index       count;
+    uint64_t        missed;
+    _Atomic int     stop;
+} Consumer;
+
+static
+void* consume(void* arg)
+{
+    Consumer* consumer = (Consumer*) arg;
+    for (;;)
+    {
+        int stop = atomic_load(&consumer->stop);
+        uint64_t missed = 0;
+        cns_Index count = 0;
+        ck_assert_int_eq(CNS_OK, cns_watch_poll_r(consumer->cns, consumer->watch, consumer->events + consumer->count, THREAD_CAPACITY, &count, &missed));
+        consumer->count += count;
+        consumer->missed += missed;
+        if (stop && !count)
+            return 0;
+    }
+}
+
+START_TEST(test_watch_threads)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    cns_Storage* storage = cns_storage_newMemoryStorage(cns, 0);
+    cns_Bytes* key = str(cns, "counter");
+    Consumer consumer = { .cns = cns, .count = 0, .missed = 0 };
+    atomic_init(&consumer.stop, 0);
+    consumer.watch = cns_watch_new(cns, storage, key, CNS_NO, THREAD_CAPACITY);
+    consumer.events = malloc(THREAD_WRITES * sizeof(cns_WatchEvent));
+    cns_Bytes** values = malloc(THREAD_WRITES * sizeof(cns_Bytes*));
+    for (int i = 0; i < THREAD_WRITES; ++i)
+    {
+        char buf[16];
+        sprintf(buf, "%d", i);
+        values[i] = str(cns, buf);
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, 0, consume, &consumer);
+    for (int i = 0; i < THREAD_WRITES; ++i)
+        cns_storage_set(cns, storage, key, values[i]);
+    atomic_store(&consumer.stop, 1);
+    pthread_join(thread, 0);
+
+    // every write was either delivered, in order and intact, or counted as missed
+    ck_assert_int_eq(THREAD_WRITES, consumer.count + (cns_Index) consumer.missed);
+    for (cns_Index i = 0; i < consumer.count; ++i)
+    {
+        cns_WatchEvent* event = &consumer.events[i];
+        if (i)
+            ck_assert_uint_gt(event->sequence, consumer.events[i - 1].sequence);
+        ck_assert(event->newValue == values[event->sequence - 1]);
+        if (event->sequence > 1)
+            ck_assert(event->oldValue == values[event->sequence - 2]);
+    }
+    cns_watch_releaseEvents(cns, consumer.events, consumer.count);
+
+    cns_watch_free(cns, consumer.watch);
+    for (int i = 0; i < THREAD_WRITES; ++i)
+        cns_bytes_free(cns, values[i]);
+    free(values);
+    free(consumer.events);
+    cns_bytes_free(cns, key);
+    cns_storage_free(cns, storage);
+
+    ck_assert_int_eq(noleaksNumber, test_rt_allocContext.bytesAllocated);
+    cns_shutdown(cns);
+}
+END_TEST
+
+Suite* watch_suite(void)
+{
+    Suite* s = suite_create("watch");
+
+    TCase* tc = tcase_create("watch");
+    tcase_add_test(tc, test_watch);
+    tcase_add_test(tc, test_watch_threads);
+
+    suite_add_tcase(s, tc);
+    return s;
+}
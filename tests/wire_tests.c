@@ -0,0 +1,167 @@
+#include <consensual/runtime.h>
+#include <consensual/bytes.h>
+#include <consensual/wire.h>
+#include <check.h>
+
+#include <string.h>
+
+#include "alloc.h"
+
+START_TEST(test_varint)
+{
+    uint64_t values[] = { 0, 1, 127, 128, 300, 16383, 16384, 0xffffffffull, 0x7fffffffffffffffull, 0xffffffffffffffffull };
+    cns_Index sizes[] = { 1, 1, 1, 2, 2, 2, 3, 5, 9, 10 };
+    for (int i = 0; i < (int) (sizeof(values) / sizeof(values[0])); ++i)
+    {
+        uint8_t buf[CNS_WIRE_MAXVARINT];
+        cns_Index n = cns_wire_encodeVarint(values[i], buf);
+        ck_assert_int_eq(sizes[i], n);
+
+        uint64_t decoded = 0;
+        ck_assert_int_eq(n, cns_wire_decodeVarint(buf, n, &decoded));
+        ck_assert(values[i] == decoded);
+
+        // truncated input
+        ck_assert_int_eq(0, cns_wire_decodeVarint(buf, n - 1, &decoded));
+    }
+
+    // overlong: 10th byte carries more than the top bit
+    uint8_t overlong[CNS_WIRE_MAXVARINT] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x02 };
+    uint64_t decoded = 0;
+    ck_assert_int_eq(0, cns_wire_decodeVarint(overlong, sizeof(overlong), &decoded));
+}
+END_TEST
+
+START_TEST(test_wire)
+{
+    struct TestRTAllocContext test_rt_allocContext = {
+        .bytesAllocated = 0,
+    };
+    cns_Runtime* cns = cns_startup(test_rt_alloc, test_rt_free, test_rt_realloc, &test_rt_allocContext);
+
+    const int noleaksNumber = test_rt_allocContext.bytesAllocated;
+
+    char big[1000];
+    for (int i = 0; i < (int) sizeof(big); ++i)
+        big[i] = (char) i;
+
+    cns_Bytes* small = cns_bytes_new(cns, "key", 3);
+    cns_Bytes* large = cns_bytes_new(cns, big, sizeof(big));
+
+    cns_WireWriter* writer = cns_wirewriter_new(cns);
+    ck_assert_ptr_ne(0, writer);
+    cns_wirewriter_putVarint(cns, writer, 42);
+    cns_wirewriter_putBytes(cns, writer, small);
+    cns_wirewriter_putBytes(cns, writer, large);
+    cns_wirewriter_putRaw(cns, writer, "", 0);
+    cns_wirewriter_putVarint(cns, writer, 100500);
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+
+    // the writer holds its own references
+    cns_bytes_free(cns, small);
+    cns_Bytes* largeCopy = cns_bytes_copy(cns, large);
+    cns_bytes_free(cns, large);
+
+    cns_Index expectedLength = 1 + (1 + 3) + (2 + 1000) + 1 + 3;
+    ck_assert_int_eq(expectedLength, cns_wirewriter_length(cns, writer));
+
+    // the large payload is referenced, not copied: header run, payload, trailing run
+    int count = 0;
+    const struct iovec * iov = cns_wirewriter_iov(cns, writer, &count);
+    ck_assert_ptr_ne(0, iov);
+    ck_assert_int_eq(3, count);
+    ck_assert_ptr_eq(cns_bytes_ptr(cns, largeCopy), iov[1].iov_base);
+    cns_Index total = 0;
+    for (int i = 0; i < count; ++i)
+        total += iov[i].iov_len;
+    ck_assert_int_eq(expectedLength, total);
+
+    cns_Bytes* message = cns_wirewriter_toBytes(cns, writer);
+    ck_assert_ptr_ne(0, message);
+    ck_assert_int_eq(expectedLength, cns_bytes_length(cns, message));
+    cns_wirewriter_free(cns, writer);
+
+    cns_WireReader* reader = cns_wirereader_new(cns, message);
+    cns_bytes_free(cns, message); // the reader holds a reference
+
+    uint64_t value = 0;
+    ck_assert_int_eq(CNS_YES, cns_wirereader_getVarint(cns, reader, &value));
+    ck_assert(42 == value);
+
+    cns_Bytes* field = cns_wirereader_getBytes(cns, reader);
+    ck_assert_int_eq(3, cns_bytes_length(cns, field));
+    ck_assert_int_eq(0, memcmp("key", cns_bytes_ptr(cns, field), 3));
+    cns_bytes_free(cns, field);
+
+    field = cns_wirereader_getBytes(cns, reader);
+    ck_assert_int_eq(CNS_YES, cns_bytes_equal(cns, field, largeCopy));
+    cns_Bytes* keepAlive = field; // slice must survive the reader and the message
+
+    field = cns_wirereader_getBytes(cns, reader);
+    ck_assert_ptr_ne(0, field);
+    ck_assert_int_eq(0, cns_bytes_length(cns, field));
+    cns_bytes_free(cns, field);
+
+    ck_assert_int_eq(CNS_YES, cns_wirereader_getVarint(cns, reader, &value));
+    ck_assert(100500 == value);
+
+    ck_assert_int_eq(0, cns_wirereader_remaining(cns, reader));
+    ck_assert_int_eq(CNS_NO, cns_wirereader_getVarint(cns, reader, &value));
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    ck_assert_ptr_eq(0, cns_wirereader_getBytes(cns, reader));
+    ck_assert_int_eq(CNS_OK, cns_lasterr(cns));
+    cns_wirereader_free(cns, reader);
+
+    ck_assert_int_eq(CNS_YES, cns_bytes_equal(cns, keepAlive, largeCopy));
+    cns_bytes_free(cns, keepAlive);
+    cns_bytes_free(cns, largeCopy);
+
+    // length prefix pointing past the end
+    uint8_t truncated[] = { 5, 'a', 'b' };
+    message = cns_bytes_new(cns, truncated, sizeof(truncated));
+    reader = cns_wirereader_new(cns, message);
+    ck_assert_ptr_eq(0, cns_wirereader_getBytes(cns, reader));
+    ck_assert_int_eq(CNS_ERR_MALFORMED, cns_lasterr(cns));
+    ck_assert_int_eq(3, cns_wirereader_remaining(cns, reader));
+    cns_wirereader_free(cns, reader);
+    cns_bytes_free(cns, message);
+
+    // a concatenation is written piece by piece, each piece its own iovec entry
+    cns_Bytes* first = cns_bytes_new(cns, big, 600);
+    cns_Bytes* second = cns_bytes_new(cns, big + 600, 400);
+    cns_Bytes* joined = cns_bytes_concat(cns, first, second);
+    writer = cns_wirewriter_new(cns);
+    cns_wirewriter_putBytes(cns, writer, joined);
+    iov = cns_wirewriter_iov(cns, writer, &count);
+    ck_assert_int_eq(3, count);
+    ck_assert_ptr_eq(cns_bytes_ptr(cns, first), iov[1].iov_base);
+    ck_assert_ptr_eq(cns_bytes_ptr(cns, second), iov[2].iov_base);
+    message = cns_wirewriter_toBytes(cns, writer);
+    cns_wirewriter_free(cns, writer);
+    reader = cns_wirereader_new(cns, message);
+    field = cns_wirereader_getBytes(cns, reader);
+    ck_assert_int_eq(CNS_YES, cns_bytes_equal(cns, joined, field));
+    cns_bytes_free(cns, field);
+    cns_wirereader_free(cns, reader);
+    cns_bytes_free(cns, message);
+    cns_bytes_free(cns, joined);
+    cns_bytes_free(cns, first);
+    cns_bytes_free(cns, second);
+
+    ck_assert_int_eq( noleaksNumber, test_rt_allocContext.bytesAllocated );
+
+    cns_shutdown(cns);
+}
+END_TEST
+
+Suite* wire_suite(void)
+{
+    Suite* s = suite_create("wire");
+
+    TCase* tc = tcase_create("wire");
+    tcase_add_test(tc, test_varint);
+    tcase_add_test(tc, test_wire);
+
+    suite_add_tcase(s, tc);
+    return s;
+}